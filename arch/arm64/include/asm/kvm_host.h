@@ -449,6 +449,7 @@ void vcpu_write_sys_reg(struct kvm_vcpu *vcpu, u64 val, int reg);
 
 struct kvm_vm_stat {
 	ulong remote_tlb_flush;
+	ulong irqfd_inject_deferred;
 };
 
 struct kvm_vcpu_stat {
@@ -458,6 +459,7 @@ struct kvm_vcpu_stat {
 	u64 halt_poll_fail_ns;
 	u64 halt_poll_invalid;
 	u64 halt_wakeup;
+	u64 halt_wakeup_coalesced;
 	u64 hvc_exit_stat;
 	u64 wfe_exit_stat;
 	u64 wfi_exit_stat;
@@ -185,6 +185,7 @@ struct kvm_vcpu_stat {
 	u64 halt_poll_fail_ns;
 	u64 halt_poll_invalid;
 	u64 halt_wakeup;
+	u64 halt_wakeup_coalesced;
 };
 
 struct kvm_arch_memory_slot {
@@ -89,6 +89,7 @@ struct kvm_nested_guest;
 
 struct kvm_vm_stat {
 	ulong remote_tlb_flush;
+	ulong irqfd_inject_deferred;
 	ulong num_2M_pages;
 	ulong num_1G_pages;
 };
@@ -117,6 +118,7 @@ struct kvm_vcpu_stat {
 	u64 halt_successful_wait;
 	u64 halt_poll_invalid;
 	u64 halt_wakeup;
+	u64 halt_wakeup_coalesced;
 	u64 dbell_exits;
 	u64 gdbell_exits;
 	u64 ld;
@@ -376,6 +376,7 @@ struct kvm_vcpu_stat {
 	u64 halt_poll_invalid;
 	u64 halt_no_poll_steal;
 	u64 halt_wakeup;
+	u64 halt_wakeup_coalesced;
 	u64 halt_poll_success_ns;
 	u64 halt_poll_fail_ns;
 	u64 instruction_lctl;
@@ -756,6 +757,7 @@ struct kvm_vm_stat {
 	u64 inject_service_signal;
 	u64 inject_virtio;
 	u64 remote_tlb_flush;
+	u64 irqfd_inject_deferred;
 };
 
 struct kvm_arch_memory_slot {
@@ -96,6 +96,7 @@ asmlinkage void aesni_cbc_dec(struct crypto_aes_ctx *ctx, u8 *out,
 
 #define AVX_GEN2_OPTSIZE 640
 #define AVX_GEN4_OPTSIZE 4096
+#define AVX512_OPTSIZE 256
 
 #ifdef CONFIG_X86_64
 
@@ -275,6 +276,172 @@ static const struct aesni_gcm_tfm_s aesni_gcm_tfm_avx_gen4 = {
 	.finalize = &aesni_gcm_finalize_avx_gen4,
 };
 
+#ifdef CONFIG_AS_AVX512
+/*
+ * The VAES/VPCLMULQDQ functions only process whole blocks, the partial
+ * blocks are handled here: the keystream of a partial block is kept in
+ * partial_block_enc_key and its ciphertext is xor'ed into aad_hash, while
+ * multiplying aad_hash by H is deferred until the block is complete.
+ */
+asmlinkage void aes_gcm_precompute_avx512(struct gcm_context_data *gdata,
+					  const u8 *hash_subkey);
+asmlinkage void aes_gcm_ghash_avx512(struct gcm_context_data *gdata,
+				     const u8 *data, unsigned long len);
+asmlinkage void aes_gcm_enc_update_avx512(void *ctx,
+					  struct gcm_context_data *gdata,
+					  u8 *out, const u8 *in,
+					  unsigned long len);
+asmlinkage void aes_gcm_dec_update_avx512(void *ctx,
+					  struct gcm_context_data *gdata,
+					  u8 *out, const u8 *in,
+					  unsigned long len);
+
+static const u8 aesni_gcm_zero_block[GCM_BLOCK_LEN];
+
+static void aesni_gcm_init_avx512(void *ctx, struct gcm_context_data *gdata,
+				  u8 *iv, u8 *hash_subkey, const u8 *aad,
+				  unsigned long aad_len)
+{
+	unsigned long full = aad_len & AES_BLOCK_MASK;
+	u8 block[GCM_BLOCK_LEN] = {};
+
+	aes_gcm_precompute_avx512(gdata, hash_subkey);
+
+	memset(gdata->aad_hash, 0, GCM_BLOCK_LEN);
+	aes_gcm_ghash_avx512(gdata, aad, full);
+	if (aad_len != full) {
+		memcpy(block, aad + full, aad_len - full);
+		aes_gcm_ghash_avx512(gdata, block, GCM_BLOCK_LEN);
+	}
+
+	gdata->aad_length = aad_len;
+	gdata->in_length = 0;
+	gdata->partial_block_len = 0;
+	memcpy(gdata->orig_IV, iv, GCM_BLOCK_LEN);
+	memcpy(gdata->current_counter, iv, GCM_BLOCK_LEN);
+	be32_add_cpu((__be32 *)&gdata->current_counter[12], 1);
+}
+
+/* Returns the number of bytes consumed from @in. */
+static unsigned long aesni_gcm_partial_avx512(bool enc,
+					      struct gcm_context_data *gdata,
+					      u8 *out, const u8 *in,
+					      unsigned long len)
+{
+	unsigned long pos = gdata->partial_block_len, i;
+
+	for (i = 0; i < len && pos < GCM_BLOCK_LEN; i++, pos++) {
+		u8 c = enc ? in[i] ^ gdata->partial_block_enc_key[pos] : in[i];
+
+		out[i] = in[i] ^ gdata->partial_block_enc_key[pos];
+		gdata->aad_hash[pos] ^= c;
+	}
+
+	if (pos == GCM_BLOCK_LEN) {
+		aes_gcm_ghash_avx512(gdata, aesni_gcm_zero_block,
+				     GCM_BLOCK_LEN);
+		pos = 0;
+	}
+	gdata->partial_block_len = pos;
+
+	return i;
+}
+
+static void aesni_gcm_update_avx512(bool enc, void *ctx,
+				    struct gcm_context_data *gdata, u8 *out,
+				    const u8 *in, unsigned long len)
+{
+	unsigned long n;
+
+	gdata->in_length += len;
+
+	if (gdata->partial_block_len) {
+		n = aesni_gcm_partial_avx512(enc, gdata, out, in, len);
+		out += n;
+		in += n;
+		len -= n;
+	}
+
+	n = len & AES_BLOCK_MASK;
+	if (n) {
+		if (enc)
+			aes_gcm_enc_update_avx512(ctx, gdata, out, in, n);
+		else
+			aes_gcm_dec_update_avx512(ctx, gdata, out, in, n);
+		out += n;
+		in += n;
+		len -= n;
+	}
+
+	if (len) {
+		aesni_enc(ctx, gdata->partial_block_enc_key,
+			  gdata->current_counter);
+		be32_add_cpu((__be32 *)&gdata->current_counter[12], 1);
+		aesni_gcm_partial_avx512(enc, gdata, out, in, len);
+	}
+}
+
+static void aesni_gcm_enc_update_avx512(void *ctx,
+					struct gcm_context_data *gdata,
+					u8 *out, const u8 *in,
+					unsigned long plaintext_len)
+{
+	aesni_gcm_update_avx512(true, ctx, gdata, out, in, plaintext_len);
+}
+
+static void aesni_gcm_dec_update_avx512(void *ctx,
+					struct gcm_context_data *gdata,
+					u8 *out, const u8 *in,
+					unsigned long ciphertext_len)
+{
+	aesni_gcm_update_avx512(false, ctx, gdata, out, in, ciphertext_len);
+}
+
+static void aesni_gcm_finalize_avx512(void *ctx,
+				      struct gcm_context_data *gdata,
+				      u8 *auth_tag, unsigned long auth_tag_len)
+{
+	__be64 lengths[2] = {
+		cpu_to_be64(gdata->aad_length * 8),
+		cpu_to_be64(gdata->in_length * 8),
+	};
+	u8 tag[GCM_BLOCK_LEN];
+
+	if (gdata->partial_block_len)
+		aes_gcm_ghash_avx512(gdata, aesni_gcm_zero_block,
+				     GCM_BLOCK_LEN);
+	aes_gcm_ghash_avx512(gdata, (u8 *)lengths, sizeof(lengths));
+
+	aesni_enc(ctx, tag, gdata->orig_IV);
+	crypto_xor_cpy(auth_tag, tag, gdata->aad_hash, auth_tag_len);
+	memzero_explicit(tag, sizeof(tag));
+}
+
+static const struct aesni_gcm_tfm_s aesni_gcm_tfm_avx512 = {
+	.init = &aesni_gcm_init_avx512,
+	.enc_update = &aesni_gcm_enc_update_avx512,
+	.dec_update = &aesni_gcm_dec_update_avx512,
+	.finalize = &aesni_gcm_finalize_avx512,
+};
+
+static bool __init aesni_gcm_avx512_usable(void)
+{
+	return boot_cpu_has(X86_FEATURE_VAES) &&
+	       boot_cpu_has(X86_FEATURE_VPCLMULQDQ) &&
+	       boot_cpu_has(X86_FEATURE_AVX512BW) &&
+	       boot_cpu_has(X86_FEATURE_AVX512VL) &&
+	       cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM |
+				 XFEATURE_MASK_AVX512, NULL);
+}
+#else
+static const struct aesni_gcm_tfm_s aesni_gcm_tfm_avx512;
+
+static inline bool aesni_gcm_avx512_usable(void)
+{
+	return false;
+}
+#endif
+
 static inline struct
 aesni_rfc4106_gcm_ctx *aesni_rfc4106_gcm_ctx_get(struct crypto_aead *tfm)
 {
@@ -703,6 +870,8 @@ static int gcmaes_crypt_by_sg(bool enc, struct aead_request *req,
 	if (!enc)
 		left -= auth_tag_len;
 
+	if (left < AVX512_OPTSIZE && gcm_tfm == &aesni_gcm_tfm_avx512)
+		gcm_tfm = &aesni_gcm_tfm_avx_gen4;
 	if (left < AVX_GEN4_OPTSIZE && gcm_tfm == &aesni_gcm_tfm_avx_gen4)
 		gcm_tfm = &aesni_gcm_tfm_avx_gen2;
 	if (left < AVX_GEN2_OPTSIZE && gcm_tfm == &aesni_gcm_tfm_avx_gen2)
@@ -1064,11 +1233,13 @@ static int __init aesni_init(void)
 	if (!x86_match_cpu(aesni_cpu_id))
 		return -ENODEV;
 #ifdef CONFIG_X86_64
-	if (boot_cpu_has(X86_FEATURE_AVX2)) {
+	if (aesni_gcm_avx512_usable()) {
+		pr_info("AVX-512 VAES version of gcm_enc/dec engaged.\n");
+		aesni_gcm_tfm = &aesni_gcm_tfm_avx512;
+	} else if (boot_cpu_has(X86_FEATURE_AVX2)) {
 		pr_info("AVX2 version of gcm_enc/dec engaged.\n");
 		aesni_gcm_tfm = &aesni_gcm_tfm_avx_gen4;
-	} else
-	if (boot_cpu_has(X86_FEATURE_AVX)) {
+	} else if (boot_cpu_has(X86_FEATURE_AVX)) {
 		pr_info("AVX version of gcm_enc/dec engaged.\n");
 		aesni_gcm_tfm = &aesni_gcm_tfm_avx_gen2;
 	} else {
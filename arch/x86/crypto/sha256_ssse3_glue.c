@@ -314,12 +314,91 @@ static int sha256_ni_final(struct shash_desc *desc, u8 *out)
 	return sha256_ni_finup(desc, NULL, 0, out);
 }
 
+asmlinkage void sha256_ni_transform_2x(struct sha256_state *digest_a,
+				       struct sha256_state *digest_b,
+				       const u8 *data_a, const u8 *data_b,
+				       int rounds);
+
+/*
+ * Finish two messages of @len bytes from the state in @desc.  Padding and
+ * partial blocks are staged in on-stack buffers so that every block of
+ * both messages goes through sha256_ni_transform_2x().
+ */
+static int sha256_ni_finup_mb(struct shash_desc *desc,
+			      const u8 * const data[], unsigned int len,
+			      u8 * const outs[], unsigned int num_msgs)
+{
+	struct sha256_state *sctx = shash_desc_ctx(desc);
+	unsigned int digestsize = crypto_shash_digestsize(desc->tfm);
+	unsigned int partial = sctx->count % SHA256_BLOCK_SIZE;
+	u8 final_a[2 * SHA256_BLOCK_SIZE], final_b[2 * SHA256_BLOCK_SIZE];
+	__be64 bits = cpu_to_be64((sctx->count + len) << 3);
+	struct sha256_state a, b;
+	unsigned int off = 0, n, i;
+
+	if (num_msgs != 2 || !crypto_simd_usable())
+		return -EOPNOTSUPP;
+
+	a = *sctx;
+	b = *sctx;
+
+	kernel_fpu_begin();
+
+	if (partial && partial + len >= SHA256_BLOCK_SIZE) {
+		off = SHA256_BLOCK_SIZE - partial;
+		memcpy(a.buf + partial, data[0], off);
+		memcpy(b.buf + partial, data[1], off);
+		sha256_ni_transform_2x(&a, &b, a.buf, b.buf, 1);
+		partial = 0;
+	}
+
+	n = (len - off) / SHA256_BLOCK_SIZE;
+	if (n) {
+		sha256_ni_transform_2x(&a, &b, data[0] + off, data[1] + off, n);
+		off += n * SHA256_BLOCK_SIZE;
+	}
+
+	/* What is left fits in the buffered bytes' block, plus padding. */
+	memset(final_a, 0, sizeof(final_a));
+	memset(final_b, 0, sizeof(final_b));
+	memcpy(final_a, a.buf, partial);
+	memcpy(final_b, b.buf, partial);
+	memcpy(final_a + partial, data[0] + off, len - off);
+	memcpy(final_b + partial, data[1] + off, len - off);
+	partial += len - off;
+	final_a[partial] = 0x80;
+	final_b[partial] = 0x80;
+	n = partial < SHA256_BLOCK_SIZE - sizeof(bits) ? 1 : 2;
+	memcpy(final_a + n * SHA256_BLOCK_SIZE - sizeof(bits), &bits,
+	       sizeof(bits));
+	memcpy(final_b + n * SHA256_BLOCK_SIZE - sizeof(bits), &bits,
+	       sizeof(bits));
+	sha256_ni_transform_2x(&a, &b, final_a, final_b, n);
+
+	kernel_fpu_end();
+
+	for (i = 0; i < digestsize / sizeof(__be32); i++) {
+		put_unaligned_be32(a.state[i], outs[0] + i * sizeof(__be32));
+		put_unaligned_be32(b.state[i], outs[1] + i * sizeof(__be32));
+	}
+
+	memzero_explicit(&a, sizeof(a));
+	memzero_explicit(&b, sizeof(b));
+	memzero_explicit(final_a, sizeof(final_a));
+	memzero_explicit(final_b, sizeof(final_b));
+	memzero_explicit(sctx, sizeof(*sctx));
+
+	return 0;
+}
+
 static struct shash_alg sha256_ni_algs[] = { {
 	.digestsize	=	SHA256_DIGEST_SIZE,
 	.init		=	sha256_base_init,
 	.update		=	sha256_ni_update,
 	.final		=	sha256_ni_final,
 	.finup		=	sha256_ni_finup,
+	.finup_mb	=	sha256_ni_finup_mb,
+	.mb_max_msgs	=	2,
 	.descsize	=	sizeof(struct sha256_state),
 	.base		=	{
 		.cra_name	=	"sha256",
@@ -334,6 +413,8 @@ static struct shash_alg sha256_ni_algs[] = { {
 	.update		=	sha256_ni_update,
 	.final		=	sha256_ni_final,
 	.finup		=	sha256_ni_finup,
+	.finup_mb	=	sha256_ni_finup_mb,
+	.mb_max_msgs	=	2,
 	.descsize	=	sizeof(struct sha256_state),
 	.base		=	{
 		.cra_name	=	"sha224",
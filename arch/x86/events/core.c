@@ -172,6 +172,7 @@ static int x86_pmu_extra_regs(u64 config, struct perf_event *event)
 
 static atomic_t active_events;
 static atomic_t pmc_refcount;
+static atomic_t guest_pmu_owners;
 static DEFINE_MUTEX(pmc_reserve_mutex);
 
 #ifdef CONFIG_X86_LOCAL_APIC
@@ -395,6 +396,35 @@ void x86_release_hardware(void)
 	}
 }
 
+/*
+ * Give the counters to a guest that loads its own values into them, as KVM's
+ * PMU pass-through does.  perf can't share the counters with such a guest, so
+ * this fails while perf has events, and no event can be created until the
+ * guest releases the PMU.
+ */
+int perf_guest_reserve_pmu(void)
+{
+	if (!x86_pmu_initialized())
+		return -ENODEV;
+
+	atomic_inc(&guest_pmu_owners);
+	/* Pairs with the barrier in __x86_pmu_event_init(). */
+	smp_mb__after_atomic();
+	if (atomic_read(&active_events)) {
+		atomic_dec(&guest_pmu_owners);
+		return -EBUSY;
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(perf_guest_reserve_pmu);
+
+void perf_guest_release_pmu(void)
+{
+	atomic_dec(&guest_pmu_owners);
+}
+EXPORT_SYMBOL_GPL(perf_guest_release_pmu);
+
 /*
  * Check if we can create event of a certain type (that no conflicting events
  * are present).
@@ -633,6 +663,11 @@ static int __x86_pmu_event_init(struct perf_event *event)
 	atomic_inc(&active_events);
 	event->destroy = hw_perf_event_destroy;
 
+	/* Pairs with the barrier in perf_guest_reserve_pmu(). */
+	smp_mb__after_atomic();
+	if (atomic_read(&guest_pmu_owners))
+		return -EBUSY;
+
 	event->hw.idx = -1;
 	event->hw.last_cpu = -1;
 	event->hw.last_tag = ~0ULL;
@@ -2753,5 +2788,6 @@ void perf_get_x86_pmu_capability(struct x86_pmu_capability *cap)
 	cap->bit_width_fixed	= x86_pmu.cntval_bits;
 	cap->events_mask	= (unsigned int)x86_pmu.events_maskl;
 	cap->events_mask_len	= x86_pmu.events_mask_len;
+	cap->pebs_ept		= x86_pmu.pebs_ept;
 }
 EXPORT_SYMBOL_GPL(perf_get_x86_pmu_capability);
@@ -2581,6 +2581,38 @@ static void intel_pmu_reset(void)
 	local_irq_restore(flags);
 }
 
+/*
+ * The buffer overflow of a guest's PEBS counters happens in its own DS area,
+ * where drain_pebs() doesn't look. Signal it with an overflow of one of the
+ * guest's events, which KVM turns into a PEBS PMI for the guest.
+ */
+static void intel_pmu_handle_guest_pebs(struct pt_regs *regs,
+					struct perf_sample_data *data)
+{
+	struct cpu_hw_events *cpuc = this_cpu_ptr(&cpu_hw_events);
+	u64 guest_pebs_idx_mask = cpuc->pebs_enabled & ~cpuc->intel_ctrl_host_mask;
+	struct perf_event *event;
+	int bit;
+
+	if (!x86_pmu.pebs_ept || !x86_pmu.pebs_active || !guest_pebs_idx_mask ||
+	    !perf_guest_cbs || !perf_guest_cbs->is_in_guest())
+		return;
+
+	for_each_set_bit(bit, (unsigned long *)&guest_pebs_idx_mask,
+			 INTEL_PMC_IDX_FIXED + x86_pmu.num_counters_fixed) {
+		event = cpuc->events[bit];
+		if (!event || !event->attr.precise_ip)
+			continue;
+
+		perf_sample_data_init(data, 0, event->hw.last_period);
+		if (perf_event_overflow(event, data, regs))
+			x86_pmu_stop(event, 0);
+
+		/* A single overflow is enough to raise the guest's PMI. */
+		break;
+	}
+}
+
 static int handle_pmi_common(struct pt_regs *regs, u64 status)
 {
 	struct perf_sample_data data;
@@ -2631,6 +2663,7 @@ static int handle_pmi_common(struct pt_regs *regs, u64 status)
 		u64 pebs_enabled = cpuc->pebs_enabled;
 
 		handled++;
+		intel_pmu_handle_guest_pebs(regs, &data);
 		x86_pmu.drain_pebs(regs, &data);
 		status &= x86_pmu.intel_ctrl | GLOBAL_STATUS_TRACE_TOPAPMI;
 
@@ -3668,29 +3701,34 @@ static int intel_pmu_hw_config(struct perf_event *event)
 }
 
 #ifdef CONFIG_RETPOLINE
-static struct perf_guest_switch_msr *core_guest_get_msrs(int *nr);
-static struct perf_guest_switch_msr *intel_guest_get_msrs(int *nr);
+static struct perf_guest_switch_msr *
+core_guest_get_msrs(int *nr, struct x86_guest_pebs *pebs);
+static struct perf_guest_switch_msr *
+intel_guest_get_msrs(int *nr, struct x86_guest_pebs *pebs);
 #endif
 
-struct perf_guest_switch_msr *perf_guest_get_msrs(int *nr)
+struct perf_guest_switch_msr *perf_guest_get_msrs(int *nr,
+						  struct x86_guest_pebs *pebs)
 {
 #ifdef CONFIG_RETPOLINE
 	if (x86_pmu.guest_get_msrs == intel_guest_get_msrs)
-		return intel_guest_get_msrs(nr);
+		return intel_guest_get_msrs(nr, pebs);
 	else if (x86_pmu.guest_get_msrs == core_guest_get_msrs)
-		return core_guest_get_msrs(nr);
+		return core_guest_get_msrs(nr, pebs);
 #endif
 	if (x86_pmu.guest_get_msrs)
-		return x86_pmu.guest_get_msrs(nr);
+		return x86_pmu.guest_get_msrs(nr, pebs);
 	*nr = 0;
 	return NULL;
 }
 EXPORT_SYMBOL_GPL(perf_guest_get_msrs);
 
-static struct perf_guest_switch_msr *intel_guest_get_msrs(int *nr)
+static struct perf_guest_switch_msr *
+intel_guest_get_msrs(int *nr, struct x86_guest_pebs *pebs)
 {
 	struct cpu_hw_events *cpuc = this_cpu_ptr(&cpu_hw_events);
 	struct perf_guest_switch_msr *arr = cpuc->guest_switch_msrs;
+	u64 guest_pebs;
 
 	arr[0].msr = MSR_CORE_PERF_GLOBAL_CTRL;
 	arr[0].host = x86_pmu.intel_ctrl & ~cpuc->intel_ctrl_guest_mask;
@@ -3714,12 +3752,53 @@ static struct perf_guest_switch_msr *intel_guest_get_msrs(int *nr)
 		arr[1].host = cpuc->pebs_enabled;
 		arr[1].guest = 0;
 		*nr = 2;
+		return arr;
+	}
+
+	if (!pebs || !x86_pmu.pebs || !x86_pmu.pebs_ept)
+		return arr;
+
+	/*
+	 * The guest's PEBS counters are host events that exclude the host.
+	 * With EPT-friendly PEBS, their records go to the guest's DS area,
+	 * through the guest's page tables.
+	 */
+	arr[*nr].msr = MSR_IA32_DS_AREA;
+	arr[*nr].host = (unsigned long)cpuc->ds;
+	arr[*nr].guest = pebs->ds_area;
+	(*nr)++;
+
+	if (x86_pmu.intel_cap.pebs_baseline) {
+		arr[*nr].msr = MSR_PEBS_DATA_CFG;
+		arr[*nr].host = cpuc->pebs_data_cfg;
+		arr[*nr].guest = pebs->data_cfg;
+		(*nr)++;
 	}
 
+	arr[*nr].msr = MSR_IA32_PEBS_ENABLE;
+	arr[*nr].host = cpuc->pebs_enabled & ~cpuc->intel_ctrl_guest_mask;
+	guest_pebs = cpuc->pebs_enabled & ~cpuc->intel_ctrl_host_mask;
+
+	/*
+	 * The records of the host's PEBS events can't go to the guest's DS
+	 * area, and those of counters that the guest knows under another
+	 * index would be misattributed: disable guest PEBS in both cases.
+	 */
+	if (arr[*nr].host)
+		guest_pebs = 0;
+	else
+		guest_pebs &= ~pebs->cross_mapped_mask;
+	arr[*nr].guest = guest_pebs;
+	(*nr)++;
+
+	/* The guest's PEBS counters run while it does. */
+	arr[0].guest |= guest_pebs;
+
 	return arr;
 }
 
-static struct perf_guest_switch_msr *core_guest_get_msrs(int *nr)
+static struct perf_guest_switch_msr *
+core_guest_get_msrs(int *nr, struct x86_guest_pebs *pebs)
 {
 	struct cpu_hw_events *cpuc = this_cpu_ptr(&cpu_hw_events);
 	struct perf_guest_switch_msr *arr = cpuc->guest_switch_msrs;
@@ -5437,6 +5516,7 @@ __init int intel_pmu_init(void)
 
 	case INTEL_FAM6_ICELAKE_X:
 	case INTEL_FAM6_ICELAKE_D:
+		x86_pmu.pebs_ept = 1;
 		pmem = true;
 		fallthrough;
 	case INTEL_FAM6_ICELAKE_L:
@@ -24,6 +24,7 @@
 #include <linux/clocksource.h>
 #include <linux/irqbypass.h>
 #include <linux/hyperv.h>
+#include <linux/kfifo.h>
 
 #include <asm/apic.h>
 #include <asm/pvclock-abi.h>
@@ -47,6 +48,8 @@
 
 #define KVM_HALT_POLL_NS_DEFAULT 200000
 
+#define KVM_HAVE_MMU_RWLOCK
+
 #define KVM_IRQCHIP_NUM_PINS  KVM_IOAPIC_NUM_PINS
 
 #define KVM_DIRTY_LOG_MANUAL_CAPS   (KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE | \
@@ -88,6 +91,10 @@
 	KVM_ARCH_REQ_FLAGS(27, KVM_REQUEST_NO_WAKEUP)
 #define KVM_REQ_APF_READY		KVM_ARCH_REQ(28)
 #define KVM_REQ_MSR_FILTER_CHANGED	KVM_ARCH_REQ(29)
+#define KVM_REQ_APICV_BACKOFF \
+	KVM_ARCH_REQ_FLAGS(30, KVM_REQUEST_NO_WAKEUP)
+#define KVM_REQ_UPDATE_CPU_DIRTY_LOGGING \
+	KVM_ARCH_REQ_FLAGS(31, KVM_REQUEST_WAIT | KVM_REQUEST_NO_WAKEUP)
 
 #define CR0_RESERVED_BITS                                               \
 	(~(unsigned long)(X86_CR0_PE | X86_CR0_MP | X86_CR0_EM | X86_CR0_TS \
@@ -134,6 +141,9 @@ static inline gfn_t gfn_to_index(gfn_t gfn, gfn_t base_gfn, int level)
 #define KVM_MIN_FREE_MMU_PAGES 5
 #define KVM_REFILL_PAGES 25
 #define KVM_MAX_CPUID_ENTRIES 256
+/* Leaves 0x0-0x1f and 0x80000000-0x8000001f, index 0-3 for the basic ones */
+#define KVM_CPUID_CACHED_LEAVES 0x20
+#define KVM_CPUID_CACHED_INDICES 4
 #define KVM_NR_FIXED_MTRR_REGION 88
 #define KVM_NR_VAR_MTRR 8
 
@@ -338,6 +348,11 @@ struct kvm_mmu_root_info {
 	((struct kvm_mmu_root_info) { .pgd = INVALID_PAGE, .hpa = INVALID_PAGE })
 
 #define KVM_MMU_NUM_PREV_ROOTS 3
+/*
+ * guest_mmu holds the shadow EPT/NPT roots of L2s, which L1 can switch between
+ * much more often than a guest switches CR3s with PCIDs in use.
+ */
+#define KVM_MMU_NUM_PREV_GUEST_ROOTS 16
 
 struct kvm_mmu_page;
 
@@ -369,7 +384,9 @@ struct kvm_mmu {
 	u8 shadow_root_level;
 	u8 ept_ad;
 	bool direct_map;
-	struct kvm_mmu_root_info prev_roots[KVM_MMU_NUM_PREV_ROOTS];
+	/* LRU ordered, the first nr_prev_roots entries are in use. */
+	struct kvm_mmu_root_info prev_roots[KVM_MMU_NUM_PREV_GUEST_ROOTS];
+	u8 nr_prev_roots;
 
 	/*
 	 * Bitmap; bit set = permission fault
@@ -435,6 +452,7 @@ struct kvm_pmu {
 	unsigned nr_arch_fixed_counters;
 	unsigned available_event_types;
 	u64 fixed_ctr_ctrl;
+	u64 fixed_ctr_ctrl_mask;
 	u64 global_ctrl;
 	u64 global_status;
 	u64 global_ovf_ctrl;
@@ -443,10 +461,27 @@ struct kvm_pmu {
 	u64 global_ovf_ctrl_mask;
 	u64 reserved_bits;
 	u8 version;
+
+	/* Guest PEBS, backed by the host's EPT-friendly PEBS. */
+	u64 ds_area;
+	u64 pebs_enable;
+	u64 pebs_enable_mask;
+	u64 pebs_data_cfg;
+	u64 pebs_data_cfg_mask;
+
+	/*
+	 * The guest counters with PEBS enabled whose perf_event landed on a
+	 * different host counter; PEBS stays off for them, since the records
+	 * would carry the wrong counter index.
+	 */
+	u64 host_cross_mapped_mask;
+
 	struct kvm_pmc gp_counters[INTEL_PMC_MAX_GENERIC];
 	struct kvm_pmc fixed_counters[INTEL_PMC_MAX_FIXED];
 	struct irq_work irq_work;
 	DECLARE_BITMAP(reprogram_pmi, X86_PMC_IDX_MAX);
+	/* Counters whose controls changed since the last VM-entry. */
+	DECLARE_BITMAP(reprogram_deferred, X86_PMC_IDX_MAX);
 	DECLARE_BITMAP(all_valid_pmc_idx, X86_PMC_IDX_MAX);
 	DECLARE_BITMAP(pmc_in_use, X86_PMC_IDX_MAX);
 
@@ -461,6 +496,20 @@ struct kvm_pmu {
 	 * redundant check before cleanup if guest don't use vPMU at all.
 	 */
 	u8 event_count;
+
+	/*
+	 * The counters are loaded into the hardware PMU around VM-entry instead
+	 * of being backed by perf_events, and the host's counters are saved in
+	 * @host meanwhile.  Only for vCPUs that own a physical core.
+	 */
+	bool passthrough;
+	struct {
+		u64 global_ctrl;
+		u64 fixed_ctr_ctrl;
+		u64 eventsel[INTEL_PMC_MAX_GENERIC];
+		u64 counters[INTEL_PMC_MAX_GENERIC];
+		u64 fixed_counters[INTEL_PMC_MAX_FIXED];
+	} host;
 };
 
 struct kvm_pmu_ops;
@@ -477,12 +526,37 @@ struct kvm_mtrr_range {
 	struct list_head node;
 };
 
+#define KVM_MTRR_VAR_MAP_SIZE	(2 * KVM_NR_VAR_MTRR + 1)
+
 struct kvm_mtrr {
 	struct kvm_mtrr_range var_ranges[KVM_NR_VAR_MTRR];
 	mtrr_type fixed_ranges[KVM_NR_FIXED_MTRR_REGION];
 	u64 deftype;
 
 	struct list_head head;
+
+	/*
+	 * The variable MTRRs flattened into adjacent ranges that each have a
+	 * single memory type, -1 if no MTRR covers them. Sorted by end
+	 * address, the first range starts at 0.
+	 */
+	struct {
+		u64 end[KVM_MTRR_VAR_MAP_SIZE];
+		s8 type[KVM_MTRR_VAR_MAP_SIZE];
+		int nr;
+	} var_map;
+};
+
+/*
+ * An hrtimer that may be armed on a housekeeping CPU from an irq_work, see
+ * lapic_timer_offload.
+ */
+struct kvm_timer_offload {
+	struct irq_work work;
+	raw_spinlock_t lock;
+	ktime_t expire;		/* what work arms, 0 if canceled */
+	struct hrtimer *timer;
+	enum hrtimer_mode mode;
 };
 
 /* Hyper-V SynIC timer */
@@ -494,6 +568,7 @@ struct kvm_vcpu_hv_stimer {
 	u64 exp_time;
 	struct hv_message msg;
 	bool msg_pending;
+	struct kvm_timer_offload offload;
 };
 
 /* Hyper-V synthetic interrupt controller (SynIC)*/
@@ -511,6 +586,19 @@ struct kvm_vcpu_hv_synic {
 };
 
 /* Hyper-V per vcpu emulation context */
+/*
+ * GVA ranges queued by HvFlushVirtualAddressList{,Ex}, in the hypercall's own
+ * format: a page address with the number of additional pages in the low 12
+ * bits.  KVM_HV_TLB_FLUSHALL_ENTRY requests a full flush.
+ */
+#define KVM_HV_TLB_FLUSH_FIFO_SIZE	16
+#define KVM_HV_TLB_FLUSHALL_ENTRY	((u64)-1)
+
+struct kvm_vcpu_hv_tlb_flush_fifo {
+	spinlock_t write_lock;
+	DECLARE_KFIFO(entries, u64, KVM_HV_TLB_FLUSH_FIFO_SIZE);
+};
+
 struct kvm_vcpu_hv {
 	u32 vp_index;
 	u64 hv_vapic;
@@ -519,7 +607,55 @@ struct kvm_vcpu_hv {
 	struct kvm_hyperv_exit exit;
 	struct kvm_vcpu_hv_stimer stimer[HV_SYNIC_STIMER_COUNT];
 	DECLARE_BITMAP(stimer_pending_bitmap, HV_SYNIC_STIMER_COUNT);
-	cpumask_t tlb_flush;
+	struct kvm_vcpu_hv_tlb_flush_fifo tlb_flush_fifo;
+};
+
+#define KVM_MMIO_INSN_CACHE_BITS	3
+
+/*
+ * A MOV to MMIO that the emulator completed in the kernel.  @insn holds the
+ * instruction bytes, which are compared against guest memory on every use.
+ */
+struct kvm_mmio_insn {
+	unsigned long rip;
+	u8 insn[15];
+	u8 len;
+	u8 bytes;
+	s8 reg;		/* source register, or -1 for an immediate */
+	bool high_byte;	/* source is AH, CH, DH or BH */
+	u64 imm;
+};
+
+#define KVM_INSN_CACHE_BITS	3
+
+#define KVM_MAX_NR_USER_RETURN_MSRS 16
+
+/*
+ * Histogram of the host TSC cycles between a VM-exit and the following
+ * VM-entry.  Bucket 0 counts deltas below 2^KVM_EXIT_LATENCY_MIN_SHIFT cycles,
+ * bucket n deltas in [2^(MIN_SHIFT + n - 1), 2^(MIN_SHIFT + n)), and the last
+ * bucket everything above.
+ */
+#define KVM_EXIT_LATENCY_BUCKETS	16
+#define KVM_EXIT_LATENCY_MIN_SHIFT	9
+
+struct kvm_exit_latency_hist {
+	u64 count[KVM_EXIT_LATENCY_BUCKETS];
+};
+
+/*
+ * Where the emulator last fetched an instruction from, for a linear RIP.
+ * Only valid as long as the guest mappings are known not to have changed,
+ * see vcpu_clear_insn_cache().
+ */
+struct kvm_insn_cache_entry {
+	unsigned long cr3;
+	unsigned long rip;
+	gpa_t gpa;
+	u64 gen;
+	u8 mode;
+	u8 cpl;
+	u8 len;
 };
 
 struct kvm_vcpu_arch {
@@ -640,6 +776,13 @@ struct kvm_vcpu_arch {
 
 	int cpuid_nent;
 	struct kvm_cpuid_entry2 *cpuid_entries;
+	/*
+	 * Lookup results for the low basic and extended leaves, which most
+	 * feature checks hit; see kvm_vcpu_set_cpuid_entries().
+	 */
+	struct kvm_cpuid_entry2 *cpuid_basic[KVM_CPUID_CACHED_LEAVES]
+					    [KVM_CPUID_CACHED_INDICES];
+	struct kvm_cpuid_entry2 *cpuid_extended[KVM_CPUID_CACHED_LEAVES];
 
 	int maxphyaddr;
 	int max_tdp_level;
@@ -651,6 +794,22 @@ struct kvm_vcpu_arch {
 	bool emulate_regs_need_sync_from_vcpu;
 	int (*complete_userspace_io)(struct kvm_vcpu *vcpu);
 
+	/* MMIO stores decoded by the emulator, indexed by RIP */
+	struct kvm_mmio_insn mmio_insn_cache[1 << KVM_MMIO_INSN_CACHE_BITS];
+	/* Translations of the RIPs the emulator fetched from */
+	struct kvm_insn_cache_entry insn_cache[1 << KVM_INSN_CACHE_BITS];
+
+	/* Guest values written to each user-return MSR slot */
+	u64 uret_msr_loads[KVM_MAX_NR_USER_RETURN_MSRS];
+
+	/* Exit-to-entry latency, indexed by the vendor's exit latency index. */
+	struct kvm_exit_latency_hist *exit_latency;
+	u64 exit_latency_tsc;
+	u32 exit_latency_index;
+
+	/* local_clock() at the last change of the state accounted in stat */
+	u64 state_clock;
+
 	gpa_t time;
 	struct pvclock_vcpu_time_info hv_clock;
 	unsigned int hw_tsc_khz;
@@ -737,6 +896,7 @@ struct kvm_vcpu_arch {
 		unsigned long nested_apf_token;
 		bool delivery_as_pf_vmexit;
 		bool pageready_pending;
+		u32 ring_head;
 	} apf;
 
 	/* OSVW MSRs (AMD only) */
@@ -897,6 +1057,10 @@ enum kvm_irqchip_mode {
 #define APICV_INHIBIT_REASON_IRQWIN     3
 #define APICV_INHIBIT_REASON_PIT_REINJ  4
 #define APICV_INHIBIT_REASON_X2APIC	5
+#define APICV_INHIBIT_REASON_PHYSICAL_ID_TOO_BIG 6
+/* Internal to x86.c, delays re-activation after a recent inhibit. */
+#define APICV_INHIBIT_REASON_BACKOFF	7
+#define APICV_INHIBIT_REASON_NR		8
 
 struct kvm_arch {
 	unsigned long n_used_mmu_pages;
@@ -904,6 +1068,8 @@ struct kvm_arch {
 	unsigned long n_max_mmu_pages;
 	unsigned int indirect_shadow_pages;
 	u8 mmu_valid_gen;
+	/* Largest page size that the guest memory is mapped with */
+	u8 max_huge_page_level;
 	struct hlist_head mmu_page_hash[KVM_NUM_MMU_PAGES];
 	/*
 	 * Hash table of struct kvm_mmu_page.
@@ -911,6 +1077,8 @@ struct kvm_arch {
 	struct list_head active_mmu_pages;
 	struct list_head zapped_obsolete_pages;
 	struct list_head lpage_disallowed_mmu_pages;
+	/* Serializes marking shadow pages unsync from TDP MMU page faults. */
+	spinlock_t mmu_unsync_pages_lock;
 	struct kvm_page_track_notifier_node mmu_sp_tracker;
 	struct kvm_page_track_notifier_head track_notifier_head;
 
@@ -931,6 +1099,8 @@ struct kvm_arch {
 
 	bool apic_access_page_done;
 	unsigned long apicv_inhibit_reasons;
+	unsigned long apicv_inhibit_jiffies;
+	struct delayed_work apicv_backoff_work;
 
 	gpa_t wall_clock;
 
@@ -945,6 +1115,8 @@ struct kvm_arch {
 	u64 last_tsc_nsec;
 	u64 last_tsc_write;
 	u32 last_tsc_khz;
+	/* TSC frequency of the vCPUs when they are created */
+	u32 default_tsc_khz;
 	u64 cur_tsc_nsec;
 	u64 cur_tsc_write;
 	u64 cur_tsc_offset;
@@ -953,6 +1125,8 @@ struct kvm_arch {
 
 	spinlock_t pvclock_gtod_sync_lock;
 	bool use_master_clock;
+	/* Set with KVM_REQ_MASTERCLOCK_UPDATE, cleared once a vCPU handles it */
+	bool masterclock_update_pending;
 	u64 master_kernel_ns;
 	u64 master_cycle_now;
 	struct delayed_work kvmclock_update_work;
@@ -986,6 +1160,12 @@ struct kvm_arch {
 	bool guest_can_read_msr_platform_info;
 	bool exception_payload_enabled;
 
+	/*
+	 * Guest pages must be pinned when they fault in, see
+	 * kvm_x86_ops.mem_enc_pin_page, so SPTEs can't be prefetched.
+	 */
+	bool mmu_no_prefetch;
+
 	/* Deflect RDMSR and WRMSR to user space when they trigger a #GP */
 	u32 user_space_msr_mask;
 
@@ -998,6 +1178,12 @@ struct kvm_arch {
 	/* Guest can access the SGX PROVISIONKEY. */
 	bool sgx_provisioning_allowed;
 
+	/*
+	 * Set once dirty logging is first enabled, at which point the vCPUs
+	 * turn on hardware dirty logging with KVM_REQ_UPDATE_CPU_DIRTY_LOGGING.
+	 */
+	bool cpu_dirty_logging;
+
 	struct kvm_pmu_event_filter *pmu_event_filter;
 	struct task_struct *nx_lpage_recovery_thread;
 
@@ -1014,6 +1200,28 @@ struct kvm_arch {
 	struct list_head tdp_mmu_roots;
 	/* List of struct tdp_mmu_pages not being used as roots */
 	struct list_head tdp_mmu_pages;
+
+	/*
+	 * Protects the tdp_mmu_pages list and the TDP MMU pages on the
+	 * lpage_disallowed_mmu_pages list, when they are modified by a
+	 * thread that holds mmu_lock only for read, i.e. the page fault
+	 * handler.  Not needed when mmu_lock is held for write.
+	 */
+	spinlock_t tdp_mmu_pages_lock;
+
+	/*
+	 * The page table pages of the TDP MMU are carved out of 2M chunks
+	 * allocated on the node of the vCPU that needs them, one chunk per
+	 * node at a time.  See kvm_tdp_mmu_topup_page_cache().
+	 */
+	struct mutex tdp_mmu_arena_lock;
+	struct tdp_mmu_arena *tdp_mmu_arenas;
+	atomic_t tdp_mmu_nr_single_pages;
+};
+
+struct tdp_mmu_arena {
+	struct page *next;
+	unsigned int nr_free;
 };
 
 struct kvm_vm_stat {
@@ -1026,9 +1234,12 @@ struct kvm_vm_stat {
 	ulong mmu_cache_miss;
 	ulong mmu_unsync;
 	ulong remote_tlb_flush;
+	ulong irqfd_inject_deferred;
 	ulong lpages;
 	ulong nx_lpage_splits;
 	ulong max_mmu_page_hash_collisions;
+	ulong apicv_inhibits[APICV_INHIBIT_REASON_NR];
+	ulong apicv_toggles;
 };
 
 struct kvm_vcpu_stat {
@@ -1049,6 +1260,7 @@ struct kvm_vcpu_stat {
 	u64 halt_attempted_poll;
 	u64 halt_poll_invalid;
 	u64 halt_wakeup;
+	u64 halt_wakeup_coalesced;
 	u64 request_irq_exits;
 	u64 irq_exits;
 	u64 host_state_reload;
@@ -1061,6 +1273,28 @@ struct kvm_vcpu_stat {
 	u64 req_event;
 	u64 halt_poll_success_ns;
 	u64 halt_poll_fail_ns;
+	u64 encls_exits;
+	u64 encls_ecreate_exits;
+	u64 encls_einit_exits;
+	u64 pml_full_exits;
+	u64 pml_flushes;
+	u64 mmio_insn_cache_hits;
+	u64 insn_cache_hits;
+	u64 pv_ipis_sent;
+	u64 pv_ipis_coalesced;
+	u64 pv_ipi_wakeups;
+	u64 evmcs_copies;
+	u64 evmcs_copied_bytes;
+	/*
+	 * Time spent in each state by the vCPU thread, besides halt-polling:
+	 * in the guest, handling exits, in the rest of the run loop, blocked
+	 * in HLT, and in userspace between two KVM_RUN.
+	 */
+	u64 guest_time_ns;
+	u64 exit_handling_ns;
+	u64 run_loop_ns;
+	u64 halt_wait_ns;
+	u64 userspace_ns;
 };
 
 struct x86_instruction_info;
@@ -1154,6 +1388,12 @@ struct kvm_x86_ops {
 	enum exit_fastpath_completion (*run)(struct kvm_vcpu *vcpu);
 	int (*handle_exit)(struct kvm_vcpu *vcpu,
 		enum exit_fastpath_completion exit_fastpath);
+	/*
+	 * Map the last VM-exit to an index below nr_exit_latency_reasons, the
+	 * last index collecting all exits without a dedicated histogram.
+	 */
+	unsigned int nr_exit_latency_reasons;
+	u32 (*exit_latency_index)(struct kvm_vcpu *vcpu);
 	int (*skip_emulated_instruction)(struct kvm_vcpu *vcpu);
 	void (*update_emulated_instruction)(struct kvm_vcpu *vcpu);
 	void (*set_interrupt_shadow)(struct kvm_vcpu *vcpu, int mask);
@@ -1226,6 +1466,9 @@ struct kvm_x86_ops {
 	 *  - enable_log_dirty_pt_masked:
 	 *	called when reenabling log dirty for the GFNs in the mask after
 	 *	corresponding bits are cleared in slot->dirty_bitmap.
+	 *  - update_cpu_dirty_logging:
+	 *	called on KVM_REQ_UPDATE_CPU_DIRTY_LOGGING to turn on hardware
+	 *	dirty logging for the vCPU before it next enters the guest.
 	 */
 	void (*slot_enable_log_dirty)(struct kvm *kvm,
 				      struct kvm_memory_slot *slot);
@@ -1235,6 +1478,12 @@ struct kvm_x86_ops {
 	void (*enable_log_dirty_pt_masked)(struct kvm *kvm,
 					   struct kvm_memory_slot *slot,
 					   gfn_t offset, unsigned long mask);
+	int (*update_cpu_dirty_logging)(struct kvm_vcpu *vcpu);
+	/*
+	 * The number of GFNs the hardware can log before a vCPU exits, i.e.
+	 * the room to keep for them in the dirty ring of the vCPU.
+	 */
+	int cpu_dirty_log_size;
 
 	/* pmu operations of sub-arch */
 	const struct kvm_pmu_ops *pmu_ops;
@@ -1274,6 +1523,7 @@ struct kvm_x86_ops {
 	int (*mem_enc_op)(struct kvm *kvm, void __user *argp);
 	int (*mem_enc_reg_region)(struct kvm *kvm, struct kvm_enc_region *argp);
 	int (*mem_enc_unreg_region)(struct kvm *kvm, struct kvm_enc_region *argp);
+	int (*mem_enc_pin_page)(struct kvm_vcpu *vcpu, gfn_t gfn);
 
 	int (*get_msr_feature)(struct kvm_msr_entry *entry);
 
@@ -1352,6 +1602,9 @@ void kvm_mmu_set_mask_ptes(u64 user_mask, u64 accessed_mask,
 		u64 acc_track_mask, u64 me_mask);
 
 void kvm_mmu_reset_context(struct kvm_vcpu *vcpu);
+void kvm_mmu_slot_try_split_huge_pages(struct kvm *kvm,
+				       const struct kvm_memory_slot *memslot,
+				       int target_level);
 void kvm_mmu_slot_remove_write_access(struct kvm *kvm,
 				      struct kvm_memory_slot *memslot,
 				      int start_level);
@@ -1367,6 +1620,8 @@ void kvm_mmu_clear_dirty_pt_masked(struct kvm *kvm,
 				   struct kvm_memory_slot *slot,
 				   gfn_t gfn_offset, unsigned long mask);
 void kvm_mmu_zap_all(struct kvm *kvm);
+int kvm_mmu_max_huge_page_level(void);
+int kvm_mmu_set_max_huge_page_level(struct kvm *kvm, u64 level);
 void kvm_mmu_invalidate_mmio_sptes(struct kvm *kvm, u64 gen);
 unsigned long kvm_mmu_calculate_default_mmu_pages(struct kvm *kvm);
 void kvm_mmu_change_mmu_pages(struct kvm *kvm, unsigned long kvm_nr_mmu_pages);
@@ -1665,12 +1920,14 @@ int kvm_cpu_get_interrupt(struct kvm_vcpu *v);
 void kvm_vcpu_reset(struct kvm_vcpu *vcpu, bool init_event);
 void kvm_vcpu_reload_apic_access_page(struct kvm_vcpu *vcpu);
 
-int kvm_pv_send_ipi(struct kvm *kvm, unsigned long ipi_bitmap_low,
+int kvm_pv_send_ipi(struct kvm_vcpu *vcpu, unsigned long ipi_bitmap_low,
 		    unsigned long ipi_bitmap_high, u32 min,
 		    unsigned long icr, int op_64_bit);
 
 void kvm_define_user_return_msr(unsigned index, u32 msr);
 int kvm_set_user_return_msr(unsigned index, u64 val, u64 mask);
+unsigned int kvm_nr_user_return_msrs(void);
+u32 kvm_user_return_msr_index(unsigned int slot);
 
 u64 kvm_scale_tsc(struct kvm_vcpu *vcpu, u64 tsc);
 u64 kvm_read_l1_tsc(struct kvm_vcpu *vcpu, u64 host_tsc);
@@ -1679,6 +1936,7 @@ unsigned long kvm_get_linear_rip(struct kvm_vcpu *vcpu);
 bool kvm_is_linear_rip(struct kvm_vcpu *vcpu, unsigned long linear_rip);
 
 void kvm_make_mclock_inprogress_request(struct kvm *kvm);
+void kvm_request_masterclock_update(struct kvm_vcpu *vcpu);
 void kvm_make_scan_ioapic_request(struct kvm *kvm);
 void kvm_make_scan_ioapic_request_mask(struct kvm *kvm,
 				       unsigned long *vcpu_bitmap);
@@ -1694,6 +1952,7 @@ bool kvm_arch_can_dequeue_async_page_present(struct kvm_vcpu *vcpu);
 extern bool kvm_find_async_pf_gfn(struct kvm_vcpu *vcpu, gfn_t gfn);
 
 int kvm_skip_emulated_instruction(struct kvm_vcpu *vcpu);
+bool kvm_mmio_insn_cache_write(struct kvm_vcpu *vcpu, gpa_t gpa);
 int kvm_complete_insn_gp(struct kvm_vcpu *vcpu, int err);
 void __kvm_request_immediate_exit(struct kvm_vcpu *vcpu);
 
@@ -192,6 +192,7 @@ struct x86_pmu_capability {
 	int		bit_width_fixed;
 	unsigned int	events_mask;
 	int		events_mask_len;
+	unsigned int	pebs_ept	:1;
 };
 
 /*
@@ -459,6 +460,15 @@ struct perf_guest_switch_msr {
 	u64 host, guest;
 };
 
+/* PEBS state of a guest, whose PEBS records go to its own DS area. */
+struct x86_guest_pebs {
+	u64	enable;
+	u64	ds_area;
+	u64	data_cfg;
+	/* Host counters that run guest PEBS counters of another index */
+	u64	cross_mapped_mask;
+};
+
 struct x86_pmu_lbr {
 	unsigned int	nr;
 	unsigned int	from;
@@ -469,21 +479,31 @@ struct x86_pmu_lbr {
 extern void perf_get_x86_pmu_capability(struct x86_pmu_capability *cap);
 extern void perf_check_microcode(void);
 extern int x86_perf_rdpmc_index(struct perf_event *event);
+extern int perf_guest_reserve_pmu(void);
+extern void perf_guest_release_pmu(void);
 #else
 static inline void perf_get_x86_pmu_capability(struct x86_pmu_capability *cap)
 {
 	memset(cap, 0, sizeof(*cap));
 }
 
+static inline int perf_guest_reserve_pmu(void)
+{
+	return -1;
+}
+static inline void perf_guest_release_pmu(void) { }
+
 static inline void perf_events_lapic_init(void)	{ }
 static inline void perf_check_microcode(void) { }
 #endif
 
 #if defined(CONFIG_PERF_EVENTS) && defined(CONFIG_CPU_SUP_INTEL)
-extern struct perf_guest_switch_msr *perf_guest_get_msrs(int *nr);
+extern struct perf_guest_switch_msr *perf_guest_get_msrs(int *nr,
+						struct x86_guest_pebs *pebs);
 extern int x86_perf_get_lbr(struct x86_pmu_lbr *lbr);
 #else
-static inline struct perf_guest_switch_msr *perf_guest_get_msrs(int *nr)
+static inline struct perf_guest_switch_msr *
+perf_guest_get_msrs(int *nr, struct x86_guest_pebs *pebs)
 {
 	*nr = 0;
 	return NULL;
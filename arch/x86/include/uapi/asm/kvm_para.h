@@ -33,6 +33,9 @@
 #define KVM_FEATURE_PV_SCHED_YIELD	13
 #define KVM_FEATURE_ASYNC_PF_INT	14
 #define KVM_FEATURE_MSI_EXT_DEST_ID	15
+#define KVM_FEATURE_PV_SCHED_HINTS	16
+#define KVM_FEATURE_PV_LOCK_HOLDER	17
+#define KVM_FEATURE_ASYNC_PF_RING	18
 
 #define KVM_HINTS_REALTIME      0
 
@@ -60,13 +63,18 @@ struct kvm_steal_time {
 	__u32 version;
 	__u32 flags;
 	__u8  preempted;
-	__u8  u8_pad[3];
-	__u32 pad[11];
+	__u8  sched_hints;
+	__u8  u8_pad[2];
+	__u32 nr_running;
+	__u32 pad[10];
 };
 
 #define KVM_VCPU_PREEMPTED          (1 << 0)
 #define KVM_VCPU_FLUSH_TLB          (1 << 1)
 
+/* sched_hints and nr_running are only valid with KVM_FEATURE_PV_SCHED_HINTS */
+#define KVM_SCHED_HINT_PREEMPT_PENDING	(1 << 0)
+
 #define KVM_CLOCK_PAIRING_WALLCLOCK 0
 struct kvm_clock_pairing {
 	__s64 sec;
@@ -86,6 +94,7 @@ struct kvm_clock_pairing {
 #define KVM_ASYNC_PF_SEND_ALWAYS		(1 << 1)
 #define KVM_ASYNC_PF_DELIVERY_AS_PF_VMEXIT	(1 << 2)
 #define KVM_ASYNC_PF_DELIVERY_AS_INT		(1 << 3)
+#define KVM_ASYNC_PF_DELIVERY_RING		(1 << 4)
 
 /* MSR_KVM_ASYNC_PF_INT */
 #define KVM_ASYNC_PF_VEC_MASK			GENMASK(7, 0)
@@ -120,6 +129,8 @@ struct kvm_mmu_op_release_pt {
 #define KVM_PV_REASON_PAGE_NOT_PRESENT 1
 #define KVM_PV_REASON_PAGE_READY 2
 
+#define KVM_ASYNC_PF_RING_SIZE 12
+
 struct kvm_vcpu_pv_apf_data {
 	/* Used for 'page not present' events delivered via #PF */
 	__u32 flags;
@@ -127,7 +138,15 @@ struct kvm_vcpu_pv_apf_data {
 	/* Used for 'page ready' events delivered via interrupt notification */
 	__u32 token;
 
-	__u8 pad[56];
+	/*
+	 * With KVM_ASYNC_PF_DELIVERY_RING, 'page ready' tokens are queued in
+	 * ring[] instead of token, and one interrupt covers all the tokens
+	 * queued until MSR_KVM_ASYNC_PF_ACK is written.  ring_head is only
+	 * written by the host, ring_tail only by the guest.
+	 */
+	__u32 ring_head;
+	__u32 ring_tail;
+	__u32 ring[KVM_ASYNC_PF_RING_SIZE];
 	__u32 enabled;
 };
 
@@ -27,6 +27,10 @@ enum sgx_page_flags {
 	_IOW(SGX_MAGIC, 0x02, struct sgx_enclave_init)
 #define SGX_IOC_ENCLAVE_PROVISION \
 	_IOW(SGX_MAGIC, 0x03, struct sgx_enclave_provision)
+#define SGX_IOC_VEPC_POPULATE \
+	_IOWR(SGX_MAGIC, 0x04, struct sgx_vepc_populate)
+#define SGX_IOC_ENCLAVE_MIGRATE \
+	_IOWR(SGX_MAGIC, 0x05, struct sgx_enclave_migrate)
 
 /**
  * struct sgx_enclave_create - parameter structure for the
@@ -74,6 +78,36 @@ struct sgx_enclave_provision {
 	__u64 fd;
 };
 
+/**
+ * struct sgx_vepc_populate - parameter structure for the
+ *			      %SGX_IOC_VEPC_POPULATE ioctl
+ * @addr:	start address inside a mapping of the virtual EPC
+ * @length:	length of the range (multiple of the page size)
+ * @count:	number of bytes populated (multiple of the page size)
+ */
+struct sgx_vepc_populate {
+	__u64 addr;
+	__u64 length;
+	__u64 count;
+};
+
+/**
+ * struct sgx_enclave_migrate - parameter structure for the
+ *				%SGX_IOC_ENCLAVE_MIGRATE ioctl
+ * @offset:	starting page offset
+ * @length:	length of the range (multiple of the page size)
+ * @nid:	target NUMA node, or -1 for the node of the calling thread
+ * @flags:	must be zero
+ * @count:	number of bytes processed (multiple of the page size)
+ */
+struct sgx_enclave_migrate {
+	__u64 offset;
+	__u64 length;
+	__s32 nid;
+	__u32 flags;
+	__u64 count;
+};
+
 struct sgx_enclave_run;
 
 /**
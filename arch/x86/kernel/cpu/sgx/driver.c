@@ -4,6 +4,7 @@
 #include <linux/acpi.h>
 #include <linux/miscdevice.h>
 #include <linux/mman.h>
+#include <linux/mount.h>
 #include <linux/security.h>
 #include <linux/suspend.h>
 #include <asm/traps.h>
@@ -13,6 +14,7 @@
 u64 sgx_attributes_reserved_mask;
 u64 sgx_xfrm_reserved_mask = ~0x3;
 u32 sgx_misc_reserved_mask;
+struct vfsmount *sgx_backing_mnt;
 
 static int sgx_open(struct inode *inode, struct file *file)
 {
@@ -36,6 +38,7 @@ static int sgx_open(struct inode *inode, struct file *file)
 		return ret;
 	}
 
+	sgx_encl_list_add(encl);
 	file->private_data = encl;
 
 	return 0;
@@ -140,6 +143,35 @@ static struct miscdevice sgx_dev_enclave = {
 	.fops = &sgx_encl_fops,
 };
 
+/*
+ * Back the swapped enclave pages with a private tmpfs instance, which uses huge
+ * pages when they fit the backing file. The backing pages of the neighbouring
+ * enclave pages then share a single page cache lookup, when they are reclaimed
+ * in a batch. Fall back to the internal shmem mount on failure.
+ */
+static void __init sgx_backing_init(void)
+{
+	char opts[] = "huge=within_size";
+	struct file_system_type *type;
+	struct vfsmount *mnt;
+
+	if (!IS_ENABLED(CONFIG_TRANSPARENT_HUGEPAGE))
+		return;
+
+	type = get_fs_type("tmpfs");
+	if (!type)
+		return;
+
+	mnt = vfs_kern_mount(type, SB_KERNMOUNT, type->name, opts);
+	put_filesystem(type);
+	if (IS_ERR(mnt)) {
+		pr_warn("sgx: huge page backing unavailable: %ld\n", PTR_ERR(mnt));
+		return;
+	}
+
+	sgx_backing_mnt = mnt;
+}
+
 int __init sgx_drv_init(void)
 {
 	unsigned int eax, ebx, ecx, edx;
@@ -169,9 +201,16 @@ int __init sgx_drv_init(void)
 		sgx_xfrm_reserved_mask = ~xfrm_mask;
 	}
 
+	sgx_backing_init();
+
 	ret = misc_register(&sgx_dev_enclave);
-	if (ret)
+	if (ret) {
+		kern_unmount(sgx_backing_mnt);
+		sgx_backing_mnt = NULL;
 		return ret;
+	}
+
+	sgx_encl_debugfs_init();
 
 	return 0;
 }
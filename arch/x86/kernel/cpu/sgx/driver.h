@@ -15,10 +15,12 @@
 #define SGX_EINIT_SPIN_COUNT	20
 #define SGX_EINIT_SLEEP_COUNT	50
 #define SGX_EINIT_SLEEP_TIME	20
+#define SGX_ADD_PAGES_BATCH	16
 
 extern u64 sgx_attributes_reserved_mask;
 extern u64 sgx_xfrm_reserved_mask;
 extern u32 sgx_misc_reserved_mask;
+extern struct vfsmount *sgx_backing_mnt;
 
 extern const struct file_operations sgx_provision_fops;
 
@@ -1,9 +1,12 @@
 // SPDX-License-Identifier: GPL-2.0
 /*  Copyright(c) 2016-20 Intel Corporation. */
 
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
 #include <linux/lockdep.h>
 #include <linux/mm.h>
 #include <linux/mman.h>
+#include <linux/seq_file.h>
 #include <linux/shmem_fs.h>
 #include <linux/suspend.h>
 #include <linux/sched/mm.h>
@@ -11,6 +14,11 @@
 #include "encl.h"
 #include "encls.h"
 #include "sgx.h"
+#include "trace.h"
+
+/* All the enclaves of the system, for the debugfs statistics. */
+static LIST_HEAD(sgx_encl_list);
+static DEFINE_SPINLOCK(sgx_encl_list_lock);
 
 /*
  * ELDU: Load an EPC page as unblocked. For more info, see "OS Management of EPC
@@ -64,39 +72,92 @@ static int __sgx_encl_eldu(struct sgx_encl_page *encl_page,
 }
 
 static struct sgx_epc_page *sgx_encl_eldu(struct sgx_encl_page *encl_page,
-					  struct sgx_epc_page *secs_page)
+					  struct sgx_epc_page *secs_page,
+					  int nid)
 {
 
 	unsigned long va_offset = encl_page->desc & SGX_ENCL_PAGE_VA_OFFSET_MASK;
 	struct sgx_encl *encl = encl_page->encl;
 	struct sgx_epc_page *epc_page;
+	u64 start, latency;
 	int ret;
 
-	epc_page = sgx_alloc_epc_page(encl_page, false);
+	epc_page = sgx_alloc_epc_page_nid(encl_page, nid, false);
 	if (IS_ERR(epc_page))
 		return epc_page;
 
+	start = ktime_get_ns();
 	ret = __sgx_encl_eldu(encl_page, epc_page, secs_page);
+	latency = ktime_get_ns() - start;
+
+	trace_sgx_encl_eldu(encl->base, encl_page->desc & PAGE_MASK, latency,
+			    ret);
+
 	if (ret) {
 		sgx_free_epc_page(epc_page);
 		return ERR_PTR(ret);
 	}
 
-	sgx_free_va_slot(encl_page->va_page, va_offset);
-	list_move(&encl_page->va_page->list, &encl->va_pages);
+	sgx_encl_free_va_slot(encl, encl_page->va_page, va_offset);
+	encl_page->va_page = NULL;
 	encl_page->desc &= ~SGX_ENCL_PAGE_VA_OFFSET_MASK;
 	encl_page->epc_page = epc_page;
 
+	encl->stats.nr_loaded++;
+	encl->stats.eldu_ns += latency;
+
 	return epc_page;
 }
 
+/* Load the SECS page back to EPC, if it has been reclaimed. */
+static struct sgx_epc_page *sgx_encl_load_secs(struct sgx_encl *encl, int nid)
+{
+	if (encl->secs.epc_page)
+		return encl->secs.epc_page;
+
+	return sgx_encl_eldu(&encl->secs, NULL, nid);
+}
+
+/**
+ * sgx_encl_reload_page() - Load a reclaimed page back to EPC
+ * @encl:	an enclave
+ * @entry:	a reclaimed page of @encl
+ * @nid:	the node to allocate from first, or NUMA_NO_NODE for the node
+ *		selected by the memory policy of the calling task
+ *
+ * Load @entry, and the SECS if it has been reclaimed too, with ELDU. The caller
+ * must hold encl->lock.
+ *
+ * Return:
+ *   0 on success,
+ *   -errno on error
+ */
+int sgx_encl_reload_page(struct sgx_encl *encl, struct sgx_encl_page *entry,
+			 int nid)
+{
+	struct sgx_epc_page *epc_page;
+
+	epc_page = sgx_encl_load_secs(encl, nid);
+	if (IS_ERR(epc_page))
+		return PTR_ERR(epc_page);
+
+	epc_page = sgx_encl_eldu(entry, encl->secs.epc_page, nid);
+	if (IS_ERR(epc_page))
+		return PTR_ERR(epc_page);
+
+	encl->secs_child_cnt++;
+	sgx_mark_page_reclaimable(entry->epc_page);
+
+	return 0;
+}
+
 static struct sgx_encl_page *sgx_encl_load_page(struct sgx_encl *encl,
 						unsigned long addr,
 						unsigned long vm_flags)
 {
 	unsigned long vm_prot_bits = vm_flags & (VM_READ | VM_WRITE | VM_EXEC);
-	struct sgx_epc_page *epc_page;
 	struct sgx_encl_page *entry;
+	int ret;
 
 	entry = xa_load(&encl->page_array, PFN_DOWN(addr));
 	if (!entry)
@@ -118,23 +179,163 @@ static struct sgx_encl_page *sgx_encl_load_page(struct sgx_encl *encl,
 		return entry;
 	}
 
-	if (!(encl->secs.epc_page)) {
-		epc_page = sgx_encl_eldu(&encl->secs, NULL);
-		if (IS_ERR(epc_page))
-			return ERR_CAST(epc_page);
+	ret = sgx_encl_reload_page(encl, entry, NUMA_NO_NODE);
+	if (ret)
+		return ERR_PTR(ret);
+
+	return entry;
+}
+
+/*
+ * Dynamically add a page to an initialized enclave with EAUG. The page is in
+ * the pending state until the enclave accepts it with EACCEPT, which is also
+ * where the enclave decides the permissions of the page, i.e. the maximum
+ * permissions of the kernel only matter for pages added before EINIT.
+ */
+static vm_fault_t sgx_encl_eaug_page(struct vm_area_struct *vma,
+				     struct sgx_encl *encl, unsigned long addr)
+{
+	vm_fault_t vmret = VM_FAULT_SIGBUS;
+	struct sgx_pageinfo pginfo = {0};
+	struct sgx_encl_page *encl_page;
+	struct sgx_epc_page *epc_page;
+	unsigned long phys_addr;
+	int ret;
+
+	if (!test_bit(SGX_ENCL_INITIALIZED, &encl->flags))
+		return VM_FAULT_SIGBUS;
+
+	encl_page = sgx_encl_page_alloc(encl, addr - encl->base,
+					SGX_SECINFO_R | SGX_SECINFO_W |
+					SGX_SECINFO_X);
+	if (IS_ERR(encl_page))
+		return VM_FAULT_OOM;
+
+	mutex_lock(&encl->lock);
+
+	epc_page = sgx_encl_load_secs(encl, NUMA_NO_NODE);
+	if (IS_ERR(epc_page)) {
+		if (PTR_ERR(epc_page) == -EBUSY)
+			vmret = VM_FAULT_NOPAGE;
+		goto err_out_unlock;
 	}
 
-	epc_page = sgx_encl_eldu(entry, encl->secs.epc_page);
-	if (IS_ERR(epc_page))
-		return ERR_CAST(epc_page);
+	/* mmap_lock is held, i.e. EPC pages can't be reclaimed directly. */
+	epc_page = sgx_alloc_epc_page(encl_page, false);
+	if (IS_ERR(epc_page)) {
+		if (PTR_ERR(epc_page) == -EBUSY)
+			vmret = VM_FAULT_NOPAGE;
+		goto err_out_unlock;
+	}
 
+	/* -EBUSY means that the page was added by another thread. */
+	ret = xa_insert(&encl->page_array, PFN_DOWN(encl_page->desc),
+			encl_page, GFP_KERNEL);
+	if (ret) {
+		if (ret == -EBUSY)
+			vmret = VM_FAULT_NOPAGE;
+		goto err_out_epc;
+	}
+
+	pginfo.secs = (unsigned long)sgx_get_epc_virt_addr(encl->secs.epc_page);
+	pginfo.addr = encl_page->desc & PAGE_MASK;
+	pginfo.metadata = 0;
+
+	ret = __eaug(&pginfo, sgx_get_epc_virt_addr(epc_page));
+	if (ret)
+		goto err_out;
+
+	encl_page->epc_page = epc_page;
 	encl->secs_child_cnt++;
-	sgx_mark_page_reclaimable(entry->epc_page);
+	encl->page_cnt++;
+	sgx_mark_page_reclaimable(encl_page->epc_page);
 
-	return entry;
+	/*
+	 * Do not undo everything when creating the PTE fails, the next #PF
+	 * will find the page ready for a PTE.
+	 */
+	phys_addr = sgx_get_epc_phys_addr(epc_page);
+	vmret = vmf_insert_pfn(vma, addr, PFN_DOWN(phys_addr));
+	mutex_unlock(&encl->lock);
+
+	return vmret == VM_FAULT_NOPAGE ? VM_FAULT_NOPAGE : VM_FAULT_SIGBUS;
+
+err_out:
+	xa_erase(&encl->page_array, PFN_DOWN(encl_page->desc));
+
+err_out_epc:
+	sgx_free_epc_page(epc_page);
+
+err_out_unlock:
+	mutex_unlock(&encl->lock);
+	kfree(encl_page);
+
+	return vmret;
 }
 
-static vm_fault_t sgx_vma_fault(struct vm_fault *vmf)
+/*
+ * Load back the evicted pages following @addr, when the faults on the evicted
+ * pages of the enclave are sequential, i.e. @addr is the first page after the
+ * previous window. The window starts at SGX_ENCL_RA_MIN_PAGES and doubles on
+ * each sequential fault up to SGX_ENCL_RA_MAX_PAGES. The loaded pages are also
+ * mapped, so that the next fault happens at the end of the window. Must be
+ * called with encl->lock held.
+ */
+static void sgx_encl_readahead(struct vm_area_struct *vma,
+			       struct sgx_encl *encl, unsigned long addr)
+{
+	struct sgx_encl_page *entry;
+	unsigned long phys_addr;
+	unsigned long end;
+
+	if (addr != encl->ra_next) {
+		encl->ra_pages = 0;
+		encl->ra_next = addr + PAGE_SIZE;
+		return;
+	}
+
+	encl->ra_pages = clamp_t(unsigned int, encl->ra_pages * 2,
+				 SGX_ENCL_RA_MIN_PAGES, SGX_ENCL_RA_MAX_PAGES);
+
+	end = min(vma->vm_end, addr + (encl->ra_pages + 1) * PAGE_SIZE);
+
+	for (addr += PAGE_SIZE; addr < end; addr += PAGE_SIZE) {
+		/* Stop at the first page, which is resident or absent. */
+		entry = xa_load(&encl->page_array, PFN_DOWN(addr));
+		if (!entry || entry->epc_page)
+			break;
+
+		entry = sgx_encl_load_page(encl, addr, vma->vm_flags);
+		if (IS_ERR(entry))
+			break;
+
+		phys_addr = sgx_get_epc_phys_addr(entry->epc_page);
+		if (vmf_insert_pfn(vma, addr, PFN_DOWN(phys_addr)) != VM_FAULT_NOPAGE)
+			break;
+
+		sgx_encl_test_and_clear_young(vma->vm_mm, entry);
+	}
+
+	encl->ra_next = addr;
+}
+
+static struct sgx_encl_mm *sgx_encl_find_mm(struct sgx_encl *encl,
+					    struct mm_struct *mm);
+
+/*
+ * Record that @mm is going to map pages of the enclave, and thus it must be
+ * included in the ETRACK shootdowns from now on.
+ */
+static void sgx_encl_mm_set_mapped(struct sgx_encl *encl, struct mm_struct *mm)
+{
+	struct sgx_encl_mm *encl_mm;
+
+	encl_mm = sgx_encl_find_mm(encl, mm);
+	if (encl_mm && !READ_ONCE(encl_mm->mapped))
+		WRITE_ONCE(encl_mm->mapped, true);
+}
+
+static vm_fault_t __sgx_vma_fault(struct vm_fault *vmf)
 {
 	unsigned long addr = (unsigned long)vmf->address;
 	struct vm_area_struct *vma = vmf->vma;
@@ -142,6 +343,7 @@ static vm_fault_t sgx_vma_fault(struct vm_fault *vmf)
 	unsigned long phys_addr;
 	struct sgx_encl *encl;
 	unsigned long pfn;
+	bool evicted;
 	vm_fault_t ret;
 
 	encl = vma->vm_private_data;
@@ -154,8 +356,23 @@ static vm_fault_t sgx_vma_fault(struct vm_fault *vmf)
 	if (unlikely(!encl))
 		return VM_FAULT_SIGBUS;
 
+	/* The mm_list entry was added by sgx_mmap() or sgx_vma_open(). */
+	sgx_encl_mm_set_mapped(encl, vma->vm_mm);
+
+	/*
+	 * On SGX2 systems, the pages of an initialized enclave, which were not
+	 * added before EINIT, are added on demand, i.e. the enclave does not
+	 * consume any EPC for e.g. the heap until it gets accessed.
+	 */
+	if (cpu_feature_enabled(X86_FEATURE_SGX2) &&
+	    !xa_load(&encl->page_array, PFN_DOWN(addr)))
+		return sgx_encl_eaug_page(vma, encl, addr);
+
 	mutex_lock(&encl->lock);
 
+	entry = xa_load(&encl->page_array, PFN_DOWN(addr));
+	evicted = entry && !entry->epc_page;
+
 	entry = sgx_encl_load_page(encl, addr, vma->vm_flags);
 	if (IS_ERR(entry)) {
 		mutex_unlock(&encl->lock);
@@ -183,11 +400,27 @@ static vm_fault_t sgx_vma_fault(struct vm_fault *vmf)
 	}
 
 	sgx_encl_test_and_clear_young(vma->vm_mm, entry);
+
+	if (evicted)
+		sgx_encl_readahead(vma, encl, addr);
+
 	mutex_unlock(&encl->lock);
 
 	return VM_FAULT_NOPAGE;
 }
 
+static vm_fault_t sgx_vma_fault(struct vm_fault *vmf)
+{
+	struct sgx_encl *encl = vmf->vma->vm_private_data;
+	vm_fault_t ret;
+
+	ret = __sgx_vma_fault(vmf);
+
+	trace_sgx_vma_fault(encl ? encl->base : 0, vmf->address, ret);
+
+	return ret;
+}
+
 static void sgx_vma_open(struct vm_area_struct *vma)
 {
 	struct sgx_encl *encl = vma->vm_private_data;
@@ -200,8 +433,16 @@ static void sgx_vma_open(struct vm_area_struct *vma)
 	if (unlikely(!encl))
 		return;
 
-	if (sgx_encl_mm_add(encl, vma->vm_mm))
+	if (sgx_encl_mm_add(encl, vma->vm_mm)) {
 		vma->vm_private_data = NULL;
+		return;
+	}
+
+	/*
+	 * The VMA is not VM_DONTCOPY, so fork() copies the PTEs of the parent
+	 * along with it, and a child can enter the enclave without faulting.
+	 */
+	sgx_encl_mm_set_mapped(encl, vma->vm_mm);
 }
 
 
@@ -389,19 +630,20 @@ const struct vm_operations_struct sgx_vm_ops = {
 	.access = sgx_vma_access,
 };
 
-/**
- * sgx_encl_release - Destroy an enclave instance
- * @kref:	address of a kref inside &sgx_encl
- *
- * Used together with kref_put(). Frees all the resources associated with the
- * enclave and the instance itself.
+/*
+ * Tear down the enclave from a worker, as EREMOVE'ing gigabytes of EPC takes
+ * long enough to stall the exiting process, or ksgxd if it dropped the last
+ * reference. The EPC pages are freed in batches by multiple threads, see
+ * sgx_free_epc_pages(), and the SECS last, once its children are gone.
  */
-void sgx_encl_release(struct kref *ref)
+static void sgx_encl_release_work(struct work_struct *work)
 {
-	struct sgx_encl *encl = container_of(ref, struct sgx_encl, refcount);
+	struct sgx_encl *encl = container_of(work, struct sgx_encl,
+					     release_work);
 	struct sgx_va_page *va_page;
 	struct sgx_encl_page *entry;
-	unsigned long index;
+	unsigned long index, nr = 0;
+	LIST_HEAD(pages);
 
 	xa_for_each(&encl->page_array, index, entry) {
 		if (entry->epc_page) {
@@ -412,7 +654,8 @@ void sgx_encl_release(struct kref *ref)
 			if (sgx_unmark_page_reclaimable(entry->epc_page))
 				continue;
 
-			sgx_free_epc_page(entry->epc_page);
+			list_add_tail(&entry->epc_page->list, &pages);
+			nr++;
 			encl->secs_child_cnt--;
 			entry->epc_page = NULL;
 		}
@@ -422,19 +665,22 @@ void sgx_encl_release(struct kref *ref)
 
 	xa_destroy(&encl->page_array);
 
-	if (!encl->secs_child_cnt && encl->secs.epc_page) {
-		sgx_free_epc_page(encl->secs.epc_page);
-		encl->secs.epc_page = NULL;
-	}
-
 	while (!list_empty(&encl->va_pages)) {
 		va_page = list_first_entry(&encl->va_pages, struct sgx_va_page,
 					   list);
 		list_del(&va_page->list);
-		sgx_free_epc_page(va_page->epc_page);
+		list_add_tail(&va_page->epc_page->list, &pages);
+		nr++;
 		kfree(va_page);
 	}
 
+	sgx_free_epc_pages(&pages, nr);
+
+	if (!encl->secs_child_cnt && encl->secs.epc_page) {
+		sgx_free_epc_page(encl->secs.epc_page);
+		encl->secs.epc_page = NULL;
+	}
+
 	if (encl->backing)
 		fput(encl->backing);
 
@@ -449,6 +695,78 @@ void sgx_encl_release(struct kref *ref)
 	kfree(encl);
 }
 
+/**
+ * sgx_encl_release - Destroy an enclave instance
+ * @kref:	address of a kref inside &sgx_encl
+ *
+ * Used together with kref_put(). Queues the freeing of all the resources
+ * associated with the enclave and of the instance itself.
+ */
+void sgx_encl_release(struct kref *ref)
+{
+	struct sgx_encl *encl = container_of(ref, struct sgx_encl, refcount);
+
+	spin_lock(&sgx_encl_list_lock);
+	list_del(&encl->list);
+	spin_unlock(&sgx_encl_list_lock);
+
+	INIT_WORK(&encl->release_work, sgx_encl_release_work);
+	queue_work(system_unbound_wq, &encl->release_work);
+}
+
+/**
+ * sgx_encl_list_add() - Register an enclave for the debugfs statistics
+ * @encl:	an enclave pointer
+ *
+ * The enclave is unregistered by sgx_encl_release().
+ */
+void sgx_encl_list_add(struct sgx_encl *encl)
+{
+	spin_lock(&sgx_encl_list_lock);
+	list_add_tail(&encl->list, &sgx_encl_list);
+	spin_unlock(&sgx_encl_list_lock);
+}
+
+static int sgx_encl_stats_show(struct seq_file *m, void *v)
+{
+	struct sgx_encl *encl;
+
+	seq_puts(m, "base size pages resident evicted loaded not_tracked eldu_ns\n");
+
+	spin_lock(&sgx_encl_list_lock);
+	list_for_each_entry(encl, &sgx_encl_list, list) {
+		/* Not created yet. */
+		if (!test_bit(SGX_ENCL_CREATED, &encl->flags))
+			continue;
+
+		seq_printf(m, "0x%lx 0x%lx %u %u %lu %lu %lu %llu\n",
+			   encl->base, encl->size, READ_ONCE(encl->page_cnt),
+			   READ_ONCE(encl->secs_child_cnt),
+			   READ_ONCE(encl->stats.nr_evicted),
+			   READ_ONCE(encl->stats.nr_loaded),
+			   READ_ONCE(encl->stats.nr_not_tracked),
+			   READ_ONCE(encl->stats.eldu_ns));
+	}
+	spin_unlock(&sgx_encl_list_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(sgx_encl_stats);
+
+/**
+ * sgx_encl_debugfs_init() - Create the debugfs statistics of the enclaves
+ *
+ * Create x86/sgx/enclaves in debugfs, which lists the paging statistics of each
+ * enclave of the system, one enclave per line.
+ */
+void __init sgx_encl_debugfs_init(void)
+{
+	struct dentry *dir;
+
+	dir = debugfs_create_dir("sgx", arch_debugfs_dir);
+	debugfs_create_file("enclaves", 0400, dir, NULL, &sgx_encl_stats_fops);
+}
+
 /*
  * 'mm' is exiting and no longer needs mmu notifications.
  */
@@ -604,6 +922,89 @@ int sgx_encl_get_backing(struct sgx_encl *encl, unsigned long page_index,
 	return 0;
 }
 
+/*
+ * Return @index from the same (possibly huge) backing page as @prev, which is
+ * the page at @prev_index, in order to skip the page cache lookup. Holding
+ * the reference to @prev prevents the huge page from being split.
+ */
+static struct page *sgx_encl_next_backing_page(struct page *prev,
+					       pgoff_t prev_index,
+					       pgoff_t index)
+{
+	struct page *head = compound_head(prev);
+	pgoff_t head_index = prev_index - (prev - head);
+	struct page *page;
+
+	if (index < head_index || index >= head_index + thp_nr_pages(head))
+		return NULL;
+
+	page = head + (index - head_index);
+	get_page(page);
+
+	return page;
+}
+
+/**
+ * sgx_encl_get_backing_batch() - Pin the backing storage for multiple pages
+ * @encl:	an enclave pointer
+ * @backing:	an array of backings with the page index filled in
+ * @nr:		the number of entries in @backing
+ *
+ * Pin the backing storage pages for a batch of enclave pages, in the same
+ * manner as sgx_encl_get_backing(), but only look up a backing page from the
+ * page cache when the previous entry does not share it. With the entries sorted
+ * by page index, a single PCMD page then covers 32 consecutive enclave pages,
+ * and a huge shmem page up to 512 entries.
+ *
+ * Return: the number of pinned entries, which is less than @nr if pinning
+ *	   the storage for the following entry failed
+ */
+int sgx_encl_get_backing_batch(struct sgx_encl *encl,
+			       struct sgx_backing *backing, int nr)
+{
+	struct sgx_backing *prev = NULL;
+	pgoff_t pcmd_index, prev_pcmd_index = 0;
+	struct page *contents, *pcmd;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		pgoff_t page_index = backing[i].page_index;
+
+		pcmd_index = PFN_DOWN(encl->size) + 1 + (page_index >> 5);
+
+		contents = prev ? sgx_encl_next_backing_page(prev->contents,
+							     prev->page_index,
+							     page_index) : NULL;
+		if (!contents) {
+			contents = sgx_encl_get_backing_page(encl, page_index);
+			if (IS_ERR(contents))
+				break;
+		}
+
+		pcmd = prev ? sgx_encl_next_backing_page(prev->pcmd,
+							 prev_pcmd_index,
+							 pcmd_index) : NULL;
+		if (!pcmd) {
+			pcmd = sgx_encl_get_backing_page(encl, pcmd_index);
+			if (IS_ERR(pcmd)) {
+				put_page(contents);
+				break;
+			}
+		}
+
+		backing[i].contents = contents;
+		backing[i].pcmd = pcmd;
+		backing[i].pcmd_offset =
+			(page_index & (PAGE_SIZE / sizeof(struct sgx_pcmd) - 1)) *
+			sizeof(struct sgx_pcmd);
+
+		prev = &backing[i];
+		prev_pcmd_index = pcmd_index;
+	}
+
+	return i;
+}
+
 /**
  * sgx_encl_put_backing() - Unpin the backing storage
  * @backing:	data for accessing backing storage for the page
@@ -670,6 +1071,8 @@ int sgx_encl_test_and_clear_young(struct mm_struct *mm,
 
 /**
  * sgx_alloc_va_page() - Allocate a Version Array (VA) page
+ * @reclaim:	reclaim EPC pages directly if none available, see
+ *		sgx_alloc_epc_page()
  *
  * Allocate a free EPC page and convert it to a Version Array (VA) page.
  *
@@ -677,12 +1080,12 @@ int sgx_encl_test_and_clear_young(struct mm_struct *mm,
  *   a VA page,
  *   -errno otherwise
  */
-struct sgx_epc_page *sgx_alloc_va_page(void)
+struct sgx_epc_page *sgx_alloc_va_page(bool reclaim)
 {
 	struct sgx_epc_page *epc_page;
 	int ret;
 
-	epc_page = sgx_alloc_epc_page(NULL, true);
+	epc_page = sgx_alloc_epc_page(NULL, reclaim);
 	if (IS_ERR(epc_page))
 		return ERR_CAST(epc_page);
 
@@ -738,3 +1141,167 @@ bool sgx_va_page_full(struct sgx_va_page *va_page)
 
 	return slot == SGX_VA_SLOT_COUNT;
 }
+
+/**
+ * sgx_encl_reserve_va_slots() - Reserve VA slots for evicting enclave pages
+ * @encl:	an enclave pointer
+ * @nr:		the number of slots
+ *
+ * The VA pages of an enclave are allocated on demand, when its pages get
+ * evicted, instead of one per SGX_VA_SLOT_COUNT added pages, as most of the
+ * enclave pages are never evicted. Reserve up to @nr slots for EWB, allocating
+ * new VA pages without reclaim, when the VA pages of the enclave do not have
+ * enough free slots. When the EPC is exhausted, the VA pages are taken from the
+ * reclaimer's reserve, see sgx_take_reserved_va_page(). The reserved slots are
+ * taken by sgx_encl_alloc_va_slot() and must be returned with
+ * sgx_encl_unreserve_va_slots() when not used.
+ *
+ * Must be called with encl->lock held.
+ *
+ * Return: the number of reserved slots
+ */
+unsigned int sgx_encl_reserve_va_slots(struct sgx_encl *encl, unsigned int nr)
+{
+	struct sgx_va_page *va_page;
+
+	while (encl->va_free_slots - encl->va_reserved_slots < nr) {
+		va_page = kzalloc(sizeof(*va_page), GFP_KERNEL);
+		if (!va_page)
+			break;
+
+		va_page->epc_page = sgx_alloc_va_page(false);
+		if (IS_ERR(va_page->epc_page))
+			va_page->epc_page = sgx_take_reserved_va_page();
+		if (!va_page->epc_page) {
+			kfree(va_page);
+			break;
+		}
+
+		list_add(&va_page->list, &encl->va_pages);
+		encl->va_free_slots += SGX_VA_SLOT_COUNT;
+	}
+
+	nr = min(nr, encl->va_free_slots - encl->va_reserved_slots);
+	encl->va_reserved_slots += nr;
+
+	return nr;
+}
+
+/**
+ * sgx_encl_unreserve_va_slots() - Undo sgx_encl_reserve_va_slots()
+ * @encl:	an enclave pointer
+ * @nr:		the number of unused slots
+ *
+ * Must be called with encl->lock held.
+ */
+void sgx_encl_unreserve_va_slots(struct sgx_encl *encl, unsigned int nr)
+{
+	WARN_ON_ONCE(encl->va_reserved_slots < nr);
+	encl->va_reserved_slots -= nr;
+}
+
+/**
+ * sgx_encl_alloc_va_slot() - Take a reserved VA slot
+ * @encl:	an enclave pointer
+ * @va_offset:	offset of the slot inside the VA page
+ *
+ * Must be called with encl->lock held.
+ *
+ * Return: the VA page of the slot
+ */
+struct sgx_va_page *sgx_encl_alloc_va_slot(struct sgx_encl *encl,
+					   unsigned int *va_offset)
+{
+	struct sgx_va_page *va_page;
+
+	BUILD_BUG_ON(SGX_VA_SLOT_COUNT !=
+		(SGX_ENCL_PAGE_VA_OFFSET_MASK >> 3) + 1);
+
+	WARN_ON_ONCE(!encl->va_reserved_slots);
+
+	va_page = list_first_entry(&encl->va_pages, struct sgx_va_page, list);
+	*va_offset = sgx_alloc_va_slot(va_page);
+	if (sgx_va_page_full(va_page))
+		list_move_tail(&va_page->list, &encl->va_pages);
+
+	encl->va_free_slots--;
+	encl->va_reserved_slots--;
+
+	return va_page;
+}
+
+/**
+ * sgx_encl_free_va_slot() - Free a VA slot
+ * @encl:	an enclave pointer
+ * @va_page:	the VA page of the slot
+ * @va_offset:	offset of the slot inside the VA page
+ *
+ * Free the slot and move the VA page to the head of the list, so that its slots
+ * get reused first. A VA page, which becomes empty, is freed when the other VA
+ * pages have at least a VA page worth of free slots left, which are not
+ * reserved, i.e. a single spare VA page is kept in order to not allocate and
+ * free a VA page all over again when a page is evicted and loaded back in a
+ * loop.
+ *
+ * Must be called with encl->lock held.
+ */
+void sgx_encl_free_va_slot(struct sgx_encl *encl, struct sgx_va_page *va_page,
+			   unsigned int va_offset)
+{
+	sgx_free_va_slot(va_page, va_offset);
+	encl->va_free_slots++;
+
+	if (bitmap_empty(va_page->slots, SGX_VA_SLOT_COUNT) &&
+	    encl->va_free_slots >=
+	    encl->va_reserved_slots + 2 * SGX_VA_SLOT_COUNT) {
+		list_del(&va_page->list);
+		sgx_free_epc_page(va_page->epc_page);
+		kfree(va_page);
+		encl->va_free_slots -= SGX_VA_SLOT_COUNT;
+		return;
+	}
+
+	list_move(&va_page->list, &encl->va_pages);
+}
+
+/**
+ * sgx_encl_page_alloc() - Allocate an enclave page
+ * @encl:		an enclave pointer
+ * @offset:		offset of the page inside the enclave
+ * @secinfo_flags:	SECINFO flags, which define the maximum permissions
+ *
+ * Return:
+ *   an enclave page,
+ *   -errno otherwise
+ */
+struct sgx_encl_page *sgx_encl_page_alloc(struct sgx_encl *encl,
+					  unsigned long offset,
+					  u64 secinfo_flags)
+{
+	struct sgx_encl_page *encl_page;
+	unsigned long prot;
+
+	encl_page = kzalloc(sizeof(*encl_page), GFP_KERNEL);
+	if (!encl_page)
+		return ERR_PTR(-ENOMEM);
+
+	encl_page->desc = encl->base + offset;
+	encl_page->encl = encl;
+
+	prot = _calc_vm_trans(secinfo_flags, SGX_SECINFO_R, PROT_READ)  |
+	       _calc_vm_trans(secinfo_flags, SGX_SECINFO_W, PROT_WRITE) |
+	       _calc_vm_trans(secinfo_flags, SGX_SECINFO_X, PROT_EXEC);
+
+	/*
+	 * TCS pages must always RW set for CPU access while the SECINFO
+	 * permissions are *always* zero - the CPU ignores the user provided
+	 * values and silently overwrites them with zero permissions.
+	 */
+	if ((secinfo_flags & SGX_SECINFO_PAGE_TYPE_MASK) == SGX_SECINFO_TCS)
+		prot |= PROT_READ | PROT_WRITE;
+
+	/* Calculate maximum of the VM flags for the page. */
+	encl_page->vm_max_prot_bits = calc_vm_prot_bits(prot, 0);
+
+	return encl_page;
+}
@@ -40,11 +40,30 @@ enum sgx_encl_flags {
 	SGX_ENCL_INITIALIZED	= BIT(3),
 };
 
+/*
+ * @mapped is set before the first PTE of the enclave is created in @mm, by the
+ * fault handler, or by sgx_vma_open() for PTEs copied on fork(). Until then
+ * no thread of @mm can have entered the enclave, as EENTER requires the TCS
+ * page to be mapped, and thus @mm can be skipped on an ETRACK shootdown.
+ */
 struct sgx_encl_mm {
 	struct sgx_encl *encl;
 	struct mm_struct *mm;
 	struct list_head list;
 	struct mmu_notifier mmu_notifier;
+	bool mapped;
+};
+
+/*
+ * Paging statistics of an enclave, protected by encl->lock. @nr_not_tracked
+ * counts the EWB's, which failed with SGX_NOT_TRACKED and needed to be retried
+ * after ETRACK or IPI's, and @eldu_ns sums up the latency of the ELDU's.
+ */
+struct sgx_encl_stats {
+	unsigned long nr_evicted;
+	unsigned long nr_loaded;
+	unsigned long nr_not_tracked;
+	u64 eldu_ns;
 };
 
 struct sgx_encl {
@@ -63,14 +82,25 @@ struct sgx_encl {
 	struct file *backing;
 	struct kref refcount;
 	struct list_head va_pages;
+	unsigned int va_free_slots;
+	unsigned int va_reserved_slots;
 	unsigned long mm_list_version;
 	struct list_head mm_list;
 	spinlock_t mm_lock;
 	struct srcu_struct srcu;
+	struct sgx_encl_stats stats;
+	struct list_head list;
+	unsigned long ra_next;
+	unsigned int ra_pages;
+	struct work_struct release_work;
 };
 
 #define SGX_VA_SLOT_COUNT 512
 
+/* The bounds of the readahead window of the evicted enclave pages. */
+#define SGX_ENCL_RA_MIN_PAGES	4
+#define SGX_ENCL_RA_MAX_PAGES	64
+
 struct sgx_va_page {
 	struct sgx_epc_page *epc_page;
 	DECLARE_BITMAP(slots, SGX_VA_SLOT_COUNT);
@@ -104,18 +134,33 @@ static inline int sgx_encl_find(struct mm_struct *mm, unsigned long addr,
 
 int sgx_encl_may_map(struct sgx_encl *encl, unsigned long start,
 		     unsigned long end, unsigned long vm_flags);
+int sgx_encl_reload_page(struct sgx_encl *encl, struct sgx_encl_page *entry,
+			 int nid);
 
 void sgx_encl_release(struct kref *ref);
+void sgx_encl_list_add(struct sgx_encl *encl);
+void sgx_encl_debugfs_init(void);
 int sgx_encl_mm_add(struct sgx_encl *encl, struct mm_struct *mm);
 int sgx_encl_get_backing(struct sgx_encl *encl, unsigned long page_index,
 			 struct sgx_backing *backing);
+int sgx_encl_get_backing_batch(struct sgx_encl *encl,
+			       struct sgx_backing *backing, int nr);
 void sgx_encl_put_backing(struct sgx_backing *backing, bool do_write);
 int sgx_encl_test_and_clear_young(struct mm_struct *mm,
 				  struct sgx_encl_page *page);
 
-struct sgx_epc_page *sgx_alloc_va_page(void);
+struct sgx_epc_page *sgx_alloc_va_page(bool reclaim);
 unsigned int sgx_alloc_va_slot(struct sgx_va_page *va_page);
 void sgx_free_va_slot(struct sgx_va_page *va_page, unsigned int offset);
 bool sgx_va_page_full(struct sgx_va_page *va_page);
+unsigned int sgx_encl_reserve_va_slots(struct sgx_encl *encl, unsigned int nr);
+void sgx_encl_unreserve_va_slots(struct sgx_encl *encl, unsigned int nr);
+struct sgx_va_page *sgx_encl_alloc_va_slot(struct sgx_encl *encl,
+					   unsigned int *va_offset);
+void sgx_encl_free_va_slot(struct sgx_encl *encl, struct sgx_va_page *va_page,
+			   unsigned int va_offset);
+struct sgx_encl_page *sgx_encl_page_alloc(struct sgx_encl *encl,
+					  unsigned long offset,
+					  u64 secinfo_flags);
 
 #endif /* _X86_ENCL_H */
@@ -0,0 +1,302 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * EPC controller for cgroups.
+ *
+ * Accounts the EPC pages allocated by the tasks of a cgroup and enforces the
+ * limit set in sgx_epc.max, which is not available in the root cgroup. The
+ * limit is hierarchical, i.e. the most stringent limit in the hierarchy is
+ * followed, and sgx_epc.current of a cgroup includes the pages charged to its
+ * descendants.
+ *
+ * When a charge would exceed the limit of a cgroup, the pages charged to that
+ * cgroup and its descendants are reclaimed, either directly by the allocating
+ * task or asynchronously from a work item, when the task can't reclaim. The
+ * allocation fails with -ENOMEM, if the cgroup does not have any reclaimable
+ * pages, e.g. when its usage consists of virtual EPC.
+ *
+ * Copyright(c) 2021 Intel Corporation.
+ */
+
+#include <linux/atomic.h>
+#include <linux/kernel.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include "epc_cgroup.h"
+
+static struct sgx_epc_cgroup *sgx_epc_root_cgroup;
+
+static inline struct sgx_epc_cgroup *
+sgx_epc_cgroup_from_css(struct cgroup_subsys_state *css)
+{
+	return container_of(css, struct sgx_epc_cgroup, css);
+}
+
+static inline bool sgx_epc_cgroup_is_root(struct sgx_epc_cgroup *epc_cg)
+{
+	return epc_cg == sgx_epc_root_cgroup;
+}
+
+/**
+ * sgx_epc_cgroup_iter() - Iterate over a cgroup hierarchy
+ * @prev:	the previously returned cgroup, or NULL for the first one
+ * @root:	the root of the hierarchy, or NULL for the whole hierarchy
+ *
+ * Return @root and its descendants in pre-order, one at a time. A reference is
+ * held for the returned cgroup until it is passed back in @prev. Use
+ * sgx_epc_cgroup_iter_break() to terminate the walk early.
+ *
+ * Return: the next cgroup, or NULL when the walk is complete
+ */
+struct sgx_epc_cgroup *sgx_epc_cgroup_iter(struct sgx_epc_cgroup *prev,
+					   struct sgx_epc_cgroup *root)
+{
+	struct cgroup_subsys_state *pos = prev ? &prev->css : NULL;
+
+	if (!root)
+		root = sgx_epc_root_cgroup;
+
+	rcu_read_lock();
+	do {
+		pos = css_next_descendant_pre(pos, &root->css);
+	} while (pos && !css_tryget(pos));
+	rcu_read_unlock();
+
+	if (prev)
+		css_put(&prev->css);
+
+	return pos ? sgx_epc_cgroup_from_css(pos) : NULL;
+}
+
+/**
+ * sgx_epc_cgroup_iter_break() - Terminate sgx_epc_cgroup_iter() walk early
+ * @prev:	the last cgroup returned by sgx_epc_cgroup_iter()
+ */
+void sgx_epc_cgroup_iter_break(struct sgx_epc_cgroup *prev)
+{
+	if (prev)
+		css_put(&prev->css);
+}
+
+/*
+ * Check whether @root and its descendants are out of reclaimable pages. Pages
+ * isolated by the reclaimer at the moment are not counted.
+ */
+static bool sgx_epc_cgroup_lru_empty(struct sgx_epc_cgroup *root)
+{
+	struct cgroup_subsys_state *css;
+	struct sgx_epc_cgroup *epc_cg;
+	bool empty = true;
+	int nid;
+
+	rcu_read_lock();
+	css_for_each_descendant_pre(css, &root->css) {
+		epc_cg = sgx_epc_cgroup_from_css(css);
+
+		for (nid = 0; nid < nr_node_ids && empty; nid++)
+			empty = !sgx_epc_lru_size(&epc_cg->lru[nid]);
+
+		if (!empty)
+			break;
+	}
+	rcu_read_unlock();
+
+	return empty;
+}
+
+static void sgx_epc_cgroup_reclaim_work_func(struct work_struct *work)
+{
+	struct sgx_epc_cgroup *epc_cg = container_of(work, struct sgx_epc_cgroup,
+						     reclaim_work);
+
+	/* Make some room below the limit, so that the next charges succeed. */
+	while (page_counter_read(&epc_cg->pc) + SGX_NR_TO_SCAN >
+	       READ_ONCE(epc_cg->pc.max)) {
+		if (!sgx_reclaim_epc_cgroup(epc_cg))
+			break;
+
+		cond_resched();
+	}
+
+	css_put(&epc_cg->css);
+}
+
+static void sgx_epc_cgroup_queue_reclaim(struct sgx_epc_cgroup *epc_cg)
+{
+	css_get(&epc_cg->css);
+
+	if (!queue_work(system_freezable_wq, &epc_cg->reclaim_work))
+		css_put(&epc_cg->css);
+}
+
+/**
+ * sgx_epc_cgroup_try_charge() - Charge an EPC page to the current cgroup
+ * @reclaim:	reclaim pages of the cgroup if the charge would exceed the limit
+ *
+ * Charge a page to the EPC cgroup of the current task. When a limit in the
+ * hierarchy would be exceeded, reclaim from the cgroup that hit the limit.
+ * If @reclaim is false, the reclaim is left to a work item and -EBUSY is
+ * returned so that the caller can retry. No mm's can be locked by the caller
+ * when @reclaim is set to true.
+ *
+ * Return:
+ *   the charged cgroup, which must be passed to sgx_epc_cgroup_uncharge(),
+ *   NULL, if nothing was charged, i.e. for the tasks of the root cgroup,
+ *   -errno on error
+ */
+struct sgx_epc_cgroup *sgx_epc_cgroup_try_charge(bool reclaim)
+{
+	struct sgx_epc_cgroup *epc_cg, *over;
+	struct page_counter *fail;
+	int ret;
+
+	if (!cgroup_subsys_enabled(sgx_epc_cgrp_subsys))
+		return NULL;
+
+	epc_cg = sgx_epc_cgroup_from_css(task_get_css(current,
+						      sgx_epc_cgrp_id));
+	if (sgx_epc_cgroup_is_root(epc_cg)) {
+		css_put(&epc_cg->css);
+		return NULL;
+	}
+
+	for ( ; ; ) {
+		if (page_counter_try_charge(&epc_cg->pc, 1, &fail))
+			return epc_cg;
+
+		over = container_of(fail, struct sgx_epc_cgroup, pc);
+
+		if (sgx_epc_cgroup_lru_empty(over)) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		if (!reclaim) {
+			sgx_epc_cgroup_queue_reclaim(over);
+			ret = -EBUSY;
+			break;
+		}
+
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+
+		sgx_reclaim_epc_cgroup(over);
+		cond_resched();
+	}
+
+	css_put(&epc_cg->css);
+	return ERR_PTR(ret);
+}
+
+/**
+ * sgx_epc_cgroup_uncharge() - Uncharge an EPC page
+ * @epc_cg:	the cgroup returned by sgx_epc_cgroup_try_charge()
+ */
+void sgx_epc_cgroup_uncharge(struct sgx_epc_cgroup *epc_cg)
+{
+	if (!epc_cg)
+		return;
+
+	page_counter_uncharge(&epc_cg->pc, 1);
+	css_put(&epc_cg->css);
+}
+
+static u64 sgx_epc_current_read(struct cgroup_subsys_state *css,
+				struct cftype *cft)
+{
+	struct sgx_epc_cgroup *epc_cg = sgx_epc_cgroup_from_css(css);
+
+	return (u64)page_counter_read(&epc_cg->pc) * PAGE_SIZE;
+}
+
+static int sgx_epc_max_show(struct seq_file *sf, void *v)
+{
+	struct sgx_epc_cgroup *epc_cg = sgx_epc_cgroup_from_css(seq_css(sf));
+	unsigned long max = READ_ONCE(epc_cg->pc.max);
+
+	if (max == PAGE_COUNTER_MAX)
+		seq_puts(sf, "max\n");
+	else
+		seq_printf(sf, "%llu\n", (u64)max * PAGE_SIZE);
+
+	return 0;
+}
+
+static ssize_t sgx_epc_max_write(struct kernfs_open_file *of, char *buf,
+				 size_t nbytes, loff_t off)
+{
+	struct sgx_epc_cgroup *epc_cg = sgx_epc_cgroup_from_css(of_css(of));
+	unsigned long max;
+	int ret;
+
+	buf = strstrip(buf);
+	ret = page_counter_memparse(buf, "max", &max);
+	if (ret)
+		return ret;
+
+	xchg(&epc_cg->pc.max, max);
+
+	/* Shrink the usage down to the new limit, as far as it's possible. */
+	while (page_counter_read(&epc_cg->pc) > max) {
+		if (signal_pending(current))
+			break;
+
+		if (!sgx_reclaim_epc_cgroup(epc_cg))
+			break;
+
+		cond_resched();
+	}
+
+	return nbytes;
+}
+
+static struct cftype sgx_epc_cgroup_files[] = {
+	{
+		.name = "current",
+		.read_u64 = sgx_epc_current_read,
+		.flags = CFTYPE_NOT_ON_ROOT,
+	},
+	{
+		.name = "max",
+		.seq_show = sgx_epc_max_show,
+		.write = sgx_epc_max_write,
+		.flags = CFTYPE_NOT_ON_ROOT,
+	},
+	{ }	/* terminate */
+};
+
+static struct cgroup_subsys_state *
+sgx_epc_css_alloc(struct cgroup_subsys_state *parent)
+{
+	struct sgx_epc_cgroup *epc_cg;
+	int nid;
+
+	epc_cg = kzalloc(struct_size(epc_cg, lru, nr_node_ids), GFP_KERNEL);
+	if (!epc_cg)
+		return ERR_PTR(-ENOMEM);
+
+	page_counter_init(&epc_cg->pc,
+			  parent ? &sgx_epc_cgroup_from_css(parent)->pc : NULL);
+	INIT_WORK(&epc_cg->reclaim_work, sgx_epc_cgroup_reclaim_work_func);
+
+	for (nid = 0; nid < nr_node_ids; nid++)
+		sgx_epc_lru_init(&epc_cg->lru[nid], nid);
+
+	if (!parent)
+		sgx_epc_root_cgroup = epc_cg;
+
+	return &epc_cg->css;
+}
+
+static void sgx_epc_css_free(struct cgroup_subsys_state *css)
+{
+	kfree(sgx_epc_cgroup_from_css(css));
+}
+
+struct cgroup_subsys sgx_epc_cgrp_subsys = {
+	.css_alloc	= sgx_epc_css_alloc,
+	.css_free	= sgx_epc_css_free,
+	.legacy_cftypes	= sgx_epc_cgroup_files,
+	.dfl_cftypes	= sgx_epc_cgroup_files,
+};
@@ -0,0 +1,91 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _X86_SGX_EPC_CGROUP_H
+#define _X86_SGX_EPC_CGROUP_H
+
+#include <linux/cgroup.h>
+#include <linux/page_counter.h>
+#include <linux/workqueue.h>
+#include "sgx.h"
+
+#ifdef CONFIG_CGROUP_SGX_EPC
+
+/*
+ * The EPC pages charged to a cgroup are kept on its own, per node LRUs so that
+ * the limit of the cgroup is enforced by reclaiming its own pages, and the
+ * pages of its descendants, instead of the ones of whoever else sits at the
+ * head of a shared list.
+ */
+struct sgx_epc_cgroup {
+	struct cgroup_subsys_state css;
+	struct page_counter pc;
+	struct work_struct reclaim_work;
+	struct sgx_epc_lru lru[];
+};
+
+static inline struct sgx_epc_cgroup *
+sgx_epc_page_cgroup(struct sgx_epc_page *page)
+{
+	return page->epc_cg;
+}
+
+static inline void sgx_epc_page_set_cgroup(struct sgx_epc_page *page,
+					   struct sgx_epc_cgroup *epc_cg)
+{
+	page->epc_cg = epc_cg;
+}
+
+static inline struct sgx_epc_lru *
+sgx_epc_cgroup_lru(struct sgx_epc_cgroup *epc_cg, int nid)
+{
+	return &epc_cg->lru[nid];
+}
+
+struct sgx_epc_cgroup *sgx_epc_cgroup_try_charge(bool reclaim);
+void sgx_epc_cgroup_uncharge(struct sgx_epc_cgroup *epc_cg);
+struct sgx_epc_cgroup *sgx_epc_cgroup_iter(struct sgx_epc_cgroup *prev,
+					   struct sgx_epc_cgroup *root);
+void sgx_epc_cgroup_iter_break(struct sgx_epc_cgroup *prev);
+
+#else /* CONFIG_CGROUP_SGX_EPC */
+
+struct sgx_epc_cgroup;
+
+static inline struct sgx_epc_cgroup *
+sgx_epc_page_cgroup(struct sgx_epc_page *page)
+{
+	return NULL;
+}
+
+static inline void sgx_epc_page_set_cgroup(struct sgx_epc_page *page,
+					   struct sgx_epc_cgroup *epc_cg)
+{
+}
+
+static inline struct sgx_epc_lru *
+sgx_epc_cgroup_lru(struct sgx_epc_cgroup *epc_cg, int nid)
+{
+	return NULL;
+}
+
+static inline struct sgx_epc_cgroup *sgx_epc_cgroup_try_charge(bool reclaim)
+{
+	return NULL;
+}
+
+static inline void sgx_epc_cgroup_uncharge(struct sgx_epc_cgroup *epc_cg)
+{
+}
+
+static inline struct sgx_epc_cgroup *
+sgx_epc_cgroup_iter(struct sgx_epc_cgroup *prev, struct sgx_epc_cgroup *root)
+{
+	return NULL;
+}
+
+static inline void sgx_epc_cgroup_iter_break(struct sgx_epc_cgroup *prev)
+{
+}
+
+#endif /* CONFIG_CGROUP_SGX_EPC */
+
+#endif /* _X86_SGX_EPC_CGROUP_H */
@@ -17,69 +17,29 @@
 #include "encl.h"
 #include "encls.h"
 
-static struct sgx_va_page *sgx_encl_grow(struct sgx_encl *encl)
-{
-	struct sgx_va_page *va_page = NULL;
-	void *err;
-
-	BUILD_BUG_ON(SGX_VA_SLOT_COUNT !=
-		(SGX_ENCL_PAGE_VA_OFFSET_MASK >> 3) + 1);
-
-	if (!(encl->page_cnt % SGX_VA_SLOT_COUNT)) {
-		va_page = kzalloc(sizeof(*va_page), GFP_KERNEL);
-		if (!va_page)
-			return ERR_PTR(-ENOMEM);
-
-		va_page->epc_page = sgx_alloc_va_page();
-		if (IS_ERR(va_page->epc_page)) {
-			err = ERR_CAST(va_page->epc_page);
-			kfree(va_page);
-			return err;
-		}
-
-		WARN_ON_ONCE(encl->page_cnt % SGX_VA_SLOT_COUNT);
-	}
-	encl->page_cnt++;
-	return va_page;
-}
-
-static void sgx_encl_shrink(struct sgx_encl *encl, struct sgx_va_page *va_page)
-{
-	encl->page_cnt--;
-
-	if (va_page) {
-		sgx_free_epc_page(va_page->epc_page);
-		list_del(&va_page->list);
-		kfree(va_page);
-	}
-}
-
 static int sgx_encl_create(struct sgx_encl *encl, struct sgx_secs *secs)
 {
 	struct sgx_epc_page *secs_epc;
-	struct sgx_va_page *va_page;
 	struct sgx_pageinfo pginfo;
 	struct sgx_secinfo secinfo;
 	unsigned long encl_size;
 	struct file *backing;
 	long ret;
 
-	va_page = sgx_encl_grow(encl);
-	if (IS_ERR(va_page))
-		return PTR_ERR(va_page);
-	else if (va_page)
-		list_add(&va_page->list, &encl->va_pages);
-	/* else the tail page of the VA page list had free slots. */
-
 	/* The extra page goes to SECS. */
 	encl_size = secs->size + PAGE_SIZE;
 
-	backing = shmem_file_setup("SGX backing", encl_size + (encl_size >> 5),
-				   VM_NORESERVE);
-	if (IS_ERR(backing)) {
-		ret = PTR_ERR(backing);
-		goto err_out_shrink;
-	}
+	if (sgx_backing_mnt)
+		backing = shmem_file_setup_with_mnt(sgx_backing_mnt,
+						    "SGX backing",
+						    encl_size + (encl_size >> 5),
+						    VM_NORESERVE);
+	else
+		backing = shmem_file_setup("SGX backing",
+					   encl_size + (encl_size >> 5),
+					   VM_NORESERVE);
+	if (IS_ERR(backing))
+		return PTR_ERR(backing);
 
 	encl->backing = backing;
 
@@ -111,6 +71,7 @@ static int sgx_encl_create(struct sgx_encl *encl, struct sgx_secs *secs)
 	encl->size = secs->size;
 	encl->attributes = secs->attributes;
 	encl->attributes_mask = SGX_ATTR_DEBUG | SGX_ATTR_MODE64BIT | SGX_ATTR_KSS;
+	encl->page_cnt = 1;
 
 	/* Set only after completion, as encl->lock has not been taken. */
 	set_bit(SGX_ENCL_CREATED, &encl->flags);
@@ -125,9 +86,6 @@ static int sgx_encl_create(struct sgx_encl *encl, struct sgx_secs *secs)
 	fput(encl->backing);
 	encl->backing = NULL;
 
-err_out_shrink:
-	sgx_encl_shrink(encl, va_page);
-
 	return ret;
 }
 
@@ -168,38 +126,6 @@ static long sgx_ioc_enclave_create(struct sgx_encl *encl, void __user *arg)
 	return ret;
 }
 
-static struct sgx_encl_page *sgx_encl_page_alloc(struct sgx_encl *encl,
-						 unsigned long offset,
-						 u64 secinfo_flags)
-{
-	struct sgx_encl_page *encl_page;
-	unsigned long prot;
-
-	encl_page = kzalloc(sizeof(*encl_page), GFP_KERNEL);
-	if (!encl_page)
-		return ERR_PTR(-ENOMEM);
-
-	encl_page->desc = encl->base + offset;
-	encl_page->encl = encl;
-
-	prot = _calc_vm_trans(secinfo_flags, SGX_SECINFO_R, PROT_READ)  |
-	       _calc_vm_trans(secinfo_flags, SGX_SECINFO_W, PROT_WRITE) |
-	       _calc_vm_trans(secinfo_flags, SGX_SECINFO_X, PROT_EXEC);
-
-	/*
-	 * TCS pages must always RW set for CPU access while the SECINFO
-	 * permissions are *always* zero - the CPU ignores the user provided
-	 * values and silently overwrites them with zero permissions.
-	 */
-	if ((secinfo_flags & SGX_SECINFO_PAGE_TYPE_MASK) == SGX_SECINFO_TCS)
-		prot |= PROT_READ | PROT_WRITE;
-
-	/* Calculate maximum of the VM flags for the page. */
-	encl_page->vm_max_prot_bits = calc_vm_prot_bits(prot, 0);
-
-	return encl_page;
-}
-
 static int sgx_validate_secinfo(struct sgx_secinfo *secinfo)
 {
 	u64 perm = secinfo->flags & SGX_SECINFO_PERMISSION_MASK;
@@ -230,25 +156,12 @@ static int sgx_validate_secinfo(struct sgx_secinfo *secinfo)
 static int __sgx_encl_add_page(struct sgx_encl *encl,
 			       struct sgx_encl_page *encl_page,
 			       struct sgx_epc_page *epc_page,
-			       struct sgx_secinfo *secinfo, unsigned long src)
+			       struct sgx_secinfo *secinfo,
+			       struct page *src_page)
 {
 	struct sgx_pageinfo pginfo;
-	struct vm_area_struct *vma;
-	struct page *src_page;
 	int ret;
 
-	/* Deny noexec. */
-	vma = find_vma(current->mm, src);
-	if (!vma)
-		return -EFAULT;
-
-	if (!(vma->vm_flags & VM_MAYEXEC))
-		return -EACCES;
-
-	ret = get_user_pages(src, 1, 0, &src_page, NULL);
-	if (ret < 1)
-		return -EFAULT;
-
 	pginfo.secs = (unsigned long)sgx_get_epc_virt_addr(encl->secs.epc_page);
 	pginfo.addr = encl_page->desc & PAGE_MASK;
 	pginfo.metadata = (unsigned long)secinfo;
@@ -257,7 +170,6 @@ static int __sgx_encl_add_page(struct sgx_encl *encl,
 	ret = __eadd(&pginfo, sgx_get_epc_virt_addr(epc_page));
 
 	kunmap_atomic((void *)pginfo.contents);
-	put_page(src_page);
 
 	return ret ? -EIO : 0;
 }
@@ -287,89 +199,135 @@ static int __sgx_encl_extend(struct sgx_encl *encl,
 	return 0;
 }
 
-static int sgx_encl_add_page(struct sgx_encl *encl, unsigned long src,
-			     unsigned long offset, struct sgx_secinfo *secinfo,
-			     unsigned long flags)
+/*
+ * Add a batch of up to SGX_ADD_PAGES_BATCH pages. EPC pages, enclave pages and
+ * VA pages are allocated up front, the source pages are pinned with a single
+ * get_user_pages() call, and EADD/EEXTEND for the whole batch run under a
+ * single acquisition of mmap_lock and encl->lock.
+ *
+ * EADD and EEXTEND extend MRENCLAVE and therefore must be executed strictly in
+ * the order of the pages, regardless of whether a page is measured or not.
+ * The measurement is computed by the CPU and checked by EINIT, so it can't be
+ * carried over from an identical enclave, and neither can the EPC pages, which
+ * belong to a single SECS.  Launching N instances of an enclave costs N times
+ * the EADDs and EEXTENDs.
+ *
+ * Return: the number of pages added, and the error that stopped the batch in
+ * @err, if any.
+ */
+static unsigned long sgx_encl_add_pages(struct sgx_encl *encl,
+					unsigned long src, unsigned long offset,
+					unsigned long nr_pages,
+					struct sgx_secinfo *secinfo,
+					unsigned long flags, int *err)
 {
-	struct sgx_encl_page *encl_page;
-	struct sgx_epc_page *epc_page;
-	struct sgx_va_page *va_page;
-	int ret;
-
-	encl_page = sgx_encl_page_alloc(encl, offset, secinfo->flags);
-	if (IS_ERR(encl_page))
-		return PTR_ERR(encl_page);
+	struct sgx_encl_page *encl_page[SGX_ADD_PAGES_BATCH];
+	struct sgx_epc_page *epc_page[SGX_ADD_PAGES_BATCH];
+	struct vm_area_struct *vmas[SGX_ADD_PAGES_BATCH];
+	struct page *src_page[SGX_ADD_PAGES_BATCH];
+	unsigned long nr_alloc, nr_pinned, i;
+	long pinned;
+	int ret = 0;
+
+	nr_pages = min_t(unsigned long, nr_pages, SGX_ADD_PAGES_BATCH);
+
+	for (nr_alloc = 0; nr_alloc < nr_pages; nr_alloc++) {
+		encl_page[nr_alloc] = sgx_encl_page_alloc(encl,
+							  offset + nr_alloc * PAGE_SIZE,
+							  secinfo->flags);
+		if (IS_ERR(encl_page[nr_alloc])) {
+			ret = PTR_ERR(encl_page[nr_alloc]);
+			break;
+		}
 
-	epc_page = sgx_alloc_epc_page(encl_page, true);
-	if (IS_ERR(epc_page)) {
-		kfree(encl_page);
-		return PTR_ERR(epc_page);
+		epc_page[nr_alloc] = sgx_alloc_epc_page(encl_page[nr_alloc], true);
+		if (IS_ERR(epc_page[nr_alloc])) {
+			ret = PTR_ERR(epc_page[nr_alloc]);
+			kfree(encl_page[nr_alloc]);
+			break;
+		}
 	}
 
-	va_page = sgx_encl_grow(encl);
-	if (IS_ERR(va_page)) {
-		ret = PTR_ERR(va_page);
-		goto err_out_free;
-	}
+	/* Add the pages that were successfully allocated, if any. */
+	nr_pages = nr_alloc;
+	*err = ret;
 
 	mmap_read_lock(current->mm);
+
+	pinned = nr_pages ? get_user_pages(src, nr_pages, 0, src_page, vmas) : 0;
+	nr_pinned = pinned > 0 ? pinned : 0;
+	if (nr_pinned < nr_pages && !*err)
+		*err = -EFAULT;
+
 	mutex_lock(&encl->lock);
 
-	/*
-	 * Adding to encl->va_pages must be done under encl->lock.  Ditto for
-	 * deleting (via sgx_encl_shrink()) in the error path.
-	 */
-	if (va_page)
-		list_add(&va_page->list, &encl->va_pages);
+	for (i = 0; i < nr_pinned; i++) {
+		/* Deny noexec. */
+		if (!(vmas[i]->vm_flags & VM_MAYEXEC)) {
+			ret = -EACCES;
+			break;
+		}
 
-	/*
-	 * Insert prior to EADD in case of OOM.  EADD modifies MRENCLAVE, i.e.
-	 * can't be gracefully unwound, while failure on EADD/EXTEND is limited
-	 * to userspace errors (or kernel/hardware bugs).
-	 */
-	ret = xa_insert(&encl->page_array, PFN_DOWN(encl_page->desc),
-			encl_page, GFP_KERNEL);
-	if (ret)
-		goto err_out_unlock;
+		/*
+		 * Insert prior to EADD in case of OOM.  EADD modifies
+		 * MRENCLAVE, i.e. can't be gracefully unwound, while failure
+		 * on EADD/EXTEND is limited to userspace errors (or
+		 * kernel/hardware bugs).
+		 */
+		ret = xa_insert(&encl->page_array, PFN_DOWN(encl_page[i]->desc),
+				encl_page[i], GFP_KERNEL);
+		if (ret)
+			break;
 
-	ret = __sgx_encl_add_page(encl, encl_page, epc_page, secinfo,
-				  src);
-	if (ret)
-		goto err_out;
+		ret = __sgx_encl_add_page(encl, encl_page[i], epc_page[i],
+					  secinfo, src_page[i]);
+		if (ret) {
+			xa_erase(&encl->page_array, PFN_DOWN(encl_page[i]->desc));
+			break;
+		}
 
-	/*
-	 * Complete the "add" before doing the "extend" so that the "add"
-	 * isn't in a half-baked state in the extremely unlikely scenario
-	 * the enclave will be destroyed in response to EEXTEND failure.
-	 */
-	encl_page->encl = encl;
-	encl_page->epc_page = epc_page;
-	encl->secs_child_cnt++;
+		/*
+		 * Complete the "add" before doing the "extend" so that the
+		 * "add" isn't in a half-baked state in the extremely unlikely
+		 * scenario the enclave will be destroyed in response to EEXTEND
+		 * failure.
+		 */
+		encl_page[i]->encl = encl;
+		encl_page[i]->epc_page = epc_page[i];
+		encl->secs_child_cnt++;
+
+		if (flags & SGX_PAGE_MEASURE) {
+			ret = __sgx_encl_extend(encl, epc_page[i]);
+			if (ret) {
+				xa_erase(&encl->page_array,
+					 PFN_DOWN(encl_page[i]->desc));
+				encl_page[i]->epc_page = NULL;
+				encl->secs_child_cnt--;
+				break;
+			}
+		}
 
-	if (flags & SGX_PAGE_MEASURE) {
-		ret = __sgx_encl_extend(encl, epc_page);
-		if (ret)
-			goto err_out;
+		encl->page_cnt++;
+		sgx_mark_page_reclaimable(encl_page[i]->epc_page);
 	}
 
-	sgx_mark_page_reclaimable(encl_page->epc_page);
-	mutex_unlock(&encl->lock);
-	mmap_read_unlock(current->mm);
-	return ret;
+	if (ret)
+		*err = ret;
 
-err_out:
-	xa_erase(&encl->page_array, PFN_DOWN(encl_page->desc));
+	/* Unwind the pages that were not added. */
+	nr_alloc = i;
+	for (i = nr_pages; i-- > nr_alloc; ) {
+		sgx_free_epc_page(epc_page[i]);
+		kfree(encl_page[i]);
+	}
 
-err_out_unlock:
-	sgx_encl_shrink(encl, va_page);
 	mutex_unlock(&encl->lock);
 	mmap_read_unlock(current->mm);
 
-err_out_free:
-	sgx_free_epc_page(epc_page);
-	kfree(encl_page);
+	for (i = 0; i < nr_pinned; i++)
+		put_page(src_page[i]);
 
-	return ret;
+	return nr_alloc;
 }
 
 /**
@@ -442,7 +400,7 @@ static long sgx_ioc_enclave_add_pages(struct sgx_encl *encl, void __user *arg)
 	if (sgx_validate_secinfo(&secinfo))
 		return -EINVAL;
 
-	for (c = 0 ; c < add_arg.length; c += PAGE_SIZE) {
+	for (c = 0 ; c < add_arg.length; ) {
 		if (signal_pending(current)) {
 			if (!c)
 				ret = -EINTR;
@@ -453,8 +411,10 @@ static long sgx_ioc_enclave_add_pages(struct sgx_encl *encl, void __user *arg)
 		if (need_resched())
 			cond_resched();
 
-		ret = sgx_encl_add_page(encl, add_arg.src + c, add_arg.offset + c,
-					&secinfo, add_arg.flags);
+		c += sgx_encl_add_pages(encl, add_arg.src + c,
+					add_arg.offset + c,
+					PFN_DOWN(add_arg.length - c), &secinfo,
+					add_arg.flags, &ret) * PAGE_SIZE;
 		if (ret)
 			break;
 	}
@@ -467,6 +427,41 @@ static long sgx_ioc_enclave_add_pages(struct sgx_encl *encl, void __user *arg)
 	return ret;
 }
 
+static struct crypto_shash *sgx_hash_tfm;
+
+/*
+ * The signer of the last initialized enclave. Enclaves are typically launched
+ * over and over again with the same key, and this saves hashing the modulus.
+ */
+static struct {
+	spinlock_t lock;
+	u8 modulus[SGX_MODULUS_SIZE];
+	u64 mrsigner[4];
+	bool valid;
+} sgx_signer_cache = {
+	.lock = __SPIN_LOCK_UNLOCKED(sgx_signer_cache.lock),
+};
+
+/* Allocate the transform on the first use, as it can load a module. */
+static struct crypto_shash *sgx_get_hash_tfm(void)
+{
+	struct crypto_shash *tfm = READ_ONCE(sgx_hash_tfm);
+
+	if (tfm)
+		return tfm;
+
+	tfm = crypto_alloc_shash("sha256", 0, CRYPTO_ALG_ASYNC);
+	if (IS_ERR(tfm))
+		return tfm;
+
+	if (cmpxchg(&sgx_hash_tfm, NULL, tfm)) {
+		crypto_free_shash(tfm);
+		tfm = sgx_hash_tfm;
+	}
+
+	return tfm;
+}
+
 static int __sgx_get_key_hash(struct crypto_shash *tfm, const void *modulus,
 			      void *hash)
 {
@@ -477,28 +472,49 @@ static int __sgx_get_key_hash(struct crypto_shash *tfm, const void *modulus,
 	return crypto_shash_digest(shash, modulus, SGX_MODULUS_SIZE, hash);
 }
 
-static int sgx_get_key_hash(const void *modulus, void *hash)
+static int sgx_get_key_hash(const void *modulus, u64 *hash)
 {
 	struct crypto_shash *tfm;
+	bool hit;
 	int ret;
 
-	tfm = crypto_alloc_shash("sha256", 0, CRYPTO_ALG_ASYNC);
+	spin_lock(&sgx_signer_cache.lock);
+	hit = sgx_signer_cache.valid &&
+	      !memcmp(sgx_signer_cache.modulus, modulus, SGX_MODULUS_SIZE);
+	if (hit)
+		memcpy(hash, sgx_signer_cache.mrsigner,
+		       sizeof(sgx_signer_cache.mrsigner));
+	spin_unlock(&sgx_signer_cache.lock);
+
+	if (hit)
+		return 0;
+
+	tfm = sgx_get_hash_tfm();
 	if (IS_ERR(tfm))
 		return PTR_ERR(tfm);
 
 	ret = __sgx_get_key_hash(tfm, modulus, hash);
+	if (ret)
+		return ret;
 
-	crypto_free_shash(tfm);
-	return ret;
+	spin_lock(&sgx_signer_cache.lock);
+	memcpy(sgx_signer_cache.modulus, modulus, SGX_MODULUS_SIZE);
+	memcpy(sgx_signer_cache.mrsigner, hash,
+	       sizeof(sgx_signer_cache.mrsigner));
+	sgx_signer_cache.valid = true;
+	spin_unlock(&sgx_signer_cache.lock);
+
+	return 0;
 }
 
 static int sgx_encl_init(struct sgx_encl *encl, struct sgx_sigstruct *sigstruct,
 			 void *token)
 {
 	u64 mrsigner[4];
-	int i, j, k;
+	bool written;
 	void *addr;
 	int ret;
+	int i, j;
 
 	/*
 	 * Deny initializing enclaves with attributes (namely provisioning)
@@ -545,11 +561,19 @@ static int sgx_encl_init(struct sgx_encl *encl, struct sgx_sigstruct *sigstruct,
 
 			preempt_disable();
 
-			for (k = 0; k < 4; k++)
-				wrmsrl(MSR_IA32_SGXLEPUBKEYHASH0 + k, mrsigner[k]);
-
+			written = sgx_update_lepubkeyhash(mrsigner, false);
 			ret = __einit(sigstruct, token, addr);
 
+			/*
+			 * The MSRs might have been reset since the last write,
+			 * making the cached values stale.
+			 */
+			if (ret && !encls_faulted(ret) &&
+			    ret != SGX_UNMASKED_EVENT && !written) {
+				sgx_update_lepubkeyhash(mrsigner, true);
+				ret = __einit(sigstruct, token, addr);
+			}
+
 			preempt_enable();
 
 			if (ret == SGX_UNMASKED_EVENT)
@@ -673,6 +697,60 @@ static long sgx_ioc_enclave_provision(struct sgx_encl *encl, void __user *arg)
 	return sgx_set_attribute(&encl->attributes_mask, params.fd);
 }
 
+/**
+ * sgx_ioc_enclave_migrate() - handler for %SGX_IOC_ENCLAVE_MIGRATE
+ * @encl:	an enclave pointer
+ * @arg:	userspace pointer to a struct sgx_enclave_migrate instance
+ *
+ * Move the resident pages of a range of the enclave, which are in EPC of
+ * another NUMA node than the target node, to EPC of the target node, see
+ * sgx_encl_migrate(). The migration stops early, successfully, if the target
+ * node runs short of free EPC pages. @count tells how much of the range was
+ * processed.
+ *
+ * Return:
+ * - 0:		Success.
+ * - -EINVAL:	Invalid range, flags or node.
+ * - -EINTR:	The call was interrupted before any page was processed.
+ * - -errno:	POSIX error.
+ */
+static long sgx_ioc_enclave_migrate(struct sgx_encl *encl, void __user *arg)
+{
+	struct sgx_enclave_migrate params;
+	unsigned long count;
+	int ret;
+
+	if (!test_bit(SGX_ENCL_CREATED, &encl->flags))
+		return -EINVAL;
+
+	if (copy_from_user(&params, arg, sizeof(params)))
+		return -EFAULT;
+
+	if (!IS_ALIGNED(params.offset, PAGE_SIZE) ||
+	    !IS_ALIGNED(params.length, PAGE_SIZE) || !params.length ||
+	    params.flags)
+		return -EINVAL;
+
+	if (params.offset + params.length - PAGE_SIZE >= encl->size)
+		return -EINVAL;
+
+	if (params.nid < NUMA_NO_NODE)
+		return -EINVAL;
+
+	ret = sgx_encl_migrate(encl, encl->base + params.offset,
+			       encl->base + params.offset + params.length,
+			       params.nid, &count);
+	if (ret == -ERESTARTSYS)
+		ret = count ? 0 : -EINTR;
+
+	params.count = count;
+
+	if (copy_to_user(arg, &params, sizeof(params)))
+		return -EFAULT;
+
+	return ret;
+}
+
 long sgx_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
 {
 	struct sgx_encl *encl = filep->private_data;
@@ -694,6 +772,9 @@ long sgx_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
 	case SGX_IOC_ENCLAVE_PROVISION:
 		ret = sgx_ioc_enclave_provision(encl, (void __user *)arg);
 		break;
+	case SGX_IOC_ENCLAVE_MIGRATE:
+		ret = sgx_ioc_enclave_migrate(encl, (void __user *)arg);
+		break;
 	default:
 		ret = -ENOIOCTLCMD;
 		break;
@@ -4,13 +4,16 @@
 #include <linux/file.h>
 #include <linux/freezer.h>
 #include <linux/highmem.h>
+#include <linux/kobject.h>
 #include <linux/kthread.h>
+#include <linux/mempolicy.h>
 #include <linux/miscdevice.h>
 #include <linux/pagemap.h>
 #include <linux/ratelimit.h>
 #include <linux/sched/mm.h>
 #include <linux/sched/signal.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
 
 #include <asm/sgx_arch.h>
 #include <asm/sgx.h>
@@ -18,59 +21,241 @@
 #include "driver.h"
 #include "encl.h"
 #include "encls.h"
+#include "epc_cgroup.h"
 #include "virt.h"
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+/*
+ * Each node runs its own instance of the reclaimer: the pages on the node's
+ * LRU lists are reclaimed by @ksgxd_tsk, which is kicked through @waitq when
+ * the free page count of the node drops below @low_watermark and reclaims
+ * until @high_watermark is reached. The watermarks scale with @nr_pages, the
+ * size of the node's EPC, see sgx_setup_watermarks().
+ *
+ * @lru holds the reclaimable pages of the node, which are not charged to an
+ * EPC cgroup, and each EPC cgroup has an LRU of its own for the node.
+ * @nr_reclaimable counts the pages on all of them. @nr_free_pages counts the
+ * free pages of the node, on the free lists of its sections and in the per-CPU
+ * caches of its CPUs, so that it can be read without walking them. @nr_to_scan,
+ * @chunk and @backing are private to ksgxd.
+ *
+ * At most SGX_NR_DIRECT_RECLAIMERS allocating threads reclaim directly at a
+ * time, as counted by @nr_direct_reclaimers. The rest wait in @alloc_waitq,
+ * and are woken up one per reclaimed page.
+ */
 struct sgx_numa_node {
 	struct sgx_epc_section *sections[SGX_MAX_EPC_SECTIONS];
 	int nr_sections;
+	unsigned long nr_pages;
+	struct sgx_epc_lru lru;
+	atomic_long_t nr_reclaimable;
+	atomic_long_t nr_free_pages;
+	unsigned long low_watermark;
+	unsigned long high_watermark;
+	struct task_struct *ksgxd_tsk;
+	wait_queue_head_t waitq;
+	wait_queue_head_t alloc_waitq;
+	atomic_t nr_direct_reclaimers;
+	unsigned int nr_to_scan;
+	struct sgx_epc_page **chunk;
+	struct sgx_backing *backing;
 };
 
 static struct sgx_numa_node sgx_numa_nodes[MAX_NUMNODES];
 static int sgx_nr_numa_nodes;
+static unsigned int sgx_watermark_scale_factor = SGX_WATERMARK_SCALE_FACTOR;
+
+/*
+ * The EPC is under pressure, when the free pages of all the nodes drop below
+ * @sgx_pressure_threshold, and stays so until they are back above twice the
+ * threshold, in the same manner as the low and high watermarks. Each change of
+ * the state is notified to the poll()'ers of /sys/kernel/mm/sgx/pressure. The
+ * pages in the per-CPU caches count as free, see sgx_nr_free_pages().
+ */
+static unsigned long sgx_pressure_threshold;
+static unsigned long sgx_pressure;
+static struct kernfs_node *sgx_pressure_kn;
 struct sgx_epc_section sgx_epc_sections[SGX_MAX_EPC_SECTIONS];
 static int sgx_nr_epc_sections;
-static struct task_struct *ksgxd_tsk;
-static DECLARE_WAIT_QUEUE_HEAD(ksgxd_waitq);
 
 /*
- * These variables are part of the state of the reclaimer, and must be accessed
- * with sgx_reclaimer_lock acquired.
+ * A per-CPU cache of free EPC pages of the CPU's node, which is refilled from
+ * and drained to the sections in batches of SGX_EPC_PCP_BATCH pages in order to
+ * take section->lock once per batch instead of once per page. Similar to the
+ * per-CPU lists of the page allocator, the cached pages are not accounted in
+ * section->free_cnt. The lock is only contended when a CPU steals pages from
+ * the other caches, as the last resort before failing an allocation.
  */
-static LIST_HEAD(sgx_active_page_list);
+struct sgx_epc_pcp {
+	spinlock_t lock;
+	struct list_head page_list;
+	unsigned int count;
+};
+
+static DEFINE_PER_CPU(struct sgx_epc_pcp, sgx_epc_pcp);
+
+/*
+ * The last values written to IA32_SGXLEPUBKEYHASH{0..3} on each CPU. Zero means
+ * unknown, the odds of a SHA-256 digest having a zero quadword are negligible.
+ */
+static DEFINE_PER_CPU(u64 [4], sgx_lepubkeyhash_cache);
+
+/* The LRU of the page's node, which belongs to the page's EPC cgroup if any. */
+static struct sgx_epc_lru *sgx_epc_page_lru(struct sgx_epc_page *page)
+{
+	struct sgx_epc_cgroup *epc_cg = sgx_epc_page_cgroup(page);
+	int nid = sgx_epc_sections[page->section].nid;
+
+	if (epc_cg)
+		return sgx_epc_cgroup_lru(epc_cg, nid);
+
+	return &sgx_numa_nodes[nid].lru;
+}
+
+/* Account @nr pages, added to or taken from the free pages of @page's node. */
+static inline void sgx_account_free_pages(struct sgx_epc_page *page, long nr)
+{
+	int nid = sgx_epc_sections[page->section].nid;
+
+	atomic_long_add(nr, &sgx_numa_nodes[nid].nr_free_pages);
+}
+
+/* Add a page to the tail of an LRU list. Must be called with lru->lock. */
+static void sgx_lru_add(struct sgx_epc_lru *lru, struct sgx_epc_page *page,
+			bool inactive)
+{
+	if (inactive) {
+		page->flags |= SGX_EPC_PAGE_INACTIVE;
+		list_add_tail(&page->list, &lru->inactive_page_list);
+		lru->nr_inactive++;
+	} else {
+		page->flags &= ~SGX_EPC_PAGE_INACTIVE;
+		list_add_tail(&page->list, &lru->active_page_list);
+		lru->nr_active++;
+	}
+
+	atomic_long_inc(&sgx_numa_nodes[lru->nid].nr_reclaimable);
+}
+
+/* Remove a page from its LRU list. Must be called with lru->lock. */
+static void sgx_lru_del(struct sgx_epc_lru *lru, struct sgx_epc_page *page)
+{
+	list_del_init(&page->list);
+
+	if (page->flags & SGX_EPC_PAGE_INACTIVE)
+		lru->nr_inactive--;
+	else
+		lru->nr_active--;
 
-static DEFINE_SPINLOCK(sgx_reclaimer_lock);
+	atomic_long_dec(&sgx_numa_nodes[lru->nid].nr_reclaimable);
+}
+
+static inline bool sgx_lru_empty(struct sgx_numa_node *node)
+{
+	return !atomic_long_read(&node->nr_reclaimable);
+}
 
 /*
  * Reset dirty EPC pages to uninitialized state. Laundry can be left with SECS
  * pages whose child pages blocked EREMOVE.
+ *
+ * The pages are taken from the laundry in batches of SGX_SANITIZE_BATCH and
+ * EREMOVE'd without section->lock, which allows multiple threads to sanitize
+ * the same section in parallel. The clean pages of each batch become available
+ * for allocation right away.
  */
 static void sgx_sanitize_section(struct sgx_epc_section *section)
 {
-	struct sgx_epc_page *page;
+	struct sgx_epc_page *page, *tmp;
 	LIST_HEAD(dirty);
-	int ret;
-
-	while (!list_empty(&section->laundry_list)) {
-		if (kthread_should_stop())
-			return;
+	LIST_HEAD(clean);
+	LIST_HEAD(batch);
+	int i;
 
+	for ( ; ; ) {
 		spin_lock(&section->lock);
+		for (i = 0; i < SGX_SANITIZE_BATCH; i++) {
+			if (list_empty(&section->laundry_list))
+				break;
+
+			list_move_tail(section->laundry_list.next, &batch);
+		}
+		spin_unlock(&section->lock);
 
-		page = list_first_entry(&section->laundry_list,
-					struct sgx_epc_page, list);
+		if (list_empty(&batch))
+			break;
 
-		ret = __eremove(sgx_get_epc_virt_addr(page));
-		if (!ret)
-			list_move(&page->list, &section->page_list);
-		else
-			list_move_tail(&page->list, &dirty);
+		list_for_each_entry_safe(page, tmp, &batch, list) {
+			if (!__eremove(sgx_get_epc_virt_addr(page)))
+				list_move_tail(&page->list, &clean);
+			else
+				list_move_tail(&page->list, &dirty);
+		}
 
+		spin_lock(&section->lock);
+		list_splice_tail_init(&clean, &section->page_list);
 		spin_unlock(&section->lock);
 
 		cond_resched();
 	}
 
-	list_splice(&dirty, &section->laundry_list);
+	spin_lock(&section->lock);
+	list_splice_tail(&dirty, &section->laundry_list);
+	spin_unlock(&section->lock);
+}
+
+struct sgx_sanitize_work {
+	struct work_struct work;
+	struct sgx_numa_node *node;
+};
+
+static void sgx_sanitize_work_func(struct work_struct *work)
+{
+	struct sgx_sanitize_work *sw = container_of(work, struct sgx_sanitize_work,
+						    work);
+	struct sgx_numa_node *node = sw->node;
+	int i;
+
+	for (i = 0; i < node->nr_sections; i++)
+		sgx_sanitize_section(node->sections[i]);
+}
+
+/*
+ * Sanitize the sections of a node with a worker per CPU of the node, up to
+ * SGX_SANITIZE_MAX_WORKERS, as sweeping hundreds of gigabytes of EPC with
+ * EREMOVE one page at a time would delay SGX for a long time after boot or
+ * kexec(). The workers share the sections, and fall back to doing the work
+ * in the calling thread if the workers can't be allocated.
+ */
+static void sgx_sanitize_node(struct sgx_numa_node *node)
+{
+	int nid = node - sgx_numa_nodes;
+	struct sgx_sanitize_work *works;
+	unsigned int nr_workers;
+	int i;
+
+	nr_workers = clamp_t(unsigned int, nr_cpus_node(nid), 1,
+			     SGX_SANITIZE_MAX_WORKERS);
+
+	works = kcalloc(nr_workers, sizeof(*works), GFP_KERNEL);
+	if (!works) {
+		for (i = 0; i < node->nr_sections; i++)
+			sgx_sanitize_section(node->sections[i]);
+		return;
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		INIT_WORK(&works[i].work, sgx_sanitize_work_func);
+		works[i].node = node;
+		queue_work_node(nid, system_unbound_wq, &works[i].work);
+	}
+
+	for (i = 0; i < nr_workers; i++)
+		flush_work(&works[i].work);
+
+	kfree(works);
 }
 
 static bool sgx_reclaimer_age(struct sgx_epc_page *epc_page)
@@ -105,15 +290,189 @@ static bool sgx_reclaimer_age(struct sgx_epc_page *epc_page)
 	return true;
 }
 
-static void sgx_reclaimer_block(struct sgx_epc_page *epc_page)
+/*
+ * Refill the inactive list, when it has become smaller than the active list, by
+ * scanning up to @nr_to_scan pages from the head of the active list. The pages
+ * that have been accessed since the last scan are rotated to the tail of the
+ * active list, and the rest are moved to the inactive list. @chunk is used as
+ * scratch space for the isolated pages.
+ */
+static void sgx_age_pages(struct sgx_epc_lru *lru,
+			  struct sgx_epc_page **chunk, unsigned int nr_to_scan)
 {
-	struct sgx_encl_page *page = epc_page->owner;
-	unsigned long addr = page->desc & PAGE_MASK;
-	struct sgx_encl *encl = page->encl;
+	struct sgx_encl_page *encl_page;
+	struct sgx_epc_page *epc_page;
+	bool old;
+	int cnt = 0;
+	int i;
+
+	spin_lock(&lru->lock);
+	if (lru->nr_inactive >= lru->nr_active) {
+		spin_unlock(&lru->lock);
+		return;
+	}
+
+	for (i = 0; i < nr_to_scan; i++) {
+		if (list_empty(&lru->active_page_list))
+			break;
+
+		epc_page = list_first_entry(&lru->active_page_list,
+					    struct sgx_epc_page, list);
+		sgx_lru_del(lru, epc_page);
+		encl_page = epc_page->owner;
+
+		if (kref_get_unless_zero(&encl_page->encl->refcount) != 0)
+			chunk[cnt++] = epc_page;
+		else
+			epc_page->flags &= ~SGX_EPC_PAGE_RECLAIMER_TRACKED;
+	}
+	spin_unlock(&lru->lock);
+
+	for (i = 0; i < cnt; i++) {
+		epc_page = chunk[i];
+		encl_page = epc_page->owner;
+
+		old = sgx_reclaimer_age(epc_page);
+
+		spin_lock(&lru->lock);
+		sgx_lru_add(lru, epc_page, old);
+		spin_unlock(&lru->lock);
+
+		kref_put(&encl_page->encl->refcount, sgx_encl_release);
+	}
+}
+
+/*
+ * Put a page, which is not going to be reclaimed after all, back to the LRU and
+ * drop the enclave reference taken when isolating it. Accessed pages are
+ * activated, the others stay inactive.
+ */
+static void sgx_reclaimer_putback(struct sgx_epc_page *epc_page, bool inactive)
+{
+	struct sgx_epc_lru *lru = sgx_epc_page_lru(epc_page);
+	struct sgx_encl *encl = epc_page->owner->encl;
+
+	spin_lock(&lru->lock);
+	sgx_lru_add(lru, epc_page, inactive);
+	spin_unlock(&lru->lock);
+
+	kref_put(&encl->refcount, sgx_encl_release);
+}
+
+/*
+ * VA pages set aside for the reclaimer. The VA pages of an enclave are only
+ * allocated when its pages get evicted, i.e. typically when the EPC is
+ * exhausted, and reclaim must not depend on allocating EPC to make progress.
+ * sgx_encl_reserve_va_slots() takes a page from the reserve, when none can be
+ * allocated, and the reserve is refilled with the pages freed by reclaim before
+ * they are handed out again. Protected by sgx_va_reserve_lock.
+ */
+static LIST_HEAD(sgx_va_reserve);
+static unsigned int sgx_nr_va_reserve;
+static DEFINE_SPINLOCK(sgx_va_reserve_lock);
+
+/**
+ * sgx_take_reserved_va_page() - Take a VA page from the reclaimer's reserve
+ *
+ * Return:
+ *   a VA page,
+ *   NULL, if the reserve is empty
+ */
+struct sgx_epc_page *sgx_take_reserved_va_page(void)
+{
+	struct sgx_epc_page *epc_page = NULL;
+
+	spin_lock(&sgx_va_reserve_lock);
+	if (sgx_nr_va_reserve) {
+		epc_page = list_first_entry(&sgx_va_reserve, struct sgx_epc_page,
+					    list);
+		list_del(&epc_page->list);
+		sgx_nr_va_reserve--;
+	}
+	spin_unlock(&sgx_va_reserve_lock);
+
+	return epc_page;
+}
+
+static inline bool sgx_va_reserve_full(void)
+{
+	return READ_ONCE(sgx_nr_va_reserve) >= SGX_NR_VA_RESERVE;
+}
+
+/* Add @epc_page, which holds a VA page, to the reserve unless it is full. */
+static bool sgx_reserve_va_page(struct sgx_epc_page *epc_page)
+{
+	bool ret = false;
+
+	spin_lock(&sgx_va_reserve_lock);
+	if (sgx_nr_va_reserve < SGX_NR_VA_RESERVE) {
+		list_add(&epc_page->list, &sgx_va_reserve);
+		sgx_nr_va_reserve++;
+		ret = true;
+	}
+	spin_unlock(&sgx_va_reserve_lock);
+
+	return ret;
+}
+
+/* Fill the reserve from the free pages, once they have been sanitized. */
+static void sgx_fill_va_reserve(void)
+{
+	struct sgx_epc_page *epc_page;
+
+	while (!sgx_va_reserve_full()) {
+		epc_page = sgx_alloc_va_page(false);
+		if (IS_ERR(epc_page))
+			break;
+
+		if (!sgx_reserve_va_page(epc_page)) {
+			sgx_free_epc_page(epc_page);
+			break;
+		}
+	}
+}
+
+/*
+ * Turn @epc_page, which has just been written back and holds no enclave page,
+ * into a VA page of the reserve, if the reserve is short of pages.
+ *
+ * Return: true if @epc_page was consumed
+ */
+static bool sgx_refill_va_reserve(struct sgx_epc_page *epc_page)
+{
+	if (sgx_va_reserve_full())
+		return false;
+
+	/* Fails if EWB did, the page then goes to the free list as before. */
+	if (__epa(sgx_get_epc_virt_addr(epc_page)))
+		return false;
+
+	epc_page->owner = NULL;
+	if (!sgx_reserve_va_page(epc_page))
+		sgx_free_epc_page(epc_page);
+
+	return true;
+}
+
+/*
+ * Unmap and EBLOCK a group of pages belonging to @encl. Walking the mm_list
+ * once for the whole group, instead of once per page, keeps the cost of taking
+ * each mm's mmap_lock independent of the size of the group.
+ *
+ * A VA slot is reserved for each page, and one more for the SECS, before the
+ * pages are blocked, as a blocked page can only be evicted. The pages, which do
+ * not get a slot, are put back to their LRU and removed from @chunk.
+ */
+static void sgx_reclaimer_block(struct sgx_encl *encl,
+				struct sgx_epc_page **chunk,
+				struct sgx_backing *backing, int nr)
+{
+	unsigned int nr_pages = 0, nr_slots;
 	unsigned long mm_list_version;
 	struct sgx_encl_mm *encl_mm;
 	struct vm_area_struct *vma;
-	int idx, ret;
+	unsigned long addr;
+	int idx, ret, i;
 
 	do {
 		mm_list_version = encl->mm_list_version;
@@ -129,9 +488,16 @@ static void sgx_reclaimer_block(struct sgx_epc_page *epc_page)
 
 			mmap_read_lock(encl_mm->mm);
 
-			ret = sgx_encl_find(encl_mm->mm, addr, &vma);
-			if (!ret && encl == vma->vm_private_data)
-				zap_vma_ptes(vma, addr, PAGE_SIZE);
+			for (i = 0; i < nr; i++) {
+				if (!chunk[i])
+					continue;
+
+				addr = chunk[i]->owner->desc & PAGE_MASK;
+
+				ret = sgx_encl_find(encl_mm->mm, addr, &vma);
+				if (!ret && encl == vma->vm_private_data)
+					zap_vma_ptes(vma, addr, PAGE_SIZE);
+			}
 
 			mmap_read_unlock(encl_mm->mm);
 
@@ -143,11 +509,46 @@ static void sgx_reclaimer_block(struct sgx_epc_page *epc_page)
 
 	mutex_lock(&encl->lock);
 
-	ret = __eblock(sgx_get_epc_virt_addr(epc_page));
-	if (encls_failed(ret))
-		ENCLS_WARN(ret, "EBLOCK");
+	for (i = 0; i < nr; i++) {
+		if (chunk[i])
+			nr_pages++;
+	}
+
+	nr_slots = sgx_encl_reserve_va_slots(encl, nr_pages + 1);
+	if (nr_slots <= nr_pages) {
+		/* Keep the last slot for the SECS. */
+		if (nr_slots == 1)
+			sgx_encl_unreserve_va_slots(encl, 1);
+
+		nr_pages = nr_slots > 1 ? nr_slots - 1 : 0;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (!chunk[i])
+			continue;
+
+		if (!nr_pages) {
+			chunk[i]->owner->desc &= ~SGX_ENCL_PAGE_BEING_RECLAIMED;
+			continue;
+		}
+
+		nr_pages--;
+
+		ret = __eblock(sgx_get_epc_virt_addr(chunk[i]));
+		if (encls_failed(ret))
+			ENCLS_WARN(ret, "EBLOCK");
+	}
 
 	mutex_unlock(&encl->lock);
+
+	for (i = 0; i < nr; i++) {
+		if (!chunk[i] || chunk[i]->owner->desc & SGX_ENCL_PAGE_BEING_RECLAIMED)
+			continue;
+
+		sgx_encl_put_backing(&backing[i], false);
+		sgx_reclaimer_putback(chunk[i], true);
+		chunk[i] = NULL;
+	}
 }
 
 static int __sgx_encl_ewb(struct sgx_epc_page *epc_page, void *va_slot,
@@ -183,15 +584,19 @@ static const cpumask_t *sgx_encl_ewb_cpumask(struct sgx_encl *encl)
 	int idx;
 
 	/*
-	 * Can race with sgx_encl_mm_add(), but ETRACK has already been
-	 * executed, which means that the CPUs running in the new mm will enter
-	 * into the enclave with a fresh epoch.
+	 * Can race with sgx_encl_mm_add() and with the first fault of an mm,
+	 * but ETRACK has already been executed, which means that the CPUs
+	 * running in the new mm will enter into the enclave with a fresh epoch.
 	 */
 	cpumask_clear(cpumask);
 
 	idx = srcu_read_lock(&encl->srcu);
 
 	list_for_each_entry_rcu(encl_mm, &encl->mm_list, list) {
+		/* Skip the mm's, which have never mapped the enclave. */
+		if (!READ_ONCE(encl_mm->mapped))
+			continue;
+
 		if (!mmget_not_zero(encl_mm->mm))
 			continue;
 
@@ -205,6 +610,15 @@ static const cpumask_t *sgx_encl_ewb_cpumask(struct sgx_encl *encl)
 	return cpumask;
 }
 
+/*
+ * ETRACK and IPI state of a group of pages of the same enclave, i.e. each of
+ * them is done at most once for all the pages of the group.
+ */
+struct sgx_ewb_track {
+	bool tracked;
+	bool kicked;
+};
+
 /*
  * Swap page to the regular memory transformed to the blocked state by using
  * EBLOCK, which means that it can no loger be referenced (no new TLB entries).
@@ -214,12 +628,18 @@ static const cpumask_t *sgx_encl_ewb_cpumask(struct sgx_encl *encl)
  * previous thread count has been zeroed out. The second trial calls ETRACK
  * before EWB. If that fails we kick all the HW threads out, and then do EWB,
  * which should be guaranteed the succeed.
+ *
+ * All the pages in a group have been blocked before the first EWB, thus an
+ * ETRACK or IPI round done for one page of the group covers the rest of the
+ * group, as recorded in @track.
  */
 static void sgx_encl_ewb(struct sgx_epc_page *epc_page,
-			 struct sgx_backing *backing)
+			 struct sgx_backing *backing,
+			 struct sgx_ewb_track *track)
 {
 	struct sgx_encl_page *encl_page = epc_page->owner;
 	struct sgx_encl *encl = encl_page->encl;
+	unsigned int nr_not_tracked = 0;
 	struct sgx_va_page *va_page;
 	unsigned int va_offset;
 	void *va_slot;
@@ -227,60 +647,86 @@ static void sgx_encl_ewb(struct sgx_epc_page *epc_page,
 
 	encl_page->desc &= ~SGX_ENCL_PAGE_BEING_RECLAIMED;
 
-	va_page = list_first_entry(&encl->va_pages, struct sgx_va_page,
-				   list);
-	va_offset = sgx_alloc_va_slot(va_page);
+	va_page = sgx_encl_alloc_va_slot(encl, &va_offset);
 	va_slot = sgx_get_epc_virt_addr(va_page->epc_page) + va_offset;
-	if (sgx_va_page_full(va_page))
-		list_move_tail(&va_page->list, &encl->va_pages);
 
 	ret = __sgx_encl_ewb(epc_page, va_slot, backing);
-	if (ret == SGX_NOT_TRACKED) {
+	if (ret == SGX_NOT_TRACKED)
+		nr_not_tracked++;
+
+	if (ret == SGX_NOT_TRACKED && !track->tracked) {
 		ret = __etrack(sgx_get_epc_virt_addr(encl->secs.epc_page));
 		if (ret) {
 			if (encls_failed(ret))
 				ENCLS_WARN(ret, "ETRACK");
 		}
 
+		track->tracked = true;
+
+		ret = __sgx_encl_ewb(epc_page, va_slot, backing);
+		if (ret == SGX_NOT_TRACKED)
+			nr_not_tracked++;
+	}
+
+	if (ret == SGX_NOT_TRACKED && !track->kicked) {
+		/*
+		 * Slow path, send IPIs to kick cpus out of the enclave.  Note,
+		 * it's imperative that the cpu mask is generated *after*
+		 * ETRACK, else we'll miss cpus that entered the enclave
+		 * between generating the mask and incrementing epoch.
+		 */
+		on_each_cpu_mask(sgx_encl_ewb_cpumask(encl),
+				 sgx_ipi_cb, NULL, 1);
+		track->kicked = true;
+
 		ret = __sgx_encl_ewb(epc_page, va_slot, backing);
-		if (ret == SGX_NOT_TRACKED) {
-			/*
-			 * Slow path, send IPIs to kick cpus out of the
-			 * enclave.  Note, it's imperative that the cpu
-			 * mask is generated *after* ETRACK, else we'll
-			 * miss cpus that entered the enclave between
-			 * generating the mask and incrementing epoch.
-			 */
-			on_each_cpu_mask(sgx_encl_ewb_cpumask(encl),
-					 sgx_ipi_cb, NULL, 1);
-			ret = __sgx_encl_ewb(epc_page, va_slot, backing);
-		}
 	}
 
 	if (ret) {
 		if (encls_failed(ret))
 			ENCLS_WARN(ret, "EWB");
 
-		sgx_free_va_slot(va_page, va_offset);
+		sgx_encl_free_va_slot(encl, va_page, va_offset);
 	} else {
 		encl_page->desc |= va_offset;
 		encl_page->va_page = va_page;
+		encl->stats.nr_evicted++;
 	}
+
+	encl->stats.nr_not_tracked += nr_not_tracked;
+	trace_sgx_encl_ewb(encl->base, encl_page->desc & PAGE_MASK, ret,
+			   nr_not_tracked);
 }
 
-static void sgx_reclaimer_write(struct sgx_epc_page *epc_page,
-				struct sgx_backing *backing)
+/*
+ * Write back a group of blocked pages belonging to @encl under a single
+ * acquisition of encl->lock, and the SECS page after the last child is gone.
+ */
+static void sgx_reclaimer_write(struct sgx_encl *encl,
+				struct sgx_epc_page **chunk,
+				struct sgx_backing *backing, int nr)
 {
-	struct sgx_encl_page *encl_page = epc_page->owner;
-	struct sgx_encl *encl = encl_page->encl;
+	struct sgx_ewb_track track = { };
+	struct sgx_ewb_track secs_track = { };
+	struct sgx_encl_page *encl_page;
 	struct sgx_backing secs_backing;
-	int ret;
+	bool secs = false;
+	int cnt = 0;
+	int ret, i;
 
 	mutex_lock(&encl->lock);
 
-	sgx_encl_ewb(epc_page, backing);
-	encl_page->epc_page = NULL;
-	encl->secs_child_cnt--;
+	for (i = 0; i < nr; i++) {
+		if (!chunk[i])
+			continue;
+
+		encl_page = chunk[i]->owner;
+
+		sgx_encl_ewb(chunk[i], &backing[i], &track);
+		encl_page->epc_page = NULL;
+		encl->secs_child_cnt--;
+		cnt++;
+	}
 
 	if (!encl->secs_child_cnt && test_bit(SGX_ENCL_INITIALIZED, &encl->flags)) {
 		ret = sgx_encl_get_backing(encl, PFN_DOWN(encl->size),
@@ -288,94 +734,139 @@ static void sgx_reclaimer_write(struct sgx_epc_page *epc_page,
 		if (ret)
 			goto out;
 
-		sgx_encl_ewb(encl->secs.epc_page, &secs_backing);
+		sgx_encl_ewb(encl->secs.epc_page, &secs_backing, &secs_track);
 
 		sgx_free_epc_page(encl->secs.epc_page);
 		encl->secs.epc_page = NULL;
+		secs = true;
 
 		sgx_encl_put_backing(&secs_backing, true);
 	}
 
 out:
+	/* Return the VA slot reserved for the SECS by sgx_reclaimer_block(). */
+	if (!secs)
+		sgx_encl_unreserve_va_slots(encl, 1);
+
+	trace_sgx_reclaimer_write(encl->base, cnt, secs);
 	mutex_unlock(&encl->lock);
 }
 
+/* Sort the isolated pages by their enclave. */
+static int sgx_reclaimer_cmp(const void *a, const void *b)
+{
+	const struct sgx_epc_page *pa = *(const struct sgx_epc_page * const *)a;
+	const struct sgx_epc_page *pb = *(const struct sgx_epc_page * const *)b;
+	unsigned long ea = (unsigned long)pa->owner->encl;
+	unsigned long eb = (unsigned long)pb->owner->encl;
+
+	if (ea != eb)
+		return ea < eb ? -1 : 1;
+
+	/*
+	 * Sort by address inside the enclave so that neighbouring pages can
+	 * share the backing storage lookups, see sgx_encl_get_backing_batch().
+	 */
+	ea = pa->owner->desc & PAGE_MASK;
+	eb = pb->owner->desc & PAGE_MASK;
+
+	if (ea < eb)
+		return -1;
+
+	return ea > eb;
+}
+
+/*
+ * Return the end of the group of pages starting at @start, i.e. the index of
+ * the first page that belongs to a different enclave. The pages that were
+ * skipped, i.e. set to NULL, are part of the group.
+ */
+static int sgx_reclaimer_group_end(struct sgx_epc_page **chunk, int start,
+				   int cnt)
+{
+	struct sgx_encl *encl = chunk[start]->owner->encl;
+	int i;
+
+	for (i = start + 1; i < cnt; i++) {
+		if (chunk[i] && chunk[i]->owner->encl != encl)
+			break;
+	}
+
+	return i;
+}
+
 /*
- * Take a fixed number of pages from the head of the active page pool and
- * reclaim them to the enclave's private shmem files. Skip the pages, which have
- * been accessed since the last scan. Move those pages to the tail of active
- * page pool so that the pages get scanned in LRU like fashion.
+ * Reclaim a chunk of @cnt isolated pages, each holding a reference to its
+ * enclave, to the enclaves' private shmem files.
+ *
+ * Batch process a chunk of pages (between SGX_NR_TO_SCAN and
+ * SGX_NR_TO_SCAN_MAX) in order to degrade amount of IPI's and ETRACK's
+ * potentially required. The chunk is sorted by enclave and each group of pages
+ * of the same enclave is blocked and written back as a unit, which means that a
+ * single ETRACK (and IPI) round per enclave covers every page of that enclave in
+ * the chunk. sgx_encl_ewb() does degrade a bit among
+ * the HW threads with three stage EWB pipeline (EWB, ETRACK + EWB and IPI + EWB)
+ * but not sufficiently. Reclaiming one page at a time would also be problematic
+ * as it would increase the lock contention too much, which would halt forward
+ * progress.
  *
- * Batch process a chunk of pages (at the moment 16) in order to degrade amount
- * of IPI's and ETRACK's potentially required. sgx_encl_ewb() does degrade a bit
- * among the HW threads with three stage EWB pipeline (EWB, ETRACK + EWB and IPI
- * + EWB) but not sufficiently. Reclaiming one page at a time would also be
- * problematic as it would increase the lock contention too much, which would
- * halt forward progress.
+ * Return: the number of reclaimed pages
  */
-static void sgx_reclaim_pages(void)
+static unsigned int sgx_reclaim_chunk(struct sgx_epc_page **chunk,
+				      struct sgx_backing *backing, int cnt)
 {
-	struct sgx_epc_page *chunk[SGX_NR_TO_SCAN];
-	struct sgx_backing backing[SGX_NR_TO_SCAN];
 	struct sgx_epc_section *section;
 	struct sgx_encl_page *encl_page;
 	struct sgx_epc_page *epc_page;
-	pgoff_t page_index;
-	int cnt = 0;
-	int ret;
-	int i;
-
-	spin_lock(&sgx_reclaimer_lock);
-	for (i = 0; i < SGX_NR_TO_SCAN; i++) {
-		if (list_empty(&sgx_active_page_list))
-			break;
+	unsigned int nr_reclaimed = 0;
+	struct sgx_encl *encl;
+	int nr_pinned;
+	int i, j, k;
 
-		epc_page = list_first_entry(&sgx_active_page_list,
-					    struct sgx_epc_page, list);
-		list_del_init(&epc_page->list);
-		encl_page = epc_page->owner;
+	/* Group the pages by enclave for the block and write stages. */
+	sort(chunk, cnt, sizeof(*chunk), sgx_reclaimer_cmp, NULL);
 
-		if (kref_get_unless_zero(&encl_page->encl->refcount) != 0)
-			chunk[cnt++] = epc_page;
-		else
-			/* The owner is freeing the page. No need to add the
-			 * page back to the list of reclaimable pages.
-			 */
-			epc_page->flags &= ~SGX_EPC_PAGE_RECLAIMER_TRACKED;
+	for (i = 0; i < cnt; i++) {
+		encl_page = chunk[i]->owner;
+		backing[i].page_index = PFN_DOWN(encl_page->desc -
+						 encl_page->encl->base);
 	}
-	spin_unlock(&sgx_reclaimer_lock);
 
-	for (i = 0; i < cnt; i++) {
-		epc_page = chunk[i];
-		encl_page = epc_page->owner;
+	for (i = 0; i < cnt; i = j) {
+		encl = chunk[i]->owner->encl;
+		j = sgx_reclaimer_group_end(chunk, i, cnt);
 
-		if (!sgx_reclaimer_age(epc_page))
-			goto skip;
+		nr_pinned = sgx_encl_get_backing_batch(encl, &backing[i], j - i);
 
-		page_index = PFN_DOWN(encl_page->desc - encl_page->encl->base);
-		ret = sgx_encl_get_backing(encl_page->encl, page_index, &backing[i]);
-		if (ret)
-			goto skip;
+		mutex_lock(&encl->lock);
+		for (k = i; k < i + nr_pinned; k++)
+			chunk[k]->owner->desc |= SGX_ENCL_PAGE_BEING_RECLAIMED;
+		mutex_unlock(&encl->lock);
 
-		mutex_lock(&encl_page->encl->lock);
-		encl_page->desc |= SGX_ENCL_PAGE_BEING_RECLAIMED;
-		mutex_unlock(&encl_page->encl->lock);
-		continue;
+		for (k = i + nr_pinned; k < j; k++) {
+			sgx_reclaimer_putback(chunk[k], true);
+			chunk[k] = NULL;
+		}
+	}
 
-skip:
-		spin_lock(&sgx_reclaimer_lock);
-		list_add_tail(&epc_page->list, &sgx_active_page_list);
-		spin_unlock(&sgx_reclaimer_lock);
+	for (i = 0; i < cnt; i = j) {
+		j = i + 1;
+		if (!chunk[i])
+			continue;
 
-		kref_put(&encl_page->encl->refcount, sgx_encl_release);
+		j = sgx_reclaimer_group_end(chunk, i, cnt);
+		sgx_reclaimer_block(chunk[i]->owner->encl, &chunk[i],
+				    &backing[i], j - i);
+	}
 
-		chunk[i] = NULL;
-	}
+	for (i = 0; i < cnt; i = j) {
+		j = i + 1;
+		if (!chunk[i])
+			continue;
 
-	for (i = 0; i < cnt; i++) {
-		epc_page = chunk[i];
-		if (epc_page)
-			sgx_reclaimer_block(epc_page);
+		j = sgx_reclaimer_group_end(chunk, i, cnt);
+		sgx_reclaimer_write(chunk[i]->owner->encl, &chunk[i], &backing[i],
+				    j - i);
 	}
 
 	for (i = 0; i < cnt; i++) {
@@ -384,118 +875,736 @@ static void sgx_reclaim_pages(void)
 			continue;
 
 		encl_page = epc_page->owner;
-		sgx_reclaimer_write(epc_page, &backing[i]);
 		sgx_encl_put_backing(&backing[i], true);
 
 		kref_put(&encl_page->encl->refcount, sgx_encl_release);
-		epc_page->flags &= ~SGX_EPC_PAGE_RECLAIMER_TRACKED;
+		epc_page->flags &= ~(SGX_EPC_PAGE_RECLAIMER_TRACKED |
+				     SGX_EPC_PAGE_INACTIVE);
+
+		sgx_epc_cgroup_uncharge(sgx_epc_page_cgroup(epc_page));
+		sgx_epc_page_set_cgroup(epc_page, NULL);
+
+		nr_reclaimed++;
+
+		if (sgx_refill_va_reserve(epc_page))
+			continue;
 
 		section = &sgx_epc_sections[epc_page->section];
 		spin_lock(&section->lock);
 		list_add_tail(&epc_page->list, &section->page_list);
 		section->free_cnt++;
 		spin_unlock(&section->lock);
+
+		sgx_account_free_pages(epc_page, 1);
+	}
+
+	return nr_reclaimed;
+}
+
+/*
+ * Take up to @nr_to_scan pages from the head of the inactive page pool of @lru
+ * and reclaim them with sgx_reclaim_chunk(). Skip the pages, which have been
+ * accessed since the last scan. Move those pages to the tail of the active page
+ * pool so that the pages get scanned in LRU like fashion.
+ *
+ * Return: the number of reclaimed pages
+ */
+static unsigned int sgx_reclaim_pages(struct sgx_epc_lru *lru,
+				      struct sgx_epc_page **chunk,
+				      struct sgx_backing *backing,
+				      unsigned int nr_to_scan, bool direct)
+{
+	struct sgx_encl_page *encl_page;
+	struct sgx_epc_page *epc_page;
+	unsigned int nr_reclaimed;
+	int cnt = 0;
+	int i, j;
+
+	sgx_age_pages(lru, chunk, nr_to_scan);
+
+	spin_lock(&lru->lock);
+	for (i = 0; i < nr_to_scan; i++) {
+		if (list_empty(&lru->inactive_page_list))
+			break;
+
+		epc_page = list_first_entry(&lru->inactive_page_list,
+					    struct sgx_epc_page, list);
+		sgx_lru_del(lru, epc_page);
+		encl_page = epc_page->owner;
+
+		if (kref_get_unless_zero(&encl_page->encl->refcount) != 0)
+			chunk[cnt++] = epc_page;
+		else
+			/* The owner is freeing the page. No need to add the
+			 * page back to the list of reclaimable pages.
+			 */
+			epc_page->flags &= ~(SGX_EPC_PAGE_RECLAIMER_TRACKED |
+					     SGX_EPC_PAGE_INACTIVE);
+	}
+	spin_unlock(&lru->lock);
+
+	/* Drop the accessed pages and compact the chunk. */
+	for (i = 0, j = 0; i < cnt; i++) {
+		epc_page = chunk[i];
+
+		if (!sgx_reclaimer_age(epc_page)) {
+			sgx_reclaimer_putback(epc_page, false);
+			continue;
+		}
+
+		chunk[j++] = epc_page;
 	}
+	cnt = j;
+
+	nr_reclaimed = sgx_reclaim_chunk(chunk, backing, cnt);
+
+	trace_sgx_reclaim_pages(lru->nid, nr_to_scan, cnt, nr_reclaimed,
+				direct);
+
+	return nr_reclaimed;
+}
+
+/*
+ * Reclaim the share of @lru of the batch of @nr_to_scan pages, which is taken
+ * from a total of @nr_total reclaimable pages.
+ */
+static unsigned int sgx_reclaim_lru_share(struct sgx_epc_lru *lru,
+					  struct sgx_epc_page **chunk,
+					  struct sgx_backing *backing,
+					  unsigned int nr_to_scan,
+					  unsigned long nr_total, bool direct)
+{
+	unsigned long nr = sgx_epc_lru_size(lru);
+
+	if (!nr)
+		return 0;
+
+	nr = min_t(unsigned long, DIV_ROUND_UP(nr * nr_to_scan, nr_total),
+		   nr_to_scan);
+
+	return sgx_reclaim_pages(lru, chunk, backing, nr, direct);
+}
+
+/*
+ * Reclaim from all the LRUs of the node, i.e. the one of the pages, which are
+ * not charged to an EPC cgroup, and the ones of the EPC cgroups, each in
+ * proportion to its size.
+ */
+static unsigned int sgx_reclaim_node_pages(struct sgx_numa_node *node,
+					   struct sgx_epc_page **chunk,
+					   struct sgx_backing *backing,
+					   unsigned int nr_to_scan, bool direct)
+{
+	unsigned long nr_total = atomic_long_read(&node->nr_reclaimable);
+	struct sgx_epc_cgroup *epc_cg = NULL;
+	int nid = node - sgx_numa_nodes;
+	unsigned int nr_reclaimed;
+
+	if (!nr_total)
+		return 0;
+
+	nr_reclaimed = sgx_reclaim_lru_share(&node->lru, chunk, backing,
+					     nr_to_scan, nr_total, direct);
+
+	while ((epc_cg = sgx_epc_cgroup_iter(epc_cg, NULL)))
+		nr_reclaimed += sgx_reclaim_lru_share(sgx_epc_cgroup_lru(epc_cg, nid),
+						      chunk, backing, nr_to_scan,
+						      nr_total, direct);
+
+	return nr_reclaimed;
 }
 
-static unsigned long sgx_nr_free_pages(void)
+/*
+ * Reclaim a small fixed size batch on behalf of an allocating thread. The
+ * chunk lives on the stack as there can be any number of direct reclaimers.
+ */
+static unsigned int sgx_reclaim_pages_direct(struct sgx_numa_node *node)
 {
-	unsigned long cnt = 0;
+	struct sgx_epc_page *chunk[SGX_NR_TO_SCAN];
+	struct sgx_backing backing[SGX_NR_TO_SCAN];
+
+	return sgx_reclaim_node_pages(node, chunk, backing, SGX_NR_TO_SCAN,
+				      true);
+}
+
+/*
+ * The free pages of @node, including those in the per-CPU caches. The count can
+ * briefly go below zero, when a page is allocated before its free is accounted.
+ */
+static unsigned long sgx_nr_free_pages(struct sgx_numa_node *node)
+{
+	return max(atomic_long_read(&node->nr_free_pages), 0L);
+}
+
+static void sgx_update_pressure(void)
+{
+	unsigned long threshold = READ_ONCE(sgx_pressure_threshold);
+	unsigned long nr_free = 0;
+	bool changed = false;
 	int i;
 
-	for (i = 0; i < sgx_nr_epc_sections; i++)
-		cnt += sgx_epc_sections[i].free_cnt;
+	if (!threshold) {
+		if (test_bit(0, &sgx_pressure))
+			changed = test_and_clear_bit(0, &sgx_pressure);
+		goto out;
+	}
+
+	for (i = 0; i < sgx_nr_numa_nodes; i++)
+		nr_free += sgx_nr_free_pages(&sgx_numa_nodes[i]);
 
-	return cnt;
+	if (nr_free < threshold) {
+		if (!test_bit(0, &sgx_pressure))
+			changed = !test_and_set_bit(0, &sgx_pressure);
+	} else if (nr_free >= threshold * 2) {
+		if (test_bit(0, &sgx_pressure))
+			changed = test_and_clear_bit(0, &sgx_pressure);
+	}
+
+out:
+	if (changed && sgx_pressure_kn)
+		sysfs_notify_dirent(sgx_pressure_kn);
+}
+
+static bool sgx_should_reclaim(struct sgx_numa_node *node,
+			       unsigned long watermark)
+{
+	return sgx_nr_free_pages(node) < watermark && !sgx_lru_empty(node);
+}
+
+/*
+ * Grow the batch size of ksgxd exponentially while the node stays below its low
+ * watermark, i.e. while the allocators are likely to fall back to direct
+ * reclaim, and let it decay back once the pressure goes away.
+ */
+static unsigned int sgx_reclaim_batch_size(struct sgx_numa_node *node)
+{
+	if (sgx_nr_free_pages(node) < node->low_watermark)
+		node->nr_to_scan = min_t(unsigned int, node->nr_to_scan * 2,
+					 SGX_NR_TO_SCAN_MAX);
+	else
+		node->nr_to_scan = max_t(unsigned int, node->nr_to_scan / 2,
+					 SGX_NR_TO_SCAN);
+
+	return node->nr_to_scan;
+}
+
+/*
+ * Pick the node for direct reclaim: prefer the node the caller is allocating
+ * from, which is typically the local node so that the backing page writes stay
+ * node-local, but fall back to any node that still has pages to reclaim.
+ */
+static struct sgx_numa_node *sgx_reclaim_node(int nid)
+{
+	int i;
+
+	if (nid < sgx_nr_numa_nodes && !sgx_lru_empty(&sgx_numa_nodes[nid]))
+		return &sgx_numa_nodes[nid];
+
+	for (i = 0; i < sgx_nr_numa_nodes; i++) {
+		if (!sgx_lru_empty(&sgx_numa_nodes[i]))
+			return &sgx_numa_nodes[i];
+	}
+
+	return NULL;
 }
 
-static bool sgx_should_reclaim(unsigned long watermark)
+/*
+ * Reclaim pages of @node on behalf of an allocating thread, or if enough
+ * threads are already doing that, kick ksgxd and wait until either of them
+ * frees a page for us, instead of piling up on the same LRU lists. The waiters
+ * are queued exclusively so that a page freed wakes up a single waiter. The
+ * wait is bounded, as the freed pages can be taken by the other allocators.
+ */
+static void sgx_reclaim_throttle(struct sgx_numa_node *node)
 {
-	return sgx_nr_free_pages() < watermark &&
-	       !list_empty(&sgx_active_page_list);
+	unsigned int nr_reclaimed;
+	DEFINE_WAIT(wait);
+
+	if (atomic_inc_return(&node->nr_direct_reclaimers) <=
+	    SGX_NR_DIRECT_RECLAIMERS) {
+		nr_reclaimed = sgx_reclaim_pages_direct(node);
+		atomic_dec(&node->nr_direct_reclaimers);
+
+		if (nr_reclaimed)
+			wake_up_nr(&node->alloc_waitq, nr_reclaimed);
+		return;
+	}
+
+	atomic_dec(&node->nr_direct_reclaimers);
+	wake_up(&node->waitq);
+
+	prepare_to_wait_exclusive(&node->alloc_waitq, &wait, TASK_INTERRUPTIBLE);
+	if (!sgx_nr_free_pages(node))
+		schedule_timeout(SGX_RECLAIM_THROTTLE_TIMEOUT);
+	finish_wait(&node->alloc_waitq, &wait);
 }
 
 static int ksgxd(void *p)
 {
+	struct sgx_numa_node *node = p;
+	int nid = node - sgx_numa_nodes;
+	const struct cpumask *cpumask = cpumask_of_node(nid);
+	unsigned int nr_to_scan, nr_reclaimed;
+	struct sgx_epc_section *section;
 	int i;
 
+	/* Keep the EWB traffic local to the node. */
+	if (!cpumask_empty(cpumask))
+		set_cpus_allowed_ptr(current, cpumask);
+
 	set_freezable();
 
 	/*
 	 * Sanitize pages in order to recover from kexec(). The 2nd pass is
-	 * required for SECS pages, whose child pages blocked EREMOVE.
+	 * required for SECS pages, whose child pages blocked EREMOVE. It only
+	 * processes the few pages left over by the parallel 1st pass.
 	 */
-	for (i = 0; i < sgx_nr_epc_sections; i++)
-		sgx_sanitize_section(&sgx_epc_sections[i]);
+	sgx_sanitize_node(node);
 
-	for (i = 0; i < sgx_nr_epc_sections; i++) {
-		sgx_sanitize_section(&sgx_epc_sections[i]);
+	for (i = 0; i < node->nr_sections && !kthread_should_stop(); i++) {
+		section = node->sections[i];
+		sgx_sanitize_section(section);
 
 		/* Should never happen. */
-		if (!list_empty(&sgx_epc_sections[i].laundry_list))
-			WARN(1, "EPC section %d has unsanitized pages.\n", i);
+		if (!list_empty(&section->laundry_list))
+			WARN(1, "EPC section %td has unsanitized pages.\n",
+			     section - sgx_epc_sections);
 	}
 
+	sgx_fill_va_reserve();
+
 	while (!kthread_should_stop()) {
 		if (try_to_freeze())
 			continue;
 
-		wait_event_freezable(ksgxd_waitq,
-				     kthread_should_stop() ||
-				     sgx_should_reclaim(SGX_NR_HIGH_PAGES));
+		wait_event_freezable(node->waitq,
+				     kthread_should_stop() ||
+				     sgx_should_reclaim(node, node->high_watermark));
+
+		if (sgx_should_reclaim(node, node->high_watermark)) {
+			nr_to_scan = sgx_reclaim_batch_size(node);
+			nr_reclaimed = sgx_reclaim_node_pages(node, node->chunk,
+							      node->backing,
+							      nr_to_scan, false);
+			if (nr_reclaimed) {
+				wake_up_nr(&node->alloc_waitq, nr_reclaimed);
+				sgx_update_pressure();
+			}
+		}
+
+		cond_resched();
+	}
+
+	return 0;
+}
+
+static void sgx_page_reclaimer_stop(void)
+{
+	struct sgx_numa_node *node;
+	int i;
+
+	for (i = 0; i < sgx_nr_numa_nodes; i++) {
+		node = &sgx_numa_nodes[i];
+
+		if (node->ksgxd_tsk) {
+			kthread_stop(node->ksgxd_tsk);
+			node->ksgxd_tsk = NULL;
+		}
+
+		kfree(node->chunk);
+		node->chunk = NULL;
+		kfree(node->backing);
+		node->backing = NULL;
+	}
+}
+
+static bool __init sgx_page_reclaimer_init(void)
+{
+	struct sgx_numa_node *node;
+	struct task_struct *tsk;
+	int i;
+
+	for (i = 0; i < sgx_nr_numa_nodes; i++) {
+		node = &sgx_numa_nodes[i];
+		if (!node->nr_sections)
+			continue;
+
+		node->chunk = kcalloc_node(SGX_NR_TO_SCAN_MAX, sizeof(*node->chunk),
+					   GFP_KERNEL, i);
+		node->backing = kcalloc_node(SGX_NR_TO_SCAN_MAX,
+					     sizeof(*node->backing), GFP_KERNEL, i);
+		if (!node->chunk || !node->backing) {
+			sgx_page_reclaimer_stop();
+			return false;
+		}
+
+		tsk = kthread_create_on_node(ksgxd, node, i, "ksgxd/%d", i);
+		if (IS_ERR(tsk)) {
+			sgx_page_reclaimer_stop();
+			return false;
+		}
+
+		node->ksgxd_tsk = tsk;
+		wake_up_process(tsk);
+	}
+
+	return true;
+}
+
+/*
+ * Set the low watermark of each node to sgx_watermark_scale_factor / 10000 of
+ * its EPC, but to at least SGX_NR_LOW_PAGES, and the high watermark to twice
+ * the low watermark, in the same manner as vm.watermark_scale_factor does for
+ * the page allocator.
+ */
+static void sgx_setup_watermarks(void)
+{
+	struct sgx_numa_node *node;
+	unsigned long low;
+	int i;
+
+	for (i = 0; i < sgx_nr_numa_nodes; i++) {
+		node = &sgx_numa_nodes[i];
+
+		low = mult_frac(node->nr_pages, sgx_watermark_scale_factor, 10000);
+		low = max_t(unsigned long, low, SGX_NR_LOW_PAGES);
+
+		WRITE_ONCE(node->low_watermark, low);
+		WRITE_ONCE(node->high_watermark, low * 2);
+	}
+}
+
+static ssize_t watermark_scale_factor_show(struct kobject *kobj,
+					   struct kobj_attribute *attr,
+					   char *buf)
+{
+	return sprintf(buf, "%u\n", sgx_watermark_scale_factor);
+}
+
+static ssize_t watermark_scale_factor_store(struct kobject *kobj,
+					    struct kobj_attribute *attr,
+					    const char *buf, size_t count)
+{
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	if (!val || val > SGX_WATERMARK_SCALE_MAX)
+		return -EINVAL;
+
+	sgx_watermark_scale_factor = val;
+	sgx_setup_watermarks();
+
+	return count;
+}
+
+static struct kobj_attribute watermark_scale_factor_attr =
+	__ATTR_RW(watermark_scale_factor);
+
+static ssize_t watermarks_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	struct sgx_numa_node *node;
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < sgx_nr_numa_nodes; i++) {
+		node = &sgx_numa_nodes[i];
+		if (!node->nr_sections)
+			continue;
+
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "node %d: free %lu low %lu high %lu\n", i,
+				 sgx_nr_free_pages(node),
+				 READ_ONCE(node->low_watermark),
+				 READ_ONCE(node->high_watermark));
+	}
+
+	return len;
+}
+
+static struct kobj_attribute watermarks_attr = __ATTR_RO(watermarks);
+
+/*
+ * Reclaim the given number of pages from all the nodes in round-robin, e.g. in
+ * order to make room ahead of launching a large enclave. Fail with -EAGAIN, if
+ * the reclaimer runs out of pages before the target is reached.
+ */
+static ssize_t reclaim_store(struct kobject *kobj, struct kobj_attribute *attr,
+			     const char *buf, size_t count)
+{
+	unsigned long nr_pages, nr_reclaimed = 0;
+	struct sgx_numa_node *node;
+	unsigned int progress;
+	int ret, i;
+
+	ret = kstrtoul(buf, 0, &nr_pages);
+	if (ret)
+		return ret;
+
+	while (nr_reclaimed < nr_pages) {
+		if (signal_pending(current))
+			return -EINTR;
+
+		progress = 0;
+		for (i = 0; i < sgx_nr_numa_nodes; i++) {
+			node = &sgx_numa_nodes[i];
+
+			if (!sgx_lru_empty(node))
+				progress += sgx_reclaim_pages_direct(node);
+		}
+
+		if (!progress)
+			return -EAGAIN;
+
+		nr_reclaimed += progress;
+		sgx_update_pressure();
+		cond_resched();
+	}
+
+	return count;
+}
+
+static struct kobj_attribute reclaim_attr = __ATTR_WO(reclaim);
+
+static ssize_t nr_virt_epc_zombies_show(struct kobject *kobj,
+					struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", sgx_virt_epc_nr_zombies());
+}
+
+static struct kobj_attribute nr_virt_epc_zombies_attr =
+	__ATTR_RO(nr_virt_epc_zombies);
+
+static ssize_t nr_virt_epc_pages_show(struct kobject *kobj,
+				      struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", sgx_virt_epc_nr_pages());
+}
+
+static struct kobj_attribute nr_virt_epc_pages_attr =
+	__ATTR_RO(nr_virt_epc_pages);
+
+static ssize_t pressure_threshold_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", READ_ONCE(sgx_pressure_threshold));
+}
+
+/* Set the threshold in pages, or disable the notifications with 0. */
+static ssize_t pressure_threshold_store(struct kobject *kobj,
+					struct kobj_attribute *attr,
+					const char *buf, size_t count)
+{
+	unsigned long val;
+	int ret;
+
+	ret = kstrtoul(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	if (val > ULONG_MAX / 2)
+		return -EINVAL;
+
+	WRITE_ONCE(sgx_pressure_threshold, val);
+	sgx_update_pressure();
+
+	return count;
+}
+
+static struct kobj_attribute pressure_threshold_attr =
+	__ATTR_RW(pressure_threshold);
+
+static ssize_t pressure_show(struct kobject *kobj,
+			     struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", test_bit(0, &sgx_pressure));
+}
+
+static struct kobj_attribute pressure_attr = __ATTR_RO(pressure);
+
+static struct attribute *sgx_attrs[] = {
+	&watermark_scale_factor_attr.attr,
+	&watermarks_attr.attr,
+	&reclaim_attr.attr,
+	&nr_virt_epc_zombies_attr.attr,
+	&nr_virt_epc_pages_attr.attr,
+	&pressure_threshold_attr.attr,
+	&pressure_attr.attr,
+	NULL,
+};
+
+static const struct attribute_group sgx_attr_group = {
+	.attrs = sgx_attrs,
+};
+
+/*
+ * Create /sys/kernel/mm/sgx. The reclaimer works fine with the default
+ * watermarks without it, so a failure is not fatal.
+ */
+static void __init sgx_sysfs_init(void)
+{
+	struct kobject *kobj;
+
+	kobj = kobject_create_and_add("sgx", mm_kobj);
+	if (!kobj) {
+		pr_warn("Failed to create the sysfs directory\n");
+		return;
+	}
+
+	if (sysfs_create_group(kobj, &sgx_attr_group)) {
+		pr_warn("Failed to create the sysfs attributes\n");
+		kobject_put(kobj);
+		return;
+	}
+
+	sgx_pressure_kn = sysfs_get_dirent(kobj->sd, "pressure");
+}
+
+static struct sgx_epc_page *__sgx_alloc_epc_page_from_section(struct sgx_epc_section *section)
+{
+	struct sgx_epc_page *page;
+
+	spin_lock(&section->lock);
+
+	if (list_empty(&section->page_list)) {
+		spin_unlock(&section->lock);
+		return NULL;
+	}
+
+	page = list_first_entry(&section->page_list, struct sgx_epc_page, list);
+	list_del_init(&page->list);
+	section->free_cnt--;
+
+	spin_unlock(&section->lock);
+
+	sgx_account_free_pages(page, -1);
+	return page;
+}
+
+static struct sgx_epc_page *__sgx_alloc_epc_page_from_node(int nid)
+{
+	struct sgx_numa_node *node = &sgx_numa_nodes[nid];
+	struct sgx_epc_section *section;
+	struct sgx_epc_page *page;
+	int i;
+
+	for (i = 0; i < node->nr_sections; i++) {
+		section = node->sections[i];
+
+		page = __sgx_alloc_epc_page_from_section(section);
+		if (page)
+			return page;
+	}
+
+	return NULL;
+}
+
+/*
+ * Move up to @nr free pages of the node to @pcp, taking the lock of each
+ * section once.
+ */
+static void sgx_epc_pcp_refill(struct sgx_epc_pcp *pcp, int nid,
+			       unsigned int nr)
+{
+	struct sgx_numa_node *node = &sgx_numa_nodes[nid];
+	struct sgx_epc_section *section;
+	struct sgx_epc_page *page;
+	int i;
+
+	for (i = 0; i < node->nr_sections && pcp->count < nr; i++) {
+		section = node->sections[i];
+
+		spin_lock(&section->lock);
+		while (pcp->count < nr && !list_empty(&section->page_list)) {
+			page = list_first_entry(&section->page_list,
+						struct sgx_epc_page, list);
+			list_move_tail(&page->list, &pcp->page_list);
+			section->free_cnt--;
+			pcp->count++;
+		}
+		spin_unlock(&section->lock);
+	}
+}
+
+/* Return the @nr coldest pages of @pcp back to their sections. */
+static void sgx_epc_pcp_drain(struct sgx_epc_pcp *pcp, unsigned int nr)
+{
+	struct sgx_epc_section *section;
+	struct sgx_epc_page *page;
+
+	while (nr-- && pcp->count) {
+		page = list_last_entry(&pcp->page_list, struct sgx_epc_page,
+				       list);
+		section = &sgx_epc_sections[page->section];
 
-		if (sgx_should_reclaim(SGX_NR_HIGH_PAGES))
-			sgx_reclaim_pages();
+		spin_lock(&section->lock);
+		list_move_tail(&page->list, &section->page_list);
+		section->free_cnt++;
+		spin_unlock(&section->lock);
 
-		cond_resched();
+		pcp->count--;
 	}
-
-	return 0;
 }
 
-static bool __init sgx_page_reclaimer_init(void)
+static struct sgx_epc_page *sgx_epc_pcp_take(struct sgx_epc_pcp *pcp)
 {
-	struct task_struct *tsk;
-
-	tsk = kthread_run(ksgxd, NULL, "ksgxd");
-	if (IS_ERR(tsk))
-		return false;
-
-	ksgxd_tsk = tsk;
+	struct sgx_epc_page *page = NULL;
+
+	if (pcp->count) {
+		page = list_first_entry(&pcp->page_list, struct sgx_epc_page,
+					list);
+		list_del_init(&page->list);
+		pcp->count--;
+		sgx_account_free_pages(page, -1);
+	}
 
-	return true;
+	return page;
 }
 
-static struct sgx_epc_page *__sgx_alloc_epc_page_from_section(struct sgx_epc_section *section)
+/*
+ * Allocate from the cache of the local CPU, refilling it in a batch from the
+ * local node when it's empty.
+ */
+static struct sgx_epc_page *sgx_alloc_epc_page_pcp(void)
 {
 	struct sgx_epc_page *page;
+	struct sgx_epc_pcp *pcp;
 
-	spin_lock(&section->lock);
+	pcp = get_cpu_ptr(&sgx_epc_pcp);
+	spin_lock(&pcp->lock);
 
-	if (list_empty(&section->page_list)) {
-		spin_unlock(&section->lock);
-		return NULL;
-	}
+	if (!pcp->count)
+		sgx_epc_pcp_refill(pcp, numa_node_id(), SGX_EPC_PCP_BATCH);
 
-	page = list_first_entry(&section->page_list, struct sgx_epc_page, list);
-	list_del_init(&page->list);
-	section->free_cnt--;
+	page = sgx_epc_pcp_take(pcp);
+
+	spin_unlock(&pcp->lock);
+	put_cpu_ptr(&sgx_epc_pcp);
 
-	spin_unlock(&section->lock);
 	return page;
 }
 
-static struct sgx_epc_page *__sgx_alloc_epc_page_from_node(int nid)
+/*
+ * Last resort when the sections have run dry: steal a page from the cache of
+ * any CPU before failing the allocation.
+ */
+static struct sgx_epc_page *sgx_steal_epc_page_pcp(void)
 {
-	struct sgx_numa_node *node = &sgx_numa_nodes[nid];
-	struct sgx_epc_section *section;
 	struct sgx_epc_page *page;
-	int i;
+	struct sgx_epc_pcp *pcp;
+	int cpu;
 
-	for (i = 0; i < node->nr_sections; i++) {
-		section = node->sections[i];
+	for_each_possible_cpu(cpu) {
+		pcp = per_cpu_ptr(&sgx_epc_pcp, cpu);
+
+		spin_lock(&pcp->lock);
+		page = sgx_epc_pcp_take(pcp);
+		spin_unlock(&pcp->lock);
 
-		page = __sgx_alloc_epc_page_from_section(section);
 		if (page)
 			return page;
 	}
@@ -503,24 +1612,29 @@ static struct sgx_epc_page *__sgx_alloc_epc_page_from_node(int nid)
 	return NULL;
 }
 
-
-/**
- * __sgx_alloc_epc_page() - Allocate an EPC page
- *
- * Iterate through EPC sections and borrow a free EPC page to the caller. When a
- * page is no longer needed it must be released with sgx_free_epc_page().
- *
- * Return:
- *   an EPC page,
- *   -errno on error
+/*
+ * Return the node to allocate from first according to the memory policy of the
+ * calling task, i.e. the preferred node, the next node to interleave or the
+ * first node of the bind set, or the local node by default.
  */
-struct sgx_epc_page *__sgx_alloc_epc_page(void)
+static int sgx_epc_policy_nid(void)
+{
+#ifdef CONFIG_NUMA
+	return mempolicy_slab_node();
+#else
+	return numa_node_id();
+#endif
+}
+
+static struct sgx_epc_page *__sgx_alloc_epc_page_nid(int nid)
 {
 	struct sgx_epc_page *page;
-	int nid = numa_node_id();
 	int i;
 
-	page = __sgx_alloc_epc_page_from_node(nid);
+	if (nid == numa_node_id())
+		page = sgx_alloc_epc_page_pcp();
+	else
+		page = __sgx_alloc_epc_page_from_node(nid);
 	if (page)
 		return page;
 
@@ -533,29 +1647,53 @@ struct sgx_epc_page *__sgx_alloc_epc_page(void)
 			return page;
 	}
 
+	page = sgx_steal_epc_page_pcp();
+	if (page)
+		return page;
+
 	return ERR_PTR(-ENOMEM);
 }
 
+/**
+ * __sgx_alloc_epc_page() - Allocate an EPC page
+ *
+ * Borrow a free EPC page to the caller, starting from the node selected by the
+ * memory policy of the calling task. Pages of the local node are taken from the
+ * cache of the local CPU. If the node is out of pages, iterate through the EPC
+ * sections of the other nodes. When a page is no longer needed it must be
+ * released with sgx_free_epc_page().
+ *
+ * Return:
+ *   an EPC page,
+ *   -errno on error
+ */
+struct sgx_epc_page *__sgx_alloc_epc_page(void)
+{
+	return __sgx_alloc_epc_page_nid(sgx_epc_policy_nid());
+}
+
 /**
  * sgx_mark_page_reclaimable() - Mark a page as reclaimable
  * @page:	EPC page
  *
  * Mark a page as reclaimable and add it to the active page list. Pages
- * are automatically removed from the active list when freed.
+ * are automatically removed from the LRU lists when freed.
  */
 void sgx_mark_page_reclaimable(struct sgx_epc_page *page)
 {
-	spin_lock(&sgx_reclaimer_lock);
+	struct sgx_epc_lru *lru = sgx_epc_page_lru(page);
+
+	spin_lock(&lru->lock);
 	page->flags |= SGX_EPC_PAGE_RECLAIMER_TRACKED;
-	list_add_tail(&page->list, &sgx_active_page_list);
-	spin_unlock(&sgx_reclaimer_lock);
+	sgx_lru_add(lru, page, false);
+	spin_unlock(&lru->lock);
 }
 
 /**
  * sgx_unmark_page_reclaimable() - Remove a page from the reclaim list
  * @page:	EPC page
  *
- * Clear the reclaimable flag and remove the page from the active page list.
+ * Clear the reclaimable flag and remove the page from its LRU list.
  *
  * Return:
  *   0 on success,
@@ -563,52 +1701,77 @@ void sgx_mark_page_reclaimable(struct sgx_epc_page *page)
  */
 int sgx_unmark_page_reclaimable(struct sgx_epc_page *page)
 {
-	spin_lock(&sgx_reclaimer_lock);
+	struct sgx_epc_lru *lru = sgx_epc_page_lru(page);
+
+	spin_lock(&lru->lock);
 	if (page->flags & SGX_EPC_PAGE_RECLAIMER_TRACKED) {
 		/* The page is being reclaimed. */
 		if (list_empty(&page->list)) {
-			spin_unlock(&sgx_reclaimer_lock);
+			spin_unlock(&lru->lock);
 			return -EBUSY;
 		}
 
-		list_del(&page->list);
-		page->flags &= ~SGX_EPC_PAGE_RECLAIMER_TRACKED;
+		sgx_lru_del(lru, page);
+		page->flags &= ~(SGX_EPC_PAGE_RECLAIMER_TRACKED |
+				 SGX_EPC_PAGE_INACTIVE);
 	}
-	spin_unlock(&sgx_reclaimer_lock);
+	spin_unlock(&lru->lock);
 
 	return 0;
 }
 
 /**
- * sgx_alloc_epc_page() - Allocate an EPC page
+ * sgx_alloc_epc_page_nid() - Allocate an EPC page, starting from a node
  * @owner:	the owner of the EPC page
+ * @nid:	the node to allocate from first, or NUMA_NO_NODE for the node
+ *		selected by the memory policy of the calling task
  * @reclaim:	reclaim pages if necessary
  *
- * Iterate through EPC sections and borrow a free EPC page to the caller. When a
- * page is no longer needed it must be released with sgx_free_epc_page(). If
- * @reclaim is set to true, directly reclaim pages when we are out of pages. No
- * mm's can be locked when @reclaim is set to true.
+ * Iterate through EPC sections and borrow a free EPC page to the caller,
+ * starting from @nid.
+ * When a page is no longer needed it must be released with sgx_free_epc_page().
+ * If @reclaim is set to true, directly reclaim pages when we are out of pages,
+ * preferably from the node selected by the memory policy. No mm's can be locked
+ * when @reclaim is set to true.
  *
- * Finally, wake up ksgxd when the number of pages goes below the watermark
- * before returning back to the caller.
+ * The page is charged to the EPC cgroup of the calling task, whose limit is
+ * enforced by reclaiming the pages of the cgroup, see
+ * sgx_epc_cgroup_try_charge().
+ *
+ * Finally, wake up the ksgxd of each node, whose number of free pages goes below
+ * its low watermark, before returning back to the caller.
  *
  * Return:
  *   an EPC page,
  *   -errno on error
  */
-struct sgx_epc_page *sgx_alloc_epc_page(void *owner, bool reclaim)
+struct sgx_epc_page *sgx_alloc_epc_page_nid(void *owner, int nid, bool reclaim)
 {
+	struct sgx_epc_cgroup *epc_cg;
+	struct sgx_numa_node *node;
 	struct sgx_epc_page *page;
+	int i;
+
+	if (nid == NUMA_NO_NODE)
+		nid = sgx_epc_policy_nid();
+
+	epc_cg = sgx_epc_cgroup_try_charge(reclaim);
+	if (IS_ERR(epc_cg))
+		return ERR_CAST(epc_cg);
 
 	for ( ; ; ) {
-		page = __sgx_alloc_epc_page();
+		page = __sgx_alloc_epc_page_nid(nid);
 		if (!IS_ERR(page)) {
 			page->owner = owner;
+			sgx_epc_page_set_cgroup(page, epc_cg);
 			break;
 		}
 
-		if (list_empty(&sgx_active_page_list))
-			return ERR_PTR(-ENOMEM);
+		node = sgx_reclaim_node(nid);
+		if (!node) {
+			page = ERR_PTR(-ENOMEM);
+			break;
+		}
 
 		if (!reclaim) {
 			page = ERR_PTR(-EBUSY);
@@ -620,25 +1783,249 @@ struct sgx_epc_page *sgx_alloc_epc_page(void *owner, bool reclaim)
 			break;
 		}
 
-		sgx_reclaim_pages();
+		sgx_reclaim_throttle(node);
 		cond_resched();
 	}
 
-	if (sgx_should_reclaim(SGX_NR_LOW_PAGES))
-		wake_up(&ksgxd_waitq);
+	if (IS_ERR(page))
+		sgx_epc_cgroup_uncharge(epc_cg);
+	else
+		sgx_update_pressure();
+
+	for (i = 0; i < sgx_nr_numa_nodes; i++) {
+		node = &sgx_numa_nodes[i];
+
+		if (sgx_should_reclaim(node, node->low_watermark))
+			wake_up(&node->waitq);
+	}
 
 	return page;
 }
 
+/**
+ * sgx_alloc_epc_page() - Allocate an EPC page
+ * @owner:	the owner of the EPC page
+ * @reclaim:	reclaim pages if necessary
+ *
+ * Same as sgx_alloc_epc_page_nid(), starting from the node selected by the
+ * memory policy of the calling task.
+ *
+ * Return:
+ *   an EPC page,
+ *   -errno on error
+ */
+struct sgx_epc_page *sgx_alloc_epc_page(void *owner, bool reclaim)
+{
+	return sgx_alloc_epc_page_nid(owner, NUMA_NO_NODE, reclaim);
+}
+
+/**
+ * sgx_reclaim_direct() - Reclaim a batch of EPC pages
+ *
+ * Reclaim a batch of pages on behalf of a caller that failed to allocate a page
+ * with @reclaim set to false because it was holding an mm, once it has dropped
+ * the mm. No mm's can be locked by the caller.
+ */
+void sgx_reclaim_direct(void)
+{
+	struct sgx_numa_node *node = sgx_reclaim_node(numa_node_id());
+
+	if (node)
+		sgx_reclaim_throttle(node);
+}
+
+/**
+ * sgx_reclaim_epc_cgroup() - Reclaim a batch of EPC pages of a cgroup
+ * @root:	an EPC cgroup
+ *
+ * Reclaim a batch of pages charged to @root or its descendants, from the LRUs
+ * of all the nodes, in order to enforce the limit of @root. No mm's can be
+ * locked by the caller.
+ *
+ * Return: the number of reclaimed pages
+ */
+unsigned int sgx_reclaim_epc_cgroup(struct sgx_epc_cgroup *root)
+{
+	struct sgx_epc_page *chunk[SGX_NR_TO_SCAN];
+	struct sgx_backing backing[SGX_NR_TO_SCAN];
+	struct sgx_epc_cgroup *epc_cg = NULL;
+	unsigned int nr_reclaimed = 0;
+	struct sgx_epc_lru *lru;
+	int nid;
+
+	while ((epc_cg = sgx_epc_cgroup_iter(epc_cg, root))) {
+		for (nid = 0; nid < sgx_nr_numa_nodes; nid++) {
+			lru = sgx_epc_cgroup_lru(epc_cg, nid);
+			if (sgx_epc_lru_size(lru))
+				nr_reclaimed += sgx_reclaim_pages(lru, chunk, backing,
+								  SGX_NR_TO_SCAN,
+								  true);
+		}
+
+		if (nr_reclaimed >= SGX_NR_TO_SCAN) {
+			sgx_epc_cgroup_iter_break(epc_cg);
+			break;
+		}
+	}
+
+	return nr_reclaimed;
+}
+
+/*
+ * Take a page off its LRU like the reclaimer does, unless the reclaimer already
+ * has it or the page is not reclaimable.
+ */
+static bool sgx_isolate_epc_page(struct sgx_epc_page *page)
+{
+	struct sgx_epc_lru *lru = sgx_epc_page_lru(page);
+	bool isolated = false;
+
+	spin_lock(&lru->lock);
+	if ((page->flags & SGX_EPC_PAGE_RECLAIMER_TRACKED) &&
+	    !list_empty(&page->list)) {
+		sgx_lru_del(lru, page);
+		isolated = true;
+	}
+	spin_unlock(&lru->lock);
+
+	return isolated;
+}
+
+/**
+ * sgx_encl_migrate() - Move the pages of an enclave range to a node
+ * @encl:	an enclave
+ * @start:	start address of the range
+ * @end:	end address of the range
+ * @nid:	the target node, or NUMA_NO_NODE for the node selected by the
+ *		memory policy of the calling task
+ * @count:	the number of bytes of the range processed
+ *
+ * Pages allocated from a remote node, e.g. because the local node was out of
+ * pages at the time, stay there until they happen to be reclaimed. Move the
+ * resident pages of the range, which are in EPC of another node than @nid, by
+ * reclaiming them with EWB and loading them back with ELDU to EPC of @nid. The
+ * pages are processed in chunks that share the ETRACK rounds and the backing
+ * storage lookups, for as long as @nid stays above its low watermark, so that
+ * the migration doesn't trigger reclaim on @nid. The SECS and the VA pages are
+ * not moved.
+ *
+ * Return:
+ *   0 on success, also when @nid has run out of free pages,
+ *   -EINVAL if @nid has no EPC,
+ *   -ERESTARTSYS if interrupted by a signal,
+ *   -errno on error
+ */
+int sgx_encl_migrate(struct sgx_encl *encl, unsigned long start,
+		     unsigned long end, int nid, unsigned long *count)
+{
+	struct sgx_encl_page *entries[SGX_NR_TO_SCAN];
+	struct sgx_epc_page *chunk[SGX_NR_TO_SCAN];
+	struct sgx_backing backing[SGX_NR_TO_SCAN];
+	unsigned long addr = start, index;
+	struct sgx_encl_page *entry;
+	struct sgx_numa_node *node;
+	int ret = 0;
+	int cnt, i;
+
+	if (nid == NUMA_NO_NODE)
+		nid = sgx_epc_policy_nid();
+
+	if (nid < 0 || nid >= sgx_nr_numa_nodes ||
+	    !sgx_numa_nodes[nid].nr_sections)
+		return -EINVAL;
+
+	node = &sgx_numa_nodes[nid];
+
+	while (addr < end) {
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+
+		if (sgx_nr_free_pages(node) < node->low_watermark + SGX_NR_TO_SCAN)
+			break;
+
+		cnt = 0;
+
+		mutex_lock(&encl->lock);
+		xa_for_each_range(&encl->page_array, index, entry,
+				  PFN_DOWN(addr), PFN_DOWN(end - 1)) {
+			addr = PFN_PHYS(index + 1);
+
+			if (!entry->epc_page ||
+			    entry->desc & SGX_ENCL_PAGE_BEING_RECLAIMED ||
+			    sgx_epc_sections[entry->epc_page->section].nid == nid)
+				continue;
+
+			if (!sgx_isolate_epc_page(entry->epc_page))
+				continue;
+
+			kref_get(&encl->refcount);
+			chunk[cnt] = entry->epc_page;
+			entries[cnt] = entry;
+
+			if (++cnt == SGX_NR_TO_SCAN)
+				break;
+		}
+		mutex_unlock(&encl->lock);
+
+		/* The rest of the range has nothing to move. */
+		if (cnt < SGX_NR_TO_SCAN)
+			addr = end;
+
+		sgx_reclaim_chunk(chunk, backing, cnt);
+
+		mutex_lock(&encl->lock);
+		for (i = 0; i < cnt && !ret; i++) {
+			/* Not reclaimed after all, or faulted back in since. */
+			if (entries[i]->epc_page)
+				continue;
+
+			ret = sgx_encl_reload_page(encl, entries[i], nid);
+		}
+		mutex_unlock(&encl->lock);
+
+		if (ret)
+			break;
+
+		cond_resched();
+	}
+
+	*count = min(addr, end) - start;
+
+	return ret;
+}
+
 /**
  * __sgx_free_epc_page() - Free an EPC page
  * @page:	pointer to a previously allocated EPC page
  *
- * Insert an EPC page back to the list of free pages.
+ * Insert an EPC page back to the cache of the local CPU, if the page belongs to
+ * the local node, or to the list of free pages.
  */
 void __sgx_free_epc_page(struct sgx_epc_page *page)
 {
 	struct sgx_epc_section *section = &sgx_epc_sections[page->section];
+	struct sgx_epc_pcp *pcp;
+
+	sgx_epc_cgroup_uncharge(sgx_epc_page_cgroup(page));
+	sgx_epc_page_set_cgroup(page, NULL);
+	sgx_account_free_pages(page, 1);
+
+	pcp = get_cpu_ptr(&sgx_epc_pcp);
+	if (section->nid == numa_node_id()) {
+		spin_lock(&pcp->lock);
+		list_add(&page->list, &pcp->page_list);
+		pcp->count++;
+
+		if (pcp->count > SGX_EPC_PCP_HIGH)
+			sgx_epc_pcp_drain(pcp, SGX_EPC_PCP_BATCH);
+
+		spin_unlock(&pcp->lock);
+		put_cpu_ptr(&sgx_epc_pcp);
+		return;
+	}
+	put_cpu_ptr(&sgx_epc_pcp);
 
 	spin_lock(&section->lock);
 	list_add_tail(&page->list, &section->page_list);
@@ -663,10 +2050,119 @@ void sgx_free_epc_page(struct sgx_epc_page *page)
 		return;
 
 	__sgx_free_epc_page(page);
+	sgx_update_pressure();
+}
+
+struct sgx_eremove_list {
+	spinlock_t lock;
+	struct list_head pages;
+};
+
+struct sgx_eremove_work {
+	struct work_struct work;
+	struct sgx_eremove_list *list;
+};
+
+/* Wake up the allocating threads throttled on a node, which has free pages. */
+static void sgx_wake_alloc_waiters(unsigned int nr)
+{
+	struct sgx_numa_node *node;
+	int i;
+
+	for (i = 0; i < sgx_nr_numa_nodes; i++) {
+		node = &sgx_numa_nodes[i];
+
+		if (sgx_nr_free_pages(node))
+			wake_up_nr(&node->alloc_waitq, nr);
+	}
+}
+
+/*
+ * Free the pages of @el in batches of SGX_EREMOVE_BATCH, taken without holding
+ * el->lock during EREMOVE, so that multiple threads can share @el.
+ */
+static void sgx_eremove_batches(struct sgx_eremove_list *el)
+{
+	struct sgx_epc_page *page, *tmp;
+	unsigned int nr;
+	LIST_HEAD(batch);
+
+	for ( ; ; ) {
+		spin_lock(&el->lock);
+		for (nr = 0; nr < SGX_EREMOVE_BATCH; nr++) {
+			if (list_empty(&el->pages))
+				break;
+
+			list_move_tail(el->pages.next, &batch);
+		}
+		spin_unlock(&el->lock);
+
+		if (!nr)
+			break;
+
+		list_for_each_entry_safe(page, tmp, &batch, list) {
+			list_del(&page->list);
+			sgx_free_epc_page(page);
+		}
+
+		sgx_wake_alloc_waiters(nr);
+		cond_resched();
+	}
+}
+
+static void sgx_eremove_work_func(struct work_struct *work)
+{
+	struct sgx_eremove_work *ew = container_of(work, struct sgx_eremove_work,
+						   work);
+
+	sgx_eremove_batches(ew->list);
+}
+
+/**
+ * sgx_free_epc_pages() - Free a list of EPC pages
+ * @pages:	EPC pages linked by their list member, which is emptied
+ * @nr:		the number of pages on @pages
+ *
+ * Same as sgx_free_epc_page() on each page of @pages, with the EREMOVEs spread
+ * over a worker per SGX_EREMOVE_BATCH pages, up to SGX_SANITIZE_MAX_WORKERS
+ * including the calling thread. The pages become available for allocation
+ * batch by batch, instead of after the whole list has been removed.
+ */
+void sgx_free_epc_pages(struct list_head *pages, unsigned long nr)
+{
+	struct sgx_eremove_work *works = NULL;
+	struct sgx_eremove_list el;
+	unsigned int nr_workers;
+	int i;
+
+	spin_lock_init(&el.lock);
+	INIT_LIST_HEAD(&el.pages);
+	list_splice_init(pages, &el.pages);
+
+	nr_workers = clamp_t(unsigned long, nr / SGX_EREMOVE_BATCH, 1,
+			     min_t(unsigned int, num_online_cpus(),
+				   SGX_SANITIZE_MAX_WORKERS)) - 1;
+	if (nr_workers)
+		works = kcalloc(nr_workers, sizeof(*works), GFP_KERNEL);
+	if (!works)
+		nr_workers = 0;
+
+	for (i = 0; i < nr_workers; i++) {
+		INIT_WORK(&works[i].work, sgx_eremove_work_func);
+		works[i].list = &el;
+		queue_work(system_unbound_wq, &works[i].work);
+	}
+
+	sgx_eremove_batches(&el);
+
+	for (i = 0; i < nr_workers; i++)
+		flush_work(&works[i].work);
+
+	kfree(works);
 }
 
 static bool __init sgx_setup_epc_section(u64 phys_addr, u64 size,
-					 unsigned long index,
+					 unsigned long index, int nid,
 					 struct sgx_epc_section *section)
 {
 	unsigned long nr_pages = size >> PAGE_SHIFT;
@@ -683,6 +2179,7 @@ static bool __init sgx_setup_epc_section(u64 phys_addr, u64 size,
 	}
 
 	section->phys_addr = phys_addr;
+	section->nid = nid;
 	spin_lock_init(&section->lock);
 	INIT_LIST_HEAD(&section->page_list);
 	INIT_LIST_HEAD(&section->laundry_list);
@@ -691,6 +2188,7 @@ static bool __init sgx_setup_epc_section(u64 phys_addr, u64 size,
 		section->pages[i].section = index;
 		section->pages[i].flags = 0;
 		section->pages[i].owner = NULL;
+		sgx_epc_page_set_cgroup(&section->pages[i], NULL);
 		list_add_tail(&section->pages[i].list, &section->laundry_list);
 	}
 
@@ -729,9 +2227,29 @@ static bool __init sgx_page_cache_init(void)
 {
 	u32 eax, ebx, ecx, edx, type;
 	struct sgx_numa_node *node;
+	struct sgx_epc_pcp *pcp;
 	u64 pa, size;
 	int i, nid;
 
+	for_each_possible_cpu(i) {
+		pcp = per_cpu_ptr(&sgx_epc_pcp, i);
+
+		spin_lock_init(&pcp->lock);
+		INIT_LIST_HEAD(&pcp->page_list);
+	}
+
+	for (nid = 0; nid < ARRAY_SIZE(sgx_numa_nodes); nid++) {
+		node = &sgx_numa_nodes[nid];
+
+		sgx_epc_lru_init(&node->lru, nid);
+		atomic_long_set(&node->nr_reclaimable, 0);
+		atomic_long_set(&node->nr_free_pages, 0);
+		init_waitqueue_head(&node->waitq);
+		init_waitqueue_head(&node->alloc_waitq);
+		atomic_set(&node->nr_direct_reclaimers, 0);
+		node->nr_to_scan = SGX_NR_TO_SCAN;
+	}
+
 	for (i = 0; i < ARRAY_SIZE(sgx_epc_sections); i++) {
 		cpuid_count(SGX_CPUID, i + SGX_CPUID_EPC, &eax, &ebx, &ecx, &edx);
 
@@ -749,18 +2267,20 @@ static bool __init sgx_page_cache_init(void)
 
 		pr_info("EPC section 0x%llx-0x%llx\n", pa, pa + size - 1);
 
-		if (!sgx_setup_epc_section(pa, size, i, &sgx_epc_sections[i])) {
+		nid = sgx_pfn_to_nid(PFN_DOWN(pa));
+		node = &sgx_numa_nodes[nid];
+
+		if (!sgx_setup_epc_section(pa, size, i, nid, &sgx_epc_sections[i])) {
 			pr_err("No free memory for an EPC section\n");
 			break;
 		}
 
 		sgx_nr_epc_sections++;
 
-		nid = sgx_pfn_to_nid(PFN_DOWN(pa));
-		node = &sgx_numa_nodes[nid];
-
 		node->sections[node->nr_sections] = &sgx_epc_sections[i];
 		node->nr_sections++;
+		node->nr_pages += size >> PAGE_SHIFT;
+		atomic_long_add(size >> PAGE_SHIFT, &node->nr_free_pages);
 
 		sgx_nr_numa_nodes = max(sgx_nr_numa_nodes, nid + 1);
 	}
@@ -770,9 +2290,44 @@ static bool __init sgx_page_cache_init(void)
 		return false;
 	}
 
+	sgx_setup_watermarks();
+
 	return true;
 }
 
+/**
+ * sgx_update_lepubkeyhash() - Update the LE public key hash MSRs of this CPU
+ * @lepubkeyhash:	the new values of IA32_SGXLEPUBKEYHASH{0..3}
+ * @force:		write the MSRs even if they seem to hold the values
+ *
+ * Write the MSRs that were not last written with the same values, which
+ * is the common case when the enclaves are signed by the same key. The cached
+ * values can go stale, when the MSRs are reset behind the kernel's back, e.g.
+ * across S3, so if EINIT fails after the write was skipped, the caller must try
+ * again with @force set. Must be called with preemption disabled.
+ *
+ * Return: true if the MSRs were written
+ */
+bool sgx_update_lepubkeyhash(const u64 *lepubkeyhash, bool force)
+{
+	u64 *cache = this_cpu_ptr(sgx_lepubkeyhash_cache);
+	bool written = false;
+	int i;
+
+	WARN_ON_ONCE(preemptible());
+
+	for (i = 0; i < 4; i++) {
+		if (!force && cache[i] == lepubkeyhash[i])
+			continue;
+
+		wrmsrl(MSR_IA32_SGXLEPUBKEYHASH0 + i, lepubkeyhash[i]);
+		cache[i] = lepubkeyhash[i];
+		written = true;
+	}
+
+	return written;
+}
+
 const struct file_operations sgx_provision_fops = {
 	.owner			= THIS_MODULE,
 };
@@ -819,7 +2374,9 @@ static void __init sgx_init(void)
 
 	if (!sgx_page_reclaimer_init())
 		goto err_page_cache;
-	
+
+	sgx_sysfs_init();
+
 	ret = misc_register(&sgx_dev_provision);
 	if (ret)
 		goto err_provision;
@@ -836,7 +2393,7 @@ static void __init sgx_init(void)
 	misc_deregister(&sgx_dev_provision);
 
 err_kthread:
-	kthread_stop(ksgxd_tsk);
+	sgx_page_reclaimer_stop();
 
 err_page_cache:
 	for (i = 0; i < sgx_nr_epc_sections; i++) {
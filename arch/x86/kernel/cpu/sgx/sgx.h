@@ -6,6 +6,7 @@
 #include <linux/err.h>
 #include <linux/io.h>
 #include <linux/rwsem.h>
+#include <linux/spinlock.h>
 #include <linux/types.h>
 #include <asm/asm.h>
 #include <asm/sgx_arch.h>
@@ -16,19 +17,74 @@
 #define SGX_MAX_EPC_SECTIONS		8
 #define SGX_EEXTEND_BLOCK_SIZE		256
 #define SGX_NR_TO_SCAN			16
+#define SGX_NR_TO_SCAN_MAX		512
 #define SGX_NR_LOW_PAGES		32
-#define SGX_NR_HIGH_PAGES		64
+#define SGX_NR_VA_RESERVE		SGX_NR_TO_SCAN
+#define SGX_WATERMARK_SCALE_FACTOR	50
+#define SGX_WATERMARK_SCALE_MAX		1000
+#define SGX_EPC_PCP_BATCH		8
+#define SGX_EPC_PCP_HIGH		32
+#define SGX_SANITIZE_BATCH		64
+#define SGX_SANITIZE_MAX_WORKERS	16
+#define SGX_EREMOVE_BATCH		256
+#define SGX_NR_DIRECT_RECLAIMERS	1
+#define SGX_RECLAIM_THROTTLE_TIMEOUT	(HZ / 100)
+#define SGX_ZOMBIE_BATCH		64
+#define SGX_ZOMBIE_RETRY_DELAY		HZ
 
 /* Pages, which are being tracked by the page reclaimer. */
 #define SGX_EPC_PAGE_RECLAIMER_TRACKED	BIT(0)
+/* Tracked pages, which are on the inactive list of the page reclaimer. */
+#define SGX_EPC_PAGE_INACTIVE		BIT(1)
+
+struct sgx_epc_cgroup;
+struct sgx_encl;
 
 struct sgx_epc_page {
 	unsigned int section;
 	unsigned int flags;
 	struct sgx_encl_page *owner;
 	struct list_head list;
+#ifdef CONFIG_CGROUP_SGX_EPC
+	struct sgx_epc_cgroup *epc_cg;
+#endif
+};
+
+/*
+ * The reclaimable pages of a node, either those charged to an EPC cgroup or
+ * the rest of them. Reclaimable pages start on @active_page_list. Pages that
+ * have not been accessed since the last scan are aged to @inactive_page_list,
+ * from which the victims are taken. An inactive page that is found accessed is
+ * put back to the active list. Therefore hot pages are only rescanned when the
+ * inactive list needs to be refilled, which bounds the A-bit walks of each
+ * round.
+ *
+ * The lists and their counters must be accessed with @lock acquired.
+ */
+struct sgx_epc_lru {
+	spinlock_t lock;
+	struct list_head active_page_list;
+	struct list_head inactive_page_list;
+	unsigned long nr_active;
+	unsigned long nr_inactive;
+	int nid;
 };
 
+static inline void sgx_epc_lru_init(struct sgx_epc_lru *lru, int nid)
+{
+	spin_lock_init(&lru->lock);
+	INIT_LIST_HEAD(&lru->active_page_list);
+	INIT_LIST_HEAD(&lru->inactive_page_list);
+	lru->nr_active = 0;
+	lru->nr_inactive = 0;
+	lru->nid = nid;
+}
+
+static inline unsigned long sgx_epc_lru_size(struct sgx_epc_lru *lru)
+{
+	return READ_ONCE(lru->nr_active) + READ_ONCE(lru->nr_inactive);
+}
+
 /*
  * The firmware can define multiple chunks of EPC to the different areas of the
  * physical memory e.g. for memory areas of the each node. This structure is
@@ -43,6 +99,7 @@ struct sgx_epc_section {
 	struct sgx_epc_page *pages;
 	unsigned long free_cnt;
 	spinlock_t lock;
+	int nid;
 };
 
 extern struct sgx_epc_section sgx_epc_sections[SGX_MAX_EPC_SECTIONS];
@@ -70,9 +127,17 @@ static inline void *sgx_get_epc_virt_addr(struct sgx_epc_page *page)
 struct sgx_epc_page *__sgx_alloc_epc_page(void);
 void __sgx_free_epc_page(struct sgx_epc_page *page);
 void sgx_free_epc_page(struct sgx_epc_page *page);
+void sgx_free_epc_pages(struct list_head *pages, unsigned long nr);
 
 void sgx_mark_page_reclaimable(struct sgx_epc_page *page);
 int sgx_unmark_page_reclaimable(struct sgx_epc_page *page);
+struct sgx_epc_page *sgx_alloc_epc_page_nid(void *owner, int nid, bool reclaim);
 struct sgx_epc_page *sgx_alloc_epc_page(void *owner, bool reclaim);
+void sgx_reclaim_direct(void);
+struct sgx_epc_page *sgx_take_reserved_va_page(void);
+int sgx_encl_migrate(struct sgx_encl *encl, unsigned long start,
+		     unsigned long end, int nid, unsigned long *count);
+unsigned int sgx_reclaim_epc_cgroup(struct sgx_epc_cgroup *root);
+bool sgx_update_lepubkeyhash(const u64 *lepubkeyhash, bool force);
 
 #endif /* _X86_SGX_H */
@@ -0,0 +1,114 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sgx
+
+#if !defined(_TRACE_SGX_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_SGX_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(sgx_reclaim_pages,
+	    TP_PROTO(int nid, unsigned int nr_to_scan, unsigned int nr_isolated,
+		     unsigned int nr_reclaimed, bool direct),
+	    TP_ARGS(nid, nr_to_scan, nr_isolated, nr_reclaimed, direct),
+	    TP_STRUCT__entry(
+		    __field(int, nid)
+		    __field(unsigned int, nr_to_scan)
+		    __field(unsigned int, nr_isolated)
+		    __field(unsigned int, nr_reclaimed)
+		    __field(bool, direct)
+		    ),
+	    TP_fast_assign(
+		    __entry->nid = nid;
+		    __entry->nr_to_scan = nr_to_scan;
+		    __entry->nr_isolated = nr_isolated;
+		    __entry->nr_reclaimed = nr_reclaimed;
+		    __entry->direct = direct;
+		    ),
+	    TP_printk("nid=%d nr_to_scan=%u nr_isolated=%u nr_reclaimed=%u direct=%d",
+		      __entry->nid, __entry->nr_to_scan, __entry->nr_isolated,
+		      __entry->nr_reclaimed, __entry->direct)
+	   );
+
+TRACE_EVENT(sgx_vma_fault,
+	    TP_PROTO(unsigned long base, unsigned long addr, vm_fault_t ret),
+	    TP_ARGS(base, addr, ret),
+	    TP_STRUCT__entry(
+		    __field(unsigned long, base)
+		    __field(unsigned long, addr)
+		    __field(unsigned int, ret)
+		    ),
+	    TP_fast_assign(
+		    __entry->base = base;
+		    __entry->addr = addr;
+		    __entry->ret = ret;
+		    ),
+	    TP_printk("base=0x%lx addr=0x%lx ret=0x%x",
+		      __entry->base, __entry->addr, __entry->ret)
+	   );
+
+TRACE_EVENT(sgx_encl_eldu,
+	    TP_PROTO(unsigned long base, unsigned long addr, u64 latency_ns,
+		     int ret),
+	    TP_ARGS(base, addr, latency_ns, ret),
+	    TP_STRUCT__entry(
+		    __field(unsigned long, base)
+		    __field(unsigned long, addr)
+		    __field(u64, latency_ns)
+		    __field(int, ret)
+		    ),
+	    TP_fast_assign(
+		    __entry->base = base;
+		    __entry->addr = addr;
+		    __entry->latency_ns = latency_ns;
+		    __entry->ret = ret;
+		    ),
+	    TP_printk("base=0x%lx addr=0x%lx latency_ns=%llu ret=%d",
+		      __entry->base, __entry->addr, __entry->latency_ns,
+		      __entry->ret)
+	   );
+
+TRACE_EVENT(sgx_encl_ewb,
+	    TP_PROTO(unsigned long base, unsigned long addr, int ret,
+		     unsigned int nr_not_tracked),
+	    TP_ARGS(base, addr, ret, nr_not_tracked),
+	    TP_STRUCT__entry(
+		    __field(unsigned long, base)
+		    __field(unsigned long, addr)
+		    __field(int, ret)
+		    __field(unsigned int, nr_not_tracked)
+		    ),
+	    TP_fast_assign(
+		    __entry->base = base;
+		    __entry->addr = addr;
+		    __entry->ret = ret;
+		    __entry->nr_not_tracked = nr_not_tracked;
+		    ),
+	    TP_printk("base=0x%lx addr=0x%lx ret=%d nr_not_tracked=%u",
+		      __entry->base, __entry->addr, __entry->ret,
+		      __entry->nr_not_tracked)
+	   );
+
+TRACE_EVENT(sgx_reclaimer_write,
+	    TP_PROTO(unsigned long base, int nr_pages, bool secs),
+	    TP_ARGS(base, nr_pages, secs),
+	    TP_STRUCT__entry(
+		    __field(unsigned long, base)
+		    __field(int, nr_pages)
+		    __field(bool, secs)
+		    ),
+	    TP_fast_assign(
+		    __entry->base = base;
+		    __entry->nr_pages = nr_pages;
+		    __entry->secs = secs;
+		    ),
+	    TP_printk("base=0x%lx nr_pages=%d secs=%d",
+		      __entry->base, __entry->nr_pages, __entry->secs)
+	   );
+
+#endif /* _TRACE_SGX_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
@@ -5,7 +5,9 @@
 #include <linux/mman.h>
 #include <linux/sched/mm.h>
 #include <linux/sched/signal.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/workqueue.h>
 #include <linux/xarray.h>
 #include <asm/sgx.h>
 #include <uapi/asm/sgx.h>
@@ -16,12 +18,32 @@
 
 struct sgx_virt_epc {
 	struct xarray page_array;
+	/* Serializes allocations, lookups in page_array are lockless. */
 	struct rw_semaphore lock;
 	struct mm_struct *mm;
+	/* The number of entries in page_array, written under lock. */
+	unsigned long nr_pages;
 };
 
 static struct mutex virt_epc_lock;
 static struct list_head virt_epc_zombie_pages;
+/* The length of virt_epc_zombie_pages, protected by virt_epc_lock. */
+static unsigned long virt_epc_nr_zombies;
+/* The sum of nr_pages of all the virtual EPC instances. */
+static atomic_long_t virt_epc_nr_pages;
+
+static void sgx_virt_epc_add_pages(struct sgx_virt_epc *epc, unsigned long nr)
+{
+	WRITE_ONCE(epc->nr_pages, epc->nr_pages + nr);
+	atomic_long_add(nr, &virt_epc_nr_pages);
+}
+
+static void sgx_virt_epc_zombie_work_func(struct work_struct *work);
+static DECLARE_DELAYED_WORK(virt_epc_zombie_work,
+			    sgx_virt_epc_zombie_work_func);
+
+/* The number of slots sgx_virt_epc_populate_vma() reserves at once. */
+#define SGX_VIRT_EPC_POPULATE_BATCH	32
 
 static inline unsigned long sgx_virt_epc_calc_index(struct vm_area_struct *vma,
 						    unsigned long addr)
@@ -42,11 +64,22 @@ static int __sgx_virt_epc_fault(struct sgx_virt_epc *epc,
 	if (epc_page)
 		return 0;
 
-	epc_page = sgx_alloc_epc_page(&epc, false);
+	/*
+	 * Virtual EPC pages are owned by the guest's enclaves and can't be
+	 * reclaimed by the host: EWB and ELDU need the parent SECS of the page,
+	 * which is not known to the host as EADD is not intercepted.  Don't
+	 * reclaim here either, mmap_lock is held, see sgx_virt_epc_fault().
+	 */
+	epc_page = sgx_alloc_epc_page(epc, false);
 	if (IS_ERR(epc_page))
 		return PTR_ERR(epc_page);
 
-	ret = xa_err(xa_store(&epc->page_array, index, epc_page, GFP_KERNEL));
+	/*
+	 * The fast path in sgx_virt_epc_fault() maps whatever it finds in
+	 * page_array, so the page is only published once it is mapped here,
+	 * in the slot reserved beforehand so that the store can't fail.
+	 */
+	ret = xa_reserve(&epc->page_array, index, GFP_KERNEL);
 	if (unlikely(ret))
 		goto err_free;
 
@@ -55,13 +88,16 @@ static int __sgx_virt_epc_fault(struct sgx_virt_epc *epc,
 	ret = vmf_insert_pfn(vma, addr, pfn);
 	if (unlikely(ret != VM_FAULT_NOPAGE)) {
 		ret = -EFAULT;
-		goto err_delete;
+		goto err_release;
 	}
 
+	xa_store(&epc->page_array, index, epc_page, GFP_KERNEL);
+	sgx_virt_epc_add_pages(epc, 1);
+
 	return 0;
 
-err_delete:
-	xa_erase(&epc->page_array, index);
+err_release:
+	xa_release(&epc->page_array, index);
 err_free:
 	sgx_free_epc_page(epc_page);
 	return ret;
@@ -71,8 +107,23 @@ static vm_fault_t sgx_virt_epc_fault(struct vm_fault *vmf)
 {
 	struct vm_area_struct *vma = vmf->vma;
 	struct sgx_virt_epc *epc = vma->vm_private_data;
+	struct sgx_epc_page *epc_page;
+	unsigned long index;
 	int ret;
 
+	/*
+	 * Fast path for pages that have already been allocated, e.g. by a
+	 * different vCPU or mapping.  xa_load() is RCU safe and the page can't
+	 * be freed while the file is mapped, so there's no need to serialize
+	 * against other faults.  vmf_insert_pfn() gracefully handles racing
+	 * with another fault inserting the same PFN.
+	 */
+	index = sgx_virt_epc_calc_index(vma, vmf->address);
+	epc_page = xa_load(&epc->page_array, index);
+	if (epc_page)
+		return vmf_insert_pfn(vma, vmf->address,
+				      PFN_DOWN(sgx_get_epc_phys_addr(epc_page)));
+
 	down_write(&epc->lock);
 	ret = __sgx_virt_epc_fault(epc, vma, vmf->address);
 	up_write(&epc->lock);
@@ -80,8 +131,19 @@ static vm_fault_t sgx_virt_epc_fault(struct vm_fault *vmf)
 	if (!ret || signal_pending(current))
 		return VM_FAULT_NOPAGE;
 
+	/*
+	 * The EPC is oversubscribed by host enclaves.  Evict their pages to
+	 * make room for the guest after dropping mmap_lock, instead of letting
+	 * the vCPU spin on the fault until ksgxd catches up.  A caller passing
+	 * FAULT_FLAG_RETRY_NOWAIT expects mmap_lock to still be held, so leave
+	 * the eviction to ksgxd for it.
+	 */
 	if (ret == -EBUSY && (vmf->flags & FAULT_FLAG_ALLOW_RETRY)) {
+		if (vmf->flags & FAULT_FLAG_RETRY_NOWAIT)
+			return VM_FAULT_RETRY;
+
 		mmap_read_unlock(vma->vm_mm);
+		sgx_reclaim_direct();
 		return VM_FAULT_RETRY;
 	}
 
@@ -107,7 +169,7 @@ static int sgx_virt_epc_access(struct vm_area_struct *vma, unsigned long start,
 		if (i == 0 || PFN_DOWN(addr) != PFN_DOWN(addr - cnt))
 			index = sgx_virt_epc_calc_index(vma, addr);
 
-		down_write(&epc->lock);
+		down_read(&epc->lock);
 		epc_page = xa_load(&epc->page_array, index);
 
 		/*
@@ -117,7 +179,7 @@ static int sgx_virt_epc_access(struct vm_area_struct *vma, unsigned long start,
 		 * have added the page to an enclave.
 		 */
 		if (!epc_page) {
-			up_write(&epc->lock);
+			up_read(&epc->lock);
 			return -EIO;
 		}
 
@@ -139,7 +201,7 @@ static int sgx_virt_epc_access(struct vm_area_struct *vma, unsigned long start,
 				memcpy(buf + i, data + offset, cnt);
 			}
 		}
-		up_write(&epc->lock);
+		up_read(&epc->lock);
 	}
 
 	if (ret)
@@ -169,6 +231,176 @@ static int sgx_virt_epc_mmap(struct file *file, struct vm_area_struct *vma)
 	return 0;
 }
 
+static int sgx_virt_epc_populate_vma(struct sgx_virt_epc *epc,
+				     struct vm_area_struct *vma,
+				     unsigned long addr, unsigned long end,
+				     unsigned long *count)
+{
+	void *reserved[SGX_VIRT_EPC_POPULATE_BATCH];
+	struct sgx_epc_page *epc_page;
+	unsigned long index, nr, i;
+	int ret = 0;
+
+	down_write(&epc->lock);
+
+	while (addr < end && !ret) {
+		if (signal_pending(current) || need_resched())
+			break;
+
+		index = sgx_virt_epc_calc_index(vma, addr);
+		for (nr = 0; nr < ARRAY_SIZE(reserved) &&
+			     addr + nr * PAGE_SIZE < end; nr++) {
+			if (xa_load(&epc->page_array, index + nr))
+				break;
+			reserved[nr] = NULL;
+		}
+
+		if (!nr) {
+			/* Already allocated. */
+			addr += PAGE_SIZE;
+			*count += PAGE_SIZE;
+			continue;
+		}
+
+		/*
+		 * Reserve the slots of the run of missing pages at @addr in one
+		 * tree walk, then allocate, map and publish each page like
+		 * __sgx_virt_epc_fault() does, so that the fast path of
+		 * sgx_virt_epc_fault() never sees a page that may still be
+		 * freed.
+		 */
+		ret = xa_insert_bulk(&epc->page_array, index, reserved, nr,
+				     GFP_KERNEL);
+		if (unlikely(ret))
+			break;
+
+		for (i = 0; i < nr; i++, addr += PAGE_SIZE) {
+			epc_page = sgx_alloc_epc_page(epc, false);
+			if (IS_ERR(epc_page)) {
+				ret = PTR_ERR(epc_page);
+				break;
+			}
+
+			if (unlikely(vmf_insert_pfn(vma, addr,
+					PFN_DOWN(sgx_get_epc_phys_addr(epc_page))) !=
+				     VM_FAULT_NOPAGE)) {
+				sgx_free_epc_page(epc_page);
+				ret = -EFAULT;
+				break;
+			}
+
+			xa_store(&epc->page_array, index + i, epc_page,
+				 GFP_KERNEL);
+			*count += PAGE_SIZE;
+		}
+
+		sgx_virt_epc_add_pages(epc, i);
+
+		for ( ; i < nr; i++)
+			xa_release(&epc->page_array, index + i);
+	}
+
+	up_write(&epc->lock);
+
+	return ret;
+}
+
+/**
+ * sgx_virt_epc_populate() - handler for %SGX_IOC_VEPC_POPULATE
+ * @epc:	a virtual EPC instance
+ * @arg:	userspace pointer to a struct sgx_vepc_populate instance
+ *
+ * Allocate and map the EPC pages for a range of a virtual EPC mapping, e.g. to
+ * populate the EPC of a VM at boot.  Compared to faulting in the pages one at a
+ * time, the fault entry and epc->lock are taken once per VMA and per scheduling
+ * quantum instead of once per page.
+ *
+ * Return:
+ * - 0:		Success.
+ * - -EINVAL:	The range is not contained in mappings of @epc.
+ * - -ENOMEM:	Out of EPC pages.
+ * - -EINTR:	The call was interrupted before data was processed.
+ * - -errno:	POSIX error.
+ */
+static long sgx_virt_epc_populate(struct sgx_virt_epc *epc, void __user *arg)
+{
+	struct sgx_vepc_populate params;
+	struct vm_area_struct *vma;
+	unsigned long addr, end;
+	unsigned long count = 0;
+	int ret = 0;
+
+	if (copy_from_user(&params, arg, sizeof(params)))
+		return -EFAULT;
+
+	if (!IS_ALIGNED(params.addr, PAGE_SIZE) ||
+	    !IS_ALIGNED(params.length, PAGE_SIZE) ||
+	    params.addr + params.length < params.addr)
+		return -EINVAL;
+
+	if (current->mm != epc->mm)
+		return -EINVAL;
+
+	end = params.addr + params.length;
+
+	while (count < params.length) {
+		if (signal_pending(current)) {
+			if (!count)
+				ret = -EINTR;
+
+			break;
+		}
+
+		if (need_resched())
+			cond_resched();
+
+		addr = params.addr + count;
+
+		mmap_read_lock(current->mm);
+
+		vma = find_vma(current->mm, addr);
+		if (!vma || vma->vm_start > addr ||
+		    vma->vm_ops != &sgx_virt_epc_vm_ops ||
+		    vma->vm_private_data != epc) {
+			mmap_read_unlock(current->mm);
+			ret = -EINVAL;
+			break;
+		}
+
+		ret = sgx_virt_epc_populate_vma(epc, vma, addr,
+						min(end, vma->vm_end), &count);
+		mmap_read_unlock(current->mm);
+
+		/* Make room by reclaiming host enclaves, now that no mm is held. */
+		if (ret == -EBUSY) {
+			sgx_reclaim_direct();
+			ret = 0;
+		} else if (ret) {
+			break;
+		}
+	}
+
+	params.count = count;
+
+	if (copy_to_user(arg, &params, sizeof(params)))
+		return -EFAULT;
+
+	return ret;
+}
+
+static long sgx_virt_epc_ioctl(struct file *file, unsigned int cmd,
+			       unsigned long arg)
+{
+	struct sgx_virt_epc *epc = file->private_data;
+
+	switch (cmd) {
+	case SGX_IOC_VEPC_POPULATE:
+		return sgx_virt_epc_populate(epc, (void __user *)arg);
+	default:
+		return -ENOIOCTLCMD;
+	}
+}
+
 static int sgx_virt_epc_free_page(struct sgx_epc_page *epc_page)
 {
 	int ret;
@@ -186,22 +418,90 @@ static int sgx_virt_epc_free_page(struct sgx_epc_page *epc_page)
 	return 0;
 }
 
+/*
+ * Retry EREMOVE on a batch of zombie SECS pages. The children of a zombie can
+ * go away without any virtual EPC instance being released, e.g. when the guest
+ * owning them EREMOVEs them itself, so don't defer the retries until the next
+ * release, which might never come. Keep retrying while zombies remain.
+ */
+static void sgx_virt_epc_zombie_work_func(struct work_struct *work)
+{
+	struct sgx_epc_page *epc_page;
+	LIST_HEAD(secs_pages);
+	int i;
+
+	mutex_lock(&virt_epc_lock);
+
+	for (i = 0; i < SGX_ZOMBIE_BATCH; i++) {
+		epc_page = list_first_entry_or_null(&virt_epc_zombie_pages,
+						    struct sgx_epc_page, list);
+		if (!epc_page)
+			break;
+
+		list_del(&epc_page->list);
+
+		if (sgx_virt_epc_free_page(epc_page))
+			list_add_tail(&epc_page->list, &secs_pages);
+		else
+			WRITE_ONCE(virt_epc_nr_zombies,
+				   virt_epc_nr_zombies - 1);
+	}
+
+	/* Rotate the failed pages so that the next batch tries other pages. */
+	list_splice_tail(&secs_pages, &virt_epc_zombie_pages);
+
+	if (virt_epc_nr_zombies)
+		queue_delayed_work(system_unbound_wq, &virt_epc_zombie_work,
+				   SGX_ZOMBIE_RETRY_DELAY);
+
+	mutex_unlock(&virt_epc_lock);
+}
+
+/**
+ * sgx_virt_epc_nr_zombies() - Get the number of zombie SECS pages
+ *
+ * Return: the number of SECS pages of released virtual EPC instances, which
+ * could not be freed yet because they still have children
+ */
+unsigned long sgx_virt_epc_nr_zombies(void)
+{
+	return READ_ONCE(virt_epc_nr_zombies);
+}
+
+/**
+ * sgx_virt_epc_nr_pages() - Get the number of virtual EPC pages
+ *
+ * Return: the number of EPC pages allocated to the open virtual EPC instances,
+ * not counting the zombie SECS pages of the released ones
+ */
+unsigned long sgx_virt_epc_nr_pages(void)
+{
+	return atomic_long_read(&virt_epc_nr_pages);
+}
+
 static int sgx_virt_epc_release(struct inode *inode, struct file *file)
 {
 	struct sgx_virt_epc *epc = file->private_data;
 	struct sgx_epc_page *epc_page, *tmp, *entry;
-	unsigned long index;
+	unsigned long index, nr_zombies = 0;
 
 	LIST_HEAD(secs_pages);
+	LIST_HEAD(retry_pages);
 
 	mmdrop(epc->mm);
 
+	/*
+	 * The file is no longer mapped, nothing looks up page_array anymore.
+	 * Park the pages that fail EREMOVE on a local list, which is free as
+	 * vEPC pages are never on the reclaimer's list, and free the whole
+	 * tree at once instead of erasing the entries one at a time.
+	 */
 	xa_for_each(&epc->page_array, index, entry) {
-		if (sgx_virt_epc_free_page(entry))
-			continue;
-
-		xa_erase(&epc->page_array, index);
+		epc_page = entry;
+		if (sgx_virt_epc_free_page(epc_page))
+			list_add_tail(&epc_page->list, &retry_pages);
 	}
+	xa_destroy(&epc->page_array);
 
 	/*
 	 * Because we don't track which pages are SECS pages, it's possible
@@ -211,12 +511,13 @@ static int sgx_virt_epc_release(struct inode *inode, struct file *file)
 	 * removed and the SECS pages can be nuked as well...unless userspace
 	 * has exposed multiple instance of virtual EPC to a single VM.
 	 */
-	xa_for_each(&epc->page_array, index, entry) {
-		epc_page = entry;
-		if (sgx_virt_epc_free_page(epc_page))
-			list_add_tail(&epc_page->list, &secs_pages);
+	list_for_each_entry_safe(epc_page, tmp, &retry_pages, list) {
+		list_del(&epc_page->list);
 
-		xa_erase(&epc->page_array, index);
+		if (sgx_virt_epc_free_page(epc_page)) {
+			list_add_tail(&epc_page->list, &secs_pages);
+			nr_zombies++;
+		}
 	}
 
 	/*
@@ -234,14 +535,21 @@ static int sgx_virt_epc_release(struct inode *inode, struct file *file)
 		 */
 		list_del(&epc_page->list);
 
-		if (sgx_virt_epc_free_page(epc_page))
+		if (sgx_virt_epc_free_page(epc_page)) {
 			list_add_tail(&epc_page->list, &secs_pages);
+			nr_zombies++;
+		}
 	}
 
-	if (!list_empty(&secs_pages))
+	WRITE_ONCE(virt_epc_nr_zombies, nr_zombies);
+	if (!list_empty(&secs_pages)) {
 		list_splice_tail(&secs_pages, &virt_epc_zombie_pages);
+		mod_delayed_work(system_unbound_wq, &virt_epc_zombie_work,
+				 SGX_ZOMBIE_RETRY_DELAY);
+	}
 	mutex_unlock(&virt_epc_lock);
 
+	atomic_long_sub(epc->nr_pages, &virt_epc_nr_pages);
 	kfree(epc);
 
 	return 0;
@@ -265,11 +573,29 @@ static int sgx_virt_epc_open(struct inode *inode, struct file *file)
 	return 0;
 }
 
+#ifdef CONFIG_PROC_FS
+/*
+ * Report the EPC pages the guest has actually touched or userspace has
+ * populated, as opposed to the size of its mappings.
+ */
+static void sgx_virt_epc_show_fdinfo(struct seq_file *m, struct file *file)
+{
+	struct sgx_virt_epc *epc = file->private_data;
+
+	seq_printf(m, "sgx_epc_pages:\t%lu\n", READ_ONCE(epc->nr_pages));
+}
+#endif
+
 static const struct file_operations sgx_virt_epc_fops = {
 	.owner			= THIS_MODULE,
 	.open			= sgx_virt_epc_open,
 	.release		= sgx_virt_epc_release,
 	.mmap			= sgx_virt_epc_mmap,
+	.unlocked_ioctl		= sgx_virt_epc_ioctl,
+	.compat_ioctl		= compat_ptr_ioctl,
+#ifdef CONFIG_PROC_FS
+	.show_fdinfo		= sgx_virt_epc_show_fdinfo,
+#endif
 };
 
 static struct miscdevice sgx_virt_epc_dev = {
@@ -321,17 +647,24 @@ static int __sgx_virt_einit(void __user *sigstruct, void __user *token,
 int sgx_virt_einit(void __user *sigstruct, void __user *token,
 		   void __user *secs, u64 *lepubkeyhash, int *trapnr)
 {
-	int ret, i;
+	bool written;
+	int ret;
 
 	if (!boot_cpu_has(X86_FEATURE_SGX_LC)) {
 		ret = __sgx_virt_einit(sigstruct, token, secs);
 	} else {
 		preempt_disable();
 
-		for (i = 0; i < 4; i++)
-			wrmsrl(MSR_IA32_SGXLEPUBKEYHASH0 + i, lepubkeyhash[i]);
-
+		written = sgx_update_lepubkeyhash(lepubkeyhash, false);
 		ret = __sgx_virt_einit(sigstruct, token, secs);
+
+		/* Retry with the MSRs rewritten in case the cache was stale. */
+		if (ret && !encls_faulted(ret) && ret != SGX_UNMASKED_EVENT &&
+		    !written) {
+			sgx_update_lepubkeyhash(lepubkeyhash, true);
+			ret = __sgx_virt_einit(sigstruct, token, secs);
+		}
+
 		preempt_enable();
 	}
 
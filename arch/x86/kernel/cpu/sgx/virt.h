@@ -4,11 +4,23 @@
 
 #ifdef CONFIG_X86_SGX_VIRTUALIZATION
 int __init sgx_virt_epc_init(void);
+unsigned long sgx_virt_epc_nr_zombies(void);
+unsigned long sgx_virt_epc_nr_pages(void);
 #else
 static inline int __init sgx_virt_epc_init(void)
 {
 	return -ENODEV;
 }
+
+static inline unsigned long sgx_virt_epc_nr_zombies(void)
+{
+	return 0;
+}
+
+static inline unsigned long sgx_virt_epc_nr_pages(void)
+{
+	return 0;
+}
 #endif
 
 #endif /* _ASM_X86_SGX_VIRT_H */
@@ -42,6 +42,7 @@
 DEFINE_STATIC_KEY_FALSE(kvm_async_pf_enabled);
 
 static int kvmapf = 1;
+static bool kvm_apf_ring __ro_after_init;
 
 static int __init parse_no_kvmapf(char *arg)
 {
@@ -268,6 +269,22 @@ noinstr bool __kvm_handle_async_pf(struct pt_regs *regs, u32 token)
 	return true;
 }
 
+/* Wake up all the tasks whose 'page ready' token was queued by the host. */
+static void kvm_async_pf_ring_wake(void)
+{
+	struct kvm_vcpu_pv_apf_data *apf = this_cpu_ptr(&apf_reason);
+	u32 head = READ_ONCE(apf->ring_head);
+	u32 tail = apf->ring_tail;
+
+	/* Read the head before the tokens it covers. */
+	virt_rmb();
+
+	for ( ; tail != head; tail++)
+		kvm_async_pf_task_wake(apf->ring[tail % KVM_ASYNC_PF_RING_SIZE]);
+
+	WRITE_ONCE(apf->ring_tail, tail);
+}
+
 DEFINE_IDTENTRY_SYSVEC(sysvec_kvm_asyncpf_interrupt)
 {
 	struct pt_regs *old_regs = set_irq_regs(regs);
@@ -278,9 +295,13 @@ DEFINE_IDTENTRY_SYSVEC(sysvec_kvm_asyncpf_interrupt)
 	inc_irq_stat(irq_hv_callback_count);
 
 	if (__this_cpu_read(apf_reason.enabled)) {
-		token = __this_cpu_read(apf_reason.token);
-		kvm_async_pf_task_wake(token);
-		__this_cpu_write(apf_reason.token, 0);
+		if (kvm_apf_ring) {
+			kvm_async_pf_ring_wake();
+		} else {
+			token = __this_cpu_read(apf_reason.token);
+			kvm_async_pf_task_wake(token);
+			__this_cpu_write(apf_reason.token, 0);
+		}
 		wrmsrl(MSR_KVM_ASYNC_PF_ACK, 1);
 	}
 
@@ -341,6 +362,9 @@ static void kvm_guest_cpu_init(void)
 		if (kvm_para_has_feature(KVM_FEATURE_ASYNC_PF_VMEXIT))
 			pa |= KVM_ASYNC_PF_DELIVERY_AS_PF_VMEXIT;
 
+		if (kvm_apf_ring)
+			pa |= KVM_ASYNC_PF_DELIVERY_RING;
+
 		wrmsrl(MSR_KVM_ASYNC_PF_INT, HYPERVISOR_CALLBACK_VECTOR);
 
 		wrmsrl(MSR_KVM_ASYNC_PF_EN, pa);
@@ -664,6 +688,7 @@ static void __init kvm_guest_init(void)
 
 	if (kvm_para_has_feature(KVM_FEATURE_ASYNC_PF_INT) && kvmapf) {
 		static_branch_enable(&kvm_async_pf_enabled);
+		kvm_apf_ring = kvm_para_has_feature(KVM_FEATURE_ASYNC_PF_RING);
 		alloc_intr_gate(HYPERVISOR_CALLBACK_VECTOR, asm_sysvec_kvm_asyncpf_interrupt);
 	}
 
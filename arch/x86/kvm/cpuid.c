@@ -72,6 +72,30 @@ static inline struct kvm_cpuid_entry2 *cpuid_entry2_find(
 	return NULL;
 }
 
+/*
+ * Install the new CPUID table and precompute the lookups of the leaves that
+ * fit in the per-vCPU cache.  The cache holds the result of the linear search,
+ * NULL included, so kvm_find_cpuid_entry() doesn't need to fall back to it.
+ */
+static void kvm_vcpu_set_cpuid_entries(struct kvm_vcpu *vcpu,
+				       struct kvm_cpuid_entry2 *e2, int nent)
+{
+	u32 i, j;
+
+	kvfree(vcpu->arch.cpuid_entries);
+	vcpu->arch.cpuid_entries = e2;
+	vcpu->arch.cpuid_nent = nent;
+
+	for (i = 0; i < KVM_CPUID_CACHED_LEAVES; i++) {
+		for (j = 0; j < KVM_CPUID_CACHED_INDICES; j++)
+			vcpu->arch.cpuid_basic[i][j] =
+				cpuid_entry2_find(e2, nent, i, j);
+
+		vcpu->arch.cpuid_extended[i] =
+			cpuid_entry2_find(e2, nent, 0x80000000 + i, 0);
+	}
+}
+
 static int kvm_check_cpuid(struct kvm_cpuid_entry2 *entries, int nent)
 {
 	struct kvm_cpuid_entry2 *best;
@@ -278,9 +302,7 @@ int kvm_vcpu_ioctl_set_cpuid(struct kvm_vcpu *vcpu,
 		goto out_free_cpuid;
 	}
 
-	kvfree(vcpu->arch.cpuid_entries);
-	vcpu->arch.cpuid_entries = e2;
-	vcpu->arch.cpuid_nent = cpuid->nent;
+	kvm_vcpu_set_cpuid_entries(vcpu, e2, cpuid->nent);
 
 	cpuid_fix_nx_cap(vcpu);
 	kvm_update_cpuid_runtime(vcpu);
@@ -314,9 +336,7 @@ int kvm_vcpu_ioctl_set_cpuid2(struct kvm_vcpu *vcpu,
 		return r;
 	}
 
-	kvfree(vcpu->arch.cpuid_entries);
-	vcpu->arch.cpuid_entries = e2;
-	vcpu->arch.cpuid_nent = cpuid->nent;
+	kvm_vcpu_set_cpuid_entries(vcpu, e2, cpuid->nent);
 
 	kvm_update_cpuid_runtime(vcpu);
 	kvm_vcpu_after_set_cpuid(vcpu);
@@ -847,10 +867,13 @@ static inline int __do_cpuid_func(struct kvm_cpuid_array *array, u32 function)
 			     (1 << KVM_FEATURE_PV_SEND_IPI) |
 			     (1 << KVM_FEATURE_POLL_CONTROL) |
 			     (1 << KVM_FEATURE_PV_SCHED_YIELD) |
-			     (1 << KVM_FEATURE_ASYNC_PF_INT);
+			     (1 << KVM_FEATURE_ASYNC_PF_INT) |
+			     (1 << KVM_FEATURE_PV_LOCK_HOLDER) |
+			     (1 << KVM_FEATURE_ASYNC_PF_RING);
 
 		if (sched_info_on())
-			entry->eax |= (1 << KVM_FEATURE_STEAL_TIME);
+			entry->eax |= (1 << KVM_FEATURE_STEAL_TIME) |
+				      (1 << KVM_FEATURE_PV_SCHED_HINTS);
 
 		entry->ebx = 0;
 		entry->ecx = 0;
@@ -1042,6 +1065,12 @@ int kvm_dev_ioctl_get_cpuid(struct kvm_cpuid2 *cpuid,
 struct kvm_cpuid_entry2 *kvm_find_cpuid_entry(struct kvm_vcpu *vcpu,
 					      u32 function, u32 index)
 {
+	struct kvm_cpuid_entry2 **cached;
+
+	cached = kvm_cpuid_cache_slot(vcpu, function, index);
+	if (cached)
+		return *cached;
+
 	return cpuid_entry2_find(vcpu->arch.cpuid_entries, vcpu->arch.cpuid_nent,
 				 function, index);
 }
@@ -187,13 +187,31 @@ static __always_inline void cpuid_entry_override(struct kvm_cpuid_entry2 *entry,
 	*reg = kvm_cpu_caps[leaf];
 }
 
+static __always_inline struct kvm_cpuid_entry2 **
+kvm_cpuid_cache_slot(struct kvm_vcpu *vcpu, u32 function, u32 index)
+{
+	if (function < KVM_CPUID_CACHED_LEAVES &&
+	    index < KVM_CPUID_CACHED_INDICES)
+		return &vcpu->arch.cpuid_basic[function][index];
+
+	if (function - 0x80000000 < KVM_CPUID_CACHED_LEAVES && !index)
+		return &vcpu->arch.cpuid_extended[function - 0x80000000];
+
+	return NULL;
+}
+
 static __always_inline u32 *guest_cpuid_get_register(struct kvm_vcpu *vcpu,
 						     unsigned int x86_feature)
 {
 	const struct cpuid_reg cpuid = x86_feature_cpuid(x86_feature);
-	struct kvm_cpuid_entry2 *entry;
+	struct kvm_cpuid_entry2 **cached, *entry;
 
-	entry = kvm_find_cpuid_entry(vcpu, cpuid.function, cpuid.index);
+	/* The leaf is a constant, the lookup folds into a load most times. */
+	cached = kvm_cpuid_cache_slot(vcpu, cpuid.function, cpuid.index);
+	if (cached)
+		entry = *cached;
+	else
+		entry = kvm_find_cpuid_entry(vcpu, cpuid.function, cpuid.index);
 	if (!entry)
 		return NULL;
 
@@ -6,6 +6,8 @@
  */
 #include <linux/kvm_host.h>
 #include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <asm/tsc.h>
 #include "lapic.h"
 
 static int vcpu_get_timer_advance_ns(void *data, u64 *val)
@@ -17,6 +19,88 @@ static int vcpu_get_timer_advance_ns(void *data, u64 *val)
 
 DEFINE_SIMPLE_ATTRIBUTE(vcpu_timer_advance_ns_fops, vcpu_get_timer_advance_ns, NULL, "%llu\n");
 
+static int vcpu_timer_advance_error_show(struct seq_file *m, void *v)
+{
+	struct kvm_vcpu *vcpu = m->private;
+	struct kvm_timer *ktimer = &vcpu->arch.apic->lapic_timer;
+	int i;
+
+	seq_puts(m, "error_ns early late\n");
+	for (i = 0; i < LAPIC_TIMER_ERR_HIST_BUCKETS; i++) {
+		if (i < LAPIC_TIMER_ERR_HIST_BUCKETS - 1)
+			seq_printf(m, "<%u", 1u << (LAPIC_TIMER_ERR_HIST_MIN_SHIFT + i));
+		else
+			seq_puts(m, "more");
+		seq_printf(m, " %u %u\n", READ_ONCE(ktimer->advance_err_hist[0][i]),
+			   READ_ONCE(ktimer->advance_err_hist[1][i]));
+	}
+	seq_printf(m, "mean_ns %lld\n", READ_ONCE(ktimer->advance_err_mean) >> 4);
+	seq_printf(m, "dev_ns %llu\n", READ_ONCE(ktimer->advance_err_dev) >> 4);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(vcpu_timer_advance_error);
+
+static int vcpu_user_return_msrs_show(struct seq_file *m, void *v)
+{
+	struct kvm_vcpu *vcpu = m->private;
+	unsigned int i;
+
+	seq_puts(m, "msr loads\n");
+	for (i = 0; i < kvm_nr_user_return_msrs(); i++)
+		seq_printf(m, "%#x %llu\n", kvm_user_return_msr_index(i),
+			   READ_ONCE(vcpu->arch.uret_msr_loads[i]));
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(vcpu_user_return_msrs);
+
+static u64 exit_latency_bucket_ns(unsigned int bucket)
+{
+	if (!bucket || !tsc_khz)
+		return 0;
+
+	return div_u64(1000000ULL << (KVM_EXIT_LATENCY_MIN_SHIFT + bucket - 1),
+		       tsc_khz);
+}
+
+/*
+ * One line per exit latency index that saw any exits, after a header with the
+ * lower edge of each bucket in nanoseconds.
+ */
+static int vcpu_exit_latency_show(struct seq_file *m, void *v)
+{
+	struct kvm_vcpu *vcpu = m->private;
+	struct kvm_exit_latency_hist *hist;
+	unsigned int i, j;
+	u64 count;
+
+	seq_puts(m, "index");
+	for (j = 0; j < KVM_EXIT_LATENCY_BUCKETS; j++)
+		seq_printf(m, " %llu", exit_latency_bucket_ns(j));
+	seq_putc(m, '\n');
+
+	for (i = 0; i < kvm_x86_ops.nr_exit_latency_reasons; i++) {
+		hist = &vcpu->arch.exit_latency[i];
+
+		for (j = 0, count = 0; j < KVM_EXIT_LATENCY_BUCKETS; j++)
+			count |= READ_ONCE(hist->count[j]);
+		if (!count)
+			continue;
+
+		seq_printf(m, "%u", i);
+		for (j = 0; j < KVM_EXIT_LATENCY_BUCKETS; j++)
+			seq_printf(m, " %llu", READ_ONCE(hist->count[j]));
+		seq_putc(m, '\n');
+	}
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(vcpu_exit_latency);
+
 static int vcpu_get_tsc_offset(void *data, u64 *val)
 {
 	struct kvm_vcpu *vcpu = (struct kvm_vcpu *) data;
@@ -47,11 +131,19 @@ void kvm_arch_create_vcpu_debugfs(struct kvm_vcpu *vcpu, struct dentry *debugfs_
 {
 	debugfs_create_file("tsc-offset", 0444, debugfs_dentry, vcpu,
 			    &vcpu_tsc_offset_fops);
+	debugfs_create_file("user_return_msrs", 0444, debugfs_dentry, vcpu,
+			    &vcpu_user_return_msrs_fops);
+	debugfs_create_file("exit_latency", 0444, debugfs_dentry, vcpu,
+			    &vcpu_exit_latency_fops);
 
-	if (lapic_in_kernel(vcpu))
+	if (lapic_in_kernel(vcpu)) {
 		debugfs_create_file("lapic_timer_advance_ns", 0444,
 				    debugfs_dentry, vcpu,
 				    &vcpu_timer_advance_ns_fops);
+		debugfs_create_file("lapic_timer_advance_error", 0444,
+				    debugfs_dentry, vcpu,
+				    &vcpu_timer_advance_error_fops);
+	}
 
 	if (kvm_has_tsc_control) {
 		debugfs_create_file("tsc-scaling-ratio", 0444,
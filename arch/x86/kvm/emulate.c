@@ -1517,7 +1517,7 @@ static int pio_in_emulated(struct x86_emulate_ctxt *ctxt,
 {
 	struct read_cache *rc = &ctxt->io_read;
 
-	if (rc->pos == rc->end) { /* refill pio read ahead */
+	if (!ctxt->io_read_valid || rc->pos == rc->end) { /* refill pio read ahead */
 		unsigned int in_page, n;
 		unsigned int count = ctxt->rep_prefix ?
 			address_mask(ctxt, reg_read(ctxt, VCPU_REGS_RCX)) : 1;
@@ -1528,6 +1528,7 @@ static int pio_in_emulated(struct x86_emulate_ctxt *ctxt,
 		if (n == 0)
 			n = 1;
 		rc->pos = rc->end = 0;
+		ctxt->io_read_valid = true;
 		if (!ctxt->ops->pio_in_emulated(ctxt, size, port, rc->data, n))
 			return 0;
 		rc->end = n * size;
@@ -5541,8 +5542,6 @@ void init_decode_cache(struct x86_emulate_ctxt *ctxt)
 	memset(&ctxt->rip_relative, 0,
 	       (void *)&ctxt->modrm - (void *)&ctxt->rip_relative);
 
-	ctxt->io_read.pos = 0;
-	ctxt->io_read.end = 0;
 	ctxt->mem_read.end = 0;
 }
 
@@ -5800,6 +5799,8 @@ int x86_emulate_insn(struct x86_emulate_ctxt *ctxt)
 	if (ctxt->rep_prefix && (ctxt->d & String)) {
 		unsigned int count;
 		struct read_cache *r = &ctxt->io_read;
+		unsigned long io_end = ctxt->io_read_valid ? r->end : 0;
+
 		if ((ctxt->d & SrcMask) == SrcSI)
 			count = ctxt->src.count;
 		else
@@ -5811,8 +5812,8 @@ int x86_emulate_insn(struct x86_emulate_ctxt *ctxt)
 			 * Re-enter guest when pio read ahead buffer is empty
 			 * or, if it is not used, after each 1024 iteration.
 			 */
-			if ((r->end != 0 || reg_read(ctxt, VCPU_REGS_RCX) & 0x3ff) &&
-			    (r->end == 0 || r->end != r->pos)) {
+			if ((io_end != 0 || reg_read(ctxt, VCPU_REGS_RCX) & 0x3ff) &&
+			    (io_end == 0 || io_end != r->pos)) {
 				/*
 				 * Reset read cache. Usually happens before
 				 * decode, but since instruction is restarted
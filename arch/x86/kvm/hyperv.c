@@ -543,6 +543,34 @@ static void stimer_mark_pending(struct kvm_vcpu_hv_stimer *stimer,
 		kvm_vcpu_kick(vcpu);
 }
 
+static int stimer_notify_direct(struct kvm_vcpu_hv_stimer *stimer);
+
+/*
+ * Direct-mode expirations are plain fixed interrupts, which can be posted to
+ * the vCPU from any CPU.  This lets the hrtimer run on a housekeeping CPU and
+ * complete the expiration without a kick, like the LAPIC timer does with
+ * lapic_timer_offload.  SynIC messages need the vCPU to write guest memory.
+ */
+static bool stimer_can_post_direct(struct kvm_vcpu_hv_stimer *stimer)
+{
+	struct kvm_vcpu *vcpu = stimer_to_vcpu(stimer);
+
+	return stimer->config.direct_mode && lapic_in_kernel(vcpu) &&
+	       kvm_can_post_timer_interrupt(vcpu);
+}
+
+static void stimer_arm(struct kvm_vcpu_hv_stimer *stimer, ktime_t expire)
+{
+	if (stimer_can_post_direct(stimer) &&
+	    kvm_lapic_timer_offloaded(stimer_to_vcpu(stimer))) {
+		kvm_timer_offload_start(&stimer->offload, expire);
+		return;
+	}
+
+	kvm_timer_offload_cancel(&stimer->offload);
+	hrtimer_start(&stimer->timer, expire, HRTIMER_MODE_ABS);
+}
+
 static void stimer_cleanup(struct kvm_vcpu_hv_stimer *stimer)
 {
 	struct kvm_vcpu *vcpu = stimer_to_vcpu(stimer);
@@ -550,6 +578,7 @@ static void stimer_cleanup(struct kvm_vcpu_hv_stimer *stimer)
 	trace_kvm_hv_stimer_cleanup(stimer_to_vcpu(stimer)->vcpu_id,
 				    stimer->index);
 
+	kvm_timer_offload_cancel(&stimer->offload);
 	hrtimer_cancel(&stimer->timer);
 	clear_bit(stimer->index,
 		  vcpu_to_hv_vcpu(vcpu)->stimer_pending_bitmap);
@@ -557,6 +586,31 @@ static void stimer_cleanup(struct kvm_vcpu_hv_stimer *stimer)
 	stimer->exp_time = 0;
 }
 
+/*
+ * The expiration was posted from the hrtimer, do what stimer_expiration() and
+ * kvm_hv_process_stimers() would do on the vCPU.  The vCPU only changes the
+ * stimer after canceling the hrtimer, so this can't race with it.
+ */
+static enum hrtimer_restart
+stimer_posted_expiration(struct kvm_vcpu_hv_stimer *stimer)
+{
+	u64 overruns;
+
+	trace_kvm_hv_stimer_expiration(stimer_to_vcpu(stimer)->vcpu_id,
+				       stimer->index, 1, 0);
+
+	if (stimer->config.periodic) {
+		overruns = hrtimer_forward_now(&stimer->timer,
+					       ns_to_ktime(100 * stimer->count));
+		stimer->exp_time += overruns * stimer->count;
+		return HRTIMER_RESTART;
+	}
+
+	stimer->config.enable = 0;
+	stimer->exp_time = 0;
+	return HRTIMER_NORESTART;
+}
+
 static enum hrtimer_restart stimer_timer_callback(struct hrtimer *timer)
 {
 	struct kvm_vcpu_hv_stimer *stimer;
@@ -564,6 +618,10 @@ static enum hrtimer_restart stimer_timer_callback(struct hrtimer *timer)
 	stimer = container_of(timer, struct kvm_vcpu_hv_stimer, timer);
 	trace_kvm_hv_stimer_callback(stimer_to_vcpu(stimer)->vcpu_id,
 				     stimer->index);
+
+	if (stimer_can_post_direct(stimer) && !stimer_notify_direct(stimer))
+		return stimer_posted_expiration(stimer);
+
 	stimer_mark_pending(stimer, true);
 
 	return HRTIMER_NORESTART;
@@ -600,10 +658,8 @@ static int stimer_start(struct kvm_vcpu_hv_stimer *stimer)
 					stimer->index,
 					time_now, stimer->exp_time);
 
-		hrtimer_start(&stimer->timer,
-			      ktime_add_ns(ktime_now,
-					   100 * (stimer->exp_time - time_now)),
-			      HRTIMER_MODE_ABS);
+		stimer_arm(stimer, ktime_add_ns(ktime_now,
+				100 * (stimer->exp_time - time_now)));
 		return 0;
 	}
 	stimer->exp_time = stimer->count;
@@ -622,9 +678,8 @@ static int stimer_start(struct kvm_vcpu_hv_stimer *stimer)
 					   stimer->index,
 					   time_now, stimer->count);
 
-	hrtimer_start(&stimer->timer,
-		      ktime_add_ns(ktime_now, 100 * (stimer->count - time_now)),
-		      HRTIMER_MODE_ABS);
+	stimer_arm(stimer,
+		   ktime_add_ns(ktime_now, 100 * (stimer->count - time_now)));
 	return 0;
 }
 
@@ -834,8 +889,10 @@ void kvm_hv_vcpu_uninit(struct kvm_vcpu *vcpu)
 	struct kvm_vcpu_hv *hv_vcpu = vcpu_to_hv_vcpu(vcpu);
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(hv_vcpu->stimer); i++)
+	for (i = 0; i < ARRAY_SIZE(hv_vcpu->stimer); i++) {
 		stimer_cleanup(&hv_vcpu->stimer[i]);
+		irq_work_sync(&hv_vcpu->stimer[i].offload.work);
+	}
 }
 
 bool kvm_hv_assist_page_enabled(struct kvm_vcpu *vcpu)
@@ -877,6 +934,8 @@ static void stimer_init(struct kvm_vcpu_hv_stimer *stimer, int timer_index)
 	stimer->index = timer_index;
 	hrtimer_init(&stimer->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
 	stimer->timer.function = stimer_timer_callback;
+	kvm_timer_offload_init(&stimer->offload, &stimer->timer,
+			       HRTIMER_MODE_ABS_PINNED);
 	stimer_prepare_msg(stimer);
 }
 
@@ -890,6 +949,9 @@ void kvm_hv_vcpu_init(struct kvm_vcpu *vcpu)
 	bitmap_zero(hv_vcpu->stimer_pending_bitmap, HV_SYNIC_STIMER_COUNT);
 	for (i = 0; i < ARRAY_SIZE(hv_vcpu->stimer); i++)
 		stimer_init(&hv_vcpu->stimer[i], i);
+
+	spin_lock_init(&hv_vcpu->tlb_flush_fifo.write_lock);
+	INIT_KFIFO(hv_vcpu->tlb_flush_fifo.entries);
 }
 
 void kvm_hv_vcpu_postcreate(struct kvm_vcpu *vcpu)
@@ -1165,7 +1227,7 @@ static int kvm_hv_set_msr_pw(struct kvm_vcpu *vcpu, u32 msr, u64 data,
 	case HV_X64_MSR_REFERENCE_TSC:
 		hv->hv_tsc_page = data;
 		if (hv->hv_tsc_page & HV_X64_MSR_TSC_REFERENCE_ENABLE)
-			kvm_make_request(KVM_REQ_MASTERCLOCK_UPDATE, vcpu);
+			kvm_request_masterclock_update(vcpu);
 		break;
 	case HV_X64_MSR_CRASH_P0 ... HV_X64_MSR_CRASH_P4:
 		return kvm_hv_msr_set_crash_data(vcpu,
@@ -1490,20 +1552,89 @@ static __always_inline unsigned long *sparse_set_to_vcpu_mask(
 	return vcpu_bitmap;
 }
 
+/*
+ * Queue @count GVA ranges for @vcpu, or a full flush if @entries is NULL or
+ * the ranges don't fit.  A slot is always left for the full flush entry, so
+ * a full FIFO always ends with one.
+ */
+static void hv_tlb_flush_enqueue(struct kvm_vcpu *vcpu, u64 *entries,
+				 int count)
+{
+	struct kvm_vcpu_hv_tlb_flush_fifo *fifo =
+		&vcpu_to_hv_vcpu(vcpu)->tlb_flush_fifo;
+	u64 flush_all_entry = KVM_HV_TLB_FLUSHALL_ENTRY;
+
+	spin_lock(&fifo->write_lock);
+
+	if (entries && count < kfifo_avail(&fifo->entries))
+		kfifo_in(&fifo->entries, entries, count);
+	else
+		kfifo_in(&fifo->entries, &flush_all_entry, 1);
+
+	spin_unlock(&fifo->write_lock);
+}
+
+/*
+ * Process the ranges queued for the running vCPU.  Returns -ENOSPC if the
+ * caller has to flush the whole guest TLB instead.  Only the vCPU itself
+ * consumes its FIFO, hence no lock on the read side.
+ */
+int kvm_hv_vcpu_flush_tlb(struct kvm_vcpu *vcpu)
+{
+	struct kvm_vcpu_hv_tlb_flush_fifo *fifo =
+		&vcpu_to_hv_vcpu(vcpu)->tlb_flush_fifo;
+	u64 entries[KVM_HV_TLB_FLUSH_FIFO_SIZE];
+	int i, j, count;
+	gva_t gva;
+
+	/*
+	 * The GVAs are L1's, but flushing a GVA acts on the current context,
+	 * which is L2's while in guest mode.
+	 */
+	if (is_guest_mode(vcpu)) {
+		kfifo_reset_out(&fifo->entries);
+		return -ENOSPC;
+	}
+
+	count = kfifo_out(&fifo->entries, entries, KVM_HV_TLB_FLUSH_FIFO_SIZE);
+	if (!count)
+		return -ENOSPC;
+
+	for (i = 0; i < count; i++) {
+		if (entries[i] == KVM_HV_TLB_FLUSHALL_ENTRY) {
+			kfifo_reset_out(&fifo->entries);
+			return -ENOSPC;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		gva = entries[i] & PAGE_MASK;
+		for (j = 0; j < (entries[i] & ~PAGE_MASK) + 1; j++)
+			kvm_x86_ops.tlb_flush_gva(vcpu, gva + j * PAGE_SIZE);
+	}
+
+	++vcpu->stat.tlb_flush;
+	return 0;
+}
+
 static u64 kvm_hv_flush_tlb(struct kvm_vcpu *current_vcpu, u64 ingpa,
 			    u16 rep_cnt, bool ex)
 {
 	struct kvm *kvm = current_vcpu->kvm;
-	struct kvm_vcpu_hv *hv_vcpu = &current_vcpu->arch.hyperv;
 	struct hv_tlb_flush_ex flush_ex;
 	struct hv_tlb_flush flush;
 	u64 vp_bitmap[KVM_HV_MAX_SPARSE_VCPU_SET_BITS];
 	DECLARE_BITMAP(vcpu_bitmap, KVM_MAX_VCPUS);
+	u64 entries[KVM_HV_TLB_FLUSH_FIFO_SIZE - 1];
 	unsigned long *vcpu_mask;
+	struct kvm_vcpu *vcpu;
 	u64 valid_bank_mask;
 	u64 sparse_banks[64];
-	int sparse_banks_len;
+	int sparse_banks_len = 0;
+	u64 gva_list_offset;
+	bool flush_gvas = true;
 	bool all_cpus;
+	int i;
 
 	if (!ex) {
 		if (unlikely(kvm_read_guest(kvm, ingpa, &flush, sizeof(flush))))
@@ -1524,6 +1655,8 @@ static u64 kvm_hv_flush_tlb(struct kvm_vcpu *current_vcpu, u64 ingpa,
 		 */
 		all_cpus = (flush.flags & HV_FLUSH_ALL_PROCESSORS) ||
 			flush.processor_mask == 0;
+
+		gva_list_offset = offsetof(struct hv_tlb_flush, gva_list);
 	} else {
 		if (unlikely(kvm_read_guest(kvm, ingpa, &flush_ex,
 					    sizeof(flush_ex))))
@@ -1538,9 +1671,10 @@ static u64 kvm_hv_flush_tlb(struct kvm_vcpu *current_vcpu, u64 ingpa,
 		all_cpus = flush_ex.hv_vp_set.format !=
 			HV_GENERIC_SET_SPARSE_4K;
 
-		sparse_banks_len =
-			bitmap_weight((unsigned long *)&valid_bank_mask, 64) *
-			sizeof(sparse_banks[0]);
+		if (!all_cpus)
+			sparse_banks_len =
+				bitmap_weight((unsigned long *)&valid_bank_mask,
+					      64) * sizeof(sparse_banks[0]);
 
 		if (!sparse_banks_len && !all_cpus)
 			goto ret_success;
@@ -1552,30 +1686,54 @@ static u64 kvm_hv_flush_tlb(struct kvm_vcpu *current_vcpu, u64 ingpa,
 				   sparse_banks,
 				   sparse_banks_len))
 			return HV_STATUS_INVALID_HYPERCALL_INPUT;
+
+		gva_list_offset = offsetof(struct hv_tlb_flush_ex,
+					   hv_vp_set.bank_contents) +
+				  sparse_banks_len;
 	}
 
-	cpumask_clear(&hv_vcpu->tlb_flush);
+	/*
+	 * Flush the listed GVAs individually if they fit in the FIFOs.  The
+	 * shadow MMU needs a full flush to resync its page tables, and so do
+	 * the *_SPACE hypercalls, which come with rep_cnt == 0.
+	 */
+	if (!tdp_enabled || !rep_cnt || rep_cnt > ARRAY_SIZE(entries) ||
+	    kvm_read_guest(kvm, ingpa + gva_list_offset, entries,
+			   rep_cnt * sizeof(entries[0])))
+		flush_gvas = false;
 
 	vcpu_mask = all_cpus ? NULL :
 		sparse_set_to_vcpu_mask(kvm, sparse_banks, valid_bank_mask,
 					vp_bitmap, vcpu_bitmap);
 
+	kvm_for_each_vcpu(i, vcpu, kvm) {
+		if (vcpu_mask && !test_bit(i, vcpu_mask))
+			continue;
+
+		hv_tlb_flush_enqueue(vcpu, flush_gvas ? entries : NULL,
+				     rep_cnt);
+	}
+
 	/*
 	 * vcpu->arch.cr3 may not be up-to-date for running vCPUs so we can't
 	 * analyze it here, flush TLB regardless of the specified address space.
 	 */
-	kvm_make_vcpus_request_mask(kvm, KVM_REQ_HV_TLB_FLUSH,
-				    NULL, vcpu_mask, &hv_vcpu->tlb_flush);
+	if (all_cpus)
+		kvm_make_all_cpus_request(kvm, KVM_REQ_HV_TLB_FLUSH);
+	else
+		kvm_make_vcpus_request_mask(kvm, KVM_REQ_HV_TLB_FLUSH,
+					    vcpu_mask);
 
 ret_success:
-	/* We always do full TLB flush, set rep_done = rep_cnt. */
+	/* All GVAs are handled in one go, set rep_done = rep_cnt. */
 	return (u64)HV_STATUS_SUCCESS |
 		((u64)rep_cnt << HV_HYPERCALL_REP_COMP_OFFSET);
 }
 
-static void kvm_send_ipi_to_many(struct kvm *kvm, u32 vector,
+static void kvm_send_ipi_to_many(struct kvm_vcpu *src, u32 vector,
 				 unsigned long *vcpu_bitmap)
 {
+	struct kvm *kvm = src->kvm;
 	struct kvm_lapic_irq irq = {
 		.delivery_mode = APIC_DM_FIXED,
 		.vector = vector
@@ -1588,7 +1746,7 @@ static void kvm_send_ipi_to_many(struct kvm *kvm, u32 vector,
 			continue;
 
 		/* We fail only when APIC is disabled */
-		kvm_apic_set_irq(vcpu, &irq, NULL);
+		kvm_apic_send_pv_ipi(src, vcpu, &irq);
 	}
 }
 
@@ -1660,7 +1818,7 @@ static u64 kvm_hv_send_ipi(struct kvm_vcpu *current_vcpu, u64 ingpa, u64 outgpa,
 		sparse_set_to_vcpu_mask(kvm, sparse_banks, valid_bank_mask,
 					vp_bitmap, vcpu_bitmap);
 
-	kvm_send_ipi_to_many(kvm, vector, vcpu_mask);
+	kvm_send_ipi_to_many(current_vcpu, vector, vcpu_mask);
 
 ret_success:
 	return HV_STATUS_SUCCESS;
@@ -264,16 +264,39 @@ static void pit_do_work(struct kthread_work *work)
 			kvm_apic_nmi_wd_deliver(vcpu);
 }
 
+/*
+ * Guests that moved to the local APIC timer usually leave channel 0 running
+ * with its IOAPIC pin masked and LVT0 not accepting ExtINT. A tick can then
+ * only be observed through the NMI watchdog.
+ */
+static bool pit_irq_masked(struct kvm_pit *pit)
+{
+	struct kvm *kvm = pit->kvm;
+
+	return !atomic_read(&kvm->arch.vapics_in_nmi_mode) &&
+	       kvm_gsi_is_masked(kvm, 0);
+}
+
 static enum hrtimer_restart pit_timer_fn(struct hrtimer *data)
 {
 	struct kvm_kpit_state *ps = container_of(data, struct kvm_kpit_state, timer);
 	struct kvm_pit *pt = pit_state_to_pit(ps);
 
+	/*
+	 * Like on real hardware, ticks are lost while masked. This skips the
+	 * wakeup of the worker and the irqchip locks in kvm_set_irq(). The
+	 * timer keeps running, the current count is derived from it.
+	 */
+	if (pit_irq_masked(pt))
+		goto out;
+
 	if (atomic_read(&ps->reinject))
 		atomic_inc(&ps->pending);
 
 	kthread_queue_work(pt->worker, &pt->expired);
 
+out:
+
 	if (ps->is_periodic) {
 		hrtimer_add_expires_ns(&ps->timer, ps->period);
 		return HRTIMER_RESTART;
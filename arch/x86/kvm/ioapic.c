@@ -101,6 +101,32 @@ static void rtc_irq_eoi_tracking_reset(struct kvm_ioapic *ioapic)
 
 static void kvm_rtc_eoi_tracking_restore_all(struct kvm_ioapic *ioapic);
 
+static void ioapic_update_vector_pins(struct kvm_ioapic *ioapic)
+{
+	int i, vector;
+
+	memset(ioapic->vector_pins, 0, sizeof(ioapic->vector_pins));
+	for (i = 0; i < IOAPIC_NUM_PINS; i++) {
+		vector = ioapic->redirtbl[i].fields.vector;
+		WRITE_ONCE(ioapic->vector_pins[vector],
+			   ioapic->vector_pins[vector] | BIT(i));
+	}
+}
+
+static void ioapic_move_vector_pin(struct kvm_ioapic *ioapic, int pin,
+				   int old_vector)
+{
+	int vector = ioapic->redirtbl[pin].fields.vector;
+
+	if (vector == old_vector)
+		return;
+
+	WRITE_ONCE(ioapic->vector_pins[old_vector],
+		   ioapic->vector_pins[old_vector] & ~BIT(pin));
+	WRITE_ONCE(ioapic->vector_pins[vector],
+		   ioapic->vector_pins[vector] | BIT(pin));
+}
+
 static void rtc_status_pending_eoi_check_valid(struct kvm_ioapic *ioapic)
 {
 	if (WARN_ON(ioapic->rtc_status.pending_eoi < 0))
@@ -321,6 +347,7 @@ static void ioapic_write_indirect(struct kvm_ioapic *ioapic, u32 val)
 	union kvm_ioapic_redirect_entry *e;
 	unsigned long vcpu_bitmap;
 	int old_remote_irr, old_delivery_status, old_dest_id, old_dest_mode;
+	int old_vector;
 
 	switch (ioapic->ioregsel) {
 	case IOAPIC_REG_VERSION:
@@ -347,6 +374,7 @@ static void ioapic_write_indirect(struct kvm_ioapic *ioapic, u32 val)
 		old_delivery_status = e->fields.delivery_status;
 		old_dest_id = e->fields.dest_id;
 		old_dest_mode = e->fields.dest_mode;
+		old_vector = e->fields.vector;
 		if (ioapic->ioregsel & 1) {
 			e->bits &= 0xffffffff;
 			e->bits |= (u64) val << 32;
@@ -356,6 +384,7 @@ static void ioapic_write_indirect(struct kvm_ioapic *ioapic, u32 val)
 		}
 		e->fields.remote_irr = old_remote_irr;
 		e->fields.delivery_status = old_delivery_status;
+		ioapic_move_vector_pin(ioapic, index, old_vector);
 
 		/*
 		 * Some OSes (Linux, Xen) assume that Remote IRR bit will
@@ -551,12 +580,25 @@ void kvm_ioapic_update_eoi(struct kvm_vcpu *vcpu, int vector, int trigger_mode)
 {
 	int i;
 	struct kvm_ioapic *ioapic = vcpu->kvm->arch.vioapic;
+	unsigned long pins;
+
+	/*
+	 * The vector can be handled by the IOAPIC without any pin using it,
+	 * e.g. if the guest reprogrammed the pin since it was delivered. Only
+	 * the RTC EOI tracking then needs the lock, and only while it waits
+	 * for EOIs.
+	 */
+	if (!READ_ONCE(ioapic->vector_pins[vector]) &&
+	    !READ_ONCE(ioapic->rtc_status.pending_eoi))
+		return;
 
 	spin_lock(&ioapic->lock);
 	rtc_irq_eoi(ioapic, vcpu, vector);
-	for (i = 0; i < IOAPIC_NUM_PINS; i++) {
+	pins = ioapic->vector_pins[vector];
+	for_each_set_bit(i, &pins, IOAPIC_NUM_PINS) {
 		union kvm_ioapic_redirect_entry *ent = &ioapic->redirtbl[i];
 
+		/* The lock is dropped for each of the pins. */
 		if (ent->fields.vector != vector)
 			continue;
 		kvm_ioapic_update_eoi_one(vcpu, ioapic, trigger_mode, i);
@@ -694,6 +736,7 @@ int kvm_ioapic_init(struct kvm *kvm)
 	INIT_DELAYED_WORK(&ioapic->eoi_inject, kvm_ioapic_eoi_inject_work);
 	kvm->arch.vioapic = ioapic;
 	kvm_ioapic_reset(ioapic);
+	ioapic_update_vector_pins(ioapic);
 	kvm_iodevice_init(&ioapic->dev, &ioapic_mmio_ops);
 	ioapic->kvm = kvm;
 	mutex_lock(&kvm->slots_lock);
@@ -741,6 +784,7 @@ void kvm_set_ioapic(struct kvm *kvm, struct kvm_ioapic_state *state)
 	memcpy(ioapic, state, sizeof(struct kvm_ioapic_state));
 	ioapic->irr = 0;
 	ioapic->irr_delivered = 0;
+	ioapic_update_vector_pins(ioapic);
 	kvm_make_scan_ioapic_request(kvm);
 	kvm_ioapic_inject_all(ioapic, state->irr);
 	spin_unlock(&ioapic->lock);
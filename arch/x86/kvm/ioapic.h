@@ -91,6 +91,12 @@ struct kvm_ioapic {
 	struct delayed_work eoi_inject;
 	u32 irq_eoi[IOAPIC_NUM_PINS];
 	u32 irr_delivered;
+	/*
+	 * The pins whose redirection entry uses each vector, so that EOIs
+	 * don't have to scan the redirection table. Written under the lock,
+	 * EOIs check for a zero mask without it.
+	 */
+	u32 vector_pins[256];
 };
 
 #ifdef DEBUG
@@ -173,7 +173,14 @@ int kvm_arch_set_irq_inatomic(struct kvm_kernel_irq_routing_entry *e,
 
 		if (kvm_irq_delivery_to_apic_fast(kvm, NULL, &irq, &r, NULL))
 			return r;
-		break;
+
+		/*
+		 * The APIC map can't resolve the destination, e.g. because of
+		 * mixed APIC modes. Walking the vCPUs only touches their APIC
+		 * state and doesn't sleep, so do it here rather than bouncing
+		 * the MSI through a workqueue.
+		 */
+		return kvm_irq_delivery_to_apic(kvm, NULL, &irq, NULL);
 
 	default:
 		break;
@@ -259,6 +266,66 @@ void kvm_fire_mask_notifiers(struct kvm *kvm, unsigned irqchip, unsigned pin,
 	srcu_read_unlock(&kvm->irq_srcu, idx);
 }
 
+/*
+ * Whether any vCPU takes ExtINT interrupts from the PIC.  Masking an input in
+ * the IMR is not enough to ignore it, the PIC still latches it in the IRR and
+ * delivers it once the input is unmasked.
+ */
+static bool kvm_pic_is_routed(struct kvm *kvm)
+{
+	struct kvm_vcpu *vcpu;
+	int i;
+
+	kvm_for_each_vcpu(i, vcpu, kvm)
+		if (kvm_apic_accept_pic_intr(vcpu))
+			return true;
+
+	return false;
+}
+
+/*
+ * Whether raising @gsi has no effect: every IOAPIC pin it is routed to is
+ * masked, and the PIC, if it is routed there too, doesn't reach any vCPU. The
+ * irqchips are not locked, the result is only a hint that can be stale by the
+ * time it is used.
+ */
+bool kvm_gsi_is_masked(struct kvm *kvm, int gsi)
+{
+	struct kvm_kernel_irq_routing_entry entries[KVM_NR_IRQCHIPS];
+	struct kvm_kernel_irq_routing_entry *e;
+	struct kvm_ioapic *ioapic = kvm->arch.vioapic;
+	union kvm_ioapic_redirect_entry ent;
+	int idx, i, n, pin;
+
+	idx = srcu_read_lock(&kvm->irq_srcu);
+	n = kvm_irq_map_gsi(kvm, entries, gsi);
+	srcu_read_unlock(&kvm->irq_srcu, idx);
+
+	for (i = 0; i < n; i++) {
+		e = &entries[i];
+		if (e->type != KVM_IRQ_ROUTING_IRQCHIP)
+			return false;
+
+		pin = e->irqchip.pin;
+		switch (e->irqchip.irqchip) {
+		case KVM_IRQCHIP_PIC_MASTER:
+		case KVM_IRQCHIP_PIC_SLAVE:
+			if (kvm_pic_is_routed(kvm))
+				return false;
+			break;
+		case KVM_IRQCHIP_IOAPIC:
+			ent.bits = READ_ONCE(ioapic->redirtbl[pin].bits);
+			if (!ent.fields.mask)
+				return false;
+			break;
+		default:
+			return false;
+		}
+	}
+
+	return true;
+}
+
 bool kvm_arch_can_set_irq_routing(struct kvm *kvm)
 {
 	return irqchip_in_kernel(kvm);
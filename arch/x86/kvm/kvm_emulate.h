@@ -272,10 +272,11 @@ struct fetch_cache {
 	u8 *end;
 };
 
+/* The indices come first, to keep them away from the cold data. */
 struct read_cache {
-	u8 data[1024];
 	unsigned long pos;
 	unsigned long end;
+	u8 data[1024];
 };
 
 /* Execution mode, passed to the emulator. */
@@ -340,7 +341,7 @@ struct x86_emulate_ctxt {
 	};
 	int (*check_perm)(struct x86_emulate_ctxt *ctxt);
 	/*
-	 * The following six fields are cleared together,
+	 * The following seven fields are cleared together,
 	 * the rest are initialized unconditionally in x86_decode_insn
 	 * or elsewhere
 	 */
@@ -348,6 +349,8 @@ struct x86_emulate_ctxt {
 	u8 rex_prefix;
 	u8 lock_prefix;
 	u8 rep_prefix;
+	/* io_read holds read-ahead data of the current instruction */
+	bool io_read_valid;
 	/* bitmaps of registers in _regs[] that can be read */
 	u32 regs_valid;
 	/* bitmaps of registers in _regs[] that have been written */
@@ -370,8 +373,14 @@ struct x86_emulate_ctxt {
 	unsigned long _regs[NR_VCPU_REGS];
 	struct operand *memopp;
 	struct fetch_cache fetch;
-	struct read_cache io_read;
+	/*
+	 * mem_read is used by most emulated instructions, its indices share
+	 * a cacheline with the fetch cache.  io_read is only used by IN and
+	 * INS, and is reset lazily based on io_read_valid so that emulating
+	 * other instructions doesn't touch it at all.
+	 */
 	struct read_cache mem_read;
+	struct read_cache io_read;
 };
 
 /* Repeat String Operation Prefix */
@@ -26,6 +26,8 @@
 #include <linux/export.h>
 #include <linux/math64.h>
 #include <linux/slab.h>
+#include <linux/irq_work.h>
+#include <linux/sched/isolation.h>
 #include <asm/processor.h>
 #include <asm/msr.h>
 #include <asm/page.h>
@@ -67,6 +69,13 @@ static bool lapic_timer_advance_dynamic __read_mostly;
 #define LAPIC_TIMER_ADVANCE_NS_MAX     5000
 /* step-by-step approximation to mitigate fluctuation */
 #define LAPIC_TIMER_ADVANCE_ADJUST_STEP 8
+/* the error statistics average over about 1 << SHIFT samples */
+#define LAPIC_TIMER_ADVANCE_EWMA_SHIFT	4
+/* errors this many mean deviations away from the mean are spikes */
+#define LAPIC_TIMER_ADVANCE_SPIKE_DEVS	4
+#define LAPIC_TIMER_ADVANCE_SPIKE_MIN_NS	200
+/* this many spikes in a row are the new normal, restart the statistics */
+#define LAPIC_TIMER_ADVANCE_REBASE_SPIKES	8
 
 static inline int apic_test_vector(int vec, void *bitmap)
 {
@@ -111,7 +120,7 @@ static inline u32 kvm_x2apic_id(struct kvm_lapic *apic)
 	return apic->vcpu->vcpu_id;
 }
 
-static bool kvm_can_post_timer_interrupt(struct kvm_vcpu *vcpu)
+bool kvm_can_post_timer_interrupt(struct kvm_vcpu *vcpu)
 {
 	return pi_inject_timer && kvm_vcpu_apicv_active(vcpu);
 }
@@ -129,6 +138,89 @@ static bool kvm_use_posted_timer_interrupt(struct kvm_vcpu *vcpu)
 	return kvm_can_post_timer_interrupt(vcpu) && vcpu->mode == IN_GUEST_MODE;
 }
 
+/*
+ * With lapic_timer_offload, the timer of a vCPU running on an isolated CPU is
+ * armed on a housekeeping CPU from an irq_work, and its expiration is posted
+ * to the vCPU, so that the isolated CPU never takes a host timer interrupt.
+ * The expire field of struct kvm_timer_offload holds the expiration the
+ * irq_work should arm, or 0 if the timer was canceled, and its lock keeps a
+ * cancel or a restart on the vCPU's CPU from being overtaken by an irq_work
+ * that is still in flight.  The Hyper-V synthetic timers use the same scheme.
+ */
+bool kvm_lapic_timer_offloaded(struct kvm_vcpu *vcpu)
+{
+	return lapic_timer_offload && kvm_can_post_timer_interrupt(vcpu) &&
+	       !housekeeping_cpu(raw_smp_processor_id(), HK_FLAG_TIMER);
+}
+
+static void kvm_timer_offload_fn(struct irq_work *work)
+{
+	struct kvm_timer_offload *offload =
+		container_of(work, struct kvm_timer_offload, work);
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&offload->lock, flags);
+	if (offload->expire)
+		hrtimer_start(offload->timer, offload->expire, offload->mode);
+	raw_spin_unlock_irqrestore(&offload->lock, flags);
+}
+
+static void kvm_timer_offload_set_expire(struct kvm_timer_offload *offload,
+					 ktime_t expire)
+{
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&offload->lock, flags);
+	offload->expire = expire;
+	raw_spin_unlock_irqrestore(&offload->lock, flags);
+}
+
+/* @mode is the pinned variant of the mode @timer was initialized with. */
+void kvm_timer_offload_init(struct kvm_timer_offload *offload,
+			    struct hrtimer *timer, enum hrtimer_mode mode)
+{
+	init_irq_work(&offload->work, kvm_timer_offload_fn);
+	raw_spin_lock_init(&offload->lock);
+	offload->timer = timer;
+	offload->mode = mode;
+}
+
+/* Arm the timer at @expire from a housekeeping CPU. */
+void kvm_timer_offload_start(struct kvm_timer_offload *offload,
+			     ktime_t expire)
+{
+	kvm_timer_offload_set_expire(offload, expire);
+	irq_work_queue_on(&offload->work, housekeeping_any_cpu(HK_FLAG_TIMER));
+}
+
+/* Called before the timer is started or canceled from the vCPU's CPU. */
+void kvm_timer_offload_cancel(struct kvm_timer_offload *offload)
+{
+	if (unlikely(offload->expire))
+		kvm_timer_offload_set_expire(offload, 0);
+}
+
+static void apic_timer_start(struct kvm_lapic *apic, ktime_t expire)
+{
+	struct kvm_timer *ktimer = &apic->lapic_timer;
+
+	if (kvm_lapic_timer_offloaded(apic->vcpu)) {
+		kvm_timer_offload_start(&ktimer->offload, expire);
+		return;
+	}
+
+	kvm_timer_offload_cancel(&ktimer->offload);
+	hrtimer_start(&ktimer->timer, expire, HRTIMER_MODE_ABS_HARD);
+}
+
+static void apic_timer_cancel(struct kvm_lapic *apic)
+{
+	struct kvm_timer *ktimer = &apic->lapic_timer;
+
+	kvm_timer_offload_cancel(&ktimer->offload);
+	hrtimer_cancel(&ktimer->timer);
+}
+
 static inline bool kvm_apic_map_get_logical_dest(struct kvm_apic_map *map,
 		u32 dest_id, struct kvm_lapic ***cluster, u16 *mask) {
 	switch (map->mode) {
@@ -596,8 +688,34 @@ int kvm_apic_set_irq(struct kvm_vcpu *vcpu, struct kvm_lapic_irq *irq,
 			irq->level, irq->trig_mode, dest_map);
 }
 
-static int __pv_send_ipi(unsigned long *ipi_bitmap, struct kvm_apic_map *map,
-			 struct kvm_lapic_irq *irq, u32 min)
+/*
+ * Send an IPI on behalf of a PV hypercall of @src.  A fixed, edge-triggered
+ * IPI whose vector is already pending in IRR would merge with it, so count it
+ * as delivered without the kick, which for a running vCPU without APICv would
+ * be a needless IPI and VM-exit.
+ */
+int kvm_apic_send_pv_ipi(struct kvm_vcpu *src, struct kvm_vcpu *vcpu,
+			 struct kvm_lapic_irq *irq)
+{
+	struct kvm_lapic *apic = vcpu->arch.apic;
+
+	if (irq->delivery_mode == APIC_DM_FIXED && !irq->trig_mode &&
+	    apic_enabled(apic) &&
+	    apic_test_vector(irq->vector, apic->regs + APIC_IRR)) {
+		++src->stat.pv_ipis_coalesced;
+		return 1;
+	}
+
+	++src->stat.pv_ipis_sent;
+	if (rcuwait_active(&vcpu->wait))
+		++src->stat.pv_ipi_wakeups;
+
+	return kvm_apic_set_irq(vcpu, irq, NULL);
+}
+
+static int __pv_send_ipi(struct kvm_vcpu *src, unsigned long *ipi_bitmap,
+			 struct kvm_apic_map *map, struct kvm_lapic_irq *irq,
+			 u32 min)
 {
 	int i, count = 0;
 	struct kvm_vcpu *vcpu;
@@ -609,17 +727,18 @@ static int __pv_send_ipi(unsigned long *ipi_bitmap, struct kvm_apic_map *map,
 		min((u32)BITS_PER_LONG, (map->max_apic_id - min + 1))) {
 		if (map->phys_map[min + i]) {
 			vcpu = map->phys_map[min + i]->vcpu;
-			count += kvm_apic_set_irq(vcpu, irq, NULL);
+			count += kvm_apic_send_pv_ipi(src, vcpu, irq);
 		}
 	}
 
 	return count;
 }
 
-int kvm_pv_send_ipi(struct kvm *kvm, unsigned long ipi_bitmap_low,
+int kvm_pv_send_ipi(struct kvm_vcpu *vcpu, unsigned long ipi_bitmap_low,
 		    unsigned long ipi_bitmap_high, u32 min,
 		    unsigned long icr, int op_64_bit)
 {
+	struct kvm *kvm = vcpu->kvm;
 	struct kvm_apic_map *map;
 	struct kvm_lapic_irq irq = {0};
 	int cluster_size = op_64_bit ? 64 : 32;
@@ -638,9 +757,9 @@ int kvm_pv_send_ipi(struct kvm *kvm, unsigned long ipi_bitmap_low,
 
 	count = -EOPNOTSUPP;
 	if (likely(map)) {
-		count = __pv_send_ipi(&ipi_bitmap_low, map, &irq, min);
+		count = __pv_send_ipi(vcpu, &ipi_bitmap_low, map, &irq, min);
 		min += cluster_size;
-		count += __pv_send_ipi(&ipi_bitmap_high, map, &irq, min);
+		count += __pv_send_ipi(vcpu, &ipi_bitmap_high, map, &irq, min);
 	}
 
 	rcu_read_unlock();
@@ -1497,7 +1616,7 @@ static void apic_update_lvtt(struct kvm_lapic *apic)
 	if (apic->lapic_timer.timer_mode != timer_mode) {
 		if (apic_lvtt_tscdeadline(apic) != (timer_mode ==
 				APIC_LVT_TIMER_TSCDEADLINE)) {
-			hrtimer_cancel(&apic->lapic_timer.timer);
+			apic_timer_cancel(apic);
 			preempt_disable();
 			if (apic->lapic_timer.hv_timer_in_use)
 				cancel_hv_timer(apic);
@@ -1554,33 +1673,88 @@ static inline void __wait_lapic_expire(struct kvm_vcpu *vcpu, u64 guest_cycles)
 	}
 }
 
+static void lapic_timer_record_error(struct kvm_timer *ktimer, s64 err_ns,
+				     bool huge)
+{
+	u64 abs_ns = abs(err_ns);
+	int i;
+
+	if (huge)
+		i = LAPIC_TIMER_ERR_HIST_BUCKETS - 1;
+	else if (abs_ns < (1ull << LAPIC_TIMER_ERR_HIST_MIN_SHIFT))
+		i = 0;
+	else
+		i = min_t(int, ilog2(abs_ns >> LAPIC_TIMER_ERR_HIST_MIN_SHIFT) + 1,
+			  LAPIC_TIMER_ERR_HIST_BUCKETS - 1);
+
+	ktimer->advance_err_hist[err_ns > 0][i]++;
+}
+
+/*
+ * Tune timer_advance_ns from the error of each expiration, measured in ns so
+ * that changes of the host CPU frequency, which change how long injecting the
+ * interrupt takes, are tracked as well. Spikes are detected against the mean
+ * deviation of the recent errors instead of a fixed bound, and a persistent
+ * bias, i.e. a mean error larger than the deviation, is corrected twice as
+ * fast as random noise.
+ */
 static inline void adjust_lapic_timer_advance(struct kvm_vcpu *vcpu,
 					      s64 advance_expire_delta)
 {
-	struct kvm_lapic *apic = vcpu->arch.apic;
-	u32 timer_advance_ns = apic->lapic_timer.timer_advance_ns;
-	u64 ns;
+	struct kvm_timer *ktimer = &vcpu->arch.apic->lapic_timer;
+	s64 timer_advance_ns = ktimer->timer_advance_ns;
+	bool huge = abs(advance_expire_delta) > LAPIC_TIMER_ADVANCE_ADJUST_MAX;
+	s64 err_ns, mean, dev;
+	int step = LAPIC_TIMER_ADVANCE_ADJUST_STEP;
+
+	err_ns = huge ? advance_expire_delta :
+		 div_s64(advance_expire_delta * 1000000LL,
+			 vcpu->arch.virtual_tsc_khz);
+	lapic_timer_record_error(ktimer, err_ns, huge);
 
-	/* Do not adjust for tiny fluctuations or large random spikes. */
-	if (abs(advance_expire_delta) > LAPIC_TIMER_ADVANCE_ADJUST_MAX ||
-	    abs(advance_expire_delta) < LAPIC_TIMER_ADVANCE_ADJUST_MIN)
+	/* Way off, e.g. the vCPU was preempted, don't learn from it. */
+	if (huge)
 		return;
 
-	/* too early */
-	if (advance_expire_delta < 0) {
-		ns = -advance_expire_delta * 1000000ULL;
-		do_div(ns, vcpu->arch.virtual_tsc_khz);
-		timer_advance_ns -= ns/LAPIC_TIMER_ADVANCE_ADJUST_STEP;
-	} else {
-	/* too late */
-		ns = advance_expire_delta * 1000000ULL;
-		do_div(ns, vcpu->arch.virtual_tsc_khz);
-		timer_advance_ns += ns/LAPIC_TIMER_ADVANCE_ADJUST_STEP;
+	mean = ktimer->advance_err_mean >> LAPIC_TIMER_ADVANCE_EWMA_SHIFT;
+	dev = ktimer->advance_err_dev >> LAPIC_TIMER_ADVANCE_EWMA_SHIFT;
+
+	if (ktimer->advance_err_samples >= (1 << LAPIC_TIMER_ADVANCE_EWMA_SHIFT) &&
+	    abs(err_ns - mean) > LAPIC_TIMER_ADVANCE_SPIKE_DEVS * dev +
+				 LAPIC_TIMER_ADVANCE_SPIKE_MIN_NS) {
+		if (++ktimer->advance_err_rejects < LAPIC_TIMER_ADVANCE_REBASE_SPIKES)
+			return;
+
+		/*
+		 * The latency moved for good, e.g. after a frequency change
+		 * larger than the deviation, and every error would be a
+		 * spike from now on. Learn the statistics from scratch.
+		 */
+		ktimer->advance_err_samples = 0;
+		ktimer->advance_err_mean = 0;
+		ktimer->advance_err_dev = 0;
+		mean = dev = 0;
 	}
 
-	if (unlikely(timer_advance_ns > LAPIC_TIMER_ADVANCE_NS_MAX))
-		timer_advance_ns = LAPIC_TIMER_ADVANCE_NS_INIT;
-	apic->lapic_timer.timer_advance_ns = timer_advance_ns;
+	ktimer->advance_err_rejects = 0;
+	ktimer->advance_err_samples++;
+	ktimer->advance_err_mean += err_ns - mean;
+	ktimer->advance_err_dev += abs(err_ns - mean) - dev;
+
+	/* Do not adjust for tiny fluctuations. */
+	if (abs(advance_expire_delta) < LAPIC_TIMER_ADVANCE_ADJUST_MIN)
+		return;
+
+	if (abs(mean) > dev)
+		step /= 2;
+
+	/*
+	 * Keep the advance non-zero, kvm_wait_lapic_expire() would stop
+	 * sampling the error otherwise.
+	 */
+	timer_advance_ns += div_s64(err_ns, step);
+	ktimer->timer_advance_ns = clamp_t(s64, timer_advance_ns, 1,
+					   LAPIC_TIMER_ADVANCE_NS_MAX);
 }
 
 static void __kvm_wait_lapic_expire(struct kvm_vcpu *vcpu)
@@ -1678,7 +1852,7 @@ static void start_sw_tscdeadline(struct kvm_lapic *apic)
 	    likely(ns > apic->lapic_timer.timer_advance_ns)) {
 		expire = ktime_add_ns(now, ns);
 		expire = ktime_sub_ns(expire, ktimer->timer_advance_ns);
-		hrtimer_start(&ktimer->timer, expire, HRTIMER_MODE_ABS_HARD);
+		apic_timer_start(apic, expire);
 	} else
 		apic_timer_expired(apic, false);
 
@@ -1796,9 +1970,7 @@ static void start_sw_period(struct kvm_lapic *apic)
 		advance_periodic_target_expiration(apic);
 	}
 
-	hrtimer_start(&apic->lapic_timer.timer,
-		apic->lapic_timer.target_expiration,
-		HRTIMER_MODE_ABS_HARD);
+	apic_timer_start(apic, apic->lapic_timer.target_expiration);
 }
 
 bool kvm_lapic_hv_timer_in_use(struct kvm_vcpu *vcpu)
@@ -1835,7 +2007,7 @@ static bool start_hv_timer(struct kvm_lapic *apic)
 		return false;
 
 	ktimer->hv_timer_in_use = true;
-	hrtimer_cancel(&ktimer->timer);
+	apic_timer_cancel(apic);
 
 	/*
 	 * To simplify handling the periodic timer, leave the hv timer running
@@ -2070,7 +2242,7 @@ int kvm_lapic_reg_write(struct kvm_lapic *apic, u32 reg, u32 val)
 		if (apic_lvtt_tscdeadline(apic))
 			break;
 
-		hrtimer_cancel(&apic->lapic_timer.timer);
+		apic_timer_cancel(apic);
 		kvm_lapic_set_reg(apic, APIC_TMICT, val);
 		start_apic_timer(apic);
 		break;
@@ -2082,7 +2254,7 @@ int kvm_lapic_reg_write(struct kvm_lapic *apic, u32 reg, u32 val)
 		update_divide_count(apic);
 		if (apic->divide_count != old_divisor &&
 				apic->lapic_timer.period) {
-			hrtimer_cancel(&apic->lapic_timer.timer);
+			apic_timer_cancel(apic);
 			update_target_expiration(apic, old_divisor);
 			restart_apic_timer(apic);
 		}
@@ -2172,7 +2344,8 @@ void kvm_free_lapic(struct kvm_vcpu *vcpu)
 	if (!vcpu->arch.apic)
 		return;
 
-	hrtimer_cancel(&apic->lapic_timer.timer);
+	apic_timer_cancel(apic);
+	irq_work_sync(&apic->lapic_timer.offload.work);
 
 	if (!(vcpu->arch.apic_base & MSR_IA32_APICBASE_ENABLE))
 		static_key_slow_dec_deferred(&apic_hw_disabled);
@@ -2208,7 +2381,7 @@ void kvm_set_lapic_tscdeadline_msr(struct kvm_vcpu *vcpu, u64 data)
 	if (!kvm_apic_present(vcpu) || !apic_lvtt_tscdeadline(apic))
 		return;
 
-	hrtimer_cancel(&apic->lapic_timer.timer);
+	apic_timer_cancel(apic);
 	apic->lapic_timer.tscdeadline = data;
 	start_apic_timer(apic);
 }
@@ -2295,7 +2468,7 @@ void kvm_lapic_reset(struct kvm_vcpu *vcpu, bool init_event)
 		return;
 
 	/* Stop the timer in case it's a reset to an active apic */
-	hrtimer_cancel(&apic->lapic_timer.timer);
+	apic_timer_cancel(apic);
 
 	if (!init_event) {
 		kvm_lapic_set_base(vcpu, APIC_DEFAULT_PHYS_BASE |
@@ -2436,6 +2609,9 @@ int kvm_create_lapic(struct kvm_vcpu *vcpu, int timer_advance_ns)
 	hrtimer_init(&apic->lapic_timer.timer, CLOCK_MONOTONIC,
 		     HRTIMER_MODE_ABS_HARD);
 	apic->lapic_timer.timer.function = apic_timer_fn;
+	kvm_timer_offload_init(&apic->lapic_timer.offload,
+			       &apic->lapic_timer.timer,
+			       HRTIMER_MODE_ABS_PINNED_HARD);
 	if (timer_advance_ns == -1) {
 		apic->lapic_timer.timer_advance_ns = LAPIC_TIMER_ADVANCE_NS_INIT;
 		lapic_timer_advance_dynamic = true;
@@ -2593,7 +2769,7 @@ int kvm_apic_set_state(struct kvm_vcpu *vcpu, struct kvm_lapic_state *s)
 	kvm_apic_set_version(vcpu);
 
 	apic_update_ppr(apic);
-	hrtimer_cancel(&apic->lapic_timer.timer);
+	apic_timer_cancel(apic);
 	apic_update_lvtt(apic);
 	apic_manage_nmi_watchdog(apic, kvm_lapic_get_reg(apic, APIC_LVT0));
 	update_divide_count(apic);
@@ -27,8 +27,13 @@ enum lapic_mode {
 	LAPIC_MODE_X2APIC = MSR_IA32_APICBASE_ENABLE | X2APIC_ENABLE,
 };
 
+/* Bucket i < 7 holds errors below 128 << i ns, the last bucket the rest. */
+#define LAPIC_TIMER_ERR_HIST_BUCKETS	8
+#define LAPIC_TIMER_ERR_HIST_MIN_SHIFT	7
+
 struct kvm_timer {
 	struct hrtimer timer;
+	struct kvm_timer_offload offload;
 	s64 period; 				/* unit: ns */
 	ktime_t target_expiration;
 	u32 timer_mode;
@@ -37,6 +42,13 @@ struct kvm_timer {
 	u64 expired_tscdeadline;
 	u32 timer_advance_ns;
 	s64 advance_expire_delta;
+	/* Running mean and mean deviation of the expiration error, ns << 4 */
+	s64 advance_err_mean;
+	u64 advance_err_dev;
+	u32 advance_err_samples;
+	u32 advance_err_rejects;		/* consecutive spikes */
+	/* Expiration errors, early and late, in power-of-two buckets of ns */
+	u32 advance_err_hist[2][LAPIC_TIMER_ERR_HIST_BUCKETS];
 	atomic_t pending;			/* accumulated triggered timers */
 	bool hv_timer_in_use;
 };
@@ -95,6 +107,8 @@ bool kvm_apic_update_irr(struct kvm_vcpu *vcpu, u32 *pir, int *max_irr);
 void kvm_apic_update_ppr(struct kvm_vcpu *vcpu);
 int kvm_apic_set_irq(struct kvm_vcpu *vcpu, struct kvm_lapic_irq *irq,
 		     struct dest_map *dest_map);
+int kvm_apic_send_pv_ipi(struct kvm_vcpu *src, struct kvm_vcpu *vcpu,
+			 struct kvm_lapic_irq *irq);
 int kvm_apic_local_deliver(struct kvm_lapic *apic, int lvt_type);
 void kvm_apic_update_apicv(struct kvm_vcpu *vcpu);
 
@@ -251,6 +265,13 @@ void kvm_lapic_switch_to_hv_timer(struct kvm_vcpu *vcpu);
 void kvm_lapic_expired_hv_timer(struct kvm_vcpu *vcpu);
 bool kvm_lapic_hv_timer_in_use(struct kvm_vcpu *vcpu);
 void kvm_lapic_restart_hv_timer(struct kvm_vcpu *vcpu);
+bool kvm_can_post_timer_interrupt(struct kvm_vcpu *vcpu);
+bool kvm_lapic_timer_offloaded(struct kvm_vcpu *vcpu);
+void kvm_timer_offload_init(struct kvm_timer_offload *offload,
+			    struct hrtimer *timer, enum hrtimer_mode mode);
+void kvm_timer_offload_start(struct kvm_timer_offload *offload,
+			     ktime_t expire);
+void kvm_timer_offload_cancel(struct kvm_timer_offload *offload);
 bool kvm_can_use_hv_timer(struct kvm_vcpu *vcpu);
 
 static inline enum lapic_mode kvm_apic_mode(u64 apic_base)
@@ -101,6 +101,7 @@ static inline void kvm_mmu_load_pgd(struct kvm_vcpu *vcpu)
 
 int kvm_tdp_page_fault(struct kvm_vcpu *vcpu, gpa_t gpa, u32 error_code,
 		       bool prefault);
+int kvm_mmu_map_tdp_page(struct kvm_vcpu *vcpu, gpa_t gpa, int *level);
 
 static inline int kvm_mmu_do_page_fault(struct kvm_vcpu *vcpu, gpa_t cr2_or_gpa,
 					u32 err, bool prefault)
@@ -180,6 +180,36 @@ u64 make_nonleaf_spte(u64 *child_pt, bool ad_disabled)
 	return spte;
 }
 
+/*
+ * Construct an SPTE that maps a sub-page of the given huge page SPTE where
+ * `index` identifies which sub-page.
+ *
+ * The child SPTE keeps all the attributes of the huge SPTE, including the
+ * access tracking and dirty state, so that splitting the huge page does not
+ * change what the guest can do with the memory.
+ */
+u64 make_huge_page_split_spte(u64 huge_spte, int huge_level, int index)
+{
+	int child_level = huge_level - 1;
+	u64 child_spte;
+
+	if (WARN_ON_ONCE(!is_shadow_present_pte(huge_spte) ||
+			 !is_large_pte(huge_spte)))
+		return 0;
+
+	/*
+	 * The huge SPTE already has the base address of the huge page being
+	 * split, just OR in the offset of the page at the next lower level.
+	 */
+	child_spte = huge_spte;
+	child_spte |= (u64)(index * KVM_PAGES_PER_HPAGE(child_level)) << PAGE_SHIFT;
+
+	if (child_level == PG_LEVEL_4K)
+		child_spte &= ~PT_PAGE_SIZE_MASK;
+
+	return child_spte;
+}
+
 u64 kvm_mmu_changed_pte_notifier_make_spte(u64 old_spte, kvm_pfn_t new_pfn)
 {
 	u64 new_spte;
@@ -12,6 +12,9 @@ static bool __read_mostly tdp_mmu_enabled = false;
 module_param_named(tdp_mmu, tdp_mmu_enabled, bool, 0644);
 #endif
 
+/* Number of page tables freed between reschedule points. */
+#define TDP_MMU_FREE_BATCH	512
+
 static bool is_tdp_mmu_enabled(void)
 {
 #ifdef CONFIG_X86_64
@@ -31,15 +34,105 @@ void kvm_mmu_init_tdp_mmu(struct kvm *kvm)
 	kvm->arch.tdp_mmu_enabled = true;
 
 	INIT_LIST_HEAD(&kvm->arch.tdp_mmu_roots);
+	spin_lock_init(&kvm->arch.tdp_mmu_pages_lock);
 	INIT_LIST_HEAD(&kvm->arch.tdp_mmu_pages);
+
+	/* Without the arenas, page tables are allocated one page at a time. */
+	mutex_init(&kvm->arch.tdp_mmu_arena_lock);
+	kvm->arch.tdp_mmu_arenas = kcalloc(nr_node_ids,
+					   sizeof(*kvm->arch.tdp_mmu_arenas),
+					   GFP_KERNEL_ACCOUNT);
 }
 
 void kvm_mmu_uninit_tdp_mmu(struct kvm *kvm)
 {
+	struct tdp_mmu_arena *arena;
+	unsigned int i;
+	int nid;
+
 	if (!kvm->arch.tdp_mmu_enabled)
 		return;
 
 	WARN_ON(!list_empty(&kvm->arch.tdp_mmu_roots));
+
+	if (!kvm->arch.tdp_mmu_arenas)
+		return;
+
+	/* The pages handed out were split off, and are freed on their own. */
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		arena = &kvm->arch.tdp_mmu_arenas[nid];
+		for (i = 0; i < arena->nr_free; i++)
+			__free_page(arena->next + i);
+	}
+	kfree(kvm->arch.tdp_mmu_arenas);
+}
+
+#define TDP_MMU_ARENA_ORDER	(PMD_SHIFT - PAGE_SHIFT)
+
+/*
+ * Refill the arena of the nearest node with memory with a zeroed 2M chunk,
+ * split into 4K pages so that each page table page is freed on its own as
+ * before.
+ */
+static bool tdp_mmu_arena_refill(struct tdp_mmu_arena *arena, int nid)
+{
+	struct page *page;
+
+	page = alloc_pages_node(nid, GFP_KERNEL_ACCOUNT | __GFP_ZERO |
+				     __GFP_THISNODE | __GFP_NORETRY |
+				     __GFP_NOWARN, TDP_MMU_ARENA_ORDER);
+	if (!page)
+		return false;
+
+	split_page(page, TDP_MMU_ARENA_ORDER);
+
+	arena->next = page;
+	arena->nr_free = 1 << TDP_MMU_ARENA_ORDER;
+
+	return true;
+}
+
+/*
+ * Top up the shadow page cache of @vcpu with pages of the arena of its node,
+ * so that the page tables of a VM are packed into few 2M chunks, close to
+ * the vCPUs that walk them, instead of being spread over the whole memory.
+ * The first chunk's worth of pages, which is all the page tables a small VM
+ * needs, are allocated one at a time, and so is every page if no chunk can
+ * be allocated.
+ */
+int kvm_tdp_mmu_topup_page_cache(struct kvm_vcpu *vcpu, int min)
+{
+	struct kvm_mmu_memory_cache *mc = &vcpu->arch.mmu_shadow_page_cache;
+	struct kvm *kvm = vcpu->kvm;
+	struct tdp_mmu_arena *arena;
+	int nid = numa_mem_id();
+	int nobjs, r;
+
+	if (mc->nobjs >= min || !kvm->arch.tdp_mmu_arenas)
+		goto out;
+
+	if (atomic_read(&kvm->arch.tdp_mmu_nr_single_pages) <
+	    (1 << TDP_MMU_ARENA_ORDER)) {
+		nobjs = mc->nobjs;
+		r = kvm_mmu_topup_memory_cache(mc, min);
+		atomic_add(mc->nobjs - nobjs, &kvm->arch.tdp_mmu_nr_single_pages);
+		return r;
+	}
+
+	arena = &kvm->arch.tdp_mmu_arenas[nid];
+
+	mutex_lock(&kvm->arch.tdp_mmu_arena_lock);
+	while (mc->nobjs < ARRAY_SIZE(mc->objects)) {
+		if (!arena->nr_free && !tdp_mmu_arena_refill(arena, nid))
+			break;
+
+		mc->objects[mc->nobjs++] = page_address(arena->next++);
+		arena->nr_free--;
+	}
+	mutex_unlock(&kvm->arch.tdp_mmu_arena_lock);
+
+out:
+	return kvm_mmu_topup_memory_cache(mc, min);
 }
 
 #define for_each_tdp_mmu_root(_kvm, _root)			    \
@@ -57,11 +150,65 @@ bool is_tdp_mmu_root(struct kvm *kvm, hpa_t hpa)
 static bool zap_gfn_range(struct kvm *kvm, struct kvm_mmu_page *root,
 			  gfn_t start, gfn_t end, bool can_yield);
 
+static void tdp_mmu_free_sp(struct kvm_mmu_page *sp)
+{
+	free_page((unsigned long)sp->spt);
+	kmem_cache_free(mmu_page_header_cache, sp);
+}
+
+/*
+ * Page tables removed from the paging structure are freed by a worker, in
+ * batches, after an RCU grace period.
+ * By only accessing TDP MMU page table memory in an RCU read critical
+ * section, and freeing it after a grace period, lockless access to that
+ * memory won't use it after it is freed. Deferring the freeing to a worker
+ * also keeps it out of the VM destruction path, where millions of page
+ * tables can be removed at once.
+ * The pages don't reference the VM, so the worker and the list are global
+ * and outlive the VMs that queued pages.
+ */
+static LLIST_HEAD(tdp_mmu_free_list);
+
+static void tdp_mmu_free_work_fn(struct work_struct *work)
+{
+	struct kvm_mmu_page *sp, *next;
+	struct llist_node *batch;
+	unsigned long nr_freed = 0;
+
+	batch = llist_del_all(&tdp_mmu_free_list);
+	if (!batch)
+		return;
+
+	/* Wait for all the walkers that could still see the pages. */
+	synchronize_rcu();
+
+	llist_for_each_entry_safe(sp, next, batch, free_node) {
+		tdp_mmu_free_sp(sp);
+
+		if (!(++nr_freed % TDP_MMU_FREE_BATCH))
+			cond_resched();
+	}
+}
+
+static DECLARE_WORK(tdp_mmu_free_work, tdp_mmu_free_work_fn);
+
+static void tdp_mmu_free_sp_deferred(struct kvm_mmu_page *sp)
+{
+	if (llist_add(&sp->free_node, &tdp_mmu_free_list))
+		queue_work(system_unbound_wq, &tdp_mmu_free_work);
+}
+
+/* Free the page tables that are still queued, before the caches go away. */
+void kvm_tdp_mmu_module_exit(void)
+{
+	flush_work(&tdp_mmu_free_work);
+}
+
 void kvm_tdp_mmu_free_root(struct kvm *kvm, struct kvm_mmu_page *root)
 {
 	gfn_t max_gfn = 1ULL << (boot_cpu_data.x86_phys_bits - PAGE_SHIFT);
 
-	lockdep_assert_held(&kvm->mmu_lock);
+	lockdep_assert_held_write(&kvm->mmu_lock);
 
 	WARN_ON(root->root_count);
 	WARN_ON(!root->tdp_mmu_page);
@@ -70,8 +217,7 @@ void kvm_tdp_mmu_free_root(struct kvm *kvm, struct kvm_mmu_page *root)
 
 	zap_gfn_range(kvm, root, 0, max_gfn, false);
 
-	free_page((unsigned long)root->spt);
-	kmem_cache_free(mmu_page_header_cache, root);
+	tdp_mmu_free_sp(root);
 }
 
 static union kvm_mmu_page_role page_role_for_level(struct kvm_vcpu *vcpu,
@@ -112,13 +258,13 @@ static struct kvm_mmu_page *get_tdp_mmu_vcpu_root(struct kvm_vcpu *vcpu)
 
 	role = page_role_for_level(vcpu, vcpu->arch.mmu->shadow_root_level);
 
-	spin_lock(&kvm->mmu_lock);
+	write_lock(&kvm->mmu_lock);
 
 	/* Check for an existing root before allocating a new one. */
 	for_each_tdp_mmu_root(kvm, root) {
 		if (root->role.word == role.word) {
 			kvm_mmu_get_root(kvm, root);
-			spin_unlock(&kvm->mmu_lock);
+			write_unlock(&kvm->mmu_lock);
 			return root;
 		}
 	}
@@ -128,7 +274,7 @@ static struct kvm_mmu_page *get_tdp_mmu_vcpu_root(struct kvm_vcpu *vcpu)
 
 	list_add(&root->link, &kvm->arch.tdp_mmu_roots);
 
-	spin_unlock(&kvm->mmu_lock);
+	write_unlock(&kvm->mmu_lock);
 
 	return root;
 }
@@ -145,7 +291,8 @@ hpa_t kvm_tdp_mmu_get_vcpu_root_hpa(struct kvm_vcpu *vcpu)
 }
 
 static void handle_changed_spte(struct kvm *kvm, int as_id, gfn_t gfn,
-				u64 old_spte, u64 new_spte, int level);
+				u64 old_spte, u64 new_spte, int level,
+				bool shared);
 
 static int kvm_mmu_page_as_id(struct kvm_mmu_page *sp)
 {
@@ -178,10 +325,122 @@ static void handle_changed_spte_dirty_log(struct kvm *kvm, int as_id, gfn_t gfn,
 	if ((!is_writable_pte(old_spte) || pfn_changed) &&
 	    is_writable_pte(new_spte)) {
 		slot = __gfn_to_memslot(__kvm_memslots(kvm, as_id), gfn);
-		mark_page_dirty_in_slot(slot, gfn);
+		mark_page_dirty_in_slot(kvm, slot, gfn);
 	}
 }
 
+/**
+ * tdp_mmu_link_page - Add a new page to the list of pages used by the TDP MMU
+ *
+ * @kvm: kvm instance
+ * @sp: the new page
+ * @shared: This operation may not be running under the exclusive use of
+ *	    the MMU lock and the operation must synchronize with other
+ *	    threads that might be adding or removing pages.
+ * @account_nx: This page replaces a NX large page and should be marked for
+ *		eventual reclaim.
+ */
+static void tdp_mmu_link_page(struct kvm *kvm, struct kvm_mmu_page *sp,
+			      bool shared, bool account_nx)
+{
+	if (shared)
+		spin_lock(&kvm->arch.tdp_mmu_pages_lock);
+	else
+		lockdep_assert_held_write(&kvm->mmu_lock);
+
+	list_add(&sp->link, &kvm->arch.tdp_mmu_pages);
+	if (account_nx)
+		account_huge_nx_page(kvm, sp);
+
+	if (shared)
+		spin_unlock(&kvm->arch.tdp_mmu_pages_lock);
+}
+
+/**
+ * tdp_mmu_unlink_page - Remove page from the list of pages used by the TDP MMU
+ *
+ * @kvm: kvm instance
+ * @sp: the page to be removed
+ * @shared: This operation may not be running under the exclusive use of
+ *	    the MMU lock and the operation must synchronize with other
+ *	    threads that might be adding or removing pages.
+ */
+static void tdp_mmu_unlink_page(struct kvm *kvm, struct kvm_mmu_page *sp,
+				bool shared)
+{
+	if (shared)
+		spin_lock(&kvm->arch.tdp_mmu_pages_lock);
+	else
+		lockdep_assert_held_write(&kvm->mmu_lock);
+
+	list_del(&sp->link);
+	if (sp->lpage_disallowed)
+		unaccount_huge_nx_page(kvm, sp);
+
+	if (shared)
+		spin_unlock(&kvm->arch.tdp_mmu_pages_lock);
+}
+
+/**
+ * handle_removed_tdp_mmu_page - handle a pt removed from the TDP structure
+ *
+ * @kvm: kvm instance
+ * @as_id: the address space of the removed paging structure
+ * @gfn: the base GFN that was mapped by the SPTE pointing to @pt
+ * @pt: the page removed from the paging structure
+ * @level: the level of the SPTE that pointed to @pt
+ * @shared: This operation may not be running under the exclusive use
+ *	    of the MMU lock and the operation must synchronize with other
+ *	    threads that might be modifying SPTEs.
+ *
+ * Given a page table that has been removed from the TDP paging structure,
+ * iterates through the page table to clear SPTEs and free child page tables.
+ * The page table itself is freed after an RCU grace period, as other threads
+ * may still be walking it.
+ */
+static void handle_removed_tdp_mmu_page(struct kvm *kvm, int as_id, gfn_t gfn,
+					u64 *pt, int level, bool shared)
+{
+	struct kvm_mmu_page *sp = sptep_to_sp(pt);
+	u64 old_child_spte;
+	u64 *sptep;
+	int i;
+
+	tdp_mmu_unlink_page(kvm, sp, shared);
+
+	for (i = 0; i < PT64_ENT_PER_PAGE; i++) {
+		sptep = pt + i;
+
+		if (shared) {
+			/*
+			 * Set the SPTE to a nonpresent value that other
+			 * threads will not overwrite. If the SPTE was
+			 * already marked as removed then another thread
+			 * handling a page fault could overwrite it, so
+			 * set the SPTE until it is set from some other
+			 * value to the removed SPTE value.
+			 */
+			for (;;) {
+				old_child_spte = xchg(sptep, REMOVED_SPTE);
+				if (!is_removed_spte(old_child_spte))
+					break;
+				cpu_relax();
+			}
+		} else {
+			old_child_spte = READ_ONCE(*sptep);
+			WRITE_ONCE(*sptep, REMOVED_SPTE);
+		}
+		handle_changed_spte(kvm, as_id,
+			gfn + (i * KVM_PAGES_PER_HPAGE(level - 1)),
+			old_child_spte, REMOVED_SPTE, level - 1, shared);
+	}
+
+	kvm_flush_remote_tlbs_with_address(kvm, gfn,
+					   KVM_PAGES_PER_HPAGE(level));
+
+	tdp_mmu_free_sp_deferred(sp);
+}
+
 /**
  * handle_changed_spte - handle bookkeeping associated with an SPTE change
  * @kvm: kvm instance
@@ -190,22 +449,22 @@ static void handle_changed_spte_dirty_log(struct kvm *kvm, int as_id, gfn_t gfn,
  * @old_spte: The value of the SPTE before the change
  * @new_spte: The value of the SPTE after the change
  * @level: the level of the PT the SPTE is part of in the paging structure
+ * @shared: This operation may not be running under the exclusive use of
+ *	    the MMU lock and the operation must synchronize with other
+ *	    threads that might be modifying SPTEs.
  *
  * Handle bookkeeping that might result from the modification of a SPTE.
  * This function must be called for all TDP SPTE modifications.
  */
 static void __handle_changed_spte(struct kvm *kvm, int as_id, gfn_t gfn,
-				u64 old_spte, u64 new_spte, int level)
+				  u64 old_spte, u64 new_spte, int level,
+				  bool shared)
 {
 	bool was_present = is_shadow_present_pte(old_spte);
 	bool is_present = is_shadow_present_pte(new_spte);
 	bool was_leaf = was_present && is_last_spte(old_spte, level);
 	bool is_leaf = is_present && is_last_spte(new_spte, level);
 	bool pfn_changed = spte_to_pfn(old_spte) != spte_to_pfn(new_spte);
-	u64 *pt;
-	struct kvm_mmu_page *sp;
-	u64 old_child_spte;
-	int i;
 
 	WARN_ON(level > PT64_ROOT_MAX_LEVEL);
 	WARN_ON(level < PG_LEVEL_4K);
@@ -240,15 +499,20 @@ static void __handle_changed_spte(struct kvm *kvm, int as_id, gfn_t gfn,
 	/*
 	 * The only times a SPTE should be changed from a non-present to
 	 * non-present state is when an MMIO entry is installed/modified/
-	 * removed. In that case, there is nothing to do here.
+	 * removed, or when a SPTE is frozen or its page table is torn down
+	 * with the removed SPTE value. In that case, there is nothing to do
+	 * here.
 	 */
 	if (!was_present && !is_present) {
 		/*
-		 * If this change does not involve a MMIO SPTE, it is
-		 * unexpected. Log the change, though it should not impact the
-		 * guest since both the former and current SPTEs are nonpresent.
+		 * If this change does not involve a MMIO SPTE or removed SPTE,
+		 * it is unexpected. Log the change, though it should not
+		 * impact the guest since both the former and current SPTEs
+		 * are nonpresent.
 		 */
-		if (WARN_ON(!is_mmio_spte(old_spte) && !is_mmio_spte(new_spte)))
+		if (WARN_ON(!is_mmio_spte(old_spte) &&
+			    !is_mmio_spte(new_spte) &&
+			    !is_removed_spte(new_spte)))
 			pr_err("Unexpected SPTE change! Nonpresent SPTEs\n"
 			       "should not be replaced with another,\n"
 			       "different nonpresent SPTE, unless one or both\n"
@@ -267,40 +531,124 @@ static void __handle_changed_spte(struct kvm *kvm, int as_id, gfn_t gfn,
 	 * Recursively handle child PTs if the change removed a subtree from
 	 * the paging structure.
 	 */
-	if (was_present && !was_leaf && (pfn_changed || !is_present)) {
-		pt = spte_to_child_pt(old_spte, level);
-		sp = sptep_to_sp(pt);
+	if (was_present && !was_leaf && (pfn_changed || !is_present))
+		handle_removed_tdp_mmu_page(kvm, as_id, gfn,
+				spte_to_child_pt(old_spte, level), level,
+				shared);
+}
 
-		list_del(&sp->link);
+static void handle_changed_spte(struct kvm *kvm, int as_id, gfn_t gfn,
+				u64 old_spte, u64 new_spte, int level,
+				bool shared)
+{
+	__handle_changed_spte(kvm, as_id, gfn, old_spte, new_spte, level,
+			      shared);
+	handle_changed_spte_acc_track(old_spte, new_spte, level);
+	handle_changed_spte_dirty_log(kvm, as_id, gfn, old_spte,
+				      new_spte, level);
+}
 
-		if (sp->lpage_disallowed)
-			unaccount_huge_nx_page(kvm, sp);
+/*
+ * tdp_mmu_set_spte_atomic - Set a TDP MMU SPTE atomically and handle the
+ * associated bookkeeping
+ *
+ * @kvm: kvm instance
+ * @iter: a tdp_iter instance currently on the SPTE that should be set
+ * @new_spte: The value the SPTE should be set to
+ * Returns: true if the SPTE was set, false if it was not. If false is returned,
+ *	    this function will have no side-effects.
+ */
+static inline bool __tdp_mmu_set_spte_atomic(struct kvm *kvm,
+					     struct tdp_iter *iter,
+					     u64 new_spte, bool record_acc_track)
+{
+	u64 *root_pt = tdp_iter_root_pt(iter);
+	struct kvm_mmu_page *root = sptep_to_sp(root_pt);
+	int as_id = kvm_mmu_page_as_id(root);
 
-		for (i = 0; i < PT64_ENT_PER_PAGE; i++) {
-			old_child_spte = READ_ONCE(*(pt + i));
-			WRITE_ONCE(*(pt + i), 0);
-			handle_changed_spte(kvm, as_id,
-				gfn + (i * KVM_PAGES_PER_HPAGE(level - 1)),
-				old_child_spte, 0, level - 1);
-		}
+	lockdep_assert_held_read(&kvm->mmu_lock);
+
+	/*
+	 * Do not change removed SPTEs. Only the thread that froze the SPTE
+	 * may modify it.
+	 */
+	if (is_removed_spte(iter->old_spte))
+		return false;
 
-		kvm_flush_remote_tlbs_with_address(kvm, gfn,
-						   KVM_PAGES_PER_HPAGE(level));
+	if (cmpxchg64(iter->sptep, iter->old_spte, new_spte) != iter->old_spte)
+		return false;
 
-		free_page((unsigned long)pt);
-		kmem_cache_free(mmu_page_header_cache, sp);
-	}
+	__handle_changed_spte(kvm, as_id, iter->gfn, iter->old_spte, new_spte,
+			      iter->level, true);
+	if (record_acc_track)
+		handle_changed_spte_acc_track(iter->old_spte, new_spte,
+					      iter->level);
+	handle_changed_spte_dirty_log(kvm, as_id, iter->gfn, iter->old_spte,
+				      new_spte, iter->level);
+
+	return true;
 }
 
-static void handle_changed_spte(struct kvm *kvm, int as_id, gfn_t gfn,
-				u64 old_spte, u64 new_spte, int level)
+static inline bool tdp_mmu_set_spte_atomic(struct kvm *kvm,
+					   struct tdp_iter *iter,
+					   u64 new_spte)
 {
-	__handle_changed_spte(kvm, as_id, gfn, old_spte, new_spte, level);
-	handle_changed_spte_acc_track(old_spte, new_spte, level);
-	handle_changed_spte_dirty_log(kvm, as_id, gfn, old_spte,
-				      new_spte, level);
+	return __tdp_mmu_set_spte_atomic(kvm, iter, new_spte, true);
+}
+
+static inline bool tdp_mmu_set_spte_atomic_no_acc_track(struct kvm *kvm,
+							struct tdp_iter *iter,
+							u64 new_spte)
+{
+	return __tdp_mmu_set_spte_atomic(kvm, iter, new_spte, false);
+}
+
+static inline bool tdp_mmu_zap_spte_atomic(struct kvm *kvm,
+					   struct tdp_iter *iter)
+{
+	/*
+	 * Freeze the SPTE by setting it to a special,
+	 * non-present value. This will stop other threads from
+	 * immediately installing a present entry in its place
+	 * before the TLBs are flushed.
+	 */
+	if (!tdp_mmu_set_spte_atomic(kvm, iter, REMOVED_SPTE))
+		return false;
+
+	kvm_flush_remote_tlbs_with_address(kvm, iter->gfn,
+					   KVM_PAGES_PER_HPAGE(iter->level));
+
+	/*
+	 * No other thread can overwrite the removed SPTE as they
+	 * must either wait on the MMU lock or use
+	 * tdp_mmu_set_spte_atomic which will not overwrite the
+	 * special removed SPTE value. No bookkeeping is needed
+	 * here since the SPTE is going from non-present
+	 * to non-present.
+	 */
+	WRITE_ONCE(*iter->sptep, 0);
+
+	return true;
 }
 
+/*
+ * __tdp_mmu_set_spte - Set a TDP MMU SPTE and handle the associated bookkeeping
+ * @kvm: kvm instance
+ * @iter: a tdp_iter instance currently on the SPTE that should be set
+ * @new_spte: The value the SPTE should be set to
+ * @record_acc_track: Notify the MM subsystem of changes to the accessed state
+ *		      of the page. Should be set unless handling an MMU
+ *		      notifier for access tracking. Leaving record_acc_track
+ *		      unset in that case prevents page accesses from being
+ *		      double counted.
+ * @record_dirty_log: Record the page as dirty in the dirty bitmap if
+ *		      appropriate for the change being made. Should be set
+ *		      unless performing certain dirty logging operations.
+ *		      Leaving record_dirty_log unset in that case prevents page
+ *		      writes from being double counted.
+ *
+ * Must be called with mmu_lock held for write.
+ */
 static inline void __tdp_mmu_set_spte(struct kvm *kvm, struct tdp_iter *iter,
 				      u64 new_spte, bool record_acc_track,
 				      bool record_dirty_log)
@@ -309,10 +657,21 @@ static inline void __tdp_mmu_set_spte(struct kvm *kvm, struct tdp_iter *iter,
 	struct kvm_mmu_page *root = sptep_to_sp(root_pt);
 	int as_id = kvm_mmu_page_as_id(root);
 
+	lockdep_assert_held_write(&kvm->mmu_lock);
+
+	/*
+	 * No thread should be using this function to set SPTEs to the
+	 * temporary removed SPTE value.
+	 * If operating under the MMU lock in read mode, tdp_mmu_set_spte_atomic
+	 * should be used. If operating under the MMU lock in write mode, the
+	 * use of the removed SPTE should not be necessary.
+	 */
+	WARN_ON(is_removed_spte(iter->old_spte));
+
 	WRITE_ONCE(*iter->sptep, new_spte);
 
 	__handle_changed_spte(kvm, as_id, iter->gfn, iter->old_spte, new_spte,
-			      iter->level);
+			      iter->level, false);
 	if (record_acc_track)
 		handle_changed_spte_acc_track(iter->old_spte, new_spte,
 					      iter->level);
@@ -362,9 +721,9 @@ static inline void tdp_mmu_set_spte_no_dirty_log(struct kvm *kvm,
  */
 static bool tdp_mmu_iter_flush_cond_resched(struct kvm *kvm, struct tdp_iter *iter)
 {
-	if (need_resched() || spin_needbreak(&kvm->mmu_lock)) {
+	if (need_resched() || rwlock_needbreak(&kvm->mmu_lock)) {
 		kvm_flush_remote_tlbs(kvm);
-		cond_resched_lock(&kvm->mmu_lock);
+		cond_resched_rwlock_write(&kvm->mmu_lock);
 		tdp_iter_refresh_walk(iter);
 		return false;
 	} else {
@@ -374,8 +733,8 @@ static bool tdp_mmu_iter_flush_cond_resched(struct kvm *kvm, struct tdp_iter *it
 
 static void tdp_mmu_iter_cond_resched(struct kvm *kvm, struct tdp_iter *iter)
 {
-	if (need_resched() || spin_needbreak(&kvm->mmu_lock)) {
-		cond_resched_lock(&kvm->mmu_lock);
+	if (need_resched() || rwlock_needbreak(&kvm->mmu_lock)) {
+		cond_resched_rwlock_write(&kvm->mmu_lock);
 		tdp_iter_refresh_walk(iter);
 	}
 }
@@ -447,12 +806,50 @@ bool kvm_tdp_mmu_zap_gfn_range(struct kvm *kvm, gfn_t start, gfn_t end)
 	return flush;
 }
 
+/*
+ * Zap all the SPTEs of a root. The SPTEs at the 1G level are zapped first, so
+ * that the subtree torn down in one go is bounded and the walk can yield in
+ * between, instead of removing up to 512G worth of page tables at once when
+ * zapping a top-level SPTE. The upper levels, now empty, are zapped last.
+ */
+static bool tdp_mmu_zap_root(struct kvm *kvm, struct kvm_mmu_page *root,
+			     gfn_t max_gfn)
+{
+	struct tdp_iter iter;
+	bool flush_needed = false;
+
+	for_each_tdp_pte_min_level(iter, root->spt, root->role.level,
+				   PG_LEVEL_1G, 0, max_gfn) {
+		if (iter.level > PG_LEVEL_1G ||
+		    !is_shadow_present_pte(iter.old_spte))
+			continue;
+
+		tdp_mmu_set_spte(kvm, &iter, 0);
+
+		flush_needed = tdp_mmu_iter_flush_cond_resched(kvm, &iter);
+	}
+
+	return zap_gfn_range(kvm, root, 0, max_gfn, true) || flush_needed;
+}
+
 void kvm_tdp_mmu_zap_all(struct kvm *kvm)
 {
 	gfn_t max_gfn = 1ULL << (boot_cpu_data.x86_phys_bits - PAGE_SHIFT);
-	bool flush;
+	struct kvm_mmu_page *root;
+	bool flush = false;
+
+	for_each_tdp_mmu_root(kvm, root) {
+		/*
+		 * Take a reference on the root so that it cannot be freed if
+		 * this thread releases the MMU lock and yields in this loop.
+		 */
+		kvm_mmu_get_root(kvm, root);
+
+		flush |= tdp_mmu_zap_root(kvm, root, max_gfn);
+
+		kvm_mmu_put_root(kvm, root);
+	}
 
-	flush = kvm_tdp_mmu_zap_gfn_range(kvm, 0, max_gfn);
 	if (flush)
 		kvm_flush_remote_tlbs(kvm);
 }
@@ -481,8 +878,8 @@ static int tdp_mmu_map_handle_target_level(struct kvm_vcpu *vcpu, int write,
 
 	if (new_spte == iter->old_spte)
 		ret = RET_PF_SPURIOUS;
-	else
-		tdp_mmu_set_spte(vcpu->kvm, iter, new_spte);
+	else if (!tdp_mmu_set_spte_atomic(vcpu->kvm, iter, new_spte))
+		return RET_PF_RETRY;
 
 	/*
 	 * If the page fault was caused by a write but the page is write
@@ -509,6 +906,10 @@ static int tdp_mmu_map_handle_target_level(struct kvm_vcpu *vcpu, int write,
 /*
  * Handle a TDP page fault (NPT/EPT violation/misconfiguration) by installing
  * page tables and SPTEs to translate the faulting guest physical address.
+ *
+ * Runs with mmu_lock held for read, so that faults on different vCPUs can
+ * proceed in parallel. SPTEs are installed with cmpxchg and the fault is
+ * retried whenever another thread changed an SPTE under the walk.
  */
 int kvm_tdp_mmu_map(struct kvm_vcpu *vcpu, gpa_t gpa, u32 error_code,
 		    int map_writable, int max_level, kvm_pfn_t pfn,
@@ -537,6 +938,9 @@ int kvm_tdp_mmu_map(struct kvm_vcpu *vcpu, gpa_t gpa, u32 error_code,
 					huge_page_disallowed, &req_level);
 
 	trace_kvm_mmu_spte_requested(gpa, level, pfn);
+
+	rcu_read_lock();
+
 	tdp_mmu_for_each_pte(iter, mmu, gfn, gfn + 1) {
 		if (nx_huge_page_workaround_enabled)
 			disallowed_hugepage_adjust(iter.old_spte, gfn,
@@ -552,10 +956,8 @@ int kvm_tdp_mmu_map(struct kvm_vcpu *vcpu, gpa_t gpa, u32 error_code,
 		 */
 		if (is_shadow_present_pte(iter.old_spte) &&
 		    is_large_pte(iter.old_spte)) {
-			tdp_mmu_set_spte(vcpu->kvm, &iter, 0);
-
-			kvm_flush_remote_tlbs_with_address(vcpu->kvm, iter.gfn,
-					KVM_PAGES_PER_HPAGE(iter.level));
+			if (!tdp_mmu_zap_spte_atomic(vcpu->kvm, &iter))
+				break;
 
 			/*
 			 * The iter must explicitly re-read the spte here
@@ -566,32 +968,62 @@ int kvm_tdp_mmu_map(struct kvm_vcpu *vcpu, gpa_t gpa, u32 error_code,
 		}
 
 		if (!is_shadow_present_pte(iter.old_spte)) {
+			/*
+			 * If SPTE has been frozen by another thread, just
+			 * give up and retry, avoiding unnecessary page table
+			 * allocation and free.
+			 */
+			if (is_removed_spte(iter.old_spte))
+				break;
+
 			sp = alloc_tdp_mmu_page(vcpu, iter.gfn, iter.level);
-			list_add(&sp->link, &vcpu->kvm->arch.tdp_mmu_pages);
 			child_pt = sp->spt;
 			clear_page(child_pt);
 			new_spte = make_nonleaf_spte(child_pt,
 						     !shadow_accessed_mask);
 
-			trace_kvm_mmu_get_page(sp, true);
-			if (huge_page_disallowed && req_level >= iter.level)
-				account_huge_nx_page(vcpu->kvm, sp);
+			/*
+			 * Link the page before making it visible, so that a
+			 * thread that removes it right away finds it on the
+			 * list.
+			 */
+			tdp_mmu_link_page(vcpu->kvm, sp, true,
+					  huge_page_disallowed &&
+					  req_level >= iter.level);
+
+			if (!tdp_mmu_set_spte_atomic(vcpu->kvm, &iter,
+						     new_spte)) {
+				tdp_mmu_unlink_page(vcpu->kvm, sp, true);
+				tdp_mmu_free_sp(sp);
+				break;
+			}
 
-			tdp_mmu_set_spte(vcpu->kvm, &iter, new_spte);
+			trace_kvm_mmu_get_page(sp, true);
 		}
 	}
 
-	if (WARN_ON(iter.level != level))
+	/* Another thread changed an SPTE under the walk, retry the fault. */
+	if (iter.level != level) {
+		rcu_read_unlock();
 		return RET_PF_RETRY;
+	}
 
 	ret = tdp_mmu_map_handle_target_level(vcpu, write, map_writable, &iter,
 					      pfn, prefault);
 
+	rcu_read_unlock();
+
 	return ret;
 }
 
+/*
+ * Run @handler on the GFN ranges of each root that are mapped by the HVA range
+ * [start, end). If @shared is true, mmu_lock is held for read and @handler must
+ * neither yield nor modify SPTEs other than atomically. The roots can't go
+ * away in that case, because they are only freed with mmu_lock held for write.
+ */
 static int kvm_tdp_mmu_handle_hva_range(struct kvm *kvm, unsigned long start,
-		unsigned long end, unsigned long data,
+		unsigned long end, unsigned long data, bool shared,
 		int (*handler)(struct kvm *kvm, struct kvm_memory_slot *slot,
 			       struct kvm_mmu_page *root, gfn_t start,
 			       gfn_t end, unsigned long data))
@@ -602,12 +1034,16 @@ static int kvm_tdp_mmu_handle_hva_range(struct kvm *kvm, unsigned long start,
 	int ret = 0;
 	int as_id;
 
+	if (shared)
+		lockdep_assert_held_read(&kvm->mmu_lock);
+
 	for_each_tdp_mmu_root(kvm, root) {
 		/*
 		 * Take a reference on the root so that it cannot be freed if
 		 * this thread releases the MMU lock and yields in this loop.
 		 */
-		kvm_mmu_get_root(kvm, root);
+		if (!shared)
+			kvm_mmu_get_root(kvm, root);
 
 		as_id = kvm_mmu_page_as_id(root);
 		slots = __kvm_memslots(kvm, as_id);
@@ -631,7 +1067,8 @@ static int kvm_tdp_mmu_handle_hva_range(struct kvm *kvm, unsigned long start,
 				       gfn_end, data);
 		}
 
-		kvm_mmu_put_root(kvm, root);
+		if (!shared)
+			kvm_mmu_put_root(kvm, root);
 	}
 
 	return ret;
@@ -648,13 +1085,18 @@ static int zap_gfn_range_hva_wrapper(struct kvm *kvm,
 int kvm_tdp_mmu_zap_hva_range(struct kvm *kvm, unsigned long start,
 			      unsigned long end)
 {
-	return kvm_tdp_mmu_handle_hva_range(kvm, start, end, 0,
+	return kvm_tdp_mmu_handle_hva_range(kvm, start, end, 0, false,
 					    zap_gfn_range_hva_wrapper);
 }
 
 /*
  * Mark the SPTEs range of GFNs [start, end) unaccessed and return non-zero
  * if any of the GFNs in the range have been accessed.
+ *
+ * Runs with mmu_lock held for read, so the SPTEs are updated with cmpxchg. If
+ * that fails, a vCPU or the CPU itself changed the SPTE under our feet and the
+ * SPTE is left alone; the GFN is reported young regardless, as it was when
+ * it was read.
  */
 static int age_gfn_range(struct kvm *kvm, struct kvm_memory_slot *slot,
 			 struct kvm_mmu_page *root, gfn_t start, gfn_t end,
@@ -664,6 +1106,8 @@ static int age_gfn_range(struct kvm *kvm, struct kvm_memory_slot *slot,
 	int young = 0;
 	u64 new_spte = 0;
 
+	rcu_read_lock();
+
 	tdp_root_for_each_leaf_pte(iter, root, start, end) {
 		/*
 		 * If we have a non-accessed entry we don't need to change the
@@ -689,17 +1133,20 @@ static int age_gfn_range(struct kvm *kvm, struct kvm_memory_slot *slot,
 		}
 		new_spte &= ~shadow_dirty_mask;
 
-		tdp_mmu_set_spte_no_acc_track(kvm, &iter, new_spte);
+		tdp_mmu_set_spte_atomic_no_acc_track(kvm, &iter, new_spte);
 		young = 1;
 	}
 
+	rcu_read_unlock();
+
 	return young;
 }
 
+/* Must be called with mmu_lock held for read. */
 int kvm_tdp_mmu_age_hva_range(struct kvm *kvm, unsigned long start,
 			      unsigned long end)
 {
-	return kvm_tdp_mmu_handle_hva_range(kvm, start, end, 0,
+	return kvm_tdp_mmu_handle_hva_range(kvm, start, end, 0, true,
 					    age_gfn_range);
 }
 
@@ -708,17 +1155,26 @@ static int test_age_gfn(struct kvm *kvm, struct kvm_memory_slot *slot,
 			unsigned long unused2)
 {
 	struct tdp_iter iter;
+	int young = 0;
 
-	tdp_root_for_each_leaf_pte(iter, root, gfn, gfn + 1)
-		if (is_accessed_spte(iter.old_spte))
-			return 1;
+	rcu_read_lock();
 
-	return 0;
+	tdp_root_for_each_leaf_pte(iter, root, gfn, gfn + 1) {
+		if (is_accessed_spte(iter.old_spte)) {
+			young = 1;
+			break;
+		}
+	}
+
+	rcu_read_unlock();
+
+	return young;
 }
 
+/* Must be called with mmu_lock held for read. */
 int kvm_tdp_mmu_test_age_hva(struct kvm *kvm, unsigned long hva)
 {
-	return kvm_tdp_mmu_handle_hva_range(kvm, hva, hva + 1, 0,
+	return kvm_tdp_mmu_handle_hva_range(kvm, hva, hva + 1, 0, true,
 					    test_age_gfn);
 }
 
@@ -773,7 +1229,7 @@ int kvm_tdp_mmu_set_spte_hva(struct kvm *kvm, unsigned long address,
 			     pte_t *host_ptep)
 {
 	return kvm_tdp_mmu_handle_hva_range(kvm, address, address + 1,
-					    (unsigned long)host_ptep,
+					    (unsigned long)host_ptep, false,
 					    set_tdp_spte);
 }
 
@@ -921,7 +1377,7 @@ static void clear_dirty_pt_masked(struct kvm *kvm, struct kvm_mmu_page *root,
 	u64 new_spte;
 
 	tdp_root_for_each_leaf_pte(iter, root, gfn + __ffs(mask),
-				    gfn + BITS_PER_LONG) {
+				    gfn + __fls(mask) + 1) {
 		if (!mask)
 			break;
 
@@ -962,7 +1418,7 @@ void kvm_tdp_mmu_clear_dirty_pt_masked(struct kvm *kvm,
 	struct kvm_mmu_page *root;
 	int root_as_id;
 
-	lockdep_assert_held(&kvm->mmu_lock);
+	lockdep_assert_held_write(&kvm->mmu_lock);
 	for_each_tdp_mmu_root(kvm, root) {
 		root_as_id = kvm_mmu_page_as_id(root);
 		if (root_as_id != slot->as_id)
@@ -1029,15 +1485,227 @@ bool kvm_tdp_mmu_slot_set_dirty(struct kvm *kvm, struct kvm_memory_slot *slot)
 	return spte_set;
 }
 
+/*
+ * Return the NUMA node of the memory mapped by @huge_spte, so that the page
+ * table splitting it can be allocated next to the memory it maps.
+ */
+static int tdp_mmu_split_nid(u64 huge_spte)
+{
+	kvm_pfn_t pfn = spte_to_pfn(huge_spte);
+
+	if (!pfn_valid(pfn))
+		return NUMA_NO_NODE;
+
+	return page_to_nid(pfn_to_page(pfn));
+}
+
+static struct kvm_mmu_page *__tdp_mmu_alloc_sp_for_split(int nid, gfp_t gfp)
+{
+	struct kvm_mmu_page *sp;
+	struct page *page;
+
+	sp = kmem_cache_zalloc(mmu_page_header_cache, gfp);
+	if (!sp)
+		return NULL;
+
+	page = alloc_pages_node(nid, gfp, 0);
+	if (!page) {
+		kmem_cache_free(mmu_page_header_cache, sp);
+		return NULL;
+	}
+
+	sp->spt = page_address(page);
+	return sp;
+}
+
+/*
+ * Replace the huge SPTE at iter with a pointer to a page table that maps the
+ * same memory with SPTEs of the next lower level.
+ */
+static void tdp_mmu_split_huge_page(struct kvm *kvm, struct tdp_iter *iter,
+				    struct kvm_mmu_page *sp)
+{
+	struct kvm_mmu_page *root = sptep_to_sp(tdp_iter_root_pt(iter));
+	int i;
+
+	set_page_private(virt_to_page(sp->spt), (unsigned long)sp);
+	sp->role = root->role;
+	sp->role.level = iter->level;
+	sp->gfn = iter->gfn;
+	sp->tdp_mmu_page = true;
+
+	/*
+	 * The new page table is not reachable yet, so it can be populated
+	 * without atomics or bookkeeping.
+	 */
+	for (i = 0; i < PT64_ENT_PER_PAGE; i++)
+		sp->spt[i] = make_huge_page_split_spte(iter->old_spte,
+						       iter->level, i);
+
+	tdp_mmu_link_page(kvm, sp, false, false);
+
+	/*
+	 * The translations don't change, so no TLB flush is needed when the
+	 * huge SPTE is replaced.  Accessed and dirty state are carried over
+	 * to the child SPTEs, so there is nothing to record either.
+	 */
+	__tdp_mmu_set_spte(kvm, iter, make_nonleaf_spte(sp->spt,
+				!shadow_accessed_mask), false, false);
+
+	trace_kvm_mmu_get_page(sp, true);
+}
+
+/*
+ * Split the huge SPTEs mapping GFNs [start, end) down to target_level.
+ * Returns -ENOMEM if a page table could not be allocated.
+ */
+static int split_huge_pages_range(struct kvm *kvm, struct kvm_mmu_page *root,
+				  gfn_t start, gfn_t end, int target_level)
+{
+	struct kvm_mmu_page *sp = NULL;
+	struct tdp_iter iter;
+	int ret = 0;
+	int nid;
+
+	/*
+	 * Newly created page tables are walked as well, so that huge pages
+	 * are split all the way down to target_level.
+	 */
+	for_each_tdp_pte_min_level(iter, root->spt, root->role.level,
+				   target_level + 1, start, end) {
+		if (!is_shadow_present_pte(iter.old_spte) ||
+		    !is_large_pte(iter.old_spte))
+			continue;
+
+		if (!sp) {
+			nid = tdp_mmu_split_nid(iter.old_spte);
+			sp = __tdp_mmu_alloc_sp_for_split(nid, GFP_NOWAIT |
+							  __GFP_ACCOUNT);
+			if (!sp) {
+				write_unlock(&kvm->mmu_lock);
+				sp = __tdp_mmu_alloc_sp_for_split(nid,
+							GFP_KERNEL_ACCOUNT);
+				write_lock(&kvm->mmu_lock);
+
+				if (!sp) {
+					ret = -ENOMEM;
+					break;
+				}
+
+				/*
+				 * The paging structure may have changed while
+				 * mmu_lock was dropped.
+				 */
+				tdp_iter_refresh_walk(&iter);
+				continue;
+			}
+		}
+
+		tdp_mmu_split_huge_page(kvm, &iter, sp);
+		sp = NULL;
+
+		tdp_mmu_iter_cond_resched(kvm, &iter);
+	}
+
+	if (sp)
+		tdp_mmu_free_sp(sp);
+
+	return ret;
+}
+
+/*
+ * Split the huge pages mapping GFNs in the memslot down to target_level, so
+ * that vCPUs don't have to split them in the page fault path once dirty
+ * logging write-protects the huge pages. The allocations can sleep, in which
+ * case mmu_lock is dropped. Returns -ENOMEM if not all huge pages could be
+ * split, the remaining ones are then split on demand in the page fault path.
+ */
+int kvm_tdp_mmu_try_split_huge_pages(struct kvm *kvm,
+				     const struct kvm_memory_slot *slot,
+				     int target_level)
+{
+	struct kvm_mmu_page *root;
+	int root_as_id;
+	int r = 0;
+
+	lockdep_assert_held_write(&kvm->mmu_lock);
+
+	for_each_tdp_mmu_root(kvm, root) {
+		root_as_id = kvm_mmu_page_as_id(root);
+		if (root_as_id != slot->as_id)
+			continue;
+
+		/*
+		 * Take a reference on the root so that it cannot be freed if
+		 * this thread releases the MMU lock and yields in this loop.
+		 */
+		kvm_mmu_get_root(kvm, root);
+
+		r = split_huge_pages_range(kvm, root, slot->base_gfn,
+					   slot->base_gfn + slot->npages,
+					   target_level);
+
+		kvm_mmu_put_root(kvm, root);
+
+		if (r)
+			break;
+	}
+
+	return r;
+}
+
+/*
+ * Returns a huge SPTE equivalent to the page table that @iter points to, or
+ * 0 if the leaf SPTEs in the page table do not map a contiguous range of
+ * pages with the same attributes.  The accessed and dirty bits of the huge
+ * SPTE are the union of those of the leaf SPTEs.
+ */
+static u64 tdp_mmu_collapsed_spte(struct tdp_iter *iter)
+{
+	u64 *pt = spte_to_child_pt(iter->old_spte, iter->level);
+	u64 ad_mask = shadow_accessed_mask | shadow_dirty_mask;
+	u64 attr_mask = ~(PT64_BASE_ADDR_MASK | ad_mask);
+	u64 child_pages = KVM_PAGES_PER_HPAGE(iter->level - 1);
+	u64 first, spte, huge_spte, ad = 0;
+	kvm_pfn_t pfn;
+	int i;
+
+	first = READ_ONCE(pt[0]);
+	pfn = spte_to_pfn(first);
+
+	for (i = 0; i < PT64_ENT_PER_PAGE; i++) {
+		spte = READ_ONCE(pt[i]);
+		if ((spte & attr_mask) != (first & attr_mask) ||
+		    spte_to_pfn(spte) != pfn + i * child_pages)
+			return 0;
+
+		ad |= spte & ad_mask;
+	}
+
+	huge_spte = (first & ~ad_mask) | ad | PT_PAGE_SIZE_MASK;
+
+	/*
+	 * As in make_spte(), huge pages are never executable with the NX huge
+	 * page mitigation; an instruction fetch splits the huge page again.
+	 */
+	if (is_nx_huge_page_enabled())
+		huge_spte = (huge_spte & ~shadow_x_mask) | shadow_nx_mask;
+
+	return huge_spte;
+}
+
 /*
  * Clear non-leaf entries (and free associated page tables) which could
  * be replaced by large mappings, for GFNs within the slot.
  */
 static void zap_collapsible_spte_range(struct kvm *kvm,
 				       struct kvm_mmu_page *root,
+				       struct kvm_memory_slot *slot,
 				       gfn_t start, gfn_t end)
 {
 	struct tdp_iter iter;
+	u64 *pt, leaf;
+	int leaf_level;
 	kvm_pfn_t pfn;
 	bool spte_set = false;
 
@@ -1046,12 +1714,46 @@ static void zap_collapsible_spte_range(struct kvm *kvm,
 		    is_last_spte(iter.old_spte, iter.level))
 			continue;
 
-		pfn = spte_to_pfn(iter.old_spte);
+		pt = spte_to_child_pt(iter.old_spte, iter.level);
+		if (sptep_to_sp(pt)->lpage_disallowed)
+			continue;
+
+		/*
+		 * Check the page that the first leaf SPTE under the page table
+		 * maps.  The walk is pre-order, so a page table that can be
+		 * replaced by e.g. a 1G mapping is handled before its 2M page
+		 * tables are looked at.
+		 */
+		leaf = iter.old_spte;
+		leaf_level = iter.level;
+		do {
+			leaf = READ_ONCE(spte_to_child_pt(leaf, leaf_level)[0]);
+			leaf_level--;
+		} while (is_shadow_present_pte(leaf) &&
+			 !is_last_spte(leaf, leaf_level));
+
+		if (!is_shadow_present_pte(leaf))
+			continue;
+
+		pfn = spte_to_pfn(leaf);
 		if (kvm_is_reserved_pfn(pfn) ||
-		    !PageTransCompoundMap(pfn_to_page(pfn)))
+		    kvm_mmu_max_mapping_level(kvm, slot, iter.gfn, pfn,
+					      iter.level) < iter.level)
 			continue;
 
-		tdp_mmu_set_spte(kvm, &iter, 0);
+		/*
+		 * Replace a page table of leaf SPTEs with a huge SPTE in place,
+		 * so that the guest does not have to fault the range back in.
+		 * Page tables of page tables, and page tables while an
+		 * invalidation is in progress and the host mapping may be about
+		 * to change, are zapped, and the guest refaults the range at
+		 * the largest level possible.
+		 */
+		if (leaf_level == iter.level - 1 && !kvm->mmu_notifier_count)
+			tdp_mmu_set_spte(kvm, &iter,
+					 tdp_mmu_collapsed_spte(&iter));
+		else
+			tdp_mmu_set_spte(kvm, &iter, 0);
 
 		spte_set = tdp_mmu_iter_flush_cond_resched(kvm, &iter);
 	}
@@ -1061,8 +1763,10 @@ static void zap_collapsible_spte_range(struct kvm *kvm,
 }
 
 /*
- * Clear non-leaf entries (and free associated page tables) which could
- * be replaced by large mappings, for GFNs within the slot.
+ * Replace non-leaf entries (and free associated page tables) with large
+ * mappings, for GFNs within the slot.  Sets of leaf entries that cannot be
+ * replaced in place, e.g. because they have different permissions, are
+ * zapped instead.
  */
 void kvm_tdp_mmu_zap_collapsible_sptes(struct kvm *kvm,
 				       const struct kvm_memory_slot *slot)
@@ -1081,7 +1785,10 @@ void kvm_tdp_mmu_zap_collapsible_sptes(struct kvm *kvm,
 		 */
 		kvm_mmu_get_root(kvm, root);
 
-		zap_collapsible_spte_range(kvm, root, slot->base_gfn,
+		/* FIXME: const-ify all uses of struct kvm_memory_slot.  */
+		zap_collapsible_spte_range(kvm, root,
+					   (struct kvm_memory_slot *)slot,
+					   slot->base_gfn,
 					   slot->base_gfn + slot->npages);
 
 		kvm_mmu_put_root(kvm, root);
@@ -1126,7 +1833,7 @@ bool kvm_tdp_mmu_write_protect_gfn(struct kvm *kvm,
 	int root_as_id;
 	bool spte_set = false;
 
-	lockdep_assert_held(&kvm->mmu_lock);
+	lockdep_assert_held_write(&kvm->mmu_lock);
 	for_each_tdp_mmu_root(kvm, root) {
 		root_as_id = kvm_mmu_page_as_id(root);
 		if (root_as_id != slot->as_id)
@@ -1148,10 +1855,15 @@ int kvm_tdp_mmu_get_walk(struct kvm_vcpu *vcpu, u64 addr, u64 *sptes)
 	int leaf = vcpu->arch.mmu->shadow_root_level;
 	gfn_t gfn = addr >> PAGE_SHIFT;
 
+	/* The walk runs without mmu_lock, page tables are freed via RCU. */
+	rcu_read_lock();
+
 	tdp_mmu_for_each_pte(iter, mmu, gfn, gfn + 1) {
 		leaf = iter.level;
 		sptes[leaf - 1] = iter.old_spte;
 	}
 
+	rcu_read_unlock();
+
 	return leaf;
 }
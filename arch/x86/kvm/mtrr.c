@@ -15,6 +15,7 @@
  */
 
 #include <linux/kvm_host.h>
+#include <linux/sort.h>
 #include <asm/mtrr.h>
 
 #include "cpuid.h"
@@ -341,6 +342,134 @@ static bool var_mtrr_range_is_valid(struct kvm_mtrr_range *range)
 	return (range->mask & (1 << 11)) != 0;
 }
 
+/*
+ * Memory type of [start, end) according to the variable MTRRs, or -1 if none
+ * of them covers it. The range must not cross the boundary of any MTRR.
+ */
+static int var_mtrr_type(struct kvm_mtrr *mtrr_state, u64 start, u64 end)
+{
+	const int wt_wb_mask = (1 << MTRR_TYPE_WRBACK)
+			       | (1 << MTRR_TYPE_WRTHROUGH);
+	struct kvm_mtrr_range *range;
+	u64 range_start, range_end;
+	int type = -1, curr_type;
+
+	list_for_each_entry(range, &mtrr_state->head, node) {
+		var_mtrr_range(range, &range_start, &range_end);
+		if (range_start >= end || range_end <= start)
+			continue;
+
+		curr_type = range->base & 0xff;
+
+		/*
+		 * Please refer to Intel SDM Volume 3: 11.11.4.1 MTRR
+		 * Precedences.
+		 */
+
+		if (type == -1) {
+			type = curr_type;
+			continue;
+		}
+
+		/*
+		 * If two or more variable memory ranges match and the
+		 * memory types are identical, then that memory type is
+		 * used.
+		 */
+		if (type == curr_type)
+			continue;
+
+		/*
+		 * If two or more variable memory ranges match and one of
+		 * the memory types is UC, the UC memory type used.
+		 */
+		if (curr_type == MTRR_TYPE_UNCACHABLE)
+			return MTRR_TYPE_UNCACHABLE;
+
+		/*
+		 * If two or more variable memory ranges match and the
+		 * memory types are WT and WB, the WT memory type is used.
+		 */
+		if (((1 << type) & wt_wb_mask) &&
+		      ((1 << curr_type) & wt_wb_mask)) {
+			type = MTRR_TYPE_WRTHROUGH;
+			continue;
+		}
+
+		/*
+		 * For overlaps not defined by the above rules, processor
+		 * behavior is undefined.
+		 */
+
+		/* We use WB for this undefined behavior. :( */
+		return MTRR_TYPE_WRBACK;
+	}
+
+	return type;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Rebuild var_map, so that looking up the memory type of a page doesn't
+ * have to walk and merge all the variable MTRRs.
+ */
+static void update_var_mtrr_map(struct kvm_mtrr *mtrr_state)
+{
+	u64 bounds[KVM_MTRR_VAR_MAP_SIZE];
+	struct kvm_mtrr_range *range;
+	u64 start, end;
+	int i, nr = 0, type;
+
+	list_for_each_entry(range, &mtrr_state->head, node) {
+		var_mtrr_range(range, &start, &end);
+		bounds[nr++] = start;
+		bounds[nr++] = end;
+	}
+	bounds[nr++] = ~0ULL;
+	sort(bounds, nr, sizeof(bounds[0]), cmp_u64, NULL);
+
+	mtrr_state->var_map.nr = 0;
+	for (i = 0, start = 0; i < nr; i++) {
+		if (bounds[i] == start)
+			continue;
+
+		type = var_mtrr_type(mtrr_state, start, bounds[i]);
+		if (mtrr_state->var_map.nr &&
+		    mtrr_state->var_map.type[mtrr_state->var_map.nr - 1] == type) {
+			mtrr_state->var_map.end[mtrr_state->var_map.nr - 1] =
+				bounds[i];
+		} else {
+			mtrr_state->var_map.end[mtrr_state->var_map.nr] =
+				bounds[i];
+			mtrr_state->var_map.type[mtrr_state->var_map.nr] = type;
+			mtrr_state->var_map.nr++;
+		}
+		start = bounds[i];
+	}
+}
+
+static int var_mtrr_map_lookup(struct kvm_mtrr *mtrr_state, u64 addr)
+{
+	int lo = 0, hi = mtrr_state->var_map.nr - 1, mid;
+
+	/* The last range ends at ~0ULL, so there is always a match. */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (addr < mtrr_state->var_map.end[mid])
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return mtrr_state->var_map.type[lo];
+}
+
 static void set_var_mtrr_msr(struct kvm_vcpu *vcpu, u32 msr, u64 data)
 {
 	struct kvm_mtrr *mtrr_state = &vcpu->arch.mtrr_state;
@@ -371,6 +500,8 @@ static void set_var_mtrr_msr(struct kvm_vcpu *vcpu, u32 msr, u64 data)
 				break;
 		list_add_tail(&cur->node, &tmp->node);
 	}
+
+	update_var_mtrr_map(mtrr_state);
 }
 
 int kvm_mtrr_set_msr(struct kvm_vcpu *vcpu, u32 msr, u64 data)
@@ -439,6 +570,7 @@ int kvm_mtrr_get_msr(struct kvm_vcpu *vcpu, u32 msr, u64 *pdata)
 void kvm_vcpu_mtrr_init(struct kvm_vcpu *vcpu)
 {
 	INIT_LIST_HEAD(&vcpu->arch.mtrr_state.head);
+	update_var_mtrr_map(&vcpu->arch.mtrr_state);
 }
 
 struct mtrr_iter {
@@ -619,75 +751,30 @@ static void mtrr_lookup_next(struct mtrr_iter *iter)
 u8 kvm_mtrr_get_guest_memory_type(struct kvm_vcpu *vcpu, gfn_t gfn)
 {
 	struct kvm_mtrr *mtrr_state = &vcpu->arch.mtrr_state;
-	struct mtrr_iter iter;
-	u64 start, end;
-	int type = -1;
-	const int wt_wb_mask = (1 << MTRR_TYPE_WRBACK)
-			       | (1 << MTRR_TYPE_WRTHROUGH);
-
-	start = gfn_to_gpa(gfn);
-	end = start + PAGE_SIZE;
+	u64 addr = gfn_to_gpa(gfn);
+	int seg, type;
 
-	mtrr_for_each_mem_type(&iter, mtrr_state, start, end) {
-		int curr_type = iter.mem_type;
-
-		/*
-		 * Please refer to Intel SDM Volume 3: 11.11.4.1 MTRR
-		 * Precedences.
-		 */
-
-		if (type == -1) {
-			type = curr_type;
-			continue;
-		}
-
-		/*
-		 * If two or more variable memory ranges match and the
-		 * memory types are identical, then that memory type is
-		 * used.
-		 */
-		if (type == curr_type)
-			continue;
-
-		/*
-		 * If two or more variable memory ranges match and one of
-		 * the memory types is UC, the UC memory type used.
-		 */
-		if (curr_type == MTRR_TYPE_UNCACHABLE)
-			return MTRR_TYPE_UNCACHABLE;
-
-		/*
-		 * If two or more variable memory ranges match and the
-		 * memory types are WT and WB, the WT memory type is used.
-		 */
-		if (((1 << type) & wt_wb_mask) &&
-		      ((1 << curr_type) & wt_wb_mask)) {
-			type = MTRR_TYPE_WRTHROUGH;
-			continue;
-		}
-
-		/*
-		 * For overlaps not defined by the above rules, processor
-		 * behavior is undefined.
-		 */
+	if (!mtrr_is_enabled(mtrr_state))
+		return mtrr_disabled_type(vcpu);
 
-		/* We use WB for this undefined behavior. :( */
-		return MTRR_TYPE_WRBACK;
+	/* The fixed MTRRs take precedence, and a page is in a single range. */
+	if (fixed_mtrr_is_enabled(mtrr_state)) {
+		seg = fixed_mtrr_addr_to_seg(addr);
+		if (seg >= 0)
+			return mtrr_state->fixed_ranges[
+				fixed_mtrr_addr_seg_to_range_index(addr, seg)];
 	}
 
-	if (iter.mtrr_disabled)
-		return mtrr_disabled_type(vcpu);
+	/*
+	 * The variable MTRRs are page aligned, so the page is in a single
+	 * range of the map.
+	 */
+	type = var_mtrr_map_lookup(mtrr_state, addr);
 
 	/* not contained in any MTRRs. */
 	if (type == -1)
 		return mtrr_default_type(mtrr_state);
 
-	/*
-	 * We just check one page, partially covered by MTRRs is
-	 * impossible.
-	 */
-	WARN_ON(iter.partial_map);
-
 	return type;
 }
 EXPORT_SYMBOL_GPL(kvm_mtrr_get_guest_memory_type);
@@ -55,6 +55,22 @@ static void kvm_pmi_trigger_fn(struct irq_work *irq_work)
 	kvm_pmu_deliver_pmi(vcpu);
 }
 
+/*
+ * The overflow of a guest PEBS counter means that the guest's PEBS buffer
+ * reached its threshold, which the guest sees as a buffer overflow.
+ */
+static inline void kvm_pmc_set_overflow(struct kvm_pmc *pmc,
+					struct perf_event *perf_event)
+{
+	struct kvm_pmu *pmu = pmc_to_pmu(pmc);
+
+	if (perf_event->attr.precise_ip)
+		__set_bit(GLOBAL_STATUS_BUFFER_OVF_BIT,
+			  (unsigned long *)&pmu->global_status);
+	else
+		__set_bit(pmc->idx, (unsigned long *)&pmu->global_status);
+}
+
 static void kvm_perf_overflow(struct perf_event *perf_event,
 			      struct perf_sample_data *data,
 			      struct pt_regs *regs)
@@ -63,7 +79,7 @@ static void kvm_perf_overflow(struct perf_event *perf_event,
 	struct kvm_pmu *pmu = pmc_to_pmu(pmc);
 
 	if (!test_and_set_bit(pmc->idx, pmu->reprogram_pmi)) {
-		__set_bit(pmc->idx, (unsigned long *)&pmu->global_status);
+		kvm_pmc_set_overflow(pmc, perf_event);
 		kvm_make_request(KVM_REQ_PMU, pmc->vcpu);
 	}
 }
@@ -76,7 +92,7 @@ static void kvm_perf_overflow_intr(struct perf_event *perf_event,
 	struct kvm_pmu *pmu = pmc_to_pmu(pmc);
 
 	if (!test_and_set_bit(pmc->idx, pmu->reprogram_pmi)) {
-		__set_bit(pmc->idx, (unsigned long *)&pmu->global_status);
+		kvm_pmc_set_overflow(pmc, perf_event);
 		kvm_make_request(KVM_REQ_PMU, pmc->vcpu);
 
 		/*
@@ -99,6 +115,7 @@ static void pmc_reprogram_counter(struct kvm_pmc *pmc, u32 type,
 				  bool exclude_kernel, bool intr,
 				  bool in_tx, bool in_tx_cp)
 {
+	struct kvm_pmu *pmu = pmc_to_pmu(pmc);
 	struct perf_event *event;
 	struct perf_event_attr attr = {
 		.type = type,
@@ -110,9 +127,22 @@ static void pmc_reprogram_counter(struct kvm_pmc *pmc, u32 type,
 		.exclude_kernel = exclude_kernel,
 		.config = config,
 	};
+	bool pebs = test_bit(pmc->idx, (unsigned long *)&pmu->pebs_enable);
 
 	attr.sample_period = get_sample_period(pmc, pmc->counter);
 
+	if (pebs) {
+		/*
+		 * A precise event makes perf enable PEBS on the counter, and
+		 * its records go to the guest's DS area.  The fixed counter 0
+		 * of Ice Lake, which has precise distribution, is only given
+		 * to the highest precision level.
+		 */
+		attr.precise_ip = 1;
+		if (pmc->idx == INTEL_PMC_IDX_FIXED)
+			attr.precise_ip = 3;
+	}
+
 	if (in_tx)
 		attr.config |= HSW_IN_TX;
 	if (in_tx_cp) {
@@ -156,6 +186,11 @@ static bool pmc_resume_counter(struct kvm_pmc *pmc)
 	if (!pmc->perf_event)
 		return false;
 
+	/* A change of the PEBS enable bit needs a new perf_event. */
+	if (!pmc->perf_event->attr.precise_ip !=
+	    !test_bit(pmc->idx, (unsigned long *)&pmc_to_pmu(pmc)->pebs_enable))
+		return false;
+
 	/* recalibrate sample period and check if it's accepted by perf core */
 	if (perf_event_period(pmc->perf_event,
 			      get_sample_period(pmc, pmc->counter)))
@@ -276,7 +311,8 @@ void reprogram_counter(struct kvm_pmu *pmu, int pmc_idx)
 {
 	struct kvm_pmc *pmc = kvm_x86_ops.pmu_ops->pmc_idx_to_pmc(pmu, pmc_idx);
 
-	if (!pmc)
+	/* Pass-through counters are loaded as is by the vendor code. */
+	if (!pmc || pmu->passthrough)
 		return;
 
 	if (pmc_is_gp(pmc))
@@ -290,11 +326,32 @@ void reprogram_counter(struct kvm_pmu *pmu, int pmc_idx)
 }
 EXPORT_SYMBOL_GPL(reprogram_counter);
 
+/* Go back to perf_events, whose configuration the event filter can check. */
+static void kvm_pmu_stop_passthrough(struct kvm_vcpu *vcpu)
+{
+	struct kvm_pmu *pmu = vcpu_to_pmu(vcpu);
+
+	pmu->passthrough = false;
+	perf_guest_release_pmu();
+	kvm_x86_ops.msr_filter_changed(vcpu);
+	bitmap_copy(pmu->reprogram_deferred, pmu->all_valid_pmc_idx,
+		    X86_PMC_IDX_MAX);
+}
+
 void kvm_pmu_handle_event(struct kvm_vcpu *vcpu)
 {
 	struct kvm_pmu *pmu = vcpu_to_pmu(vcpu);
 	int bit;
 
+	if (unlikely(pmu->passthrough) &&
+	    rcu_access_pointer(vcpu->kvm->arch.pmu_event_filter))
+		kvm_pmu_stop_passthrough(vcpu);
+
+	for_each_set_bit(bit, pmu->reprogram_deferred, X86_PMC_IDX_MAX) {
+		__clear_bit(bit, pmu->reprogram_deferred);
+		reprogram_counter(pmu, bit);
+	}
+
 	for_each_set_bit(bit, pmu->reprogram_pmi, X86_PMC_IDX_MAX) {
 		struct kvm_pmc *pmc = kvm_x86_ops.pmu_ops->pmc_idx_to_pmc(pmu, bit);
 
@@ -478,6 +535,12 @@ void kvm_pmu_cleanup(struct kvm_vcpu *vcpu)
 
 void kvm_pmu_destroy(struct kvm_vcpu *vcpu)
 {
+	struct kvm_pmu *pmu = vcpu_to_pmu(vcpu);
+
+	if (pmu->passthrough) {
+		pmu->passthrough = false;
+		perf_guest_release_pmu();
+	}
 	kvm_pmu_reset(vcpu);
 }
 
@@ -518,6 +581,9 @@ int kvm_vm_ioctl_set_pmu_event_filter(struct kvm *kvm, void __user *argp)
 	mutex_unlock(&kvm->lock);
 
 	synchronize_srcu_expedited(&kvm->srcu);
+
+	/* Pass-through counters can't be filtered, see kvm_pmu_handle_event(). */
+	kvm_make_all_cpus_request(kvm, KVM_REQ_PMU);
 	r = 0;
 cleanup:
 	kfree(filter);
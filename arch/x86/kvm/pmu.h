@@ -140,6 +140,17 @@ static inline u64 get_sample_period(struct kvm_pmc *pmc, u64 counter_value)
 	return sample_period;
 }
 
+/*
+ * Reprogram the counter on the next VM-entry.  The perf_event only counts
+ * while the guest runs, so nothing is lost by waiting, and a guest that writes
+ * several PMU MSRs in a row gets its counter created or resumed only once.
+ */
+static inline void kvm_pmu_request_counter_reprogram(struct kvm_pmc *pmc)
+{
+	__set_bit(pmc->idx, pmc_to_pmu(pmc)->reprogram_deferred);
+	kvm_make_request(KVM_REQ_PMU, pmc->vcpu);
+}
+
 void reprogram_gp_counter(struct kvm_pmc *pmc, u64 eventsel);
 void reprogram_fixed_counter(struct kvm_pmc *pmc, u8 ctrl, int fixed_idx);
 void reprogram_counter(struct kvm_pmu *pmu, int pmc_idx);
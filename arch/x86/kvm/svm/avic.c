@@ -23,6 +23,7 @@
 
 #include "trace.h"
 #include "lapic.h"
+#include "mmu.h"
 #include "x86.h"
 #include "irq.h"
 #include "svm.h"
@@ -39,19 +40,21 @@ module_param(avic, int, S_IRUGO);
 
 /*
  * 0xff is broadcast, so the max index allowed for physical APIC ID
- * table is 0xfe.  APIC IDs above 0xff are reserved.
+ * table is 0xfe.  APIC IDs above 0xff are reserved.  With x2AVIC the
+ * table is indexed by the x2APIC ID and spans the whole 4KB page.
  */
-#define AVIC_MAX_PHYSICAL_ID_COUNT	255
+#define AVIC_MAX_PHYSICAL_ID		0xFEUL
+#define X2AVIC_MAX_PHYSICAL_ID		0x1FFUL
 
 #define AVIC_UNACCEL_ACCESS_WRITE_MASK		1
 #define AVIC_UNACCEL_ACCESS_OFFSET_MASK		0xFF0
 #define AVIC_UNACCEL_ACCESS_VECTOR_MASK		0xFFFFFFFF
 
 /* AVIC GATAG is encoded using VM and VCPU IDs */
-#define AVIC_VCPU_ID_BITS		8
+#define AVIC_VCPU_ID_BITS		9
 #define AVIC_VCPU_ID_MASK		((1 << AVIC_VCPU_ID_BITS) - 1)
 
-#define AVIC_VM_ID_BITS			24
+#define AVIC_VM_ID_BITS			23
 #define AVIC_VM_ID_NR			(1 << AVIC_VM_ID_BITS)
 #define AVIC_VM_ID_MASK			((1 << AVIC_VM_ID_BITS) - 1)
 
@@ -71,6 +74,9 @@ static u32 next_vm_id = 0;
 static bool next_vm_id_wrapped = 0;
 static DEFINE_SPINLOCK(svm_vm_data_hash_lock);
 
+static bool x2avic_enabled;
+static u64 avic_host_physical_id_mask = AVIC_PHYSICAL_ID_ENTRY_HOST_PHYSICAL_ID_MASK;
+
 /*
  * This is a wrapper of struct amd_iommu_ir_data.
  */
@@ -90,6 +96,15 @@ enum avic_ipi_failure_cause {
  * This function is called from IOMMU driver to notify
  * SVM to schedule in a particular vCPU of a particular VM.
  */
+void avic_hardware_setup(void)
+{
+	x2avic_enabled = boot_cpu_has(X86_FEATURE_X2AVIC);
+	if (x2avic_enabled) {
+		avic_host_physical_id_mask = X2AVIC_PHYSICAL_ID_ENTRY_HOST_PHYSICAL_ID_MASK;
+		pr_info("x2AVIC enabled\n");
+	}
+}
+
 int avic_ga_log_notifier(u32 ga_tag)
 {
 	unsigned long flags;
@@ -191,6 +206,35 @@ int avic_vm_init(struct kvm *kvm)
 	return err;
 }
 
+static inline unsigned long avic_max_physical_id(void)
+{
+	return x2avic_enabled ? X2AVIC_MAX_PHYSICAL_ID : AVIC_MAX_PHYSICAL_ID;
+}
+
+/*
+ * Switch the VMCB between xAPIC and x2APIC virtualization.  Without x2AVIC
+ * an x2APIC guest keeps AVIC enabled for interrupt delivery, but its APIC
+ * MSR accesses are intercepted and emulated by KVM (hybrid mode).
+ */
+static void avic_update_vapic_mode(struct vcpu_svm *svm, bool activated)
+{
+	struct vmcb *vmcb = svm->vmcb;
+	bool x2avic = activated && x2avic_enabled &&
+		      apic_x2apic_mode(svm->vcpu.arch.apic);
+
+	vmcb->control.avic_physical_id &= ~AVIC_PHYSICAL_MAX_INDEX_MASK;
+	if (x2avic) {
+		vmcb->control.int_ctl |= X2APIC_MODE_MASK;
+		vmcb->control.avic_physical_id |= X2AVIC_MAX_PHYSICAL_ID;
+	} else {
+		vmcb->control.int_ctl &= ~X2APIC_MODE_MASK;
+		vmcb->control.avic_physical_id |= AVIC_MAX_PHYSICAL_ID;
+	}
+
+	svm_set_x2apic_msr_interception(svm, !x2avic);
+	vmcb_mark_dirty(vmcb, VMCB_AVIC);
+}
+
 void avic_init_vmcb(struct vcpu_svm *svm)
 {
 	struct vmcb *vmcb = svm->vmcb;
@@ -202,11 +246,11 @@ void avic_init_vmcb(struct vcpu_svm *svm)
 	vmcb->control.avic_backing_page = bpa & AVIC_HPA_MASK;
 	vmcb->control.avic_logical_id = lpa & AVIC_HPA_MASK;
 	vmcb->control.avic_physical_id = ppa & AVIC_HPA_MASK;
-	vmcb->control.avic_physical_id |= AVIC_MAX_PHYSICAL_ID_COUNT;
 	if (kvm_apicv_activated(svm->vcpu.kvm))
 		vmcb->control.int_ctl |= AVIC_ENABLE_MASK;
 	else
 		vmcb->control.int_ctl &= ~AVIC_ENABLE_MASK;
+	avic_update_vapic_mode(svm, kvm_apicv_activated(svm->vcpu.kvm));
 }
 
 static u64 *avic_get_physical_id_entry(struct kvm_vcpu *vcpu,
@@ -215,7 +259,7 @@ static u64 *avic_get_physical_id_entry(struct kvm_vcpu *vcpu,
 	u64 *avic_physical_id_table;
 	struct kvm_svm *kvm_svm = to_kvm_svm(vcpu->kvm);
 
-	if (index >= AVIC_MAX_PHYSICAL_ID_COUNT)
+	if (index > avic_max_physical_id())
 		return NULL;
 
 	avic_physical_id_table = page_address(kvm_svm->avic_physical_id_table_page);
@@ -264,12 +308,21 @@ static int avic_init_backing_page(struct kvm_vcpu *vcpu)
 	int id = vcpu->vcpu_id;
 	struct vcpu_svm *svm = to_svm(vcpu);
 
-	if (id >= AVIC_MAX_PHYSICAL_ID_COUNT)
-		return -EINVAL;
-
 	if (!svm->vcpu.arch.apic->regs)
 		return -EINVAL;
 
+	/*
+	 * The vCPU cannot be described in the physical APIC ID table, so
+	 * APICv is inhibited for the whole VM rather than refusing to create
+	 * the vCPU.
+	 */
+	if (id > avic_max_physical_id()) {
+		kvm_request_apicv_update(vcpu->kvm, false,
+					 APICV_INHIBIT_REASON_PHYSICAL_ID_TOO_BIG);
+		vcpu->arch.apicv_active = false;
+		return 0;
+	}
+
 	if (kvm_apicv_activated(vcpu->kvm)) {
 		int ret;
 
@@ -332,11 +385,13 @@ int avic_incomplete_ipi_interception(struct vcpu_svm *svm)
 		 * set the appropriate IRR bits on the valid target
 		 * vcpus. So, we just need to kick the appropriate vcpu.
 		 */
+		u32 dest = apic_x2apic_mode(apic) ? icrh :
+						    GET_APIC_DEST_FIELD(icrh);
+
 		kvm_for_each_vcpu(i, vcpu, kvm) {
 			bool m = kvm_apic_match_dest(vcpu, apic,
 						     icrl & APIC_SHORT_MASK,
-						     GET_APIC_DEST_FIELD(icrh),
-						     icrl & APIC_DEST_MASK);
+						     dest, icrl & APIC_DEST_MASK);
 
 			if (m && !avic_vcpu_is_running(vcpu))
 				kvm_vcpu_wake_up(vcpu);
@@ -422,6 +477,10 @@ static int avic_handle_ldr_update(struct kvm_vcpu *vcpu)
 	u32 ldr = kvm_lapic_get_reg(vcpu->arch.apic, APIC_LDR);
 	u32 id = kvm_xapic_id(vcpu->arch.apic);
 
+	/* The logical APIC ID table only describes xAPIC destinations. */
+	if (apic_x2apic_mode(vcpu->arch.apic))
+		return 0;
+
 	if (ldr == svm->ldr_reg)
 		return 0;
 
@@ -440,16 +499,25 @@ static int avic_handle_apic_id_update(struct kvm_vcpu *vcpu)
 {
 	u64 *old, *new;
 	struct vcpu_svm *svm = to_svm(vcpu);
-	u32 id = kvm_xapic_id(vcpu->arch.apic);
+	u32 id;
 
-	if (vcpu->vcpu_id == id)
-		return 0;
+	/* The x2APIC ID is read-only and always matches the vCPU ID. */
+	if (apic_x2apic_mode(vcpu->arch.apic))
+		id = vcpu->vcpu_id;
+	else
+		id = kvm_xapic_id(vcpu->arch.apic);
 
-	old = avic_get_physical_id_entry(vcpu, vcpu->vcpu_id);
-	new = avic_get_physical_id_entry(vcpu, id);
+	old = svm->avic_physical_id_cache;
+	if (!apic_x2apic_mode(vcpu->arch.apic) && id > AVIC_MAX_PHYSICAL_ID)
+		new = NULL;
+	else
+		new = avic_get_physical_id_entry(vcpu, id);
 	if (!new || !old)
 		return 1;
 
+	if (new == old)
+		return 0;
+
 	/* We need to move physical_id_entry to new offset */
 	*new = *old;
 	*old = 0ULL;
@@ -598,7 +666,30 @@ void svm_toggle_avic_for_irq_window(struct kvm_vcpu *vcpu, bool activate)
 
 void svm_set_virtual_apic_mode(struct kvm_vcpu *vcpu)
 {
-	return;
+	struct vcpu_svm *svm = to_svm(vcpu);
+
+	if (!avic || !lapic_in_kernel(vcpu) || !kvm_vcpu_apicv_active(vcpu))
+		return;
+
+	/*
+	 * Entering x2APIC mode resets the APIC ID to the vCPU ID and leaves
+	 * the logical APIC ID table unused, so drop the xAPIC entry.
+	 *
+	 * The xAPIC MMIO page must not stay accelerated either, or the guest
+	 * could keep driving the APIC through it in hybrid mode.  Zap its NPT
+	 * entry; the MMU won't map it again for vCPUs in x2APIC mode.  The
+	 * NPT is shared, so a VM that mixes xAPIC and x2APIC vCPUs faults the
+	 * page back in for the xAPIC ones.
+	 */
+	if (apic_x2apic_mode(vcpu->arch.apic)) {
+		avic_invalidate_logical_id_entry(vcpu);
+		svm->ldr_reg = 0;
+		kvm_zap_gfn_range(vcpu->kvm,
+				  gpa_to_gfn(APIC_DEFAULT_PHYS_BASE),
+				  gpa_to_gfn(APIC_DEFAULT_PHYS_BASE) + 1);
+	}
+	avic_handle_apic_id_update(vcpu);
+	avic_update_vapic_mode(svm, true);
 }
 
 void svm_hwapic_irr_update(struct kvm_vcpu *vcpu, int max_irr)
@@ -663,7 +754,7 @@ void svm_refresh_apicv_exec_ctrl(struct kvm_vcpu *vcpu)
 	} else {
 		vmcb->control.int_ctl &= ~AVIC_ENABLE_MASK;
 	}
-	vmcb_mark_dirty(vmcb, VMCB_AVIC);
+	avic_update_vapic_mode(svm, activated);
 
 	svm_set_pi_irte_mode(vcpu, activated);
 }
@@ -911,7 +1002,8 @@ bool svm_check_apicv_inhibit_reasons(ulong bit)
 			  BIT(APICV_INHIBIT_REASON_NESTED) |
 			  BIT(APICV_INHIBIT_REASON_IRQWIN) |
 			  BIT(APICV_INHIBIT_REASON_PIT_REINJ) |
-			  BIT(APICV_INHIBIT_REASON_X2APIC);
+			  BIT(APICV_INHIBIT_REASON_X2APIC) |
+			  BIT(APICV_INHIBIT_REASON_PHYSICAL_ID_TOO_BIG);
 
 	return supported & BIT(bit);
 }
@@ -962,17 +1054,17 @@ void avic_vcpu_load(struct kvm_vcpu *vcpu, int cpu)
 		return;
 
 	/*
-	 * Since the host physical APIC id is 8 bits,
-	 * we can support host APIC ID upto 255.
+	 * The host physical APIC id is 8 bits, or 12 bits with x2AVIC,
+	 * which supports host APIC IDs up to 4095.
 	 */
-	if (WARN_ON(h_physical_id > AVIC_PHYSICAL_ID_ENTRY_HOST_PHYSICAL_ID_MASK))
+	if (WARN_ON(h_physical_id & ~avic_host_physical_id_mask))
 		return;
 
 	entry = READ_ONCE(*(svm->avic_physical_id_cache));
 	WARN_ON(entry & AVIC_PHYSICAL_ID_ENTRY_IS_RUNNING_MASK);
 
-	entry &= ~AVIC_PHYSICAL_ID_ENTRY_HOST_PHYSICAL_ID_MASK;
-	entry |= (h_physical_id & AVIC_PHYSICAL_ID_ENTRY_HOST_PHYSICAL_ID_MASK);
+	entry &= ~avic_host_physical_id_mask;
+	entry |= h_physical_id;
 
 	entry &= ~AVIC_PHYSICAL_ID_ENTRY_IS_RUNNING_MASK;
 	if (svm->avic_is_running)
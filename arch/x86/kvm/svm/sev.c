@@ -14,6 +14,8 @@
 #include <linux/psp-sev.h>
 #include <linux/pagemap.h>
 #include <linux/swap.h>
+#include <linux/sizes.h>
+#include <linux/xarray.h>
 
 #include "x86.h"
 #include "svm.h"
@@ -25,14 +27,43 @@ unsigned int max_sev_asid;
 static unsigned int min_sev_asid;
 static unsigned long *sev_asid_bitmap;
 static unsigned long *sev_reclaim_asid_bitmap;
+static unsigned long *sev_flush_asid_bitmap;
+static unsigned int nr_reclaim_asids;
+
+/*
+ * Serializes DF_FLUSH based recycling of the ASIDs in sev_reclaim_asid_bitmap.
+ * Taken outside of sev_bitmap_lock, which is not held across the flush so
+ * that ASIDs can still be allocated and freed while the flush runs.
+ */
+static DEFINE_MUTEX(sev_recycle_lock);
+
+/*
+ * Recycle freed ASIDs from a work item once fewer than this many ASIDs are
+ * free, so that a new guest rarely has to wait for WBINVD and DF_FLUSH.
+ * '0' recycles only on demand, when no free ASID is left.
+ */
+static unsigned int sev_asid_reserve = 8;
+module_param(sev_asid_reserve, uint, 0644);
+
+static void sev_reclaim_asids_work_fn(struct work_struct *work);
+static DECLARE_WORK(sev_reclaim_asids_work, sev_reclaim_asids_work_fn);
 #define __sme_page_pa(x) __sme_set(page_to_pfn(x) << PAGE_SHIFT)
 
+/* Keep the length of a single PSP command well within its u32 field. */
+#define SEV_MAX_CONTIG_PAGES	(SZ_2G >> PAGE_SHIFT)
+
+/*
+ * The pages of a registered region are pinned when they are first faulted in
+ * by the guest or encrypted by LAUNCH_UPDATE_DATA, and stay pinned until the
+ * region is unregistered.
+ */
 struct enc_region {
 	struct list_head list;
-	unsigned long npages;
-	struct page **pages;
+	unsigned long npages;	/* Number of pinned pages */
+	struct xarray pages;	/* Pinned pages, indexed by page offset */
 	unsigned long uaddr;
 	unsigned long size;
+	struct rcu_head rcu;
 };
 
 static int sev_flush_asids(void)
@@ -56,25 +87,69 @@ static int sev_flush_asids(void)
 	return ret;
 }
 
-/* Must be called with the sev_bitmap_lock held */
-static bool __sev_recycle_asids(void)
+/*
+ * Flush all ASIDs freed so far and make them available again.  Returns true
+ * if ASIDs may have become available, i.e. also if a concurrent caller
+ * recycled them while waiting for sev_recycle_lock.
+ */
+static bool sev_recycle_asids(void)
 {
-	int pos;
+	bool ret = true;
 
-	/* Check if there are any ASIDs to reclaim before performing a flush */
-	pos = find_next_bit(sev_reclaim_asid_bitmap,
-			    max_sev_asid, min_sev_asid - 1);
-	if (pos >= max_sev_asid)
-		return false;
+	mutex_lock(&sev_recycle_lock);
 
-	if (sev_flush_asids())
-		return false;
-
-	bitmap_xor(sev_asid_bitmap, sev_asid_bitmap, sev_reclaim_asid_bitmap,
-		   max_sev_asid);
+	mutex_lock(&sev_bitmap_lock);
+	if (!nr_reclaim_asids) {
+		mutex_unlock(&sev_bitmap_lock);
+		goto out;
+	}
+	bitmap_copy(sev_flush_asid_bitmap, sev_reclaim_asid_bitmap,
+		    max_sev_asid);
 	bitmap_zero(sev_reclaim_asid_bitmap, max_sev_asid);
+	nr_reclaim_asids = 0;
+	mutex_unlock(&sev_bitmap_lock);
+
+	/*
+	 * ASIDs freed from now on are left for the next flush, DF_FLUSH only
+	 * covers the ASIDs that were deactivated before it is issued.
+	 */
+	if (sev_flush_asids()) {
+		mutex_lock(&sev_bitmap_lock);
+		bitmap_or(sev_reclaim_asid_bitmap, sev_reclaim_asid_bitmap,
+			  sev_flush_asid_bitmap, max_sev_asid);
+		nr_reclaim_asids = bitmap_weight(sev_reclaim_asid_bitmap,
+						 max_sev_asid);
+		mutex_unlock(&sev_bitmap_lock);
+		ret = false;
+		goto out;
+	}
+
+	mutex_lock(&sev_bitmap_lock);
+	bitmap_andnot(sev_asid_bitmap, sev_asid_bitmap, sev_flush_asid_bitmap,
+		      max_sev_asid);
+	mutex_unlock(&sev_bitmap_lock);
+out:
+	mutex_unlock(&sev_recycle_lock);
+	return ret;
+}
+
+static void sev_reclaim_asids_work_fn(struct work_struct *work)
+{
+	sev_recycle_asids();
+}
+
+/* Must be called with the sev_bitmap_lock held */
+static void sev_check_asid_reserve(void)
+{
+	unsigned int nr_free;
 
-	return true;
+	if (!nr_reclaim_asids)
+		return;
+
+	nr_free = max_sev_asid - min_sev_asid + 1 -
+		  bitmap_weight(sev_asid_bitmap, max_sev_asid);
+	if (nr_free < READ_ONCE(sev_asid_reserve))
+		queue_work(system_unbound_wq, &sev_reclaim_asids_work);
 }
 
 static int sev_asid_new(void)
@@ -82,23 +157,24 @@ static int sev_asid_new(void)
 	bool retry = true;
 	int pos;
 
-	mutex_lock(&sev_bitmap_lock);
-
 	/*
 	 * SEV-enabled guest must use asid from min_sev_asid to max_sev_asid.
 	 */
 again:
+	mutex_lock(&sev_bitmap_lock);
+
 	pos = find_next_zero_bit(sev_asid_bitmap, max_sev_asid, min_sev_asid - 1);
 	if (pos >= max_sev_asid) {
-		if (retry && __sev_recycle_asids()) {
+		mutex_unlock(&sev_bitmap_lock);
+		if (retry && sev_recycle_asids()) {
 			retry = false;
 			goto again;
 		}
-		mutex_unlock(&sev_bitmap_lock);
 		return -EBUSY;
 	}
 
 	__set_bit(pos, sev_asid_bitmap);
+	sev_check_asid_reserve();
 
 	mutex_unlock(&sev_bitmap_lock);
 
@@ -121,12 +197,15 @@ static void sev_asid_free(int asid)
 
 	pos = asid - 1;
 	__set_bit(pos, sev_reclaim_asid_bitmap);
+	nr_reclaim_asids++;
 
 	for_each_possible_cpu(cpu) {
 		sd = per_cpu(svm_data, cpu);
 		sd->sev_vmcbs[pos] = NULL;
 	}
 
+	sev_check_asid_reserve();
+
 	mutex_unlock(&sev_bitmap_lock);
 }
 
@@ -183,6 +262,10 @@ static int sev_guest_init(struct kvm *kvm, struct kvm_sev_cmd *argp)
 	sev->active = true;
 	sev->asid = asid;
 	INIT_LIST_HEAD(&sev->regions_list);
+	mutex_init(&sev->regions_lock);
+
+	/* Only sev_pin_guest_page() pins pages, on faults. */
+	kvm->arch.mmu_no_prefetch = true;
 
 	return 0;
 
@@ -357,7 +440,9 @@ static struct page **sev_pin_memory(struct kvm *kvm, unsigned long uaddr,
 	}
 
 	*n = npages;
-	sev->pages_locked = locked;
+	mutex_lock(&sev->regions_lock);
+	sev->pages_locked += npages;
+	mutex_unlock(&sev->regions_lock);
 
 	return pages;
 
@@ -376,7 +461,9 @@ static void sev_unpin_memory(struct kvm *kvm, struct page **pages,
 
 	unpin_user_pages(pages, npages);
 	kvfree(pages);
+	mutex_lock(&sev->regions_lock);
 	sev->pages_locked -= npages;
+	mutex_unlock(&sev->regions_lock);
 }
 
 static void sev_clflush_pages(struct page *pages[], unsigned long npages)
@@ -398,24 +485,216 @@ static void sev_clflush_pages(struct page *pages[], unsigned long npages)
 static unsigned long get_num_contig_pages(unsigned long idx,
 				struct page **inpages, unsigned long npages)
 {
-	unsigned long paddr, next_paddr;
-	unsigned long i = idx + 1, pages = 1;
-
-	/* find the number of contiguous pages starting from idx */
-	paddr = __sme_page_pa(inpages[idx]);
-	while (i < npages) {
-		next_paddr = __sme_page_pa(inpages[i++]);
-		if ((paddr + PAGE_SIZE) == next_paddr) {
-			pages++;
-			paddr = next_paddr;
+	unsigned long pfn, i = idx + 1, pages = 1;
+
+	npages = min(npages, idx + SEV_MAX_CONTIG_PAGES);
+
+	/*
+	 * find the number of contiguous pages starting from idx, which may
+	 * span several huge pages
+	 */
+	pfn = page_to_pfn(inpages[idx]);
+	while (i < npages && page_to_pfn(inpages[i]) == pfn + pages) {
+		i++;
+		pages++;
+	}
+
+	return pages;
+}
+
+/* Find a registered region that covers [uaddr, uaddr + ulen). */
+static struct enc_region *sev_find_covering_region(struct kvm *kvm,
+						   unsigned long uaddr,
+						   unsigned long ulen)
+{
+	struct kvm_sev_info *sev = &to_kvm_svm(kvm)->sev_info;
+	struct enc_region *region;
+
+	lockdep_assert_held(&sev->regions_lock);
+
+	list_for_each_entry(region, &sev->regions_list, list) {
+		if (uaddr >= region->uaddr &&
+		    uaddr + ulen <= region->uaddr + region->size)
+			return region;
+	}
+
+	return NULL;
+}
+
+/*
+ * Pin the pages of @region in [uaddr, uaddr + npages * PAGE_SIZE) that are not
+ * pinned yet, and return all of them in @pages unless it is NULL.  Newly
+ * pinned pages are flushed from the cache, as the guest may access them with
+ * a different C-bit than the one they were last written with.
+ */
+static int sev_region_pin_pages(struct kvm *kvm, struct enc_region *region,
+				unsigned long uaddr, unsigned long npages,
+				struct page **pages)
+{
+	struct kvm_sev_info *sev = &to_kvm_svm(kvm)->sev_info;
+	unsigned long lock_limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+	unsigned long idx, i, j, n;
+	struct page *page, **p;
+	int npinned, ret = 0;
+
+	lockdep_assert_held(&sev->regions_lock);
+
+	uaddr &= PAGE_MASK;
+	idx = (uaddr >> PAGE_SHIFT) - (region->uaddr >> PAGE_SHIFT);
+
+	for (i = 0; i < npages; i += n) {
+		page = xa_load(&region->pages, idx + i);
+		if (page) {
+			if (pages)
+				pages[i] = page;
+			n = 1;
 			continue;
 		}
-		break;
+
+		/* Pin runs of missing pages at once, if there is room for them. */
+		n = 1;
+		if (pages)
+			while (i + n < npages && !xa_load(&region->pages, idx + i + n))
+				n++;
+		p = pages ? &pages[i] : &page;
+
+		if (sev->pages_locked + n > lock_limit && !capable(CAP_IPC_LOCK)) {
+			pr_err("SEV: %lu locked pages exceed the lock limit of %lu.\n",
+			       sev->pages_locked + n, lock_limit);
+			return -ENOMEM;
+		}
+
+		npinned = pin_user_pages_fast(uaddr + (i << PAGE_SHIFT), n,
+					      FOLL_WRITE, p);
+		if (npinned != n) {
+			if (npinned > 0)
+				unpin_user_pages(p, npinned);
+			return -ENOMEM;
+		}
+
+		sev_clflush_pages(p, n);
+
+		for (j = 0; j < n; j++) {
+			ret = xa_err(xa_store(&region->pages, idx + i + j, p[j],
+					      GFP_KERNEL_ACCOUNT));
+			if (ret) {
+				unpin_user_pages(&p[j], n - j);
+				n = j;
+				break;
+			}
+		}
+		region->npages += n;
+		sev->pages_locked += n;
+		if (ret)
+			return ret;
 	}
 
+	return 0;
+}
+
+/*
+ * Pin [uaddr, uaddr + ulen) in the registered region covering it, if any, and
+ * return an array of the pages.  The array is freed with kvfree(), the pages
+ * stay pinned until the region is unregistered.
+ */
+static struct page **sev_pin_registered_memory(struct kvm *kvm,
+					       unsigned long uaddr,
+					       unsigned long ulen,
+					       unsigned long *n)
+{
+	struct kvm_sev_info *sev = &to_kvm_svm(kvm)->sev_info;
+	struct enc_region *region;
+	struct page **pages = NULL;
+	unsigned long first, last;
+	int ret;
+
+	if (ulen == 0 || uaddr + ulen < uaddr)
+		return NULL;
+
+	mutex_lock(&sev->regions_lock);
+
+	region = sev_find_covering_region(kvm, uaddr, ulen);
+	if (!region)
+		goto out;
+
+	first = uaddr >> PAGE_SHIFT;
+	last = (uaddr + ulen - 1) >> PAGE_SHIFT;
+	*n = last - first + 1;
+
+	pages = kvcalloc(*n, sizeof(*pages), GFP_KERNEL_ACCOUNT);
+	if (!pages) {
+		pages = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+
+	ret = sev_region_pin_pages(kvm, region, uaddr, *n, pages);
+	if (ret) {
+		kvfree(pages);
+		pages = ERR_PTR(ret);
+	}
+out:
+	mutex_unlock(&sev->regions_lock);
 	return pages;
 }
 
+/*
+ * Returns true if the page at @hva needs to be pinned, i.e. it is in a
+ * registered region but not pinned yet.  The regions list is RCU protected, and
+ * so are the xarrays of pinned pages, so this doesn't need regions_lock.
+ */
+static bool sev_page_needs_pin(struct kvm_sev_info *sev, unsigned long hva)
+{
+	struct enc_region *region;
+	bool ret = false;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(region, &sev->regions_list, list) {
+		if (hva < region->uaddr || hva >= region->uaddr + region->size)
+			continue;
+
+		if (!xa_load(&region->pages, (hva >> PAGE_SHIFT) -
+					     (region->uaddr >> PAGE_SHIFT))) {
+			ret = true;
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/*
+ * Called on guest page faults, before the page is mapped, to pin pages of the
+ * registered regions on first use.
+ */
+int sev_pin_guest_page(struct kvm_vcpu *vcpu, gfn_t gfn)
+{
+	struct kvm *kvm = vcpu->kvm;
+	struct kvm_sev_info *sev = &to_kvm_svm(kvm)->sev_info;
+	struct enc_region *region;
+	unsigned long hva;
+	int ret = 0;
+
+	if (!sev_guest(kvm))
+		return 0;
+
+	hva = kvm_vcpu_gfn_to_hva(vcpu, gfn);
+	if (kvm_is_error_hva(hva))
+		return 0;
+
+	/* Most faults are for pages that are pinned already. */
+	if (!sev_page_needs_pin(sev, hva & PAGE_MASK))
+		return 0;
+
+	mutex_lock(&sev->regions_lock);
+	region = sev_find_covering_region(kvm, hva, PAGE_SIZE);
+	if (region)
+		ret = sev_region_pin_pages(kvm, region, hva, 1, NULL);
+	mutex_unlock(&sev->regions_lock);
+
+	return ret;
+}
+
 static int sev_launch_update_data(struct kvm *kvm, struct kvm_sev_cmd *argp)
 {
 	unsigned long vaddr, vaddr_end, next_vaddr, npages, pages, size, i;
@@ -423,6 +702,7 @@ static int sev_launch_update_data(struct kvm *kvm, struct kvm_sev_cmd *argp)
 	struct kvm_sev_launch_update_data params;
 	struct sev_data_launch_update_data *data;
 	struct page **inpages;
+	bool pinned;
 	int ret;
 
 	if (!sev_guest(kvm))
@@ -439,8 +719,15 @@ static int sev_launch_update_data(struct kvm *kvm, struct kvm_sev_cmd *argp)
 	size = params.len;
 	vaddr_end = vaddr + size;
 
-	/* Lock the user memory. */
-	inpages = sev_pin_memory(kvm, vaddr, size, &npages, 1);
+	/*
+	 * Use the pages of a registered region if there is one, e.g. when
+	 * the VMM registered all of guest memory, otherwise lock the user
+	 * memory.
+	 */
+	inpages = sev_pin_registered_memory(kvm, vaddr, size, &npages);
+	pinned = !inpages;
+	if (pinned)
+		inpages = sev_pin_memory(kvm, vaddr, size, &npages, 1);
 	if (IS_ERR(inpages)) {
 		ret = PTR_ERR(inpages);
 		goto e_free;
@@ -484,7 +771,10 @@ static int sev_launch_update_data(struct kvm *kvm, struct kvm_sev_cmd *argp)
 		mark_page_accessed(inpages[i]);
 	}
 	/* unlock the user pages */
-	sev_unpin_memory(kvm, inpages, npages);
+	if (pinned)
+		sev_unpin_memory(kvm, inpages, npages);
+	else
+		kvfree(inpages);
 e_free:
 	kfree(data);
 	return ret;
@@ -997,36 +1287,28 @@ int svm_register_enc_region(struct kvm *kvm,
 	if (range->addr > ULONG_MAX || range->size > ULONG_MAX)
 		return -EINVAL;
 
+	if (!range->size || range->addr + range->size < range->addr)
+		return -EINVAL;
+
 	region = kzalloc(sizeof(*region), GFP_KERNEL_ACCOUNT);
 	if (!region)
 		return -ENOMEM;
 
-	region->pages = sev_pin_memory(kvm, range->addr, range->size, &region->npages, 1);
-	if (IS_ERR(region->pages)) {
-		ret = PTR_ERR(region->pages);
-		goto e_free;
-	}
-
 	/*
-	 * The guest may change the memory encryption attribute from C=0 -> C=1
-	 * or vice versa for this memory range. Lets make sure caches are
-	 * flushed to ensure that guest data gets written into memory with
-	 * correct C-bit.
+	 * Nothing is pinned here, the pages are pinned and flushed from the
+	 * cache by sev_region_pin_pages() when the guest first uses them.
 	 */
-	sev_clflush_pages(region->pages, region->npages);
-
+	xa_init(&region->pages);
 	region->uaddr = range->addr;
 	region->size = range->size;
 
 	mutex_lock(&kvm->lock);
-	list_add_tail(&region->list, &sev->regions_list);
+	mutex_lock(&sev->regions_lock);
+	list_add_tail_rcu(&region->list, &sev->regions_list);
+	mutex_unlock(&sev->regions_lock);
 	mutex_unlock(&kvm->lock);
 
 	return ret;
-
-e_free:
-	kfree(region);
-	return ret;
 }
 
 static struct enc_region *
@@ -1048,9 +1330,20 @@ find_enc_region(struct kvm *kvm, struct kvm_enc_region *range)
 static void __unregister_enc_region_locked(struct kvm *kvm,
 					   struct enc_region *region)
 {
-	sev_unpin_memory(kvm, region->pages, region->npages);
-	list_del(&region->list);
-	kfree(region);
+	struct kvm_sev_info *sev = &to_kvm_svm(kvm)->sev_info;
+	struct page *page;
+	unsigned long idx;
+
+	mutex_lock(&sev->regions_lock);
+	list_del_rcu(&region->list);
+	sev->pages_locked -= region->npages;
+	mutex_unlock(&sev->regions_lock);
+
+	xa_for_each(&region->pages, idx, page)
+		unpin_user_page(page);
+	xa_destroy(&region->pages);
+	/* sev_page_needs_pin() may still be looking at the region. */
+	kfree_rcu(region, rcu);
 }
 
 int svm_unregister_enc_region(struct kvm *kvm,
@@ -1148,6 +1441,10 @@ int __init sev_hardware_setup(void)
 	if (!sev_reclaim_asid_bitmap)
 		return 1;
 
+	sev_flush_asid_bitmap = bitmap_zalloc(max_sev_asid, GFP_KERNEL);
+	if (!sev_flush_asid_bitmap)
+		return 1;
+
 	status = kmalloc(sizeof(*status), GFP_KERNEL);
 	if (!status)
 		return 1;
@@ -1175,8 +1472,11 @@ void sev_hardware_teardown(void)
 	if (!svm_sev_enabled())
 		return;
 
+	cancel_work_sync(&sev_reclaim_asids_work);
+
 	bitmap_free(sev_asid_bitmap);
 	bitmap_free(sev_reclaim_asid_bitmap);
+	bitmap_free(sev_flush_asid_bitmap);
 
 	sev_flush_asids();
 }
@@ -108,6 +108,48 @@ static const struct svm_direct_access_msrs {
 	{ .index = MSR_IA32_LASTBRANCHTOIP,		.always = false },
 	{ .index = MSR_IA32_LASTINTFROMIP,		.always = false },
 	{ .index = MSR_IA32_LASTINTTOIP,		.always = false },
+	{ .index = X2APIC_MSR(APIC_ID),			.always = false },
+	{ .index = X2APIC_MSR(APIC_LVR),		.always = false },
+	{ .index = X2APIC_MSR(APIC_TASKPRI),		.always = false },
+	{ .index = X2APIC_MSR(APIC_PROCPRI),		.always = false },
+	{ .index = X2APIC_MSR(APIC_EOI),		.always = false },
+	{ .index = X2APIC_MSR(APIC_LDR),		.always = false },
+	{ .index = X2APIC_MSR(APIC_SPIV),		.always = false },
+	{ .index = X2APIC_MSR(APIC_ISR),		.always = false },
+	{ .index = X2APIC_MSR(APIC_ISR + 0x10),		.always = false },
+	{ .index = X2APIC_MSR(APIC_ISR + 0x20),		.always = false },
+	{ .index = X2APIC_MSR(APIC_ISR + 0x30),		.always = false },
+	{ .index = X2APIC_MSR(APIC_ISR + 0x40),		.always = false },
+	{ .index = X2APIC_MSR(APIC_ISR + 0x50),		.always = false },
+	{ .index = X2APIC_MSR(APIC_ISR + 0x60),		.always = false },
+	{ .index = X2APIC_MSR(APIC_ISR + 0x70),		.always = false },
+	{ .index = X2APIC_MSR(APIC_TMR),		.always = false },
+	{ .index = X2APIC_MSR(APIC_TMR + 0x10),		.always = false },
+	{ .index = X2APIC_MSR(APIC_TMR + 0x20),		.always = false },
+	{ .index = X2APIC_MSR(APIC_TMR + 0x30),		.always = false },
+	{ .index = X2APIC_MSR(APIC_TMR + 0x40),		.always = false },
+	{ .index = X2APIC_MSR(APIC_TMR + 0x50),		.always = false },
+	{ .index = X2APIC_MSR(APIC_TMR + 0x60),		.always = false },
+	{ .index = X2APIC_MSR(APIC_TMR + 0x70),		.always = false },
+	{ .index = X2APIC_MSR(APIC_IRR),		.always = false },
+	{ .index = X2APIC_MSR(APIC_IRR + 0x10),		.always = false },
+	{ .index = X2APIC_MSR(APIC_IRR + 0x20),		.always = false },
+	{ .index = X2APIC_MSR(APIC_IRR + 0x30),		.always = false },
+	{ .index = X2APIC_MSR(APIC_IRR + 0x40),		.always = false },
+	{ .index = X2APIC_MSR(APIC_IRR + 0x50),		.always = false },
+	{ .index = X2APIC_MSR(APIC_IRR + 0x60),		.always = false },
+	{ .index = X2APIC_MSR(APIC_IRR + 0x70),		.always = false },
+	{ .index = X2APIC_MSR(APIC_ESR),		.always = false },
+	{ .index = X2APIC_MSR(APIC_ICR),		.always = false },
+	{ .index = X2APIC_MSR(APIC_LVTT),		.always = false },
+	{ .index = X2APIC_MSR(APIC_LVTTHMR),		.always = false },
+	{ .index = X2APIC_MSR(APIC_LVTPC),		.always = false },
+	{ .index = X2APIC_MSR(APIC_LVT0),		.always = false },
+	{ .index = X2APIC_MSR(APIC_LVT1),		.always = false },
+	{ .index = X2APIC_MSR(APIC_LVTERR),		.always = false },
+	{ .index = X2APIC_MSR(APIC_TMICT),		.always = false },
+	{ .index = X2APIC_MSR(APIC_TMCCT),		.always = false },
+	{ .index = X2APIC_MSR(APIC_TDCR),		.always = false },
 	{ .index = MSR_INVALID,				.always = false },
 };
 
@@ -694,6 +736,25 @@ void svm_vcpu_init_msrpm(struct kvm_vcpu *vcpu, u32 *msrpm)
 	}
 }
 
+void svm_set_x2apic_msr_interception(struct vcpu_svm *svm, bool intercept)
+{
+	int i;
+
+	if (intercept == svm->x2avic_msrs_intercepted)
+		return;
+
+	for (i = 0; direct_access_msrs[i].index != MSR_INVALID; i++) {
+		u32 msr = direct_access_msrs[i].index;
+
+		if (msr < APIC_BASE_MSR || msr > APIC_BASE_MSR + 0xff)
+			continue;
+
+		set_msr_interception(&svm->vcpu, svm->msrpm, msr,
+				     !intercept, !intercept);
+	}
+
+	svm->x2avic_msrs_intercepted = intercept;
+}
 
 void svm_vcpu_free_msrpm(u32 *msrpm)
 {
@@ -1000,6 +1061,7 @@ static __init int svm_hardware_setup(void)
 		} else {
 			pr_info("AVIC enabled\n");
 
+			avic_hardware_setup();
 			amd_iommu_register_ga_log_notifier(&avic_ga_log_notifier);
 		}
 	}
@@ -1313,6 +1375,7 @@ static int svm_create_vcpu(struct kvm_vcpu *vcpu)
 		goto error_free_vmcb_page;
 
 	svm_vcpu_init_msrpm(vcpu, svm->msrpm);
+	svm->x2avic_msrs_intercepted = true;
 
 	svm->vmcb = page_address(vmcb_page);
 	svm->vmcb_pa = __sme_set(page_to_pfn(vmcb_page) << PAGE_SHIFT);
@@ -2925,6 +2988,26 @@ static int (*const svm_exit_handlers[])(struct vcpu_svm *svm) = {
 	[SVM_EXIT_AVIC_UNACCELERATED_ACCESS]	= avic_unaccelerated_access_interception,
 };
 
+/*
+ * Exit codes up to INVPCID index the latency histograms directly, NPF and the
+ * AVIC exits follow them and everything else shares the last histogram.
+ */
+#define SVM_EXIT_LATENCY_NPF		(SVM_EXIT_INVPCID + 1)
+#define SVM_NR_EXIT_LATENCY_REASONS	(SVM_EXIT_LATENCY_NPF + 4)
+
+static u32 svm_exit_latency_index(struct kvm_vcpu *vcpu)
+{
+	u32 exit_code = to_svm(vcpu)->vmcb->control.exit_code;
+
+	if (exit_code <= SVM_EXIT_INVPCID)
+		return exit_code;
+	if (exit_code >= SVM_EXIT_NPF &&
+	    exit_code <= SVM_EXIT_AVIC_UNACCELERATED_ACCESS)
+		return SVM_EXIT_LATENCY_NPF + exit_code - SVM_EXIT_NPF;
+
+	return SVM_NR_EXIT_LATENCY_REASONS - 1;
+}
+
 static void dump_vmcb(struct kvm_vcpu *vcpu)
 {
 	struct vcpu_svm *svm = to_svm(vcpu);
@@ -3756,14 +3839,6 @@ static void svm_vcpu_after_set_cpuid(struct kvm_vcpu *vcpu)
 	if (!kvm_vcpu_apicv_active(vcpu))
 		return;
 
-	/*
-	 * AVIC does not work with an x2APIC mode guest. If the X2APIC feature
-	 * is exposed to the guest, disable AVIC.
-	 */
-	if (guest_cpuid_has(vcpu, X86_FEATURE_X2APIC))
-		kvm_request_apicv_update(vcpu->kvm, false,
-					 APICV_INHIBIT_REASON_X2APIC);
-
 	/*
 	 * Currently, AVIC does not work with nested virtualization.
 	 * So, we disable AVIC when cpuid for SVM is set in the L1 guest.
@@ -4226,6 +4301,8 @@ static struct kvm_x86_ops svm_x86_ops __initdata = {
 
 	.run = svm_vcpu_run,
 	.handle_exit = handle_exit,
+	.nr_exit_latency_reasons = SVM_NR_EXIT_LATENCY_REASONS,
+	.exit_latency_index = svm_exit_latency_index,
 	.skip_emulated_instruction = skip_emulated_instruction,
 	.update_emulated_instruction = NULL,
 	.set_interrupt_shadow = svm_set_interrupt_shadow,
@@ -4289,6 +4366,7 @@ static struct kvm_x86_ops svm_x86_ops __initdata = {
 	.mem_enc_op = svm_mem_enc_op,
 	.mem_enc_reg_region = svm_register_enc_region,
 	.mem_enc_unreg_region = svm_unregister_enc_region,
+	.mem_enc_pin_page = sev_pin_guest_page,
 
 	.can_emulate_instruction = svm_can_emulate_instruction,
 
@@ -2,6 +2,7 @@
 #ifndef __KVM_X86_VMX_CAPS_H
 #define __KVM_X86_VMX_CAPS_H
 
+#include <asm/perf_event.h>
 #include <asm/vmx.h>
 
 #include "lapic.h"
@@ -18,7 +19,13 @@ extern int __read_mostly pt_mode;
 #define PT_MODE_SYSTEM		0
 #define PT_MODE_HOST_GUEST	1
 
+#define PMU_CAP_PEBS_TRAP	(1ULL << 6)
+#define PMU_CAP_PEBS_ARCH_REG	(1ULL << 7)
+#define PMU_CAP_PEBS_FORMAT	0xf00ULL
 #define PMU_CAP_FW_WRITES	(1ULL << 13)
+#define PMU_CAP_PEBS_BASELINE	(1ULL << 14)
+#define PMU_CAP_PEBS_MASK	(PMU_CAP_PEBS_TRAP | PMU_CAP_PEBS_ARCH_REG | \
+				 PMU_CAP_PEBS_FORMAT | PMU_CAP_PEBS_BASELINE)
 
 struct nested_vmx_msrs {
 	/*
@@ -369,13 +376,41 @@ static inline bool vmx_pt_mode_is_host_guest(void)
 	return pt_mode == PT_MODE_HOST_GUEST;
 }
 
+/*
+ * PEBS can only be exposed if the records are written through the guest's
+ * page tables and EPT, instead of to host physical addresses.
+ */
+static inline bool vmx_pebs_supported(void)
+{
+	struct x86_pmu_capability x86_pmu;
+
+	if (!boot_cpu_has(X86_FEATURE_PEBS))
+		return false;
+
+	perf_get_x86_pmu_capability(&x86_pmu);
+	return x86_pmu.pebs_ept;
+}
+
 static inline u64 vmx_get_perf_capabilities(void)
 {
 	/*
 	 * Since counters are virtualized, KVM would support full
 	 * width counting unconditionally, even if the host lacks it.
 	 */
-	return PMU_CAP_FW_WRITES;
+	u64 perf_cap = PMU_CAP_FW_WRITES;
+	u64 host_perf_cap = 0;
+
+	if (!vmx_pebs_supported())
+		return perf_cap;
+
+	rdmsrl(MSR_IA32_PERF_CAPABILITIES, host_perf_cap);
+	perf_cap |= host_perf_cap & PMU_CAP_PEBS_MASK;
+
+	/* Adaptive PEBS needs the format 4 records. */
+	if ((perf_cap & PMU_CAP_PEBS_FORMAT) < 0x400)
+		perf_cap &= ~PMU_CAP_PEBS_BASELINE;
+
+	return perf_cap;
 }
 
 #endif /* __KVM_X86_VMX_CAPS_H */
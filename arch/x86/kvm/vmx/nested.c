@@ -21,6 +21,14 @@ module_param_named(enable_shadow_vmcs, enable_shadow_vmcs, bool, S_IRUGO);
 static bool __read_mostly nested_early_check = 0;
 module_param(nested_early_check, bool, S_IRUGO);
 
+/*
+ * Number of exits on VMREAD/VMWRITE of a vmcs12 field, within a window of
+ * HOT_SHADOW_WINDOW such exits, after which the field is added to the shadow
+ * VMCS of a vCPU.  0 disables extending the set of shadowed fields at runtime.
+ */
+static u8 __read_mostly hot_shadow_vmcs_threshold = 16;
+module_param(hot_shadow_vmcs_threshold, byte, S_IRUGO);
+
 #define CC(consistency_check)						\
 ({									\
 	bool failed = (consistency_check);				\
@@ -41,6 +49,18 @@ module_param(nested_early_check, bool, S_IRUGO);
 
 #define VMX_MISC_EMULATED_PREEMPTION_TIMER_RATE 5
 
+/*
+ * Groups of vmcs12 fields that prepare_vmcs02_rare() copies to vmcs02 only
+ * when they are dirty.  The two guest state groups match the GUEST_GRP2 and
+ * GUEST_GRP1 clean fields of the enlightened VMCS.
+ */
+#define VMCS12_DIRTY_GUEST_SEG		BIT(0)
+#define VMCS12_DIRTY_GUEST_MISC		BIT(1)
+#define VMCS12_DIRTY_OTHER		BIT(2)
+#define VMCS12_DIRTY_ALL		(VMCS12_DIRTY_GUEST_SEG |	\
+					 VMCS12_DIRTY_GUEST_MISC |	\
+					 VMCS12_DIRTY_OTHER)
+
 enum {
 	VMX_VMREAD_BITMAP,
 	VMX_VMWRITE_BITMAP,
@@ -69,6 +89,81 @@ static struct shadow_vmcs_field shadow_read_write_fields[] = {
 static int max_shadow_read_write_fields =
 	ARRAY_SIZE(shadow_read_write_fields);
 
+/*
+ * The group of vmcs12 fields dirtied by a VMWRITE to @field.  Anything that
+ * isn't plain guest state, e.g. a control that decides which fields are
+ * loaded, dirties all of them.
+ */
+static u32 vmcs12_field_dirty_group(unsigned long field)
+{
+	switch (field) {
+	case GUEST_ES_SELECTOR ... GUEST_TR_SELECTOR:
+	case GUEST_ES_LIMIT ... GUEST_TR_AR_BYTES:
+	case GUEST_ES_BASE ... GUEST_IDTR_BASE:
+		return VMCS12_DIRTY_GUEST_SEG;
+	case GUEST_PDPTR0 ... GUEST_BNDCFGS_HIGH:
+	case GUEST_SYSENTER_CS:
+	case GUEST_PENDING_DBG_EXCEPTIONS:
+	case GUEST_SYSENTER_ESP:
+	case GUEST_SYSENTER_EIP:
+		return VMCS12_DIRTY_GUEST_MISC;
+	default:
+		return VMCS12_DIRTY_ALL;
+	}
+}
+
+#define HOT_SHADOW_NR_FIELDS	16
+#define HOT_SHADOW_WINDOW	1024
+
+/*
+ * vmcs12 fields that aren't shadowed by default, but that L1 accesses often
+ * enough to be added to the shadow VMCS of the vCPU, see
+ * nested_vmx_hot_shadow_access().  The VMREAD and VMWRITE bitmaps of vmcs01
+ * are switched from vmx_bitmap to per-vCPU copies on the first promotion.
+ */
+struct hot_shadow_vmcs {
+	unsigned long *bitmap[VMX_BITMAP_NR];
+	struct shadow_vmcs_field read_write_fields[HOT_SHADOW_NR_FIELDS];
+	struct shadow_vmcs_field read_only_fields[HOT_SHADOW_NR_FIELDS];
+	int nr_read_write_fields;
+	int nr_read_only_fields;
+	int nr_accesses;
+	/* Trapped accesses in the current window, indexed by offset / 2. */
+	u8 hits[sizeof(struct vmcs12) / sizeof(u16)];
+};
+
+static void free_hot_shadow_vmcs(struct vcpu_vmx *vmx)
+{
+	struct hot_shadow_vmcs *hot = vmx->nested.hot_shadow;
+	int i;
+
+	if (!hot)
+		return;
+
+	if (hot->bitmap[VMX_VMREAD_BITMAP])
+		nested_vmx_set_vmcs_shadowing_bitmap();
+
+	for (i = 0; i < VMX_BITMAP_NR; i++)
+		free_page((unsigned long)hot->bitmap[i]);
+	kfree(hot);
+	vmx->nested.hot_shadow = NULL;
+}
+
+static bool is_hot_shadow_field_ro(struct vcpu_vmx *vmx, unsigned long field)
+{
+	struct hot_shadow_vmcs *hot = vmx->nested.hot_shadow;
+	int i;
+
+	if (!hot)
+		return false;
+
+	for (i = 0; i < hot->nr_read_only_fields; i++) {
+		if (hot->read_only_fields[i].encoding == (field & ~1ul))
+			return true;
+	}
+	return false;
+}
+
 static void init_vmcs_shadow_fields(void)
 {
 	int i, j;
@@ -178,9 +273,11 @@ static int nested_vmx_failValid(struct kvm_vcpu *vcpu,
 			| X86_EFLAGS_ZF);
 	get_vmcs12(vcpu)->vm_instruction_error = vm_instruction_error;
 	/*
-	 * We don't need to force a shadow sync because
-	 * VM_INSTRUCTION_ERROR is not shadowed
+	 * VM_INSTRUCTION_ERROR is not shadowed by default, but L1 reads it
+	 * from the shadow VMCS once it has been promoted at runtime.
 	 */
+	if (is_hot_shadow_field_ro(to_vmx(vcpu), VM_INSTRUCTION_ERROR))
+		to_vmx(vcpu)->nested.need_vmcs12_to_shadow_sync = true;
 	return kvm_skip_emulated_instruction(vcpu);
 }
 
@@ -279,6 +376,7 @@ static void vmx_switch_vmcs(struct kvm_vcpu *vcpu, struct loaded_vmcs *vmcs)
 static void free_nested(struct kvm_vcpu *vcpu)
 {
 	struct vcpu_vmx *vmx = to_vmx(vcpu);
+	int i;
 
 	if (WARN_ON_ONCE(vmx->loaded_vmcs != &vmx->vmcs01))
 		vmx_switch_vmcs(vcpu, &vmx->vmcs01);
@@ -298,9 +396,14 @@ static void free_nested(struct kvm_vcpu *vcpu)
 		vmcs_clear(vmx->vmcs01.shadow_vmcs);
 		free_vmcs(vmx->vmcs01.shadow_vmcs);
 		vmx->vmcs01.shadow_vmcs = NULL;
+		free_hot_shadow_vmcs(vmx);
 	}
 	kfree(vmx->nested.cached_vmcs12);
 	vmx->nested.cached_vmcs12 = NULL;
+	for (i = 0; i < NR_PREV_EVMCS; i++) {
+		kfree(vmx->nested.prev_evmcs[i].vmcs12);
+		vmx->nested.prev_evmcs[i].vmcs12 = NULL;
+	}
 	kfree(vmx->nested.cached_shadow_vmcs12);
 	vmx->nested.cached_shadow_vmcs12 = NULL;
 	/* Unpin physical memory we referred to in the vmcs02 */
@@ -1538,9 +1641,11 @@ int vmx_get_vmx_msr(struct nested_vmx_msrs *msrs, u32 msr_index, u64 *pdata)
  * fields tagged SHADOW_FIELD_RO may or may not align with the "read-only"
  * VM-exit information fields (which are actually writable if the vCPU is
  * configured to support "VMWRITE to any supported field in the VMCS").
+ * The fields shadowed at runtime mark vmcs12 dirty only if L1 changed them.
  */
 static void copy_shadow_to_vmcs12(struct vcpu_vmx *vmx)
 {
+	struct hot_shadow_vmcs *hot = vmx->nested.hot_shadow;
 	struct vmcs *shadow_vmcs = vmx->vmcs01.shadow_vmcs;
 	struct vmcs12 *vmcs12 = get_vmcs12(&vmx->vcpu);
 	struct shadow_vmcs_field field;
@@ -1560,6 +1665,17 @@ static void copy_shadow_to_vmcs12(struct vcpu_vmx *vmx)
 		vmcs12_write_any(vmcs12, field.encoding, field.offset, val);
 	}
 
+	for (i = 0; hot && i < hot->nr_read_write_fields; i++) {
+		field = hot->read_write_fields[i];
+		val = __vmcs_readl(field.encoding);
+		if (val == vmcs12_read_any(vmcs12, field.encoding, field.offset))
+			continue;
+
+		vmcs12_write_any(vmcs12, field.encoding, field.offset, val);
+		vmx->nested.dirty_vmcs12 |=
+			vmcs12_field_dirty_group(field.encoding);
+	}
+
 	vmcs_clear(shadow_vmcs);
 	vmcs_load(vmx->loaded_vmcs->vmcs);
 
@@ -1568,13 +1684,18 @@ static void copy_shadow_to_vmcs12(struct vcpu_vmx *vmx)
 
 static void copy_vmcs12_to_shadow(struct vcpu_vmx *vmx)
 {
+	struct hot_shadow_vmcs *hot = vmx->nested.hot_shadow;
 	const struct shadow_vmcs_field *fields[] = {
 		shadow_read_write_fields,
-		shadow_read_only_fields
+		shadow_read_only_fields,
+		hot ? hot->read_write_fields : NULL,
+		hot ? hot->read_only_fields : NULL
 	};
 	const int max_fields[] = {
 		max_shadow_read_write_fields,
-		max_shadow_read_only_fields
+		max_shadow_read_only_fields,
+		hot ? hot->nr_read_write_fields : 0,
+		hot ? hot->nr_read_only_fields : 0
 	};
 	struct vmcs *shadow_vmcs = vmx->vmcs01.shadow_vmcs;
 	struct vmcs12 *vmcs12 = get_vmcs12(&vmx->vcpu);
@@ -1604,177 +1725,176 @@ static int copy_enlightened_to_vmcs12(struct vcpu_vmx *vmx)
 {
 	struct vmcs12 *vmcs12 = vmx->nested.cached_vmcs12;
 	struct hv_enlightened_vmcs *evmcs = vmx->nested.hv_evmcs;
+	u32 copied = 0;
+
+#define COPY_EVMCS_FIELD(field)					\
+	do {							\
+		vmcs12->field = evmcs->field;			\
+		copied += sizeof(evmcs->field);			\
+	} while (0)
 
 	/* HV_VMX_ENLIGHTENED_CLEAN_FIELD_NONE */
-	vmcs12->tpr_threshold = evmcs->tpr_threshold;
-	vmcs12->guest_rip = evmcs->guest_rip;
+	COPY_EVMCS_FIELD(tpr_threshold);
+	COPY_EVMCS_FIELD(guest_rip);
 
 	if (unlikely(!(evmcs->hv_clean_fields &
 		       HV_VMX_ENLIGHTENED_CLEAN_FIELD_GUEST_BASIC))) {
-		vmcs12->guest_rsp = evmcs->guest_rsp;
-		vmcs12->guest_rflags = evmcs->guest_rflags;
-		vmcs12->guest_interruptibility_info =
-			evmcs->guest_interruptibility_info;
+		COPY_EVMCS_FIELD(guest_rsp);
+		COPY_EVMCS_FIELD(guest_rflags);
+		COPY_EVMCS_FIELD(guest_interruptibility_info);
 	}
 
 	if (unlikely(!(evmcs->hv_clean_fields &
 		       HV_VMX_ENLIGHTENED_CLEAN_FIELD_CONTROL_PROC))) {
-		vmcs12->cpu_based_vm_exec_control =
-			evmcs->cpu_based_vm_exec_control;
+		COPY_EVMCS_FIELD(cpu_based_vm_exec_control);
 	}
 
 	if (unlikely(!(evmcs->hv_clean_fields &
 		       HV_VMX_ENLIGHTENED_CLEAN_FIELD_CONTROL_EXCPN))) {
-		vmcs12->exception_bitmap = evmcs->exception_bitmap;
+		COPY_EVMCS_FIELD(exception_bitmap);
 	}
 
 	if (unlikely(!(evmcs->hv_clean_fields &
 		       HV_VMX_ENLIGHTENED_CLEAN_FIELD_CONTROL_ENTRY))) {
-		vmcs12->vm_entry_controls = evmcs->vm_entry_controls;
+		COPY_EVMCS_FIELD(vm_entry_controls);
 	}
 
 	if (unlikely(!(evmcs->hv_clean_fields &
 		       HV_VMX_ENLIGHTENED_CLEAN_FIELD_CONTROL_EVENT))) {
-		vmcs12->vm_entry_intr_info_field =
-			evmcs->vm_entry_intr_info_field;
-		vmcs12->vm_entry_exception_error_code =
-			evmcs->vm_entry_exception_error_code;
-		vmcs12->vm_entry_instruction_len =
-			evmcs->vm_entry_instruction_len;
+		COPY_EVMCS_FIELD(vm_entry_intr_info_field);
+		COPY_EVMCS_FIELD(vm_entry_exception_error_code);
+		COPY_EVMCS_FIELD(vm_entry_instruction_len);
 	}
 
 	if (unlikely(!(evmcs->hv_clean_fields &
 		       HV_VMX_ENLIGHTENED_CLEAN_FIELD_HOST_GRP1))) {
-		vmcs12->host_ia32_pat = evmcs->host_ia32_pat;
-		vmcs12->host_ia32_efer = evmcs->host_ia32_efer;
-		vmcs12->host_cr0 = evmcs->host_cr0;
-		vmcs12->host_cr3 = evmcs->host_cr3;
-		vmcs12->host_cr4 = evmcs->host_cr4;
-		vmcs12->host_ia32_sysenter_esp = evmcs->host_ia32_sysenter_esp;
-		vmcs12->host_ia32_sysenter_eip = evmcs->host_ia32_sysenter_eip;
-		vmcs12->host_rip = evmcs->host_rip;
-		vmcs12->host_ia32_sysenter_cs = evmcs->host_ia32_sysenter_cs;
-		vmcs12->host_es_selector = evmcs->host_es_selector;
-		vmcs12->host_cs_selector = evmcs->host_cs_selector;
-		vmcs12->host_ss_selector = evmcs->host_ss_selector;
-		vmcs12->host_ds_selector = evmcs->host_ds_selector;
-		vmcs12->host_fs_selector = evmcs->host_fs_selector;
-		vmcs12->host_gs_selector = evmcs->host_gs_selector;
-		vmcs12->host_tr_selector = evmcs->host_tr_selector;
+		COPY_EVMCS_FIELD(host_ia32_pat);
+		COPY_EVMCS_FIELD(host_ia32_efer);
+		COPY_EVMCS_FIELD(host_cr0);
+		COPY_EVMCS_FIELD(host_cr3);
+		COPY_EVMCS_FIELD(host_cr4);
+		COPY_EVMCS_FIELD(host_ia32_sysenter_esp);
+		COPY_EVMCS_FIELD(host_ia32_sysenter_eip);
+		COPY_EVMCS_FIELD(host_rip);
+		COPY_EVMCS_FIELD(host_ia32_sysenter_cs);
+		COPY_EVMCS_FIELD(host_es_selector);
+		COPY_EVMCS_FIELD(host_cs_selector);
+		COPY_EVMCS_FIELD(host_ss_selector);
+		COPY_EVMCS_FIELD(host_ds_selector);
+		COPY_EVMCS_FIELD(host_fs_selector);
+		COPY_EVMCS_FIELD(host_gs_selector);
+		COPY_EVMCS_FIELD(host_tr_selector);
 	}
 
 	if (unlikely(!(evmcs->hv_clean_fields &
 		       HV_VMX_ENLIGHTENED_CLEAN_FIELD_CONTROL_GRP1))) {
-		vmcs12->pin_based_vm_exec_control =
-			evmcs->pin_based_vm_exec_control;
-		vmcs12->vm_exit_controls = evmcs->vm_exit_controls;
-		vmcs12->secondary_vm_exec_control =
-			evmcs->secondary_vm_exec_control;
+		COPY_EVMCS_FIELD(pin_based_vm_exec_control);
+		COPY_EVMCS_FIELD(vm_exit_controls);
+		COPY_EVMCS_FIELD(secondary_vm_exec_control);
 	}
 
 	if (unlikely(!(evmcs->hv_clean_fields &
 		       HV_VMX_ENLIGHTENED_CLEAN_FIELD_IO_BITMAP))) {
-		vmcs12->io_bitmap_a = evmcs->io_bitmap_a;
-		vmcs12->io_bitmap_b = evmcs->io_bitmap_b;
+		COPY_EVMCS_FIELD(io_bitmap_a);
+		COPY_EVMCS_FIELD(io_bitmap_b);
 	}
 
 	if (unlikely(!(evmcs->hv_clean_fields &
 		       HV_VMX_ENLIGHTENED_CLEAN_FIELD_MSR_BITMAP))) {
-		vmcs12->msr_bitmap = evmcs->msr_bitmap;
+		COPY_EVMCS_FIELD(msr_bitmap);
 	}
 
 	if (unlikely(!(evmcs->hv_clean_fields &
 		       HV_VMX_ENLIGHTENED_CLEAN_FIELD_GUEST_GRP2))) {
-		vmcs12->guest_es_base = evmcs->guest_es_base;
-		vmcs12->guest_cs_base = evmcs->guest_cs_base;
-		vmcs12->guest_ss_base = evmcs->guest_ss_base;
-		vmcs12->guest_ds_base = evmcs->guest_ds_base;
-		vmcs12->guest_fs_base = evmcs->guest_fs_base;
-		vmcs12->guest_gs_base = evmcs->guest_gs_base;
-		vmcs12->guest_ldtr_base = evmcs->guest_ldtr_base;
-		vmcs12->guest_tr_base = evmcs->guest_tr_base;
-		vmcs12->guest_gdtr_base = evmcs->guest_gdtr_base;
-		vmcs12->guest_idtr_base = evmcs->guest_idtr_base;
-		vmcs12->guest_es_limit = evmcs->guest_es_limit;
-		vmcs12->guest_cs_limit = evmcs->guest_cs_limit;
-		vmcs12->guest_ss_limit = evmcs->guest_ss_limit;
-		vmcs12->guest_ds_limit = evmcs->guest_ds_limit;
-		vmcs12->guest_fs_limit = evmcs->guest_fs_limit;
-		vmcs12->guest_gs_limit = evmcs->guest_gs_limit;
-		vmcs12->guest_ldtr_limit = evmcs->guest_ldtr_limit;
-		vmcs12->guest_tr_limit = evmcs->guest_tr_limit;
-		vmcs12->guest_gdtr_limit = evmcs->guest_gdtr_limit;
-		vmcs12->guest_idtr_limit = evmcs->guest_idtr_limit;
-		vmcs12->guest_es_ar_bytes = evmcs->guest_es_ar_bytes;
-		vmcs12->guest_cs_ar_bytes = evmcs->guest_cs_ar_bytes;
-		vmcs12->guest_ss_ar_bytes = evmcs->guest_ss_ar_bytes;
-		vmcs12->guest_ds_ar_bytes = evmcs->guest_ds_ar_bytes;
-		vmcs12->guest_fs_ar_bytes = evmcs->guest_fs_ar_bytes;
-		vmcs12->guest_gs_ar_bytes = evmcs->guest_gs_ar_bytes;
-		vmcs12->guest_ldtr_ar_bytes = evmcs->guest_ldtr_ar_bytes;
-		vmcs12->guest_tr_ar_bytes = evmcs->guest_tr_ar_bytes;
-		vmcs12->guest_es_selector = evmcs->guest_es_selector;
-		vmcs12->guest_cs_selector = evmcs->guest_cs_selector;
-		vmcs12->guest_ss_selector = evmcs->guest_ss_selector;
-		vmcs12->guest_ds_selector = evmcs->guest_ds_selector;
-		vmcs12->guest_fs_selector = evmcs->guest_fs_selector;
-		vmcs12->guest_gs_selector = evmcs->guest_gs_selector;
-		vmcs12->guest_ldtr_selector = evmcs->guest_ldtr_selector;
-		vmcs12->guest_tr_selector = evmcs->guest_tr_selector;
+		COPY_EVMCS_FIELD(guest_es_base);
+		COPY_EVMCS_FIELD(guest_cs_base);
+		COPY_EVMCS_FIELD(guest_ss_base);
+		COPY_EVMCS_FIELD(guest_ds_base);
+		COPY_EVMCS_FIELD(guest_fs_base);
+		COPY_EVMCS_FIELD(guest_gs_base);
+		COPY_EVMCS_FIELD(guest_ldtr_base);
+		COPY_EVMCS_FIELD(guest_tr_base);
+		COPY_EVMCS_FIELD(guest_gdtr_base);
+		COPY_EVMCS_FIELD(guest_idtr_base);
+		COPY_EVMCS_FIELD(guest_es_limit);
+		COPY_EVMCS_FIELD(guest_cs_limit);
+		COPY_EVMCS_FIELD(guest_ss_limit);
+		COPY_EVMCS_FIELD(guest_ds_limit);
+		COPY_EVMCS_FIELD(guest_fs_limit);
+		COPY_EVMCS_FIELD(guest_gs_limit);
+		COPY_EVMCS_FIELD(guest_ldtr_limit);
+		COPY_EVMCS_FIELD(guest_tr_limit);
+		COPY_EVMCS_FIELD(guest_gdtr_limit);
+		COPY_EVMCS_FIELD(guest_idtr_limit);
+		COPY_EVMCS_FIELD(guest_es_ar_bytes);
+		COPY_EVMCS_FIELD(guest_cs_ar_bytes);
+		COPY_EVMCS_FIELD(guest_ss_ar_bytes);
+		COPY_EVMCS_FIELD(guest_ds_ar_bytes);
+		COPY_EVMCS_FIELD(guest_fs_ar_bytes);
+		COPY_EVMCS_FIELD(guest_gs_ar_bytes);
+		COPY_EVMCS_FIELD(guest_ldtr_ar_bytes);
+		COPY_EVMCS_FIELD(guest_tr_ar_bytes);
+		COPY_EVMCS_FIELD(guest_es_selector);
+		COPY_EVMCS_FIELD(guest_cs_selector);
+		COPY_EVMCS_FIELD(guest_ss_selector);
+		COPY_EVMCS_FIELD(guest_ds_selector);
+		COPY_EVMCS_FIELD(guest_fs_selector);
+		COPY_EVMCS_FIELD(guest_gs_selector);
+		COPY_EVMCS_FIELD(guest_ldtr_selector);
+		COPY_EVMCS_FIELD(guest_tr_selector);
 	}
 
 	if (unlikely(!(evmcs->hv_clean_fields &
 		       HV_VMX_ENLIGHTENED_CLEAN_FIELD_CONTROL_GRP2))) {
-		vmcs12->tsc_offset = evmcs->tsc_offset;
-		vmcs12->virtual_apic_page_addr = evmcs->virtual_apic_page_addr;
-		vmcs12->xss_exit_bitmap = evmcs->xss_exit_bitmap;
+		COPY_EVMCS_FIELD(tsc_offset);
+		COPY_EVMCS_FIELD(virtual_apic_page_addr);
+		COPY_EVMCS_FIELD(xss_exit_bitmap);
 	}
 
 	if (unlikely(!(evmcs->hv_clean_fields &
 		       HV_VMX_ENLIGHTENED_CLEAN_FIELD_CRDR))) {
-		vmcs12->cr0_guest_host_mask = evmcs->cr0_guest_host_mask;
-		vmcs12->cr4_guest_host_mask = evmcs->cr4_guest_host_mask;
-		vmcs12->cr0_read_shadow = evmcs->cr0_read_shadow;
-		vmcs12->cr4_read_shadow = evmcs->cr4_read_shadow;
-		vmcs12->guest_cr0 = evmcs->guest_cr0;
-		vmcs12->guest_cr3 = evmcs->guest_cr3;
-		vmcs12->guest_cr4 = evmcs->guest_cr4;
-		vmcs12->guest_dr7 = evmcs->guest_dr7;
+		COPY_EVMCS_FIELD(cr0_guest_host_mask);
+		COPY_EVMCS_FIELD(cr4_guest_host_mask);
+		COPY_EVMCS_FIELD(cr0_read_shadow);
+		COPY_EVMCS_FIELD(cr4_read_shadow);
+		COPY_EVMCS_FIELD(guest_cr0);
+		COPY_EVMCS_FIELD(guest_cr3);
+		COPY_EVMCS_FIELD(guest_cr4);
+		COPY_EVMCS_FIELD(guest_dr7);
 	}
 
 	if (unlikely(!(evmcs->hv_clean_fields &
 		       HV_VMX_ENLIGHTENED_CLEAN_FIELD_HOST_POINTER))) {
-		vmcs12->host_fs_base = evmcs->host_fs_base;
-		vmcs12->host_gs_base = evmcs->host_gs_base;
-		vmcs12->host_tr_base = evmcs->host_tr_base;
-		vmcs12->host_gdtr_base = evmcs->host_gdtr_base;
-		vmcs12->host_idtr_base = evmcs->host_idtr_base;
-		vmcs12->host_rsp = evmcs->host_rsp;
+		COPY_EVMCS_FIELD(host_fs_base);
+		COPY_EVMCS_FIELD(host_gs_base);
+		COPY_EVMCS_FIELD(host_tr_base);
+		COPY_EVMCS_FIELD(host_gdtr_base);
+		COPY_EVMCS_FIELD(host_idtr_base);
+		COPY_EVMCS_FIELD(host_rsp);
 	}
 
 	if (unlikely(!(evmcs->hv_clean_fields &
 		       HV_VMX_ENLIGHTENED_CLEAN_FIELD_CONTROL_XLAT))) {
-		vmcs12->ept_pointer = evmcs->ept_pointer;
-		vmcs12->virtual_processor_id = evmcs->virtual_processor_id;
+		COPY_EVMCS_FIELD(ept_pointer);
+		COPY_EVMCS_FIELD(virtual_processor_id);
 	}
 
 	if (unlikely(!(evmcs->hv_clean_fields &
 		       HV_VMX_ENLIGHTENED_CLEAN_FIELD_GUEST_GRP1))) {
-		vmcs12->vmcs_link_pointer = evmcs->vmcs_link_pointer;
-		vmcs12->guest_ia32_debugctl = evmcs->guest_ia32_debugctl;
-		vmcs12->guest_ia32_pat = evmcs->guest_ia32_pat;
-		vmcs12->guest_ia32_efer = evmcs->guest_ia32_efer;
-		vmcs12->guest_pdptr0 = evmcs->guest_pdptr0;
-		vmcs12->guest_pdptr1 = evmcs->guest_pdptr1;
-		vmcs12->guest_pdptr2 = evmcs->guest_pdptr2;
-		vmcs12->guest_pdptr3 = evmcs->guest_pdptr3;
-		vmcs12->guest_pending_dbg_exceptions =
-			evmcs->guest_pending_dbg_exceptions;
-		vmcs12->guest_sysenter_esp = evmcs->guest_sysenter_esp;
-		vmcs12->guest_sysenter_eip = evmcs->guest_sysenter_eip;
-		vmcs12->guest_bndcfgs = evmcs->guest_bndcfgs;
-		vmcs12->guest_activity_state = evmcs->guest_activity_state;
-		vmcs12->guest_sysenter_cs = evmcs->guest_sysenter_cs;
+		COPY_EVMCS_FIELD(vmcs_link_pointer);
+		COPY_EVMCS_FIELD(guest_ia32_debugctl);
+		COPY_EVMCS_FIELD(guest_ia32_pat);
+		COPY_EVMCS_FIELD(guest_ia32_efer);
+		COPY_EVMCS_FIELD(guest_pdptr0);
+		COPY_EVMCS_FIELD(guest_pdptr1);
+		COPY_EVMCS_FIELD(guest_pdptr2);
+		COPY_EVMCS_FIELD(guest_pdptr3);
+		COPY_EVMCS_FIELD(guest_pending_dbg_exceptions);
+		COPY_EVMCS_FIELD(guest_sysenter_esp);
+		COPY_EVMCS_FIELD(guest_sysenter_eip);
+		COPY_EVMCS_FIELD(guest_bndcfgs);
+		COPY_EVMCS_FIELD(guest_activity_state);
+		COPY_EVMCS_FIELD(guest_sysenter_cs);
 	}
 
 	/*
@@ -1813,6 +1933,11 @@ static int copy_enlightened_to_vmcs12(struct vcpu_vmx *vmx)
 	 * vmcs12->exit_io_instruction_eip = evmcs->exit_io_instruction_eip;
 	 */
 
+#undef COPY_EVMCS_FIELD
+
+	vmx->vcpu.stat.evmcs_copies++;
+	vmx->vcpu.stat.evmcs_copied_bytes += copied;
+
 	return 0;
 }
 
@@ -1979,6 +2104,60 @@ static int copy_vmcs12_to_enlightened(struct vcpu_vmx *vmx)
 	return 0;
 }
 
+/*
+ * Make the vmcs12 of the enlightened VMCS at @gpa the current one, and stash
+ * the vmcs12 of the previous eVMCS, which is at @prev_gpa or -1ull, in
+ * prev_evmcs.  Returns true if the vmcs12 still holds the contents of the
+ * eVMCS from when L1 last used it, i.e. the clean fields can be honored.
+ */
+static bool nested_evmcs_switch_vmcs12(struct vcpu_vmx *vmx, gpa_t prev_gpa,
+				       gpa_t gpa)
+{
+	struct nested_vmx *nested = &vmx->nested;
+	typeof(nested->prev_evmcs[0]) cur, *prev = nested->prev_evmcs;
+	bool hit = true;
+	int i, j;
+
+	/*
+	 * Without a previous eVMCS, e.g. after KVM_SET_NESTED_STATE, the
+	 * current vmcs12 is the only up to date one, keep it.
+	 */
+	if (prev_gpa == -1ull)
+		return false;
+
+	for (i = 0; i < NR_PREV_EVMCS; i++) {
+		if (prev[i].vmcs12 && prev[i].gpa == gpa)
+			break;
+	}
+
+	if (i == NR_PREV_EVMCS) {
+		/* Reuse the least recently used vmcs12, or add a new one. */
+		i = NR_PREV_EVMCS - 1;
+		if (!prev[i].vmcs12) {
+			prev[i].vmcs12 = kmalloc(VMCS12_SIZE,
+						 GFP_KERNEL_ACCOUNT);
+			if (!prev[i].vmcs12)
+				return false;
+		}
+
+		/*
+		 * Not all of vmcs12 is copied from the eVMCS, start from the
+		 * current vmcs12 like a single vmcs12 would.
+		 */
+		memcpy(prev[i].vmcs12, nested->cached_vmcs12, VMCS12_SIZE);
+		prev[i].gpa = -1ull;
+		hit = false;
+	}
+
+	cur.gpa = prev_gpa;
+	cur.vmcs12 = nested->cached_vmcs12;
+	for (j = 0; j <= i; j++)
+		swap(cur, prev[j]);
+
+	nested->cached_vmcs12 = cur.vmcs12;
+	return hit;
+}
+
 /*
  * This is an equivalent of the nested hypervisor executing the vmptrld
  * instruction.
@@ -1988,6 +2167,8 @@ static enum nested_evmptrld_status nested_vmx_handle_enlightened_vmptrld(
 {
 	struct vcpu_vmx *vmx = to_vmx(vcpu);
 	bool evmcs_gpa_changed = false;
+	bool evmcs_cached = false;
+	gpa_t prev_evmcs_gpa;
 	u64 evmcs_gpa;
 
 	if (likely(!vmx->nested.enlightened_vmcs_enabled))
@@ -2001,6 +2182,8 @@ static enum nested_evmptrld_status nested_vmx_handle_enlightened_vmptrld(
 		if (!vmx->nested.hv_evmcs)
 			vmx->nested.current_vmptr = -1ull;
 
+		prev_evmcs_gpa = vmx->nested.hv_evmcs ?
+				 vmx->nested.hv_evmcs_vmptr : -1ull;
 		nested_release_evmcs(vcpu);
 
 		if (kvm_vcpu_map(vcpu, gpa_to_gfn(evmcs_gpa),
@@ -2037,10 +2220,12 @@ static enum nested_evmptrld_status nested_vmx_handle_enlightened_vmptrld(
 			return EVMPTRLD_VMFAIL;
 		}
 
-		vmx->nested.dirty_vmcs12 = true;
+		vmx->nested.dirty_vmcs12 = VMCS12_DIRTY_ALL;
 		vmx->nested.hv_evmcs_vmptr = evmcs_gpa;
 
 		evmcs_gpa_changed = true;
+		evmcs_cached = nested_evmcs_switch_vmcs12(vmx, prev_evmcs_gpa,
+							  evmcs_gpa);
 		/*
 		 * Unlike normal vmcs12, enlightened vmcs12 is not fully
 		 * reloaded from guest's memory (read only fields, fields not
@@ -2056,10 +2241,11 @@ static enum nested_evmptrld_status nested_vmx_handle_enlightened_vmptrld(
 	}
 
 	/*
-	 * Clean fields data can't be used on VMLAUNCH and when we switch
-	 * between different L2 guests as KVM keeps a single VMCS12 per L1.
+	 * Clean fields data can't be used on VMLAUNCH, nor when switching to
+	 * an eVMCS whose vmcs12 is no longer cached.  vmcs02 is still
+	 * refreshed in full on any switch, see nested_vmcs12_dirty().
 	 */
-	if (from_launch || evmcs_gpa_changed)
+	if (from_launch || (evmcs_gpa_changed && !evmcs_cached))
 		vmx->nested.hv_evmcs->hv_clean_fields &=
 			~HV_VMX_ENLIGHTENED_CLEAN_FIELD_ALL;
 
@@ -2184,7 +2370,7 @@ static void prepare_vmcs02_constant_state(struct vcpu_vmx *vmx)
 	 * the log and reset GUEST_PML_INDEX on each vmexit, the PML
 	 * index is also effectively constant in vmcs02.
 	 */
-	if (enable_pml) {
+	if (vmx->pml_pg) {
 		vmcs_write64(PML_ADDRESS, page_to_phys(vmx->pml_pg));
 		vmcs_write16(GUEST_PML_INDEX, PML_ENTITY_NUM - 1);
 	}
@@ -2219,12 +2405,34 @@ static void prepare_vmcs02_early_rare(struct vcpu_vmx *vmx,
 	}
 }
 
+/*
+ * Return the groups of vmcs12 fields that must be copied to vmcs02.  With an
+ * enlightened VMCS, L1 reports them itself in hv_clean_fields, but vmcs02
+ * holds the state of another eVMCS after a switch.
+ */
+static u32 nested_vmcs12_dirty(struct vcpu_vmx *vmx)
+{
+	struct hv_enlightened_vmcs *hv_evmcs = vmx->nested.hv_evmcs;
+	u32 dirty = VMCS12_DIRTY_OTHER | vmx->nested.dirty_vmcs12;
+
+	if (!hv_evmcs)
+		return vmx->nested.dirty_vmcs12;
+
+	if (!(hv_evmcs->hv_clean_fields &
+	      HV_VMX_ENLIGHTENED_CLEAN_FIELD_GUEST_GRP2))
+		dirty |= VMCS12_DIRTY_GUEST_SEG;
+	if (!(hv_evmcs->hv_clean_fields &
+	      HV_VMX_ENLIGHTENED_CLEAN_FIELD_GUEST_GRP1))
+		dirty |= VMCS12_DIRTY_GUEST_MISC;
+	return dirty;
+}
+
 static void prepare_vmcs02_early(struct vcpu_vmx *vmx, struct vmcs12 *vmcs12)
 {
 	u32 exec_control, vmcs12_exec_ctrl;
 	u64 guest_efer = nested_vmx_calc_efer(vmx, vmcs12);
 
-	if (vmx->nested.dirty_vmcs12 || vmx->nested.hv_evmcs)
+	if (nested_vmcs12_dirty(vmx) & VMCS12_DIRTY_OTHER)
 		prepare_vmcs02_early_rare(vmx, vmcs12);
 
 	/*
@@ -2374,12 +2582,10 @@ static void prepare_vmcs02_early(struct vcpu_vmx *vmx, struct vmcs12 *vmcs12)
 	}
 }
 
-static void prepare_vmcs02_rare(struct vcpu_vmx *vmx, struct vmcs12 *vmcs12)
+static void prepare_vmcs02_rare(struct vcpu_vmx *vmx, struct vmcs12 *vmcs12,
+				u32 dirty)
 {
-	struct hv_enlightened_vmcs *hv_evmcs = vmx->nested.hv_evmcs;
-
-	if (!hv_evmcs || !(hv_evmcs->hv_clean_fields &
-			   HV_VMX_ENLIGHTENED_CLEAN_FIELD_GUEST_GRP2)) {
+	if (dirty & VMCS12_DIRTY_GUEST_SEG) {
 		vmcs_write16(GUEST_ES_SELECTOR, vmcs12->guest_es_selector);
 		vmcs_write16(GUEST_CS_SELECTOR, vmcs12->guest_cs_selector);
 		vmcs_write16(GUEST_SS_SELECTOR, vmcs12->guest_ss_selector);
@@ -2420,8 +2626,7 @@ static void prepare_vmcs02_rare(struct vcpu_vmx *vmx, struct vmcs12 *vmcs12)
 		vmx->segment_cache.bitmask = 0;
 	}
 
-	if (!hv_evmcs || !(hv_evmcs->hv_clean_fields &
-			   HV_VMX_ENLIGHTENED_CLEAN_FIELD_GUEST_GRP1)) {
+	if (dirty & VMCS12_DIRTY_GUEST_MISC) {
 		vmcs_write32(GUEST_SYSENTER_CS, vmcs12->guest_sysenter_cs);
 		vmcs_writel(GUEST_PENDING_DBG_EXCEPTIONS,
 			    vmcs12->guest_pending_dbg_exceptions);
@@ -2444,6 +2649,9 @@ static void prepare_vmcs02_rare(struct vcpu_vmx *vmx, struct vmcs12 *vmcs12)
 			vmcs_write64(GUEST_BNDCFGS, vmcs12->guest_bndcfgs);
 	}
 
+	if (!(dirty & VMCS12_DIRTY_OTHER))
+		return;
+
 	if (nested_cpu_has_xsaves(vmcs12))
 		vmcs_write64(XSS_EXIT_BITMAP, vmcs12->xss_exit_bitmap);
 
@@ -2507,16 +2715,14 @@ static int prepare_vmcs02(struct kvm_vcpu *vcpu, struct vmcs12 *vmcs12,
 			  enum vm_entry_failure_code *entry_failure_code)
 {
 	struct vcpu_vmx *vmx = to_vmx(vcpu);
-	struct hv_enlightened_vmcs *hv_evmcs = vmx->nested.hv_evmcs;
+	u32 dirty = nested_vmcs12_dirty(vmx);
 	bool load_guest_pdptrs_vmcs12 = false;
 
-	if (vmx->nested.dirty_vmcs12 || hv_evmcs) {
-		prepare_vmcs02_rare(vmx, vmcs12);
-		vmx->nested.dirty_vmcs12 = false;
+	if (dirty) {
+		prepare_vmcs02_rare(vmx, vmcs12, dirty);
+		vmx->nested.dirty_vmcs12 = 0;
 
-		load_guest_pdptrs_vmcs12 = !hv_evmcs ||
-			!(hv_evmcs->hv_clean_fields &
-			  HV_VMX_ENLIGHTENED_CLEAN_FIELD_GUEST_GRP1);
+		load_guest_pdptrs_vmcs12 = dirty & VMCS12_DIRTY_GUEST_MISC;
 	}
 
 	if (vmx->nested.nested_run_pending &&
@@ -4492,6 +4698,11 @@ void nested_vmx_vmexit(struct kvm_vcpu *vcpu, u32 vm_exit_reason,
 		vmx_set_virtual_apic_mode(vcpu);
 	}
 
+	if (vmx->nested.update_vmcs01_cpu_dirty_logging) {
+		vmx->nested.update_vmcs01_cpu_dirty_logging = false;
+		vmx_enable_pml(vmx);
+	}
+
 	/* Unpin physical memory we referred to in vmcs02 */
 	if (vmx->nested.apic_access_page) {
 		kvm_release_page_clean(vmx->nested.apic_access_page);
@@ -4898,8 +5109,12 @@ static inline void nested_release_vmcs12(struct kvm_vcpu *vcpu)
 				  vmx->nested.current_vmptr >> PAGE_SHIFT,
 				  vmx->nested.cached_vmcs12, 0, VMCS12_SIZE);
 
-	kvm_mmu_free_roots(vcpu, &vcpu->arch.guest_mmu, KVM_MMU_ROOTS_ALL);
-
+	/*
+	 * Keep the shadow EPT roots, the EPT-derived translations are tagged
+	 * by EPTP and not by the VMCS, i.e. they survive VMPTRLD and VMCLEAR
+	 * and must be flushed by L1 with INVEPT.  This lets L1 switch between
+	 * L2s without refaulting their whole address space.
+	 */
 	vmx->nested.current_vmptr = -1ull;
 }
 
@@ -4975,6 +5190,154 @@ static int handle_vmresume(struct kvm_vcpu *vcpu)
 	return nested_vmx_run(vcpu, false);
 }
 
+static bool is_shadow_field_rw(unsigned long field)
+{
+	switch (field) {
+#define SHADOW_FIELD_RW(x, y) case x:
+#include "vmcs_shadow_fields.h"
+		return true;
+	default:
+		break;
+	}
+	return false;
+}
+
+static bool is_shadow_field_ro(unsigned long field)
+{
+	switch (field) {
+#define SHADOW_FIELD_RO(x, y) case x:
+#include "vmcs_shadow_fields.h"
+		return true;
+	default:
+		break;
+	}
+	return false;
+}
+
+static void nested_vmx_promote_shadow_field(struct vcpu_vmx *vmx, u16 field,
+					    u16 offset)
+{
+	struct hot_shadow_vmcs *hot = vmx->nested.hot_shadow;
+	struct vmcs12 *vmcs12 = get_vmcs12(&vmx->vcpu);
+	bool read_only = vmcs_field_readonly(field);
+	struct shadow_vmcs_field *fields;
+	int *nr_fields, i;
+
+	if (read_only) {
+		fields = hot->read_only_fields;
+		nr_fields = &hot->nr_read_only_fields;
+	} else {
+		fields = hot->read_write_fields;
+		nr_fields = &hot->nr_read_write_fields;
+	}
+
+	if (*nr_fields == HOT_SHADOW_NR_FIELDS)
+		return;
+
+	/*
+	 * Fields that are emulated by KVM, e.g. PML and the preemption timer
+	 * on CPUs without them, can't be held by the shadow VMCS.
+	 */
+	if (!vmcs_field_exists(field))
+		return;
+
+	if (!hot->bitmap[VMX_VMREAD_BITMAP]) {
+		for (i = 0; i < VMX_BITMAP_NR; i++) {
+			hot->bitmap[i] = (unsigned long *)
+				__get_free_page(GFP_KERNEL_ACCOUNT);
+			if (!hot->bitmap[i])
+				goto out_free_bitmaps;
+			memcpy(hot->bitmap[i], vmx_bitmap[i], PAGE_SIZE);
+		}
+		vmcs_write64(VMREAD_BITMAP,
+			     __pa(hot->bitmap[VMX_VMREAD_BITMAP]));
+		vmcs_write64(VMWRITE_BITMAP,
+			     __pa(hot->bitmap[VMX_VMWRITE_BITMAP]));
+	}
+
+	/*
+	 * "Read-only" fields are shadowed only for VMREAD, VMWRITEs from L1
+	 * keep exiting and are mirrored to the shadow VMCS by handle_vmwrite().
+	 * Accesses to the high half of a 64-bit field go to the shadow VMCS
+	 * as well, but only the full field needs to be synced.
+	 */
+	clear_bit(field, hot->bitmap[VMX_VMREAD_BITMAP]);
+	if (!read_only)
+		clear_bit(field, hot->bitmap[VMX_VMWRITE_BITMAP]);
+	if (vmcs_field_width(field) == VMCS_FIELD_WIDTH_U64) {
+		clear_bit(field + 1, hot->bitmap[VMX_VMREAD_BITMAP]);
+		if (!read_only)
+			clear_bit(field + 1, hot->bitmap[VMX_VMWRITE_BITMAP]);
+	}
+
+	fields[(*nr_fields)++] = (struct shadow_vmcs_field) { field, offset };
+
+	/* L1 couldn't access the field without exiting, vmcs12 is current. */
+	preempt_disable();
+	vmcs_load(vmx->vmcs01.shadow_vmcs);
+
+	__vmcs_writel(field, vmcs12_read_any(vmcs12, field, offset));
+
+	vmcs_clear(vmx->vmcs01.shadow_vmcs);
+	vmcs_load(vmx->loaded_vmcs->vmcs);
+	preempt_enable();
+	return;
+
+out_free_bitmaps:
+	for (i = 0; i < VMX_BITMAP_NR; i++) {
+		free_page((unsigned long)hot->bitmap[i]);
+		hot->bitmap[i] = NULL;
+	}
+}
+
+/*
+ * Account a VMREAD or VMWRITE from L1 that exited because @field isn't
+ * shadowed, and add the field to the shadow VMCS of the vCPU once it was
+ * accessed hot_shadow_vmcs_threshold times within HOT_SHADOW_WINDOW exits.
+ * Fields that vmcs12 holds a stale value for while L1 runs, i.e. the ones
+ * synced lazily by copy_vmcs02_to_vmcs12_rare(), and the AR bytes, whose
+ * reserved bits are dropped on VMWRITE, are never shadowed.
+ */
+static void nested_vmx_hot_shadow_access(struct kvm_vcpu *vcpu,
+					 unsigned long field)
+{
+	struct vcpu_vmx *vmx = to_vmx(vcpu);
+	struct hot_shadow_vmcs *hot = vmx->nested.hot_shadow;
+	short offset;
+	u8 *hits;
+
+	if (!enable_shadow_vmcs || !hot_shadow_vmcs_threshold ||
+	    is_guest_mode(vcpu))
+		return;
+
+	/* Track 64-bit fields by their full encoding. */
+	field &= ~1ul;
+
+	offset = vmcs_field_to_offset(field);
+	if (offset < 0 || is_vmcs12_ext_field(field) ||
+	    is_shadow_field_rw(field) || is_shadow_field_ro(field) ||
+	    (field >= GUEST_ES_AR_BYTES && field <= GUEST_TR_AR_BYTES))
+		return;
+
+	if (!hot) {
+		hot = kzalloc(sizeof(*hot), GFP_KERNEL_ACCOUNT);
+		if (!hot)
+			return;
+		vmx->nested.hot_shadow = hot;
+	}
+
+	if (++hot->nr_accesses == HOT_SHADOW_WINDOW) {
+		hot->nr_accesses = 0;
+		memset(hot->hits, 0, sizeof(hot->hits));
+	}
+
+	hits = &hot->hits[offset / sizeof(u16)];
+	if (++(*hits) < hot_shadow_vmcs_threshold)
+		return;
+
+	*hits = 0;
+	nested_vmx_promote_shadow_field(vmx, field, offset);
+}
 static int handle_vmread(struct kvm_vcpu *vcpu)
 {
 	struct vmcs12 *vmcs12 = is_guest_mode(vcpu) ? get_shadow_vmcs12(vcpu)
@@ -5032,31 +5395,9 @@ static int handle_vmread(struct kvm_vcpu *vcpu)
 			return kvm_handle_memory_failure(vcpu, r, &e);
 	}
 
-	return nested_vmx_succeed(vcpu);
-}
-
-static bool is_shadow_field_rw(unsigned long field)
-{
-	switch (field) {
-#define SHADOW_FIELD_RW(x, y) case x:
-#include "vmcs_shadow_fields.h"
-		return true;
-	default:
-		break;
-	}
-	return false;
-}
+	nested_vmx_hot_shadow_access(vcpu, field);
 
-static bool is_shadow_field_ro(unsigned long field)
-{
-	switch (field) {
-#define SHADOW_FIELD_RO(x, y) case x:
-#include "vmcs_shadow_fields.h"
-		return true;
-	default:
-		break;
-	}
-	return false;
+	return nested_vmx_succeed(vcpu);
 }
 
 static int handle_vmwrite(struct kvm_vcpu *vcpu)
@@ -5150,7 +5491,8 @@ static int handle_vmwrite(struct kvm_vcpu *vcpu)
 		 * L1 can read these fields without exiting, ensure the
 		 * shadow VMCS is up-to-date.
 		 */
-		if (enable_shadow_vmcs && is_shadow_field_ro(field)) {
+		if (enable_shadow_vmcs && (is_shadow_field_ro(field) ||
+					   is_hot_shadow_field_ro(vmx, field))) {
 			preempt_disable();
 			vmcs_load(vmx->vmcs01.shadow_vmcs);
 
@@ -5160,9 +5502,11 @@ static int handle_vmwrite(struct kvm_vcpu *vcpu)
 			vmcs_load(vmx->loaded_vmcs->vmcs);
 			preempt_enable();
 		}
-		vmx->nested.dirty_vmcs12 = true;
+		vmx->nested.dirty_vmcs12 |= vmcs12_field_dirty_group(field);
 	}
 
+	nested_vmx_hot_shadow_access(vcpu, field);
+
 	return nested_vmx_succeed(vcpu);
 }
 
@@ -5175,7 +5519,7 @@ static void set_current_vmptr(struct vcpu_vmx *vmx, gpa_t vmptr)
 			     __pa(vmx->vmcs01.shadow_vmcs));
 		vmx->nested.need_vmcs12_to_shadow_sync = true;
 	}
-	vmx->nested.dirty_vmcs12 = true;
+	vmx->nested.dirty_vmcs12 = VMCS12_DIRTY_ALL;
 }
 
 /* Emulate the VMPTRLD instruction */
@@ -5336,7 +5680,7 @@ static int handle_invept(struct kvm_vcpu *vcpu)
 					    operand.eptp))
 			roots_to_free |= KVM_MMU_ROOT_CURRENT;
 
-		for (i = 0; i < KVM_MMU_NUM_PREV_ROOTS; i++) {
+		for (i = 0; i < mmu->nr_prev_roots; i++) {
 			if (nested_ept_root_matches(mmu->prev_roots[i].hpa,
 						    mmu->prev_roots[i].pgd,
 						    operand.eptp))
@@ -6286,7 +6630,7 @@ static int vmx_set_nested_state(struct kvm_vcpu *vcpu,
 	    nested_vmx_check_guest_state(vcpu, vmcs12, &ignored))
 		goto error_guest_mode;
 
-	vmx->nested.dirty_vmcs12 = true;
+	vmx->nested.dirty_vmcs12 = VMCS12_DIRTY_ALL;
 	ret = nested_vmx_enter_non_root_mode(vcpu, false);
 	if (ret)
 		goto error_guest_mode;
@@ -6569,6 +6913,12 @@ __init int nested_vmx_hardware_setup(int (*exit_handlers[])(struct kvm_vcpu *))
 
 	if (!cpu_has_vmx_shadow_vmcs())
 		enable_shadow_vmcs = 0;
+	/*
+	 * The runtime shadowed fields are synced without the 32-bit halves of
+	 * 64-bit fields, and probed with a raw VMREAD.
+	 */
+	if (!IS_ENABLED(CONFIG_X86_64) || static_branch_unlikely(&enable_evmcs))
+		hot_shadow_vmcs_threshold = 0;
 	if (enable_shadow_vmcs) {
 		for (i = 0; i < VMX_BITMAP_NR; i++) {
 			/*
@@ -11,6 +11,8 @@
 #include <linux/types.h>
 #include <linux/kvm_host.h>
 #include <linux/perf_event.h>
+#include <asm/apic.h>
+#include <asm/nmi.h>
 #include <asm/perf_event.h>
 #include "x86.h"
 #include "cpuid.h"
@@ -35,6 +37,22 @@ static struct kvm_event_hw_type_mapping intel_arch_events[] = {
 /* mapping between fixed pmc index and intel_arch_events array */
 static int fixed_pmc_events[] = {1, 0, 7};
 
+/*
+ * Give the hardware counters to guests whose PMU matches the host's, instead
+ * of backing them with perf_events.  The counters are reserved from perf for
+ * as long as such a vCPU exists, so this is a mode for hosts that dedicate
+ * the PMU to their guests, and it is not used for VMs with an event filter.
+ * The event selectors stay intercepted, so that their reserved bits, AnyThread
+ * in particular, are checked like for any other guest.
+ */
+static bool __read_mostly enable_pmu_passthrough;
+module_param_named(pmu_passthrough, enable_pmu_passthrough, bool, 0444);
+
+/* The PMU whose counters are loaded on this CPU, if any. */
+static DEFINE_PER_CPU(struct kvm_pmu *, passthrough_pmu);
+/* A guest PMI was processed at VM-exit, its NMI is still to come. */
+static DEFINE_PER_CPU(bool, passthrough_pmi);
+
 static void reprogram_fixed_counters(struct kvm_pmu *pmu, u64 data)
 {
 	int i;
@@ -50,7 +68,7 @@ static void reprogram_fixed_counters(struct kvm_pmu *pmu, u64 data)
 			continue;
 
 		__set_bit(INTEL_PMC_IDX_FIXED + i, pmu->pmc_in_use);
-		reprogram_fixed_counter(pmc, new_ctrl, i);
+		kvm_pmu_request_counter_reprogram(pmc);
 	}
 
 	pmu->fixed_ctr_ctrl = data;
@@ -59,13 +77,17 @@ static void reprogram_fixed_counters(struct kvm_pmu *pmu, u64 data)
 /* function is called when global control register has been updated. */
 static void global_ctrl_changed(struct kvm_pmu *pmu, u64 data)
 {
+	struct kvm_pmc *pmc;
 	int bit;
 	u64 diff = pmu->global_ctrl ^ data;
 
 	pmu->global_ctrl = data;
 
-	for_each_set_bit(bit, (unsigned long *)&diff, X86_PMC_IDX_MAX)
-		reprogram_counter(pmu, bit);
+	for_each_set_bit(bit, (unsigned long *)&diff, X86_PMC_IDX_MAX) {
+		pmc = kvm_x86_ops.pmu_ops->pmc_idx_to_pmc(pmu, bit);
+		if (pmc)
+			kvm_pmu_request_counter_reprogram(pmc);
+	}
 }
 
 static unsigned intel_find_arch_event(struct kvm_pmu *pmu,
@@ -168,6 +190,16 @@ static inline struct kvm_pmc *get_fw_gp_pmc(struct kvm_pmu *pmu, u32 msr)
 	return get_gp_pmc(pmu, msr, MSR_IA32_PMC0);
 }
 
+static inline bool pebs_is_enabled(struct kvm_vcpu *vcpu)
+{
+	return vcpu->arch.perf_capabilities & PMU_CAP_PEBS_FORMAT;
+}
+
+static inline bool pebs_baseline_is_enabled(struct kvm_vcpu *vcpu)
+{
+	return vcpu->arch.perf_capabilities & PMU_CAP_PEBS_BASELINE;
+}
+
 static bool intel_is_valid_msr(struct kvm_vcpu *vcpu, u32 msr)
 {
 	struct kvm_pmu *pmu = vcpu_to_pmu(vcpu);
@@ -180,6 +212,15 @@ static bool intel_is_valid_msr(struct kvm_vcpu *vcpu, u32 msr)
 	case MSR_CORE_PERF_GLOBAL_OVF_CTRL:
 		ret = pmu->version > 1;
 		break;
+	case MSR_IA32_PEBS_ENABLE:
+		ret = pebs_is_enabled(vcpu);
+		break;
+	case MSR_IA32_DS_AREA:
+		ret = guest_cpuid_has(vcpu, X86_FEATURE_DS);
+		break;
+	case MSR_PEBS_DATA_CFG:
+		ret = pebs_baseline_is_enabled(vcpu);
+		break;
 	default:
 		ret = get_gp_pmc(pmu, msr, MSR_IA32_PERFCTR0) ||
 			get_gp_pmc(pmu, msr, MSR_P6_EVNTSEL0) ||
@@ -221,6 +262,15 @@ static int intel_pmu_get_msr(struct kvm_vcpu *vcpu, struct msr_data *msr_info)
 	case MSR_CORE_PERF_GLOBAL_OVF_CTRL:
 		msr_info->data = pmu->global_ovf_ctrl;
 		return 0;
+	case MSR_IA32_PEBS_ENABLE:
+		msr_info->data = pmu->pebs_enable;
+		return 0;
+	case MSR_IA32_DS_AREA:
+		msr_info->data = pmu->ds_area;
+		return 0;
+	case MSR_PEBS_DATA_CFG:
+		msr_info->data = pmu->pebs_data_cfg;
+		return 0;
 	default:
 		if ((pmc = get_gp_pmc(pmu, msr, MSR_IA32_PERFCTR0)) ||
 		    (pmc = get_gp_pmc(pmu, msr, MSR_IA32_PMC0))) {
@@ -253,7 +303,7 @@ static int intel_pmu_set_msr(struct kvm_vcpu *vcpu, struct msr_data *msr_info)
 	case MSR_CORE_PERF_FIXED_CTR_CTRL:
 		if (pmu->fixed_ctr_ctrl == data)
 			return 0;
-		if (!(data & 0xfffffffffffff444ull)) {
+		if (!(data & pmu->fixed_ctr_ctrl_mask)) {
 			reprogram_fixed_counters(pmu, data);
 			return 0;
 		}
@@ -280,6 +330,36 @@ static int intel_pmu_set_msr(struct kvm_vcpu *vcpu, struct msr_data *msr_info)
 			return 0;
 		}
 		break;
+	case MSR_IA32_PEBS_ENABLE:
+		if (pmu->pebs_enable == data)
+			return 0;
+		if (!(data & pmu->pebs_enable_mask)) {
+			u64 diff = pmu->pebs_enable ^ data;
+			int bit;
+
+			pmu->pebs_enable = data;
+			for_each_set_bit(bit, (unsigned long *)&diff,
+					 X86_PMC_IDX_MAX) {
+				pmc = kvm_x86_ops.pmu_ops->pmc_idx_to_pmc(pmu, bit);
+				if (pmc)
+					kvm_pmu_request_counter_reprogram(pmc);
+			}
+			return 0;
+		}
+		break;
+	case MSR_IA32_DS_AREA:
+		if (is_noncanonical_address(data, vcpu))
+			return 1;
+		pmu->ds_area = data;
+		return 0;
+	case MSR_PEBS_DATA_CFG:
+		if (pmu->pebs_data_cfg == data)
+			return 0;
+		if (!(data & pmu->pebs_data_cfg_mask)) {
+			pmu->pebs_data_cfg = data;
+			return 0;
+		}
+		break;
 	default:
 		if ((pmc = get_gp_pmc(pmu, msr, MSR_IA32_PERFCTR0)) ||
 		    (pmc = get_gp_pmc(pmu, msr, MSR_IA32_PMC0))) {
@@ -304,7 +384,8 @@ static int intel_pmu_set_msr(struct kvm_vcpu *vcpu, struct msr_data *msr_info)
 			if (data == pmc->eventsel)
 				return 0;
 			if (!(data & pmu->reserved_bits)) {
-				reprogram_gp_counter(pmc, data);
+				pmc->eventsel = data;
+				kvm_pmu_request_counter_reprogram(pmc);
 				return 0;
 			}
 		}
@@ -320,6 +401,7 @@ static void intel_pmu_refresh(struct kvm_vcpu *vcpu)
 	struct kvm_cpuid_entry2 *entry;
 	union cpuid10_eax eax;
 	union cpuid10_edx edx;
+	int i;
 
 	pmu->nr_arch_gp_counters = 0;
 	pmu->nr_arch_fixed_counters = 0;
@@ -327,7 +409,15 @@ static void intel_pmu_refresh(struct kvm_vcpu *vcpu)
 	pmu->counter_bitmask[KVM_PMC_FIXED] = 0;
 	pmu->version = 0;
 	pmu->reserved_bits = 0xffffffff00200000ull;
+	pmu->fixed_ctr_ctrl_mask = ~0ull;
+	pmu->pebs_enable_mask = ~0ull;
+	pmu->pebs_data_cfg_mask = ~0ull;
+	if (pmu->passthrough)
+		perf_guest_release_pmu();
+	pmu->passthrough = false;
 	vcpu->arch.perf_capabilities = 0;
+	/* Cleared below if the guest gets PEBS. */
+	vcpu->arch.ia32_misc_enable_msr |= MSR_IA32_MISC_ENABLE_PEBS_UNAVAIL;
 
 	entry = kvm_find_cpuid_entry(vcpu, 0xa, 0);
 	if (!entry)
@@ -359,6 +449,9 @@ static void intel_pmu_refresh(struct kvm_vcpu *vcpu)
 			((u64)1 << edx.split.bit_width_fixed) - 1;
 	}
 
+	for (i = 0; i < pmu->nr_arch_fixed_counters; i++)
+		pmu->fixed_ctr_ctrl_mask &= ~(0xbull << (i * 4));
+
 	pmu->global_ctrl = ((1ull << pmu->nr_arch_gp_counters) - 1) |
 		(((1ull << pmu->nr_arch_fixed_counters) - 1) << INTEL_PMC_IDX_FIXED);
 	pmu->global_ctrl_mask = ~pmu->global_ctrl;
@@ -375,11 +468,60 @@ static void intel_pmu_refresh(struct kvm_vcpu *vcpu)
 	    (entry->ebx & (X86_FEATURE_HLE|X86_FEATURE_RTM)))
 		pmu->reserved_bits ^= HSW_IN_TX|HSW_IN_TX_CHECKPOINTED;
 
+	if (vcpu->arch.perf_capabilities & PMU_CAP_PEBS_FORMAT) {
+		vcpu->arch.ia32_misc_enable_msr &= ~MSR_IA32_MISC_ENABLE_PEBS_UNAVAIL;
+		if (vcpu->arch.perf_capabilities & PMU_CAP_PEBS_BASELINE) {
+			pmu->pebs_enable_mask = ~pmu->global_ctrl;
+			pmu->reserved_bits &= ~ICL_EVENTSEL_ADAPTIVE;
+			for (i = 0; i < pmu->nr_arch_fixed_counters; i++)
+				pmu->fixed_ctr_ctrl_mask &=
+					~(1ull << (INTEL_PMC_IDX_FIXED + i * 4));
+			pmu->pebs_data_cfg_mask = ~0xff00000full;
+		} else {
+			pmu->pebs_enable_mask =
+				~((1ull << pmu->nr_arch_gp_counters) - 1);
+		}
+	}
+
 	bitmap_set(pmu->all_valid_pmc_idx,
 		0, pmu->nr_arch_gp_counters);
 	bitmap_set(pmu->all_valid_pmc_idx,
 		INTEL_PMC_MAX_GENERIC, pmu->nr_arch_fixed_counters);
 
+	/*
+	 * The guest can only be given the hardware counters if its PMU looks
+	 * exactly like the host's, as nothing is emulated in that mode, and
+	 * if no event filter has to be enforced on it.
+	 */
+	if (enable_pmu_passthrough && pmu->version >= 2 &&
+	    pmu->nr_arch_gp_counters == x86_pmu.num_counters_gp &&
+	    pmu->nr_arch_fixed_counters == x86_pmu.num_counters_fixed &&
+	    eax.split.bit_width == x86_pmu.bit_width_gp &&
+	    edx.split.bit_width_fixed == x86_pmu.bit_width_fixed &&
+	    !rcu_access_pointer(vcpu->kvm->arch.pmu_event_filter)) {
+		/* The vCPU's own perf_events would keep perf from yielding. */
+		for (i = 0; i < pmu->nr_arch_gp_counters; i++)
+			pmc_stop_counter(&pmu->gp_counters[i]);
+		for (i = 0; i < pmu->nr_arch_fixed_counters; i++)
+			pmc_stop_counter(&pmu->fixed_counters[i]);
+
+		if (perf_guest_reserve_pmu()) {
+			/* perf is in use on the host, keep emulating. */
+			bitmap_copy(pmu->reprogram_deferred,
+				    pmu->all_valid_pmc_idx, X86_PMC_IDX_MAX);
+			kvm_make_request(KVM_REQ_PMU, vcpu);
+			goto out;
+		}
+		pmu->passthrough = true;
+
+		/* The PEBS records would go to the host's DS area. */
+		vcpu->arch.perf_capabilities &= ~PMU_CAP_PEBS_MASK;
+		pmu->pebs_enable_mask = ~0ull;
+		vcpu->arch.ia32_misc_enable_msr |=
+			MSR_IA32_MISC_ENABLE_PEBS_UNAVAIL;
+	}
+
+out:
 	nested_vmx_pmu_entry_exit_ctls_update(vcpu);
 }
 
@@ -425,6 +567,182 @@ static void intel_pmu_reset(struct kvm_vcpu *vcpu)
 
 	pmu->fixed_ctr_ctrl = pmu->global_ctrl = pmu->global_status =
 		pmu->global_ovf_ctrl = 0;
+	pmu->pebs_enable = pmu->ds_area = pmu->pebs_data_cfg = 0;
+}
+
+/*
+ * Find the guest PEBS counters whose perf_event is not on the host counter of
+ * the same index, with the counters being enabled for the guest.
+ */
+void intel_pmu_cross_mapped_check(struct kvm_pmu *pmu)
+{
+	struct kvm_pmc *pmc;
+	int bit;
+
+	pmu->host_cross_mapped_mask = 0;
+	for_each_set_bit(bit, (unsigned long *)&pmu->global_ctrl,
+			 X86_PMC_IDX_MAX) {
+		pmc = kvm_x86_ops.pmu_ops->pmc_idx_to_pmc(pmu, bit);
+		if (!pmc || !pmc->perf_event ||
+		    !test_bit(bit, (unsigned long *)&pmu->pebs_enable))
+			continue;
+
+		if (pmc->perf_event->hw.idx != -1 &&
+		    pmc->perf_event->hw.idx != pmc->idx)
+			pmu->host_cross_mapped_mask |= BIT_ULL(pmc->perf_event->hw.idx);
+	}
+}
+
+/*
+ * Fold the overflows of the guest's counters into the virtual GLOBAL_STATUS
+ * and request a PMI if any of them has the interrupt enabled.  Called with the
+ * guest's counters loaded, from VM-exit and from NMI context.
+ */
+static bool intel_pmu_passthrough_sync_status(struct kvm_pmu *pmu)
+{
+	u64 status, fixed_ctr_ctrl, eventsel;
+	bool pmi = false;
+	int bit;
+
+	rdmsrl(MSR_CORE_PERF_GLOBAL_STATUS, status);
+	status &= ~pmu->global_ctrl_mask;
+	if (!status)
+		return false;
+
+	wrmsrl(MSR_CORE_PERF_GLOBAL_OVF_CTRL, status);
+	pmu->global_status |= status;
+
+	rdmsrl(MSR_CORE_PERF_FIXED_CTR_CTRL, fixed_ctr_ctrl);
+	for_each_set_bit(bit, (unsigned long *)&status, X86_PMC_IDX_MAX) {
+		if (bit < INTEL_PMC_IDX_FIXED) {
+			rdmsrl(MSR_P6_EVNTSEL0 + bit, eventsel);
+			pmi |= !!(eventsel & ARCH_PERFMON_EVENTSEL_INT);
+		} else {
+			pmi |= !!(fixed_ctrl_field(fixed_ctr_ctrl,
+					bit - INTEL_PMC_IDX_FIXED) & 0x8);
+		}
+	}
+
+	if (pmi)
+		kvm_make_request(KVM_REQ_PMI, pmu_to_vcpu(pmu));
+
+	return pmi;
+}
+
+/* Called with IRQs disabled, right before VM-entry. */
+void intel_pmu_passthrough_enter(struct kvm_vcpu *vcpu)
+{
+	struct kvm_pmu *pmu = vcpu_to_pmu(vcpu);
+	struct kvm_pmc *pmc;
+	int i;
+
+	/* Stop the host's counters before they're switched out. */
+	rdmsrl(MSR_CORE_PERF_GLOBAL_CTRL, pmu->host.global_ctrl);
+	wrmsrl(MSR_CORE_PERF_GLOBAL_CTRL, 0);
+
+	for (i = 0; i < pmu->nr_arch_gp_counters; i++) {
+		pmc = &pmu->gp_counters[i];
+
+		rdmsrl(MSR_P6_EVNTSEL0 + i, pmu->host.eventsel[i]);
+		rdmsrl(MSR_IA32_PERFCTR0 + i, pmu->host.counters[i]);
+		wrmsrl(MSR_P6_EVNTSEL0 + i, pmc->eventsel);
+		wrmsrl(MSR_IA32_PMC0 + i, pmc_read_counter(pmc));
+	}
+
+	rdmsrl(MSR_CORE_PERF_FIXED_CTR_CTRL, pmu->host.fixed_ctr_ctrl);
+	wrmsrl(MSR_CORE_PERF_FIXED_CTR_CTRL, pmu->fixed_ctr_ctrl);
+
+	for (i = 0; i < pmu->nr_arch_fixed_counters; i++) {
+		pmc = &pmu->fixed_counters[i];
+
+		rdmsrl(MSR_CORE_PERF_FIXED_CTR0 + i, pmu->host.fixed_counters[i]);
+		wrmsrl(MSR_CORE_PERF_FIXED_CTR0 + i, pmc_read_counter(pmc));
+	}
+
+	__this_cpu_write(passthrough_pmu, pmu);
+}
+
+/*
+ * Called with IRQs disabled, right after VM-exit.  The VM-exit has cleared
+ * GLOBAL_CTRL, so none of the counters is running.
+ */
+void intel_pmu_passthrough_exit(struct kvm_vcpu *vcpu)
+{
+	struct kvm_pmu *pmu = vcpu_to_pmu(vcpu);
+	struct kvm_pmc *pmc;
+	int i;
+
+	/* The PMI, if any, is claimed when the host handles the NMI. */
+	if (intel_pmu_passthrough_sync_status(pmu))
+		__this_cpu_write(passthrough_pmi, true);
+
+	__this_cpu_write(passthrough_pmu, NULL);
+
+	for (i = 0; i < pmu->nr_arch_gp_counters; i++) {
+		pmc = &pmu->gp_counters[i];
+
+		rdmsrl(MSR_IA32_PERFCTR0 + i, pmc->counter);
+		wrmsrl(MSR_P6_EVNTSEL0 + i, pmu->host.eventsel[i]);
+		wrmsrl(MSR_IA32_PMC0 + i, pmu->host.counters[i]);
+	}
+
+	wrmsrl(MSR_CORE_PERF_FIXED_CTR_CTRL, pmu->host.fixed_ctr_ctrl);
+
+	for (i = 0; i < pmu->nr_arch_fixed_counters; i++) {
+		pmc = &pmu->fixed_counters[i];
+
+		rdmsrl(MSR_CORE_PERF_FIXED_CTR0 + i, pmc->counter);
+		wrmsrl(MSR_CORE_PERF_FIXED_CTR0 + i, pmu->host.fixed_counters[i]);
+	}
+
+	wrmsrl(MSR_CORE_PERF_GLOBAL_CTRL, pmu->host.global_ctrl);
+}
+
+static int intel_pmu_passthrough_nmi(unsigned int cmd, struct pt_regs *regs)
+{
+	struct kvm_pmu *pmu = __this_cpu_read(passthrough_pmu);
+	bool handled = false;
+
+	/* The PMI hit before the VM-exit code got to look at the status. */
+	if (pmu && intel_pmu_passthrough_sync_status(pmu))
+		handled = true;
+
+	if (__this_cpu_read(passthrough_pmi)) {
+		__this_cpu_write(passthrough_pmi, false);
+		handled = true;
+	}
+
+	if (!handled)
+		return NMI_DONE;
+
+	/* perf only unmasks LVTPC if the host has counters of its own. */
+	apic_write(APIC_LVTPC, APIC_DM_NMI);
+	return NMI_HANDLED;
+}
+
+void __init intel_pmu_passthrough_setup(void)
+{
+	u64 perf_cap = 0;
+
+	if (!enable_pmu_passthrough)
+		return;
+
+	/* The counters are loaded through the full-width aliases. */
+	if (boot_cpu_has(X86_FEATURE_PDCM))
+		rdmsrl(MSR_IA32_PERF_CAPABILITIES, perf_cap);
+
+	if (!(perf_cap & PMU_CAP_FW_WRITES) ||
+	    register_nmi_handler(NMI_LOCAL, intel_pmu_passthrough_nmi,
+				 NMI_FLAG_FIRST, "kvm_pmu")) {
+		pr_warn_once("kvm: PMU pass-through is not supported\n");
+		enable_pmu_passthrough = false;
+	}
+}
+
+void intel_pmu_passthrough_unsetup(void)
+{
+	if (enable_pmu_passthrough)
+		unregister_nmi_handler(NMI_LOCAL, "kvm_pmu");
 }
 
 struct kvm_pmu_ops intel_pmu_ops = {
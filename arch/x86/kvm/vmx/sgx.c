@@ -99,6 +99,49 @@ static int sgx_gpa_to_hva(struct kvm_vcpu *vcpu, gpa_t gpa, unsigned long *hva)
 	return 0;
 }
 
+/* A memory operand of ENCLS, which needs to be translated from GVA to HVA. */
+struct sgx_encls_op {
+	gva_t gva;
+	bool write;
+	unsigned long hva;
+};
+
+/*
+ * Translate the memory operands of ENCLS from GVA to GPA, and then to HVA.  The
+ * order of accesses isn't architectural, i.e. KVM doesn't have to fully process
+ * one address at a time, but all GVAs are translated first so that a #PF is
+ * injected in preference to exiting to userspace on an invalid GPA.  All the
+ * operands are naturally aligned and cannot split pages.
+ *
+ * Return 0 on success, or -EFAULT with @r set to the return value of the exit
+ * handler: 1 to resume the guest to inject a #PF, or 0 to exit to userspace.
+ */
+static int sgx_translate_encls_ops(struct kvm_vcpu *vcpu,
+				   struct sgx_encls_op *ops, int nr, int *r)
+{
+	gpa_t gpa[3];
+	int i;
+
+	if (WARN_ON_ONCE(nr > ARRAY_SIZE(gpa)))
+		return -EINVAL;
+
+	for (i = 0; i < nr; i++) {
+		if (sgx_gva_to_gpa(vcpu, ops[i].gva, ops[i].write, &gpa[i])) {
+			*r = 1;
+			return -EFAULT;
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (sgx_gpa_to_hva(vcpu, gpa[i], &ops[i].hva)) {
+			*r = 0;
+			return -EFAULT;
+		}
+	}
+
+	return 0;
+}
+
 static int sgx_inject_fault(struct kvm_vcpu *vcpu, gva_t gva, int trapnr)
 {
 	struct x86_exception ex;
@@ -139,13 +182,14 @@ static int sgx_inject_fault(struct kvm_vcpu *vcpu, gva_t gva, int trapnr)
 
 static int handle_encls_ecreate(struct kvm_vcpu *vcpu)
 {
-	unsigned long a_hva, m_hva, x_hva, s_hva, secs_hva;
+	u8 buf[offsetofend(struct sgx_secs, xfrm)];
 	struct kvm_cpuid_entry2 *sgx_12_0, *sgx_12_1;
-	gpa_t metadata_gpa, contents_gpa, secs_gpa;
+	struct sgx_encls_op ops[3];
 	struct sgx_pageinfo pageinfo;
 	gva_t pageinfo_gva, secs_gva;
 	u64 attributes, xfrm, size;
 	struct x86_exception ex;
+	struct sgx_secs *secs;
 	u8 max_size_log2;
 	u32 miscselect;
 	int trapnr, r;
@@ -171,7 +215,8 @@ static int handle_encls_ecreate(struct kvm_vcpu *vcpu)
 		kvm_inject_emulated_page_fault(vcpu, &ex);
 		return 1;
 	} else if (r != X86EMUL_CONTINUE) {
-		sgx_handle_emulation_failure(vcpu, pageinfo_gva, size);
+		sgx_handle_emulation_failure(vcpu, pageinfo_gva,
+					     sizeof(pageinfo));
 		return 0;
 	}
 
@@ -185,44 +230,32 @@ static int handle_encls_ecreate(struct kvm_vcpu *vcpu)
 		return 1;
 	}
 
-	/*
-	 * Translate the SECINFO, SOURCE and SECS pointers from GVA to GPA.
-	 * Resume the guest on failure to inject a #PF.
-	 */
-	if (sgx_gva_to_gpa(vcpu, pageinfo.metadata, false, &metadata_gpa) ||
-	    sgx_gva_to_gpa(vcpu, pageinfo.contents, false, &contents_gpa) ||
-	    sgx_gva_to_gpa(vcpu, secs_gva, true, &secs_gpa))
-		return 1;
+	/* Translate the SECINFO, SOURCE and SECS pointers to HVA. */
+	ops[0] = (struct sgx_encls_op){ .gva = pageinfo.metadata };
+	ops[1] = (struct sgx_encls_op){ .gva = pageinfo.contents };
+	ops[2] = (struct sgx_encls_op){ .gva = secs_gva, .write = true };
+	if (sgx_translate_encls_ops(vcpu, ops, ARRAY_SIZE(ops), &r))
+		return r;
 
-	/*
-	 * ...and then to HVA.  The order of accesses isn't architectural, i.e.
-	 * KVM doesn't have to fully process one address at a time.  Exit to
-	 * userspace if a GPA is invalid.
-	 */
-	if (sgx_gpa_to_hva(vcpu, metadata_gpa,
-			   (unsigned long *)&pageinfo.metadata) ||
-	    sgx_gpa_to_hva(vcpu, contents_gpa,
-			   (unsigned long *)&pageinfo.contents) ||
-	    sgx_gpa_to_hva(vcpu, secs_gpa, &secs_hva))
-		return 0;
+	pageinfo.metadata = ops[0].hva;
+	pageinfo.contents = ops[1].hva;
 
 	/*
-	 * Read out select portions of the input SECS to enforce userspace
-	 * restrictions on MISCSELECT, ATTRIBUTES, etc...  Note, 'contents' is
-	 * page aligned, i.e. no need to worry about page splits.
+	 * Read out the head of the input SECS, which holds the fields needed
+	 * to enforce userspace restrictions on MISCSELECT, ATTRIBUTES, etc...,
+	 * with a single copy.  Note, 'contents' is page aligned, i.e. no need
+	 * to worry about page splits.  Exit to userspace if copying from a host
+	 * userspace address fails.
 	 */
-	m_hva = pageinfo.contents + offsetof(struct sgx_secs, miscselect);
-	a_hva = pageinfo.contents + offsetof(struct sgx_secs, attributes);
-	x_hva = pageinfo.contents + offsetof(struct sgx_secs, xfrm);
-	s_hva = pageinfo.contents + offsetof(struct sgx_secs, size);
-
-	/* Exit to userspace if copying from a host userspace address fails. */
-	if (sgx_read_hva(vcpu, m_hva, &miscselect, sizeof(miscselect)) ||
-	    sgx_read_hva(vcpu, a_hva, &attributes, sizeof(attributes)) ||
-	    sgx_read_hva(vcpu, x_hva, &xfrm, sizeof(xfrm)) ||
-	    sgx_read_hva(vcpu, s_hva, &size, sizeof(size)))
+	if (sgx_read_hva(vcpu, pageinfo.contents, buf, sizeof(buf)))
 		return 0;
 
+	secs = (struct sgx_secs *)buf;
+	miscselect = secs->miscselect;
+	attributes = secs->attributes;
+	xfrm = secs->xfrm;
+	size = secs->size;
+
 	/* Enforce restriction of access to the PROVISIONKEY. */
 	if (!vcpu->kvm->arch.sgx_provisioning_allowed &&
 	    (attributes & SGX_ATTR_PROVISIONKEY)) {
@@ -248,7 +281,7 @@ static int handle_encls_ecreate(struct kvm_vcpu *vcpu)
 	if (size >= BIT_ULL(max_size_log2))
 		kvm_inject_gp(vcpu, 0);
 
-	if (sgx_virt_ecreate(&pageinfo, (void __user *)secs_hva, &trapnr))
+	if (sgx_virt_ecreate(&pageinfo, (void __user *)ops[2].hva, &trapnr))
 		return sgx_inject_fault(vcpu, secs_gva, trapnr);
 
 	return kvm_skip_emulated_instruction(vcpu);
@@ -256,39 +289,27 @@ static int handle_encls_ecreate(struct kvm_vcpu *vcpu)
 
 static int handle_encls_einit(struct kvm_vcpu *vcpu)
 {
-	unsigned long sig_hva, secs_hva, token_hva, rflags;
 	struct vcpu_vmx *vmx = to_vmx(vcpu);
 	gva_t sig_gva, secs_gva, token_gva;
-	gpa_t sig_gpa, secs_gpa, token_gpa;
-	int ret, trapnr;
+	struct sgx_encls_op ops[3];
+	unsigned long rflags;
+	int ret, trapnr, r;
 
 	if (sgx_get_encls_gva(vcpu, kvm_rbx_read(vcpu), 1808, 4096, &sig_gva) ||
 	    sgx_get_encls_gva(vcpu, kvm_rcx_read(vcpu), 4096, 4096, &secs_gva) ||
 	    sgx_get_encls_gva(vcpu, kvm_rdx_read(vcpu), 304, 512, &token_gva))
 		return 1;
 
-	/*
-	 * Translate the SIGSTRUCT, SECS and TOKEN pointers from GVA to GPA.
-	 * Resume the guest on failure to inject a #PF.
-	 */
-	if (sgx_gva_to_gpa(vcpu, sig_gva, false, &sig_gpa) ||
-	    sgx_gva_to_gpa(vcpu, secs_gva, true, &secs_gpa) ||
-	    sgx_gva_to_gpa(vcpu, token_gva, false, &token_gpa))
-		return 1;
-
-	/*
-	 * ...and then to HVA.  The order of accesses isn't architectural, i.e.
-	 * KVM doesn't have to fully process one address at a time.  Exit to
-	 * userspace if a GPA is invalid.  Note, all structures are aligned and
-	 * cannot split pages.
-	 */
-	if (sgx_gpa_to_hva(vcpu, sig_gpa, &sig_hva) ||
-	    sgx_gpa_to_hva(vcpu, secs_gpa, &secs_hva) ||
-	    sgx_gpa_to_hva(vcpu, token_gpa, &token_hva))
-		return 0;
+	/* Translate the SIGSTRUCT, SECS and TOKEN pointers to HVA. */
+	ops[0] = (struct sgx_encls_op){ .gva = sig_gva };
+	ops[1] = (struct sgx_encls_op){ .gva = secs_gva, .write = true };
+	ops[2] = (struct sgx_encls_op){ .gva = token_gva };
+	if (sgx_translate_encls_ops(vcpu, ops, ARRAY_SIZE(ops), &r))
+		return r;
 
-	ret = sgx_virt_einit((void __user *)sig_hva, (void __user *)token_hva,
-			     (void __user *)secs_hva,
+	ret = sgx_virt_einit((void __user *)ops[0].hva,
+			     (void __user *)ops[2].hva,
+			     (void __user *)ops[1].hva,
 			     vmx->msr_ia32_sgxlepubkeyhash, &trapnr);
 
 	if (ret == -EFAULT)
@@ -332,15 +353,21 @@ int handle_encls(struct kvm_vcpu *vcpu)
 {
 	u32 leaf = (u32)vcpu->arch.regs[VCPU_REGS_RAX];
 
+	++vcpu->stat.encls_exits;
+
 	if (!encls_leaf_enabled_in_guest(vcpu, leaf)) {
 		kvm_queue_exception(vcpu, UD_VECTOR);
 	} else if (!sgx_enabled_in_guest_bios(vcpu)) {
 		kvm_inject_gp(vcpu, 0);
 	} else {
-		if (leaf == ECREATE)
+		if (leaf == ECREATE) {
+			++vcpu->stat.encls_ecreate_exits;
 			return handle_encls_ecreate(vcpu);
-		if (leaf == EINIT)
+		}
+		if (leaf == EINIT) {
+			++vcpu->stat.encls_einit_exits;
 			return handle_encls_einit(vcpu);
+		}
 		WARN(1, "KVM: unexpected exit on ENCLS[%u]", leaf);
 		vcpu->run->exit_reason = KVM_EXIT_UNKNOWN;
 		vcpu->run->hw.hardware_exit_reason = EXIT_REASON_ENCLS;
@@ -462,13 +462,32 @@ static u64 sgx_pubkey_hash[4] __ro_after_init;
  * CPUID.0:{EBX,ECX,EDX} is "AuthenticAMD" or "AMDisbetter!" To
  * support this emulation, IA32_STAR must always be included in
  * vmx_uret_msrs_list[], even in i386 builds.
+ *
+ * The policy of each MSR says when the guest value has to be loaded, see
+ * vmx_need_uret_msr().  The host value is only restored on return to
+ * userspace, and only if the guest value was loaded and differs.
  */
-static const u32 vmx_uret_msrs_list[] = {
+enum vmx_uret_msr_policy {
+	VMX_URET_NEVER,		/* not consumed by Intel CPUs, only stored */
+	VMX_URET_SYSCALL,	/* 64-bit guests with EFER.SCE set */
+	VMX_URET_EFER,		/* unless EFER is switched atomically */
+	VMX_URET_RDTSCP,	/* guests with RDTSCP */
+	VMX_URET_ALWAYS,
+};
+
+static const struct vmx_uret_msr_info {
+	u32 msr;
+	enum vmx_uret_msr_policy policy;
+} vmx_uret_msrs_list[] = {
 #ifdef CONFIG_X86_64
-	MSR_SYSCALL_MASK, MSR_LSTAR, MSR_CSTAR,
+	{ MSR_SYSCALL_MASK,	VMX_URET_SYSCALL },
+	{ MSR_LSTAR,		VMX_URET_SYSCALL },
+	{ MSR_CSTAR,		VMX_URET_NEVER },
 #endif
-	MSR_EFER, MSR_TSC_AUX, MSR_STAR,
-	MSR_IA32_TSX_CTRL,
+	{ MSR_EFER,		VMX_URET_EFER },
+	{ MSR_TSC_AUX,		VMX_URET_RDTSCP },
+	{ MSR_STAR,		VMX_URET_SYSCALL },
+	{ MSR_IA32_TSX_CTRL,	VMX_URET_ALWAYS },
 };
 
 #if IS_ENABLED(CONFIG_HYPERV)
@@ -677,7 +696,7 @@ static inline int __vmx_find_uret_msr(struct vcpu_vmx *vmx, u32 msr)
 	int i;
 
 	for (i = 0; i < vmx->nr_uret_msrs; ++i)
-		if (vmx_uret_msrs_list[vmx->guest_uret_msrs[i].slot] == msr)
+		if (vmx_uret_msrs_list[vmx->guest_uret_msrs[i].slot].msr == msr)
 			return i;
 	return -1;
 }
@@ -1734,6 +1753,28 @@ static void vmx_setup_uret_msr(struct vcpu_vmx *vmx, unsigned int msr)
 	vmx->guest_uret_msrs[from] = tmp;
 }
 
+static bool vmx_need_uret_msr(struct vcpu_vmx *vmx,
+			      enum vmx_uret_msr_policy policy)
+{
+	switch (policy) {
+	case VMX_URET_SYSCALL:
+#ifdef CONFIG_X86_64
+		return is_long_mode(&vmx->vcpu) &&
+		       (vmx->vcpu.arch.efer & EFER_SCE);
+#else
+		return false;
+#endif
+	case VMX_URET_EFER:
+		return update_transition_efer(vmx);
+	case VMX_URET_RDTSCP:
+		return guest_cpuid_has(&vmx->vcpu, X86_FEATURE_RDTSCP);
+	case VMX_URET_ALWAYS:
+		return true;
+	default:
+		return false;
+	}
+}
+
 /*
  * Set up the vmcs to automatically save and restore system
  * msrs.  Don't touch the 64-bit msrs if the guest is in legacy
@@ -1741,26 +1782,15 @@ static void vmx_setup_uret_msr(struct vcpu_vmx *vmx, unsigned int msr)
  */
 static void setup_msrs(struct vcpu_vmx *vmx)
 {
+	int i;
+
 	vmx->guest_uret_msrs_loaded = false;
 	vmx->nr_active_uret_msrs = 0;
-#ifdef CONFIG_X86_64
-	/*
-	 * The SYSCALL MSRs are only needed on long mode guests, and only
-	 * when EFER.SCE is set.
-	 */
-	if (is_long_mode(&vmx->vcpu) && (vmx->vcpu.arch.efer & EFER_SCE)) {
-		vmx_setup_uret_msr(vmx, MSR_STAR);
-		vmx_setup_uret_msr(vmx, MSR_LSTAR);
-		vmx_setup_uret_msr(vmx, MSR_SYSCALL_MASK);
-	}
-#endif
-	if (update_transition_efer(vmx))
-		vmx_setup_uret_msr(vmx, MSR_EFER);
-
-	if (guest_cpuid_has(&vmx->vcpu, X86_FEATURE_RDTSCP))
-		vmx_setup_uret_msr(vmx, MSR_TSC_AUX);
 
-	vmx_setup_uret_msr(vmx, MSR_IA32_TSX_CTRL);
+	/* Every policy is evaluated, update_transition_efer() must run. */
+	for (i = 0; i < ARRAY_SIZE(vmx_uret_msrs_list); i++)
+		if (vmx_need_uret_msr(vmx, vmx_uret_msrs_list[i].policy))
+			vmx_setup_uret_msr(vmx, vmx_uret_msrs_list[i].msr);
 
 	if (cpu_has_vmx_msr_bitmap())
 		vmx_update_msr_bitmap(&vmx->vcpu);
@@ -3606,10 +3636,18 @@ static int init_rmode_identity_map(struct kvm *kvm)
 	kvm_pfn_t identity_map_pfn;
 	u32 tmp;
 
+	/*
+	 * The map is built once per VM and the flag is never cleared, so skip
+	 * slots_lock, which every vCPU creation would otherwise serialize on.
+	 * Pairs with the smp_store_release() below.
+	 */
+	if (likely(smp_load_acquire(&kvm_vmx->ept_identity_pagetable_done)))
+		return 0;
+
 	/* Protect kvm_vmx->ept_identity_pagetable_done. */
 	mutex_lock(&kvm->slots_lock);
 
-	if (likely(kvm_vmx->ept_identity_pagetable_done))
+	if (kvm_vmx->ept_identity_pagetable_done)
 		goto out;
 
 	if (!kvm_vmx->ept_identity_map_addr)
@@ -3633,7 +3671,7 @@ static int init_rmode_identity_map(struct kvm *kvm)
 		if (r < 0)
 			goto out;
 	}
-	kvm_vmx->ept_identity_pagetable_done = true;
+	smp_store_release(&kvm_vmx->ept_identity_pagetable_done, true);
 
 out:
 	mutex_unlock(&kvm->slots_lock);
@@ -3660,6 +3698,10 @@ static int alloc_apic_access_page(struct kvm *kvm)
 	struct page *page;
 	int r = 0;
 
+	/* As with the identity map, the flag is never cleared on VMX. */
+	if (smp_load_acquire(&kvm->arch.apic_access_page_done))
+		return 0;
+
 	mutex_lock(&kvm->slots_lock);
 	if (kvm->arch.apic_access_page_done)
 		goto out;
@@ -3679,7 +3721,7 @@ static int alloc_apic_access_page(struct kvm *kvm)
 	 * is able to migrate it.
 	 */
 	put_page(page);
-	kvm->arch.apic_access_page_done = true;
+	smp_store_release(&kvm->arch.apic_access_page_done, true);
 out:
 	mutex_unlock(&kvm->slots_lock);
 	return r;
@@ -3943,6 +3985,36 @@ static bool vmx_guest_apic_has_interrupt(struct kvm_vcpu *vcpu)
 	return ((rvi & 0xf0) > (vppr & 0xf0));
 }
 
+static void vmx_update_pmu_passthrough(struct kvm_vcpu *vcpu)
+{
+	bool intercept = !vcpu_to_pmu(vcpu)->passthrough;
+	struct x86_pmu_capability x86_pmu;
+	int i;
+
+	/*
+	 * Only the counters themselves are passed through.  GLOBAL_CTRL,
+	 * GLOBAL_STATUS and GLOBAL_OVF_CTRL stay intercepted, as the host's
+	 * counters live in the same registers, and so do the event selectors
+	 * and FIXED_CTR_CTRL, whose values are checked before they are loaded
+	 * at VM-entry.
+	 */
+	perf_get_x86_pmu_capability(&x86_pmu);
+	for (i = 0; i < x86_pmu.num_counters_gp; i++) {
+		vmx_set_intercept_for_msr(vcpu, MSR_IA32_PERFCTR0 + i,
+					  MSR_TYPE_RW, intercept);
+		vmx_set_intercept_for_msr(vcpu, MSR_IA32_PMC0 + i,
+					  MSR_TYPE_RW, intercept);
+	}
+	for (i = 0; i < x86_pmu.num_counters_fixed; i++)
+		vmx_set_intercept_for_msr(vcpu, MSR_CORE_PERF_FIXED_CTR0 + i,
+					  MSR_TYPE_RW, intercept);
+
+	if (intercept)
+		exec_controls_setbit(to_vmx(vcpu), CPU_BASED_RDPMC_EXITING);
+	else
+		exec_controls_clearbit(to_vmx(vcpu), CPU_BASED_RDPMC_EXITING);
+}
+
 static void vmx_msr_filter_changed(struct kvm_vcpu *vcpu)
 {
 	struct vcpu_vmx *vmx = to_vmx(vcpu);
@@ -3964,6 +4036,7 @@ static void vmx_msr_filter_changed(struct kvm_vcpu *vcpu)
 
 	pt_update_intercept_for_msr(vcpu);
 	vmx_update_msr_bitmap_x2apic(vcpu, vmx_msr_bitmap_mode(vcpu));
+	vmx_update_pmu_passthrough(vcpu);
 }
 
 static inline bool kvm_vcpu_trigger_posted_interrupt(struct kvm_vcpu *vcpu,
@@ -4194,6 +4267,8 @@ u32 vmx_exec_control(struct vcpu_vmx *vmx)
 				CPU_BASED_MONITOR_EXITING);
 	if (kvm_hlt_in_guest(vmx->vcpu.kvm))
 		exec_control &= ~CPU_BASED_HLT_EXITING;
+	if (vcpu_to_pmu(&vmx->vcpu)->passthrough)
+		exec_control &= ~CPU_BASED_RDPMC_EXITING;
 	return exec_control;
 }
 
@@ -4289,7 +4364,8 @@ static void vmx_compute_secondary_exec_control(struct vcpu_vmx *vmx)
 	*/
 	exec_control &= ~SECONDARY_EXEC_SHADOW_VMCS;
 
-	if (!enable_pml)
+	/* PML is turned on once the VM first enables dirty logging. */
+	if (!vmx->pml_pg)
 		exec_control &= ~SECONDARY_EXEC_ENABLE_PML;
 
 	if (cpu_has_vmx_xsaves()) {
@@ -4428,11 +4504,6 @@ static void init_vmcs(struct vcpu_vmx *vmx)
 	if (cpu_has_vmx_xsaves())
 		vmcs_write64(XSS_EXIT_BITMAP, VMX_XSS_EXIT_BITMAP);
 
-	if (enable_pml) {
-		vmcs_write64(PML_ADDRESS, page_to_phys(vmx->pml_pg));
-		vmcs_write16(GUEST_PML_INDEX, PML_ENTITY_NUM - 1);
-	}
-
 	vmx_write_encls_bitmap(&vmx->vcpu, NULL);
 
 	if (vmx_pt_mode_is_host_guest()) {
@@ -5436,6 +5507,10 @@ static int handle_ept_misconfig(struct kvm_vcpu *vcpu)
 		return kvm_skip_emulated_instruction(vcpu);
 	}
 
+	/* Doorbells with data, e.g. a queue index, skip the emulator too. */
+	if (!is_guest_mode(vcpu) && kvm_mmio_insn_cache_write(vcpu, gpa))
+		return kvm_skip_emulated_instruction(vcpu);
+
 	return kvm_mmu_page_fault(vcpu, gpa, PFERR_RSVD_MASK, NULL, 0);
 }
 
@@ -5624,6 +5699,7 @@ static int handle_pml_full(struct kvm_vcpu *vcpu)
 	unsigned long exit_qualification;
 
 	trace_kvm_pml_full(vcpu->vcpu_id);
+	++vcpu->stat.pml_full_exits;
 
 	exit_qualification = vmx_get_exit_qual(vcpu);
 
@@ -5747,6 +5823,19 @@ static int (*kvm_vmx_exit_handlers[])(struct kvm_vcpu *vcpu) = {
 static const int kvm_vmx_max_exit_handlers =
 	ARRAY_SIZE(kvm_vmx_exit_handlers);
 
+#define VMX_NR_EXIT_LATENCY_REASONS	(ARRAY_SIZE(kvm_vmx_exit_handlers) + 1)
+
+static u32 vmx_exit_latency_index(struct kvm_vcpu *vcpu)
+{
+	union vmx_exit_reason exit_reason = to_vmx(vcpu)->exit_reason;
+
+	if (exit_reason.failed_vmentry ||
+	    exit_reason.basic >= kvm_vmx_max_exit_handlers)
+		return VMX_NR_EXIT_LATENCY_REASONS - 1;
+
+	return exit_reason.basic;
+}
+
 static void vmx_get_exit_info(struct kvm_vcpu *vcpu, u64 *info1, u64 *info2,
 			      u32 *intr_info, u32 *error_code)
 {
@@ -5775,9 +5864,56 @@ static void vmx_destroy_pml_buffer(struct vcpu_vmx *vmx)
 	}
 }
 
+/* Turn on PML in the current VMCS, which must not have it yet. */
+void vmx_enable_pml(struct vcpu_vmx *vmx)
+{
+	vmcs_write64(PML_ADDRESS, page_to_phys(vmx->pml_pg));
+	vmcs_write16(GUEST_PML_INDEX, PML_ENTITY_NUM - 1);
+	secondary_exec_controls_setbit(vmx, SECONDARY_EXEC_ENABLE_PML);
+}
+
+/*
+ * Most VMs never enable dirty logging, so the PML buffer is only allocated
+ * and PML only turned on once they do.  Until then, sptes have their dirty
+ * bit set and there is nothing to log.
+ */
+static int vmx_update_cpu_dirty_logging(struct kvm_vcpu *vcpu)
+{
+	struct vcpu_vmx *vmx = to_vmx(vcpu);
+
+	if (vmx->pml_pg || !READ_ONCE(vcpu->kvm->arch.cpu_dirty_logging))
+		return 0;
+
+	vmx->pml_pg = alloc_page(GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+	if (!vmx->pml_pg)
+		return -ENOMEM;
+
+	vmx->secondary_exec_control |= SECONDARY_EXEC_ENABLE_PML;
+	vmx_enable_pml(vmx);
+
+	/*
+	 * The current VMCS is vmcs02 if L2 is active, L2's writes must be
+	 * logged right away too.  vmcs01 is updated on nested VM-Exit.
+	 * Otherwise, have vmcs02 pick up the PML address on the next nested
+	 * VM-Enter.
+	 */
+	if (is_guest_mode(vcpu))
+		vmx->nested.update_vmcs01_cpu_dirty_logging = true;
+	else
+		vmx->nested.vmcs02_initialized = false;
+
+	return 0;
+}
+
+/*
+ * Drain the PML buffer into the dirty bitmap, or into the vCPU's dirty ring if
+ * the VM uses one. Consecutive entries usually hit the same memslot, so the
+ * last one is reused instead of being looked up for every GPA.
+ */
 static void vmx_flush_pml_buffer(struct kvm_vcpu *vcpu)
 {
 	struct vcpu_vmx *vmx = to_vmx(vcpu);
+	struct kvm_memory_slot *slot = NULL;
 	u64 *pml_buf;
 	u16 pml_idx;
 
@@ -5793,13 +5929,21 @@ static void vmx_flush_pml_buffer(struct kvm_vcpu *vcpu)
 	else
 		pml_idx++;
 
+	++vcpu->stat.pml_flushes;
+
 	pml_buf = page_address(vmx->pml_pg);
 	for (; pml_idx < PML_ENTITY_NUM; pml_idx++) {
 		u64 gpa;
+		gfn_t gfn;
 
 		gpa = pml_buf[pml_idx];
 		WARN_ON(gpa & (PAGE_SIZE - 1));
-		kvm_vcpu_mark_page_dirty(vcpu, gpa >> PAGE_SHIFT);
+
+		gfn = gpa >> PAGE_SHIFT;
+		if (!slot || gfn < slot->base_gfn ||
+		    gfn >= slot->base_gfn + slot->npages)
+			slot = kvm_vcpu_gfn_to_memslot(vcpu, gfn);
+		mark_page_dirty_in_slot(vcpu->kvm, slot, gfn);
 	}
 
 	/* reset PML index */
@@ -6008,7 +6152,7 @@ static int vmx_handle_exit(struct kvm_vcpu *vcpu, fastpath_t exit_fastpath)
 	 * mode as if vcpus is in root mode, the PML buffer must has been
 	 * flushed already.
 	 */
-	if (enable_pml)
+	if (secondary_exec_controls_get(vmx) & SECONDARY_EXEC_ENABLE_PML)
 		vmx_flush_pml_buffer(vcpu);
 
 	/*
@@ -6599,10 +6743,20 @@ static void vmx_cancel_injection(struct kvm_vcpu *vcpu)
 
 static void atomic_switch_perf_msrs(struct vcpu_vmx *vmx)
 {
+	struct kvm_pmu *pmu = vcpu_to_pmu(&vmx->vcpu);
+	struct x86_guest_pebs pebs = {};
 	int i, nr_msrs;
 	struct perf_guest_switch_msr *msrs;
 
-	msrs = perf_guest_get_msrs(&nr_msrs);
+	if (pmu->pebs_enable) {
+		intel_pmu_cross_mapped_check(pmu);
+		pebs.enable = pmu->pebs_enable;
+		pebs.ds_area = pmu->ds_area;
+		pebs.data_cfg = pmu->pebs_data_cfg;
+		pebs.cross_mapped_mask = pmu->host_cross_mapped_mask;
+	}
+
+	msrs = perf_guest_get_msrs(&nr_msrs, &pebs);
 
 	if (!msrs)
 		return;
@@ -6779,6 +6933,16 @@ static fastpath_t vmx_vcpu_run(struct kvm_vcpu *vcpu)
 
 	atomic_switch_perf_msrs(vmx);
 
+	/*
+	 * Keep the counters stopped while outside the guest; the host's
+	 * GLOBAL_CTRL is restored once its counters are back in place.
+	 */
+	if (vcpu_to_pmu(vcpu)->passthrough) {
+		add_atomic_switch_msr(vmx, MSR_CORE_PERF_GLOBAL_CTRL,
+				      vcpu_to_pmu(vcpu)->global_ctrl, 0, false);
+		intel_pmu_passthrough_enter(vcpu);
+	}
+
 	if (enable_preemption_timer)
 		vmx_update_hv_timer(vcpu);
 
@@ -6815,6 +6979,9 @@ static fastpath_t vmx_vcpu_run(struct kvm_vcpu *vcpu)
 
 	x86_spec_ctrl_restore_host(vmx->spec_ctrl, 0);
 
+	if (vcpu_to_pmu(vcpu)->passthrough)
+		intel_pmu_passthrough_exit(vcpu);
+
 	/* All fields are clean at this point */
 	if (static_branch_unlikely(&enable_evmcs))
 		current_evmcs->hv_clean_fields |=
@@ -6894,8 +7061,7 @@ static void vmx_free_vcpu(struct kvm_vcpu *vcpu)
 {
 	struct vcpu_vmx *vmx = to_vmx(vcpu);
 
-	if (enable_pml)
-		vmx_destroy_pml_buffer(vmx);
+	vmx_destroy_pml_buffer(vmx);
 	free_vpid(vmx->vpid);
 	nested_vmx_free_vcpu(vcpu);
 	free_loaded_vmcs(vmx->loaded_vmcs);
@@ -6913,22 +7079,10 @@ static int vmx_create_vcpu(struct kvm_vcpu *vcpu)
 
 	vmx->vpid = allocate_vpid();
 
-	/*
-	 * If PML is turned on, failure on enabling PML just results in failure
-	 * of creating the vcpu, therefore we can simplify PML logic (by
-	 * avoiding dealing with cases, such as enabling PML partially on vcpus
-	 * for the guest), etc.
-	 */
-	if (enable_pml) {
-		vmx->pml_pg = alloc_page(GFP_KERNEL_ACCOUNT | __GFP_ZERO);
-		if (!vmx->pml_pg)
-			goto free_vpid;
-	}
-
 	BUILD_BUG_ON(ARRAY_SIZE(vmx_uret_msrs_list) != MAX_NR_USER_RETURN_MSRS);
 
 	for (i = 0; i < ARRAY_SIZE(vmx_uret_msrs_list); ++i) {
-		u32 index = vmx_uret_msrs_list[i];
+		u32 index = vmx_uret_msrs_list[i].msr;
 		u32 data_low, data_high;
 		int j = vmx->nr_uret_msrs;
 
@@ -6957,7 +7111,7 @@ static int vmx_create_vcpu(struct kvm_vcpu *vcpu)
 
 	err = alloc_loaded_vmcs(&vmx->vmcs01);
 	if (err < 0)
-		goto free_pml;
+		goto free_vpid;
 
 	/* The MSR bitmap starts with all ones */
 	bitmap_fill(vmx->shadow_msr_intercept.read, MAX_POSSIBLE_PASSTHROUGH_MSRS);
@@ -7024,8 +7178,6 @@ static int vmx_create_vcpu(struct kvm_vcpu *vcpu)
 
 free_vmcs:
 	free_loaded_vmcs(vmx->loaded_vmcs);
-free_pml:
-	vmx_destroy_pml_buffer(vmx);
 free_vpid:
 	free_vpid(vmx->vpid);
 	return err;
@@ -7345,6 +7497,8 @@ static void vmx_vcpu_after_set_cpuid(struct kvm_vcpu *vcpu)
 
 	/* Refresh #PF interception to account for MAXPHYADDR changes. */
 	update_exception_bitmap(vcpu);
+
+	vmx_update_pmu_passthrough(vcpu);
 }
 
 static __init void vmx_set_cpu_caps(void)
@@ -7384,6 +7538,12 @@ static __init void vmx_set_cpu_caps(void)
 
 	if (cpu_has_vmx_waitpkg())
 		kvm_cpu_cap_check_and_set(X86_FEATURE_WAITPKG);
+
+	/* CPUID 0x1, the DS area that guest PEBS writes to */
+	if (vmx_pebs_supported()) {
+		kvm_cpu_cap_check_and_set(X86_FEATURE_DS);
+		kvm_cpu_cap_check_and_set(X86_FEATURE_DTES64);
+	}
 }
 
 static void vmx_request_immediate_exit(struct kvm_vcpu *vcpu)
@@ -7547,6 +7707,18 @@ static void vmx_sched_in(struct kvm_vcpu *vcpu, int cpu)
 static void vmx_slot_enable_log_dirty(struct kvm *kvm,
 				     struct kvm_memory_slot *slot)
 {
+	/*
+	 * The vCPUs must have PML on before the dirty bits are cleared.  The
+	 * request kicks them out of the guest, and they turn PML on before
+	 * entering it again.
+	 */
+	if (!kvm->arch.cpu_dirty_logging) {
+		WRITE_ONCE(kvm->arch.cpu_dirty_logging, true);
+		/* Pairs with the smp_mb() in kvm_arch_vcpu_postcreate(). */
+		smp_mb();
+		kvm_make_all_cpus_request(kvm, KVM_REQ_UPDATE_CPU_DIRTY_LOGGING);
+	}
+
 	if (!kvm_dirty_log_manual_protect_and_init_set(kvm))
 		kvm_mmu_slot_leaf_clear_dirty(kvm, slot);
 	kvm_mmu_slot_largepage_remove_write_access(kvm, slot);
@@ -7663,6 +7835,8 @@ static void vmx_migrate_timers(struct kvm_vcpu *vcpu)
 
 static void hardware_unsetup(void)
 {
+	intel_pmu_passthrough_unsetup();
+
 	if (nested)
 		nested_vmx_hardware_unsetup();
 
@@ -7725,6 +7899,8 @@ static struct kvm_x86_ops vmx_x86_ops __initdata = {
 
 	.run = vmx_vcpu_run,
 	.handle_exit = vmx_handle_exit,
+	.nr_exit_latency_reasons = VMX_NR_EXIT_LATENCY_REASONS,
+	.exit_latency_index = vmx_exit_latency_index,
 	.skip_emulated_instruction = vmx_skip_emulated_instruction,
 	.update_emulated_instruction = vmx_update_emulated_instruction,
 	.set_interrupt_shadow = vmx_set_interrupt_shadow,
@@ -7779,6 +7955,8 @@ static struct kvm_x86_ops vmx_x86_ops __initdata = {
 	.slot_disable_log_dirty = vmx_slot_disable_log_dirty,
 	.flush_log_dirty = vmx_flush_log_dirty,
 	.enable_log_dirty_pt_masked = vmx_enable_log_dirty_pt_masked,
+	.update_cpu_dirty_logging = vmx_update_cpu_dirty_logging,
+	.cpu_dirty_log_size = PML_ENTITY_NUM,
 
 	.pre_block = vmx_pre_block,
 	.post_block = vmx_post_block,
@@ -7817,7 +7995,7 @@ static __init int hardware_setup(void)
 	host_idt_base = dt.address;
 
 	for (i = 0; i < ARRAY_SIZE(vmx_uret_msrs_list); ++i)
-		kvm_define_user_return_msr(i, vmx_uret_msrs_list[i]);
+		kvm_define_user_return_msr(i, vmx_uret_msrs_list[i].msr);
 
 	if (setup_vmcs_config(&vmcs_config, &vmx_capability) < 0)
 		return -EIO;
@@ -7922,6 +8100,8 @@ static __init int hardware_setup(void)
 		vmx_x86_ops.slot_disable_log_dirty = NULL;
 		vmx_x86_ops.flush_log_dirty = NULL;
 		vmx_x86_ops.enable_log_dirty_pt_masked = NULL;
+		vmx_x86_ops.update_cpu_dirty_logging = NULL;
+		vmx_x86_ops.cpu_dirty_log_size = 0;
 	}
 
 	if (!cpu_has_vmx_preemption_timer())
@@ -7995,9 +8175,13 @@ static __init int hardware_setup(void)
 
 	vmx_set_cpu_caps();
 
+	intel_pmu_passthrough_setup();
+
 	r = alloc_kvm_area();
-	if (r)
+	if (r) {
+		intel_pmu_passthrough_unsetup();
 		nested_vmx_hardware_unsetup();
+	}
 	return r;
 }
 
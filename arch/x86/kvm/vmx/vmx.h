@@ -97,6 +97,8 @@ union vmx_exit_reason {
  * The nested_vmx structure is part of vcpu_vmx, and holds information we need
  * for correct emulation of VMX (i.e., nested VMX) on this vcpu.
  */
+#define NR_PREV_EVMCS	3
+
 struct nested_vmx {
 	/* Has the level1 guest done vmxon? */
 	bool vmxon;
@@ -123,7 +125,12 @@ struct nested_vmx {
 	 * with the data held by struct vmcs12.
 	 */
 	bool need_vmcs12_to_shadow_sync;
-	bool dirty_vmcs12;
+
+	/* VMCS12_DIRTY_* groups of vmcs12 that vmcs02 is not in sync with. */
+	u32 dirty_vmcs12;
+
+	/* vmcs12 fields added to the shadow VMCS at runtime, if any. */
+	struct hot_shadow_vmcs *hot_shadow;
 
 	/*
 	 * Indicates lazily loaded guest state has not yet been decached from
@@ -140,6 +147,7 @@ struct nested_vmx {
 
 	bool change_vmcs01_virtual_apic_mode;
 	bool reload_vmcs01_apic_access_page;
+	bool update_vmcs01_cpu_dirty_logging;
 
 	/*
 	 * Enlightened VMCS has been enabled. It does not mean that L1 has to
@@ -198,6 +206,16 @@ struct nested_vmx {
 	gpa_t hv_evmcs_vmptr;
 	struct kvm_host_map hv_evmcs_map;
 	struct hv_enlightened_vmcs *hv_evmcs;
+
+	/*
+	 * vmcs12s of the enlightened VMCSs that L1 used before the current
+	 * one, most recently used first.  They keep the clean fields of an
+	 * eVMCS usable when L1 switches back to it.
+	 */
+	struct {
+		gpa_t gpa;
+		struct vmcs12 *vmcs12;
+	} prev_evmcs[NR_PREV_EVMCS];
 };
 
 struct vcpu_vmx {
@@ -271,6 +289,8 @@ struct vcpu_vmx {
 
 	/* Posted interrupt descriptor */
 	struct pi_desc pi_desc;
+	/* Kicked by the wakeup handler since the vCPU blocked. */
+	bool pi_wakeup_kicked;
 
 	/* Support for a guest hypervisor (nested VMX) */
 	struct nested_vmx nested;
@@ -361,12 +381,19 @@ bool vmx_interrupt_blocked(struct kvm_vcpu *vcpu);
 bool vmx_get_nmi_mask(struct kvm_vcpu *vcpu);
 void vmx_set_nmi_mask(struct kvm_vcpu *vcpu, bool masked);
 void vmx_set_virtual_apic_mode(struct kvm_vcpu *vcpu);
+void vmx_enable_pml(struct vcpu_vmx *vmx);
 struct vmx_uret_msr *vmx_find_uret_msr(struct vcpu_vmx *vmx, u32 msr);
 void pt_update_intercept_for_msr(struct kvm_vcpu *vcpu);
 void vmx_update_host_rsp(struct vcpu_vmx *vmx, unsigned long host_rsp);
 int vmx_find_loadstore_msr_slot(struct vmx_msrs *m, u32 msr);
 void vmx_ept_load_pdptrs(struct kvm_vcpu *vcpu);
 
+void intel_pmu_passthrough_enter(struct kvm_vcpu *vcpu);
+void intel_pmu_passthrough_exit(struct kvm_vcpu *vcpu);
+void intel_pmu_passthrough_setup(void);
+void intel_pmu_passthrough_unsetup(void);
+void intel_pmu_cross_mapped_check(struct kvm_pmu *pmu);
+
 static inline u8 vmx_get_rvi(void)
 {
 	return vmcs_read16(GUEST_INTR_STATUS) & 0xff;
@@ -101,6 +101,22 @@ static __always_inline unsigned long __vmcs_readl(unsigned long field)
 	return value;
 }
 
+/*
+ * Check whether the CPU supports @field by reading it from the current VMCS,
+ * without complaining about VM-Fail.
+ */
+static __always_inline bool vmcs_field_exists(unsigned long field)
+{
+	unsigned long value;
+	bool fail;
+
+	asm volatile("vmread %[field], %[value]\n\t"
+		     CC_SET(be)
+		     : CC_OUT(be) (fail), [value] "=r" (value)
+		     : [field] "r" (field));
+	return !fail;
+}
+
 static __always_inline u16 vmcs_read16(unsigned long field)
 {
 	vmcs_check16(field);
@@ -55,6 +55,7 @@
 #include <linux/irqbypass.h>
 #include <linux/sched/stat.h>
 #include <linux/sched/isolation.h>
+#include <linux/sched/clock.h>
 #include <linux/mem_encrypt.h>
 #include <linux/entry-kvm.h>
 
@@ -111,6 +112,11 @@ static void enter_smm(struct kvm_vcpu *vcpu);
 static void __kvm_set_rflags(struct kvm_vcpu *vcpu, unsigned long rflags);
 static void store_regs(struct kvm_vcpu *vcpu);
 static int sync_regs(struct kvm_vcpu *vcpu);
+static u32 kvm_vcpu_state_max_size(void);
+static int kvm_vcpu_get_state(struct kvm_vcpu *vcpu,
+			      struct kvm_vcpu_state __user *ustate, u32 size);
+static int kvm_vcpu_set_state(struct kvm_vcpu *vcpu,
+			      struct kvm_vcpu_state __user *ustate, u32 size);
 
 struct kvm_x86_ops kvm_x86_ops __read_mostly;
 EXPORT_SYMBOL_GPL(kvm_x86_ops);
@@ -127,6 +133,14 @@ module_param(min_timer_period_us, uint, S_IRUGO | S_IWUSR);
 static bool __read_mostly kvmclock_periodic_sync = true;
 module_param(kvmclock_periodic_sync, bool, S_IRUGO);
 
+/*
+ * Minimum time in milliseconds between inhibiting APICv and re-activating
+ * it, so that a flapping inhibit reason does not repeatedly zap the APIC
+ * access page and kick all vCPUs.  '0' re-activates APICv immediately.
+ */
+static unsigned int __read_mostly apicv_backoff_ms = 100;
+module_param(apicv_backoff_ms, uint, S_IRUGO | S_IWUSR);
+
 bool __read_mostly kvm_has_tsc_control;
 EXPORT_SYMBOL_GPL(kvm_has_tsc_control);
 u32  __read_mostly kvm_max_guest_tsc_khz;
@@ -164,13 +178,18 @@ module_param(force_emulation_prefix, bool, S_IRUGO);
 int __read_mostly pi_inject_timer = -1;
 module_param(pi_inject_timer, bint, S_IRUGO | S_IWUSR);
 
+/*
+ * Run the LAPIC timers of vCPUs on isolated CPUs on the housekeeping CPUs,
+ * requires pi_inject_timer.
+ */
+bool __read_mostly lapic_timer_offload;
+module_param(lapic_timer_offload, bool, S_IRUGO);
+
 /*
  * Restoring the host value for MSRs that are only consumed when running in
  * usermode, e.g. SYSCALL MSRs and TSC_AUX, can be deferred until the CPU
  * returns to userspace, i.e. the kernel can run with the guest's value.
  */
-#define KVM_MAX_NR_USER_RETURN_MSRS 16
-
 struct kvm_user_return_msrs_global {
 	int nr;
 	u32 msrs[KVM_MAX_NR_USER_RETURN_MSRS];
@@ -219,6 +238,7 @@ struct kvm_stats_debugfs_item debugfs_entries[] = {
 	VCPU_STAT("halt_attempted_poll", halt_attempted_poll),
 	VCPU_STAT("halt_poll_invalid", halt_poll_invalid),
 	VCPU_STAT("halt_wakeup", halt_wakeup),
+	VCPU_STAT("halt_wakeup_coalesced", halt_wakeup_coalesced),
 	VCPU_STAT("hypercalls", hypercalls),
 	VCPU_STAT("request_irq", request_irq_exits),
 	VCPU_STAT("irq_exits", irq_exits),
@@ -230,8 +250,25 @@ struct kvm_stats_debugfs_item debugfs_entries[] = {
 	VCPU_STAT("nmi_injections", nmi_injections),
 	VCPU_STAT("req_event", req_event),
 	VCPU_STAT("l1d_flush", l1d_flush),
-	VCPU_STAT("halt_poll_success_ns", halt_poll_success_ns),
-	VCPU_STAT("halt_poll_fail_ns", halt_poll_fail_ns),
+	VCPU_STAT("halt_poll_success_ns", halt_poll_success_ns, KVM_STAT_NS),
+	VCPU_STAT("halt_poll_fail_ns", halt_poll_fail_ns, KVM_STAT_NS),
+	VCPU_STAT("encls_exits", encls_exits),
+	VCPU_STAT("encls_ecreate_exits", encls_ecreate_exits),
+	VCPU_STAT("encls_einit_exits", encls_einit_exits),
+	VCPU_STAT("pml_full_exits", pml_full_exits),
+	VCPU_STAT("pml_flushes", pml_flushes),
+	VCPU_STAT("mmio_insn_cache_hits", mmio_insn_cache_hits),
+	VCPU_STAT("insn_cache_hits", insn_cache_hits),
+	VCPU_STAT("pv_ipis_sent", pv_ipis_sent),
+	VCPU_STAT("pv_ipis_coalesced", pv_ipis_coalesced),
+	VCPU_STAT("pv_ipi_wakeups", pv_ipi_wakeups),
+	VCPU_STAT("evmcs_copies", evmcs_copies),
+	VCPU_STAT("evmcs_copied_bytes", evmcs_copied_bytes, KVM_STAT_BYTES),
+	VCPU_STAT("guest_time_ns", guest_time_ns, KVM_STAT_NS),
+	VCPU_STAT("exit_handling_ns", exit_handling_ns, KVM_STAT_NS),
+	VCPU_STAT("run_loop_ns", run_loop_ns, KVM_STAT_NS),
+	VCPU_STAT("halt_wait_ns", halt_wait_ns, KVM_STAT_NS),
+	VCPU_STAT("userspace_ns", userspace_ns, KVM_STAT_NS),
 	VM_STAT("mmu_shadow_zapped", mmu_shadow_zapped),
 	VM_STAT("mmu_pte_write", mmu_pte_write),
 	VM_STAT("mmu_pte_updated", mmu_pte_updated),
@@ -239,11 +276,31 @@ struct kvm_stats_debugfs_item debugfs_entries[] = {
 	VM_STAT("mmu_flooded", mmu_flooded),
 	VM_STAT("mmu_recycled", mmu_recycled),
 	VM_STAT("mmu_cache_miss", mmu_cache_miss),
-	VM_STAT("mmu_unsync", mmu_unsync),
+	VM_STAT("mmu_unsync", mmu_unsync, KVM_STAT_INSTANT),
 	VM_STAT("remote_tlb_flush", remote_tlb_flush),
-	VM_STAT("largepages", lpages, .mode = 0444),
-	VM_STAT("nx_largepages_splitted", nx_lpage_splits, .mode = 0444),
-	VM_STAT("max_mmu_page_hash_collisions", max_mmu_page_hash_collisions),
+	VM_STAT("irqfd_inject_deferred", irqfd_inject_deferred),
+	VM_STAT("largepages", lpages, .mode = 0444, KVM_STAT_INSTANT),
+	VM_STAT("nx_largepages_splitted", nx_lpage_splits, .mode = 0444,
+		KVM_STAT_INSTANT),
+	VM_STAT("max_mmu_page_hash_collisions", max_mmu_page_hash_collisions,
+		KVM_STAT_PEAK),
+	VM_STAT("apicv_inhibit_disable",
+		apicv_inhibits[APICV_INHIBIT_REASON_DISABLE]),
+	VM_STAT("apicv_inhibit_hyperv",
+		apicv_inhibits[APICV_INHIBIT_REASON_HYPERV]),
+	VM_STAT("apicv_inhibit_nested",
+		apicv_inhibits[APICV_INHIBIT_REASON_NESTED]),
+	VM_STAT("apicv_inhibit_irqwin",
+		apicv_inhibits[APICV_INHIBIT_REASON_IRQWIN]),
+	VM_STAT("apicv_inhibit_pit_reinj",
+		apicv_inhibits[APICV_INHIBIT_REASON_PIT_REINJ]),
+	VM_STAT("apicv_inhibit_x2apic",
+		apicv_inhibits[APICV_INHIBIT_REASON_X2APIC]),
+	VM_STAT("apicv_inhibit_physical_id",
+		apicv_inhibits[APICV_INHIBIT_REASON_PHYSICAL_ID_TOO_BIG]),
+	VM_STAT("apicv_inhibit_backoff",
+		apicv_inhibits[APICV_INHIBIT_REASON_BACKOFF]),
+	VM_STAT("apicv_toggles", apicv_toggles),
 	{ NULL }
 };
 
@@ -324,6 +381,16 @@ static void kvm_on_user_return(struct user_return_notifier *urn)
 	}
 }
 
+unsigned int kvm_nr_user_return_msrs(void)
+{
+	return user_return_msrs_global.nr;
+}
+
+u32 kvm_user_return_msr_index(unsigned int slot)
+{
+	return user_return_msrs_global.msrs[slot];
+}
+
 void kvm_define_user_return_msr(unsigned slot, u32 msr)
 {
 	BUG_ON(slot >= KVM_MAX_NR_USER_RETURN_MSRS);
@@ -351,6 +418,7 @@ int kvm_set_user_return_msr(unsigned slot, u64 value, u64 mask)
 {
 	unsigned int cpu = smp_processor_id();
 	struct kvm_user_return_msrs *msrs = per_cpu_ptr(user_return_msrs, cpu);
+	struct kvm_vcpu *vcpu;
 	int err;
 
 	value = (value & mask) | (msrs->values[slot].host & ~mask);
@@ -360,6 +428,11 @@ int kvm_set_user_return_msr(unsigned slot, u64 value, u64 mask)
 	if (err)
 		return 1;
 
+	/* Each load is undone by at most one reload on return to userspace. */
+	vcpu = kvm_get_running_vcpu();
+	if (vcpu)
+		++vcpu->arch.uret_msr_loads[slot];
+
 	msrs->values[slot].curr = value;
 	if (!msrs->registered) {
 		msrs->urn.on_user_return = kvm_on_user_return;
@@ -1238,6 +1311,7 @@ static const u32 msrs_to_save_all[] = {
 	MSR_ARCH_PERFMON_EVENTSEL0 + 12, MSR_ARCH_PERFMON_EVENTSEL0 + 13,
 	MSR_ARCH_PERFMON_EVENTSEL0 + 14, MSR_ARCH_PERFMON_EVENTSEL0 + 15,
 	MSR_ARCH_PERFMON_EVENTSEL0 + 16, MSR_ARCH_PERFMON_EVENTSEL0 + 17,
+	MSR_IA32_DS_AREA, MSR_PEBS_DATA_CFG, MSR_IA32_PEBS_ENABLE,
 };
 
 static u32 msrs_to_save[ARRAY_SIZE(msrs_to_save_all)];
@@ -1769,6 +1843,9 @@ EXPORT_SYMBOL_GPL(kvm_emulate_wrmsr);
 
 bool kvm_vcpu_exit_request(struct kvm_vcpu *vcpu)
 {
+	/* The nocb wakeup can set need_resched, check it afterwards. */
+	xfer_to_guest_mode_prepare();
+
 	return vcpu->mode == EXITING_GUEST_MODE || kvm_request_pending(vcpu) ||
 		xfer_to_guest_mode_work_pending();
 }
@@ -1970,7 +2047,7 @@ static void kvm_write_system_time(struct kvm_vcpu *vcpu, gpa_t system_time,
 
 	if (vcpu->vcpu_id == 0 && !host_initiated) {
 		if (ka->boot_vcpu_runs_old_kvmclock != old_msr)
-			kvm_make_request(KVM_REQ_MASTERCLOCK_UPDATE, vcpu);
+			kvm_request_masterclock_update(vcpu);
 
 		ka->boot_vcpu_runs_old_kvmclock = old_msr;
 	}
@@ -2142,7 +2219,7 @@ static void kvm_track_tsc_matching(struct kvm_vcpu *vcpu)
 	 */
 	if (ka->use_master_clock ||
 	    (gtod_is_based_on_tsc(gtod->clock.vclock_mode) && vcpus_matched))
-		kvm_make_request(KVM_REQ_MASTERCLOCK_UPDATE, vcpu);
+		kvm_request_masterclock_update(vcpu);
 
 	trace_kvm_track_tsc(vcpu->vcpu_id, ka->nr_vcpus_matched_tsc,
 			    atomic_read(&vcpu->kvm->online_vcpus),
@@ -2523,7 +2600,22 @@ void kvm_make_mclock_inprogress_request(struct kvm *kvm)
 	kvm_make_all_cpus_request(kvm, KVM_REQ_MCLOCK_INPROGRESS);
 }
 
-static void kvm_gen_update_masterclock(struct kvm *kvm)
+/*
+ * The master clock is per VM, so the first vCPU to process the request does
+ * the update for all of them, and the others drop theirs. Events that request
+ * it on every vCPU thus cause a single update, rather than one per vCPU that
+ * each kicks all the vCPUs out of the guest.
+ */
+void kvm_request_masterclock_update(struct kvm_vcpu *vcpu)
+{
+	WRITE_ONCE(vcpu->kvm->arch.masterclock_update_pending, true);
+	kvm_make_request(KVM_REQ_MASTERCLOCK_UPDATE, vcpu);
+}
+
+/*
+ * @force: update even if no KVM_REQ_MASTERCLOCK_UPDATE is pending.
+ */
+static void kvm_gen_update_masterclock(struct kvm *kvm, bool force)
 {
 #ifdef CONFIG_X86_64
 	int i;
@@ -2531,6 +2623,13 @@ static void kvm_gen_update_masterclock(struct kvm *kvm)
 	struct kvm_arch *ka = &kvm->arch;
 
 	spin_lock(&ka->pvclock_gtod_sync_lock);
+
+	/* Another vCPU already did the update since the request was made. */
+	if (!xchg(&ka->masterclock_update_pending, false) && !force) {
+		spin_unlock(&ka->pvclock_gtod_sync_lock);
+		return;
+	}
+
 	kvm_make_mclock_inprogress_request(kvm);
 	/* no guest entries from this point */
 	pvclock_update_vm_gtod_copy(kvm);
@@ -2877,12 +2976,57 @@ static inline bool kvm_pv_async_pf_enabled(struct kvm_vcpu *vcpu)
 	return (vcpu->arch.apf.msr_en_val & mask) == mask;
 }
 
+static inline bool apf_ring_enabled(struct kvm_vcpu *vcpu)
+{
+	return vcpu->arch.apf.msr_en_val & KVM_ASYNC_PF_DELIVERY_RING;
+}
+
+static int apf_get_ring_tail(struct kvm_vcpu *vcpu, u32 *tail)
+{
+	unsigned int offset = offsetof(struct kvm_vcpu_pv_apf_data, ring_tail);
+
+	return kvm_read_guest_offset_cached(vcpu->kvm, &vcpu->arch.apf.data,
+					    tail, offset, sizeof(*tail));
+}
+
+static int apf_put_ring_head(struct kvm_vcpu *vcpu, u32 head)
+{
+	unsigned int offset = offsetof(struct kvm_vcpu_pv_apf_data, ring_head);
+	int r;
+
+	r = kvm_write_guest_offset_cached(vcpu->kvm, &vcpu->arch.apf.data,
+					  &head, offset, sizeof(head));
+	if (!r)
+		vcpu->arch.apf.ring_head = head;
+	return r;
+}
+
+static bool apf_ring_empty(struct kvm_vcpu *vcpu)
+{
+	u32 tail;
+
+	return apf_get_ring_tail(vcpu, &tail) ||
+	       tail == vcpu->arch.apf.ring_head;
+}
+
+static void kvm_apf_notify_page_ready(struct kvm_vcpu *vcpu)
+{
+	struct kvm_lapic_irq irq = {
+		.delivery_mode = APIC_DM_FIXED,
+		.vector = vcpu->arch.apf.vec
+	};
+
+	vcpu->arch.apf.pageready_pending = true;
+	kvm_apic_set_irq(vcpu, &irq, NULL);
+}
+
 static int kvm_pv_enable_async_pf(struct kvm_vcpu *vcpu, u64 data)
 {
 	gpa_t gpa = data & ~0x3f;
+	u32 ring_tail;
 
-	/* Bits 4:5 are reserved, Should be zero */
-	if (data & 0x30)
+	/* Bit 5 is reserved, Should be zero */
+	if (data & 0x20)
 		return 1;
 
 	if (!guest_pv_has(vcpu, KVM_FEATURE_ASYNC_PF_VMEXIT) &&
@@ -2893,6 +3037,11 @@ static int kvm_pv_enable_async_pf(struct kvm_vcpu *vcpu, u64 data)
 	    (data & KVM_ASYNC_PF_DELIVERY_AS_INT))
 		return 1;
 
+	if ((data & KVM_ASYNC_PF_DELIVERY_RING) &&
+	    (!guest_pv_has(vcpu, KVM_FEATURE_ASYNC_PF_RING) ||
+	     !(data & KVM_ASYNC_PF_DELIVERY_AS_INT)))
+		return 1;
+
 	if (!lapic_in_kernel(vcpu))
 		return data ? 1 : 0;
 
@@ -2905,9 +3054,18 @@ static int kvm_pv_enable_async_pf(struct kvm_vcpu *vcpu, u64 data)
 	}
 
 	if (kvm_gfn_to_hva_cache_init(vcpu->kvm, &vcpu->arch.apf.data, gpa,
-					sizeof(u64)))
+			apf_ring_enabled(vcpu) ?
+			offsetof(struct kvm_vcpu_pv_apf_data, enabled) :
+			sizeof(u64)))
 		return 1;
 
+	/* Start with an empty ring, wherever the guest left it. */
+	if (apf_ring_enabled(vcpu)) {
+		if (apf_get_ring_tail(vcpu, &ring_tail) ||
+		    apf_put_ring_head(vcpu, ring_tail))
+			return 1;
+	}
+
 	vcpu->arch.apf.send_user_only = !(data & KVM_ASYNC_PF_SEND_ALWAYS);
 	vcpu->arch.apf.delivery_as_pf_vmexit = data & KVM_ASYNC_PF_DELIVERY_AS_PF_VMEXIT;
 
@@ -2946,25 +3104,35 @@ static void kvm_vcpu_flush_tlb_all(struct kvm_vcpu *vcpu)
 
 static void kvm_vcpu_flush_tlb_guest(struct kvm_vcpu *vcpu)
 {
+	vcpu_clear_insn_cache(vcpu);
 	++vcpu->stat.tlb_flush;
 	kvm_x86_ops.tlb_flush_guest(vcpu);
 }
 
 static void record_steal_time(struct kvm_vcpu *vcpu)
 {
-	struct kvm_host_map map;
+	struct gfn_to_pfn_cache *gpc = &vcpu->arch.st.cache;
+	gpa_t gpa = vcpu->arch.st.msr_val & KVM_STEAL_VALID_BITS;
 	struct kvm_steal_time *st;
 
 	if (!(vcpu->arch.st.msr_val & KVM_MSR_ENABLED))
 		return;
 
-	/* -EAGAIN is returned in atomic context so we can just return. */
-	if (kvm_map_gfn(vcpu, vcpu->arch.st.msr_val >> PAGE_SHIFT,
-			&map, &vcpu->arch.st.cache, false))
+	if (unlikely(!gpc->active || gpc->gpa != gpa) &&
+	    kvm_gpc_activate(gpc, gpa, sizeof(*st)))
 		return;
 
-	st = map.hva +
-		offset_in_page(vcpu->arch.st.msr_val & KVM_STEAL_VALID_BITS);
+	read_lock(&gpc->lock);
+	while (!kvm_gpc_check(gpc, sizeof(*st))) {
+		read_unlock(&gpc->lock);
+
+		if (kvm_gpc_refresh(gpc, sizeof(*st)))
+			return;
+
+		read_lock(&gpc->lock);
+	}
+
+	st = gpc->khva;
 
 	/*
 	 * Doing a TLB flush here, on the guest's behalf, can avoid
@@ -2990,11 +3158,26 @@ static void record_steal_time(struct kvm_vcpu *vcpu)
 		vcpu->arch.st.last_steal;
 	vcpu->arch.st.last_steal = current->sched_info.run_delay;
 
+	/*
+	 * Tell the guest how loaded the host CPU is. If other tasks are
+	 * runnable, the vCPU is likely to be preempted at the end of its time
+	 * slice, and the guest may want to avoid taking or spinning on locks.
+	 * This is refreshed whenever the vCPU is scheduled in.
+	 */
+	if (guest_pv_has(vcpu, KVM_FEATURE_PV_SCHED_HINTS)) {
+		unsigned int nr_running = nr_running_this_cpu();
+
+		st->nr_running = nr_running;
+		st->sched_hints = nr_running > 1 ?
+				  KVM_SCHED_HINT_PREEMPT_PENDING : 0;
+	}
+
 	smp_wmb();
 
 	st->version += 1;
 
-	kvm_unmap_gfn(vcpu, &map, &vcpu->arch.st.cache, true, false);
+	mark_page_dirty_in_slot(vcpu->kvm, gpc->memslot, gpa_to_gfn(gpa));
+	read_unlock(&gpc->lock);
 }
 
 int kvm_set_msr_common(struct kvm_vcpu *vcpu, struct msr_data *msr_info)
@@ -3179,6 +3362,16 @@ int kvm_set_msr_common(struct kvm_vcpu *vcpu, struct msr_data *msr_info)
 		if (data & 0x1) {
 			vcpu->arch.apf.pageready_pending = false;
 			kvm_check_async_pf_completion(vcpu);
+
+			/*
+			 * Tokens queued after the guest drained the ring, but
+			 * before the ACK, did not raise an interrupt.
+			 */
+			if (kvm_pv_async_pf_enabled(vcpu) &&
+			    apf_ring_enabled(vcpu) &&
+			    !vcpu->arch.apf.pageready_pending &&
+			    !apf_ring_empty(vcpu))
+				kvm_apf_notify_page_ready(vcpu);
 		}
 		break;
 	case MSR_KVM_STEAL_TIME:
@@ -3752,6 +3945,9 @@ int kvm_vm_ioctl_check_extension(struct kvm *kvm, long ext)
 	case KVM_CAP_ADJUST_CLOCK:
 		r = KVM_CLOCK_TSC_STABLE;
 		break;
+	case KVM_CAP_PRE_FAULT_MEMORY:
+		r = tdp_enabled;
+		break;
 	case KVM_CAP_X86_DISABLE_EXITS:
 		r |=  KVM_X86_DISABLE_EXITS_HLT | KVM_X86_DISABLE_EXITS_PAUSE |
 		      KVM_X86_DISABLE_EXITS_CSTATE;
@@ -3791,8 +3987,15 @@ int kvm_vm_ioctl_check_extension(struct kvm *kvm, long ext)
 		r = boot_cpu_has(X86_FEATURE_XSAVE);
 		break;
 	case KVM_CAP_TSC_CONTROL:
+	case KVM_CAP_VM_TSC_CONTROL:
 		r = kvm_has_tsc_control;
 		break;
+	case KVM_CAP_MAX_HUGEPAGE_LEVEL:
+		r = kvm_mmu_max_huge_page_level();
+		break;
+	case KVM_CAP_VCPU_STATE:
+		r = kvm_vcpu_state_max_size();
+		break;
 	case KVM_CAP_X2APIC_API:
 		r = KVM_X2APIC_API_VALID_FLAGS;
 		break;
@@ -3977,8 +4180,10 @@ void kvm_arch_vcpu_load(struct kvm_vcpu *vcpu, int cpu)
 
 static void kvm_steal_time_set_preempted(struct kvm_vcpu *vcpu)
 {
-	struct kvm_host_map map;
+	struct gfn_to_pfn_cache *gpc = &vcpu->arch.st.cache;
+	gpa_t gpa = vcpu->arch.st.msr_val & KVM_STEAL_VALID_BITS;
 	struct kvm_steal_time *st;
+	unsigned long flags;
 
 	if (!(vcpu->arch.st.msr_val & KVM_MSR_ENABLED))
 		return;
@@ -3986,16 +4191,18 @@ static void kvm_steal_time_set_preempted(struct kvm_vcpu *vcpu)
 	if (vcpu->arch.st.preempted)
 		return;
 
-	if (kvm_map_gfn(vcpu, vcpu->arch.st.msr_val >> PAGE_SHIFT, &map,
-			&vcpu->arch.st.cache, true))
-		return;
-
-	st = map.hva +
-		offset_in_page(vcpu->arch.st.msr_val & KVM_STEAL_VALID_BITS);
-
-	st->preempted = vcpu->arch.st.preempted = KVM_VCPU_PREEMPTED;
-
-	kvm_unmap_gfn(vcpu, &map, &vcpu->arch.st.cache, true, true);
+	/*
+	 * This runs in atomic context, so the cache can't be refreshed here;
+	 * a stale cache is fixed up by the next record_steal_time().
+	 */
+	read_lock_irqsave(&gpc->lock, flags);
+	if (gpc->gpa == gpa && kvm_gpc_check(gpc, sizeof(*st))) {
+		st = gpc->khva;
+		st->preempted = vcpu->arch.st.preempted = KVM_VCPU_PREEMPTED;
+		mark_page_dirty_in_slot(vcpu->kvm, gpc->memslot,
+					gpa_to_gfn(gpa));
+	}
+	read_unlock_irqrestore(&gpc->lock, flags);
 }
 
 void kvm_arch_vcpu_put(struct kvm_vcpu *vcpu)
@@ -4626,6 +4833,32 @@ static int kvm_vcpu_ioctl_enable_cap(struct kvm_vcpu *vcpu,
 	}
 }
 
+long kvm_arch_vcpu_pre_fault_memory(struct kvm_vcpu *vcpu,
+				    struct kvm_pre_fault_memory *range)
+{
+	u64 end;
+	int level = PG_LEVEL_4K;
+	int r;
+
+	if (!tdp_enabled)
+		return -EOPNOTSUPP;
+
+	r = kvm_mmu_reload(vcpu);
+	if (r)
+		return r;
+
+	r = kvm_mmu_map_tdp_page(vcpu, range->gpa, &level);
+	if (r < 0)
+		return r;
+
+	/*
+	 * The fault may have installed a huge page, skip to the end of it so
+	 * that the rest of the range it covers isn't faulted in page by page.
+	 */
+	end = (range->gpa & KVM_HPAGE_MASK(level)) + KVM_HPAGE_SIZE(level);
+	return min(range->size, end - range->gpa);
+}
+
 long kvm_arch_vcpu_ioctl(struct file *filp,
 			 unsigned int ioctl, unsigned long arg)
 {
@@ -4834,6 +5067,19 @@ long kvm_arch_vcpu_ioctl(struct file *filp,
 		r = kvm_vcpu_ioctl_x86_set_debugregs(vcpu, &dbgregs);
 		break;
 	}
+	case KVM_GET_VCPU_STATE: {
+		struct kvm_vcpu_state __user *ustate = argp;
+		u32 size;
+
+		r = -EFAULT;
+		if (get_user(size, &ustate->size))
+			goto out;
+		r = kvm_vcpu_get_state(vcpu, ustate, size);
+		break;
+	}
+	case KVM_SET_VCPU_STATE:
+		r = kvm_vcpu_set_state(vcpu, argp, U32_MAX);
+		break;
 	case KVM_GET_XSAVE: {
 		u.xsave = kzalloc(sizeof(struct kvm_xsave), GFP_KERNEL_ACCOUNT);
 		r = -ENOMEM;
@@ -5275,6 +5521,9 @@ int kvm_vm_ioctl_enable_cap(struct kvm *kvm,
 		kvm->arch.user_space_msr_mask = cap->args[0];
 		r = 0;
 		break;
+	case KVM_CAP_MAX_HUGEPAGE_LEVEL:
+		r = kvm_mmu_set_max_huge_page_level(kvm, cap->args[0]);
+		break;
 #ifdef CONFIG_X86_SGX_VIRTUALIZATION
 	case KVM_CAP_SGX_ATTRIBUTE: {
 		unsigned long allowed_attributes = 0;
@@ -5403,6 +5652,47 @@ static int kvm_vm_ioctl_set_msr_filter(struct kvm *kvm, void __user *argp)
 	return r;
 }
 
+/*
+ * Save or restore the state of the first nr_vcpus vCPUs in one call, taking
+ * each vCPU the same way as its own ioctls do.
+ */
+static int kvm_vm_ioctl_vcpu_states(struct kvm *kvm,
+				    struct kvm_vcpu_states __user *argp,
+				    bool set)
+{
+	struct kvm_vcpu_state __user *ustate;
+	struct kvm_vcpu_states states;
+	struct kvm_vcpu *vcpu;
+	int r = 0;
+	u32 i;
+
+	if (copy_from_user(&states, argp, sizeof(states)))
+		return -EFAULT;
+
+	if (states.nr_vcpus > atomic_read(&kvm->online_vcpus))
+		return -EINVAL;
+
+	for (i = 0; i < states.nr_vcpus && !r; i++) {
+		vcpu = kvm_get_vcpu(kvm, i);
+		ustate = u64_to_user_ptr(states.addr + (u64)i * states.stride);
+
+		if (mutex_lock_killable(&vcpu->mutex))
+			return -EINTR;
+
+		vcpu_load(vcpu);
+		if (set)
+			r = kvm_vcpu_set_state(vcpu, ustate, states.stride);
+		else
+			r = kvm_vcpu_get_state(vcpu, ustate, states.stride);
+		vcpu_put(vcpu);
+
+		mutex_unlock(&vcpu->mutex);
+		cond_resched();
+	}
+
+	return r;
+}
+
 long kvm_arch_vm_ioctl(struct file *filp,
 		       unsigned int ioctl, unsigned long arg)
 {
@@ -5424,6 +5714,12 @@ long kvm_arch_vm_ioctl(struct file *filp,
 	case KVM_SET_TSS_ADDR:
 		r = kvm_vm_ioctl_set_tss_addr(kvm, arg);
 		break;
+	case KVM_GET_VCPU_STATES:
+		r = kvm_vm_ioctl_vcpu_states(kvm, argp, false);
+		break;
+	case KVM_SET_VCPU_STATES:
+		r = kvm_vm_ioctl_vcpu_states(kvm, argp, true);
+		break;
 	case KVM_SET_IDENTITY_MAP_ADDR: {
 		u64 ident_addr;
 
@@ -5646,7 +5942,7 @@ long kvm_arch_vm_ioctl(struct file *filp,
 		 * kvm_gen_update_masterclock() can be cut down to locked
 		 * pvclock_update_vm_gtod_copy().
 		 */
-		kvm_gen_update_masterclock(kvm);
+		kvm_gen_update_masterclock(kvm, true);
 		now_ns = get_kvmclock_ns(kvm);
 		kvm->arch.kvmclock_offset += user_ns.clock - now_ns;
 		kvm_make_all_cpus_request(kvm, KVM_REQ_CLOCK_UPDATE);
@@ -5712,6 +6008,38 @@ long kvm_arch_vm_ioctl(struct file *filp,
 	case KVM_X86_SET_MSR_FILTER:
 		r = kvm_vm_ioctl_set_msr_filter(kvm, argp);
 		break;
+	case KVM_SET_TSC_KHZ: {
+		u32 user_tsc_khz;
+
+		r = -EINVAL;
+		user_tsc_khz = (u32)arg;
+
+		if (kvm_has_tsc_control &&
+		    user_tsc_khz >= kvm_max_guest_tsc_khz)
+			goto out;
+
+		if (user_tsc_khz == 0)
+			user_tsc_khz = tsc_khz;
+
+		/*
+		 * Setting the frequency before creating the vCPUs gives them
+		 * the same TSC scaling ratio from the start, and lets
+		 * kvm_synchronize_tsc() match them for the master clock.
+		 */
+		mutex_lock(&kvm->lock);
+		if (!kvm->created_vcpus) {
+			WRITE_ONCE(kvm->arch.default_tsc_khz, user_tsc_khz);
+			r = 0;
+		} else {
+			r = -EBUSY;
+		}
+		mutex_unlock(&kvm->lock);
+		goto out;
+	}
+	case KVM_GET_TSC_KHZ: {
+		r = READ_ONCE(kvm->arch.default_tsc_khz);
+		goto out;
+	}
 	default:
 		r = -ENOTTY;
 	}
@@ -5788,6 +6116,12 @@ static void kvm_init_msr_list(void)
 			    min(INTEL_PMC_MAX_GENERIC, x86_pmu.num_counters_gp))
 				continue;
 			break;
+		case MSR_IA32_DS_AREA:
+		case MSR_PEBS_DATA_CFG:
+		case MSR_IA32_PEBS_ENABLE:
+			if (!x86_pmu.pebs_ept)
+				continue;
+			break;
 		default:
 			break;
 		}
@@ -7087,9 +7421,9 @@ static bool reexecute_instruction(struct kvm_vcpu *vcpu, gpa_t cr2_or_gpa,
 	if (vcpu->arch.mmu->direct_map) {
 		unsigned int indirect_shadow_pages;
 
-		spin_lock(&vcpu->kvm->mmu_lock);
+		write_lock(&vcpu->kvm->mmu_lock);
 		indirect_shadow_pages = vcpu->kvm->arch.indirect_shadow_pages;
-		spin_unlock(&vcpu->kvm->mmu_lock);
+		write_unlock(&vcpu->kvm->mmu_lock);
 
 		if (indirect_shadow_pages)
 			kvm_mmu_unprotect_page(vcpu->kvm, gpa_to_gfn(gpa));
@@ -7297,6 +7631,179 @@ static bool is_vmware_backdoor_opcode(struct x86_emulate_ctxt *ctxt)
 	return false;
 }
 
+/*
+ * The emulator translates RIP through the guest page tables on every
+ * instruction fetch.  With shadow paging, KVM sees every CR3 load and TLB
+ * flush of the guest and drops the cached translations then, so that the
+ * fetch can go straight to the guest physical address of the instruction.
+ * With TDP the guest can change its mappings without exiting, so nothing is
+ * cached.  The bytes themselves are always read again, which takes care of
+ * any writes to the code.
+ */
+static struct kvm_insn_cache_entry *kvm_insn_cache_lookup(struct kvm_vcpu *vcpu,
+							  unsigned long rip)
+{
+	return &vcpu->arch.insn_cache[hash_long(rip, KVM_INSN_CACHE_BITS)];
+}
+
+static int kvm_insn_cache_fetch(struct kvm_vcpu *vcpu,
+				struct x86_emulate_ctxt *ctxt, void *insn)
+{
+	unsigned long rip = kvm_get_linear_rip(vcpu);
+	struct kvm_insn_cache_entry *ic;
+
+	if (tdp_enabled)
+		return 0;
+
+	ic = kvm_insn_cache_lookup(vcpu, rip);
+	if (!ic->len || ic->rip != rip || ic->mode != ctxt->mode ||
+	    ic->cr3 != kvm_read_cr3(vcpu) ||
+	    ic->cpl != kvm_x86_ops.get_cpl(vcpu) ||
+	    ic->gen != kvm_memslots(vcpu->kvm)->generation)
+		return 0;
+
+	if (kvm_vcpu_read_guest(vcpu, ic->gpa, insn, ic->len))
+		return 0;
+
+	++vcpu->stat.insn_cache_hits;
+	return ic->len;
+}
+
+static void kvm_insn_cache_fill(struct kvm_vcpu *vcpu,
+				struct x86_emulate_ctxt *ctxt)
+{
+	unsigned int len = ctxt->fetch.ptr - ctxt->fetch.data;
+	unsigned long rip = kvm_get_linear_rip(vcpu);
+	struct kvm_insn_cache_entry *ic;
+	struct x86_exception exception;
+	u32 access = PFERR_FETCH_MASK;
+	u64 gen;
+	gpa_t gpa;
+	u8 cpl;
+
+	if (tdp_enabled || !len || offset_in_page(rip) + len > PAGE_SIZE)
+		return;
+
+	gen = kvm_memslots(vcpu->kvm)->generation;
+	if (unlikely(gen & KVM_MEMSLOT_GEN_UPDATE_IN_PROGRESS))
+		return;
+
+	cpl = kvm_x86_ops.get_cpl(vcpu);
+	if (cpl == 3)
+		access |= PFERR_USER_MASK;
+	gpa = vcpu->arch.walk_mmu->gva_to_gpa(vcpu, rip, access, &exception);
+	if (gpa == UNMAPPED_GVA)
+		return;
+
+	ic = kvm_insn_cache_lookup(vcpu, rip);
+	ic->cr3 = kvm_read_cr3(vcpu);
+	ic->rip = rip;
+	ic->gpa = gpa;
+	ic->gen = gen;
+	ic->mode = ctxt->mode;
+	ic->cpl = cpl;
+	ic->len = len;
+}
+
+static struct kvm_mmio_insn *kvm_mmio_insn_lookup(struct kvm_vcpu *vcpu,
+						  unsigned long rip)
+{
+	return &vcpu->arch.mmio_insn_cache[hash_long(rip,
+						     KVM_MMIO_INSN_CACHE_BITS)];
+}
+
+/*
+ * Remember a MOV from a register or an immediate to memory, which the
+ * emulator has just completed in the kernel, so that the next time the
+ * instruction faults on MMIO kvm_mmio_insn_cache_write() can replay it
+ * without decoding.  Only 64-bit mode is handled, where the linear RIP is
+ * the RIP and the decoding does not depend on the code segment.
+ */
+static void kvm_mmio_insn_cache_fill(struct kvm_vcpu *vcpu,
+				     struct x86_emulate_ctxt *ctxt)
+{
+	unsigned int len = ctxt->fetch.ptr - ctxt->fetch.data;
+	struct kvm_mmio_insn *mi;
+	unsigned long rip;
+	int reg = -1;
+
+	if (ctxt->mode != X86EMUL_MODE_PROT64 || ctxt->opcode_len != 1 ||
+	    ctxt->rep_prefix || ctxt->dst.type != OP_MEM ||
+	    !len || len > sizeof(mi->insn))
+		return;
+
+	switch (ctxt->b) {
+	case 0x88:	/* MOV r/m8, r8 */
+	case 0x89:	/* MOV r/m, r */
+		reg = ctxt->modrm_reg;
+		break;
+	case 0xc6:	/* MOV r/m8, imm8 */
+	case 0xc7:	/* MOV r/m, imm */
+		if (ctxt->modrm_reg & 7)
+			return;
+		break;
+	default:
+		return;
+	}
+
+	rip = ctxt->eip - len;
+	mi = kvm_mmio_insn_lookup(vcpu, rip);
+	mi->rip = rip;
+	mi->len = len;
+	mi->bytes = ctxt->dst.bytes;
+	mi->high_byte = ctxt->b == 0x88 && !ctxt->rex_prefix && reg >= 4;
+	mi->reg = mi->high_byte ? reg - 4 : reg;
+	mi->imm = ctxt->src.val;
+	memcpy(mi->insn, ctxt->fetch.data, len);
+}
+
+/*
+ * Complete an MMIO store at the current RIP from the instruction cache, if
+ * the instruction is cached and the write is claimed by an in-kernel device,
+ * e.g. an ioeventfd doorbell.  The caller skips the instruction on success.
+ */
+bool kvm_mmio_insn_cache_write(struct kvm_vcpu *vcpu, gpa_t gpa)
+{
+	unsigned long rip = kvm_rip_read(vcpu);
+	struct x86_exception exception;
+	struct kvm_mmio_insn *mi;
+	u8 insn[sizeof(mi->insn)];
+	u32 access = PFERR_FETCH_MASK;
+	u64 val;
+
+	if (!is_64_bit_mode(vcpu) || vcpu->guest_debug)
+		return false;
+
+	mi = kvm_mmio_insn_lookup(vcpu, rip);
+	if (!mi->len || mi->rip != rip ||
+	    offset_in_page(gpa) + mi->bytes > PAGE_SIZE)
+		return false;
+
+	/* The guest may have rewritten the code without any exit. */
+	if (kvm_x86_ops.get_cpl(vcpu) == 3)
+		access |= PFERR_USER_MASK;
+	if (kvm_read_guest_virt_helper(rip, insn, mi->len, vcpu, access,
+				       &exception) != X86EMUL_CONTINUE ||
+	    memcmp(insn, mi->insn, mi->len))
+		return false;
+
+	if (mi->reg < 0)
+		val = mi->imm;
+	else if (mi->high_byte)
+		val = kvm_register_read(vcpu, mi->reg) >> 8;
+	else
+		val = kvm_register_read(vcpu, mi->reg);
+
+	vcpu->arch.l1tf_flush_l1d = true;
+	if (kvm_io_bus_write(vcpu, KVM_MMIO_BUS, gpa, mi->bytes, &val))
+		return false;
+
+	trace_kvm_mmio(KVM_TRACE_MMIO_WRITE, mi->bytes, gpa, &val);
+	++vcpu->stat.mmio_insn_cache_hits;
+	return true;
+}
+EXPORT_SYMBOL_GPL(kvm_mmio_insn_cache_write);
+
 int x86_emulate_instruction(struct kvm_vcpu *vcpu, gpa_t cr2_or_gpa,
 			    int emulation_type, void *insn, int insn_len)
 {
@@ -7304,6 +7811,8 @@ int x86_emulate_instruction(struct kvm_vcpu *vcpu, gpa_t cr2_or_gpa,
 	struct x86_emulate_ctxt *ctxt = vcpu->arch.emulate_ctxt;
 	bool writeback = true;
 	bool write_fault_to_spt;
+	u8 cached_insn[15];
+	bool fetched = false;
 
 	if (unlikely(!kvm_x86_ops.can_emulate_instruction(vcpu, insn, insn_len)))
 		return 1;
@@ -7338,7 +7847,17 @@ int x86_emulate_instruction(struct kvm_vcpu *vcpu, gpa_t cr2_or_gpa,
 
 		ctxt->ud = emulation_type & EMULTYPE_TRAP_UD;
 
+		if (!insn_len) {
+			insn_len = kvm_insn_cache_fetch(vcpu, ctxt, cached_insn);
+			if (insn_len)
+				insn = cached_insn;
+			else
+				fetched = true;
+		}
+
 		r = x86_decode_insn(ctxt, insn, insn_len);
+		if (r == EMULATION_OK && fetched)
+			kvm_insn_cache_fill(vcpu, ctxt);
 
 		trace_kvm_emulate_insn_start(vcpu);
 		++vcpu->stat.insn_emulation;
@@ -7469,6 +7988,10 @@ int x86_emulate_instruction(struct kvm_vcpu *vcpu, gpa_t cr2_or_gpa,
 		 */
 		if (unlikely((ctxt->eflags & ~rflags) & X86_EFLAGS_IF))
 			kvm_make_request(KVM_REQ_EVENT, vcpu);
+
+		if (r == 1 && !ctxt->have_exception &&
+		    (emulation_type & EMULTYPE_PF))
+			kvm_mmio_insn_cache_fill(vcpu, ctxt);
 	} else
 		vcpu->arch.emulate_regs_need_sync_to_vcpu = true;
 
@@ -7828,7 +8351,7 @@ static void pvclock_gtod_update_fn(struct work_struct *work)
 	mutex_lock(&kvm_lock);
 	list_for_each_entry(kvm, &vm_list, vm_list)
 		kvm_for_each_vcpu(i, vcpu, kvm)
-			kvm_make_request(KVM_REQ_MASTERCLOCK_UPDATE, vcpu);
+			kvm_request_masterclock_update(vcpu);
 	atomic_set(&kvm_guest_has_master_clock, 0);
 	mutex_unlock(&kvm_lock);
 }
@@ -8065,7 +8588,8 @@ void kvm_apicv_init(struct kvm *kvm, bool enable)
 }
 EXPORT_SYMBOL_GPL(kvm_apicv_init);
 
-static void kvm_sched_yield(struct kvm *kvm, unsigned long dest_id)
+static struct kvm_vcpu *kvm_pv_apic_id_to_vcpu(struct kvm *kvm,
+						unsigned long dest_id)
 {
 	struct kvm_vcpu *target = NULL;
 	struct kvm_apic_map *map;
@@ -8078,6 +8602,13 @@ static void kvm_sched_yield(struct kvm *kvm, unsigned long dest_id)
 
 	rcu_read_unlock();
 
+	return target;
+}
+
+static void kvm_sched_yield(struct kvm *kvm, unsigned long dest_id)
+{
+	struct kvm_vcpu *target = kvm_pv_apic_id_to_vcpu(kvm, dest_id);
+
 	if (target && READ_ONCE(target->ready))
 		kvm_vcpu_yield_to(target);
 }
@@ -8135,7 +8666,7 @@ int kvm_emulate_hypercall(struct kvm_vcpu *vcpu)
 		if (!guest_pv_has(vcpu, KVM_FEATURE_PV_SEND_IPI))
 			break;
 
-		ret = kvm_pv_send_ipi(vcpu->kvm, a0, a1, a2, a3, op_64_bit);
+		ret = kvm_pv_send_ipi(vcpu, a0, a1, a2, a3, op_64_bit);
 		break;
 	case KVM_HC_SCHED_YIELD:
 		if (!guest_pv_has(vcpu, KVM_FEATURE_PV_SCHED_YIELD))
@@ -8144,6 +8675,15 @@ int kvm_emulate_hypercall(struct kvm_vcpu *vcpu)
 		kvm_sched_yield(vcpu->kvm, a0);
 		ret = 0;
 		break;
+	case KVM_HC_LOCK_HOLDER:
+		if (!guest_pv_has(vcpu, KVM_FEATURE_PV_LOCK_HOLDER))
+			break;
+
+		/* An APIC ID that doesn't map to a vCPU clears the hint. */
+		WRITE_ONCE(vcpu->lock_holder_hint,
+			   kvm_pv_apic_id_to_vcpu(vcpu->kvm, a0));
+		ret = 0;
+		break;
 	default:
 		ret = -KVM_ENOSYS;
 		break;
@@ -8616,14 +9156,7 @@ static void process_smi(struct kvm_vcpu *vcpu)
 void kvm_make_scan_ioapic_request_mask(struct kvm *kvm,
 				       unsigned long *vcpu_bitmap)
 {
-	cpumask_var_t cpus;
-
-	zalloc_cpumask_var(&cpus, GFP_ATOMIC);
-
-	kvm_make_vcpus_request_mask(kvm, KVM_REQ_SCAN_IOAPIC,
-				    NULL, vcpu_bitmap, cpus);
-
-	free_cpumask_var(cpus);
+	kvm_make_vcpus_request_mask(kvm, KVM_REQ_SCAN_IOAPIC, vcpu_bitmap);
 }
 
 void kvm_make_scan_ioapic_request(struct kvm *kvm)
@@ -8653,11 +9186,24 @@ void kvm_request_apicv_update(struct kvm *kvm, bool activate, ulong bit)
 {
 	struct kvm_vcpu *except;
 	unsigned long old, new, expected;
+	unsigned long backoff = msecs_to_jiffies(READ_ONCE(apicv_backoff_ms));
+	bool defer;
 
-	if (!kvm_x86_ops.check_apicv_inhibit_reasons ||
-	    !kvm_x86_ops.check_apicv_inhibit_reasons(bit))
+	if (bit != APICV_INHIBIT_REASON_BACKOFF &&
+	    (!kvm_x86_ops.check_apicv_inhibit_reasons ||
+	     !kvm_x86_ops.check_apicv_inhibit_reasons(bit)))
 		return;
 
+	/*
+	 * If APICv was inhibited only recently, replace the last inhibit
+	 * reason with APICV_INHIBIT_REASON_BACKOFF instead of re-activating
+	 * APICv.  Reasons that come and go in the meantime then do not toggle
+	 * APICv at all, and kvm_apicv_backoff_fn() activates it later.
+	 */
+	defer = activate && bit != APICV_INHIBIT_REASON_BACKOFF && backoff &&
+		time_before(jiffies,
+			    READ_ONCE(kvm->arch.apicv_inhibit_jiffies) + backoff);
+
 	old = READ_ONCE(kvm->arch.apicv_inhibit_reasons);
 	do {
 		expected = new = old;
@@ -8665,14 +9211,32 @@ void kvm_request_apicv_update(struct kvm *kvm, bool activate, ulong bit)
 			__clear_bit(bit, &new);
 		else
 			__set_bit(bit, &new);
+		if (defer && !new)
+			__set_bit(APICV_INHIBIT_REASON_BACKOFF, &new);
 		if (new == old)
 			break;
 		old = cmpxchg(&kvm->arch.apicv_inhibit_reasons, expected, new);
 	} while (old != expected);
 
+	if (new == old)
+		return;
+
+	if (!activate)
+		kvm->stat.apicv_inhibits[bit]++;
+
+	if (test_bit(APICV_INHIBIT_REASON_BACKOFF, &new) &&
+	    !test_bit(APICV_INHIBIT_REASON_BACKOFF, &old)) {
+		kvm->stat.apicv_inhibits[APICV_INHIBIT_REASON_BACKOFF]++;
+		schedule_delayed_work(&kvm->arch.apicv_backoff_work, backoff);
+	}
+
 	if (!!old == !!new)
 		return;
 
+	if (!activate)
+		WRITE_ONCE(kvm->arch.apicv_inhibit_jiffies, jiffies);
+	kvm->stat.apicv_toggles++;
+
 	trace_kvm_apicv_update_request(activate, bit);
 	if (kvm_x86_ops.pre_update_apicv_exec_ctrl)
 		kvm_x86_ops.pre_update_apicv_exec_ctrl(kvm, activate);
@@ -8690,6 +9254,20 @@ void kvm_request_apicv_update(struct kvm *kvm, bool activate, ulong bit)
 }
 EXPORT_SYMBOL_GPL(kvm_request_apicv_update);
 
+/*
+ * Re-activating APICv may have to map the APIC access page, which must be
+ * done from a task that owns the VM's mm.  Leave it to the vCPUs.
+ */
+static void kvm_apicv_backoff_fn(struct work_struct *work)
+{
+	struct delayed_work *dwork = to_delayed_work(work);
+	struct kvm_arch *ka = container_of(dwork, struct kvm_arch,
+					   apicv_backoff_work);
+	struct kvm *kvm = container_of(ka, struct kvm, arch);
+
+	kvm_make_all_cpus_request(kvm, KVM_REQ_APICV_BACKOFF);
+}
+
 static void vcpu_scan_ioapic(struct kvm_vcpu *vcpu)
 {
 	if (!kvm_apic_present(vcpu))
@@ -8755,6 +9333,77 @@ void __kvm_request_immediate_exit(struct kvm_vcpu *vcpu)
 }
 EXPORT_SYMBOL_GPL(__kvm_request_immediate_exit);
 
+static unsigned int kvm_exit_latency_bucket(u64 delta)
+{
+	return min_t(unsigned int, fls64(delta >> KVM_EXIT_LATENCY_MIN_SHIFT),
+		     KVM_EXIT_LATENCY_BUCKETS - 1);
+}
+
+/*
+ * Return the time spent in the previous state of the vCPU thread, and start
+ * the next one. local_clock() is cheap, but it isn't synchronized across CPUs,
+ * which migrations may expose as a small negative time, counted as zero.
+ */
+static u64 kvm_vcpu_state_change(struct kvm_vcpu *vcpu)
+{
+	u64 now = local_clock(), last = vcpu->arch.state_clock;
+
+	vcpu->arch.state_clock = now;
+
+	return last && (s64)(now - last) > 0 ? now - last : 0;
+}
+
+static u64 kvm_vcpu_halt_poll_ns(struct kvm_vcpu *vcpu)
+{
+	return vcpu->stat.halt_poll_success_ns + vcpu->stat.halt_poll_fail_ns;
+}
+
+/* kvm_vcpu_block() accounts the polling, the rest is the wait. */
+static void kvm_vcpu_block_accounted(struct kvm_vcpu *vcpu)
+{
+	u64 poll_ns = kvm_vcpu_halt_poll_ns(vcpu), block_ns;
+
+	vcpu->stat.run_loop_ns += kvm_vcpu_state_change(vcpu);
+	kvm_vcpu_block(vcpu);
+	block_ns = kvm_vcpu_state_change(vcpu);
+
+	poll_ns = kvm_vcpu_halt_poll_ns(vcpu) - poll_ns;
+	vcpu->stat.halt_wait_ns += block_ns - min(block_ns, poll_ns);
+}
+
+/*
+ * Account the time since the last VM-exit, i.e. the time spent handling it in
+ * KVM and, for exits that weren't handled in the kernel, in userspace.
+ */
+static void kvm_exit_latency_record(struct kvm_vcpu *vcpu)
+{
+	struct kvm_exit_latency_hist *hist;
+
+	if (!vcpu->arch.exit_latency_tsc)
+		return;
+
+	hist = &vcpu->arch.exit_latency[vcpu->arch.exit_latency_index];
+	hist->count[kvm_exit_latency_bucket(rdtsc() -
+					    vcpu->arch.exit_latency_tsc)]++;
+}
+
+unsigned int kvm_arch_vcpu_nr_stats_hist(struct kvm_vcpu *vcpu, u16 *size)
+{
+	*size = KVM_EXIT_LATENCY_BUCKETS;
+	return kvm_x86_ops.nr_exit_latency_reasons;
+}
+
+/* One exit latency histogram per exit latency index, in host TSC cycles. */
+u64 *kvm_arch_vcpu_stats_hist(struct kvm_vcpu *vcpu, unsigned int i,
+			      struct kvm_stats_desc *desc)
+{
+	desc->flags = KVM_STATS_TYPE_LOG_HIST | KVM_STATS_UNIT_CYCLES;
+	desc->bucket_shift = KVM_EXIT_LATENCY_MIN_SHIFT;
+	snprintf(desc->name, KVM_STATS_NAME_SIZE, "exit_latency_%u", i);
+
+	return vcpu->arch.exit_latency[i].count;
+}
+
 /*
  * Returns 1 to let vcpu_run() continue the guest execution loop without
  * exiting to the userspace.  Otherwise, the value will be returned to the
@@ -8767,9 +9416,19 @@ static int vcpu_enter_guest(struct kvm_vcpu *vcpu)
 		dm_request_for_irq_injection(vcpu) &&
 		kvm_cpu_accept_dm_intr(vcpu);
 	fastpath_t exit_fastpath;
+	u64 host_tsc;
 
 	bool req_immediate_exit = false;
 
+	/* Forbid vmenter if vcpu dirty ring is soft-full */
+	if (unlikely(vcpu->kvm->dirty_ring_size &&
+		     kvm_dirty_ring_soft_full(&vcpu->dirty_ring))) {
+		vcpu->run->exit_reason = KVM_EXIT_DIRTY_RING_FULL;
+		trace_kvm_dirty_ring_exit(vcpu);
+		r = 0;
+		goto out;
+	}
+
 	if (kvm_request_pending(vcpu)) {
 		if (kvm_check_request(KVM_REQ_GET_NESTED_STATE_PAGES, vcpu)) {
 			if (unlikely(!kvm_x86_ops.nested_ops->get_nested_state_pages(vcpu))) {
@@ -8782,7 +9441,7 @@ static int vcpu_enter_guest(struct kvm_vcpu *vcpu)
 		if (kvm_check_request(KVM_REQ_MIGRATE_TIMER, vcpu))
 			__kvm_migrate_timers(vcpu);
 		if (kvm_check_request(KVM_REQ_MASTERCLOCK_UPDATE, vcpu))
-			kvm_gen_update_masterclock(vcpu->kvm);
+			kvm_gen_update_masterclock(vcpu->kvm, false);
 		if (kvm_check_request(KVM_REQ_GLOBAL_CLOCK_UPDATE, vcpu))
 			kvm_gen_kvmclock_update(vcpu);
 		if (kvm_check_request(KVM_REQ_CLOCK_UPDATE, vcpu)) {
@@ -8802,7 +9461,8 @@ static int vcpu_enter_guest(struct kvm_vcpu *vcpu)
 		}
 		if (kvm_check_request(KVM_REQ_TLB_FLUSH_CURRENT, vcpu))
 			kvm_vcpu_flush_tlb_current(vcpu);
-		if (kvm_check_request(KVM_REQ_HV_TLB_FLUSH, vcpu))
+		if (kvm_check_request(KVM_REQ_HV_TLB_FLUSH, vcpu) &&
+		    kvm_hv_vcpu_flush_tlb(vcpu))
 			kvm_vcpu_flush_tlb_guest(vcpu);
 
 		if (kvm_check_request(KVM_REQ_REPORT_TPR_ACCESS, vcpu)) {
@@ -8875,12 +9535,26 @@ static int vcpu_enter_guest(struct kvm_vcpu *vcpu)
 		 */
 		if (kvm_check_request(KVM_REQ_HV_STIMER, vcpu))
 			kvm_hv_process_stimers(vcpu);
+		if (kvm_check_request(KVM_REQ_APICV_BACKOFF, vcpu)) {
+			srcu_read_unlock(&vcpu->kvm->srcu, vcpu->srcu_idx);
+			kvm_request_apicv_update(vcpu->kvm, true,
+						 APICV_INHIBIT_REASON_BACKOFF);
+			vcpu->srcu_idx = srcu_read_lock(&vcpu->kvm->srcu);
+		}
 		if (kvm_check_request(KVM_REQ_APICV_UPDATE, vcpu))
 			kvm_vcpu_update_apicv(vcpu);
 		if (kvm_check_request(KVM_REQ_APF_READY, vcpu))
 			kvm_check_async_pf_completion(vcpu);
 		if (kvm_check_request(KVM_REQ_MSR_FILTER_CHANGED, vcpu))
 			kvm_x86_ops.msr_filter_changed(vcpu);
+		if (kvm_check_request(KVM_REQ_UPDATE_CPU_DIRTY_LOGGING, vcpu)) {
+			r = kvm_x86_ops.update_cpu_dirty_logging(vcpu);
+			if (r) {
+				kvm_make_request(KVM_REQ_UPDATE_CPU_DIRTY_LOGGING,
+						 vcpu);
+				goto out;
+			}
+		}
 	}
 
 	if (kvm_check_request(KVM_REQ_EVENT, vcpu) || req_int_win) {
@@ -8972,8 +9646,13 @@ static int vcpu_enter_guest(struct kvm_vcpu *vcpu)
 		vcpu->arch.switch_db_regs &= ~KVM_DEBUGREG_RELOAD;
 	}
 
+	kvm_exit_latency_record(vcpu);
+	vcpu->stat.run_loop_ns += kvm_vcpu_state_change(vcpu);
+
 	exit_fastpath = kvm_x86_ops.run(vcpu);
 
+	vcpu->stat.guest_time_ns += kvm_vcpu_state_change(vcpu);
+
 	/*
 	 * Do this here before restoring debug registers on the host.  And
 	 * since we do this before handling the vmexit, a DR access vmexit
@@ -8999,7 +9678,10 @@ static int vcpu_enter_guest(struct kvm_vcpu *vcpu)
 		hw_breakpoint_restore();
 
 	vcpu->arch.last_vmentry_cpu = vcpu->cpu;
-	vcpu->arch.last_guest_tsc = kvm_read_l1_tsc(vcpu, rdtsc());
+	host_tsc = rdtsc();
+	vcpu->arch.last_guest_tsc = kvm_read_l1_tsc(vcpu, host_tsc);
+	vcpu->arch.exit_latency_tsc = host_tsc;
+	vcpu->arch.exit_latency_index = kvm_x86_ops.exit_latency_index(vcpu);
 
 	vcpu->mode = OUTSIDE_GUEST_MODE;
 	smp_wmb();
@@ -9047,6 +9729,7 @@ static int vcpu_enter_guest(struct kvm_vcpu *vcpu)
 		kvm_lapic_sync_from_vapic(vcpu);
 
 	r = kvm_x86_ops.handle_exit(vcpu, exit_fastpath);
+	vcpu->stat.exit_handling_ns += kvm_vcpu_state_change(vcpu);
 	return r;
 
 cancel_injection:
@@ -9064,7 +9747,7 @@ static inline int vcpu_block(struct kvm *kvm, struct kvm_vcpu *vcpu)
 	if (!kvm_arch_vcpu_runnable(vcpu) &&
 	    (!kvm_x86_ops.pre_block || kvm_x86_ops.pre_block(vcpu) == 0)) {
 		srcu_read_unlock(&kvm->srcu, vcpu->srcu_idx);
-		kvm_vcpu_block(vcpu);
+		kvm_vcpu_block_accounted(vcpu);
 		vcpu->srcu_idx = srcu_read_lock(&kvm->srcu);
 
 		if (kvm_x86_ops.post_block)
@@ -9277,15 +9960,16 @@ int kvm_arch_vcpu_ioctl_run(struct kvm_vcpu *vcpu)
 	int r;
 
 	vcpu_load(vcpu);
+	vcpu->stat.userspace_ns += kvm_vcpu_state_change(vcpu);
 	kvm_sigset_activate(vcpu);
-	kvm_load_guest_fpu(vcpu);
 
 	if (unlikely(vcpu->arch.mp_state == KVM_MP_STATE_UNINITIALIZED)) {
 		if (kvm_run->immediate_exit) {
 			r = -EINTR;
 			goto out;
 		}
-		kvm_vcpu_block(vcpu);
+		kvm_load_guest_fpu(vcpu);
+		kvm_vcpu_block_accounted(vcpu);
 		kvm_apic_accept_events(vcpu);
 		kvm_clear_request(KVM_REQ_UNHALT, vcpu);
 		r = -EAGAIN;
@@ -9294,7 +9978,7 @@ int kvm_arch_vcpu_ioctl_run(struct kvm_vcpu *vcpu)
 			kvm_run->exit_reason = KVM_EXIT_INTR;
 			++vcpu->stat.signal_exits;
 		}
-		goto out;
+		goto out_put_fpu;
 	}
 
 	if (kvm_run->kvm_valid_regs & ~KVM_SYNC_X86_VALID_FIELDS) {
@@ -9316,12 +10000,24 @@ int kvm_arch_vcpu_ioctl_run(struct kvm_vcpu *vcpu)
 		}
 	}
 
+	/*
+	 * Userspace kicks the vCPU out of KVM_RUN with immediate_exit, e.g. to
+	 * pause it. Don't swap the FPU state back and forth for that, unless
+	 * the completion of an exit needs it, e.g. to emulate an SSE access.
+	 */
+	if (kvm_run->immediate_exit && !vcpu->arch.complete_userspace_io) {
+		r = -EINTR;
+		goto out;
+	}
+
+	kvm_load_guest_fpu(vcpu);
+
 	if (unlikely(vcpu->arch.complete_userspace_io)) {
 		int (*cui)(struct kvm_vcpu *) = vcpu->arch.complete_userspace_io;
 		vcpu->arch.complete_userspace_io = NULL;
 		r = cui(vcpu);
 		if (r <= 0)
-			goto out;
+			goto out_put_fpu;
 	} else
 		WARN_ON(vcpu->arch.pio.count || vcpu->mmio_needed);
 
@@ -9330,13 +10026,15 @@ int kvm_arch_vcpu_ioctl_run(struct kvm_vcpu *vcpu)
 	else
 		r = vcpu_run(vcpu);
 
-out:
+out_put_fpu:
 	kvm_put_guest_fpu(vcpu);
+out:
 	if (kvm_run->kvm_valid_regs)
 		store_regs(vcpu);
 	post_kvm_run_save(vcpu);
 	kvm_sigset_deactivate(vcpu);
 
+	vcpu->stat.run_loop_ns += kvm_vcpu_state_change(vcpu);
 	vcpu_put(vcpu);
 	return r;
 }
@@ -9480,10 +10178,8 @@ int kvm_arch_vcpu_ioctl_get_sregs(struct kvm_vcpu *vcpu,
 	return 0;
 }
 
-int kvm_arch_vcpu_ioctl_get_mpstate(struct kvm_vcpu *vcpu,
-				    struct kvm_mp_state *mp_state)
+static void __get_mpstate(struct kvm_vcpu *vcpu, struct kvm_mp_state *mp_state)
 {
-	vcpu_load(vcpu);
 	if (kvm_mpx_supported())
 		kvm_load_guest_fpu(vcpu);
 
@@ -9496,20 +10192,22 @@ int kvm_arch_vcpu_ioctl_get_mpstate(struct kvm_vcpu *vcpu,
 
 	if (kvm_mpx_supported())
 		kvm_put_guest_fpu(vcpu);
-	vcpu_put(vcpu);
-	return 0;
 }
 
-int kvm_arch_vcpu_ioctl_set_mpstate(struct kvm_vcpu *vcpu,
+int kvm_arch_vcpu_ioctl_get_mpstate(struct kvm_vcpu *vcpu,
 				    struct kvm_mp_state *mp_state)
 {
-	int ret = -EINVAL;
-
 	vcpu_load(vcpu);
+	__get_mpstate(vcpu, mp_state);
+	vcpu_put(vcpu);
+	return 0;
+}
 
+static int __set_mpstate(struct kvm_vcpu *vcpu, struct kvm_mp_state *mp_state)
+{
 	if (!lapic_in_kernel(vcpu) &&
 	    mp_state->mp_state != KVM_MP_STATE_RUNNABLE)
-		goto out;
+		return -EINVAL;
 
 	/*
 	 * KVM_MP_STATE_INIT_RECEIVED means the processor is in
@@ -9519,7 +10217,7 @@ int kvm_arch_vcpu_ioctl_set_mpstate(struct kvm_vcpu *vcpu,
 	if ((kvm_vcpu_latch_init(vcpu) || vcpu->arch.smi_pending) &&
 	    (mp_state->mp_state == KVM_MP_STATE_SIPI_RECEIVED ||
 	     mp_state->mp_state == KVM_MP_STATE_INIT_RECEIVED))
-		goto out;
+		return -EINVAL;
 
 	if (mp_state->mp_state == KVM_MP_STATE_SIPI_RECEIVED) {
 		vcpu->arch.mp_state = KVM_MP_STATE_INIT_RECEIVED;
@@ -9528,8 +10226,16 @@ int kvm_arch_vcpu_ioctl_set_mpstate(struct kvm_vcpu *vcpu,
 		vcpu->arch.mp_state = mp_state->mp_state;
 	kvm_make_request(KVM_REQ_EVENT, vcpu);
 
-	ret = 0;
-out:
+	return 0;
+}
+
+int kvm_arch_vcpu_ioctl_set_mpstate(struct kvm_vcpu *vcpu,
+				    struct kvm_mp_state *mp_state)
+{
+	int ret;
+
+	vcpu_load(vcpu);
+	ret = __set_mpstate(vcpu, mp_state);
 	vcpu_put(vcpu);
 	return ret;
 }
@@ -9840,6 +10546,266 @@ static int sync_regs(struct kvm_vcpu *vcpu)
 	return 0;
 }
 
+/* The sizes of the sections of the vCPU state, 0 if variable. */
+static const u32 kvm_vcpu_state_sizes[] = {
+	[KVM_VCPU_STATE_REGS]		= sizeof(struct kvm_regs),
+	[KVM_VCPU_STATE_XSAVE]		= sizeof(struct kvm_xsave),
+	[KVM_VCPU_STATE_XCRS]		= sizeof(struct kvm_xcrs),
+	[KVM_VCPU_STATE_SREGS]		= sizeof(struct kvm_sregs),
+	[KVM_VCPU_STATE_MSRS]		= 0,
+	[KVM_VCPU_STATE_MP_STATE]	= sizeof(struct kvm_mp_state),
+	[KVM_VCPU_STATE_LAPIC]		= sizeof(struct kvm_lapic_state),
+	[KVM_VCPU_STATE_EVENTS]		= sizeof(struct kvm_vcpu_events),
+	[KVM_VCPU_STATE_DEBUGREGS]	= sizeof(struct kvm_debugregs),
+};
+
+#define KVM_VCPU_STATE_SECTION_SIZE(size) \
+	(sizeof(struct kvm_vcpu_state_section) + ALIGN(size, 8))
+
+/* The MSRs saved are the ones reported by KVM_GET_MSR_INDEX_LIST. */
+static u32 kvm_vcpu_state_msrs_size(void)
+{
+	return sizeof(struct kvm_msrs) + sizeof(struct kvm_msr_entry) *
+	       (num_msrs_to_save + num_emulated_msrs);
+}
+
+static u32 kvm_vcpu_state_max_size(void)
+{
+	u32 size = sizeof(struct kvm_vcpu_state);
+	int i;
+
+	for (i = KVM_VCPU_STATE_REGS; i < ARRAY_SIZE(kvm_vcpu_state_sizes); i++)
+		size += KVM_VCPU_STATE_SECTION_SIZE(kvm_vcpu_state_sizes[i]);
+
+	return size + KVM_VCPU_STATE_SECTION_SIZE(kvm_vcpu_state_msrs_size());
+}
+
+/*
+ * There is no section for the nested state, which would be lost.  Such vCPUs
+ * have to be moved with KVM_GET/SET_NESTED_STATE and the separate ioctls.
+ * CR4.VMXE can't be cleared while in VMX operation, so it catches VMXON too.
+ */
+static bool kvm_vcpu_state_has_nested(struct kvm_vcpu *vcpu)
+{
+	return is_guest_mode(vcpu) || kvm_read_cr4_bits(vcpu, X86_CR4_VMXE);
+}
+
+/* Append a section of @size bytes at @pos and return its data. */
+static void *kvm_vcpu_state_add(struct kvm_vcpu_state *state, void **pos,
+				u32 id, u32 size)
+{
+	struct kvm_vcpu_state_section *section = *pos;
+
+	section->id = id;
+	section->size = size;
+	*pos += KVM_VCPU_STATE_SECTION_SIZE(size);
+	state->nr_sections++;
+
+	return section->data;
+}
+
+static void kvm_vcpu_state_get_msrs(struct kvm_vcpu *vcpu,
+				    struct kvm_msrs *msrs)
+{
+	struct kvm_msr_entry *entry = msrs->entries;
+	unsigned int i;
+	int idx;
+
+	idx = srcu_read_lock(&vcpu->kvm->srcu);
+
+	/* Skip the MSRs the vCPU doesn't have, as KVM_GET_MSRS would fail. */
+	for (i = 0; i < num_msrs_to_save; i++) {
+		entry->index = msrs_to_save[i];
+		if (!do_get_msr(vcpu, entry->index, &entry->data))
+			entry++;
+	}
+
+	for (i = 0; i < num_emulated_msrs; i++) {
+		entry->index = emulated_msrs[i];
+		if (!do_get_msr(vcpu, entry->index, &entry->data))
+			entry++;
+	}
+
+	srcu_read_unlock(&vcpu->kvm->srcu, idx);
+
+	msrs->nmsrs = entry - msrs->entries;
+}
+
+/*
+ * Serialize the state of @vcpu, which must be loaded, to @ustate, which has
+ * room for @size bytes.
+ */
+static int kvm_vcpu_get_state(struct kvm_vcpu *vcpu,
+			      struct kvm_vcpu_state __user *ustate, u32 size)
+{
+	struct kvm_vcpu_state_section *section;
+	struct kvm_vcpu_state *state;
+	struct kvm_msrs *msrs;
+	void *pos;
+	int r;
+
+	if (kvm_vcpu_state_has_nested(vcpu))
+		return -EINVAL;
+
+	state = kvzalloc(kvm_vcpu_state_max_size(), GFP_KERNEL_ACCOUNT);
+	if (!state)
+		return -ENOMEM;
+
+	state->version = KVM_VCPU_STATE_VERSION;
+	pos = state->data;
+
+	__get_regs(vcpu, kvm_vcpu_state_add(state, &pos, KVM_VCPU_STATE_REGS,
+					    sizeof(struct kvm_regs)));
+	kvm_vcpu_ioctl_x86_get_xsave(vcpu,
+		kvm_vcpu_state_add(state, &pos, KVM_VCPU_STATE_XSAVE,
+				   sizeof(struct kvm_xsave)));
+	kvm_vcpu_ioctl_x86_get_xcrs(vcpu,
+		kvm_vcpu_state_add(state, &pos, KVM_VCPU_STATE_XCRS,
+				   sizeof(struct kvm_xcrs)));
+	__get_sregs(vcpu, kvm_vcpu_state_add(state, &pos, KVM_VCPU_STATE_SREGS,
+					     sizeof(struct kvm_sregs)));
+
+	/* Shrink the MSR section to the MSRs actually saved. */
+	section = pos;
+	msrs = kvm_vcpu_state_add(state, &pos, KVM_VCPU_STATE_MSRS,
+				  kvm_vcpu_state_msrs_size());
+	kvm_vcpu_state_get_msrs(vcpu, msrs);
+	section->size = struct_size(msrs, entries, msrs->nmsrs);
+	pos = section->data + ALIGN(section->size, 8);
+
+	__get_mpstate(vcpu, kvm_vcpu_state_add(state, &pos,
+					       KVM_VCPU_STATE_MP_STATE,
+					       sizeof(struct kvm_mp_state)));
+
+	if (lapic_in_kernel(vcpu)) {
+		r = kvm_vcpu_ioctl_get_lapic(vcpu,
+			kvm_vcpu_state_add(state, &pos, KVM_VCPU_STATE_LAPIC,
+					   sizeof(struct kvm_lapic_state)));
+		if (r)
+			goto out;
+	}
+
+	kvm_vcpu_ioctl_x86_get_vcpu_events(vcpu,
+		kvm_vcpu_state_add(state, &pos, KVM_VCPU_STATE_EVENTS,
+				   sizeof(struct kvm_vcpu_events)));
+	kvm_vcpu_ioctl_x86_get_debugregs(vcpu,
+		kvm_vcpu_state_add(state, &pos, KVM_VCPU_STATE_DEBUGREGS,
+				   sizeof(struct kvm_debugregs)));
+
+	state->size = pos - (void *)state;
+
+	r = -E2BIG;
+	if (state->size > size) {
+		if (put_user(state->size, &ustate->size))
+			r = -EFAULT;
+		goto out;
+	}
+
+	r = 0;
+	if (copy_to_user(ustate, state, state->size))
+		r = -EFAULT;
+out:
+	kvfree(state);
+	return r;
+}
+
+static int kvm_vcpu_set_state_section(struct kvm_vcpu *vcpu, u32 id,
+				      void *data, u32 size)
+{
+	struct kvm_msrs *msrs = data;
+	int idx, n;
+
+	if (!id || id >= ARRAY_SIZE(kvm_vcpu_state_sizes))
+		return -EINVAL;
+
+	if (kvm_vcpu_state_sizes[id] && size != kvm_vcpu_state_sizes[id])
+		return -EINVAL;
+
+	switch (id) {
+	case KVM_VCPU_STATE_REGS:
+		__set_regs(vcpu, data);
+		return 0;
+	case KVM_VCPU_STATE_XSAVE:
+		return kvm_vcpu_ioctl_x86_set_xsave(vcpu, data);
+	case KVM_VCPU_STATE_XCRS:
+		return kvm_vcpu_ioctl_x86_set_xcrs(vcpu, data);
+	case KVM_VCPU_STATE_SREGS:
+		return __set_sregs(vcpu, data);
+	case KVM_VCPU_STATE_MSRS:
+		if (size < sizeof(*msrs) ||
+		    msrs->nmsrs > (size - sizeof(*msrs)) / sizeof(msrs->entries[0]))
+			return -EINVAL;
+
+		idx = srcu_read_lock(&vcpu->kvm->srcu);
+		n = __msr_io(vcpu, msrs, msrs->entries, do_set_msr);
+		srcu_read_unlock(&vcpu->kvm->srcu, idx);
+
+		return n == msrs->nmsrs ? 0 : -EINVAL;
+	case KVM_VCPU_STATE_MP_STATE:
+		return __set_mpstate(vcpu, data);
+	case KVM_VCPU_STATE_LAPIC:
+		if (!lapic_in_kernel(vcpu))
+			return -EINVAL;
+
+		return kvm_vcpu_ioctl_set_lapic(vcpu, data);
+	case KVM_VCPU_STATE_EVENTS:
+		return kvm_vcpu_ioctl_x86_set_vcpu_events(vcpu, data);
+	case KVM_VCPU_STATE_DEBUGREGS:
+		return kvm_vcpu_ioctl_x86_set_debugregs(vcpu, data);
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Restore the state of @vcpu, which must be loaded, from @ustate, which is
+ * at most @size bytes.
+ */
+static int kvm_vcpu_set_state(struct kvm_vcpu *vcpu,
+			      struct kvm_vcpu_state __user *ustate, u32 size)
+{
+	struct kvm_vcpu_state_section *section;
+	struct kvm_vcpu_state hdr, *state;
+	void *pos, *end;
+	int r = 0;
+	u32 i;
+
+	if (kvm_vcpu_state_has_nested(vcpu))
+		return -EINVAL;
+
+	if (copy_from_user(&hdr, ustate, sizeof(hdr)))
+		return -EFAULT;
+
+	if (hdr.version != KVM_VCPU_STATE_VERSION || hdr.flags ||
+	    hdr.size < sizeof(hdr) || hdr.size > size ||
+	    hdr.size > kvm_vcpu_state_max_size())
+		return -EINVAL;
+
+	state = vmemdup_user(ustate, hdr.size);
+	if (IS_ERR(state))
+		return PTR_ERR(state);
+
+	pos = state->data;
+	end = (void *)state + hdr.size;
+
+	for (i = 0; i < hdr.nr_sections && !r; i++) {
+		section = pos;
+		if (end - pos < sizeof(*section) ||
+		    section->size > end - pos ||
+		    end - pos < KVM_VCPU_STATE_SECTION_SIZE(section->size)) {
+			r = -EINVAL;
+			break;
+		}
+
+		pos += KVM_VCPU_STATE_SECTION_SIZE(section->size);
+		r = kvm_vcpu_set_state_section(vcpu, section->id, section->data,
+					       section->size);
+	}
+
+	kvfree(state);
+	return r;
+}
+
 static void fx_init(struct kvm_vcpu *vcpu)
 {
 	fpstate_init(&vcpu->arch.guest_fpu->state);
@@ -9874,7 +10840,9 @@ int kvm_arch_vcpu_create(struct kvm_vcpu *vcpu)
 	else
 		vcpu->arch.mp_state = KVM_MP_STATE_UNINITIALIZED;
 
-	kvm_set_tsc_khz(vcpu, max_tsc_khz);
+	kvm_gpc_init(&vcpu->arch.st.cache, vcpu->kvm);
+
+	kvm_set_tsc_khz(vcpu, vcpu->kvm->arch.default_tsc_khz);
 
 	r = kvm_mmu_create(vcpu);
 	if (r < 0)
@@ -9936,9 +10904,15 @@ int kvm_arch_vcpu_create(struct kvm_vcpu *vcpu)
 
 	kvm_hv_vcpu_init(vcpu);
 
+	vcpu->arch.exit_latency = kvcalloc(kvm_x86_ops.nr_exit_latency_reasons,
+					   sizeof(*vcpu->arch.exit_latency),
+					   GFP_KERNEL_ACCOUNT);
+	if (!vcpu->arch.exit_latency)
+		goto free_guest_fpu;
+
 	r = kvm_x86_ops.vcpu_create(vcpu);
 	if (r)
-		goto free_guest_fpu;
+		goto free_exit_latency;
 
 	vcpu->arch.arch_capabilities = kvm_get_arch_capabilities();
 	vcpu->arch.msr_platform_info = MSR_PLATFORM_INFO_CPUID_FAULT;
@@ -9949,6 +10923,8 @@ int kvm_arch_vcpu_create(struct kvm_vcpu *vcpu)
 	vcpu_put(vcpu);
 	return 0;
 
+free_exit_latency:
+	kvfree(vcpu->arch.exit_latency);
 free_guest_fpu:
 	kmem_cache_free(x86_fpu_cache, vcpu->arch.guest_fpu);
 free_user_fpu:
@@ -9985,6 +10961,15 @@ void kvm_arch_vcpu_postcreate(struct kvm_vcpu *vcpu)
 
 	mutex_unlock(&vcpu->mutex);
 
+	/*
+	 * The vCPU is online now.  Pairs with the smp_mb() after setting
+	 * cpu_dirty_logging: either the request covered this vCPU, or the
+	 * vCPU sees cpu_dirty_logging here.
+	 */
+	smp_mb();
+	if (READ_ONCE(kvm->arch.cpu_dirty_logging))
+		kvm_make_request(KVM_REQ_UPDATE_CPU_DIRTY_LOGGING, vcpu);
+
 	if (kvmclock_periodic_sync && vcpu->vcpu_idx == 0)
 		schedule_delayed_work(&kvm->arch.kvmclock_sync_work,
 						KVMCLOCK_SYNC_PERIOD);
@@ -9992,10 +10977,9 @@ void kvm_arch_vcpu_postcreate(struct kvm_vcpu *vcpu)
 
 void kvm_arch_vcpu_destroy(struct kvm_vcpu *vcpu)
 {
-	struct gfn_to_pfn_cache *cache = &vcpu->arch.st.cache;
 	int idx;
 
-	kvm_release_pfn(cache->pfn, cache->dirty, cache);
+	kvm_gpc_deactivate(&vcpu->arch.st.cache);
 
 	kvmclock_reset(vcpu);
 
@@ -10015,6 +10999,7 @@ void kvm_arch_vcpu_destroy(struct kvm_vcpu *vcpu)
 	srcu_read_unlock(&vcpu->kvm->srcu, idx);
 	free_page((unsigned long)vcpu->arch.pio_data);
 	kvfree(vcpu->arch.cpuid_entries);
+	kvfree(vcpu->arch.exit_latency);
 	if (!lapic_in_kernel(vcpu))
 		static_key_slow_dec(&kvm_no_apic_vcpu);
 }
@@ -10176,7 +11161,7 @@ int kvm_arch_hardware_enable(void)
 			kvm_for_each_vcpu(i, vcpu, kvm) {
 				vcpu->arch.tsc_offset_adjustment += delta_cyc;
 				vcpu->arch.last_host_tsc = local_tsc;
-				kvm_make_request(KVM_REQ_MASTERCLOCK_UPDATE, vcpu);
+				kvm_request_masterclock_update(vcpu);
 			}
 
 			/*
@@ -10317,10 +11302,13 @@ int kvm_arch_init_vm(struct kvm *kvm, unsigned long type)
 	kvm->arch.kvmclock_offset = -get_kvmclock_base_ns();
 	pvclock_update_vm_gtod_copy(kvm);
 
+	kvm->arch.default_tsc_khz = max_tsc_khz ? : tsc_khz;
+
 	kvm->arch.guest_can_read_msr_platform_info = true;
 
 	INIT_DELAYED_WORK(&kvm->arch.kvmclock_update_work, kvmclock_update_fn);
 	INIT_DELAYED_WORK(&kvm->arch.kvmclock_sync_work, kvmclock_sync_fn);
+	INIT_DELAYED_WORK(&kvm->arch.apicv_backoff_work, kvm_apicv_backoff_fn);
 
 	kvm_hv_init_vm(kvm);
 	kvm_page_track_init(kvm);
@@ -10364,10 +11352,16 @@ static void kvm_free_vcpus(struct kvm *kvm)
 	mutex_unlock(&kvm->lock);
 }
 
+int kvm_cpu_dirty_log_size(void)
+{
+	return kvm_x86_ops.cpu_dirty_log_size;
+}
+
 void kvm_arch_sync_events(struct kvm *kvm)
 {
 	cancel_delayed_work_sync(&kvm->arch.kvmclock_sync_work);
 	cancel_delayed_work_sync(&kvm->arch.kvmclock_update_work);
+	cancel_delayed_work_sync(&kvm->arch.apicv_backoff_work);
 	kvm_free_pit(kvm);
 }
 
@@ -10628,15 +11622,19 @@ static void kvm_mmu_slot_apply_flags(struct kvm *kvm,
 	 * won't have any additional overhead from PML when the guest is
 	 * running with dirty logging disabled.
 	 *
-	 * When enabling dirty logging, large sptes are write-protected
-	 * so they can be split on first write.  New large sptes cannot
-	 * be created for this slot until the end of the logging.
+	 * When enabling dirty logging, the huge pages of the TDP MMU are
+	 * split eagerly, unless disabled with the eager_page_split module
+	 * parameter.  Large sptes that remain are write-protected so they
+	 * can be split on first write.  New large sptes cannot be created
+	 * for this slot until the end of the logging.
 	 * See the comments in fast_page_fault().
 	 * For small sptes, nothing is done if the dirty log is in the
 	 * initial-all-set state.  Otherwise, depending on whether pml
 	 * is enabled the D-bit or the W-bit will be cleared.
 	 */
 	if (new->flags & KVM_MEM_LOG_DIRTY_PAGES) {
+		kvm_mmu_slot_try_split_huge_pages(kvm, new, PG_LEVEL_4K);
+
 		if (kvm_x86_ops.slot_enable_log_dirty) {
 			kvm_x86_ops.slot_enable_log_dirty(kvm, new);
 		} else {
@@ -10909,10 +11907,27 @@ static inline int apf_put_user_notpresent(struct kvm_vcpu *vcpu)
 				      sizeof(reason));
 }
 
+static int apf_put_ring_token(struct kvm_vcpu *vcpu, u32 token)
+{
+	u32 head = vcpu->arch.apf.ring_head;
+	unsigned int offset = offsetof(struct kvm_vcpu_pv_apf_data, ring) +
+			      (head % KVM_ASYNC_PF_RING_SIZE) * sizeof(token);
+
+	/* The token must be visible before the guest sees the new head. */
+	if (kvm_write_guest_offset_cached(vcpu->kvm, &vcpu->arch.apf.data,
+					  &token, offset, sizeof(token)))
+		return -EFAULT;
+
+	return apf_put_ring_head(vcpu, head + 1);
+}
+
 static inline int apf_put_user_ready(struct kvm_vcpu *vcpu, u32 token)
 {
 	unsigned int offset = offsetof(struct kvm_vcpu_pv_apf_data, token);
 
+	if (apf_ring_enabled(vcpu))
+		return apf_put_ring_token(vcpu, token);
+
 	return kvm_write_guest_offset_cached(vcpu->kvm, &vcpu->arch.apf.data,
 					     &token, offset, sizeof(token));
 }
@@ -10922,6 +11937,13 @@ static inline bool apf_pageready_slot_free(struct kvm_vcpu *vcpu)
 	unsigned int offset = offsetof(struct kvm_vcpu_pv_apf_data, token);
 	u32 val;
 
+	if (apf_ring_enabled(vcpu)) {
+		if (apf_get_ring_tail(vcpu, &val))
+			return false;
+
+		return vcpu->arch.apf.ring_head - val < KVM_ASYNC_PF_RING_SIZE;
+	}
+
 	if (kvm_read_guest_offset_cached(vcpu->kvm, &vcpu->arch.apf.data,
 					 &val, offset, sizeof(val)))
 		return false;
@@ -10993,11 +12015,6 @@ bool kvm_arch_async_page_not_present(struct kvm_vcpu *vcpu,
 void kvm_arch_async_page_present(struct kvm_vcpu *vcpu,
 				 struct kvm_async_pf *work)
 {
-	struct kvm_lapic_irq irq = {
-		.delivery_mode = APIC_DM_FIXED,
-		.vector = vcpu->arch.apf.vec
-	};
-
 	if (work->wakeup_all)
 		work->arch.token = ~0; /* broadcast wakeup */
 	else
@@ -11006,10 +12023,9 @@ void kvm_arch_async_page_present(struct kvm_vcpu *vcpu,
 
 	if ((work->wakeup_all || work->notpresent_injected) &&
 	    kvm_pv_async_pf_enabled(vcpu) &&
-	    !apf_put_user_ready(vcpu, work->arch.token)) {
-		vcpu->arch.apf.pageready_pending = true;
-		kvm_apic_set_irq(vcpu, &irq, NULL);
-	}
+	    !apf_put_user_ready(vcpu, work->arch.token) &&
+	    !(apf_ring_enabled(vcpu) && vcpu->arch.apf.pageready_pending))
+		kvm_apf_notify_page_ready(vcpu);
 
 	vcpu->arch.apf.halted = false;
 	vcpu->arch.mp_state = KVM_MP_STATE_RUNNABLE;
@@ -11252,7 +12268,7 @@ int kvm_handle_invpcid(struct kvm_vcpu *vcpu, unsigned long type, gva_t gva)
 			kvm_make_request(KVM_REQ_TLB_FLUSH_CURRENT, vcpu);
 		}
 
-		for (i = 0; i < KVM_MMU_NUM_PREV_ROOTS; i++)
+		for (i = 0; i < vcpu->arch.mmu->nr_prev_roots; i++)
 			if (kvm_get_pcid(vcpu, vcpu->arch.mmu->prev_roots[i].pgd)
 			    == operand.pcid)
 				roots_to_free |= KVM_MMU_ROOT_PREVIOUS(i);
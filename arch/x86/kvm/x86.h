@@ -195,8 +195,16 @@ static inline bool vcpu_match_mmio_gen(struct kvm_vcpu *vcpu)
  */
 #define MMIO_GVA_ANY (~(gva_t)0)
 
+static inline void vcpu_clear_insn_cache(struct kvm_vcpu *vcpu)
+{
+	memset(vcpu->arch.insn_cache, 0, sizeof(vcpu->arch.insn_cache));
+}
+
 static inline void vcpu_clear_mmio_info(struct kvm_vcpu *vcpu, gva_t gva)
 {
+	/* The cached instruction fetches went through the same mappings. */
+	vcpu_clear_insn_cache(vcpu);
+
 	if (gva != MMIO_GVA_ANY && vcpu->arch.mmio_gva != (gva & PAGE_MASK))
 		return;
 
@@ -291,6 +299,7 @@ extern unsigned int min_timer_period_us;
 extern bool enable_vmware_backdoor;
 
 extern int pi_inject_timer;
+extern bool lapic_timer_offload;
 
 extern struct static_key kvm_no_apic_vcpu;
 
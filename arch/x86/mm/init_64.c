@@ -1224,7 +1224,7 @@ static struct kcore_list kcore_vsyscall;
 
 static void __init register_page_bootmem_info(void)
 {
-#ifdef CONFIG_NUMA
+#if defined(CONFIG_NUMA) || defined(CONFIG_HUGETLB_PAGE_FREE_VMEMMAP)
 	int i;
 
 	for_each_online_node(i)
@@ -1556,7 +1556,8 @@ int __meminit vmemmap_populate(unsigned long start, unsigned long end, int node,
 {
 	int err;
 
-	if (end - start < PAGES_PER_SECTION * sizeof(struct page))
+	if (end - start < PAGES_PER_SECTION * sizeof(struct page) ||
+	    (is_hugetlb_free_vmemmap_enabled() && !altmap))
 		err = vmemmap_populate_basepages(start, end, node, NULL);
 	else if (boot_cpu_has(X86_FEATURE_PSE))
 		err = vmemmap_populate_hugepages(start, end, node, altmap);
@@ -1609,9 +1610,10 @@ void register_page_bootmem_memmap(unsigned long section_nr,
 		}
 		get_page_bootmem(section_nr, pud_page(*pud), MIX_SECTION_INFO);
 
-		if (!boot_cpu_has(X86_FEATURE_PSE)) {
+		pmd = pmd_offset(pud, addr);
+		if (!boot_cpu_has(X86_FEATURE_PSE) ||
+		    (!pmd_none(*pmd) && !pmd_large(*pmd))) {
 			next = (addr + PAGE_SIZE) & PAGE_MASK;
-			pmd = pmd_offset(pud, addr);
 			if (pmd_none(*pmd))
 				continue;
 			get_page_bootmem(section_nr, pmd_page(*pmd),
@@ -1625,7 +1627,6 @@ void register_page_bootmem_memmap(unsigned long section_nr,
 		} else {
 			next = pmd_addr_end(addr, end);
 
-			pmd = pmd_offset(pud, addr);
 			if (pmd_none(*pmd))
 				continue;
 
@@ -733,32 +733,41 @@ EXPORT_SYMBOL_GPL(blkg_conf_finish);
 
 static void blkg_iostat_set(struct blkg_iostat *dst, struct blkg_iostat *src)
 {
-	int i;
+	int i, j;
 
 	for (i = 0; i < BLKG_IOSTAT_NR; i++) {
 		dst->bytes[i] = src->bytes[i];
 		dst->ios[i] = src->ios[i];
 	}
+	for (i = 0; i < BLKG_IOSTAT_DISCARD; i++)
+		for (j = 0; j < BLKG_LAT_BUCKETS; j++)
+			dst->lat[i][j] = src->lat[i][j];
 }
 
 static void blkg_iostat_add(struct blkg_iostat *dst, struct blkg_iostat *src)
 {
-	int i;
+	int i, j;
 
 	for (i = 0; i < BLKG_IOSTAT_NR; i++) {
 		dst->bytes[i] += src->bytes[i];
 		dst->ios[i] += src->ios[i];
 	}
+	for (i = 0; i < BLKG_IOSTAT_DISCARD; i++)
+		for (j = 0; j < BLKG_LAT_BUCKETS; j++)
+			dst->lat[i][j] += src->lat[i][j];
 }
 
 static void blkg_iostat_sub(struct blkg_iostat *dst, struct blkg_iostat *src)
 {
-	int i;
+	int i, j;
 
 	for (i = 0; i < BLKG_IOSTAT_NR; i++) {
 		dst->bytes[i] -= src->bytes[i];
 		dst->ios[i] -= src->ios[i];
 	}
+	for (i = 0; i < BLKG_IOSTAT_DISCARD; i++)
+		for (j = 0; j < BLKG_LAT_BUCKETS; j++)
+			dst->lat[i][j] -= src->lat[i][j];
 }
 
 static void blkcg_rstat_flush(struct cgroup_subsys_state *css, int cpu)
@@ -852,6 +861,24 @@ static void blkcg_fill_root_iostats(void)
 	}
 }
 
+static size_t blkcg_print_lat_hist(char *buf, size_t size, const char *name,
+				   u64 *lat)
+{
+	size_t off;
+	int i;
+
+	for (i = 0; i < BLKG_LAT_BUCKETS; i++)
+		if (lat[i])
+			break;
+	if (i == BLKG_LAT_BUCKETS)
+		return 0;
+
+	off = scnprintf(buf, size, " %s=%llu", name, lat[0]);
+	for (i = 1; i < BLKG_LAT_BUCKETS; i++)
+		off += scnprintf(buf + off, size - off, ",%llu", lat[i]);
+	return off;
+}
+
 static int blkcg_print_stat(struct seq_file *sf, void *v)
 {
 	struct blkcg *blkcg = css_to_blkcg(seq_css(sf));
@@ -869,6 +896,7 @@ static int blkcg_print_stat(struct seq_file *sf, void *v)
 		const char *dname;
 		char *buf;
 		u64 rbytes, wbytes, rios, wios, dbytes, dios;
+		u64 lat[BLKG_IOSTAT_DISCARD][BLKG_LAT_BUCKETS];
 		size_t size = seq_get_buf(sf, &buf), off = 0;
 		int i;
 		bool has_stats = false;
@@ -900,6 +928,7 @@ static int blkcg_print_stat(struct seq_file *sf, void *v)
 			rios = bis->cur.ios[BLKG_IOSTAT_READ];
 			wios = bis->cur.ios[BLKG_IOSTAT_WRITE];
 			dios = bis->cur.ios[BLKG_IOSTAT_DISCARD];
+			memcpy(lat, bis->cur.lat, sizeof(lat));
 		} while (u64_stats_fetch_retry(&bis->sync, seq));
 
 		if (rbytes || wbytes || rios || wios) {
@@ -908,6 +937,10 @@ static int blkcg_print_stat(struct seq_file *sf, void *v)
 					 "rbytes=%llu wbytes=%llu rios=%llu wios=%llu dbytes=%llu dios=%llu",
 					 rbytes, wbytes, rios, wios,
 					 dbytes, dios);
+			off += blkcg_print_lat_hist(buf+off, size-off, "rlat_hist",
+						    lat[BLKG_IOSTAT_READ]);
+			off += blkcg_print_lat_hist(buf+off, size-off, "wlat_hist",
+						    lat[BLKG_IOSTAT_WRITE]);
 		}
 
 		if (blkcg_debug_stats && atomic_read(&blkg->use_delay)) {
@@ -1918,6 +1951,63 @@ void blk_cgroup_bio_start(struct bio *bio)
 	put_cpu();
 }
 
+/*
+ * The blkg of the first bio of a request is the one that it is accounted to,
+ * and the request keeps a reference to it, as the bios are gone by the time
+ * the request completes.
+ */
+void blk_cgroup_rq_start(struct request *rq)
+{
+	rq->blkg = NULL;
+	if (!rq->bio || !rq->bio->bi_blkg ||
+	    !cgroup_subsys_on_dfl(io_cgrp_subsys))
+		return;
+
+	rq->blkg = rq->bio->bi_blkg;
+	blkg_get(rq->blkg);
+}
+
+/* Drop the blkg reference of @rq, which was merged into another request. */
+void blk_cgroup_rq_merged(struct request *rq)
+{
+	if (!rq->blkg)
+		return;
+
+	blkg_put(rq->blkg);
+	rq->blkg = NULL;
+}
+
+/* Account the completion latency of @rq to the histogram of its blkg. */
+void blk_cgroup_rq_done(struct request *rq, u64 now)
+{
+	struct blkcg_gq *blkg = rq->blkg;
+	struct blkg_iostat_set *bis;
+	int rw, bucket = 0, cpu;
+	u64 lat_us;
+
+	if (!blkg)
+		return;
+
+	rq->blkg = NULL;
+	if (op_is_discard(rq->cmd_flags))
+		goto out;
+	rw = op_is_write(rq->cmd_flags) ? BLKG_IOSTAT_WRITE : BLKG_IOSTAT_READ;
+
+	lat_us = div_u64(now - rq->start_time_ns, NSEC_PER_USEC);
+	if (lat_us >= 2)
+		bucket = min_t(int, ilog2(lat_us), BLKG_LAT_BUCKETS - 1);
+
+	cpu = get_cpu();
+	bis = per_cpu_ptr(blkg->iostat_cpu, cpu);
+	u64_stats_update_begin(&bis->sync);
+	bis->cur.lat[rw][bucket]++;
+	u64_stats_update_end(&bis->sync);
+	cgroup_rstat_updated(blkg->blkcg->css.cgroup, cpu);
+	put_cpu();
+out:
+	blkg_put(blkg);
+}
+
 static int __init blkcg_init(void)
 {
 	blkcg_punt_bio_wq = alloc_workqueue("blkcg_punt_bio",
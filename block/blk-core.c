@@ -1308,6 +1308,7 @@ void blk_account_io_done(struct request *req, u64 now)
 		part_stat_add(part, nsecs[sgrp], now - req->start_time_ns);
 		part_stat_unlock();
 
+		blk_cgroup_rq_done(req, now);
 		hd_struct_put(part);
 	}
 }
@@ -1318,6 +1319,7 @@ void blk_account_io_start(struct request *rq)
 		return;
 
 	rq->part = disk_map_sector_rcu(rq->rq_disk, blk_rq_pos(rq));
+	blk_cgroup_rq_start(rq);
 
 	part_stat_lock();
 	update_io_ticks(rq->part, jiffies, false);
@@ -1687,6 +1689,21 @@ EXPORT_SYMBOL(kblockd_mod_delayed_work_on);
  *   this kind of deadlock.
  */
 void blk_start_plug(struct blk_plug *plug)
+{
+	blk_start_plug_nr_ios(plug, 1);
+}
+EXPORT_SYMBOL(blk_start_plug);
+
+/**
+ * blk_start_plug_nr_ios - start a plug for a known number of I/Os
+ * @plug:	The &struct blk_plug that needs to be initialized
+ * @nr_ios:	How many I/Os the caller is about to submit
+ *
+ * Description:
+ *   Like blk_start_plug(), but the first request allocated under the plug
+ *   allocates up to @nr_ios at once, for the bios that follow.
+ */
+void blk_start_plug_nr_ios(struct blk_plug *plug, unsigned short nr_ios)
 {
 	struct task_struct *tsk = current;
 
@@ -1698,7 +1715,9 @@ void blk_start_plug(struct blk_plug *plug)
 
 	INIT_LIST_HEAD(&plug->mq_list);
 	INIT_LIST_HEAD(&plug->cb_list);
+	INIT_LIST_HEAD(&plug->cached_rqs);
 	plug->rq_count = 0;
+	plug->nr_ios = min_t(unsigned short, nr_ios, BLK_MAX_REQUEST_COUNT);
 	plug->multiple_queues = false;
 	plug->nowait = false;
 
@@ -1708,7 +1727,7 @@ void blk_start_plug(struct blk_plug *plug)
 	 */
 	tsk->plug = plug;
 }
-EXPORT_SYMBOL(blk_start_plug);
+EXPORT_SYMBOL(blk_start_plug_nr_ios);
 
 static void flush_plug_callbacks(struct blk_plug *plug, bool from_schedule)
 {
@@ -1758,6 +1777,9 @@ void blk_flush_plug_list(struct blk_plug *plug, bool from_schedule)
 
 	if (!list_empty(&plug->mq_list))
 		blk_mq_flush_plug_list(plug, from_schedule);
+	/* don't sit on tags that other tasks may be waiting for */
+	if (unlikely(!list_empty(&plug->cached_rqs)))
+		blk_mq_free_plug_rqs(plug);
 }
 
 /**
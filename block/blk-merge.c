@@ -6,6 +6,7 @@
 #include <linux/module.h>
 #include <linux/bio.h>
 #include <linux/blkdev.h>
+#include <linux/blk-cgroup.h>
 #include <linux/scatterlist.h>
 
 #include <trace/events/block.h>
@@ -684,6 +685,7 @@ static void blk_account_io_merge_request(struct request *req)
 		part_stat_inc(req->part, merges[op_stat_group(req_op(req))]);
 		part_stat_unlock();
 
+		blk_cgroup_rq_merged(req);
 		hd_struct_put(req->part);
 	}
 }
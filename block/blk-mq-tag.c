@@ -86,6 +86,36 @@ static int __blk_mq_get_tag(struct blk_mq_alloc_data *data,
 		return __sbitmap_queue_get(bt);
 }
 
+/*
+ * Allocate up to @nr_tags tags without waiting, as a mask relative to @offset.
+ * A shared tag set keeps allocating one at a time, as hctx_may_queue() needs
+ * to account for each of them.
+ */
+unsigned long blk_mq_get_tags(struct blk_mq_alloc_data *data, int nr_tags,
+			      unsigned int *offset)
+{
+	struct blk_mq_tags *tags = blk_mq_tags_from_data(data);
+	unsigned long ret;
+
+	if (data->shallow_depth || (data->flags & BLK_MQ_REQ_RESERVED) ||
+	    (data->hctx->flags & BLK_MQ_F_TAG_QUEUE_SHARED))
+		return 0;
+
+	ret = __sbitmap_queue_get_batch(tags->bitmap_tags, nr_tags, offset);
+	*offset += tags->nr_reserved_tags;
+
+	/* Same as blk_mq_get_tag(), the caller retries one tag at a time. */
+	if (ret && unlikely(test_bit(BLK_MQ_S_INACTIVE, &data->hctx->state))) {
+		unsigned long mask = ret;
+		int i;
+
+		for_each_set_bit(i, &mask, BITS_PER_LONG)
+			blk_mq_put_tag(tags, data->ctx, *offset + i);
+		return 0;
+	}
+	return ret;
+}
+
 unsigned int blk_mq_get_tag(struct blk_mq_alloc_data *data)
 {
 	struct blk_mq_tags *tags = blk_mq_tags_from_data(data);
@@ -192,6 +222,13 @@ void blk_mq_put_tag(struct blk_mq_tags *tags, struct blk_mq_ctx *ctx,
 	}
 }
 
+/* All of @tag_array must be from the non-reserved part of @tags. */
+void blk_mq_put_tags(struct blk_mq_tags *tags, int *tag_array, int nr_tags)
+{
+	sbitmap_queue_clear_batch(tags->bitmap_tags, tags->nr_reserved_tags,
+				  tag_array, nr_tags);
+}
+
 struct bt_iter_data {
 	struct blk_mq_hw_ctx *hctx;
 	busy_iter_fn *fn;
@@ -343,6 +343,35 @@ static struct request *blk_mq_rq_ctx_init(struct blk_mq_alloc_data *data,
 	return rq;
 }
 
+static struct request *__blk_mq_alloc_request_batch(
+		struct blk_mq_alloc_data *data, u64 alloc_time_ns)
+{
+	unsigned int tag_offset;
+	struct request *rq;
+	unsigned long tags;
+	int i, nr = 0;
+
+	tags = blk_mq_get_tags(data, data->nr_tags, &tag_offset);
+	if (!tags)
+		return NULL;
+
+	for (i = 0; tags; i++) {
+		if (!(tags & (1UL << i)))
+			continue;
+		tags &= ~(1UL << i);
+		rq = blk_mq_rq_ctx_init(data, tag_offset + i, alloc_time_ns);
+		list_add_tail(&rq->queuelist, data->cached_rqs);
+		nr++;
+	}
+
+	/* the caller holds a queue reference for the first request */
+	percpu_ref_get_many(&data->q->q_usage_counter, nr - 1);
+
+	rq = list_first_entry(data->cached_rqs, struct request, queuelist);
+	list_del_init(&rq->queuelist);
+	return rq;
+}
+
 static struct request *__blk_mq_alloc_request(struct blk_mq_alloc_data *data)
 {
 	struct request_queue *q = data->q;
@@ -375,6 +404,19 @@ static struct request *__blk_mq_alloc_request(struct blk_mq_alloc_data *data)
 	if (!e)
 		blk_mq_tag_busy(data->hctx);
 
+	/*
+	 * Without a scheduler there is nothing per request to set up beyond
+	 * the tag, so a plug can take several tags with one atomic, and keep
+	 * the requests until its next bios.
+	 */
+	if (!e && data->nr_tags > 1 && !op_is_flush(data->cmd_flags)) {
+		struct request *rq;
+
+		rq = __blk_mq_alloc_request_batch(data, alloc_time_ns);
+		if (rq)
+			return rq;
+	}
+
 	/*
 	 * Waiting allocations only fail because of an inactive hctx.  In that
 	 * case just retry the hctx assignment and tag allocation as CPU hotplug
@@ -501,6 +543,38 @@ static void __blk_mq_free_request(struct request *rq)
 	blk_queue_exit(q);
 }
 
+void blk_mq_free_plug_rqs(struct blk_plug *plug)
+{
+	struct request *rq;
+
+	while (!list_empty(&plug->cached_rqs)) {
+		rq = list_first_entry(&plug->cached_rqs, struct request,
+				      queuelist);
+		list_del_init(&rq->queuelist);
+		blk_mq_free_request(rq);
+	}
+}
+
+static struct request *blk_mq_get_cached_request(struct request_queue *q,
+		struct blk_plug *plug, struct bio *bio)
+{
+	struct request *rq;
+
+	if (!plug || list_empty(&plug->cached_rqs))
+		return NULL;
+
+	rq = list_first_entry(&plug->cached_rqs, struct request, queuelist);
+	if (rq->q != q || op_is_flush(bio->bi_opf) ||
+	    blk_mq_map_queue(q, bio->bi_opf, rq->mq_ctx) != rq->mq_hctx)
+		return NULL;
+
+	list_del_init(&rq->queuelist);
+	rq->cmd_flags = bio->bi_opf;
+	/* the request has its own reference on the queue */
+	blk_queue_exit(q);
+	return rq;
+}
+
 void blk_mq_free_request(struct request *rq)
 {
 	struct request_queue *q = rq->q;
@@ -532,13 +606,8 @@ void blk_mq_free_request(struct request *rq)
 }
 EXPORT_SYMBOL_GPL(blk_mq_free_request);
 
-inline void __blk_mq_end_request(struct request *rq, blk_status_t error)
+static inline void __blk_mq_end_request_acct(struct request *rq, u64 now)
 {
-	u64 now = 0;
-
-	if (blk_mq_need_time_stamp(rq))
-		now = ktime_get_ns();
-
 	if (rq->rq_flags & RQF_STATS) {
 		blk_mq_poll_stats_start(rq->q);
 		blk_stat_add(rq, now);
@@ -547,6 +616,16 @@ inline void __blk_mq_end_request(struct request *rq, blk_status_t error)
 	blk_mq_sched_completed_request(rq, now);
 
 	blk_account_io_done(rq, now);
+}
+
+inline void __blk_mq_end_request(struct request *rq, blk_status_t error)
+{
+	u64 now = 0;
+
+	if (blk_mq_need_time_stamp(rq))
+		now = ktime_get_ns();
+
+	__blk_mq_end_request_acct(rq, now);
 
 	if (rq->end_io) {
 		rq_qos_done(rq->q, rq);
@@ -565,6 +644,83 @@ void blk_mq_end_request(struct request *rq, blk_status_t error)
 }
 EXPORT_SYMBOL(blk_mq_end_request);
 
+#define TAG_COMP_BATCH		32
+
+static inline void blk_mq_flush_tag_batch(struct blk_mq_hw_ctx *hctx,
+					  int *tag_array, int nr_tags)
+{
+	struct request_queue *q = hctx->queue;
+
+	blk_mq_put_tags(hctx->tags, tag_array, nr_tags);
+	blk_mq_sched_restart(hctx);
+	percpu_ref_put_many(&q->q_usage_counter, nr_tags);
+}
+
+/**
+ * blk_mq_end_request_batch - end a batch of successfully completed requests
+ * @iob: the batch, built with blk_mq_add_to_batch()
+ *
+ * Description:
+ *     This does what blk_mq_end_request() does for each of the requests,
+ *     but it reads the clock once, and it frees the tags and drops the
+ *     queue references in bulk, per hardware queue.
+ */
+void blk_mq_end_request_batch(struct io_comp_batch *iob)
+{
+	int tags[TAG_COMP_BATCH], nr_tags = 0;
+	struct blk_mq_hw_ctx *cur_hctx = NULL;
+	struct request *rq;
+	u64 now = 0;
+
+	if (iob->need_ts)
+		now = ktime_get_ns();
+
+	while ((rq = iob->req_list) != NULL) {
+		struct blk_mq_hw_ctx *hctx = rq->mq_hctx;
+
+		iob->req_list = rq->rq_next;
+		prefetch(rq->bio);
+		prefetch(rq->rq_next);
+
+		if (blk_update_request(rq, BLK_STS_OK, blk_rq_bytes(rq)))
+			BUG();
+		if (iob->need_ts)
+			__blk_mq_end_request_acct(rq, now);
+
+		rq->mq_ctx->rq_completed[rq_is_sync(rq)]++;
+		if (rq->rq_flags & RQF_MQ_INFLIGHT)
+			__blk_mq_dec_active_requests(hctx);
+		if (unlikely(laptop_mode && !blk_rq_is_passthrough(rq)))
+			laptop_io_completion(rq->q->backing_dev_info);
+		rq_qos_done(rq->q, rq);
+
+		WRITE_ONCE(rq->state, MQ_RQ_IDLE);
+		if (!refcount_dec_and_test(&rq->ref))
+			continue;
+
+		if (unlikely(blk_mq_tag_is_reserved(hctx->tags, rq->tag))) {
+			__blk_mq_free_request(rq);
+			continue;
+		}
+
+		blk_crypto_free_request(rq);
+		blk_pm_mark_last_busy(rq);
+		rq->mq_hctx = NULL;
+
+		if (nr_tags == TAG_COMP_BATCH || cur_hctx != hctx) {
+			if (cur_hctx)
+				blk_mq_flush_tag_batch(cur_hctx, tags, nr_tags);
+			nr_tags = 0;
+			cur_hctx = hctx;
+		}
+		tags[nr_tags++] = rq->tag;
+	}
+
+	if (nr_tags)
+		blk_mq_flush_tag_batch(cur_hctx, tags, nr_tags);
+}
+EXPORT_SYMBOL_GPL(blk_mq_end_request_batch);
+
 /*
  * Softirq action handler - move entries to local list and loop over them
  * while passing them to the queue registered handler.
@@ -2173,13 +2329,24 @@ blk_qc_t blk_mq_submit_bio(struct bio *bio)
 
 	rq_qos_throttle(q, bio);
 
-	data.cmd_flags = bio->bi_opf;
-	rq = __blk_mq_alloc_request(&data);
-	if (unlikely(!rq)) {
-		rq_qos_cleanup(q, bio);
-		if (bio->bi_opf & REQ_NOWAIT)
-			bio_wouldblock_error(bio);
-		goto queue_exit;
+	plug = blk_mq_plug(q, bio);
+	rq = blk_mq_get_cached_request(q, plug, bio);
+	if (rq) {
+		data.hctx = rq->mq_hctx;
+	} else {
+		data.cmd_flags = bio->bi_opf;
+		if (plug) {
+			data.nr_tags = plug->nr_ios;
+			data.cached_rqs = &plug->cached_rqs;
+			plug->nr_ios = 1;
+		}
+		rq = __blk_mq_alloc_request(&data);
+		if (unlikely(!rq)) {
+			rq_qos_cleanup(q, bio);
+			if (bio->bi_opf & REQ_NOWAIT)
+				bio_wouldblock_error(bio);
+			goto queue_exit;
+		}
 	}
 
 	trace_block_getrq(q, bio, bio->bi_opf);
@@ -2198,7 +2365,6 @@ blk_qc_t blk_mq_submit_bio(struct bio *bio)
 		return BLK_QC_T_NONE;
 	}
 
-	plug = blk_mq_plug(q, bio);
 	if (unlikely(is_flush_fua)) {
 		/* Bypass scheduler for flush requests */
 		blk_insert_flush(rq);
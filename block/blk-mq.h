@@ -154,11 +154,17 @@ struct blk_mq_alloc_data {
 	unsigned int shallow_depth;
 	unsigned int cmd_flags;
 
+	/* allocate this many requests, and put all but one on cached_rqs */
+	unsigned int nr_tags;
+	struct list_head *cached_rqs;
+
 	/* input & output parameter */
 	struct blk_mq_ctx *ctx;
 	struct blk_mq_hw_ctx *hctx;
 };
 
+void blk_mq_free_plug_rqs(struct blk_plug *plug);
+
 static inline bool blk_mq_is_sbitmap_shared(unsigned int flags)
 {
 	return flags & BLK_MQ_F_TAG_HCTX_SHARED;
@@ -1549,6 +1549,51 @@ static int test_hash_vec_cfg(const char *driver,
 				  hashstate);
 }
 
+/*
+ * Test crypto_shash_finup_mb() on two copies of the test vector, finishing
+ * them from an empty state and from the state after half of the data.
+ */
+static int test_shash_finup_mb(const char *driver,
+			       const struct hash_testvec *vec,
+			       const char *vec_name, struct shash_desc *desc)
+{
+	struct crypto_shash *tfm = desc->tfm;
+	const unsigned int digestsize = crypto_shash_digestsize(tfm);
+	u8 result[2][HASH_MAX_DIGESTSIZE];
+	u8 * const outs[2] = { result[0], result[1] };
+	unsigned int split, i;
+	int err;
+
+	if (crypto_shash_mb_max_msgs(tfm) < 2 || vec->setkey_error ||
+	    vec->digest_error)
+		return 0;
+
+	for (split = 0; split <= vec->psize / 2; split += vec->psize / 2 ?: 1) {
+		const u8 * const data[2] = { vec->plaintext + split,
+					     vec->plaintext + split };
+
+		err = crypto_shash_init(desc) ?:
+		      crypto_shash_update(desc, vec->plaintext, split) ?:
+		      crypto_shash_finup_mb(desc, data, vec->psize - split,
+					    outs, 2);
+		if (err) {
+			pr_err("alg: shash: %s finup_mb() failed with err %d on test vector %s\n",
+			       driver, err, vec_name);
+			return err;
+		}
+
+		for (i = 0; i < 2; i++) {
+			if (memcmp(result[i], vec->digest, digestsize)) {
+				pr_err("alg: shash: %s finup_mb() test failed (wrong result) on test vector %s, message %u, split %u\n",
+				       driver, vec_name, i, split);
+				return -EINVAL;
+			}
+		}
+	}
+
+	return 0;
+}
+
 static int test_hash_vec(const char *driver, const struct hash_testvec *vec,
 			 unsigned int vec_num, struct ahash_request *req,
 			 struct shash_desc *desc, struct test_sglist *tsgl,
@@ -1568,6 +1613,12 @@ static int test_hash_vec(const char *driver, const struct hash_testvec *vec,
 			return err;
 	}
 
+	if (desc) {
+		err = test_shash_finup_mb(driver, vec, vec_name, desc);
+		if (err)
+			return err;
+	}
+
 #ifdef CONFIG_CRYPTO_MANAGER_EXTRA_TESTS
 	if (!noextratests) {
 		struct testvec_config cfg;
@@ -20,6 +20,15 @@ struct nullb_cmd {
 	blk_status_t error;
 	struct nullb_queue *nq;
 	struct hrtimer timer;
+	u64 start_ns; /* submission time, for the queue statistics */
+};
+
+/* Completion statistics of a queue, for the requests of each direction. */
+struct nullb_queue_stats {
+	atomic_long_t ios;
+	atomic_long_t bytes;
+	atomic64_t lat_ns; /* sum of the device latencies */
+	atomic64_t max_lat_ns;
 };
 
 struct nullb_queue {
@@ -29,6 +38,10 @@ struct nullb_queue {
 	struct nullb_device *dev;
 	unsigned int requeue_selection;
 
+	/* end of the last transfer, when queue_mbps limits the bandwidth */
+	atomic64_t busy_until_ns;
+	struct nullb_queue_stats stats[3]; /* read, write, flush */
+
 	struct nullb_cmd *cmds;
 };
 
@@ -52,6 +65,11 @@ struct nullb_device {
 
 	unsigned long size; /* device size in MB */
 	unsigned long completion_nsec; /* time in ns to complete a request */
+	unsigned long completion_nsec_write; /* same for writes, if not 0 */
+	unsigned long completion_jitter_nsec; /* random extra latency, max */
+	unsigned long tail_nsec; /* extra latency of the slow requests */
+	unsigned int tail_permille; /* how many requests are slow, per 1000 */
+	unsigned int queue_mbps; /* bandwidth of each queue (in MB/s) */
 	unsigned long cache_size; /* disk cache size in MB */
 	unsigned long zone_size; /* zone size in MB if device is zoned */
 	unsigned long zone_capacity; /* zone capacity in MB if device is zoned */
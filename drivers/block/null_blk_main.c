@@ -342,6 +342,11 @@ static int nullb_apply_submit_queues(struct nullb_device *dev,
 
 NULLB_DEVICE_ATTR(size, ulong, NULL);
 NULLB_DEVICE_ATTR(completion_nsec, ulong, NULL);
+NULLB_DEVICE_ATTR(completion_nsec_write, ulong, NULL);
+NULLB_DEVICE_ATTR(completion_jitter_nsec, ulong, NULL);
+NULLB_DEVICE_ATTR(tail_nsec, ulong, NULL);
+NULLB_DEVICE_ATTR(tail_permille, uint, NULL);
+NULLB_DEVICE_ATTR(queue_mbps, uint, NULL);
 NULLB_DEVICE_ATTR(submit_queues, uint, nullb_apply_submit_queues);
 NULLB_DEVICE_ATTR(home_node, uint, NULL);
 NULLB_DEVICE_ATTR(queue_mode, uint, NULL);
@@ -456,9 +461,50 @@ static ssize_t nullb_device_badblocks_store(struct config_item *item,
 }
 CONFIGFS_ATTR(nullb_device_, badblocks);
 
+/*
+ * One line per queue: "<queue> <dir> ios=<n> bytes=<n> avg_lat_ns=<n>
+ * max_lat_ns=<n>", where the latencies are from submission to completion.
+ */
+static ssize_t nullb_device_queue_stats_show(struct config_item *item,
+					     char *page)
+{
+	struct nullb_device *dev = to_nullb_device(item);
+	static const char * const dirs[] = { "read", "write", "flush" };
+	struct nullb_queue_stats *stats;
+	unsigned long ios;
+	ssize_t ret = 0;
+	int i, d;
+
+	mutex_lock(&lock);
+	if (!dev->power || !dev->nullb)
+		goto out;
+
+	for (i = 0; i < dev->nullb->nr_queues; i++) {
+		for (d = 0; d < ARRAY_SIZE(dirs); d++) {
+			stats = &dev->nullb->queues[i].stats[d];
+			ios = atomic_long_read(&stats->ios);
+			ret += scnprintf(page + ret, PAGE_SIZE - ret,
+				"%d %s ios=%lu bytes=%lu avg_lat_ns=%llu max_lat_ns=%llu\n",
+				i, dirs[d], ios, atomic_long_read(&stats->bytes),
+				ios ? div_u64(atomic64_read(&stats->lat_ns), ios) : 0,
+				atomic64_read(&stats->max_lat_ns));
+		}
+	}
+out:
+	mutex_unlock(&lock);
+	return ret;
+}
+CONFIGFS_ATTR_RO(nullb_device_, queue_stats);
+
 static struct configfs_attribute *nullb_device_attrs[] = {
 	&nullb_device_attr_size,
 	&nullb_device_attr_completion_nsec,
+	&nullb_device_attr_completion_nsec_write,
+	&nullb_device_attr_completion_jitter_nsec,
+	&nullb_device_attr_tail_nsec,
+	&nullb_device_attr_tail_permille,
+	&nullb_device_attr_queue_mbps,
+	&nullb_device_attr_queue_stats,
 	&nullb_device_attr_submit_queues,
 	&nullb_device_attr_home_node,
 	&nullb_device_attr_queue_mode,
@@ -533,7 +579,7 @@ nullb_group_drop_item(struct config_group *group, struct config_item *item)
 static ssize_t memb_group_features_show(struct config_item *item, char *page)
 {
 	return snprintf(page, PAGE_SIZE,
-			"memory_backed,discard,bandwidth,cache,badblocks,zoned,zone_size,zone_capacity,zone_nr_conv,zone_max_open,zone_max_active\n");
+			"memory_backed,discard,bandwidth,cache,badblocks,zoned,zone_size,zone_capacity,zone_nr_conv,zone_max_open,zone_max_active,latency_model,queue_mbps,queue_stats\n");
 }
 
 CONFIGFS_ATTR_RO(memb_group_, features);
@@ -650,6 +696,7 @@ static struct nullb_cmd *__alloc_cmd(struct nullb_queue *nq)
 		cmd->tag = tag;
 		cmd->error = BLK_STS_OK;
 		cmd->nq = nq;
+		cmd->start_ns = ktime_get_ns();
 		if (nq->dev->irqmode == NULL_IRQ_TIMER) {
 			hrtimer_init(&cmd->timer, CLOCK_MONOTONIC,
 				     HRTIMER_MODE_REL);
@@ -683,10 +730,57 @@ static struct nullb_cmd *alloc_cmd(struct nullb_queue *nq, int can_wait)
 	return cmd;
 }
 
+static inline enum req_opf null_cmd_op(struct nullb_cmd *cmd)
+{
+	if (cmd->nq->dev->queue_mode == NULL_Q_BIO)
+		return bio_op(cmd->bio);
+	return req_op(cmd->rq);
+}
+
+static inline bool null_cmd_is_write(struct nullb_cmd *cmd)
+{
+	return op_is_write(null_cmd_op(cmd));
+}
+
+static inline unsigned int null_cmd_bytes(struct nullb_cmd *cmd)
+{
+	if (cmd->nq->dev->queue_mode == NULL_Q_BIO)
+		return cmd->bio->bi_iter.bi_size;
+	return blk_rq_bytes(cmd->rq);
+}
+
+/* The index in nullb_queue.stats: flushes don't count as reads or writes. */
+static inline int null_cmd_stats_dir(struct nullb_cmd *cmd)
+{
+	if (null_cmd_op(cmd) == REQ_OP_FLUSH)
+		return 2;
+	return null_cmd_is_write(cmd);
+}
+
+static void null_account_cmd(struct nullb_cmd *cmd)
+{
+	struct nullb_queue_stats *stats = &cmd->nq->stats[null_cmd_stats_dir(cmd)];
+	u64 lat = ktime_get_ns() - cmd->start_ns;
+	u64 max = atomic64_read(&stats->max_lat_ns);
+
+	atomic_long_inc(&stats->ios);
+	atomic_long_add(null_cmd_bytes(cmd), &stats->bytes);
+	atomic64_add(lat, &stats->lat_ns);
+	while (lat > max) {
+		u64 old = atomic64_cmpxchg(&stats->max_lat_ns, max, lat);
+
+		if (old == max)
+			break;
+		max = old;
+	}
+}
+
 static void end_cmd(struct nullb_cmd *cmd)
 {
 	int queue_mode = cmd->nq->dev->queue_mode;
 
+	null_account_cmd(cmd);
+
 	switch (queue_mode)  {
 	case NULL_Q_MQ:
 		blk_mq_end_request(cmd->rq, cmd->error);
@@ -707,9 +801,46 @@ static enum hrtimer_restart null_cmd_timer_expired(struct hrtimer *timer)
 	return HRTIMER_NORESTART;
 }
 
+/*
+ * The time until the completion of a command, in the timer mode: the time it
+ * waits for the transfers queued before it and its own when queue_mbps limits
+ * the bandwidth of the queue, plus a latency of completion_nsec, or
+ * completion_nsec_write for writes. completion_jitter_nsec adds up to that
+ * much at random, and tail_permille of the commands take tail_nsec more, to
+ * shape the higher percentiles.
+ */
+static u64 null_cmd_latency(struct nullb_cmd *cmd)
+{
+	struct nullb_device *dev = cmd->nq->dev;
+	u64 lat = dev->completion_nsec;
+	u64 now, start, end;
+	s64 busy;
+
+	if (null_cmd_is_write(cmd) && dev->completion_nsec_write)
+		lat = dev->completion_nsec_write;
+	if (dev->completion_jitter_nsec)
+		lat += mul_u64_u32_shr(dev->completion_jitter_nsec,
+				       prandom_u32(), 32);
+	if (dev->tail_permille && prandom_u32_max(1000) < dev->tail_permille)
+		lat += dev->tail_nsec;
+
+	if (!dev->queue_mbps)
+		return lat;
+
+	now = ktime_get_ns();
+	busy = atomic64_read(&cmd->nq->busy_until_ns);
+	do {
+		start = max_t(u64, now, busy);
+		end = start + div_u64((u64)null_cmd_bytes(cmd) * NSEC_PER_SEC,
+				      dev->queue_mbps) / SZ_1M;
+	} while (!atomic64_try_cmpxchg(&cmd->nq->busy_until_ns, &busy, end));
+
+	return end - now + lat;
+}
+
 static void null_cmd_end_timer(struct nullb_cmd *cmd)
 {
-	ktime_t kt = cmd->nq->dev->completion_nsec;
+	ktime_t kt = null_cmd_latency(cmd);
 
 	hrtimer_start(&cmd->timer, kt, HRTIMER_MODE_REL);
 }
@@ -1471,6 +1602,7 @@ static blk_status_t null_queue_rq(struct blk_mq_hw_ctx *hctx,
 	cmd->rq = bd->rq;
 	cmd->error = BLK_STS_OK;
 	cmd->nq = nq;
+	cmd->start_ns = ktime_get_ns();
 
 	blk_mq_start_request(bd->rq);
 
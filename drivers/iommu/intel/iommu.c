@@ -5312,6 +5312,13 @@ static int prepare_domain_attach_device(struct iommu_domain *domain,
 	}
 	dmar_domain->gaw = addr_width;
 
+	if ((dmar_domain->flags & DOMAIN_FLAG_DIRTY_TRACKING) &&
+	    !domain_use_first_level(dmar_domain) &&
+	    (!sm_supported(iommu) || !ecap_slads(iommu->ecap))) {
+		dev_err(dev, "%s: iommu can't track dirty pages\n", __func__);
+		return -EINVAL;
+	}
+
 	/*
 	 * Knock out extra levels of page tables if necessary
 	 */
@@ -6039,6 +6046,96 @@ static bool intel_iommu_is_attach_deferred(struct iommu_domain *domain,
 	return attach_deferred(dev);
 }
 
+static int intel_iommu_set_dirty_tracking(struct dmar_domain *domain,
+					  bool enable)
+{
+	struct device_domain_info *info;
+	int ret = 0;
+
+	assert_spin_locked(&device_domain_lock);
+
+	/* First level page tables always have their dirty bits updated. */
+	if (domain_use_first_level(domain))
+		goto out;
+
+	list_for_each_entry(info, &domain->devices, link) {
+		if (!sm_supported(info->iommu) ||
+		    !ecap_slads(info->iommu->ecap))
+			return -EOPNOTSUPP;
+	}
+
+	list_for_each_entry(info, &domain->devices, link) {
+		ret = intel_pasid_setup_dirty_tracking(info->iommu, domain,
+						       info->dev,
+						       PASID_RID2PASID, enable);
+		if (ret)
+			return ret;
+	}
+
+out:
+	if (enable)
+		domain->flags |= DOMAIN_FLAG_DIRTY_TRACKING;
+	else
+		domain->flags &= ~DOMAIN_FLAG_DIRTY_TRACKING;
+
+	return 0;
+}
+
+static int intel_iommu_read_and_clear_dirty(struct iommu_domain *domain,
+					    unsigned long iova, size_t size,
+					    unsigned long *bitmap,
+					    unsigned long pgshift)
+{
+	struct dmar_domain *dmar_domain = to_dmar_domain(domain);
+	unsigned long start_pfn = iova >> VTD_PAGE_SHIFT;
+	unsigned long last_pfn = (iova + size - 1) >> VTD_PAGE_SHIFT;
+	unsigned long pfn, next_pfn;
+	bool flush = false;
+	int dirty_bit, iommu_id;
+
+	if (!(dmar_domain->flags & DOMAIN_FLAG_DIRTY_TRACKING))
+		return -EINVAL;
+
+	dirty_bit = domain_use_first_level(dmar_domain) ?
+		    DMA_FL_PTE_DIRTY_BIT : DMA_SL_PTE_DIRTY_BIT;
+
+	for (pfn = start_pfn; pfn <= last_pfn; pfn = next_pfn) {
+		int large_page = 1;
+		struct dma_pte *pte;
+		unsigned long first, last;
+
+		pte = dma_pfn_level_pte(dmar_domain, pfn, 1, &large_page);
+		next_pfn = (pfn & ~(lvl_to_nr_pages(large_page) - 1)) +
+			   lvl_to_nr_pages(large_page);
+
+		if (!pte || !dma_pte_present(pte) ||
+		    !test_and_clear_bit(dirty_bit, (unsigned long *)&pte->val))
+			continue;
+
+		domain_flush_cache(dmar_domain, pte, sizeof(*pte));
+		flush = true;
+
+		if (!bitmap)
+			continue;
+
+		first = pfn << VTD_PAGE_SHIFT;
+		last = (min(next_pfn - 1, last_pfn) << VTD_PAGE_SHIFT) |
+		       (VTD_PAGE_SIZE - 1);
+		bitmap_set(bitmap, (first - iova) >> pgshift,
+			   ((last - first) >> pgshift) + 1);
+	}
+
+	/* The IOMMU must set the dirty bits again on the next write. */
+	if (flush) {
+		for_each_domain_iommu(iommu_id, dmar_domain)
+			iommu_flush_iotlb_psi(g_iommus[iommu_id], dmar_domain,
+					      start_pfn,
+					      last_pfn - start_pfn + 1, 0, 0);
+	}
+
+	return 0;
+}
+
 static int
 intel_iommu_domain_set_attr(struct iommu_domain *domain,
 			    enum iommu_attr attr, void *data)
@@ -6062,6 +6159,11 @@ intel_iommu_domain_set_attr(struct iommu_domain *domain,
 		}
 		spin_unlock_irqrestore(&device_domain_lock, flags);
 		break;
+	case DOMAIN_ATTR_DIRTY_TRACKING:
+		spin_lock_irqsave(&device_domain_lock, flags);
+		ret = intel_iommu_set_dirty_tracking(dmar_domain, *(bool *)data);
+		spin_unlock_irqrestore(&device_domain_lock, flags);
+		break;
 	default:
 		ret = -EINVAL;
 		break;
@@ -6092,6 +6194,7 @@ const struct iommu_ops intel_iommu_ops = {
 	.domain_alloc		= intel_iommu_domain_alloc,
 	.domain_free		= intel_iommu_domain_free,
 	.domain_set_attr	= intel_iommu_domain_set_attr,
+	.read_and_clear_dirty	= intel_iommu_read_and_clear_dirty,
 	.attach_dev		= intel_iommu_attach_device,
 	.detach_dev		= intel_iommu_detach_device,
 	.aux_attach_dev		= intel_iommu_aux_attach_device,
@@ -2688,6 +2688,30 @@ int iommu_domain_set_attr(struct iommu_domain *domain,
 }
 EXPORT_SYMBOL_GPL(iommu_domain_set_attr);
 
+/**
+ * iommu_read_and_clear_dirty - Collect the pages written by DMA
+ * @domain: the domain, with DOMAIN_ATTR_DIRTY_TRACKING enabled
+ * @iova: the start of the range
+ * @size: the size of the range
+ * @bitmap: the bitmap of the range, or NULL to only clear the dirty state
+ * @pgshift: the page size of the bits of @bitmap
+ *
+ * Set the bits of the pages in the range that were written since tracking was
+ * enabled or since the last call, and clear their dirty state.  Bits are only
+ * ever set, those of clean pages are left as is.
+ */
+int iommu_read_and_clear_dirty(struct iommu_domain *domain,
+			       unsigned long iova, size_t size,
+			       unsigned long *bitmap, unsigned long pgshift)
+{
+	if (!domain->ops->read_and_clear_dirty)
+		return -EOPNOTSUPP;
+
+	return domain->ops->read_and_clear_dirty(domain, iova, size, bitmap,
+						 pgshift);
+}
+EXPORT_SYMBOL_GPL(iommu_read_and_clear_dirty);
+
 void iommu_get_resv_regions(struct device *dev, struct list_head *list)
 {
 	const struct iommu_ops *ops = dev->bus->iommu_ops;
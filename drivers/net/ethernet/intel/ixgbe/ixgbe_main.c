@@ -1116,6 +1116,7 @@ static bool ixgbe_clean_tx_irq(struct ixgbe_q_vector *q_vector,
 	unsigned int total_bytes = 0, total_packets = 0, total_ipsec = 0;
 	unsigned int budget = q_vector->tx.work_limit;
 	unsigned int i = tx_ring->next_to_clean;
+	struct xdp_frame_bulk bq;
 
 	if (test_bit(__IXGBE_DOWN, &adapter->state))
 		return true;
@@ -1124,6 +1125,9 @@ static bool ixgbe_clean_tx_irq(struct ixgbe_q_vector *q_vector,
 	tx_desc = IXGBE_TX_DESC(tx_ring, i);
 	i -= tx_ring->count;
 
+	xdp_frame_bulk_init(&bq);
+	rcu_read_lock(); /* for xdp_return_frame_bulk() */
+
 	do {
 		union ixgbe_adv_tx_desc *eop_desc = tx_buffer->next_to_watch;
 
@@ -1149,7 +1153,7 @@ static bool ixgbe_clean_tx_irq(struct ixgbe_q_vector *q_vector,
 
 		/* free the skb */
 		if (ring_is_xdp(tx_ring))
-			xdp_return_frame(tx_buffer->xdpf);
+			xdp_return_frame_bulk(tx_buffer->xdpf, &bq);
 		else
 			napi_consume_skb(tx_buffer->skb, napi_budget);
 
@@ -1200,6 +1204,9 @@ static bool ixgbe_clean_tx_irq(struct ixgbe_q_vector *q_vector,
 		budget--;
 	} while (likely(budget));
 
+	xdp_flush_frame_bulk(&bq);
+	rcu_read_unlock();
+
 	i += tx_ring->count;
 	tx_ring->next_to_clean = i;
 	u64_stats_update_begin(&tx_ring->syncp);
@@ -6579,6 +6586,8 @@ int ixgbe_setup_rx_resources(struct ixgbe_adapter *adapter,
 	if (xdp_rxq_info_reg(&rx_ring->xdp_rxq, adapter->netdev,
 			     rx_ring->queue_index) < 0)
 		goto err;
+	if (rx_ring->q_vector)
+		rx_ring->xdp_rxq.napi_id = rx_ring->q_vector->napi.napi_id;
 
 	rx_ring->xdp_prog = adapter->xdp_prog;
 
@@ -1215,12 +1215,38 @@ static int tap_sendmsg(struct socket *sock, struct msghdr *m,
 			    m->msg_flags & MSG_DONTWAIT);
 }
 
+static int tap_recvmsg_batch(struct tap_queue *q, struct tun_msg_ctl *ctl,
+			     int flags)
+{
+	struct tun_msg_rx *rx = ctl->ptr;
+	int i, ret = ctl->num;
+
+	if (flags & ~(MSG_DONTWAIT|MSG_TRUNC))
+		ret = -EINVAL;
+
+	for (i = 0; i < ctl->num; i++) {
+		if (ret < 0) {
+			kfree_skb(rx[i].ptr);
+			rx[i].len = ret;
+		} else {
+			rx[i].len = tap_do_read(q, &rx[i].iter, 1, rx[i].ptr);
+		}
+	}
+
+	return ret;
+}
+
 static int tap_recvmsg(struct socket *sock, struct msghdr *m,
 		       size_t total_len, int flags)
 {
 	struct tap_queue *q = container_of(sock, struct tap_queue, sock);
+	struct tun_msg_ctl *ctl = m->msg_control;
 	struct sk_buff *skb = m->msg_control;
 	int ret;
+
+	if (ctl && m->msg_controllen == sizeof(*ctl) && ctl->type == TUN_MSG_PTR)
+		return tap_recvmsg_batch(q, ctl, flags);
+
 	if (flags & ~(MSG_DONTWAIT|MSG_TRUNC)) {
 		kfree_skb(skb);
 		return -EINVAL;
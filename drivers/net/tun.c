@@ -2513,14 +2513,47 @@ static int tun_sendmsg(struct socket *sock, struct msghdr *m, size_t total_len)
 	return ret;
 }
 
+static int tun_recvmsg_batch(struct tun_file *tfile, struct tun_msg_ctl *ctl,
+			     int flags)
+{
+	struct tun_struct *tun = tun_get(tfile);
+	struct tun_msg_rx *rx = ctl->ptr;
+	int i, ret = ctl->num;
+
+	if (!tun)
+		ret = -EBADFD;
+	else if (flags & ~(MSG_DONTWAIT|MSG_TRUNC))
+		ret = -EINVAL;
+
+	for (i = 0; i < ctl->num; i++) {
+		if (ret < 0) {
+			tun_ptr_free(rx[i].ptr);
+			rx[i].len = ret;
+		} else {
+			rx[i].len = tun_do_read(tun, tfile, &rx[i].iter, 1,
+						rx[i].ptr);
+		}
+	}
+
+	if (tun)
+		tun_put(tun);
+	return ret;
+}
+
 static int tun_recvmsg(struct socket *sock, struct msghdr *m, size_t total_len,
 		       int flags)
 {
 	struct tun_file *tfile = container_of(sock, struct tun_file, socket);
-	struct tun_struct *tun = tun_get(tfile);
+	struct tun_msg_ctl *ctl = m->msg_control;
+	struct tun_struct *tun;
 	void *ptr = m->msg_control;
 	int ret;
 
+	if (ctl && m->msg_controllen == sizeof(*ctl) && ctl->type == TUN_MSG_PTR)
+		return tun_recvmsg_batch(tfile, ctl, flags);
+
+	tun = tun_get(tfile);
+
 	if (!tun) {
 		ret = -EBADFD;
 		goto out_free;
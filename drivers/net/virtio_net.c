@@ -1036,7 +1036,8 @@ static struct sk_buff *receive_mergeable(struct net_device *dev,
 static void receive_buf(struct virtnet_info *vi, struct receive_queue *rq,
 			void *buf, unsigned int len, void **ctx,
 			unsigned int *xdp_xmit,
-			struct virtnet_rq_stats *stats)
+			struct virtnet_rq_stats *stats,
+			struct list_head *gro_list)
 {
 	struct net_device *dev = vi->dev;
 	struct sk_buff *skb;
@@ -1084,7 +1085,7 @@ static void receive_buf(struct virtnet_info *vi, struct receive_queue *rq,
 	pr_debug("Receiving skb proto 0x%04x len %i type %i\n",
 		 ntohs(skb->protocol), skb->len, skb->pkt_type);
 
-	napi_gro_receive(&rq->napi, skb);
+	list_add_tail(&skb->list, gro_list);
 	return;
 
 frame_err:
@@ -1339,6 +1340,7 @@ static int virtnet_receive(struct receive_queue *rq, int budget,
 {
 	struct virtnet_info *vi = rq->vq->vdev->priv;
 	struct virtnet_rq_stats stats = {};
+	LIST_HEAD(gro_list);
 	unsigned int len;
 	void *buf;
 	int i;
@@ -1348,17 +1350,21 @@ static int virtnet_receive(struct receive_queue *rq, int budget,
 
 		while (stats.packets < budget &&
 		       (buf = virtqueue_get_buf_ctx(rq->vq, &len, &ctx))) {
-			receive_buf(vi, rq, buf, len, ctx, xdp_xmit, &stats);
+			receive_buf(vi, rq, buf, len, ctx, xdp_xmit, &stats,
+				    &gro_list);
 			stats.packets++;
 		}
 	} else {
 		while (stats.packets < budget &&
 		       (buf = virtqueue_get_buf(rq->vq, &len)) != NULL) {
-			receive_buf(vi, rq, buf, len, NULL, xdp_xmit, &stats);
+			receive_buf(vi, rq, buf, len, NULL, xdp_xmit, &stats,
+				    &gro_list);
 			stats.packets++;
 		}
 	}
 
+	napi_gro_receive_list(&rq->napi, &gro_list);
+
 	if (rq->vq->num_free > min((unsigned int)budget, virtqueue_get_vring_size(rq->vq)) / 2) {
 		if (!try_fill_recv(vi, rq, GFP_ATOMIC))
 			schedule_delayed_work(&vi->refill, 0);
@@ -1832,8 +1832,15 @@ static void mlx5_vdpa_free(struct vdpa_device *vdev)
 
 static struct vdpa_notification_area mlx5_get_vq_notification(struct vdpa_device *vdev, u16 idx)
 {
+	struct mlx5_vdpa_dev *mvdev = to_mvdev(vdev);
 	struct vdpa_notification_area ret = {};
 
+	/* All the virtqueues share the doorbell page, which is written the
+	 * index of the kicked virtqueue.
+	 */
+	ret.addr = (phys_addr_t)mvdev->res.phys_kick_addr;
+	ret.size = PAGE_SIZE;
+
 	return ret;
 }
 
@@ -73,6 +73,9 @@ struct vfio_iommu {
 	bool			v2;
 	bool			nesting;
 	bool			dirty_page_tracking;
+	bool			hw_dirty_tracking; /* by all domains */
+	unsigned int		dma_maps_inflight; /* unlocked MAP_DMA */
+	wait_queue_head_t	dma_maps_wait;
 	bool			pinned_page_dirty_scope;
 };
 
@@ -82,6 +85,7 @@ struct vfio_domain {
 	struct list_head	group_list;
 	int			prot;		/* IOMMU_CACHE */
 	bool			fgsp;		/* Fine-grained super pages */
+	bool			dirty_tracking;	/* IOMMU dirty bits enabled */
 };
 
 struct vfio_dma {
@@ -120,6 +124,16 @@ struct vfio_pfn {
 	unsigned int		ref_count;
 };
 
+#define VFIO_BATCH_MAX_CAPACITY (PAGE_SIZE / sizeof(struct page *))
+
+struct vfio_batch {
+	struct page		**pages;	/* for pin_user_pages_remote */
+	struct page		*fallback_page; /* if pages alloc fails */
+	int			capacity;	/* length of pages array */
+	int			size;		/* of batch currently */
+	int			offset;		/* of next entry in pages */
+};
+
 struct vfio_regions {
 	struct list_head list;
 	dma_addr_t iova;
@@ -154,6 +168,20 @@ static void update_pinned_page_dirty_scope(struct vfio_iommu *iommu);
  * into DMA'ble space using the IOMMU
  */
 
+/*
+ * Wait for the MAP_DMA calls that pin and map without iommu->lock.  Called and
+ * returns with the lock held, but drops it while waiting.
+ */
+static void vfio_wait_dma_maps(struct vfio_iommu *iommu)
+{
+	while (iommu->dma_maps_inflight) {
+		mutex_unlock(&iommu->lock);
+		wait_event(iommu->dma_maps_wait,
+			   !READ_ONCE(iommu->dma_maps_inflight));
+		mutex_lock(&iommu->lock);
+	}
+}
+
 static struct vfio_dma *vfio_find_dma(struct vfio_iommu *iommu,
 				      dma_addr_t start, size_t size)
 {
@@ -441,10 +469,54 @@ static int follow_fault_pfn(struct vm_area_struct *vma, struct mm_struct *mm,
 	return ret;
 }
 
-static int vaddr_get_pfn(struct mm_struct *mm, unsigned long vaddr,
-			 int prot, unsigned long *pfn)
+static void vfio_batch_init(struct vfio_batch *batch)
+{
+	batch->size = 0;
+	batch->offset = 0;
+
+	if (unlikely(disable_hugepages))
+		goto fallback;
+
+	batch->pages = (struct page **) __get_free_page(GFP_KERNEL);
+	if (!batch->pages)
+		goto fallback;
+
+	batch->capacity = VFIO_BATCH_MAX_CAPACITY;
+	return;
+
+fallback:
+	batch->pages = &batch->fallback_page;
+	batch->capacity = 1;
+}
+
+static void vfio_batch_unpin(struct vfio_batch *batch, struct vfio_dma *dma)
+{
+	while (batch->size) {
+		unsigned long pfn = page_to_pfn(batch->pages[batch->offset]);
+
+		put_pfn(pfn, dma->prot);
+		batch->offset++;
+		batch->size--;
+	}
+}
+
+static void vfio_batch_fini(struct vfio_batch *batch)
+{
+	if (batch->capacity == VFIO_BATCH_MAX_CAPACITY)
+		free_page((unsigned long)batch->pages);
+}
+
+/*
+ * Pin up to @npages pages starting at @vaddr into @pages and return the pfn of
+ * the first one in @pfn.  A VM_PFNMAP vma has no struct pages, so only its
+ * first pfn is returned and @pages is left untouched.
+ *
+ * Returns the positive number of pfns obtained or a negative error code.
+ */
+static int vaddr_get_pfns(struct mm_struct *mm, unsigned long vaddr,
+			  long npages, int prot, unsigned long *pfn,
+			  struct page **pages)
 {
-	struct page *page[1];
 	struct vm_area_struct *vma;
 	unsigned int flags = 0;
 	int ret;
@@ -453,11 +525,10 @@ static int vaddr_get_pfn(struct mm_struct *mm, unsigned long vaddr,
 		flags |= FOLL_WRITE;
 
 	mmap_read_lock(mm);
-	ret = pin_user_pages_remote(mm, vaddr, 1, flags | FOLL_LONGTERM,
-				    page, NULL, NULL);
-	if (ret == 1) {
-		*pfn = page_to_pfn(page[0]);
-		ret = 0;
+	ret = pin_user_pages_remote(mm, vaddr, npages, flags | FOLL_LONGTERM,
+				    pages, NULL, NULL);
+	if (ret > 0) {
+		*pfn = page_to_pfn(pages[0]);
 		goto done;
 	}
 
@@ -471,8 +542,12 @@ static int vaddr_get_pfn(struct mm_struct *mm, unsigned long vaddr,
 		if (ret == -EAGAIN)
 			goto retry;
 
-		if (!ret && !is_invalid_reserved_pfn(*pfn))
-			ret = -EFAULT;
+		if (!ret) {
+			if (is_invalid_reserved_pfn(*pfn))
+				ret = 1;
+			else
+				ret = -EFAULT;
+		}
 	}
 done:
 	mmap_read_unlock(mm);
@@ -483,79 +558,114 @@ static int vaddr_get_pfn(struct mm_struct *mm, unsigned long vaddr,
  * Attempt to pin pages.  We really don't want to track all the pfns and
  * the iommu can only map chunks of consecutive pfns anyway, so get the
  * first page and all consecutive pages with the same locking.
+ *
+ * The pages are pinned in batches, the pages of @batch that aren't part of the
+ * returned chunk start the chunk of the next call.  The caller must release
+ * them with vfio_batch_unpin() if it doesn't pin the rest of the range.
  */
 static long vfio_pin_pages_remote(struct vfio_dma *dma, unsigned long vaddr,
 				  long npage, unsigned long *pfn_base,
-				  unsigned long limit)
+				  unsigned long limit, struct vfio_batch *batch)
 {
 	unsigned long pfn = 0;
+	struct mm_struct *mm = current->mm;
 	long ret, pinned = 0, lock_acct = 0;
-	bool rsvd;
+	bool rsvd = false, first = true;
 	dma_addr_t iova = vaddr - dma->vaddr + dma->iova;
 
 	/* This code path is only user initiated */
-	if (!current->mm)
+	if (!mm)
 		return -ENODEV;
 
-	ret = vaddr_get_pfn(current->mm, vaddr, dma->prot, pfn_base);
-	if (ret)
-		return ret;
-
-	pinned++;
-	rsvd = is_invalid_reserved_pfn(*pfn_base);
-
-	/*
-	 * Reserved pages aren't counted against the user, externally pinned
-	 * pages are already counted against the user.
-	 */
-	if (!rsvd && !vfio_find_vpfn(dma, iova)) {
-		if (!dma->lock_cap && current->mm->locked_vm + 1 > limit) {
-			put_pfn(*pfn_base, dma->prot);
-			pr_warn("%s: RLIMIT_MEMLOCK (%ld) exceeded\n", __func__,
-					limit << PAGE_SHIFT);
-			return -ENOMEM;
-		}
-		lock_acct++;
+	if (batch->size) {
+		/* Leftover pages in batch from an earlier call. */
+		pfn = page_to_pfn(batch->pages[batch->offset]);
+		*pfn_base = pfn;
+		rsvd = is_invalid_reserved_pfn(pfn);
+		first = false;
 	}
 
-	if (unlikely(disable_hugepages))
-		goto out;
+	while (npage) {
+		if (!batch->size) {
+			/* Empty batch, so refill it. */
+			long req_pages = min_t(long, npage, batch->capacity);
 
-	/* Lock all the consecutive pages from pfn_base */
-	for (vaddr += PAGE_SIZE, iova += PAGE_SIZE; pinned < npage;
-	     pinned++, vaddr += PAGE_SIZE, iova += PAGE_SIZE) {
-		ret = vaddr_get_pfn(current->mm, vaddr, dma->prot, &pfn);
-		if (ret)
-			break;
+			ret = vaddr_get_pfns(mm, vaddr, req_pages, dma->prot,
+					     &pfn, batch->pages);
+			if (ret < 0)
+				goto unpin_out;
 
-		if (pfn != *pfn_base + pinned ||
-		    rsvd != is_invalid_reserved_pfn(pfn)) {
-			put_pfn(pfn, dma->prot);
-			break;
+			batch->size = ret;
+			batch->offset = 0;
+
+			if (first) {
+				*pfn_base = pfn;
+				rsvd = is_invalid_reserved_pfn(pfn);
+				first = false;
+			}
 		}
 
-		if (!rsvd && !vfio_find_vpfn(dma, iova)) {
-			if (!dma->lock_cap &&
-			    current->mm->locked_vm + lock_acct + 1 > limit) {
-				put_pfn(pfn, dma->prot);
-				pr_warn("%s: RLIMIT_MEMLOCK (%ld) exceeded\n",
-					__func__, limit << PAGE_SHIFT);
-				ret = -ENOMEM;
-				goto unpin_out;
+		/*
+		 * pfn is preset for the first iteration of this inner loop and
+		 * updated at the end of it.  A VM_PFNMAP pfn has no struct
+		 * page in batch->pages, so the pages are only looked at when
+		 * there's more than one pfn in the batch, i.e. when they come
+		 * from a !VM_PFNMAP vma.
+		 */
+		while (true) {
+			if (pfn != *pfn_base + pinned ||
+			    rsvd != is_invalid_reserved_pfn(pfn))
+				goto out;
+
+			/*
+			 * Reserved pages aren't counted against the user,
+			 * externally pinned pages are already counted against
+			 * the user.
+			 */
+			if (!rsvd && !vfio_find_vpfn(dma, iova)) {
+				if (!dma->lock_cap &&
+				    mm->locked_vm + lock_acct + 1 > limit) {
+					pr_warn("%s: RLIMIT_MEMLOCK (%ld) exceeded\n",
+						__func__, limit << PAGE_SHIFT);
+					ret = -ENOMEM;
+					goto unpin_out;
+				}
+				lock_acct++;
 			}
-			lock_acct++;
+
+			pinned++;
+			npage--;
+			vaddr += PAGE_SIZE;
+			iova += PAGE_SIZE;
+			batch->offset++;
+			batch->size--;
+
+			if (!batch->size)
+				break;
+
+			pfn = page_to_pfn(batch->pages[batch->offset]);
 		}
+
+		if (unlikely(disable_hugepages))
+			break;
 	}
 
 out:
 	ret = vfio_lock_acct(dma, lock_acct, false);
 
 unpin_out:
-	if (ret) {
-		if (!rsvd) {
+	if (batch->size == 1 && !batch->offset) {
+		/* May be a VM_PFNMAP pfn, which the batch can't remember. */
+		put_pfn(pfn, dma->prot);
+		batch->size = 0;
+	}
+
+	if (ret < 0) {
+		if (pinned && !rsvd) {
 			for (pfn = *pfn_base ; pinned ; pfn++, pinned--)
 				put_pfn(pfn, dma->prot);
 		}
+		vfio_batch_unpin(batch, dma);
 
 		return ret;
 	}
@@ -587,6 +697,7 @@ static long vfio_unpin_pages_remote(struct vfio_dma *dma, dma_addr_t iova,
 static int vfio_pin_page_external(struct vfio_dma *dma, unsigned long vaddr,
 				  unsigned long *pfn_base, bool do_accounting)
 {
+	struct page *pages[1];
 	struct mm_struct *mm;
 	int ret;
 
@@ -594,8 +705,13 @@ static int vfio_pin_page_external(struct vfio_dma *dma, unsigned long vaddr,
 	if (!mm)
 		return -ENODEV;
 
-	ret = vaddr_get_pfn(mm, vaddr, dma->prot, pfn_base);
-	if (!ret && do_accounting && !is_invalid_reserved_pfn(*pfn_base)) {
+	ret = vaddr_get_pfns(mm, vaddr, 1, dma->prot, pfn_base, pages);
+	if (ret != 1)
+		goto out;
+
+	ret = 0;
+
+	if (do_accounting && !is_invalid_reserved_pfn(*pfn_base)) {
 		ret = vfio_lock_acct(dma, 1, true);
 		if (ret) {
 			put_pfn(*pfn_base, dma->prot);
@@ -607,6 +723,7 @@ static int vfio_pin_page_external(struct vfio_dma *dma, unsigned long vaddr,
 		}
 	}
 
+out:
 	mmput(mm);
 	return ret;
 }
@@ -649,6 +766,7 @@ static int vfio_iommu_type1_pin_pages(void *iommu_data,
 		return -EACCES;
 
 	mutex_lock(&iommu->lock);
+	vfio_wait_dma_maps(iommu);
 
 	/* Fail if notifier list is empty */
 	if (!iommu->notifier.head) {
@@ -750,6 +868,7 @@ static int vfio_iommu_type1_unpin_pages(void *iommu_data,
 		return -EACCES;
 
 	mutex_lock(&iommu->lock);
+	vfio_wait_dma_maps(iommu);
 
 	do_accounting = !IS_IOMMU_CAP_DOMAIN_IN_CONTAINER(iommu);
 	for (i = 0; i < npage; i++) {
@@ -976,6 +1095,82 @@ static void vfio_update_pgsize_bitmap(struct vfio_iommu *iommu)
 	}
 }
 
+/*
+ * Enable or disable the tracking of DMA writes by the IOMMU of @domain.  The
+ * pages written before tracking got enabled are unknown, so all pages of the
+ * mapped ranges are marked dirty once when it is.
+ */
+static void vfio_domain_set_dirty_tracking(struct vfio_iommu *iommu,
+					   struct vfio_domain *domain,
+					   bool enable)
+{
+	unsigned long pgshift = __ffs(iommu->pgsize_bitmap);
+	struct rb_node *n;
+
+	if (domain->dirty_tracking == enable)
+		return;
+
+	if (iommu_domain_set_attr(domain->domain, DOMAIN_ATTR_DIRTY_TRACKING,
+				  &enable) && enable)
+		return;
+
+	domain->dirty_tracking = enable;
+	if (!enable)
+		return;
+
+	for (n = rb_first(&iommu->dma_list); n; n = rb_next(n)) {
+		struct vfio_dma *dma = rb_entry(n, struct vfio_dma, node);
+
+		if (!dma->iommu_mapped)
+			continue;
+
+		iommu_read_and_clear_dirty(domain->domain, dma->iova, dma->size,
+					   NULL, pgshift);
+		if (dma->bitmap)
+			bitmap_set(dma->bitmap, 0, dma->size >> pgshift);
+	}
+}
+
+/*
+ * Sync the IOMMU dirty tracking of the domains with the dirty page tracking
+ * state of the container.  Hardware dirty bits are only of use if all domains
+ * provide them.
+ */
+static void vfio_update_dirty_tracking(struct vfio_iommu *iommu)
+{
+	struct vfio_domain *domain;
+	bool hw = !list_empty(&iommu->domain_list);
+
+	list_for_each_entry(domain, &iommu->domain_list, next) {
+		vfio_domain_set_dirty_tracking(iommu, domain,
+					       iommu->dirty_page_tracking);
+		hw &= domain->dirty_tracking;
+	}
+
+	iommu->hw_dirty_tracking = iommu->dirty_page_tracking && hw;
+}
+
+/*
+ * Collect the pages of @dma written by devices from the IOMMU dirty bits of
+ * all domains.  Returns false if they aren't available.
+ */
+static bool vfio_dma_read_hw_dirty(struct vfio_iommu *iommu,
+				   struct vfio_dma *dma, unsigned long pgshift)
+{
+	struct vfio_domain *domain;
+
+	if (!iommu->hw_dirty_tracking)
+		return false;
+
+	list_for_each_entry(domain, &iommu->domain_list, next) {
+		if (iommu_read_and_clear_dirty(domain->domain, dma->iova,
+					       dma->size, dma->bitmap, pgshift))
+			return false;
+	}
+
+	return true;
+}
+
 static int update_user_bitmap(u64 __user *bitmap, struct vfio_iommu *iommu,
 			      struct vfio_dma *dma, dma_addr_t base_iova,
 			      size_t pgsize)
@@ -989,9 +1184,11 @@ static int update_user_bitmap(u64 __user *bitmap, struct vfio_iommu *iommu,
 
 	/*
 	 * mark all pages dirty if any IOMMU capable device is not able
-	 * to report dirty pages and all pages are pinned and mapped.
+	 * to report dirty pages and all pages are pinned and mapped,
+	 * unless the IOMMUs track the pages written by DMA.
 	 */
-	if (!iommu->pinned_page_dirty_scope && dma->iommu_mapped)
+	if (!iommu->pinned_page_dirty_scope && dma->iommu_mapped &&
+	    !vfio_dma_read_hw_dirty(iommu, dma, pgshift))
 		bitmap_set(dma->bitmap, 0, nbits);
 
 	if (shift) {
@@ -1078,6 +1275,7 @@ static int vfio_dma_do_unmap(struct vfio_iommu *iommu,
 	unsigned long pgshift;
 
 	mutex_lock(&iommu->lock);
+	vfio_wait_dma_maps(iommu);
 
 	pgshift = __ffs(iommu->pgsize_bitmap);
 	pgsize = (size_t)1 << pgshift;
@@ -1185,6 +1383,7 @@ static int vfio_dma_do_unmap(struct vfio_iommu *iommu,
 						    VFIO_IOMMU_NOTIFY_DMA_UNMAP,
 						    &nb_unmap);
 			mutex_lock(&iommu->lock);
+			vfio_wait_dma_maps(iommu);
 			goto again;
 		}
 
@@ -1234,20 +1433,29 @@ static int vfio_iommu_map(struct vfio_iommu *iommu, dma_addr_t iova,
 	return ret;
 }
 
+/*
+ * Pin and map the range of @dma, which is already linked at its full size.
+ * Called without iommu->lock, see vfio_dma_do_map().  On failure, dma->size is
+ * trimmed to the part that got mapped for vfio_remove_dma() to undo.
+ */
 static int vfio_pin_map_dma(struct vfio_iommu *iommu, struct vfio_dma *dma,
 			    size_t map_size)
 {
 	dma_addr_t iova = dma->iova;
 	unsigned long vaddr = dma->vaddr;
-	size_t size = map_size;
+	size_t size = map_size, mapped = 0;
 	long npage;
 	unsigned long pfn, limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+	struct vfio_batch batch;
 	int ret = 0;
 
+	vfio_batch_init(&batch);
+
 	while (size) {
 		/* Pin a contiguous chunk of memory */
-		npage = vfio_pin_pages_remote(dma, vaddr + dma->size,
-					      size >> PAGE_SHIFT, &pfn, limit);
+		npage = vfio_pin_pages_remote(dma, vaddr + mapped,
+					      size >> PAGE_SHIFT, &pfn, limit,
+					      &batch);
 		if (npage <= 0) {
 			WARN_ON(!npage);
 			ret = (int)npage;
@@ -1255,22 +1463,24 @@ static int vfio_pin_map_dma(struct vfio_iommu *iommu, struct vfio_dma *dma,
 		}
 
 		/* Map it! */
-		ret = vfio_iommu_map(iommu, iova + dma->size, pfn, npage,
+		ret = vfio_iommu_map(iommu, iova + mapped, pfn, npage,
 				     dma->prot);
 		if (ret) {
-			vfio_unpin_pages_remote(dma, iova + dma->size, pfn,
+			vfio_unpin_pages_remote(dma, iova + mapped, pfn,
 						npage, true);
+			vfio_batch_unpin(&batch, dma);
 			break;
 		}
 
 		size -= npage << PAGE_SHIFT;
-		dma->size += npage << PAGE_SHIFT;
+		mapped += npage << PAGE_SHIFT;
 	}
 
+	vfio_batch_fini(&batch);
 	dma->iommu_mapped = true;
 
 	if (ret)
-		vfio_remove_dma(iommu, dma);
+		dma->size = mapped;
 
 	return ret;
 }
@@ -1390,15 +1600,32 @@ static int vfio_dma_do_map(struct vfio_iommu *iommu,
 
 	dma->pfn_list = RB_ROOT;
 
-	/* Insert zero-sized and grow as we map chunks of it */
+	/*
+	 * Insert at full size, so that the range is reserved against other
+	 * MAP_DMA calls while it's pinned and mapped.
+	 */
+	dma->size = size;
 	vfio_link_dma(iommu, dma);
 
-	/* Don't pin and map if container doesn't contain IOMMU capable domain*/
-	if (!IS_IOMMU_CAP_DOMAIN_IN_CONTAINER(iommu))
-		dma->size = size;
-	else
+	/*
+	 * Don't pin and map if container doesn't contain IOMMU capable domain.
+	 * Otherwise do it without the lock, so that MAP_DMA calls for disjoint
+	 * ranges run in parallel.  Everything else that looks at the dma_list
+	 * or the domains waits for them in vfio_wait_dma_maps().
+	 */
+	if (IS_IOMMU_CAP_DOMAIN_IN_CONTAINER(iommu)) {
+		iommu->dma_maps_inflight++;
+		mutex_unlock(&iommu->lock);
+
 		ret = vfio_pin_map_dma(iommu, dma, size);
 
+		mutex_lock(&iommu->lock);
+		if (ret)
+			vfio_remove_dma(iommu, dma);
+		if (!--iommu->dma_maps_inflight)
+			wake_up_all(&iommu->dma_maps_wait);
+	}
+
 	if (!ret && iommu->dirty_page_tracking) {
 		ret = vfio_dma_bitmap_alloc(dma, pgsize);
 		if (ret)
@@ -1425,6 +1652,7 @@ static int vfio_bus_type(struct device *dev, void *data)
 static int vfio_iommu_replay(struct vfio_iommu *iommu,
 			     struct vfio_domain *domain)
 {
+	struct vfio_batch batch;
 	struct vfio_domain *d = NULL;
 	struct rb_node *n;
 	unsigned long limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
@@ -1435,6 +1663,8 @@ static int vfio_iommu_replay(struct vfio_iommu *iommu,
 		d = list_first_entry(&iommu->domain_list,
 				     struct vfio_domain, next);
 
+	vfio_batch_init(&batch);
+
 	n = rb_first(&iommu->dma_list);
 
 	for (; n; n = rb_next(n)) {
@@ -1482,7 +1712,8 @@ static int vfio_iommu_replay(struct vfio_iommu *iommu,
 
 				npage = vfio_pin_pages_remote(dma, vaddr,
 							      n >> PAGE_SHIFT,
-							      &pfn, limit);
+							      &pfn, limit,
+							      &batch);
 				if (npage <= 0) {
 					WARN_ON(!npage);
 					ret = (int)npage;
@@ -1496,11 +1727,13 @@ static int vfio_iommu_replay(struct vfio_iommu *iommu,
 			ret = iommu_map(domain->domain, iova, phys,
 					size, dma->prot | domain->prot);
 			if (ret) {
-				if (!dma->iommu_mapped)
+				if (!dma->iommu_mapped) {
 					vfio_unpin_pages_remote(dma, iova,
 							phys >> PAGE_SHIFT,
 							size >> PAGE_SHIFT,
 							true);
+					vfio_batch_unpin(&batch, dma);
+				}
 				goto unwind;
 			}
 
@@ -1515,6 +1748,7 @@ static int vfio_iommu_replay(struct vfio_iommu *iommu,
 		dma->iommu_mapped = true;
 	}
 
+	vfio_batch_fini(&batch);
 	return 0;
 
 unwind:
@@ -1555,6 +1789,7 @@ static int vfio_iommu_replay(struct vfio_iommu *iommu,
 		}
 	}
 
+	vfio_batch_fini(&batch);
 	return ret;
 }
 
@@ -2009,6 +2244,7 @@ static int vfio_iommu_type1_attach_group(void *iommu_data,
 	LIST_HEAD(group_resv_regions);
 
 	mutex_lock(&iommu->lock);
+	vfio_wait_dma_maps(iommu);
 
 	/* Check for duplicates */
 	if (vfio_iommu_find_iommu_group(iommu, iommu_group)) {
@@ -2179,6 +2415,7 @@ static int vfio_iommu_type1_attach_group(void *iommu_data,
 
 	list_add(&domain->next, &iommu->domain_list);
 	vfio_update_pgsize_bitmap(iommu);
+	vfio_update_dirty_tracking(iommu);
 done:
 	/* Delete the old one and insert new iova list */
 	vfio_iommu_iova_insert_copy(iommu, &iova_copy);
@@ -2345,6 +2582,7 @@ static void vfio_iommu_type1_detach_group(void *iommu_data,
 	LIST_HEAD(iova_copy);
 
 	mutex_lock(&iommu->lock);
+	vfio_wait_dma_maps(iommu);
 
 	if (iommu->external_domain) {
 		group = find_iommu_group(iommu->external_domain, iommu_group);
@@ -2417,6 +2655,7 @@ static void vfio_iommu_type1_detach_group(void *iommu_data,
 	 */
 	if (update_dirty_scope)
 		update_pinned_page_dirty_scope(iommu);
+	vfio_update_dirty_tracking(iommu);
 	mutex_unlock(&iommu->lock);
 }
 
@@ -2447,6 +2686,7 @@ static void *vfio_iommu_type1_open(unsigned long arg)
 	iommu->dma_list = RB_ROOT;
 	iommu->dma_avail = dma_entry_limit;
 	mutex_init(&iommu->lock);
+	init_waitqueue_head(&iommu->dma_maps_wait);
 	BLOCKING_INIT_NOTIFIER_HEAD(&iommu->notifier);
 
 	return iommu;
@@ -2776,18 +3016,23 @@ static int vfio_iommu_type1_dirty_pages(struct vfio_iommu *iommu,
 		size_t pgsize;
 
 		mutex_lock(&iommu->lock);
+		vfio_wait_dma_maps(iommu);
 		pgsize = 1 << __ffs(iommu->pgsize_bitmap);
 		if (!iommu->dirty_page_tracking) {
 			ret = vfio_dma_bitmap_alloc_all(iommu, pgsize);
-			if (!ret)
+			if (!ret) {
 				iommu->dirty_page_tracking = true;
+				vfio_update_dirty_tracking(iommu);
+			}
 		}
 		mutex_unlock(&iommu->lock);
 		return ret;
 	} else if (dirty.flags & VFIO_IOMMU_DIRTY_PAGES_FLAG_STOP) {
 		mutex_lock(&iommu->lock);
+		vfio_wait_dma_maps(iommu);
 		if (iommu->dirty_page_tracking) {
 			iommu->dirty_page_tracking = false;
+			vfio_update_dirty_tracking(iommu);
 			vfio_dma_bitmap_free_all(iommu);
 		}
 		mutex_unlock(&iommu->lock);
@@ -2818,6 +3063,7 @@ static int vfio_iommu_type1_dirty_pages(struct vfio_iommu *iommu,
 			return ret;
 
 		mutex_lock(&iommu->lock);
+		vfio_wait_dma_maps(iommu);
 
 		iommu_pgsize = (size_t)1 << __ffs(iommu->pgsize_bitmap);
 
@@ -2965,6 +3211,7 @@ static int vfio_iommu_type1_dma_rw(void *iommu_data, dma_addr_t user_iova,
 	size_t done;
 
 	mutex_lock(&iommu->lock);
+	vfio_wait_dma_maps(iommu);
 	while (count > 0) {
 		ret = vfio_iommu_type1_dma_rw_chunk(iommu, user_iova, data,
 						    count, write, &done);
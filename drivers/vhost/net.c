@@ -18,6 +18,7 @@
 #include <linux/slab.h>
 #include <linux/sched/clock.h>
 #include <linux/sched/signal.h>
+#include <linux/seq_file.h>
 #include <linux/vmalloc.h>
 
 #include <linux/net.h>
@@ -35,11 +36,30 @@
 
 #include "vhost.h"
 
-static int experimental_zcopytx = 0;
+static int experimental_zcopytx = 1;
 module_param(experimental_zcopytx, int, 0444);
 MODULE_PARM_DESC(experimental_zcopytx, "Enable Zero Copy TX;"
 		                       " 1 -Enable; 0 - Disable");
 
+/*
+ * The busy polling window of a virtqueue adapts to how often polling finds
+ * work, up to the busyloop_timeout set by VHOST_SET_VRING_BUSYLOOP_TIMEOUT.
+ * A zero busyloop_grow always polls for the whole busyloop_timeout.
+ */
+static unsigned int busyloop_grow = 2;
+module_param(busyloop_grow, uint, 0644);
+MODULE_PARM_DESC(busyloop_grow, "Busy polling window grow factor, 0 disables adapting the window");
+
+/* Initial and minimum window, in the units of busyloop_timeout (~us) */
+static unsigned int busyloop_grow_start = 2;
+module_param(busyloop_grow_start, uint, 0644);
+MODULE_PARM_DESC(busyloop_grow_start, "Minimum busy polling window");
+
+/* Default is to halve the window, 0 resets it to busyloop_grow_start */
+static unsigned int busyloop_shrink = 2;
+module_param(busyloop_shrink, uint, 0644);
+MODULE_PARM_DESC(busyloop_shrink, "Busy polling window shrink divisor");
+
 /* Max number of bytes transferred before requeueing the job.
  * Using this limit prevents one virtqueue from starving others. */
 #define VHOST_NET_WEIGHT 0x80000
@@ -73,7 +93,8 @@ enum {
 	VHOST_NET_FEATURES = VHOST_FEATURES |
 			 (1ULL << VHOST_NET_F_VIRTIO_NET_HDR) |
 			 (1ULL << VIRTIO_NET_F_MRG_RXBUF) |
-			 (1ULL << VIRTIO_F_ACCESS_PLATFORM)
+			 (1ULL << VIRTIO_F_ACCESS_PLATFORM) |
+			 (1ULL << VIRTIO_F_RING_PACKED)
 };
 
 enum {
@@ -104,6 +125,18 @@ struct vhost_net_buf {
 	int head;
 };
 
+/* A RX packet, received into its descriptors when its batch is flushed */
+struct vhost_net_rx_pkt {
+	struct iov_iter fixup;
+	struct iovec *iov;
+	struct vhost_log *log;
+	unsigned int in;
+	unsigned int log_num;
+	size_t sock_len;
+	size_t vhost_len;
+	s16 headcount;
+};
+
 struct vhost_net_virtqueue {
 	struct vhost_virtqueue vq;
 	size_t vhost_hlen;
@@ -115,6 +148,10 @@ struct vhost_net_virtqueue {
 	 * For RX, number of batched heads
 	 */
 	int done_idx;
+	/* Number of zerocopy buffers with DMA in progress */
+	int zcopy_pend;
+	/* DMA done zerocopy buffers batched for the used ring */
+	struct vring_used_elem zcopy_done[VHOST_NET_BATCH];
 	/* Number of XDP frames batched */
 	int batched_xdp;
 	/* an array of userspace buffers info */
@@ -126,6 +163,17 @@ struct vhost_net_virtqueue {
 	struct vhost_net_buf rxq;
 	/* Batched XDP buffs */
 	struct xdp_buff *xdp;
+	/* RX packets batched for a single recvmsg call on rx_ring */
+	struct vhost_net_rx_pkt *rx_pkts;
+	struct tun_msg_rx *rx_msgs;
+	int batched_rx;
+	/* Heads and iovecs used by the batched RX packets */
+	int batched_rx_heads;
+	int batched_rx_iovs;
+	/* Adaptive busy polling window, protected by vq mutex */
+	unsigned long busyloop_window;
+	u64 busyloop_hits;
+	u64 busyloop_misses;
 };
 
 struct vhost_net {
@@ -308,9 +356,13 @@ static void vhost_net_vq_reset(struct vhost_net *n)
 	for (i = 0; i < VHOST_NET_VQ_MAX; i++) {
 		n->vqs[i].done_idx = 0;
 		n->vqs[i].upend_idx = 0;
+		n->vqs[i].zcopy_pend = 0;
 		n->vqs[i].ubufs = NULL;
 		n->vqs[i].vhost_hlen = 0;
 		n->vqs[i].sock_hlen = 0;
+		n->vqs[i].busyloop_window = 0;
+		n->vqs[i].busyloop_hits = 0;
+		n->vqs[i].busyloop_misses = 0;
 		vhost_net_buf_init(&n->vqs[i].rxq);
 	}
 
@@ -352,33 +404,48 @@ static bool vhost_sock_xdp(struct socket *sock)
 
 /* In case of DMA done not in order in lower device driver for some reason.
  * upend_idx is used to track end of used idx, done_idx is used to track head
- * of used idx. Once lower device DMA done contiguously, we will signal KVM
- * guest used idx.
+ * of used idx. The used ring does not have to be in order, so the buffers
+ * whose DMA is done are returned to the guest as soon as they are seen, in
+ * batches, even if a buffer before them is still in flight. Returned buffers
+ * are cleared, and done_idx moves past them once all the buffers before are
+ * done too.
  */
 static void vhost_zerocopy_signal_used(struct vhost_net *net,
 				       struct vhost_virtqueue *vq)
 {
 	struct vhost_net_virtqueue *nvq =
 		container_of(vq, struct vhost_net_virtqueue, vq);
-	int i, add;
-	int j = 0;
+	bool head_done = true, added = false;
+	__virtio32 len;
+	int i, n = 0;
 
 	for (i = nvq->done_idx; i != nvq->upend_idx; i = (i + 1) % UIO_MAXIOV) {
-		if (vq->heads[i].len == VHOST_DMA_FAILED_LEN)
+		len = READ_ONCE(vq->heads[i].len);
+		if (len == VHOST_DMA_FAILED_LEN)
 			vhost_net_tx_err(net);
-		if (VHOST_DMA_IS_DONE(vq->heads[i].len)) {
+		if (VHOST_DMA_IS_DONE(len)) {
 			vq->heads[i].len = VHOST_DMA_CLEAR_LEN;
-			++j;
-		} else
-			break;
+			nvq->zcopy_done[n].id = vq->heads[i].id;
+			nvq->zcopy_done[n].len = VHOST_DMA_CLEAR_LEN;
+			--nvq->zcopy_pend;
+			if (++n == VHOST_NET_BATCH) {
+				vhost_add_used_n(vq, nvq->zcopy_done, n);
+				added = true;
+				n = 0;
+			}
+		} else if (len != VHOST_DMA_CLEAR_LEN) {
+			head_done = false;
+		}
+		if (head_done)
+			nvq->done_idx = (i + 1) % UIO_MAXIOV;
 	}
-	while (j) {
-		add = min(UIO_MAXIOV - nvq->done_idx, j);
-		vhost_add_used_and_signal_n(vq->dev, vq,
-					    &vq->heads[nvq->done_idx], add);
-		nvq->done_idx = (nvq->done_idx + add) % UIO_MAXIOV;
-		j -= add;
+
+	if (n) {
+		vhost_add_used_n(vq, nvq->zcopy_done, n);
+		added = true;
 	}
+	if (added)
+		vhost_signal(vq->dev, vq);
 }
 
 static void vhost_zerocopy_callback(struct ubuf_info *ubuf, bool success)
@@ -505,16 +572,57 @@ static void vhost_net_busy_poll_try_queue(struct vhost_net *net,
 	}
 }
 
+static unsigned long vhost_net_busyloop_min(struct vhost_net_virtqueue *nvq)
+{
+	return min_t(unsigned long, READ_ONCE(busyloop_grow_start),
+		     nvq->vq.busyloop_timeout);
+}
+
+static unsigned long vhost_net_busyloop_window(struct vhost_net_virtqueue *nvq)
+{
+	unsigned long max = nvq->vq.busyloop_timeout;
+
+	if (!READ_ONCE(busyloop_grow))
+		return max;
+
+	if (!nvq->busyloop_window)
+		nvq->busyloop_window = vhost_net_busyloop_min(nvq);
+
+	return min(nvq->busyloop_window, max);
+}
+
+/* Polling found work late in the window, a larger one may catch more. */
+static void vhost_net_busyloop_grow(struct vhost_net_virtqueue *nvq)
+{
+	unsigned long window = nvq->busyloop_window;
+
+	window *= READ_ONCE(busyloop_grow);
+	nvq->busyloop_window = clamp(window, vhost_net_busyloop_min(nvq),
+				     (unsigned long)nvq->vq.busyloop_timeout);
+}
+
+/* Polling found nothing, don't burn as much CPU next time. */
+static void vhost_net_busyloop_shrink(struct vhost_net_virtqueue *nvq)
+{
+	unsigned int shrink = READ_ONCE(busyloop_shrink);
+	unsigned long window = shrink ? nvq->busyloop_window / shrink : 0;
+
+	nvq->busyloop_window = max(window, vhost_net_busyloop_min(nvq));
+}
+
 static void vhost_net_busy_poll(struct vhost_net *net,
 				struct vhost_virtqueue *rvq,
 				struct vhost_virtqueue *tvq,
 				bool *busyloop_intr,
 				bool poll_rx)
 {
+	struct vhost_net_virtqueue *nvq = &net->vqs[poll_rx ? VHOST_NET_VQ_RX :
+							    VHOST_NET_VQ_TX];
 	unsigned long busyloop_timeout;
-	unsigned long endtime;
+	unsigned long start, endtime;
 	struct socket *sock;
 	struct vhost_virtqueue *vq = poll_rx ? tvq : rvq;
+	bool hit = false;
 
 	/* Try to hold the vq mutex of the paired virtqueue. We can't
 	 * use mutex_lock() here since we could not guarantee a
@@ -526,26 +634,39 @@ static void vhost_net_busy_poll(struct vhost_net *net,
 	vhost_disable_notify(&net->dev, vq);
 	sock = vhost_vq_get_backend(rvq);
 
-	busyloop_timeout = poll_rx ? rvq->busyloop_timeout:
-				     tvq->busyloop_timeout;
+	busyloop_timeout = vhost_net_busyloop_window(nvq);
 
 	preempt_disable();
-	endtime = busy_clock() + busyloop_timeout;
+	start = busy_clock();
+	endtime = start + busyloop_timeout;
 
 	while (vhost_can_busy_poll(endtime)) {
-		if (vhost_has_work(&net->dev)) {
+		if (vhost_vq_has_work(poll_rx ? rvq : tvq)) {
 			*busyloop_intr = true;
 			break;
 		}
 
 		if ((sock_has_rx_data(sock) &&
 		     !vhost_vq_avail_empty(&net->dev, rvq)) ||
-		    !vhost_vq_avail_empty(&net->dev, tvq))
+		    !vhost_vq_avail_empty(&net->dev, tvq)) {
+			hit = true;
 			break;
+		}
 
 		cpu_relax();
 	}
 
+	if (hit) {
+		nvq->busyloop_hits++;
+		if (busyloop_grow &&
+		    busy_clock() - start > busyloop_timeout / 2)
+			vhost_net_busyloop_grow(nvq);
+	} else if (time_after(busy_clock(), endtime)) {
+		nvq->busyloop_misses++;
+		if (busyloop_grow)
+			vhost_net_busyloop_shrink(nvq);
+	}
+
 	preempt_enable();
 
 	if (poll_rx || sock_has_rx_data(sock))
@@ -589,8 +710,13 @@ static bool vhost_exceeds_maxpend(struct vhost_net *net)
 	struct vhost_net_virtqueue *nvq = &net->vqs[VHOST_NET_VQ_TX];
 	struct vhost_virtqueue *vq = &nvq->vq;
 
-	return (nvq->upend_idx + UIO_MAXIOV - nvq->done_idx) % UIO_MAXIOV >
-	       min_t(unsigned int, VHOST_MAX_PEND, vq->num >> 2);
+	/*
+	 * Slots between done_idx and upend_idx can't be reused until all DMAs
+	 * before them are done, even if they were returned to the guest.
+	 */
+	return nvq->zcopy_pend >
+	       min_t(unsigned int, VHOST_MAX_PEND, vq->num >> 2) ||
+	       (nvq->upend_idx + 1) % UIO_MAXIOV == nvq->done_idx;
 }
 
 static size_t init_iov_iter(struct vhost_virtqueue *vq, struct iov_iter *iter,
@@ -911,6 +1037,7 @@ static void handle_tx_zerocopy(struct vhost_net *net, struct socket *sock)
 			ubufs = nvq->ubufs;
 			atomic_inc(&ubufs->refcount);
 			nvq->upend_idx = (nvq->upend_idx + 1) % UIO_MAXIOV;
+			++nvq->zcopy_pend;
 		} else {
 			msg.msg_control = NULL;
 			ubufs = NULL;
@@ -930,6 +1057,7 @@ static void handle_tx_zerocopy(struct vhost_net *net, struct socket *sock)
 				vhost_net_ubuf_put(ubufs);
 				nvq->upend_idx = ((unsigned)nvq->upend_idx - 1)
 					% UIO_MAXIOV;
+				--nvq->zcopy_pend;
 			}
 			vhost_discard_vq_desc(vq, 1);
 			vhost_net_enable_vq(net, vq);
@@ -995,6 +1123,119 @@ static int peek_head_len(struct vhost_net_virtqueue *rvq, struct sock *sk)
 	return len;
 }
 
+static int vhost_net_rx_fixup(struct vhost_virtqueue *vq,
+			      struct vhost_net_rx_pkt *pkt, size_t vhost_hlen)
+{
+	struct virtio_net_hdr hdr = {
+		.flags = 0,
+		.gso_type = VIRTIO_NET_HDR_GSO_NONE
+	};
+	__virtio16 num_buffers;
+
+	/* Supply virtio_net_hdr if VHOST_NET_F_VIRTIO_NET_HDR */
+	if (unlikely(vhost_hlen)) {
+		if (copy_to_iter(&hdr, sizeof(hdr),
+				 &pkt->fixup) != sizeof(hdr)) {
+			vq_err(vq, "Unable to write vnet_hdr at addr %p\n",
+			       pkt->iov->iov_base);
+			return -EFAULT;
+		}
+	} else {
+		/* Header came from socket; we'll need to patch
+		 * ->num_buffers over if VIRTIO_NET_F_MRG_RXBUF
+		 */
+		iov_iter_advance(&pkt->fixup, sizeof(hdr));
+	}
+	/* TODO: Should check and handle checksum. */
+
+	num_buffers = cpu_to_vhost16(vq, pkt->headcount);
+	if (likely(vhost_has_feature(vq, VIRTIO_NET_F_MRG_RXBUF)) &&
+	    copy_to_iter(&num_buffers, sizeof(num_buffers),
+			 &pkt->fixup) != sizeof(num_buffers)) {
+		vq_err(vq, "Failed num_buffers write");
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+/*
+ * Receive the batched RX packets and queue their heads to be added to the used
+ * ring. tun and tap receive the whole batch with one recvmsg call, other
+ * sockets never batch more than one packet. When a packet can't be received,
+ * it is discarded along with the packets after it, as their descriptors can
+ * only be given back in order.
+ */
+static int vhost_net_rx_flush(struct vhost_net_virtqueue *nvq,
+			      struct socket *sock)
+{
+	struct vhost_virtqueue *vq = &nvq->vq;
+	struct tun_msg_ctl ctl = {
+		.type = TUN_MSG_PTR,
+		.num = nvq->batched_rx,
+		.ptr = nvq->rx_msgs,
+	};
+	struct msghdr msg = {
+		.msg_name = NULL,
+		.msg_namelen = 0,
+		.msg_control = &ctl,
+		.msg_controllen = sizeof(ctl),
+		.msg_flags = MSG_DONTWAIT,
+	};
+	struct vhost_net_rx_pkt *pkt;
+	int i, n = nvq->batched_rx;
+	int discard = 0, err = 0;
+
+	if (!n)
+		return 0;
+
+	nvq->batched_rx = 0;
+	nvq->batched_rx_heads = 0;
+	nvq->batched_rx_iovs = 0;
+
+	if (nvq->rx_ring) {
+		sock->ops->recvmsg(sock, &msg, 0, MSG_DONTWAIT | MSG_TRUNC);
+	} else {
+		msg.msg_control = NULL; /* FIXME: get and handle RX aux data. */
+		msg.msg_controllen = 0;
+		msg.msg_iter = nvq->rx_msgs[0].iter;
+		nvq->rx_msgs[0].len = sock->ops->recvmsg(sock, &msg,
+							 nvq->rx_pkts[0].sock_len,
+							 MSG_DONTWAIT | MSG_TRUNC);
+	}
+
+	for (i = 0; i < n; i++) {
+		pkt = &nvq->rx_pkts[i];
+
+		/* Userspace might have consumed the packet meanwhile:
+		 * it's not supposed to do this usually, but might be hard
+		 * to prevent. Discard data we got (if any) and keep going.
+		 */
+		if (unlikely(nvq->rx_msgs[i].len != pkt->sock_len)) {
+			pr_debug("Discarded rx packet: len %d, expected %zd\n",
+				 nvq->rx_msgs[i].len, pkt->sock_len);
+			break;
+		}
+
+		err = vhost_net_rx_fixup(vq, pkt, nvq->vhost_hlen);
+		if (unlikely(err))
+			break;
+
+		nvq->done_idx += pkt->headcount;
+		if (unlikely(pkt->log))
+			vhost_log_write(vq, pkt->log, pkt->log_num,
+					pkt->vhost_len, pkt->iov, pkt->in);
+	}
+
+	if (unlikely(i < n)) {
+		for (; i < n; i++)
+			discard += nvq->rx_pkts[i].headcount;
+		vhost_discard_vq_desc(vq, discard);
+	}
+
+	return err;
+}
+
 static int vhost_net_rx_peek_head_len(struct vhost_net *net, struct sock *sk,
 				      bool *busyloop_intr)
 {
@@ -1005,7 +1246,8 @@ static int vhost_net_rx_peek_head_len(struct vhost_net *net, struct sock *sk,
 	int len = peek_head_len(rnvq, sk);
 
 	if (!len && rvq->busyloop_timeout) {
-		/* Flush batched heads first */
+		/* Flush batched packets and heads first */
+		vhost_net_rx_flush(rnvq, vhost_vq_get_backend(rvq));
 		vhost_net_signal_used(rnvq);
 		/* Both tx vq and rx socket were polled here */
 		vhost_net_busy_poll(net, rvq, tvq, busyloop_intr, true);
@@ -1028,6 +1270,8 @@ static int vhost_net_rx_peek_head_len(struct vhost_net *net, struct sock *sk,
  */
 static int get_rx_bufs(struct vhost_virtqueue *vq,
 		       struct vring_used_elem *heads,
+		       struct iovec *iov,
+		       unsigned int iov_size,
 		       int datalen,
 		       unsigned *iovcount,
 		       struct vhost_log *log,
@@ -1045,12 +1289,11 @@ static int get_rx_bufs(struct vhost_virtqueue *vq,
 	u32 len;
 
 	while (datalen > 0 && headcount < quota) {
-		if (unlikely(seg >= UIO_MAXIOV)) {
+		if (unlikely(seg >= iov_size)) {
 			r = -ENOBUFS;
 			goto err;
 		}
-		r = vhost_get_vq_desc(vq, vq->iov + seg,
-				      ARRAY_SIZE(vq->iov) - seg, &out,
+		r = vhost_get_vq_desc(vq, iov + seg, iov_size - seg, &out,
 				      &in, log, log_num);
 		if (unlikely(r < 0))
 			goto err;
@@ -1071,7 +1314,7 @@ static int get_rx_bufs(struct vhost_virtqueue *vq,
 			log += *log_num;
 		}
 		heads[headcount].id = cpu_to_vhost32(vq, d);
-		len = iov_length(vq->iov + seg, in);
+		len = iov_length(iov + seg, in);
 		heads[headcount].len = cpu_to_vhost32(vq, len);
 		datalen -= len;
 		++headcount;
@@ -1099,7 +1342,6 @@ static void handle_rx(struct vhost_net *net)
 {
 	struct vhost_net_virtqueue *nvq = &net->vqs[VHOST_NET_VQ_RX];
 	struct vhost_virtqueue *vq = &nvq->vq;
-	unsigned in, log;
 	struct vhost_log *vq_log;
 	struct msghdr msg = {
 		.msg_name = NULL,
@@ -1108,20 +1350,17 @@ static void handle_rx(struct vhost_net *net)
 		.msg_controllen = 0,
 		.msg_flags = MSG_DONTWAIT,
 	};
-	struct virtio_net_hdr hdr = {
-		.flags = 0,
-		.gso_type = VIRTIO_NET_HDR_GSO_NONE
-	};
 	size_t total_len = 0;
 	int err, mergeable;
 	s16 headcount;
 	size_t vhost_hlen, sock_hlen;
 	size_t vhost_len, sock_len;
 	bool busyloop_intr = false;
+	struct vhost_net_rx_pkt *pkt;
+	struct tun_msg_rx *rx;
 	struct socket *sock;
-	struct iov_iter fixup;
-	__virtio16 num_buffers;
 	int recv_pkts = 0;
+	void *ptr;
 
 	mutex_lock_nested(&vq->mutex, VHOST_NET_VQ_RX);
 	sock = vhost_vq_get_backend(vq);
@@ -1148,9 +1387,22 @@ static void handle_rx(struct vhost_net *net)
 			break;
 		sock_len += sock_hlen;
 		vhost_len = sock_len + vhost_hlen;
-		headcount = get_rx_bufs(vq, vq->heads + nvq->done_idx,
-					vhost_len, &in, vq_log, &log,
+		pkt = &nvq->rx_pkts[nvq->batched_rx];
+		pkt->iov = vq->iov + nvq->batched_rx_iovs;
+		pkt->log = vq_log ? vq_log + nvq->batched_rx_iovs : NULL;
+		headcount = get_rx_bufs(vq, vq->heads + nvq->done_idx +
+					    nvq->batched_rx_heads,
+					pkt->iov,
+					UIO_MAXIOV - nvq->batched_rx_iovs,
+					vhost_len, &pkt->in, pkt->log,
+					&pkt->log_num,
 					likely(mergeable) ? UIO_MAXIOV : 1);
+		/* Out of iovecs with a batch pending: receive it and retry. */
+		if (unlikely(headcount == -ENOBUFS && nvq->batched_rx)) {
+			if (vhost_net_rx_flush(nvq, sock))
+				goto out;
+			continue;
+		}
 		/* On error, stop handling until the next kick. */
 		if (unlikely(headcount < 0))
 			goto out;
@@ -1169,66 +1421,44 @@ static void handle_rx(struct vhost_net *net)
 			goto out;
 		}
 		busyloop_intr = false;
-		if (nvq->rx_ring)
-			msg.msg_control = vhost_net_buf_consume(&nvq->rxq);
+		ptr = nvq->rx_ring ? vhost_net_buf_consume(&nvq->rxq) : NULL;
 		/* On overrun, truncate and discard */
 		if (unlikely(headcount > UIO_MAXIOV)) {
-			iov_iter_init(&msg.msg_iter, READ, vq->iov, 1, 1);
+			msg.msg_control = ptr;
+			iov_iter_init(&msg.msg_iter, READ, pkt->iov, 1, 1);
 			err = sock->ops->recvmsg(sock, &msg,
 						 1, MSG_DONTWAIT | MSG_TRUNC);
 			pr_debug("Discarded rx packet: len %zd\n", sock_len);
 			continue;
 		}
 		/* We don't need to be notified again. */
-		iov_iter_init(&msg.msg_iter, READ, vq->iov, in, vhost_len);
-		fixup = msg.msg_iter;
+		rx = &nvq->rx_msgs[nvq->batched_rx];
+		rx->ptr = ptr;
+		iov_iter_init(&rx->iter, READ, pkt->iov, pkt->in, vhost_len);
+		pkt->fixup = rx->iter;
 		if (unlikely((vhost_hlen))) {
 			/* We will supply the header ourselves
 			 * TODO: support TSO.
 			 */
-			iov_iter_advance(&msg.msg_iter, vhost_hlen);
+			iov_iter_advance(&rx->iter, vhost_hlen);
 		}
-		err = sock->ops->recvmsg(sock, &msg,
-					 sock_len, MSG_DONTWAIT | MSG_TRUNC);
-		/* Userspace might have consumed the packet meanwhile:
-		 * it's not supposed to do this usually, but might be hard
-		 * to prevent. Discard data we got (if any) and keep going. */
-		if (unlikely(err != sock_len)) {
-			pr_debug("Discarded rx packet: "
-				 " len %d, expected %zd\n", err, sock_len);
-			vhost_discard_vq_desc(vq, headcount);
-			continue;
-		}
-		/* Supply virtio_net_hdr if VHOST_NET_F_VIRTIO_NET_HDR */
-		if (unlikely(vhost_hlen)) {
-			if (copy_to_iter(&hdr, sizeof(hdr),
-					 &fixup) != sizeof(hdr)) {
-				vq_err(vq, "Unable to write vnet_hdr "
-				       "at addr %p\n", vq->iov->iov_base);
+		pkt->sock_len = sock_len;
+		pkt->vhost_len = vhost_len;
+		pkt->headcount = headcount;
+
+		nvq->batched_rx++;
+		nvq->batched_rx_heads += headcount;
+		nvq->batched_rx_iovs += pkt->in;
+
+		/* Keep enough iovecs free for the next packet of the batch */
+		if (!nvq->rx_ring || nvq->batched_rx == VHOST_NET_BATCH ||
+		    nvq->batched_rx_iovs > UIO_MAXIOV / 2 ||
+		    nvq->done_idx + nvq->batched_rx_heads > VHOST_NET_BATCH) {
+			if (vhost_net_rx_flush(nvq, sock))
 				goto out;
-			}
-		} else {
-			/* Header came from socket; we'll need to patch
-			 * ->num_buffers over if VIRTIO_NET_F_MRG_RXBUF
-			 */
-			iov_iter_advance(&fixup, sizeof(hdr));
-		}
-		/* TODO: Should check and handle checksum. */
-
-		num_buffers = cpu_to_vhost16(vq, headcount);
-		if (likely(mergeable) &&
-		    copy_to_iter(&num_buffers, sizeof num_buffers,
-				 &fixup) != sizeof num_buffers) {
-			vq_err(vq, "Failed num_buffers write");
-			vhost_discard_vq_desc(vq, headcount);
-			goto out;
+			if (nvq->done_idx > VHOST_NET_BATCH)
+				vhost_net_signal_used(nvq);
 		}
-		nvq->done_idx += headcount;
-		if (nvq->done_idx > VHOST_NET_BATCH)
-			vhost_net_signal_used(nvq);
-		if (unlikely(vq_log))
-			vhost_log_write(vq, vq_log, log, vhost_len,
-					vq->iov, in);
 		total_len += vhost_len;
 	} while (likely(!vhost_exceeds_weight(vq, ++recv_pkts, total_len)));
 
@@ -1237,6 +1467,7 @@ static void handle_rx(struct vhost_net *net)
 	else if (!sock_len)
 		vhost_net_enable_vq(net, vq);
 out:
+	vhost_net_rx_flush(nvq, sock);
 	vhost_net_signal_used(nvq);
 	mutex_unlock(&vq->mutex);
 }
@@ -1280,6 +1511,8 @@ static int vhost_net_open(struct inode *inode, struct file *f)
 	struct vhost_virtqueue **vqs;
 	void **queue;
 	struct xdp_buff *xdp;
+	struct vhost_net_rx_pkt *rx_pkts;
+	struct tun_msg_rx *rx_msgs;
 	int i;
 
 	n = kvmalloc(sizeof *n, GFP_KERNEL | __GFP_RETRY_MAYFAIL);
@@ -1309,6 +1542,20 @@ static int vhost_net_open(struct inode *inode, struct file *f)
 	}
 	n->vqs[VHOST_NET_VQ_TX].xdp = xdp;
 
+	rx_pkts = kmalloc_array(VHOST_NET_BATCH, sizeof(*rx_pkts), GFP_KERNEL);
+	rx_msgs = kmalloc_array(VHOST_NET_BATCH, sizeof(*rx_msgs), GFP_KERNEL);
+	if (!rx_pkts || !rx_msgs) {
+		kfree(rx_msgs);
+		kfree(rx_pkts);
+		kfree(xdp);
+		kfree(vqs);
+		kvfree(n);
+		kfree(queue);
+		return -ENOMEM;
+	}
+	n->vqs[VHOST_NET_VQ_RX].rx_pkts = rx_pkts;
+	n->vqs[VHOST_NET_VQ_RX].rx_msgs = rx_msgs;
+
 	dev = &n->dev;
 	vqs[VHOST_NET_VQ_TX] = &n->vqs[VHOST_NET_VQ_TX].vq;
 	vqs[VHOST_NET_VQ_RX] = &n->vqs[VHOST_NET_VQ_RX].vq;
@@ -1319,10 +1566,17 @@ static int vhost_net_open(struct inode *inode, struct file *f)
 		n->vqs[i].ubuf_info = NULL;
 		n->vqs[i].upend_idx = 0;
 		n->vqs[i].done_idx = 0;
+		n->vqs[i].zcopy_pend = 0;
 		n->vqs[i].batched_xdp = 0;
+		n->vqs[i].batched_rx = 0;
+		n->vqs[i].batched_rx_heads = 0;
+		n->vqs[i].batched_rx_iovs = 0;
 		n->vqs[i].vhost_hlen = 0;
 		n->vqs[i].sock_hlen = 0;
 		n->vqs[i].rx_ring = NULL;
+		n->vqs[i].busyloop_window = 0;
+		n->vqs[i].busyloop_hits = 0;
+		n->vqs[i].busyloop_misses = 0;
 		vhost_net_buf_init(&n->vqs[i].rxq);
 	}
 	vhost_dev_init(dev, vqs, VHOST_NET_VQ_MAX,
@@ -1330,8 +1584,10 @@ static int vhost_net_open(struct inode *inode, struct file *f)
 		       VHOST_NET_PKT_WEIGHT, VHOST_NET_WEIGHT, true,
 		       NULL);
 
-	vhost_poll_init(n->poll + VHOST_NET_VQ_TX, handle_tx_net, EPOLLOUT, dev);
-	vhost_poll_init(n->poll + VHOST_NET_VQ_RX, handle_rx_net, EPOLLIN, dev);
+	vhost_poll_init(n->poll + VHOST_NET_VQ_TX, handle_tx_net, EPOLLOUT, dev,
+			vqs[VHOST_NET_VQ_TX]);
+	vhost_poll_init(n->poll + VHOST_NET_VQ_RX, handle_rx_net, EPOLLIN, dev,
+			vqs[VHOST_NET_VQ_RX]);
 
 	f->private_data = n;
 	n->page_frag.page = NULL;
@@ -1409,6 +1665,8 @@ static int vhost_net_release(struct inode *inode, struct file *f)
 	vhost_net_flush(n);
 	kfree(n->vqs[VHOST_NET_VQ_RX].rxq.queue);
 	kfree(n->vqs[VHOST_NET_VQ_TX].xdp);
+	kfree(n->vqs[VHOST_NET_VQ_RX].rx_pkts);
+	kfree(n->vqs[VHOST_NET_VQ_RX].rx_msgs);
 	kfree(n->dev.vqs);
 	if (n->page_frag.page)
 		__page_frag_cache_drain(n->page_frag.page, n->refcnt_bias);
@@ -1761,8 +2019,36 @@ static __poll_t vhost_net_chr_poll(struct file *file, poll_table *wait)
 	return vhost_chr_poll(file, dev, wait);
 }
 
+#ifdef CONFIG_PROC_FS
+static void vhost_net_show_fdinfo(struct seq_file *m, struct file *f)
+{
+	struct vhost_net *n = f->private_data;
+	static const char * const names[] = { "rx", "tx" };
+	struct vhost_net_virtqueue *nvq;
+	int i;
+
+	for (i = 0; i < VHOST_NET_VQ_MAX; i++) {
+		nvq = &n->vqs[i];
+		mutex_lock(&nvq->vq.mutex);
+		seq_printf(m, "%s-busyloop-timeout: %u\n", names[i],
+			   nvq->vq.busyloop_timeout);
+		seq_printf(m, "%s-busyloop-window: %lu\n", names[i],
+			   nvq->vq.busyloop_timeout ?
+			   vhost_net_busyloop_window(nvq) : 0);
+		seq_printf(m, "%s-busyloop-hits: %llu\n", names[i],
+			   nvq->busyloop_hits);
+		seq_printf(m, "%s-busyloop-misses: %llu\n", names[i],
+			   nvq->busyloop_misses);
+		mutex_unlock(&nvq->vq.mutex);
+	}
+}
+#endif
+
 static const struct file_operations vhost_net_fops = {
 	.owner          = THIS_MODULE,
+#ifdef CONFIG_PROC_FS
+	.show_fdinfo	= vhost_net_show_fdinfo,
+#endif
 	.release        = vhost_net_release,
 	.read_iter      = vhost_net_chr_read_iter,
 	.write_iter     = vhost_net_chr_write_iter,
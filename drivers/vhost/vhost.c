@@ -37,10 +37,10 @@ static ushort max_mem_regions = 64;
 module_param(max_mem_regions, ushort, 0444);
 MODULE_PARM_DESC(max_mem_regions,
 	"Maximum number of memory regions in memory map. (default: 64)");
-static int max_iotlb_entries = 2048;
+static int max_iotlb_entries = 8192;
 module_param(max_iotlb_entries, int, 0444);
 MODULE_PARM_DESC(max_iotlb_entries,
-	"Maximum number of iotlb entries. (default: 2048)");
+	"Maximum number of iotlb entries. (default: 8192)");
 
 enum {
 	VHOST_MEMORY_F_LOG = 0x1,
@@ -187,12 +187,14 @@ EXPORT_SYMBOL_GPL(vhost_work_init);
 
 /* Init poll structure */
 void vhost_poll_init(struct vhost_poll *poll, vhost_work_fn_t fn,
-		     __poll_t mask, struct vhost_dev *dev)
+		     __poll_t mask, struct vhost_dev *dev,
+		     struct vhost_virtqueue *vq)
 {
 	init_waitqueue_func_entry(&poll->wait, vhost_poll_wakeup);
 	init_poll_funcptr(&poll->table, vhost_poll_func);
 	poll->mask = mask;
 	poll->dev = dev;
+	poll->vq = vq;
 	poll->wqh = NULL;
 
 	vhost_work_init(&poll->work, fn);
@@ -231,17 +233,38 @@ void vhost_poll_stop(struct vhost_poll *poll)
 }
 EXPORT_SYMBOL_GPL(vhost_poll_stop);
 
-void vhost_work_flush(struct vhost_dev *dev, struct vhost_work *work)
+static void vhost_worker_queue(struct vhost_worker *worker,
+			       struct vhost_work *work)
+{
+	if (!test_and_set_bit(VHOST_WORK_QUEUED, &work->flags)) {
+		/* We can only add the work to the list after we're
+		 * sure it was not in the list.
+		 * test_and_set_bit() implies a memory barrier.
+		 */
+		llist_add(&work->node, &worker->work_list);
+		wake_up_process(worker->task);
+	}
+}
+
+static void vhost_worker_flush(struct vhost_worker *worker)
 {
 	struct vhost_flush_struct flush;
 
-	if (dev->worker) {
-		init_completion(&flush.wait_event);
-		vhost_work_init(&flush.work, vhost_flush_work);
+	init_completion(&flush.wait_event);
+	vhost_work_init(&flush.work, vhost_flush_work);
 
-		vhost_work_queue(dev, &flush.work);
-		wait_for_completion(&flush.wait_event);
-	}
+	vhost_worker_queue(worker, &flush.work);
+	wait_for_completion(&flush.wait_event);
+}
+
+/* Flush all the workers of the device, as @work may be queued on any of them. */
+void vhost_work_flush(struct vhost_dev *dev, struct vhost_work *work)
+{
+	struct vhost_worker *worker;
+	unsigned long i;
+
+	xa_for_each(&dev->worker_xa, i, worker)
+		vhost_worker_flush(worker);
 }
 EXPORT_SYMBOL_GPL(vhost_work_flush);
 
@@ -253,32 +276,58 @@ void vhost_poll_flush(struct vhost_poll *poll)
 }
 EXPORT_SYMBOL_GPL(vhost_poll_flush);
 
+/* Queue @work on the default worker of the device. */
 void vhost_work_queue(struct vhost_dev *dev, struct vhost_work *work)
 {
 	if (!dev->worker)
 		return;
 
-	if (!test_and_set_bit(VHOST_WORK_QUEUED, &work->flags)) {
-		/* We can only add the work to the list after we're
-		 * sure it was not in the list.
-		 * test_and_set_bit() implies a memory barrier.
-		 */
-		llist_add(&work->node, &dev->work_list);
-		wake_up_process(dev->worker);
-	}
+	vhost_worker_queue(dev->worker, work);
 }
 EXPORT_SYMBOL_GPL(vhost_work_queue);
 
+/* Queue @work on the worker @vq is bound to. */
+void vhost_vq_work_queue(struct vhost_virtqueue *vq, struct vhost_work *work)
+{
+	struct vhost_worker *worker;
+
+	rcu_read_lock();
+	worker = rcu_dereference(vq->worker);
+	if (worker)
+		vhost_worker_queue(worker, work);
+	rcu_read_unlock();
+}
+EXPORT_SYMBOL_GPL(vhost_vq_work_queue);
+
 /* A lockless hint for busy polling code to exit the loop */
 bool vhost_has_work(struct vhost_dev *dev)
 {
-	return !llist_empty(&dev->work_list);
+	return dev->worker && !llist_empty(&dev->worker->work_list);
 }
 EXPORT_SYMBOL_GPL(vhost_has_work);
 
+/* Same as vhost_has_work(), for the worker @vq is bound to. */
+bool vhost_vq_has_work(struct vhost_virtqueue *vq)
+{
+	struct vhost_worker *worker;
+	bool has_work = false;
+
+	rcu_read_lock();
+	worker = rcu_dereference(vq->worker);
+	if (worker)
+		has_work = !llist_empty(&worker->work_list);
+	rcu_read_unlock();
+
+	return has_work;
+}
+EXPORT_SYMBOL_GPL(vhost_vq_has_work);
+
 void vhost_poll_queue(struct vhost_poll *poll)
 {
-	vhost_work_queue(poll->dev, &poll->work);
+	if (poll->vq)
+		vhost_vq_work_queue(poll->vq, &poll->work);
+	else
+		vhost_work_queue(poll->dev, &poll->work);
 }
 EXPORT_SYMBOL_GPL(vhost_poll_queue);
 
@@ -288,6 +337,7 @@ static void __vhost_vq_meta_reset(struct vhost_virtqueue *vq)
 
 	for (j = 0; j < VHOST_NUM_ADDRS; j++)
 		vq->meta_iotlb[j] = NULL;
+	vq->iotlb_last = NULL;
 }
 
 static void vhost_vq_meta_reset(struct vhost_dev *d)
@@ -314,6 +364,9 @@ static void vhost_vq_reset(struct vhost_dev *dev,
 	vq->last_avail_idx = 0;
 	vq->avail_idx = 0;
 	vq->last_used_idx = 0;
+	vq->last_avail_wrap_counter = true;
+	vq->last_used_wrap_counter = true;
+	vq->packed_fetched = 0;
 	vq->signalled_used = 0;
 	vq->signalled_used_valid = false;
 	vq->used_flags = 0;
@@ -331,13 +384,15 @@ static void vhost_vq_reset(struct vhost_dev *dev,
 	vq->busyloop_timeout = 0;
 	vq->umem = NULL;
 	vq->iotlb = NULL;
+	RCU_INIT_POINTER(vq->worker, NULL);
 	vhost_vring_call_reset(&vq->call_ctx);
 	__vhost_vq_meta_reset(vq);
 }
 
 static int vhost_worker(void *data)
 {
-	struct vhost_dev *dev = data;
+	struct vhost_worker *worker = data;
+	struct vhost_dev *dev = worker->dev;
 	struct vhost_work *work, *work_next;
 	struct llist_node *node;
 
@@ -352,7 +407,7 @@ static int vhost_worker(void *data)
 			break;
 		}
 
-		node = llist_del_all(&dev->work_list);
+		node = llist_del_all(&worker->work_list);
 		if (!node)
 			schedule();
 
@@ -375,6 +430,8 @@ static int vhost_worker(void *data)
 
 static void vhost_vq_free_iovecs(struct vhost_virtqueue *vq)
 {
+	kfree(vq->packed_counts);
+	vq->packed_counts = NULL;
 	kfree(vq->indirect);
 	vq->indirect = NULL;
 	kfree(vq->log);
@@ -438,6 +495,9 @@ static size_t vhost_get_avail_size(struct vhost_virtqueue *vq,
 	size_t event __maybe_unused =
 	       vhost_has_feature(vq, VIRTIO_RING_F_EVENT_IDX) ? 2 : 0;
 
+	if (vhost_vq_is_packed(vq))
+		return sizeof(*vq->driver_event);
+
 	return sizeof(*vq->avail) +
 	       sizeof(*vq->avail->ring) * num + event;
 }
@@ -448,6 +508,9 @@ static size_t vhost_get_used_size(struct vhost_virtqueue *vq,
 	size_t event __maybe_unused =
 	       vhost_has_feature(vq, VIRTIO_RING_F_EVENT_IDX) ? 2 : 0;
 
+	if (vhost_vq_is_packed(vq))
+		return sizeof(*vq->device_event);
+
 	return sizeof(*vq->used) +
 	       sizeof(*vq->used->ring) * num + event;
 }
@@ -455,6 +518,9 @@ static size_t vhost_get_used_size(struct vhost_virtqueue *vq,
 static size_t vhost_get_desc_size(struct vhost_virtqueue *vq,
 				  unsigned int num)
 {
+	if (vhost_vq_is_packed(vq))
+		return sizeof(*vq->desc_packed) * num;
+
 	return sizeof(*vq->desc) * num;
 }
 
@@ -476,12 +542,12 @@ void vhost_dev_init(struct vhost_dev *dev,
 	dev->iotlb = NULL;
 	dev->mm = NULL;
 	dev->worker = NULL;
+	xa_init_flags(&dev->worker_xa, XA_FLAGS_ALLOC);
 	dev->iov_limit = iov_limit;
 	dev->weight = weight;
 	dev->byte_weight = byte_weight;
 	dev->use_worker = use_worker;
 	dev->msg_handler = msg_handler;
-	init_llist_head(&dev->work_list);
 	init_waitqueue_head(&dev->wait);
 	INIT_LIST_HEAD(&dev->read_list);
 	INIT_LIST_HEAD(&dev->pending_list);
@@ -493,12 +559,13 @@ void vhost_dev_init(struct vhost_dev *dev,
 		vq->log = NULL;
 		vq->indirect = NULL;
 		vq->heads = NULL;
+		vq->packed_counts = NULL;
 		vq->dev = dev;
 		mutex_init(&vq->mutex);
 		vhost_vq_reset(dev, vq);
 		if (vq->handle_kick)
 			vhost_poll_init(&vq->poll, vq->handle_kick,
-					EPOLLIN, dev);
+					EPOLLIN, dev, vq);
 	}
 }
 EXPORT_SYMBOL_GPL(vhost_dev_init);
@@ -525,14 +592,14 @@ static void vhost_attach_cgroups_work(struct vhost_work *work)
 	s->ret = cgroup_attach_task_all(s->owner, current);
 }
 
-static int vhost_attach_cgroups(struct vhost_dev *dev)
+static int vhost_attach_cgroups(struct vhost_worker *worker)
 {
 	struct vhost_attach_cgroups_struct attach;
 
 	attach.owner = current;
 	vhost_work_init(&attach.work, vhost_attach_cgroups_work);
-	vhost_work_queue(dev, &attach.work);
-	vhost_work_flush(dev, &attach.work);
+	vhost_worker_queue(worker, &attach.work);
+	vhost_worker_flush(worker);
 	return attach.ret;
 }
 
@@ -573,11 +640,199 @@ static void vhost_detach_mm(struct vhost_dev *dev)
 	dev->mm = NULL;
 }
 
+static void vhost_worker_destroy(struct vhost_dev *dev,
+				 struct vhost_worker *worker)
+{
+	WARN_ON(!llist_empty(&worker->work_list));
+	xa_erase(&dev->worker_xa, worker->id);
+	kthread_stop(worker->task);
+	kfree(worker);
+}
+
+static void vhost_workers_free(struct vhost_dev *dev)
+{
+	struct vhost_worker *worker;
+	unsigned long i;
+
+	xa_for_each(&dev->worker_xa, i, worker)
+		vhost_worker_destroy(dev, worker);
+	xa_destroy(&dev->worker_xa);
+	dev->worker = NULL;
+}
+
+/*
+ * Create a worker running in the cgroups of the owner. If @cpu is not -1, the
+ * worker is bound to @cpu, which the owner must be allowed to run on.
+ */
+static struct vhost_worker *vhost_worker_create(struct vhost_dev *dev, int cpu)
+{
+	struct vhost_worker *worker;
+	struct task_struct *task;
+	u32 id;
+	int ret;
+
+	if (cpu != -1 &&
+	    (cpu < 0 || cpu >= nr_cpu_ids || !cpu_online(cpu) ||
+	     !cpumask_test_cpu(cpu, current->cpus_ptr)))
+		return ERR_PTR(-EINVAL);
+
+	worker = kzalloc(sizeof(*worker), GFP_KERNEL_ACCOUNT);
+	if (!worker)
+		return ERR_PTR(-ENOMEM);
+
+	worker->dev = dev;
+	init_llist_head(&worker->work_list);
+
+	task = kthread_create(vhost_worker, worker, "vhost-%d", current->pid);
+	if (IS_ERR(task)) {
+		ret = PTR_ERR(task);
+		goto free_worker;
+	}
+	worker->task = task;
+	wake_up_process(task); /* avoid contributing to loadavg */
+
+	ret = xa_alloc(&dev->worker_xa, &id, worker, xa_limit_32b, GFP_KERNEL);
+	if (ret < 0)
+		goto stop_worker;
+	worker->id = id;
+
+	ret = vhost_attach_cgroups(worker);
+	if (ret)
+		goto erase_worker;
+
+	/* Attaching to a cpuset resets the affinity, so set it afterwards. */
+	if (cpu != -1) {
+		ret = set_cpus_allowed_ptr(task, cpumask_of(cpu));
+		if (ret)
+			goto erase_worker;
+	}
+
+	return worker;
+
+erase_worker:
+	xa_erase(&dev->worker_xa, id);
+stop_worker:
+	kthread_stop(task);
+free_worker:
+	kfree(worker);
+	return ERR_PTR(ret);
+}
+
+/* Caller must have device mutex */
+static void vhost_vq_attach_worker(struct vhost_virtqueue *vq,
+				   struct vhost_worker *worker)
+{
+	struct vhost_worker *old_worker;
+
+	mutex_lock(&vq->mutex);
+	old_worker = rcu_dereference_protected(vq->worker,
+					       lockdep_is_held(&vq->mutex));
+	rcu_assign_pointer(vq->worker, worker);
+	worker->attachment_cnt++;
+	mutex_unlock(&vq->mutex);
+
+	if (!old_worker)
+		return;
+
+	old_worker->attachment_cnt--;
+
+	/*
+	 * Wait for the work queued on the old worker before the switch to run,
+	 * so that none of the work of @vq is left behind when it is freed. The
+	 * handlers of @vq take vq->mutex, so the two workers never run them
+	 * concurrently.
+	 */
+	synchronize_rcu();
+	vhost_worker_flush(old_worker);
+}
+
+/* Caller must have device mutex */
+static int vhost_new_worker(struct vhost_dev *dev, void __user *argp)
+{
+	struct vhost_worker_state state;
+	struct vhost_worker *worker;
+
+	if (!dev->use_worker)
+		return -EOPNOTSUPP;
+
+	if (copy_from_user(&state, argp, sizeof(state)))
+		return -EFAULT;
+
+	worker = vhost_worker_create(dev, state.cpu);
+	if (IS_ERR(worker))
+		return PTR_ERR(worker);
+
+	state.worker_id = worker->id;
+	if (copy_to_user(argp, &state, sizeof(state))) {
+		vhost_worker_destroy(dev, worker);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+/* Caller must have device mutex */
+static int vhost_free_worker(struct vhost_dev *dev, void __user *argp)
+{
+	struct vhost_worker_state state;
+	struct vhost_worker *worker;
+
+	if (copy_from_user(&state, argp, sizeof(state)))
+		return -EFAULT;
+
+	worker = xa_load(&dev->worker_xa, state.worker_id);
+	if (!worker)
+		return -ENODEV;
+
+	if (worker == dev->worker || worker->attachment_cnt)
+		return -EBUSY;
+
+	vhost_worker_destroy(dev, worker);
+	return 0;
+}
+
+/* Caller must have device mutex */
+static long vhost_vring_worker_ioctl(struct vhost_dev *dev,
+				     struct vhost_virtqueue *vq,
+				     unsigned int ioctl, void __user *argp)
+{
+	struct vhost_vring_worker w;
+	struct vhost_worker *worker;
+
+	if (!dev->use_worker)
+		return -EOPNOTSUPP;
+
+	if (copy_from_user(&w, argp, sizeof(w)))
+		return -EFAULT;
+
+	switch (ioctl) {
+	case VHOST_ATTACH_VRING_WORKER:
+		worker = xa_load(&dev->worker_xa, w.worker_id);
+		if (!worker)
+			return -ENODEV;
+
+		vhost_vq_attach_worker(vq, worker);
+		return 0;
+	case VHOST_GET_VRING_WORKER:
+		worker = rcu_dereference_protected(vq->worker,
+						   lockdep_is_held(&dev->mutex));
+		if (!worker)
+			return -ENODEV;
+
+		w.worker_id = worker->id;
+		if (copy_to_user(argp, &w, sizeof(w)))
+			return -EFAULT;
+		return 0;
+	default:
+		return -ENOIOCTLCMD;
+	}
+}
+
 /* Caller should have device mutex */
 long vhost_dev_set_owner(struct vhost_dev *dev)
 {
-	struct task_struct *worker;
-	int err;
+	struct vhost_worker *worker;
+	int err, i;
 
 	/* Is there an owner already? */
 	if (vhost_dev_has_owner(dev)) {
@@ -589,31 +844,24 @@ long vhost_dev_set_owner(struct vhost_dev *dev)
 
 	dev->kcov_handle = kcov_common_handle();
 	if (dev->use_worker) {
-		worker = kthread_create(vhost_worker, dev,
-					"vhost-%d", current->pid);
+		worker = vhost_worker_create(dev, -1);
 		if (IS_ERR(worker)) {
 			err = PTR_ERR(worker);
 			goto err_worker;
 		}
 
 		dev->worker = worker;
-		wake_up_process(worker); /* avoid contributing to loadavg */
-
-		err = vhost_attach_cgroups(dev);
-		if (err)
-			goto err_cgroup;
+		for (i = 0; i < dev->nvqs; i++)
+			vhost_vq_attach_worker(dev->vqs[i], worker);
 	}
 
 	err = vhost_dev_alloc_iovecs(dev);
 	if (err)
-		goto err_cgroup;
+		goto err_iovecs;
 
 	return 0;
-err_cgroup:
-	if (dev->worker) {
-		kthread_stop(dev->worker);
-		dev->worker = NULL;
-	}
+err_iovecs:
+	vhost_workers_free(dev);
 err_worker:
 	vhost_detach_mm(dev);
 	dev->kcov_handle = 0;
@@ -706,12 +954,8 @@ void vhost_dev_cleanup(struct vhost_dev *dev)
 	dev->iotlb = NULL;
 	vhost_clear_msg(dev);
 	wake_up_interruptible_poll(&dev->wait, EPOLLIN | EPOLLRDNORM);
-	WARN_ON(!llist_empty(&dev->work_list));
-	if (dev->worker) {
-		kthread_stop(dev->worker);
-		dev->worker = NULL;
-		dev->kcov_handle = 0;
-	}
+	vhost_workers_free(dev);
+	dev->kcov_handle = 0;
 	vhost_detach_mm(dev);
 }
 EXPORT_SYMBOL_GPL(vhost_dev_cleanup);
@@ -920,7 +1164,7 @@ static inline void __user *__vhost_get_user(struct vhost_virtqueue *vq,
 	return __vhost_get_user_slow(vq, addr, size, type);
 }
 
-#define vhost_put_user(vq, x, ptr)		\
+#define vhost_put_user(vq, x, ptr, type)		\
 ({ \
 	int ret; \
 	if (!vq->iotlb) { \
@@ -928,7 +1172,7 @@ static inline void __user *__vhost_get_user(struct vhost_virtqueue *vq,
 	} else { \
 		__typeof__(ptr) to = \
 			(__typeof__(ptr)) __vhost_get_user(vq, ptr,	\
-					  sizeof(*ptr), VHOST_ADDR_USED); \
+					  sizeof(*ptr), type); \
 		if (to != NULL) \
 			ret = __put_user(x, to); \
 		else \
@@ -940,7 +1184,7 @@ static inline void __user *__vhost_get_user(struct vhost_virtqueue *vq,
 static inline int vhost_put_avail_event(struct vhost_virtqueue *vq)
 {
 	return vhost_put_user(vq, cpu_to_vhost16(vq, vq->avail_idx),
-			      vhost_avail_event(vq));
+			      vhost_avail_event(vq), VHOST_ADDR_USED);
 }
 
 static inline int vhost_put_used(struct vhost_virtqueue *vq,
@@ -955,14 +1199,14 @@ static inline int vhost_put_used_flags(struct vhost_virtqueue *vq)
 
 {
 	return vhost_put_user(vq, cpu_to_vhost16(vq, vq->used_flags),
-			      &vq->used->flags);
+			      &vq->used->flags, VHOST_ADDR_USED);
 }
 
 static inline int vhost_put_used_idx(struct vhost_virtqueue *vq)
 
 {
 	return vhost_put_user(vq, cpu_to_vhost16(vq, vq->last_used_idx),
-			      &vq->used->idx);
+			      &vq->used->idx, VHOST_ADDR_USED);
 }
 
 #define vhost_get_user(vq, x, ptr, type)		\
@@ -1040,6 +1284,27 @@ static inline int vhost_get_desc(struct vhost_virtqueue *vq,
 	return vhost_copy_from_user(vq, desc, vq->desc + idx, sizeof(*desc));
 }
 
+static inline int vhost_get_desc_packed(struct vhost_virtqueue *vq,
+					struct vring_packed_desc *desc, int idx)
+{
+	return vhost_copy_from_user(vq, desc, vq->desc_packed + idx,
+				    sizeof(*desc));
+}
+
+static inline int vhost_get_desc_flags_packed(struct vhost_virtqueue *vq,
+					      __le16 *flags, int idx)
+{
+	return vhost_get_user(vq, *flags, &vq->desc_packed[idx].flags,
+			      VHOST_ADDR_DESC);
+}
+
+static inline int vhost_get_driver_event(struct vhost_virtqueue *vq,
+					 struct vring_packed_desc_event *event)
+{
+	return vhost_copy_from_user(vq, event, vq->driver_event,
+				    sizeof(*event));
+}
+
 static void vhost_iotlb_notify_vq(struct vhost_dev *d,
 				  struct vhost_iotlb_msg *msg)
 {
@@ -1249,6 +1514,7 @@ ssize_t vhost_chr_read_iter(struct vhost_dev *dev, struct iov_iter *to,
 			kfree(node);
 			return ret;
 		}
+		node->queued = jiffies;
 		vhost_enqueue_msg(dev, &dev->pending_list, node);
 	}
 
@@ -1256,13 +1522,65 @@ ssize_t vhost_chr_read_iter(struct vhost_dev *dev, struct iov_iter *to,
 }
 EXPORT_SYMBOL_GPL(vhost_chr_read_iter);
 
-static int vhost_iotlb_miss(struct vhost_virtqueue *vq, u64 iova, int access)
+/*
+ * Userspace doesn't answer a miss it can't resolve, and may answer with an
+ * update that doesn't cover the address of the miss, so a miss it has read
+ * stops suppressing new ones after a while.
+ */
+#define VHOST_IOTLB_MISS_TIMEOUT	(HZ / 10)
+
+/* Is a recent miss of @vq covering @iova still unanswered by userspace? */
+static bool vhost_iotlb_miss_pending(struct vhost_virtqueue *vq, u64 iova,
+				     int access)
+{
+	struct list_head *lists[] = { &vq->dev->read_list,
+				      &vq->dev->pending_list };
+	struct vhost_dev *dev = vq->dev;
+	struct vhost_iotlb_msg *msg;
+	struct vhost_msg_node *node;
+	bool pending = false;
+	int i;
+
+	spin_lock(&dev->iotlb_lock);
+	for (i = 0; i < ARRAY_SIZE(lists) && !pending; i++) {
+		list_for_each_entry(node, lists[i], node) {
+			if (lists[i] == &dev->pending_list &&
+			    time_after(jiffies,
+				       node->queued + VHOST_IOTLB_MISS_TIMEOUT))
+				continue;
+
+			/* The iotlb message is at the same offset in v1 and v2. */
+			msg = &node->msg.iotlb;
+			if (node->vq == vq && msg->type == VHOST_IOTLB_MISS &&
+			    (msg->perm & access) == access &&
+			    iova >= msg->iova &&
+			    iova - msg->iova < max_t(u64, msg->size, 1)) {
+				pending = true;
+				break;
+			}
+		}
+	}
+	spin_unlock(&dev->iotlb_lock);
+
+	return pending;
+}
+
+/*
+ * Request the translation of [iova, iova + size - 1] from userspace. The size
+ * is only a hint, userspace may answer with a smaller or larger mapping.
+ */
+static int vhost_iotlb_miss(struct vhost_virtqueue *vq, u64 iova, u64 size,
+			    int access)
 {
 	struct vhost_dev *dev = vq->dev;
 	struct vhost_msg_node *node;
 	struct vhost_iotlb_msg *msg;
 	bool v2 = vhost_backend_has_feature(vq, VHOST_BACKEND_F_IOTLB_MSG_V2);
 
+	/* Don't send the same miss again while waiting for its update. */
+	if (vhost_iotlb_miss_pending(vq, iova, access))
+		return 0;
+
 	node = vhost_new_msg(vq, v2 ? VHOST_IOTLB_MSG_V2 : VHOST_IOTLB_MSG);
 	if (!node)
 		return -ENOMEM;
@@ -1276,6 +1594,7 @@ static int vhost_iotlb_miss(struct vhost_virtqueue *vq, u64 iova, int access)
 
 	msg->type = VHOST_IOTLB_MISS;
 	msg->iova = iova;
+	msg->size = size;
 	msg->perm = access;
 
 	vhost_enqueue_msg(dev, &dev->read_list, node);
@@ -1283,6 +1602,34 @@ static int vhost_iotlb_miss(struct vhost_virtqueue *vq, u64 iova, int access)
 	return 0;
 }
 
+/*
+ * Report all the unmapped parts of [addr, last] at once, so that a ring or
+ * buffer spanning several IOTLB entries is resolved in one round trip to
+ * userspace, instead of one per entry.
+ */
+static void vhost_iotlb_miss_range(struct vhost_virtqueue *vq, u64 addr,
+				   u64 last, int access)
+{
+	const struct vhost_iotlb_map *map;
+	u64 hole_last;
+
+	for (;;) {
+		map = vhost_iotlb_itree_first(vq->dev->iotlb, addr, last);
+		if (map && map->start <= addr) {
+			if (map->last >= last)
+				return;
+			addr = map->last + 1;
+			continue;
+		}
+
+		hole_last = map ? map->start - 1 : last;
+		if (vhost_iotlb_miss(vq, addr, hole_last - addr + 1, access) ||
+		    hole_last == last)
+			return;
+		addr = hole_last + 1;
+	}
+}
+
 static bool vq_access_ok(struct vhost_virtqueue *vq, unsigned int num,
 			 vring_desc_t __user *desc,
 			 vring_avail_t __user *avail,
@@ -1306,7 +1653,11 @@ static void vhost_vq_meta_update(struct vhost_virtqueue *vq,
 	int access = (type == VHOST_ADDR_USED) ?
 		     VHOST_ACCESS_WO : VHOST_ACCESS_RO;
 
-	if (likely(map->perm & access))
+	/* Used descriptors are written to the packed descriptor ring. */
+	if (type == VHOST_ADDR_DESC && vhost_vq_is_packed(vq))
+		access = VHOST_ACCESS_RW;
+
+	if (likely((map->perm & access) == access))
 		vq->meta_iotlb[type] = map;
 }
 
@@ -1323,9 +1674,9 @@ static bool iotlb_access_ok(struct vhost_virtqueue *vq,
 	while (len > s) {
 		map = vhost_iotlb_itree_first(umem, addr, last);
 		if (map == NULL || map->start > addr) {
-			vhost_iotlb_miss(vq, addr, access);
+			vhost_iotlb_miss_range(vq, addr, last, access);
 			return false;
-		} else if (!(map->perm & access)) {
+		} else if ((map->perm & access) != access) {
 			/* Report the possible access violation by
 			 * request another translation from userspace.
 			 */
@@ -1347,11 +1698,12 @@ static bool iotlb_access_ok(struct vhost_virtqueue *vq,
 int vq_meta_prefetch(struct vhost_virtqueue *vq)
 {
 	unsigned int num = vq->num;
+	int desc_access = vhost_vq_is_packed(vq) ? VHOST_MAP_RW : VHOST_MAP_RO;
 
 	if (!vq->iotlb)
 		return 1;
 
-	return iotlb_access_ok(vq, VHOST_MAP_RO, (u64)(uintptr_t)vq->desc,
+	return iotlb_access_ok(vq, desc_access, (u64)(uintptr_t)vq->desc,
 			       vhost_get_desc_size(vq, num), VHOST_ADDR_DESC) &&
 	       iotlb_access_ok(vq, VHOST_MAP_RO, (u64)(uintptr_t)vq->avail,
 			       vhost_get_avail_size(vq, num),
@@ -1594,6 +1946,11 @@ long vhost_vring_ioctl(struct vhost_dev *d, unsigned int ioctl, void __user *arg
 		return vhost_vring_set_num_addr(d, vq, ioctl, argp);
 	}
 
+	/* Switching workers flushes the old one, which may need vq->mutex. */
+	if (ioctl == VHOST_ATTACH_VRING_WORKER ||
+	    ioctl == VHOST_GET_VRING_WORKER)
+		return vhost_vring_worker_ioctl(d, vq, ioctl, argp);
+
 	mutex_lock(&vq->mutex);
 
 	switch (ioctl) {
@@ -1608,6 +1965,24 @@ long vhost_vring_ioctl(struct vhost_dev *d, unsigned int ioctl, void __user *arg
 			r = -EFAULT;
 			break;
 		}
+		/*
+		 * For packed rings, bits 0-14 hold the last avail index, bit 15
+		 * the avail wrap counter, bits 16-30 the last used index and bit
+		 * 31 the used wrap counter.
+		 */
+		if (vhost_vq_is_packed(vq)) {
+			/* Both indices are used to index desc_packed. */
+			if ((s.num & 0x7fff) >= vq->num ||
+			    ((s.num >> 16) & 0x7fff) >= vq->num) {
+				r = -EINVAL;
+				break;
+			}
+			vq->last_avail_idx = s.num & 0x7fff;
+			vq->last_avail_wrap_counter = !!(s.num & BIT(15));
+			vq->last_used_idx = (s.num >> 16) & 0x7fff;
+			vq->last_used_wrap_counter = !!(s.num & BIT(31));
+			break;
+		}
 		if (s.num > 0xffff) {
 			r = -EINVAL;
 			break;
@@ -1618,7 +1993,13 @@ long vhost_vring_ioctl(struct vhost_dev *d, unsigned int ioctl, void __user *arg
 		break;
 	case VHOST_GET_VRING_BASE:
 		s.index = idx;
-		s.num = vq->last_avail_idx;
+		if (vhost_vq_is_packed(vq))
+			s.num = vq->last_avail_idx |
+				vq->last_avail_wrap_counter << 15 |
+				vq->last_used_idx << 16 |
+				(u32)vq->last_used_wrap_counter << 31;
+		else
+			s.num = vq->last_avail_idx;
 		if (copy_to_user(argp, &s, sizeof s))
 			r = -EFAULT;
 		break;
@@ -1795,6 +2176,12 @@ long vhost_dev_ioctl(struct vhost_dev *d, unsigned int ioctl, void __user *argp)
 		if (ctx)
 			eventfd_ctx_put(ctx);
 		break;
+	case VHOST_NEW_WORKER:
+		r = vhost_new_worker(d, argp);
+		break;
+	case VHOST_FREE_WORKER:
+		r = vhost_free_worker(d, argp);
+		break;
 	default:
 		r = -ENOIOCTLCMD;
 		break;
@@ -1892,16 +2279,17 @@ static int log_write_hva(struct vhost_virtqueue *vq, u64 hva, u64 len)
 	return 0;
 }
 
-static int log_used(struct vhost_virtqueue *vq, u64 used_offset, u64 len)
+/* Log a write to the rings, by its userspace (or IOTLB) address. */
+static int log_ring(struct vhost_virtqueue *vq, void __user *addr, u64 len)
 {
 	struct iovec *iov = vq->log_iov;
 	int i, ret;
 
 	if (!vq->iotlb)
-		return log_write(vq->log_base, vq->log_addr + used_offset, len);
+		return log_write_hva(vq, (uintptr_t)addr, len);
 
-	ret = translate_desc(vq, (uintptr_t)vq->used + used_offset,
-			     len, iov, 64, VHOST_ACCESS_WO);
+	ret = translate_desc(vq, (uintptr_t)addr, len, iov, 64,
+			     VHOST_ACCESS_WO);
 	if (ret < 0)
 		return ret;
 
@@ -1915,6 +2303,14 @@ static int log_used(struct vhost_virtqueue *vq, u64 used_offset, u64 len)
 	return 0;
 }
 
+static int log_used(struct vhost_virtqueue *vq, u64 used_offset, u64 len)
+{
+	if (!vq->iotlb)
+		return log_write(vq->log_base, vq->log_addr + used_offset, len);
+
+	return log_ring(vq, (void __user *)vq->used + used_offset, len);
+}
+
 int vhost_log_write(struct vhost_virtqueue *vq, struct vhost_log *log,
 		    unsigned int log_num, u64 len, struct iovec *iov, int count)
 {
@@ -1951,9 +2347,52 @@ int vhost_log_write(struct vhost_virtqueue *vq, struct vhost_log *log,
 }
 EXPORT_SYMBOL_GPL(vhost_log_write);
 
+/*
+ * The device event suppression structure of a packed ring is written both to
+ * enable or disable notifications, based on VRING_USED_F_NO_NOTIFY in
+ * vq->used_flags, and to move the event offset with VIRTIO_RING_F_EVENT_IDX.
+ */
+static int vhost_update_device_event(struct vhost_virtqueue *vq)
+{
+	__le16 flags, off_wrap;
+
+	if (vq->used_flags & VRING_USED_F_NO_NOTIFY) {
+		flags = cpu_to_le16(VRING_PACKED_EVENT_FLAG_DISABLE);
+	} else if (vhost_has_feature(vq, VIRTIO_RING_F_EVENT_IDX)) {
+		off_wrap = cpu_to_le16(vq->last_avail_idx |
+				       vq->last_avail_wrap_counter <<
+				       VRING_PACKED_EVENT_F_WRAP_CTR);
+		if (vhost_put_user(vq, off_wrap, &vq->device_event->off_wrap,
+				   VHOST_ADDR_USED))
+			return -EFAULT;
+		/* Make sure the offset is seen before the flags. */
+		smp_wmb();
+		flags = cpu_to_le16(VRING_PACKED_EVENT_FLAG_DESC);
+	} else {
+		flags = cpu_to_le16(VRING_PACKED_EVENT_FLAG_ENABLE);
+	}
+
+	if (vhost_put_user(vq, flags, &vq->device_event->flags,
+			   VHOST_ADDR_USED))
+		return -EFAULT;
+
+	if (unlikely(vq->log_used)) {
+		/* Make sure the event is seen before log. */
+		smp_wmb();
+		log_ring(vq, vq->device_event, sizeof(*vq->device_event));
+		if (vq->log_ctx)
+			eventfd_signal(vq->log_ctx, 1);
+	}
+	return 0;
+}
+
 static int vhost_update_used_flags(struct vhost_virtqueue *vq)
 {
 	void __user *used;
+
+	if (vhost_vq_is_packed(vq))
+		return vhost_update_device_event(vq);
+
 	if (vhost_put_used_flags(vq))
 		return -EFAULT;
 	if (unlikely(vq->log_used)) {
@@ -1998,10 +2437,32 @@ int vhost_vq_init_access(struct vhost_virtqueue *vq)
 
 	vhost_init_is_le(vq);
 
+	if (vhost_vq_is_packed(vq)) {
+		/* The wrap counters take bit 15 of the ring indexes. */
+		if (!vhost_has_feature(vq, VIRTIO_F_VERSION_1) ||
+		    vq->num > 0x8000) {
+			r = -EINVAL;
+			goto err;
+		}
+
+		kfree(vq->packed_counts);
+		vq->packed_counts = kmalloc_array(vq->num,
+						  sizeof(*vq->packed_counts),
+						  GFP_KERNEL);
+		if (!vq->packed_counts) {
+			r = -ENOMEM;
+			goto err;
+		}
+		vq->packed_fetched = 0;
+	}
+
 	r = vhost_update_used_flags(vq);
 	if (r)
 		goto err;
 	vq->signalled_used_valid = false;
+	/* The last used index of a packed ring is set by VHOST_SET_VRING_BASE */
+	if (vhost_vq_is_packed(vq))
+		return 0;
 	if (!vq->iotlb &&
 	    !access_ok(&vq->used->idx, sizeof vq->used->idx)) {
 		r = -EFAULT;
@@ -2028,8 +2489,8 @@ static int translate_desc(struct vhost_virtqueue *vq, u64 addr, u32 len,
 	const struct vhost_iotlb_map *map;
 	struct vhost_dev *dev = vq->dev;
 	struct vhost_iotlb *umem = dev->iotlb ? dev->iotlb : dev->umem;
+	u64 s = 0, last = addr + len - 1;
 	struct iovec *_iov;
-	u64 s = 0;
 	int ret = 0;
 
 	while ((u64)len > s) {
@@ -2039,7 +2500,17 @@ static int translate_desc(struct vhost_virtqueue *vq, u64 addr, u32 len,
 			break;
 		}
 
-		map = vhost_iotlb_itree_first(umem, addr, addr + len - 1);
+		/*
+		 * Buffers tend to be close to each other, so try the entry of
+		 * the last translation before looking up the IOTLB.
+		 */
+		map = vq->iotlb_last;
+		if (!map || umem != dev->iotlb ||
+		    addr < map->start || addr > map->last) {
+			map = vhost_iotlb_itree_first(umem, addr, last);
+			if (map && umem == dev->iotlb)
+				vq->iotlb_last = map;
+		}
 		if (map == NULL || map->start > addr) {
 			if (umem != dev->iotlb) {
 				ret = -EFAULT;
@@ -2063,7 +2534,7 @@ static int translate_desc(struct vhost_virtqueue *vq, u64 addr, u32 len,
 	}
 
 	if (ret == -EAGAIN)
-		vhost_iotlb_miss(vq, addr, access);
+		vhost_iotlb_miss_range(vq, addr, last, access);
 	return ret;
 }
 
@@ -2176,6 +2647,212 @@ static int get_indirect(struct vhost_virtqueue *vq,
 	return 0;
 }
 
+static bool vhost_desc_is_avail_packed(struct vhost_virtqueue *vq, u16 flags)
+{
+	bool avail = flags & BIT(VRING_PACKED_DESC_F_AVAIL);
+	bool used = flags & BIT(VRING_PACKED_DESC_F_USED);
+
+	return avail == vq->last_avail_wrap_counter &&
+	       used != vq->last_avail_wrap_counter;
+}
+
+/* Return 1 if the next descriptor of a packed ring is available, 0 if it's
+ * not, or -EFAULT. */
+static int vhost_vq_avail_packed(struct vhost_virtqueue *vq)
+{
+	__le16 flags;
+
+	if (unlikely(vhost_get_desc_flags_packed(vq, &flags,
+						 vq->last_avail_idx))) {
+		vq_err(vq, "Failed to get descriptor flags: idx %d addr %p\n",
+		       vq->last_avail_idx,
+		       &vq->desc_packed[vq->last_avail_idx].flags);
+		return -EFAULT;
+	}
+
+	return vhost_desc_is_avail_packed(vq, le16_to_cpu(flags));
+}
+
+/* Translate a descriptor of a packed ring, or of its indirect table. */
+static int vhost_translate_desc_packed(struct vhost_virtqueue *vq,
+				       struct vring_packed_desc *desc,
+				       struct iovec iov[], unsigned int iov_size,
+				       unsigned int *out_num,
+				       unsigned int *in_num,
+				       struct vhost_log *log,
+				       unsigned int *log_num)
+{
+	unsigned int iov_count = *in_num + *out_num;
+	int ret, access;
+
+	if (le16_to_cpu(desc->flags) & VRING_DESC_F_WRITE)
+		access = VHOST_ACCESS_WO;
+	else
+		access = VHOST_ACCESS_RO;
+
+	ret = translate_desc(vq, le64_to_cpu(desc->addr),
+			     le32_to_cpu(desc->len), iov + iov_count,
+			     iov_size - iov_count, access);
+	if (unlikely(ret < 0)) {
+		if (ret != -EAGAIN)
+			vq_err(vq, "Translation failure %d in packed descriptor\n",
+			       ret);
+		return ret;
+	}
+
+	if (access == VHOST_ACCESS_WO) {
+		/* If this is an input descriptor, increment that count. */
+		*in_num += ret;
+		if (unlikely(log && ret)) {
+			log[*log_num].addr = le64_to_cpu(desc->addr);
+			log[*log_num].len = le32_to_cpu(desc->len);
+			++*log_num;
+		}
+	} else {
+		/* If it's an output descriptor, they're all supposed
+		 * to come before any input descriptors. */
+		if (unlikely(*in_num)) {
+			vq_err(vq, "Packed descriptor has out after in\n");
+			return -EINVAL;
+		}
+		*out_num += ret;
+	}
+
+	return 0;
+}
+
+/* The indirect table of a packed ring is an array of packed descriptors, which
+ * are not chained with VRING_DESC_F_NEXT. */
+static int get_indirect_packed(struct vhost_virtqueue *vq,
+			       struct iovec iov[], unsigned int iov_size,
+			       unsigned int *out_num, unsigned int *in_num,
+			       struct vhost_log *log, unsigned int *log_num,
+			       struct vring_packed_desc *indirect)
+{
+	struct vring_packed_desc desc;
+	u32 len = le32_to_cpu(indirect->len);
+	unsigned int i, count;
+	struct iov_iter from;
+	int ret;
+
+	if (unlikely(!len || len % sizeof(desc))) {
+		vq_err(vq, "Invalid length in indirect descriptor: len 0x%x\n",
+		       len);
+		return -EINVAL;
+	}
+
+	ret = translate_desc(vq, le64_to_cpu(indirect->addr), len,
+			     vq->indirect, UIO_MAXIOV, VHOST_ACCESS_RO);
+	if (unlikely(ret < 0)) {
+		if (ret != -EAGAIN)
+			vq_err(vq, "Translation failure %d in indirect.\n", ret);
+		return ret;
+	}
+	iov_iter_init(&from, READ, vq->indirect, ret, len);
+	count = len / sizeof(desc);
+
+	for (i = 0; i < count; i++) {
+		if (unlikely(!copy_from_iter_full(&desc, sizeof(desc), &from))) {
+			vq_err(vq, "Failed indirect descriptor: idx %d\n", i);
+			return -EINVAL;
+		}
+		if (unlikely(le16_to_cpu(desc.flags) & VRING_DESC_F_INDIRECT)) {
+			vq_err(vq, "Nested indirect descriptor: idx %d\n", i);
+			return -EINVAL;
+		}
+
+		ret = vhost_translate_desc_packed(vq, &desc, iov, iov_size,
+						  out_num, in_num, log,
+						  log_num);
+		if (unlikely(ret < 0))
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Packed ring version of vhost_get_vq_desc(). A used descriptor has to skip
+ * all the descriptors of its chain, so their number is returned in the upper
+ * bits of the head, along with the buffer id in the lower 16 bits. The head is
+ * an opaque value for the drivers, which pass it back to vhost_add_used(). It
+ * is always larger than vq->num.
+ */
+static int vhost_get_vq_desc_packed(struct vhost_virtqueue *vq,
+				    struct iovec iov[], unsigned int iov_size,
+				    unsigned int *out_num,
+				    unsigned int *in_num,
+				    struct vhost_log *log,
+				    unsigned int *log_num)
+{
+	u16 idx = vq->last_avail_idx;
+	bool wrap = vq->last_avail_wrap_counter;
+	struct vring_packed_desc desc;
+	unsigned int count = 0;
+	u16 flags;
+	int ret;
+
+	ret = vhost_vq_avail_packed(vq);
+	if (ret <= 0)
+		return ret ? ret : vq->num;
+
+	/* Only read the descriptors after they have been exposed by guest. */
+	smp_rmb();
+
+	/* When we start there are none of either input nor output. */
+	*out_num = *in_num = 0;
+	if (unlikely(log))
+		*log_num = 0;
+
+	do {
+		if (unlikely(++count > vq->num || count > 0x7fff)) {
+			vq_err(vq, "Descriptor chain too long: idx %u\n",
+			       vq->last_avail_idx);
+			return -EINVAL;
+		}
+		ret = vhost_get_desc_packed(vq, &desc, idx);
+		if (unlikely(ret)) {
+			vq_err(vq, "Failed to get descriptor: idx %d addr %p\n",
+			       idx, vq->desc_packed + idx);
+			return -EFAULT;
+		}
+		flags = le16_to_cpu(desc.flags);
+
+		if (flags & VRING_DESC_F_INDIRECT) {
+			if (unlikely(flags & VRING_DESC_F_NEXT)) {
+				vq_err(vq, "Chained indirect descriptor: idx %d\n",
+				       idx);
+				return -EINVAL;
+			}
+			ret = get_indirect_packed(vq, iov, iov_size, out_num,
+						  in_num, log, log_num, &desc);
+		} else {
+			ret = vhost_translate_desc_packed(vq, &desc, iov,
+							  iov_size, out_num,
+							  in_num, log, log_num);
+		}
+		if (unlikely(ret < 0))
+			return ret;
+
+		if (++idx >= vq->num) {
+			idx = 0;
+			wrap = !wrap;
+		}
+	} while (flags & VRING_DESC_F_NEXT);
+
+	/* On success, move past the chain. */
+	vq->last_avail_idx = idx;
+	vq->last_avail_wrap_counter = wrap;
+	vq->packed_counts[vq->packed_fetched++ & (vq->num - 1)] = count;
+
+	/* Assume notifications from guest are disabled at this point,
+	 * if they aren't we would need to update the event offset. */
+	BUG_ON(!(vq->used_flags & VRING_USED_F_NO_NOTIFY));
+
+	/* The buffer id is in the last descriptor of the chain. */
+	return le16_to_cpu(desc.id) | count << 16;
+}
+
 /* This looks in the virtqueue and for the first available buffer, and converts
  * it to an iovec for convenient access.  Since descriptors consist of some
  * number of output then some number of input descriptors, it's actually two
@@ -2196,6 +2873,10 @@ int vhost_get_vq_desc(struct vhost_virtqueue *vq,
 	__virtio16 ring_head;
 	int ret, access;
 
+	if (vhost_vq_is_packed(vq))
+		return vhost_get_vq_desc_packed(vq, iov, iov_size, out_num,
+						in_num, log, log_num);
+
 	/* Check it isn't doing very strange things with descriptor numbers. */
 	last_avail_idx = vq->last_avail_idx;
 
@@ -2328,7 +3009,21 @@ EXPORT_SYMBOL_GPL(vhost_get_vq_desc);
 /* Reverse the effect of vhost_get_vq_desc. Useful for error handling. */
 void vhost_discard_vq_desc(struct vhost_virtqueue *vq, int n)
 {
-	vq->last_avail_idx -= n;
+	u16 count;
+
+	if (!vhost_vq_is_packed(vq)) {
+		vq->last_avail_idx -= n;
+		return;
+	}
+
+	while (n--) {
+		count = vq->packed_counts[--vq->packed_fetched & (vq->num - 1)];
+		if (vq->last_avail_idx < count) {
+			vq->last_avail_idx += vq->num;
+			vq->last_avail_wrap_counter = !vq->last_avail_wrap_counter;
+		}
+		vq->last_avail_idx -= count;
+	}
 }
 EXPORT_SYMBOL_GPL(vhost_discard_vq_desc);
 
@@ -2377,6 +3072,93 @@ static int __vhost_add_used_n(struct vhost_virtqueue *vq,
 	return 0;
 }
 
+static u16 vhost_used_flags_packed(bool wrap)
+{
+	return wrap ? BIT(VRING_PACKED_DESC_F_AVAIL) |
+		      BIT(VRING_PACKED_DESC_F_USED) : 0;
+}
+
+/*
+ * Write a used descriptor for each head, in the first descriptor of its chain.
+ * The flags of the first used descriptor are written last, so that the driver
+ * sees the whole batch at once.
+ */
+static int vhost_add_used_n_packed(struct vhost_virtqueue *vq,
+				   struct vring_used_elem *heads,
+				   unsigned int count)
+{
+	struct vring_packed_desc __user *desc;
+	u16 first = vq->last_used_idx;
+	u16 idx = first;
+	bool wrap = vq->last_used_wrap_counter;
+	__le16 first_flags = 0;
+	unsigned int i;
+	u32 head;
+
+	for (i = 0; i < count; i++) {
+		head = vhost32_to_cpu(vq, heads[i].id);
+		desc = vq->desc_packed + idx;
+		if (vhost_put_user(vq, (__force __le32)heads[i].len, &desc->len,
+				   VHOST_ADDR_DESC) ||
+		    vhost_put_user(vq, cpu_to_le16(head & 0xffff), &desc->id,
+				   VHOST_ADDR_DESC)) {
+			vq_err(vq, "Failed to write used");
+			return -EFAULT;
+		}
+
+		idx += head >> 16;
+		if (idx >= vq->num) {
+			idx -= vq->num;
+			wrap = !wrap;
+		}
+	}
+
+	/* Make sure buffer ids and lengths are written before the flags. */
+	smp_wmb();
+
+	idx = vq->last_used_idx;
+	wrap = vq->last_used_wrap_counter;
+	for (i = 0; i < count; i++) {
+		desc = vq->desc_packed + idx;
+		if (!i)
+			first_flags = cpu_to_le16(vhost_used_flags_packed(wrap));
+		else if (vhost_put_user(vq,
+					cpu_to_le16(vhost_used_flags_packed(wrap)),
+					&desc->flags, VHOST_ADDR_DESC))
+			goto err;
+
+		if (unlikely(vq->log_used) && i)
+			log_ring(vq, desc, sizeof(*desc));
+
+		idx += vhost32_to_cpu(vq, heads[i].id) >> 16;
+		if (idx >= vq->num) {
+			idx -= vq->num;
+			wrap = !wrap;
+		}
+	}
+
+	if (count && vhost_put_user(vq, first_flags,
+				    &vq->desc_packed[first].flags,
+				    VHOST_ADDR_DESC))
+		goto err;
+
+	vq->last_used_idx = idx;
+	vq->last_used_wrap_counter = wrap;
+
+	if (unlikely(vq->log_used)) {
+		/* Make sure used descriptors are seen before log. */
+		smp_wmb();
+		log_ring(vq, vq->desc_packed + first, sizeof(*vq->desc_packed));
+		if (vq->log_ctx)
+			eventfd_signal(vq->log_ctx, 1);
+	}
+	return 0;
+
+err:
+	vq_err(vq, "Failed to write used flags");
+	return -EFAULT;
+}
+
 /* After we've used one of their buffers, we tell them about it.  We'll then
  * want to notify the guest, using eventfd. */
 int vhost_add_used_n(struct vhost_virtqueue *vq, struct vring_used_elem *heads,
@@ -2384,6 +3166,9 @@ int vhost_add_used_n(struct vhost_virtqueue *vq, struct vring_used_elem *heads,
 {
 	int start, n, r;
 
+	if (vhost_vq_is_packed(vq))
+		return vhost_add_used_n_packed(vq, heads, count);
+
 	start = vq->last_used_idx & (vq->num - 1);
 	n = vq->num - start;
 	if (n < count) {
@@ -2414,6 +3199,56 @@ int vhost_add_used_n(struct vhost_virtqueue *vq, struct vring_used_elem *heads,
 }
 EXPORT_SYMBOL_GPL(vhost_add_used_n);
 
+/*
+ * The signalled used index of a packed ring keeps the used wrap counter in bit
+ * 15, like the offset of the driver event suppression structure.
+ */
+static bool vhost_notify_packed(struct vhost_virtqueue *vq)
+{
+	struct vring_packed_desc_event event;
+	u16 old, new, off, wrap = vq->last_used_wrap_counter;
+	bool v;
+
+	if (vhost_get_driver_event(vq, &event)) {
+		vq_err(vq, "Failed to get driver event");
+		return true;
+	}
+
+	switch (le16_to_cpu(event.flags)) {
+	case VRING_PACKED_EVENT_FLAG_DISABLE:
+		return false;
+	case VRING_PACKED_EVENT_FLAG_DESC:
+		if (vhost_has_feature(vq, VIRTIO_RING_F_EVENT_IDX))
+			break;
+		fallthrough;
+	default:
+		return true;
+	}
+
+	old = vq->signalled_used;
+	v = vq->signalled_used_valid;
+	new = vq->last_used_idx;
+	vq->signalled_used = new | wrap << VRING_PACKED_EVENT_F_WRAP_CTR;
+	vq->signalled_used_valid = true;
+
+	if (unlikely(!v))
+		return true;
+
+	/* Indexes of the previous lap are negative in the current one. */
+	if ((old >> VRING_PACKED_EVENT_F_WRAP_CTR) != wrap)
+		old = (old & 0x7fff) - vq->num;
+	else
+		old &= 0x7fff;
+
+	off = le16_to_cpu(event.off_wrap);
+	if ((off >> VRING_PACKED_EVENT_F_WRAP_CTR) != wrap)
+		off = (off & 0x7fff) - vq->num;
+	else
+		off &= 0x7fff;
+
+	return vring_need_event(off, new, old);
+}
+
 static bool vhost_notify(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 {
 	__u16 old, new;
@@ -2424,6 +3259,9 @@ static bool vhost_notify(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 	 * interrupts. */
 	smp_mb();
 
+	if (vhost_vq_is_packed(vq))
+		return vhost_notify_packed(vq);
+
 	if (vhost_has_feature(vq, VIRTIO_F_NOTIFY_ON_EMPTY) &&
 	    unlikely(vq->avail_idx == vq->last_avail_idx))
 		return true;
@@ -2486,6 +3324,9 @@ bool vhost_vq_avail_empty(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 	__virtio16 avail_idx;
 	int r;
 
+	if (vhost_vq_is_packed(vq))
+		return !vhost_vq_avail_packed(vq);
+
 	if (vq->avail_idx != vq->last_avail_idx)
 		return false;
 
@@ -2507,6 +3348,17 @@ bool vhost_enable_notify(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 	if (!(vq->used_flags & VRING_USED_F_NO_NOTIFY))
 		return false;
 	vq->used_flags &= ~VRING_USED_F_NO_NOTIFY;
+	if (vhost_vq_is_packed(vq)) {
+		r = vhost_update_device_event(vq);
+		if (r) {
+			vq_err(vq, "Failed to enable notification at %p: %d\n",
+			       vq->device_event, r);
+			return false;
+		}
+		/* Make sure the event is written before checking the ring. */
+		smp_mb();
+		return vhost_vq_avail_packed(vq) > 0;
+	}
 	if (!vhost_has_feature(vq, VIRTIO_RING_F_EVENT_IDX)) {
 		r = vhost_update_used_flags(vq);
 		if (r) {
@@ -2544,7 +3396,8 @@ void vhost_disable_notify(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 	if (vq->used_flags & VRING_USED_F_NO_NOTIFY)
 		return;
 	vq->used_flags |= VRING_USED_F_NO_NOTIFY;
-	if (!vhost_has_feature(vq, VIRTIO_RING_F_EVENT_IDX)) {
+	if (vhost_vq_is_packed(vq) ||
+	    !vhost_has_feature(vq, VIRTIO_RING_F_EVENT_IDX)) {
 		r = vhost_update_used_flags(vq);
 		if (r)
 			vq_err(vq, "Failed to disable notification at %p: %d\n",
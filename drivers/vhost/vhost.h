@@ -14,6 +14,7 @@
 #include <linux/atomic.h>
 #include <linux/vhost_iotlb.h>
 #include <linux/irqbypass.h>
+#include <linux/xarray.h>
 
 struct vhost_work;
 typedef void (*vhost_work_fn_t)(struct vhost_work *work);
@@ -25,6 +26,15 @@ struct vhost_work {
 	unsigned long		  flags;
 };
 
+struct vhost_worker {
+	struct task_struct	*task;
+	struct llist_head	work_list;
+	struct vhost_dev	*dev;
+	u32			id;
+	/* Number of virtqueues bound to this worker, protected by dev->mutex */
+	int			attachment_cnt;
+};
+
 /* Poll a file (eventfd or socket) */
 /* Note: there's nothing vhost specific about this structure. */
 struct vhost_poll {
@@ -34,14 +44,18 @@ struct vhost_poll {
 	struct vhost_work	  work;
 	__poll_t		  mask;
 	struct vhost_dev	 *dev;
+	struct vhost_virtqueue	 *vq;
 };
 
 void vhost_work_init(struct vhost_work *work, vhost_work_fn_t fn);
 void vhost_work_queue(struct vhost_dev *dev, struct vhost_work *work);
 bool vhost_has_work(struct vhost_dev *dev);
+void vhost_vq_work_queue(struct vhost_virtqueue *vq, struct vhost_work *work);
+bool vhost_vq_has_work(struct vhost_virtqueue *vq);
 
 void vhost_poll_init(struct vhost_poll *poll, vhost_work_fn_t fn,
-		     __poll_t mask, struct vhost_dev *dev);
+		     __poll_t mask, struct vhost_dev *dev,
+		     struct vhost_virtqueue *vq);
 int vhost_poll_start(struct vhost_poll *poll, struct file *file);
 void vhost_poll_stop(struct vhost_poll *poll);
 void vhost_poll_flush(struct vhost_poll *poll);
@@ -73,10 +87,21 @@ struct vhost_virtqueue {
 	/* The actual ring of buffers. */
 	struct mutex mutex;
 	unsigned int num;
-	vring_desc_t __user *desc;
-	vring_avail_t __user *avail;
-	vring_used_t __user *used;
+	union {
+		vring_desc_t __user *desc;
+		struct vring_packed_desc __user *desc_packed;
+	};
+	union {
+		vring_avail_t __user *avail;
+		struct vring_packed_desc_event __user *driver_event;
+	};
+	union {
+		vring_used_t __user *used;
+		struct vring_packed_desc_event __user *device_event;
+	};
 	const struct vhost_iotlb_map *meta_iotlb[VHOST_NUM_ADDRS];
+	/* IOTLB entry of the last descriptor translation */
+	const struct vhost_iotlb_map *iotlb_last;
 	struct file *kick;
 	struct vhost_vring_call call_ctx;
 	struct eventfd_ctx *error_ctx;
@@ -84,6 +109,9 @@ struct vhost_virtqueue {
 
 	struct vhost_poll poll;
 
+	/* The worker running handle_kick and the polls bound to this vq. */
+	struct vhost_worker __rcu *worker;
+
 	/* The routine to call when the Guest pings us, or timeout. */
 	vhost_work_fn_t handle_kick;
 
@@ -96,6 +124,15 @@ struct vhost_virtqueue {
 	/* Last index we used. */
 	u16 last_used_idx;
 
+	/* Wrap counters of last_avail_idx and last_used_idx (packed ring). */
+	bool last_avail_wrap_counter;
+	bool last_used_wrap_counter;
+
+	/* Number of descriptors of the chains fetched from a packed ring,
+	 * indexed by packed_fetched, for vhost_discard_vq_desc(). */
+	u16 *packed_counts;
+	u16 packed_fetched;
+
 	/* Used flags */
 	u16 used_flags;
 
@@ -141,6 +178,7 @@ struct vhost_msg_node {
   };
   struct vhost_virtqueue *vq;
   struct list_head node;
+  unsigned long queued;	/* jiffies, when read by userspace */
 };
 
 struct vhost_dev {
@@ -149,8 +187,10 @@ struct vhost_dev {
 	struct vhost_virtqueue **vqs;
 	int nvqs;
 	struct eventfd_ctx *log_ctx;
-	struct llist_head work_list;
-	struct task_struct *worker;
+	/* The default worker, created by VHOST_SET_OWNER */
+	struct vhost_worker *worker;
+	/* All workers of the device, indexed by worker id */
+	struct xarray worker_xa;
 	struct vhost_iotlb *umem;
 	struct vhost_iotlb *iotlb;
 	spinlock_t iotlb_lock;
@@ -274,6 +314,11 @@ static inline bool vhost_has_feature(struct vhost_virtqueue *vq, int bit)
 	return vq->acked_features & (1ULL << bit);
 }
 
+static inline bool vhost_vq_is_packed(struct vhost_virtqueue *vq)
+{
+	return vhost_has_feature(vq, VIRTIO_F_RING_PACKED);
+}
+
 static inline bool vhost_backend_has_feature(struct vhost_virtqueue *vq, int bit)
 {
 	return vq->acked_backend_features & (1ULL << bit);
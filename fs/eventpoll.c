@@ -378,6 +378,15 @@ static inline int ep_events_available(struct eventpoll *ep)
 		READ_ONCE(ep->ovflist) != EP_UNACTIVE_PTR;
 }
 
+/*
+ * Tells whether ep_scan_ready_list() is between stealing the ready list and
+ * putting back what it left, which it then hands to the next waiter of ep->wq.
+ */
+static inline bool ep_scan_in_progress(struct eventpoll *ep)
+{
+	return READ_ONCE(ep->ovflist) != EP_UNACTIVE_PTR;
+}
+
 #ifdef CONFIG_NET_RX_BUSY_POLL
 static bool ep_busy_loop_end(void *p, unsigned long start_time)
 {
@@ -397,7 +406,8 @@ static void ep_busy_loop(struct eventpoll *ep, int nonblock)
 	unsigned int napi_id = READ_ONCE(ep->napi_id);
 
 	if ((napi_id >= MIN_NAPI_ID) && net_busy_loop_on())
-		napi_busy_loop(napi_id, nonblock ? NULL : ep_busy_loop_end, ep);
+		napi_busy_loop(napi_id, nonblock ? NULL : ep_busy_loop_end, ep,
+			       false, BUSY_POLL_BUDGET);
 }
 
 static inline void ep_reset_busy_poll_napi_id(struct eventpoll *ep)
@@ -746,6 +756,13 @@ static __poll_t ep_scan_ready_list(struct eventpoll *ep,
 	 */
 	list_splice(&txlist, &ep->rdllist);
 	__pm_relax(ep->ws);
+
+	/*
+	 * The waiters that came while we were scanning went to sleep rather
+	 * than wait for ep->mtx, hand them what we didn't take.
+	 */
+	if (!list_empty(&ep->rdllist) && waitqueue_active(&ep->wq))
+		wake_up(&ep->wq);
 	write_unlock_irq(&ep->lock);
 
 	if (!ep_locked)
@@ -1854,7 +1871,7 @@ static int ep_poll(struct eventpoll *ep, struct epoll_event __user *events,
 		ep_busy_loop(ep, timed_out);
 
 	eavail = ep_events_available(ep);
-	if (eavail)
+	if (eavail && !ep_scan_in_progress(ep))
 		goto send_events;
 
 	/*
@@ -1892,8 +1909,14 @@ static int ep_poll(struct eventpoll *ep, struct epoll_event __user *events,
 		 * is always a race when both lists are empty for short
 		 * period of time although events are pending, so lock is
 		 * important.
+		 *
+		 * While a scan is in progress, the events are those of the
+		 * thread scanning, and queueing on ep->mtx behind it only to
+		 * find an empty list is what makes many threads waiting on
+		 * the same epoll scale badly. Sleep instead, the scan wakes
+		 * us up if it leaves events behind.
 		 */
-		eavail = ep_events_available(ep);
+		eavail = ep_events_available(ep) && !ep_scan_in_progress(ep);
 		if (!eavail) {
 			if (signal_pending(current))
 				res = -EINTR;
@@ -1910,10 +1933,19 @@ static int ep_poll(struct eventpoll *ep, struct epoll_event __user *events,
 			break;
 		}
 
-		/* We were woken up, thus go and try to harvest some events */
-		eavail = 1;
-
-	} while (0);
+		/*
+		 * We were woken up, but that may have been by a callback that
+		 * queued its event on ovflist during a scan.  Do the check
+		 * again under the lock rather than wait for ep->mtx, the scan
+		 * wakes the next waiter if it leaves events behind.
+		 */
+		__set_current_state(TASK_RUNNING);
+		if (!list_empty_careful(&wait.entry)) {
+			write_lock_irq(&ep->lock);
+			__remove_wait_queue(&ep->wq, &wait);
+			write_unlock_irq(&ep->lock);
+		}
+	} while (1);
 
 	__set_current_state(TASK_RUNNING);
 
@@ -18,8 +18,10 @@
  * map_alignment values 4KB and 64KB.
  */
 #define FUSE_DAX_SHIFT	21
-#define FUSE_DAX_SZ	(1 << FUSE_DAX_SHIFT)
-#define FUSE_DAX_PAGES	(FUSE_DAX_SZ / PAGE_SIZE)
+
+/* Largest memory range size, and fewest ranges to use it with */
+#define FUSE_DAX_MAX_SHIFT	30
+#define FUSE_DAX_MIN_RANGES	64
 
 /* Number of ranges reclaimer will try to free in one invocation */
 #define FUSE_DAX_RECLAIM_CHUNK		(10)
@@ -31,6 +33,16 @@
  */
 #define FUSE_DAX_RECLAIM_THRESHOLD	(20)
 
+/*
+ * Larger ranges take fewer FUSE_SETUPMAPPING requests to map large files, and
+ * keep their working set mapped with fewer ranges, but waste more of the
+ * window on small files.
+ */
+static unsigned int dax_range_shift = FUSE_DAX_SHIFT;
+module_param(dax_range_shift, uint, 0444);
+MODULE_PARM_DESC(dax_range_shift,
+		 "log2 of the size of DAX window memory ranges (21-30)");
+
 /** Translation information for file offsets to DAX window offsets */
 struct fuse_dax_mapping {
 	/* Pointer to inode where this memory range is mapped */
@@ -56,6 +68,9 @@ struct fuse_dax_mapping {
 
 	/* reference count when the mapping is used by dax iomap. */
 	refcount_t refcnt;
+
+	/* Used since the reclaimer last looked at it */
+	bool referenced;
 };
 
 /* Per-inode dax map */
@@ -90,6 +105,9 @@ struct fuse_conn_dax {
 	struct list_head free_ranges;
 
 	unsigned long nr_ranges;
+
+	/* log2 of the size of the memory ranges */
+	unsigned int range_shift;
 };
 
 static inline struct fuse_dax_mapping *
@@ -186,7 +204,7 @@ static int fuse_setup_one_mapping(struct inode *inode, unsigned long start_idx,
 	struct fuse_conn_dax *fcd = fm->fc->dax;
 	struct fuse_inode *fi = get_fuse_inode(inode);
 	struct fuse_setupmapping_in inarg;
-	loff_t offset = start_idx << FUSE_DAX_SHIFT;
+	loff_t offset = (loff_t)start_idx << fcd->range_shift;
 	FUSE_ARGS(args);
 	ssize_t err;
 
@@ -197,7 +215,7 @@ static int fuse_setup_one_mapping(struct inode *inode, unsigned long start_idx,
 	inarg.foffset = offset;
 	inarg.fh = -1;
 	inarg.moffset = dmap->window_offset;
-	inarg.len = FUSE_DAX_SZ;
+	inarg.len = dmap->length;
 	inarg.flags |= FUSE_SETUPMAPPING_FLAG_READ;
 	if (writable)
 		inarg.flags |= FUSE_SETUPMAPPING_FLAG_WRITE;
@@ -313,8 +331,8 @@ static void inode_reclaim_dmap_range(struct fuse_conn_dax *fcd,
 	struct fuse_dax_mapping *dmap, *n;
 	int err, num = 0;
 	LIST_HEAD(to_remove);
-	unsigned long start_idx = start >> FUSE_DAX_SHIFT;
-	unsigned long end_idx = end >> FUSE_DAX_SHIFT;
+	unsigned long start_idx = start >> fcd->range_shift;
+	unsigned long end_idx = end >> fcd->range_shift;
 	struct interval_tree_node *node;
 
 	while (1) {
@@ -395,10 +413,11 @@ static void fuse_fill_iomap(struct inode *inode, loff_t pos, loff_t length,
 			    struct iomap *iomap, struct fuse_dax_mapping *dmap,
 			    unsigned int flags)
 {
+	struct fuse_conn_dax *fcd = get_fuse_conn(inode)->dax;
 	loff_t offset, len;
 	loff_t i_size = i_size_read(inode);
 
-	offset = pos - (dmap->itn.start << FUSE_DAX_SHIFT);
+	offset = pos - ((loff_t)dmap->itn.start << fcd->range_shift);
 	len = min(length, dmap->length - offset);
 
 	/* If length is beyond end of file, truncate further */
@@ -418,6 +437,10 @@ static void fuse_fill_iomap(struct inode *inode, loff_t pos, loff_t length,
 		 */
 		refcount_inc(&dmap->refcnt);
 
+		/* Don't dirty the cacheline on every access */
+		if (!READ_ONCE(dmap->referenced))
+			WRITE_ONCE(dmap->referenced, true);
+
 		/* iomap->private should be NULL */
 		WARN_ON_ONCE(iomap->private);
 		iomap->private = dmap;
@@ -437,7 +460,7 @@ static int fuse_setup_new_dax_mapping(struct inode *inode, loff_t pos,
 	struct fuse_dax_mapping *dmap, *alloc_dmap = NULL;
 	int ret;
 	bool writable = flags & IOMAP_WRITE;
-	unsigned long start_idx = pos >> FUSE_DAX_SHIFT;
+	unsigned long start_idx = pos >> fcd->range_shift;
 	struct interval_tree_node *node;
 
 	/*
@@ -483,8 +506,8 @@ static int fuse_setup_new_dax_mapping(struct inode *inode, loff_t pos,
 	}
 
 	/* Setup one mapping */
-	ret = fuse_setup_one_mapping(inode, pos >> FUSE_DAX_SHIFT, alloc_dmap,
-				     writable, false);
+	ret = fuse_setup_one_mapping(inode, start_idx, alloc_dmap, writable,
+				     false);
 	if (ret < 0) {
 		dmap_add_to_free_pool(fcd, alloc_dmap);
 		up_write(&fi->dax->sem);
@@ -500,9 +523,10 @@ static int fuse_upgrade_dax_mapping(struct inode *inode, loff_t pos,
 				    struct iomap *iomap)
 {
 	struct fuse_inode *fi = get_fuse_inode(inode);
+	struct fuse_conn_dax *fcd = get_fuse_conn(inode)->dax;
 	struct fuse_dax_mapping *dmap;
 	int ret;
-	unsigned long idx = pos >> FUSE_DAX_SHIFT;
+	unsigned long idx = pos >> fcd->range_shift;
 	struct interval_tree_node *node;
 
 	/*
@@ -543,8 +567,7 @@ static int fuse_upgrade_dax_mapping(struct inode *inode, loff_t pos,
 		goto out_fill_iomap;
 	}
 
-	ret = fuse_setup_one_mapping(inode, pos >> FUSE_DAX_SHIFT, dmap, true,
-				     true);
+	ret = fuse_setup_one_mapping(inode, idx, dmap, true, true);
 	if (ret < 0)
 		goto out_err;
 out_fill_iomap:
@@ -565,7 +588,7 @@ static int fuse_iomap_begin(struct inode *inode, loff_t pos, loff_t length,
 	struct fuse_conn *fc = get_fuse_conn(inode);
 	struct fuse_dax_mapping *dmap;
 	bool writable = flags & IOMAP_WRITE;
-	unsigned long start_idx = pos >> FUSE_DAX_SHIFT;
+	unsigned long start_idx = pos >> fc->dax->range_shift;
 	struct interval_tree_node *node;
 
 	/* We don't support FIEMAP */
@@ -871,9 +894,10 @@ int fuse_dax_mmap(struct file *file, struct vm_area_struct *vma)
 static int dmap_writeback_invalidate(struct inode *inode,
 				     struct fuse_dax_mapping *dmap)
 {
+	struct fuse_conn_dax *fcd = get_fuse_conn(inode)->dax;
+	loff_t start_pos = (loff_t)dmap->itn.start << fcd->range_shift;
+	loff_t end_pos = start_pos + dmap->length - 1;
 	int ret;
-	loff_t start_pos = dmap->itn.start << FUSE_DAX_SHIFT;
-	loff_t end_pos = (start_pos + FUSE_DAX_SZ - 1);
 
 	ret = filemap_fdatawrite_range(inode->i_mapping, start_pos, end_pos);
 	if (ret) {
@@ -906,19 +930,14 @@ static int reclaim_one_dmap_locked(struct inode *inode,
 	if (ret)
 		return ret;
 
-	/* Remove dax mapping from inode interval tree now */
+	/*
+	 * Remove dax mapping from inode interval tree now.  The window range
+	 * is still mapped to the file on the host: the caller either maps it
+	 * again right away, which replaces that mapping, or removes it with
+	 * dmap_removemapping_one() once the inode locks are dropped.
+	 */
 	interval_tree_remove(&dmap->itn, &fi->dax->tree);
 	fi->dax->nr--;
-
-	/* It is possible that umount/shutdown has killed the fuse connection
-	 * and worker thread is trying to reclaim memory in parallel.  Don't
-	 * warn in that case.
-	 */
-	ret = dmap_removemapping_one(inode, dmap);
-	if (ret && ret != -ENOTCONN) {
-		pr_warn("Failed to remove mapping. offset=0x%llx len=0x%llx ret=%d\n",
-			dmap->window_offset, dmap->length, ret);
-	}
 	return 0;
 }
 
@@ -966,8 +985,8 @@ inode_inline_reclaim_one_dmap(struct fuse_conn_dax *fcd, struct inode *inode,
 	dmap = inode_lookup_first_dmap(inode);
 	if (dmap) {
 		start_idx = dmap->itn.start;
-		dmap_start = start_idx << FUSE_DAX_SHIFT;
-		dmap_end = dmap_start + FUSE_DAX_SZ - 1;
+		dmap_start = (u64)start_idx << fcd->range_shift;
+		dmap_end = dmap_start + dmap->length - 1;
 	}
 	up_read(&fi->dax->sem);
 
@@ -1009,7 +1028,10 @@ inode_inline_reclaim_one_dmap(struct fuse_conn_dax *fcd, struct inode *inode,
 		goto out_write_dmap_sem;
 	}
 
-	/* Clean up dmap. Do not add back to free list */
+	/*
+	 * Clean up dmap. Do not add back to free list, nor remove its host
+	 * mapping: the caller sets up a new one.
+	 */
 	dmap_remove_busy_list(fcd, dmap);
 	dmap->inode = NULL;
 	dmap->itn.start = dmap->itn.last = 0;
@@ -1072,9 +1094,9 @@ alloc_dax_mapping_reclaim(struct fuse_conn_dax *fcd, struct inode *inode)
 	}
 }
 
-static int lookup_and_reclaim_dmap_locked(struct fuse_conn_dax *fcd,
-					  struct inode *inode,
-					  unsigned long start_idx)
+static struct fuse_dax_mapping *
+lookup_and_reclaim_dmap_locked(struct fuse_conn_dax *fcd, struct inode *inode,
+			       unsigned long start_idx)
 {
 	int ret;
 	struct fuse_inode *fi = get_fuse_inode(inode);
@@ -1086,22 +1108,19 @@ static int lookup_and_reclaim_dmap_locked(struct fuse_conn_dax *fcd,
 
 	/* Range already got cleaned up by somebody else */
 	if (!node)
-		return 0;
+		return NULL;
 	dmap = node_to_dmap(node);
 
 	/* still in use. */
 	if (refcount_read(&dmap->refcnt) > 1)
-		return 0;
+		return NULL;
 
 	ret = reclaim_one_dmap_locked(inode, dmap);
 	if (ret < 0)
-		return ret;
+		return ERR_PTR(ret);
 
-	/* Cleanup dmap entry and add back to free list */
-	spin_lock(&fcd->lock);
-	dmap_reinit_add_to_free_pool(fcd, dmap);
-	spin_unlock(&fcd->lock);
-	return ret;
+	dmap_remove_busy_list(fcd, dmap);
+	return dmap;
 }
 
 /*
@@ -1118,23 +1137,45 @@ static int lookup_and_reclaim_dmap(struct fuse_conn_dax *fcd,
 {
 	int ret;
 	struct fuse_inode *fi = get_fuse_inode(inode);
-	loff_t dmap_start = start_idx << FUSE_DAX_SHIFT;
-	loff_t dmap_end = (dmap_start + FUSE_DAX_SZ) - 1;
+	struct fuse_dax_mapping *dmap;
+	loff_t dmap_start = (loff_t)start_idx << fcd->range_shift;
+	loff_t dmap_end = (dmap_start + (1LL << fcd->range_shift)) - 1;
 
 	down_write(&fi->i_mmap_sem);
 	ret = fuse_dax_break_layouts(inode, dmap_start, dmap_end);
 	if (ret) {
 		pr_debug("virtio_fs: fuse_dax_break_layouts() failed. err=%d\n",
 			 ret);
-		goto out_mmap_sem;
+		up_write(&fi->i_mmap_sem);
+		return ret;
 	}
 
 	down_write(&fi->dax->sem);
-	ret = lookup_and_reclaim_dmap_locked(fcd, inode, start_idx);
+	dmap = lookup_and_reclaim_dmap_locked(fcd, inode, start_idx);
 	up_write(&fi->dax->sem);
-out_mmap_sem:
 	up_write(&fi->i_mmap_sem);
-	return ret;
+	if (IS_ERR_OR_NULL(dmap))
+		return PTR_ERR_OR_ZERO(dmap);
+
+	/*
+	 * Don't block faults on the inode for the round trip to remove the
+	 * mapping on the host.  The range can't be reused before that's done
+	 * though, or the removal could tear down its new mapping.
+	 *
+	 * It is possible that umount/shutdown has killed the fuse connection
+	 * and worker thread is trying to reclaim memory in parallel.  Don't
+	 * warn in that case.
+	 */
+	ret = dmap_removemapping_one(inode, dmap);
+	if (ret && ret != -ENOTCONN) {
+		pr_warn("Failed to remove mapping. offset=0x%llx len=0x%llx ret=%d\n",
+			dmap->window_offset, dmap->length, ret);
+	}
+
+	dmap->inode = NULL;
+	dmap->itn.start = dmap->itn.last = 0;
+	dmap_add_to_free_pool(fcd, dmap);
+	return 0;
 }
 
 static int try_to_free_dmap_chunks(struct fuse_conn_dax *fcd,
@@ -1144,8 +1185,12 @@ static int try_to_free_dmap_chunks(struct fuse_conn_dax *fcd,
 	int ret, nr_freed = 0;
 	unsigned long start_idx = 0, end_idx = 0;
 	struct inode *inode = NULL;
+	unsigned long nr_scan;
 
-	/* Pick first busy range and free it for now*/
+	/*
+	 * Pick the least recently used busy range, approximated with a second
+	 * chance: ranges used since they were last looked at go to the tail.
+	 */
 	while (1) {
 		if (nr_freed >= nr_to_free)
 			break;
@@ -1158,12 +1203,23 @@ static int try_to_free_dmap_chunks(struct fuse_conn_dax *fcd,
 			return 0;
 		}
 
+		nr_scan = 2 * fcd->nr_busy_ranges;
 		list_for_each_entry_safe(pos, temp, &fcd->busy_ranges,
 						busy_list) {
+			if (!nr_scan--)
+				break;
+
 			/* skip this range if it's in use. */
 			if (refcount_read(&pos->refcnt) > 1)
 				continue;
 
+			if (READ_ONCE(pos->referenced)) {
+				WRITE_ONCE(pos->referenced, false);
+				list_move_tail(&pos->busy_list,
+					       &fcd->busy_ranges);
+				continue;
+			}
+
 			inode = igrab(pos->inode);
 			/*
 			 * This inode is going away. That will free
@@ -1234,6 +1290,7 @@ void fuse_dax_conn_free(struct fuse_conn *fc)
 static int fuse_dax_mem_range_init(struct fuse_conn_dax *fcd)
 {
 	long nr_pages, nr_ranges;
+	unsigned int shift;
 	void *kaddr;
 	pfn_t pfn;
 	struct fuse_dax_mapping *range;
@@ -1255,9 +1312,17 @@ static int fuse_dax_mem_range_init(struct fuse_conn_dax *fcd)
 		return nr_pages;
 	}
 
-	nr_ranges = nr_pages/FUSE_DAX_PAGES;
-	pr_debug("%s: dax mapped %ld pages. nr_ranges=%ld\n",
-		__func__, nr_pages, nr_ranges);
+	/* Keep enough ranges for the reclaim threshold to make sense */
+	shift = clamp_t(unsigned int, dax_range_shift, FUSE_DAX_SHIFT,
+			FUSE_DAX_MAX_SHIFT);
+	while (shift > FUSE_DAX_SHIFT &&
+	       (nr_pages >> (shift - PAGE_SHIFT)) < FUSE_DAX_MIN_RANGES)
+		shift--;
+	fcd->range_shift = shift;
+
+	nr_ranges = nr_pages >> (shift - PAGE_SHIFT);
+	pr_debug("%s: dax mapped %ld pages. nr_ranges=%ld range_shift=%u\n",
+		__func__, nr_pages, nr_ranges, shift);
 
 	for (i = 0; i < nr_ranges; i++) {
 		range = kzalloc(sizeof(struct fuse_dax_mapping), GFP_KERNEL);
@@ -1269,8 +1334,8 @@ static int fuse_dax_mem_range_init(struct fuse_conn_dax *fcd)
 		 * having some memory hidden at the beginning. This needs
 		 * better handling
 		 */
-		range->window_offset = i * FUSE_DAX_SZ;
-		range->length = FUSE_DAX_SZ;
+		range->window_offset = (u64)i << shift;
+		range->length = 1LL << shift;
 		INIT_LIST_HEAD(&range->busy_list);
 		refcount_set(&range->refcnt, 1);
 		list_add_tail(&range->list, &fcd->free_ranges);
@@ -1346,9 +1411,9 @@ void fuse_dax_inode_init(struct inode *inode)
 
 bool fuse_dax_check_alignment(struct fuse_conn *fc, unsigned int map_alignment)
 {
-	if (fc->dax && (map_alignment > FUSE_DAX_SHIFT)) {
-		pr_warn("FUSE: map_alignment %u incompatible with dax mem range size %u\n",
-			map_alignment, FUSE_DAX_SZ);
+	if (fc->dax && (map_alignment > fc->dax->range_shift)) {
+		pr_warn("FUSE: map_alignment %u incompatible with dax mem range size %llu\n",
+			map_alignment, 1ULL << fc->dax->range_shift);
 		return false;
 	}
 	return true;
@@ -21,6 +21,7 @@
 #include <linux/swap.h>
 #include <linux/splice.h>
 #include <linux/sched.h>
+#include <linux/io_uring.h>
 
 MODULE_ALIAS_MISCDEV(FUSE_MINOR);
 MODULE_ALIAS("devname:fuse");
@@ -229,6 +230,10 @@ __releases(fiq->lock)
 	req->in.h.len = sizeof(struct fuse_in_header) +
 		fuse_len_args(req->args->in_numargs,
 			      (struct fuse_arg *) req->args->in_args);
+	if (IS_ENABLED(CONFIG_FUSE_IO_URING) && fuse_uring_queue_req(fiq, req)) {
+		spin_unlock(&fiq->lock);
+		return;
+	}
 	list_add_tail(&req->list, &fiq->pending);
 	fiq->ops->wake_pending_and_unlock(fiq);
 }
@@ -386,6 +391,8 @@ static void request_wait_answer(struct fuse_req *req)
 	}
 
 	if (!test_bit(FR_FORCE, &req->flags)) {
+		bool pending;
+
 		/* Only fatal signals may interrupt this */
 		err = wait_event_killable(req->waitq,
 					test_bit(FR_FINISHED, &req->flags));
@@ -393,9 +400,16 @@ static void request_wait_answer(struct fuse_req *req)
 			return;
 
 		spin_lock(&fiq->lock);
+		if (IS_ENABLED(CONFIG_FUSE_IO_URING) &&
+		    test_bit(FR_URING, &req->flags)) {
+			pending = fuse_uring_remove_pending_req(req);
+		} else {
+			pending = test_bit(FR_PENDING, &req->flags);
+			if (pending)
+				list_del(&req->list);
+		}
 		/* Request is not yet in userspace, bail out */
-		if (test_bit(FR_PENDING, &req->flags)) {
-			list_del(&req->list);
+		if (pending) {
 			spin_unlock(&fiq->lock);
 			__fuse_put_request(req);
 			req->out.h.error = -EINTR;
@@ -647,22 +661,8 @@ static int unlock_request(struct fuse_req *req)
 	return err;
 }
 
-struct fuse_copy_state {
-	int write;
-	struct fuse_req *req;
-	struct iov_iter *iter;
-	struct pipe_buffer *pipebufs;
-	struct pipe_buffer *currbuf;
-	struct pipe_inode_info *pipe;
-	unsigned long nr_segs;
-	struct page *pg;
-	unsigned len;
-	unsigned offset;
-	unsigned move_pages:1;
-};
-
-static void fuse_copy_init(struct fuse_copy_state *cs, int write,
-			   struct iov_iter *iter)
+void fuse_copy_init(struct fuse_copy_state *cs, int write,
+		    struct iov_iter *iter)
 {
 	memset(cs, 0, sizeof(*cs));
 	cs->write = write;
@@ -670,7 +670,7 @@ static void fuse_copy_init(struct fuse_copy_state *cs, int write,
 }
 
 /* Unmap and put previous page of userspace buffer */
-static void fuse_copy_finish(struct fuse_copy_state *cs)
+void fuse_copy_finish(struct fuse_copy_state *cs)
 {
 	if (cs->currbuf) {
 		struct pipe_buffer *buf = cs->currbuf;
@@ -1203,7 +1203,6 @@ static ssize_t fuse_dev_do_read(struct fuse_dev *fud, struct file *file,
 	struct fuse_req *req;
 	struct fuse_args *args;
 	unsigned reqsize;
-	unsigned int hash;
 
 	/*
 	 * Require sane minimum read buffer - that has capacity for fixed part
@@ -1217,10 +1216,7 @@ static ssize_t fuse_dev_do_read(struct fuse_dev *fud, struct file *file,
 	 * which is the absolute minimum any sane filesystem should be using
 	 * for header room.
 	 */
-	if (nbytes < max_t(size_t, FUSE_MIN_READ_BUFFER,
-			   sizeof(struct fuse_in_header) +
-			   sizeof(struct fuse_write_in) +
-			   fc->max_write))
+	if (nbytes < fuse_min_read_buffer(fc))
 		return -EINVAL;
 
  restart:
@@ -1274,6 +1270,27 @@ static ssize_t fuse_dev_do_read(struct fuse_dev *fud, struct file *file,
 		fuse_request_end(req);
 		goto restart;
 	}
+
+	return fuse_dev_send_req(fc, fpq, cs, req);
+
+ err_unlock:
+	spin_unlock(&fiq->lock);
+	return err;
+}
+
+/*
+ * Copy a request taken off an input queue to userspace, and put it on the
+ * processing list of @fpq to wait for the reply.  Returns the size of the
+ * request, or an error after ending the request.
+ */
+ssize_t fuse_dev_send_req(struct fuse_conn *fc, struct fuse_pqueue *fpq,
+			  struct fuse_copy_state *cs, struct fuse_req *req)
+{
+	struct fuse_args *args = req->args;
+	unsigned reqsize = req->in.h.len;
+	unsigned int hash;
+	ssize_t err;
+
 	spin_lock(&fpq->lock);
 	list_add(&req->list, &fpq->io);
 	spin_unlock(&fpq->lock);
@@ -1316,10 +1333,6 @@ static ssize_t fuse_dev_do_read(struct fuse_dev *fud, struct file *file,
 	spin_unlock(&fpq->lock);
 	fuse_request_end(req);
 	return err;
-
- err_unlock:
-	spin_unlock(&fiq->lock);
-	return err;
 }
 
 static int fuse_dev_open(struct inode *inode, struct file *file)
@@ -1790,7 +1803,7 @@ static int fuse_notify(struct fuse_conn *fc, enum fuse_notify_code code,
 }
 
 /* Look up request on processing list by unique ID */
-static struct fuse_req *request_find(struct fuse_pqueue *fpq, u64 unique)
+struct fuse_req *fuse_request_find(struct fuse_pqueue *fpq, u64 unique)
 {
 	unsigned int hash = fuse_req_hash(unique);
 	struct fuse_req *req;
@@ -1802,8 +1815,8 @@ static struct fuse_req *request_find(struct fuse_pqueue *fpq, u64 unique)
 	return NULL;
 }
 
-static int copy_out_args(struct fuse_copy_state *cs, struct fuse_args *args,
-			 unsigned nbytes)
+int fuse_copy_out_args(struct fuse_copy_state *cs, struct fuse_args *args,
+		       unsigned nbytes)
 {
 	unsigned reqsize = sizeof(struct fuse_out_header);
 
@@ -1867,7 +1880,7 @@ static ssize_t fuse_dev_do_write(struct fuse_dev *fud,
 	spin_lock(&fpq->lock);
 	req = NULL;
 	if (fpq->connected)
-		req = request_find(fpq, oh.unique & ~FUSE_INT_REQ_BIT);
+		req = fuse_request_find(fpq, oh.unique & ~FUSE_INT_REQ_BIT);
 
 	err = -ENOENT;
 	if (!req) {
@@ -1905,7 +1918,7 @@ static ssize_t fuse_dev_do_write(struct fuse_dev *fud,
 	if (oh.error)
 		err = nbytes != sizeof(oh) ? -EINVAL : 0;
 	else
-		err = copy_out_args(cs, req->args, nbytes);
+		err = fuse_copy_out_args(cs, req->args, nbytes);
 	fuse_copy_finish(cs);
 
 	spin_lock(&fpq->lock);
@@ -2083,6 +2096,33 @@ static void end_polls(struct fuse_conn *fc)
 	}
 }
 
+/*
+ * Disconnect @fpq, and move the requests that can be ended right away to
+ * @to_end.  Requests that are being copied are ended after the copy.
+ */
+void fuse_abort_pqueue(struct fuse_pqueue *fpq, struct list_head *to_end)
+{
+	struct fuse_req *req, *next;
+	unsigned int i;
+
+	spin_lock(&fpq->lock);
+	fpq->connected = 0;
+	list_for_each_entry_safe(req, next, &fpq->io, list) {
+		req->out.h.error = -ECONNABORTED;
+		spin_lock(&req->waitq.lock);
+		set_bit(FR_ABORTED, &req->flags);
+		if (!test_bit(FR_LOCKED, &req->flags)) {
+			set_bit(FR_PRIVATE, &req->flags);
+			__fuse_get_request(req);
+			list_move(&req->list, to_end);
+		}
+		spin_unlock(&req->waitq.lock);
+	}
+	for (i = 0; i < FUSE_PQ_HASH_SIZE; i++)
+		list_splice_tail_init(&fpq->processing[i], to_end);
+	spin_unlock(&fpq->lock);
+}
+
 /*
  * Abort all requests.
  *
@@ -2108,9 +2148,8 @@ void fuse_abort_conn(struct fuse_conn *fc)
 	spin_lock(&fc->lock);
 	if (fc->connected) {
 		struct fuse_dev *fud;
-		struct fuse_req *req, *next;
+		struct fuse_req *req;
 		LIST_HEAD(to_end);
-		unsigned int i;
 
 		/* Background queuing checks fc->connected under bg_lock */
 		spin_lock(&fc->bg_lock);
@@ -2118,27 +2157,10 @@ void fuse_abort_conn(struct fuse_conn *fc)
 		spin_unlock(&fc->bg_lock);
 
 		fuse_set_initialized(fc);
-		list_for_each_entry(fud, &fc->devices, entry) {
-			struct fuse_pqueue *fpq = &fud->pq;
-
-			spin_lock(&fpq->lock);
-			fpq->connected = 0;
-			list_for_each_entry_safe(req, next, &fpq->io, list) {
-				req->out.h.error = -ECONNABORTED;
-				spin_lock(&req->waitq.lock);
-				set_bit(FR_ABORTED, &req->flags);
-				if (!test_bit(FR_LOCKED, &req->flags)) {
-					set_bit(FR_PRIVATE, &req->flags);
-					__fuse_get_request(req);
-					list_move(&req->list, &to_end);
-				}
-				spin_unlock(&req->waitq.lock);
-			}
-			for (i = 0; i < FUSE_PQ_HASH_SIZE; i++)
-				list_splice_tail_init(&fpq->processing[i],
-						      &to_end);
-			spin_unlock(&fpq->lock);
-		}
+		list_for_each_entry(fud, &fc->devices, entry)
+			fuse_abort_pqueue(&fud->pq, &to_end);
+		if (IS_ENABLED(CONFIG_FUSE_IO_URING))
+			fuse_uring_abort(fc, &to_end);
 		spin_lock(&fc->bg_lock);
 		fc->blocked = 0;
 		fc->max_background = UINT_MAX;
@@ -2266,6 +2288,19 @@ static long fuse_dev_ioctl(struct file *file, unsigned int cmd,
 	return err;
 }
 
+#ifdef CONFIG_FUSE_IO_URING
+static int fuse_dev_uring_cmd(struct io_uring_cmd *cmd,
+			      unsigned int issue_flags)
+{
+	struct fuse_dev *fud = fuse_get_dev(cmd->file);
+
+	if (!fud)
+		return -EPERM;
+
+	return fuse_uring_cmd(fud->fc, cmd, issue_flags);
+}
+#endif
+
 const struct file_operations fuse_dev_operations = {
 	.owner		= THIS_MODULE,
 	.open		= fuse_dev_open,
@@ -2279,6 +2314,9 @@ const struct file_operations fuse_dev_operations = {
 	.fasync		= fuse_dev_fasync,
 	.unlocked_ioctl = fuse_dev_ioctl,
 	.compat_ioctl   = compat_ptr_ioctl,
+#ifdef CONFIG_FUSE_IO_URING
+	.uring_cmd	= fuse_dev_uring_cmd,
+#endif
 };
 EXPORT_SYMBOL_GPL(fuse_dev_operations);
 
@@ -0,0 +1,631 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * FUSE: io_uring transport
+ *
+ * The server hands buffers to per-CPU queues with FUSE_IO_URING_CMD_REGISTER
+ * io_uring commands on /dev/fuse.  A request made on a CPU is copied to an
+ * available buffer of its queue, completing the command of the buffer, and
+ * the server replies in that buffer with FUSE_IO_URING_CMD_COMMIT_AND_FETCH,
+ * which also makes the buffer wait for the next request.  A request thus
+ * costs the server one submission and one completion, which can be batched,
+ * instead of a read(2) and a write(2), and requests made on different CPUs
+ * don't contend on fiq->lock.
+ *
+ * INTERRUPT and FORGET requests, requests without a reply, and requests made
+ * on CPUs whose queue has no buffer still go through read(2) on /dev/fuse.
+ */
+
+#include "fuse_i.h"
+
+#include <linux/io_uring.h>
+#include <linux/uio.h>
+
+/* A buffer of the server */
+struct fuse_ring_ent {
+	/* on queue->ents */
+	struct list_head list;
+
+	/* on queue->ent_avail, while waiting for a request with ->cmd */
+	struct list_head avail;
+
+	struct fuse_ring_queue *queue;
+
+	/* command waiting for a request, or that a request is sent to */
+	struct io_uring_cmd *cmd;
+
+	/* request to send from the task_work of the server */
+	struct fuse_req *req;
+
+	void __user *buf;
+	u32 buf_sz;
+};
+
+struct fuse_ring_queue {
+	struct fuse_ring *ring;
+
+	/* Requests sent to the buffers; fpq.lock protects the queue */
+	struct fuse_pqueue fpq;
+
+	/* All the buffers, and those waiting for a request */
+	struct list_head ents;
+	struct list_head ent_avail;
+
+	/* Number of buffers that still have a command */
+	unsigned int nr_ents;
+
+	/* Requests waiting for a buffer */
+	struct list_head pending;
+};
+
+struct fuse_ring {
+	struct fuse_conn *fc;
+	unsigned int nr_queues;
+	struct fuse_ring_queue *queues[];
+};
+
+static void fuse_uring_cmd_set_ent(struct io_uring_cmd *cmd,
+				   struct fuse_ring_ent *ent)
+{
+	*(struct fuse_ring_ent **)cmd->pdu = ent;
+}
+
+static struct fuse_ring_ent *fuse_uring_cmd_ent(struct io_uring_cmd *cmd)
+{
+	return *(struct fuse_ring_ent **)cmd->pdu;
+}
+
+static struct fuse_ring *fuse_uring_create(struct fuse_conn *fc)
+{
+	struct fuse_ring *ring;
+
+	ring = smp_load_acquire(&fc->ring);
+	if (ring)
+		return ring;
+
+	ring = kzalloc(struct_size(ring, queues, nr_cpu_ids),
+		       GFP_KERNEL_ACCOUNT);
+	if (!ring)
+		return ERR_PTR(-ENOMEM);
+
+	ring->fc = fc;
+	ring->nr_queues = nr_cpu_ids;
+
+	spin_lock(&fc->lock);
+	if (fc->ring) {
+		kfree(ring);
+		ring = fc->ring;
+	} else {
+		/* Pairs with smp_load_acquire() in fuse_uring_queue_req() */
+		smp_store_release(&fc->ring, ring);
+	}
+	spin_unlock(&fc->lock);
+
+	return ring;
+}
+
+static void fuse_uring_free_queue(struct fuse_ring_queue *queue)
+{
+	kfree(queue->fpq.processing);
+	kfree(queue);
+}
+
+static struct fuse_ring_queue *fuse_uring_create_queue(struct fuse_ring *ring,
+							unsigned int qid)
+{
+	struct fuse_conn *fc = ring->fc;
+	struct fuse_ring_queue *queue;
+	struct list_head *pq;
+
+	queue = smp_load_acquire(&ring->queues[qid]);
+	if (queue)
+		return queue;
+
+	queue = kzalloc(sizeof(*queue), GFP_KERNEL_ACCOUNT);
+	if (!queue)
+		return ERR_PTR(-ENOMEM);
+
+	pq = kcalloc(FUSE_PQ_HASH_SIZE, sizeof(struct list_head),
+		     GFP_KERNEL_ACCOUNT);
+	if (!pq) {
+		kfree(queue);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	queue->ring = ring;
+	queue->fpq.processing = pq;
+	fuse_pqueue_init(&queue->fpq);
+	INIT_LIST_HEAD(&queue->ents);
+	INIT_LIST_HEAD(&queue->ent_avail);
+	INIT_LIST_HEAD(&queue->pending);
+
+	/* fuse_uring_abort() runs under fc->lock, after clearing connected */
+	spin_lock(&fc->lock);
+	if (!fc->connected) {
+		fuse_uring_free_queue(queue);
+		queue = ERR_PTR(-ENOTCONN);
+	} else if (ring->queues[qid]) {
+		fuse_uring_free_queue(queue);
+		queue = ring->queues[qid];
+	} else {
+		smp_store_release(&ring->queues[qid], queue);
+	}
+	spin_unlock(&fc->lock);
+
+	return queue;
+}
+
+static struct fuse_ring_queue *fuse_uring_get_queue(struct fuse_conn *fc,
+						    unsigned int qid)
+{
+	struct fuse_ring *ring = smp_load_acquire(&fc->ring);
+
+	if (!ring || qid >= ring->nr_queues)
+		return NULL;
+
+	return smp_load_acquire(&ring->queues[qid]);
+}
+
+/*
+ * Take the first pending request for @ent, or have @ent wait for one with
+ * @cmd.  Called with fpq.lock held.
+ */
+static struct fuse_req *fuse_uring_ent_get_req(struct fuse_ring_ent *ent,
+					       struct io_uring_cmd *cmd)
+{
+	struct fuse_ring_queue *queue = ent->queue;
+	struct fuse_req *req;
+
+	ent->cmd = cmd;
+	req = list_first_entry_or_null(&queue->pending, struct fuse_req, list);
+	if (!req) {
+		/* LIFO, to reuse the buffers that are warm in the cache */
+		list_move(&ent->avail, &queue->ent_avail);
+		return NULL;
+	}
+
+	list_del_init(&ent->avail);
+	clear_bit(FR_PENDING, &req->flags);
+	list_del_init(&req->list);
+
+	return req;
+}
+
+/*
+ * Retire @ent, which lost its command.  Without a cmd, @ent must be owned by
+ * the caller; with one, @ent is only retired if still waiting with @cmd.
+ *
+ * If @ent was the last buffer of the queue, the pending requests go back to
+ * the input queue of /dev/fuse.
+ */
+static bool fuse_uring_ent_kill(struct fuse_ring_ent *ent,
+				struct io_uring_cmd *cmd)
+{
+	struct fuse_ring_queue *queue = ent->queue;
+	struct fuse_iqueue *fiq = &queue->ring->fc->iq;
+	struct fuse_req *req;
+	bool requeue = false;
+
+	spin_lock(&fiq->lock);
+	spin_lock(&queue->fpq.lock);
+	if (cmd && (ent->cmd != cmd || list_empty(&ent->avail))) {
+		spin_unlock(&queue->fpq.lock);
+		spin_unlock(&fiq->lock);
+		return false;
+	}
+
+	list_del_init(&ent->avail);
+	ent->cmd = NULL;
+	if (!--queue->nr_ents && !list_empty(&queue->pending)) {
+		list_for_each_entry(req, &queue->pending, list)
+			clear_bit(FR_URING, &req->flags);
+		list_splice_tail_init(&queue->pending, &fiq->pending);
+		requeue = true;
+	}
+	spin_unlock(&queue->fpq.lock);
+
+	if (requeue)
+		fiq->ops->wake_pending_and_unlock(fiq);
+	else
+		spin_unlock(&fiq->lock);
+
+	return true;
+}
+
+/*
+ * Copy @req to the buffer of @ent, and the next pending requests if it
+ * doesn't fit, from the context of the server.  Returns the size of the
+ * request sent, -EIOCBQUEUED if @ent now waits with @cmd, or an error.
+ */
+static ssize_t fuse_uring_send(struct fuse_ring_ent *ent,
+			       struct io_uring_cmd *cmd, struct fuse_req *req)
+{
+	struct fuse_ring_queue *queue = ent->queue;
+	struct fuse_conn *fc = queue->ring->fc;
+	struct fuse_copy_state cs;
+	struct iov_iter iter;
+	struct iovec iov;
+	ssize_t ret;
+
+	while (req->in.h.len > ent->buf_sz) {
+		req->out.h.error = -EIO;
+		/* SETXATTR is special, since it may contain too large data */
+		if (req->args->opcode == FUSE_SETXATTR)
+			req->out.h.error = -E2BIG;
+		fuse_request_end(req);
+
+		spin_lock(&queue->fpq.lock);
+		if (!queue->fpq.connected) {
+			spin_unlock(&queue->fpq.lock);
+			return -ENOTCONN;
+		}
+		req = fuse_uring_ent_get_req(ent, cmd);
+		spin_unlock(&queue->fpq.lock);
+
+		if (!req)
+			return -EIOCBQUEUED;
+	}
+
+	ret = import_single_range(READ, ent->buf, ent->buf_sz, &iov, &iter);
+	if (ret) {
+		req->out.h.error = -EIO;
+		fuse_request_end(req);
+		fuse_uring_ent_kill(ent, NULL);
+		return ret;
+	}
+
+	fuse_copy_init(&cs, 1, &iter);
+	req->ring_ent = ent;
+	ret = fuse_dev_send_req(fc, &queue->fpq, &cs, req);
+	if (ret < 0)
+		fuse_uring_ent_kill(ent, NULL);
+
+	return ret;
+}
+
+static void fuse_uring_send_in_task(struct io_uring_cmd *cmd,
+				    unsigned int issue_flags)
+{
+	struct fuse_ring_ent *ent = fuse_uring_cmd_ent(cmd);
+	struct fuse_req *req = ent->req;
+	ssize_t ret;
+
+	ent->req = NULL;
+	if (issue_flags & IO_URING_F_TASK_DEAD) {
+		req->out.h.error = -ECONNABORTED;
+		fuse_request_end(req);
+		fuse_uring_ent_kill(ent, NULL);
+		ret = -ECONNABORTED;
+	} else {
+		ret = fuse_uring_send(ent, cmd, req);
+	}
+
+	if (ret != -EIOCBQUEUED)
+		io_uring_cmd_done(cmd, ret);
+}
+
+/*
+ * Queue @req on the queue of the current CPU, if the server gave it buffers.
+ * Called with fiq->lock held.
+ */
+bool fuse_uring_queue_req(struct fuse_iqueue *fiq, struct fuse_req *req)
+{
+	struct fuse_conn *fc = container_of(fiq, struct fuse_conn, iq);
+	struct fuse_ring *ring = smp_load_acquire(&fc->ring);
+	struct io_uring_cmd *cmd = NULL;
+	struct fuse_ring_queue *queue;
+	struct fuse_ring_ent *ent;
+
+	if (!ring || !test_bit(FR_ISREPLY, &req->flags))
+		return false;
+
+	queue = smp_load_acquire(&ring->queues[raw_smp_processor_id()]);
+	if (!queue)
+		return false;
+
+	spin_lock(&queue->fpq.lock);
+	if (!queue->fpq.connected || !queue->nr_ents) {
+		spin_unlock(&queue->fpq.lock);
+		return false;
+	}
+
+	req->ring_queue = queue;
+	set_bit(FR_URING, &req->flags);
+	list_add_tail(&req->list, &queue->pending);
+
+	ent = list_first_entry_or_null(&queue->ent_avail, struct fuse_ring_ent,
+				       avail);
+	if (ent) {
+		cmd = ent->cmd;
+		ent->req = fuse_uring_ent_get_req(ent, cmd);
+	}
+	spin_unlock(&queue->fpq.lock);
+
+	/* The copy needs the mm of the server */
+	if (cmd)
+		io_uring_cmd_complete_in_task(cmd, fuse_uring_send_in_task);
+
+	return true;
+}
+
+/*
+ * Take a request queued with fuse_uring_queue_req() off its queue, if it
+ * wasn't sent yet.  Called with fiq->lock held.
+ */
+bool fuse_uring_remove_pending_req(struct fuse_req *req)
+{
+	struct fuse_ring_queue *queue = req->ring_queue;
+	bool pending;
+
+	spin_lock(&queue->fpq.lock);
+	pending = test_bit(FR_PENDING, &req->flags);
+	if (pending)
+		list_del(&req->list);
+	spin_unlock(&queue->fpq.lock);
+
+	return pending;
+}
+
+/* Have @ent, owned by the server, wait for the next request with @cmd */
+static int fuse_uring_fetch(struct fuse_ring_ent *ent,
+			    struct io_uring_cmd *cmd)
+{
+	struct fuse_ring_queue *queue = ent->queue;
+	struct fuse_req *req;
+
+	fuse_uring_cmd_set_ent(cmd, ent);
+	io_uring_cmd_mark_cancelable(cmd);
+
+	spin_lock(&queue->fpq.lock);
+	if (!queue->fpq.connected) {
+		spin_unlock(&queue->fpq.lock);
+		return -ENOTCONN;
+	}
+	req = fuse_uring_ent_get_req(ent, cmd);
+	spin_unlock(&queue->fpq.lock);
+
+	if (!req)
+		return -EIOCBQUEUED;
+
+	/* We are in the context of the server, no need for task_work */
+	return fuse_uring_send(ent, cmd, req);
+}
+
+static int fuse_uring_register(struct fuse_conn *fc, struct io_uring_cmd *cmd,
+			       const struct fuse_uring_cmd_req *cmd_req)
+{
+	void __user *buf = u64_to_user_ptr(cmd->addr);
+	struct fuse_ring_queue *queue;
+	struct fuse_ring_ent *ent;
+	struct fuse_ring *ring;
+
+	if (cmd_req->qid >= nr_cpu_ids || cmd_req->commit_id)
+		return -EINVAL;
+
+	/* Same requirement as for read(2) */
+	if (cmd->len < fuse_min_read_buffer(fc))
+		return -EINVAL;
+	if (!access_ok(buf, cmd->len))
+		return -EFAULT;
+
+	ring = fuse_uring_create(fc);
+	if (IS_ERR(ring))
+		return PTR_ERR(ring);
+
+	queue = fuse_uring_create_queue(ring, cmd_req->qid);
+	if (IS_ERR(queue))
+		return PTR_ERR(queue);
+
+	ent = kzalloc(sizeof(*ent), GFP_KERNEL_ACCOUNT);
+	if (!ent)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&ent->avail);
+	ent->queue = queue;
+	ent->buf = buf;
+	ent->buf_sz = cmd->len;
+
+	spin_lock(&queue->fpq.lock);
+	list_add_tail(&ent->list, &queue->ents);
+	queue->nr_ents++;
+	spin_unlock(&queue->fpq.lock);
+
+	return fuse_uring_fetch(ent, cmd);
+}
+
+/* Copy the reply to @req from the buffer of @ent, and end @req */
+static void fuse_uring_commit(struct fuse_ring_ent *ent, struct fuse_req *req)
+{
+	struct fuse_pqueue *fpq = &ent->queue->fpq;
+	struct fuse_copy_state cs;
+	struct fuse_out_header oh;
+	struct iov_iter iter;
+	struct iovec iov;
+	int err;
+
+	err = -EFAULT;
+	if (copy_from_user(&oh, ent->buf, sizeof(oh)))
+		goto out;
+
+	err = -EINVAL;
+	if (oh.unique != req->in.h.unique || oh.len < sizeof(oh) ||
+	    oh.len > ent->buf_sz || oh.error <= -1000 || oh.error > 0)
+		goto out;
+
+	req->out.h = oh;
+	if (oh.error) {
+		err = oh.len != sizeof(oh) ? -EINVAL : 0;
+		goto out;
+	}
+
+	err = import_single_range(WRITE, ent->buf + sizeof(oh),
+				  oh.len - sizeof(oh), &iov, &iter);
+	if (err)
+		goto out;
+
+	fuse_copy_init(&cs, 0, &iter);
+	cs.req = req;
+	err = fuse_copy_out_args(&cs, req->args, oh.len);
+	fuse_copy_finish(&cs);
+out:
+	spin_lock(&fpq->lock);
+	clear_bit(FR_LOCKED, &req->flags);
+	if (fpq->connected && err)
+		req->out.h.error = -EIO;
+	if (!test_bit(FR_PRIVATE, &req->flags))
+		list_del_init(&req->list);
+	spin_unlock(&fpq->lock);
+
+	fuse_request_end(req);
+}
+
+static int fuse_uring_commit_fetch(struct fuse_conn *fc,
+				   struct io_uring_cmd *cmd,
+				   const struct fuse_uring_cmd_req *cmd_req)
+{
+	struct fuse_ring_queue *queue;
+	struct fuse_ring_ent *ent;
+	struct fuse_pqueue *fpq;
+	struct fuse_req *req;
+
+	queue = fuse_uring_get_queue(fc, cmd_req->qid);
+	if (!queue)
+		return -EINVAL;
+
+	fpq = &queue->fpq;
+	spin_lock(&fpq->lock);
+	if (!fpq->connected) {
+		spin_unlock(&fpq->lock);
+		return -ENOTCONN;
+	}
+	req = fuse_request_find(fpq, cmd_req->commit_id);
+	if (!req) {
+		spin_unlock(&fpq->lock);
+		return -ENOENT;
+	}
+
+	ent = req->ring_ent;
+	clear_bit(FR_SENT, &req->flags);
+	list_move(&req->list, &fpq->io);
+	set_bit(FR_LOCKED, &req->flags);
+	spin_unlock(&fpq->lock);
+
+	/* A bad reply fails the request, the buffer can still be used */
+	fuse_uring_commit(ent, req);
+
+	return fuse_uring_fetch(ent, cmd);
+}
+
+static void fuse_uring_cancel(struct io_uring_cmd *cmd)
+{
+	struct fuse_ring_ent *ent = fuse_uring_cmd_ent(cmd);
+
+	/* Otherwise a request is being sent to it, completing @cmd */
+	if (fuse_uring_ent_kill(ent, cmd))
+		io_uring_cmd_done(cmd, -ENOTCONN);
+}
+
+int fuse_uring_cmd(struct fuse_conn *fc, struct io_uring_cmd *cmd,
+		   unsigned int issue_flags)
+{
+	const struct fuse_uring_cmd_req *cmd_req = (const void *)cmd->cmd;
+
+	BUILD_BUG_ON(sizeof(*cmd_req) > sizeof(cmd->cmd));
+	BUILD_BUG_ON(sizeof(struct fuse_ring_ent *) > sizeof(cmd->pdu));
+
+	if (issue_flags & IO_URING_F_CANCEL) {
+		fuse_uring_cancel(cmd);
+		return 0;
+	}
+
+	/* max_write is only known after INIT */
+	if (!fc->initialized)
+		return -EBUSY;
+	if (!fc->connected)
+		return -ENOTCONN;
+	if (cmd_req->flags || cmd_req->padding)
+		return -EINVAL;
+
+	switch (cmd->cmd_op) {
+	case FUSE_IO_URING_CMD_REGISTER:
+		return fuse_uring_register(fc, cmd, cmd_req);
+	case FUSE_IO_URING_CMD_COMMIT_AND_FETCH:
+		return fuse_uring_commit_fetch(fc, cmd, cmd_req);
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * Called from fuse_abort_conn() under fc->lock: end the requests of the
+ * queues, and fail the commands waiting for a request.
+ */
+void fuse_uring_abort(struct fuse_conn *fc, struct list_head *to_end)
+{
+	struct fuse_ring *ring = fc->ring;
+	unsigned int qid;
+
+	if (!ring)
+		return;
+
+	for (qid = 0; qid < ring->nr_queues; qid++) {
+		struct fuse_ring_queue *queue = ring->queues[qid];
+		struct io_uring_cmd *cmd;
+		struct fuse_ring_ent *ent;
+		struct fuse_req *req;
+
+		if (!queue)
+			continue;
+
+		fuse_abort_pqueue(&queue->fpq, to_end);
+
+		spin_lock(&queue->fpq.lock);
+		list_for_each_entry(req, &queue->pending, list)
+			clear_bit(FR_PENDING, &req->flags);
+		list_splice_tail_init(&queue->pending, to_end);
+		spin_unlock(&queue->fpq.lock);
+
+		for (;;) {
+			spin_lock(&queue->fpq.lock);
+			ent = list_first_entry_or_null(&queue->ent_avail,
+						       struct fuse_ring_ent,
+						       avail);
+			if (ent) {
+				list_del_init(&ent->avail);
+				cmd = ent->cmd;
+				ent->cmd = NULL;
+			}
+			spin_unlock(&queue->fpq.lock);
+
+			if (!ent)
+				break;
+			io_uring_cmd_done(cmd, -ENOTCONN);
+		}
+	}
+}
+
+/* Called on the final put of @fc, when no command is left */
+void fuse_uring_destruct(struct fuse_conn *fc)
+{
+	struct fuse_ring *ring = fc->ring;
+	unsigned int qid;
+
+	if (!ring)
+		return;
+
+	for (qid = 0; qid < ring->nr_queues; qid++) {
+		struct fuse_ring_queue *queue = ring->queues[qid];
+		struct fuse_ring_ent *ent, *next;
+
+		if (!queue)
+			continue;
+
+		WARN_ON(!list_empty(&queue->pending));
+		WARN_ON(!list_empty(&queue->ent_avail));
+		list_for_each_entry_safe(ent, next, &queue->ents, list)
+			kfree(ent);
+		fuse_uring_free_queue(queue);
+	}
+
+	kfree(ring);
+	fc->ring = NULL;
+}
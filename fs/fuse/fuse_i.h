@@ -318,6 +318,7 @@ struct fuse_io_priv {
  * FR_FINISHED:		request is finished
  * FR_PRIVATE:		request is on private list
  * FR_ASYNC:		request is asynchronous
+ * FR_URING:		request is queued on an io_uring queue, see dev_uring.c
  */
 enum fuse_req_flag {
 	FR_ISREPLY,
@@ -332,6 +333,7 @@ enum fuse_req_flag {
 	FR_FINISHED,
 	FR_PRIVATE,
 	FR_ASYNC,
+	FR_URING,
 };
 
 /**
@@ -376,11 +378,22 @@ struct fuse_req {
 	void *argbuf;
 #endif
 
+#ifdef CONFIG_FUSE_IO_URING
+	/** io_uring queue holding the request, if FR_URING is set */
+	struct fuse_ring_queue *ring_queue;
+
+	/** io_uring buffer the request was sent to */
+	struct fuse_ring_ent *ring_ent;
+#endif
+
 	/** fuse_mount this request belongs to */
 	struct fuse_mount *fm;
 };
 
 struct fuse_iqueue;
+struct fuse_ring;
+struct fuse_ring_queue;
+struct fuse_ring_ent;
 
 /**
  * Input queue callbacks
@@ -485,6 +498,23 @@ struct fuse_dev {
 	struct list_head entry;
 };
 
+/**
+ * State of a copy of a request or reply to or from userspace
+ */
+struct fuse_copy_state {
+	int write;
+	struct fuse_req *req;
+	struct iov_iter *iter;
+	struct pipe_buffer *pipebufs;
+	struct pipe_buffer *currbuf;
+	struct pipe_inode_info *pipe;
+	unsigned long nr_segs;
+	struct page *pg;
+	unsigned len;
+	unsigned offset;
+	unsigned move_pages:1;
+};
+
 struct fuse_fs_context {
 	int fd;
 	unsigned int rootmode;
@@ -786,6 +816,11 @@ struct fuse_conn {
 	struct fuse_conn_dax *dax;
 #endif
 
+#ifdef CONFIG_FUSE_IO_URING
+	/** io_uring transport, set up by the first FUSE_IO_URING_CMD_REGISTER */
+	struct fuse_ring *ring;
+#endif
+
 	/** List of filesystems using this connection */
 	struct list_head mounts;
 };
@@ -1036,6 +1071,7 @@ void fuse_mount_put(struct fuse_mount *fm);
 
 struct fuse_dev *fuse_dev_alloc_install(struct fuse_conn *fc);
 struct fuse_dev *fuse_dev_alloc(void);
+void fuse_pqueue_init(struct fuse_pqueue *fpq);
 void fuse_dev_install(struct fuse_dev *fud, struct fuse_conn *fc);
 void fuse_dev_free(struct fuse_dev *fud);
 void fuse_send_init(struct fuse_mount *fm);
@@ -1194,6 +1230,37 @@ unsigned int fuse_len_args(unsigned int numargs, struct fuse_arg *args);
 u64 fuse_get_unique(struct fuse_iqueue *fiq);
 void fuse_free_conn(struct fuse_conn *fc);
 
+/**
+ * Minimum size of the buffers the server reads requests into
+ */
+static inline size_t fuse_min_read_buffer(struct fuse_conn *fc)
+{
+	return max_t(size_t, FUSE_MIN_READ_BUFFER,
+		     sizeof(struct fuse_in_header) +
+		     sizeof(struct fuse_write_in) + fc->max_write);
+}
+
+void fuse_copy_init(struct fuse_copy_state *cs, int write,
+		    struct iov_iter *iter);
+void fuse_copy_finish(struct fuse_copy_state *cs);
+int fuse_copy_out_args(struct fuse_copy_state *cs, struct fuse_args *args,
+		       unsigned nbytes);
+struct fuse_req *fuse_request_find(struct fuse_pqueue *fpq, u64 unique);
+ssize_t fuse_dev_send_req(struct fuse_conn *fc, struct fuse_pqueue *fpq,
+			  struct fuse_copy_state *cs, struct fuse_req *req);
+void fuse_abort_pqueue(struct fuse_pqueue *fpq, struct list_head *to_end);
+
+/* dev_uring.c */
+
+struct io_uring_cmd;
+
+int fuse_uring_cmd(struct fuse_conn *fc, struct io_uring_cmd *cmd,
+		   unsigned int issue_flags);
+bool fuse_uring_queue_req(struct fuse_iqueue *fiq, struct fuse_req *req);
+bool fuse_uring_remove_pending_req(struct fuse_req *req);
+void fuse_uring_abort(struct fuse_conn *fc, struct list_head *to_end);
+void fuse_uring_destruct(struct fuse_conn *fc);
+
 /* dax.c */
 
 #define FUSE_IS_DAX(inode) (IS_ENABLED(CONFIG_FUSE_DAX) && IS_DAX(inode))
@@ -71,6 +71,7 @@
 #include <linux/sizes.h>
 #include <linux/hugetlb.h>
 #include <linux/highmem.h>
+#include <linux/vmalloc.h>
 #include <linux/namei.h>
 #include <linux/fsnotify.h>
 #include <linux/fadvise.h>
@@ -104,6 +105,11 @@
 #define IORING_MAX_RESTRICTIONS	(IORING_RESTRICTION_LAST + \
 				 IORING_REGISTER_LAST + IORING_OP_LAST)
 
+/* completions batched by a submission before they are flushed */
+#define IO_COMPL_BATCH		32
+/* freed requests that a ring keeps for its next submissions */
+#define IO_REQ_CACHE_SIZE	64
+
 struct io_uring {
 	u32 head ____cacheline_aligned_in_smp;
 	u32 tail ____cacheline_aligned_in_smp;
@@ -225,6 +231,15 @@ struct io_buffer {
 	__u16 bid;
 };
 
+/* a group of provided buffers registered as a ring, see io_uring_buf_ring */
+struct io_buffer_ring {
+	struct io_uring_buf_ring *br;
+	__u16 head;
+	__u16 mask;
+	int nr_pages;
+	struct page *pages[];
+};
+
 struct io_restriction {
 	DECLARE_BITMAP(register_op, IORING_REGISTER_LAST);
 	DECLARE_BITMAP(sqe_op, IORING_OP_LAST);
@@ -339,11 +354,18 @@ struct io_ring_ctx {
 	/* if all else fails... */
 	struct io_kiocb		*fallback_req;
 
+	/* freed requests for reuse, protected by ->uring_lock */
+	struct {
+		unsigned int		nr;
+		void			*reqs[IO_REQ_CACHE_SIZE];
+	} req_cache;
+
 #if defined(CONFIG_UNIX)
 	struct socket		*ring_sock;
 #endif
 
 	struct idr		io_buffer_idr;
+	struct idr		io_buf_ring_idr;
 
 	struct idr		personality_idr;
 
@@ -375,7 +397,11 @@ struct io_ring_ctx {
 		struct list_head	iopoll_list;
 		struct hlist_head	*cancel_hash;
 		unsigned		cancel_hash_bits;
+		/* IORING_OP_URING_CMD requests to cancel on exit */
+		struct hlist_head	uring_cmd_list;
 		bool			poll_multi_file;
+		/* shortest completion time seen, for hybrid IOPOLL */
+		u64			hybrid_poll_ns;
 
 		spinlock_t		inflight_lock;
 		struct list_head	inflight_list;
@@ -422,6 +448,7 @@ struct io_accept {
 	struct sockaddr __user		*addr;
 	int __user			*addr_len;
 	int				flags;
+	bool				multishot;
 	unsigned long			nofile;
 };
 
@@ -472,6 +499,9 @@ struct io_sr_msg {
 	int				msg_flags;
 	int				bgid;
 	size_t				len;
+	/* for multishot recv, as selecting a buffer shrinks len */
+	size_t				multishot_len;
+	bool				multishot;
 	struct io_buffer		*kbuf;
 };
 
@@ -665,6 +695,7 @@ struct io_kiocb {
 		struct io_splice	splice;
 		struct io_provide_buf	pbuf;
 		struct io_statx		statx;
+		struct io_uring_cmd	uring_cmd;
 		/* use only after cleaning per-op data, see io_clean_op() */
 		struct io_completion	compl;
 	};
@@ -677,6 +708,8 @@ struct io_kiocb {
 
 	u16				buf_index;
 	u32				result;
+	/* for hybrid IOPOLL, when the request was issued */
+	u64				iopoll_start;
 
 	struct io_ring_ctx		*ctx;
 	unsigned int			flags;
@@ -932,6 +965,10 @@ static const struct io_op_def io_op_defs[] = {
 		.hash_reg_file		= 1,
 		.unbound_nonreg_file	= 1,
 	},
+	[IORING_OP_URING_CMD] = {
+		.needs_file		= 1,
+		.work_flags		= IO_WQ_WORK_MM,
+	},
 };
 
 enum io_mem_account {
@@ -955,6 +992,7 @@ static void __io_clean_op(struct io_kiocb *req);
 static struct file *io_file_get(struct io_submit_state *state,
 				struct io_kiocb *req, int fd, bool fixed);
 static void __io_queue_sqe(struct io_kiocb *req, struct io_comp_state *cs);
+static void io_submit_flush_completions(struct io_comp_state *cs);
 static void io_file_put_work(struct work_struct *work);
 
 static ssize_t io_import_iovec(int rw, struct io_kiocb *req,
@@ -1165,11 +1203,14 @@ static struct io_ring_ctx *io_ring_ctx_alloc(struct io_uring_params *p)
 	init_completion(&ctx->ref_comp);
 	init_completion(&ctx->sq_thread_comp);
 	idr_init(&ctx->io_buffer_idr);
+	idr_init(&ctx->io_buf_ring_idr);
 	idr_init(&ctx->personality_idr);
 	mutex_init(&ctx->uring_lock);
 	init_waitqueue_head(&ctx->wait);
 	spin_lock_init(&ctx->completion_lock);
 	INIT_LIST_HEAD(&ctx->iopoll_list);
+	INIT_HLIST_HEAD(&ctx->uring_cmd_list);
+	ctx->hybrid_poll_ns = U64_MAX;
 	INIT_LIST_HEAD(&ctx->defer_list);
 	INIT_LIST_HEAD(&ctx->timeout_list);
 	init_waitqueue_head(&ctx->inflight_wait);
@@ -1740,37 +1781,31 @@ static void io_cqring_add_event(struct io_kiocb *req, long res, long cflags)
 	io_cqring_ev_posted(ctx);
 }
 
-static void io_submit_flush_completions(struct io_comp_state *cs)
+/*
+ * Post a CQE with IORING_CQE_F_MORE for a multishot request, which stays
+ * armed. A request can only be on the overflow list once, so this fails if
+ * the CQ ring is full, and the request must then complete for good.
+ */
+static bool io_cqring_fill_more(struct io_kiocb *req, long res, long cflags)
 {
-	struct io_ring_ctx *ctx = cs->ctx;
-
-	spin_lock_irq(&ctx->completion_lock);
-	while (!list_empty(&cs->list)) {
-		struct io_kiocb *req;
-
-		req = list_first_entry(&cs->list, struct io_kiocb, compl.list);
-		list_del(&req->compl.list);
-		__io_cqring_fill_event(req, req->result, req->compl.cflags);
+	struct io_ring_ctx *ctx = req->ctx;
+	struct io_uring_cqe *cqe;
+	unsigned long flags;
 
-		/*
-		 * io_free_req() doesn't care about completion_lock unless one
-		 * of these flags is set. REQ_F_WORK_INITIALIZED is in the list
-		 * because of a potential deadlock with req->work.fs->lock
-		 */
-		if (req->flags & (REQ_F_FAIL_LINK|REQ_F_LINK_TIMEOUT
-				 |REQ_F_WORK_INITIALIZED)) {
-			spin_unlock_irq(&ctx->completion_lock);
-			io_put_req(req);
-			spin_lock_irq(&ctx->completion_lock);
-		} else {
-			io_put_req(req);
-		}
+	spin_lock_irqsave(&ctx->completion_lock, flags);
+	cqe = io_get_cqring(ctx);
+	if (likely(cqe)) {
+		trace_io_uring_complete(ctx, req->user_data, res);
+		WRITE_ONCE(cqe->user_data, req->user_data);
+		WRITE_ONCE(cqe->res, res);
+		WRITE_ONCE(cqe->flags, cflags | IORING_CQE_F_MORE);
+		io_commit_cqring(ctx);
 	}
-	io_commit_cqring(ctx);
-	spin_unlock_irq(&ctx->completion_lock);
+	spin_unlock_irqrestore(&ctx->completion_lock, flags);
 
-	io_cqring_ev_posted(ctx);
-	cs->nr = 0;
+	if (likely(cqe))
+		io_cqring_ev_posted(ctx);
+	return cqe != NULL;
 }
 
 static void __io_req_complete(struct io_kiocb *req, long res, unsigned cflags,
@@ -1784,7 +1819,7 @@ static void __io_req_complete(struct io_kiocb *req, long res, unsigned cflags,
 		req->result = res;
 		req->compl.cflags = cflags;
 		list_add_tail(&req->compl.list, &cs->list);
-		if (++cs->nr >= 32)
+		if (++cs->nr >= IO_COMPL_BATCH)
 			io_submit_flush_completions(cs);
 	}
 }
@@ -1811,6 +1846,23 @@ static struct io_kiocb *io_get_fallback_req(struct io_ring_ctx *ctx)
 	return NULL;
 }
 
+/*
+ * Put freed requests in the ring's cache, and return how many of them fit.
+ * The submission and the inline completion paths both hold ->uring_lock,
+ * so requests go round between them without touching the slab allocator.
+ */
+static int io_req_cache_put(struct io_ring_ctx *ctx, void **reqs, int nr)
+{
+	int n = min_t(int, nr, IO_REQ_CACHE_SIZE - ctx->req_cache.nr);
+
+	lockdep_assert_held(&ctx->uring_lock);
+
+	memcpy(&ctx->req_cache.reqs[ctx->req_cache.nr], reqs,
+	       n * sizeof(*reqs));
+	ctx->req_cache.nr += n;
+	return n;
+}
+
 static struct io_kiocb *io_alloc_req(struct io_ring_ctx *ctx,
 				     struct io_submit_state *state)
 {
@@ -1820,6 +1872,16 @@ static struct io_kiocb *io_alloc_req(struct io_ring_ctx *ctx,
 		int ret;
 
 		sz = min_t(size_t, state->ios_left, ARRAY_SIZE(state->reqs));
+		if (ctx->req_cache.nr) {
+			ret = min_t(int, sz, ctx->req_cache.nr);
+			ctx->req_cache.nr -= ret;
+			memcpy(state->reqs,
+			       &ctx->req_cache.reqs[ctx->req_cache.nr],
+			       ret * sizeof(state->reqs[0]));
+			state->free_reqs = ret;
+			goto got_req;
+		}
+
 		ret = kmem_cache_alloc_bulk(req_cachep, gfp, sz, state->reqs);
 
 		/*
@@ -1834,7 +1896,7 @@ static struct io_kiocb *io_alloc_req(struct io_ring_ctx *ctx,
 		}
 		state->free_reqs = ret;
 	}
-
+got_req:
 	state->free_reqs--;
 	return state->reqs[state->free_reqs];
 fallback:
@@ -2117,7 +2179,10 @@ static inline void io_init_req_batch(struct req_batch *rb)
 static void __io_req_free_batch_flush(struct io_ring_ctx *ctx,
 				      struct req_batch *rb)
 {
-	kmem_cache_free_bulk(req_cachep, rb->to_free, rb->reqs);
+	int n = io_req_cache_put(ctx, rb->reqs, rb->to_free);
+
+	if (n < rb->to_free)
+		kmem_cache_free_bulk(req_cachep, rb->to_free - n, rb->reqs + n);
 	percpu_ref_put_many(&ctx->refs, rb->to_free);
 	rb->to_free = 0;
 }
@@ -2163,6 +2228,41 @@ static void io_req_free_batch(struct req_batch *rb, struct io_kiocb *req)
 		__io_req_free_batch_flush(req->ctx, rb);
 }
 
+static void io_submit_flush_completions(struct io_comp_state *cs)
+{
+	struct io_kiocb *reqs[IO_COMPL_BATCH];
+	struct io_ring_ctx *ctx = cs->ctx;
+	struct req_batch rb;
+	int i, nr = 0;
+
+	spin_lock_irq(&ctx->completion_lock);
+	while (!list_empty(&cs->list)) {
+		struct io_kiocb *req;
+
+		req = list_first_entry(&cs->list, struct io_kiocb, compl.list);
+		list_del(&req->compl.list);
+		__io_cqring_fill_event(req, req->result, req->compl.cflags);
+		reqs[nr++] = req;
+	}
+	io_commit_cqring(ctx);
+	spin_unlock_irq(&ctx->completion_lock);
+
+	io_cqring_ev_posted(ctx);
+
+	/*
+	 * Free outside of completion_lock, freeing takes it for linked
+	 * requests, and REQ_F_WORK_INITIALIZED requests take the
+	 * req->work.fs->lock. The requests go back to the ring's cache.
+	 */
+	io_init_req_batch(&rb);
+	for (i = 0; i < nr; i++) {
+		if (refcount_dec_and_test(&reqs[i]->refs))
+			io_req_free_batch(&rb, reqs[i]);
+	}
+	io_req_free_batch_finish(ctx, &rb);
+	cs->nr = 0;
+}
+
 /*
  * Drop reference to request, return next in chain (if there is one) if this
  * was the last reference to this request.
@@ -2340,6 +2440,13 @@ static void io_iopoll_complete(struct io_ring_ctx *ctx, unsigned int *nr_events,
 		if (req->flags & REQ_F_BUFFER_SELECTED)
 			cflags = io_put_rw_kbuf(req);
 
+		if (ctx->flags & IORING_SETUP_HYBRID_IOPOLL) {
+			u64 runtime = ktime_get_ns() - req->iopoll_start;
+
+			if (runtime < ctx->hybrid_poll_ns)
+				ctx->hybrid_poll_ns = runtime;
+		}
+
 		__io_cqring_fill_event(req, req->result, cflags);
 		(*nr_events)++;
 
@@ -2356,6 +2463,32 @@ static void io_iopoll_complete(struct io_ring_ctx *ctx, unsigned int *nr_events,
 		io_iopoll_queue(&again);
 }
 
+/*
+ * Sleep through the first half of the shortest completion time seen so far,
+ * rather than spinning on the device for all of it. Like the hybrid polling
+ * of blk-mq, half is an optimistic guess that the request won't be done any
+ * sooner. The shortest time is used, and not the mean, because the time is
+ * measured by polling: a sleep that overshoots can't make later sleeps any
+ * longer. The ring spins until it has seen its first completion.
+ */
+static void io_iopoll_hybrid_sleep(struct io_ring_ctx *ctx,
+				   struct io_kiocb *req)
+{
+	ktime_t kt;
+	u64 now;
+
+	if (ctx->hybrid_poll_ns == U64_MAX)
+		return;
+
+	now = ktime_get_ns();
+	if (now - req->iopoll_start >= ctx->hybrid_poll_ns / 2)
+		return;
+
+	kt = ns_to_ktime(req->iopoll_start + ctx->hybrid_poll_ns / 2 - now);
+	set_current_state(TASK_UNINTERRUPTIBLE);
+	schedule_hrtimeout(&kt, HRTIMER_MODE_REL);
+}
+
 static int io_do_iopoll(struct io_ring_ctx *ctx, unsigned int *nr_events,
 			long min)
 {
@@ -2386,6 +2519,14 @@ static int io_do_iopoll(struct io_ring_ctx *ctx, unsigned int *nr_events,
 		if (!list_empty(&done))
 			break;
 
+		if (spin && (ctx->flags & IORING_SETUP_HYBRID_IOPOLL)) {
+			io_iopoll_hybrid_sleep(ctx, req);
+			if (READ_ONCE(req->iopoll_completed)) {
+				list_move_tail(&req->inflight_entry, &done);
+				continue;
+			}
+		}
+
 		ret = kiocb->ki_filp->f_op->iopoll(kiocb, spin);
 		if (ret < 0)
 			break;
@@ -2645,6 +2786,9 @@ static void io_iopoll_req_issued(struct io_kiocb *req)
 {
 	struct io_ring_ctx *ctx = req->ctx;
 
+	if (ctx->flags & IORING_SETUP_HYBRID_IOPOLL)
+		req->iopoll_start = ktime_get_ns();
+
 	/*
 	 * Track whether we have multiple files in our lists. This will impact
 	 * how we do polling eventually, not spinning if we're on potentially
@@ -2943,10 +3087,47 @@ static void io_ring_submit_lock(struct io_ring_ctx *ctx, bool needs_lock)
 		mutex_lock(&ctx->uring_lock);
 }
 
+/*
+ * The application adds buffers to the ring without entering the kernel, so
+ * the entry is copied out the moment it is consumed, and the request then
+ * owns the copy exactly like a buffer from IORING_OP_PROVIDE_BUFFERS.
+ */
+static struct io_buffer *io_ring_buffer_select(struct io_buffer_ring *bl,
+					       size_t *len)
+{
+	struct io_uring_buf *buf;
+	struct io_buffer *kbuf;
+	__u16 tail;
+
+	/* pairs with the store of the tail, after the application's entry */
+	tail = smp_load_acquire(&bl->br->tail);
+	if (tail == bl->head)
+		return ERR_PTR(-ENOBUFS);
+
+	kbuf = kmalloc(sizeof(*kbuf), GFP_KERNEL);
+	if (!kbuf)
+		return ERR_PTR(-ENOMEM);
+
+	buf = &bl->br->bufs[bl->head & bl->mask];
+	kbuf->addr = READ_ONCE(buf->addr);
+	kbuf->len = min_t(__u32, READ_ONCE(buf->len), MAX_RW_COUNT);
+	kbuf->bid = READ_ONCE(buf->bid);
+	bl->head++;
+
+	if (!access_ok(u64_to_user_ptr(kbuf->addr), kbuf->len)) {
+		kfree(kbuf);
+		return ERR_PTR(-EFAULT);
+	}
+	if (*len > kbuf->len)
+		*len = kbuf->len;
+	return kbuf;
+}
+
 static struct io_buffer *io_buffer_select(struct io_kiocb *req, size_t *len,
 					  int bgid, struct io_buffer *kbuf,
 					  bool needs_lock)
 {
+	struct io_buffer_ring *bl;
 	struct io_buffer *head;
 
 	if (req->flags & REQ_F_BUFFER_SELECTED)
@@ -2969,7 +3150,8 @@ static struct io_buffer *io_buffer_select(struct io_kiocb *req, size_t *len,
 		if (*len > kbuf->len)
 			*len = kbuf->len;
 	} else {
-		kbuf = ERR_PTR(-ENOBUFS);
+		bl = idr_find(&req->ctx->io_buf_ring_idr, bgid);
+		kbuf = bl ? io_ring_buffer_select(bl, len) : ERR_PTR(-ENOBUFS);
 	}
 
 	io_ring_submit_unlock(req->ctx, needs_lock);
@@ -3691,6 +3873,174 @@ static int io_splice(struct io_kiocb *req, bool force_nonblock)
 	return 0;
 }
 
+static void io_uring_cmd_del_cancelable(struct io_kiocb *req)
+{
+	struct io_ring_ctx *ctx = req->ctx;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctx->completion_lock, flags);
+	hlist_del_init(&req->hash_node);
+	spin_unlock_irqrestore(&ctx->completion_lock, flags);
+}
+
+/**
+ * io_uring_cmd_done - complete an IORING_OP_URING_CMD request
+ * @ioucmd: the command
+ * @ret: the result, posted in cqe->res
+ *
+ * For commands that ->uring_cmd() left in flight by returning -EIOCBQUEUED.
+ * May be called from any context that can take a spinlock.
+ */
+void io_uring_cmd_done(struct io_uring_cmd *ioucmd, ssize_t ret)
+{
+	struct io_kiocb *req = container_of(ioucmd, struct io_kiocb, uring_cmd);
+
+	io_uring_cmd_del_cancelable(req);
+	if (ret < 0)
+		req_set_fail_links(req);
+	io_req_complete(req, ret);
+}
+EXPORT_SYMBOL_GPL(io_uring_cmd_done);
+
+static void io_uring_cmd_work(struct callback_head *cb)
+{
+	struct io_kiocb *req = container_of(cb, struct io_kiocb, task_work);
+	struct io_ring_ctx *ctx = req->ctx;
+	unsigned int issue_flags = 0;
+
+	/* io_req_task_work_add() failed, we are in the io-wq manager. */
+	if (current != req->task || __io_sq_thread_acquire_mm(ctx))
+		issue_flags |= IO_URING_F_TASK_DEAD;
+
+	req->uring_cmd.task_work_cb(&req->uring_cmd, issue_flags);
+	percpu_ref_put(&ctx->refs);
+}
+
+/**
+ * io_uring_cmd_complete_in_task - run a callback in the submitter's context
+ * @ioucmd: the command, in flight
+ * @task_work_cb: the callback
+ *
+ * Has @task_work_cb called from task_work of the task that submitted
+ * @ioucmd, with its mm, e.g. to copy to the buffers of the command before
+ * completing it. If that task is exiting, @task_work_cb is called from
+ * another kernel thread with IO_URING_F_TASK_DEAD set.
+ */
+void io_uring_cmd_complete_in_task(struct io_uring_cmd *ioucmd,
+		void (*task_work_cb)(struct io_uring_cmd *, unsigned int))
+{
+	struct io_kiocb *req = container_of(ioucmd, struct io_kiocb, uring_cmd);
+	int ret;
+
+	ioucmd->task_work_cb = task_work_cb;
+	init_task_work(&req->task_work, io_uring_cmd_work);
+	percpu_ref_get(&req->ctx->refs);
+
+	ret = io_req_task_work_add(req, true);
+	if (unlikely(ret)) {
+		struct task_struct *tsk;
+
+		tsk = io_wq_get_task(req->ctx->io_wq);
+		task_work_add(tsk, &req->task_work, TWA_NONE);
+		wake_up_process(tsk);
+	}
+}
+EXPORT_SYMBOL_GPL(io_uring_cmd_complete_in_task);
+
+/**
+ * io_uring_cmd_mark_cancelable - cancel a command when its ring or task exits
+ * @ioucmd: the command, in flight
+ *
+ * For commands that may stay in flight indefinitely. When the ring is torn
+ * down or the submitting task exits, ->uring_cmd() is called again with
+ * IO_URING_F_CANCEL, and must complete the command unless it is already
+ * being completed.
+ */
+void io_uring_cmd_mark_cancelable(struct io_uring_cmd *ioucmd)
+{
+	struct io_kiocb *req = container_of(ioucmd, struct io_kiocb, uring_cmd);
+	struct io_ring_ctx *ctx = req->ctx;
+
+	spin_lock_irq(&ctx->completion_lock);
+	if (hlist_unhashed(&req->hash_node))
+		hlist_add_head(&req->hash_node, &ctx->uring_cmd_list);
+	spin_unlock_irq(&ctx->completion_lock);
+}
+EXPORT_SYMBOL_GPL(io_uring_cmd_mark_cancelable);
+
+/*
+ * Returns true if we found and cancelled one or more commands
+ */
+static bool io_uring_cmd_cancel_all(struct io_ring_ctx *ctx,
+				    struct task_struct *tsk)
+{
+	struct io_kiocb *req;
+	bool found = false;
+
+	for (;;) {
+		spin_lock_irq(&ctx->completion_lock);
+		hlist_for_each_entry(req, &ctx->uring_cmd_list, hash_node) {
+			if (io_task_match(req, tsk))
+				break;
+		}
+		if (req) {
+			hlist_del_init(&req->hash_node);
+			/* may be completed as soon as we drop the lock */
+			refcount_inc(&req->refs);
+		}
+		spin_unlock_irq(&ctx->completion_lock);
+
+		if (!req)
+			return found;
+
+		req->file->f_op->uring_cmd(&req->uring_cmd, IO_URING_F_CANCEL);
+		io_put_req(req);
+		found = true;
+	}
+}
+
+static int io_uring_cmd_prep(struct io_kiocb *req,
+			     const struct io_uring_sqe *sqe)
+{
+	struct io_uring_cmd *ioucmd = &req->uring_cmd;
+
+	if (unlikely(req->ctx->flags & IORING_SETUP_IOPOLL))
+		return -EINVAL;
+	if (sqe->ioprio || sqe->uring_cmd_flags || sqe->buf_index ||
+	    sqe->splice_fd_in)
+		return -EINVAL;
+	if (!req->file->f_op->uring_cmd)
+		return -EOPNOTSUPP;
+
+	ioucmd->cmd_op = READ_ONCE(sqe->cmd_op);
+	ioucmd->addr = READ_ONCE(sqe->addr);
+	ioucmd->len = READ_ONCE(sqe->len);
+	memcpy(ioucmd->cmd, sqe->cmd, sizeof(ioucmd->cmd));
+	INIT_HLIST_NODE(&req->hash_node);
+	return 0;
+}
+
+static int io_uring_cmd(struct io_kiocb *req, bool force_nonblock,
+			struct io_comp_state *cs)
+{
+	struct io_uring_cmd *ioucmd = &req->uring_cmd;
+	int ret;
+
+	ret = req->file->f_op->uring_cmd(ioucmd, force_nonblock ?
+					 IO_URING_F_NONBLOCK : 0);
+	if (ret == -EAGAIN && force_nonblock)
+		return -EAGAIN;
+	/* completed, or to be completed, through io_uring_cmd_done() */
+	if (ret == -EIOCBQUEUED)
+		return 0;
+
+	io_uring_cmd_del_cancelable(req);
+	if (ret < 0)
+		req_set_fail_links(req);
+	__io_req_complete(req, ret, 0, cs);
+	return 0;
+}
+
 /*
  * IORING_OP_NOP just posts a completion event, nothing else.
  */
@@ -4007,6 +4357,11 @@ static int io_provide_buffers(struct io_kiocb *req, bool force_nonblock,
 
 	lockdep_assert_held(&ctx->uring_lock);
 
+	/* the group's buffers come from a registered ring */
+	ret = -EEXIST;
+	if (idr_find(&ctx->io_buf_ring_idr, p->bgid))
+		goto out;
+
 	list = head = idr_find(&ctx->io_buffer_idr, p->bgid);
 
 	ret = io_add_buffers(p, &head);
@@ -4537,6 +4892,7 @@ static int io_recvmsg_prep(struct io_kiocb *req,
 {
 	struct io_async_msghdr *async_msg = req->async_data;
 	struct io_sr_msg *sr = &req->sr_msg;
+	unsigned int flags;
 	int ret;
 
 	if (unlikely(req->ctx->flags & IORING_SETUP_IOPOLL))
@@ -4547,6 +4903,16 @@ static int io_recvmsg_prep(struct io_kiocb *req,
 	sr->len = READ_ONCE(sqe->len);
 	sr->bgid = READ_ONCE(sqe->buf_group);
 
+	/* each CQE of a multishot recv needs a buffer of its own */
+	flags = READ_ONCE(sqe->ioprio);
+	if (flags & ~IORING_RECV_MULTISHOT)
+		return -EINVAL;
+	sr->multishot = flags & IORING_RECV_MULTISHOT;
+	if (sr->multishot && (req->opcode != IORING_OP_RECV ||
+			      !(req->flags & REQ_F_BUFFER_SELECT)))
+		return -EINVAL;
+	sr->multishot_len = sr->len;
+
 #ifdef CONFIG_COMPAT
 	if (req->ctx->compat)
 		sr->msg_flags |= MSG_CMSG_COMPAT;
@@ -4636,6 +5002,7 @@ static int io_recv(struct io_kiocb *req, bool force_nonblock,
 	if (unlikely(!sock))
 		return ret;
 
+retry:
 	if (req->flags & REQ_F_BUFFER_SELECT) {
 		kbuf = io_recv_buffer_select(req, !force_nonblock);
 		if (IS_ERR(kbuf))
@@ -4661,13 +5028,28 @@ static int io_recv(struct io_kiocb *req, bool force_nonblock,
 		flags |= MSG_DONTWAIT;
 
 	ret = sock_recvmsg(sock, &msg, flags);
-	if (force_nonblock && ret == -EAGAIN)
+	if (force_nonblock && ret == -EAGAIN) {
+		/* let __io_queue_sqe() arm a new poll handler */
+		if (sr->multishot)
+			req->flags &= ~REQ_F_POLLED;
 		return -EAGAIN;
+	}
 	if (ret == -ERESTARTSYS)
 		ret = -EINTR;
 out_free:
 	if (req->flags & REQ_F_BUFFER_SELECTED)
 		cflags = io_put_recv_kbuf(req);
+	/*
+	 * Keep receiving until the socket runs dry. io-wq has no way to wait
+	 * for the next event without blocking a worker, so a multishot recv
+	 * that got punted there completes after the first one.
+	 */
+	if (sr->multishot && force_nonblock && ret > 0 &&
+	    io_cqring_fill_more(req, ret, cflags)) {
+		sr->len = sr->multishot_len;
+		cflags = 0;
+		goto retry;
+	}
 	if (ret < 0)
 		req_set_fail_links(req);
 	__io_req_complete(req, ret, cflags, cs);
@@ -4677,16 +5059,25 @@ static int io_recv(struct io_kiocb *req, bool force_nonblock,
 static int io_accept_prep(struct io_kiocb *req, const struct io_uring_sqe *sqe)
 {
 	struct io_accept *accept = &req->accept;
+	unsigned int flags;
 
 	if (unlikely(req->ctx->flags & (IORING_SETUP_IOPOLL|IORING_SETUP_SQPOLL)))
 		return -EINVAL;
-	if (sqe->ioprio || sqe->len || sqe->buf_index)
+	if (sqe->len || sqe->buf_index)
+		return -EINVAL;
+	flags = READ_ONCE(sqe->ioprio);
+	if (flags & ~IORING_ACCEPT_MULTISHOT)
 		return -EINVAL;
 
 	accept->addr = u64_to_user_ptr(READ_ONCE(sqe->addr));
 	accept->addr_len = u64_to_user_ptr(READ_ONCE(sqe->addr2));
 	accept->flags = READ_ONCE(sqe->accept_flags);
 	accept->nofile = rlimit(RLIMIT_NOFILE);
+	accept->multishot = flags & IORING_ACCEPT_MULTISHOT;
+
+	/* every connection would overwrite the address of the previous one */
+	if (accept->multishot && accept->addr)
+		return -EINVAL;
 	return 0;
 }
 
@@ -4697,14 +5088,24 @@ static int io_accept(struct io_kiocb *req, bool force_nonblock,
 	unsigned int file_flags = force_nonblock ? O_NONBLOCK : 0;
 	int ret;
 
-	if (req->file->f_flags & O_NONBLOCK)
+	/* a multishot accept waits for connections on any listening socket */
+	if ((req->file->f_flags & O_NONBLOCK) && !accept->multishot)
 		req->flags |= REQ_F_NOWAIT;
 
+retry:
 	ret = __sys_accept4_file(req->file, file_flags, accept->addr,
 					accept->addr_len, accept->flags,
 					accept->nofile);
-	if (ret == -EAGAIN && force_nonblock)
+	if (ret == -EAGAIN && force_nonblock) {
+		/* let __io_queue_sqe() arm a new poll handler */
+		if (accept->multishot)
+			req->flags &= ~REQ_F_POLLED;
 		return -EAGAIN;
+	}
+	/* like multishot recv, a multishot accept punted to io-wq stops here */
+	if (accept->multishot && force_nonblock && ret >= 0 &&
+	    io_cqring_fill_more(req, ret, 0))
+		goto retry;
 	if (ret < 0) {
 		if (ret == -ERESTARTSYS)
 			ret = -EINTR;
@@ -5759,6 +6160,8 @@ static int io_req_prep(struct io_kiocb *req, const struct io_uring_sqe *sqe)
 		return io_remove_buffers_prep(req, sqe);
 	case IORING_OP_TEE:
 		return io_tee_prep(req, sqe);
+	case IORING_OP_URING_CMD:
+		return io_uring_cmd_prep(req, sqe);
 	}
 
 	printk_once(KERN_WARNING "io_uring: unhandled opcode %d\n",
@@ -6002,6 +6405,9 @@ static int io_issue_sqe(struct io_kiocb *req, bool force_nonblock,
 	case IORING_OP_TEE:
 		ret = io_tee(req, force_nonblock);
 		break;
+	case IORING_OP_URING_CMD:
+		ret = io_uring_cmd(req, force_nonblock, cs);
+		break;
 	default:
 		ret = -EINVAL;
 		break;
@@ -6365,8 +6771,14 @@ static void io_submit_state_end(struct io_submit_state *state)
 		io_submit_flush_completions(&state->comp);
 	blk_finish_plug(&state->plug);
 	io_state_file_put(state);
-	if (state->free_reqs)
-		kmem_cache_free_bulk(req_cachep, state->free_reqs, state->reqs);
+	if (state->free_reqs) {
+		int n = io_req_cache_put(state->comp.ctx, state->reqs,
+					 state->free_reqs);
+
+		if (n < state->free_reqs)
+			kmem_cache_free_bulk(req_cachep, state->free_reqs - n,
+					     state->reqs + n);
+	}
 }
 
 /*
@@ -6375,7 +6787,7 @@ static void io_submit_state_end(struct io_submit_state *state)
 static void io_submit_state_start(struct io_submit_state *state,
 				  struct io_ring_ctx *ctx, unsigned int max_ios)
 {
-	blk_start_plug(&state->plug);
+	blk_start_plug_nr_ios(&state->plug, max_ios);
 	state->comp.nr = 0;
 	INIT_LIST_HEAD(&state->comp.list);
 	state->comp.ctx = ctx;
@@ -6634,6 +7046,9 @@ static int io_sq_wake_function(struct wait_queue_entry *wqe, unsigned mode,
 	return ret;
 }
 
+/* the most SQEs an sq thread submits from a ring before moving to the next */
+#define IORING_SQPOLL_CAP_ENTRIES	8
+
 enum sq_ret {
 	SQT_IDLE	= 1,
 	SQT_SPIN	= 2,
@@ -6710,8 +7125,8 @@ static enum sq_ret __io_sq_thread(struct io_ring_ctx *ctx,
 	io_ring_clear_wakeup_flag(ctx);
 
 	/* if we're handling multiple rings, cap submit size for fairness */
-	if (cap_entries && to_submit > 8)
-		to_submit = 8;
+	if (cap_entries && to_submit > IORING_SQPOLL_CAP_ENTRIES)
+		to_submit = IORING_SQPOLL_CAP_ENTRIES;
 
 	mutex_lock(&ctx->uring_lock);
 	if (likely(!percpu_ref_is_dying(&ctx->refs)))
@@ -6780,6 +7195,22 @@ static int io_sq_thread(void *data)
 			io_sq_thread_drop_mm();
 		}
 
+		/*
+		 * Start the next pass from the following ring, so that the
+		 * first ring on the list doesn't always get to submit first.
+		 */
+		if (cap_entries)
+			list_rotate_left(&sqd->ctx_list);
+
+		/*
+		 * The idle period counts from the last time that any of the
+		 * rings had work, not from the last wakeup, so that a thread
+		 * serving busy rings keeps polling through short gaps instead
+		 * of going to sleep as soon as they all happen to be empty.
+		 */
+		if (ret & SQT_DID_WORK)
+			start_jiffies = jiffies;
+
 		if (ret & SQT_SPIN) {
 			io_run_task_work();
 			cond_resched();
@@ -8245,10 +8676,127 @@ static int __io_destroy_buffers(int id, void *p, void *data)
 	return 0;
 }
 
+static void io_free_buf_ring(struct io_ring_ctx *ctx,
+			     struct io_buffer_ring *bl)
+{
+	vunmap(bl->br);
+	unpin_user_pages(bl->pages, bl->nr_pages);
+	io_unaccount_mem(ctx, bl->nr_pages, ACCT_PINNED);
+	kfree(bl);
+}
+
+static int __io_destroy_buf_ring(int id, void *p, void *data)
+{
+	io_free_buf_ring(data, p);
+	return 0;
+}
+
 static void io_destroy_buffers(struct io_ring_ctx *ctx)
 {
 	idr_for_each(&ctx->io_buffer_idr, __io_destroy_buffers, ctx);
 	idr_destroy(&ctx->io_buffer_idr);
+	idr_for_each(&ctx->io_buf_ring_idr, __io_destroy_buf_ring, ctx);
+	idr_destroy(&ctx->io_buf_ring_idr);
+}
+
+static int io_register_pbuf_ring(struct io_ring_ctx *ctx, void __user *arg)
+{
+	struct io_uring_buf_reg reg;
+	struct vm_area_struct **vmas;
+	struct io_buffer_ring *bl;
+	unsigned long size;
+	int i, nr_pages, pret = 0, ret;
+
+	if (copy_from_user(&reg, arg, sizeof(reg)))
+		return -EFAULT;
+	if (reg.pad || reg.resv[0] || reg.resv[1] || reg.resv[2])
+		return -EINVAL;
+	if (!reg.ring_addr || (reg.ring_addr & ~PAGE_MASK))
+		return -EINVAL;
+	/* the head and the tail are 16 bits wide */
+	if (!is_power_of_2(reg.ring_entries) || reg.ring_entries > 32768)
+		return -EINVAL;
+	if (idr_find(&ctx->io_buffer_idr, reg.bgid) ||
+	    idr_find(&ctx->io_buf_ring_idr, reg.bgid))
+		return -EEXIST;
+
+	size = reg.ring_entries * sizeof(struct io_uring_buf);
+	nr_pages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+	bl = kzalloc(struct_size(bl, pages, nr_pages), GFP_KERNEL);
+	vmas = kcalloc(nr_pages, sizeof(*vmas), GFP_KERNEL);
+	ret = -ENOMEM;
+	if (!bl || !vmas)
+		goto err;
+
+	ret = 0;
+	mmap_read_lock(current->mm);
+	pret = pin_user_pages(reg.ring_addr, nr_pages,
+			      FOLL_WRITE | FOLL_LONGTERM, bl->pages, vmas);
+	if (pret == nr_pages) {
+		/* don't support file backed memory */
+		for (i = 0; i < nr_pages; i++) {
+			if (vmas[i]->vm_file &&
+			    !is_file_hugepages(vmas[i]->vm_file)) {
+				ret = -EOPNOTSUPP;
+				break;
+			}
+		}
+	} else {
+		ret = pret < 0 ? pret : -EFAULT;
+	}
+	mmap_read_unlock(current->mm);
+	if (ret)
+		goto err_unpin;
+
+	ret = io_account_mem(ctx, nr_pages, ACCT_PINNED);
+	if (ret)
+		goto err_unpin;
+
+	ret = -ENOMEM;
+	bl->br = vmap(bl->pages, nr_pages, VM_MAP, PAGE_KERNEL);
+	if (!bl->br)
+		goto err_unaccount;
+	bl->nr_pages = nr_pages;
+	bl->mask = reg.ring_entries - 1;
+
+	ret = idr_alloc(&ctx->io_buf_ring_idr, bl, reg.bgid, reg.bgid + 1,
+			GFP_KERNEL);
+	if (ret < 0)
+		goto err_vunmap;
+
+	kfree(vmas);
+	return 0;
+
+err_vunmap:
+	vunmap(bl->br);
+err_unaccount:
+	io_unaccount_mem(ctx, nr_pages, ACCT_PINNED);
+err_unpin:
+	if (pret > 0)
+		unpin_user_pages(bl->pages, pret);
+err:
+	kfree(vmas);
+	kfree(bl);
+	return ret;
+}
+
+static int io_unregister_pbuf_ring(struct io_ring_ctx *ctx, void __user *arg)
+{
+	struct io_uring_buf_reg reg;
+	struct io_buffer_ring *bl;
+
+	if (copy_from_user(&reg, arg, sizeof(reg)))
+		return -EFAULT;
+	if (reg.ring_addr || reg.ring_entries || reg.pad ||
+	    reg.resv[0] || reg.resv[1] || reg.resv[2])
+		return -EINVAL;
+
+	bl = idr_remove(&ctx->io_buf_ring_idr, reg.bgid);
+	if (!bl)
+		return -ENOENT;
+
+	io_free_buf_ring(ctx, bl);
+	return 0;
 }
 
 static void io_ring_ctx_free(struct io_ring_ctx *ctx)
@@ -8288,6 +8836,7 @@ static void io_ring_ctx_free(struct io_ring_ctx *ctx)
 	put_cred(ctx->creds);
 	kfree(ctx->cancel_hash);
 	kmem_cache_free(req_cachep, ctx->fallback_req);
+	kmem_cache_free_bulk(req_cachep, ctx->req_cache.nr, ctx->req_cache.reqs);
 	kfree(ctx);
 }
 
@@ -8358,6 +8907,7 @@ static void io_ring_ctx_wait_and_kill(struct io_ring_ctx *ctx)
 
 	io_kill_timeouts(ctx, NULL);
 	io_poll_remove_all(ctx, NULL);
+	io_uring_cmd_cancel_all(ctx, NULL);
 
 	if (ctx->io_wq)
 		io_wq_cancel_all(ctx->io_wq);
@@ -8615,6 +9165,7 @@ static bool __io_uring_cancel_task_requests(struct io_ring_ctx *ctx,
 
 		ret |= io_poll_remove_all(ctx, task);
 		ret |= io_kill_timeouts(ctx, task);
+		ret |= io_uring_cmd_cancel_all(ctx, task);
 	}
 
 	return ret;
@@ -9379,7 +9930,10 @@ static long io_uring_setup(u32 entries, struct io_uring_params __user *params)
 	if (p.flags & ~(IORING_SETUP_IOPOLL | IORING_SETUP_SQPOLL |
 			IORING_SETUP_SQ_AFF | IORING_SETUP_CQSIZE |
 			IORING_SETUP_CLAMP | IORING_SETUP_ATTACH_WQ |
-			IORING_SETUP_R_DISABLED))
+			IORING_SETUP_R_DISABLED | IORING_SETUP_HYBRID_IOPOLL))
+		return -EINVAL;
+	if ((p.flags & IORING_SETUP_HYBRID_IOPOLL) &&
+	    !(p.flags & IORING_SETUP_IOPOLL))
 		return -EINVAL;
 
 	return  io_uring_create(entries, &p, params);
@@ -9558,6 +10112,8 @@ static bool io_register_op_must_quiesce(int op)
 	case IORING_REGISTER_PROBE:
 	case IORING_REGISTER_PERSONALITY:
 	case IORING_UNREGISTER_PERSONALITY:
+	case IORING_REGISTER_PBUF_RING:
+	case IORING_UNREGISTER_PBUF_RING:
 		return false;
 	default:
 		return true;
@@ -9688,6 +10244,18 @@ static int __io_uring_register(struct io_ring_ctx *ctx, unsigned opcode,
 	case IORING_REGISTER_RESTRICTIONS:
 		ret = io_register_restrictions(ctx, arg, nr_args);
 		break;
+	case IORING_REGISTER_PBUF_RING:
+		ret = -EINVAL;
+		if (!arg || nr_args != 1)
+			break;
+		ret = io_register_pbuf_ring(ctx, arg);
+		break;
+	case IORING_UNREGISTER_PBUF_RING:
+		ret = -EINVAL;
+		if (!arg || nr_args != 1)
+			break;
+		ret = io_unregister_pbuf_ring(ctx, arg);
+		break;
 	default:
 		ret = -EINVAL;
 		break;
@@ -9746,6 +10314,7 @@ static int __init io_uring_init(void)
 	BUILD_BUG_SQE_ELEM(4,  __s32,  fd);
 	BUILD_BUG_SQE_ELEM(8,  __u64,  off);
 	BUILD_BUG_SQE_ELEM(8,  __u64,  addr2);
+	BUILD_BUG_SQE_ELEM(8,  __u32,  cmd_op);
 	BUILD_BUG_SQE_ELEM(16, __u64,  addr);
 	BUILD_BUG_SQE_ELEM(16, __u64,  splice_off_in);
 	BUILD_BUG_SQE_ELEM(24, __u32,  len);
@@ -9764,10 +10333,12 @@ static int __init io_uring_init(void)
 	BUILD_BUG_SQE_ELEM(28, __u32,  statx_flags);
 	BUILD_BUG_SQE_ELEM(28, __u32,  fadvise_advice);
 	BUILD_BUG_SQE_ELEM(28, __u32,  splice_flags);
+	BUILD_BUG_SQE_ELEM(28, __u32,  uring_cmd_flags);
 	BUILD_BUG_SQE_ELEM(32, __u64,  user_data);
 	BUILD_BUG_SQE_ELEM(40, __u16,  buf_index);
 	BUILD_BUG_SQE_ELEM(42, __u16,  personality);
 	BUILD_BUG_SQE_ELEM(44, __s32,  splice_fd_in);
+	BUILD_BUG_ON(offsetof(struct io_uring_sqe, cmd) != 48);
 
 	BUILD_BUG_ON(ARRAY_SIZE(io_op_defs) != IORING_OP_LAST);
 	BUILD_BUG_ON(__REQ_F_LAST_BIT >= 8 * sizeof(int));
@@ -193,6 +193,11 @@ struct shash_desc {
  * @descsize: Size of the operational state for the message digest. This state
  * 	      size is the memory size that needs to be allocated for
  *	      shash_desc.__ctx
+ * @finup_mb: Optional. Finish up to @mb_max_msgs messages of the same length
+ *	      from the state in the descriptor, interleaving their
+ *	      computation. May return -EOPNOTSUPP to have them hashed one by
+ *	      one instead, e.g. when SIMD is not usable.
+ * @mb_max_msgs: The maximum number of messages @finup_mb accepts.
  * @base: internally used
  */
 struct shash_alg {
@@ -210,8 +215,12 @@ struct shash_alg {
 		      unsigned int keylen);
 	int (*init_tfm)(struct crypto_shash *tfm);
 	void (*exit_tfm)(struct crypto_shash *tfm);
+	int (*finup_mb)(struct shash_desc *desc, const u8 * const data[],
+			unsigned int len, u8 * const outs[],
+			unsigned int num_msgs);
 
 	unsigned int descsize;
+	unsigned int mb_max_msgs;
 
 	/* These fields must match hash_alg_common. */
 	unsigned int digestsize
@@ -992,6 +1001,39 @@ int crypto_shash_final(struct shash_desc *desc, u8 *out);
 int crypto_shash_finup(struct shash_desc *desc, const u8 *data,
 		       unsigned int len, u8 *out);
 
+/**
+ * crypto_shash_mb_max_msgs() - number of messages hashed in parallel
+ * @tfm: hash algorithm handle
+ *
+ * Return: the number of messages crypto_shash_finup_mb() can interleave, 1
+ *	   if the algorithm has no multi-buffer implementation.
+ */
+static inline unsigned int crypto_shash_mb_max_msgs(struct crypto_shash *tfm)
+{
+	return crypto_shash_alg(tfm)->mb_max_msgs;
+}
+
+/**
+ * crypto_shash_finup_mb() - calculate the message digests of several buffers
+ * @desc: see crypto_shash_final(), the state all the messages start from
+ * @data: the messages, all @len bytes long
+ * @len: see crypto_shash_update()
+ * @outs: the buffers the message digests are stored into
+ * @num_msgs: the number of messages
+ *
+ * Finish each message from the state in @desc, which usually holds a common
+ * prefix such as a salt, as if by crypto_shash_finup() on a copy of @desc.
+ * Up to crypto_shash_mb_max_msgs() messages are hashed in parallel, which
+ * keeps the hashing units busy that a single message leaves idle.
+ *
+ * Context: Any context.
+ * Return: 0 if the message digest creation was successful; < 0 if an error
+ *	   occurred
+ */
+int crypto_shash_finup_mb(struct shash_desc *desc, const u8 * const data[],
+			  unsigned int len, u8 * const outs[],
+			  unsigned int num_msgs);
+
 static inline void shash_desc_zero(struct shash_desc *desc)
 {
 	memzero_explicit(desc,
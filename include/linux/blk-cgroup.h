@@ -60,9 +60,17 @@ struct blkcg {
 #endif
 };
 
+/*
+ * Bucket 0 of the read and write latency histograms counts the requests that
+ * completed in less than 2us, bucket i those that took [2^i, 2^(i+1)) us, and
+ * the last one everything above.
+ */
+#define BLKG_LAT_BUCKETS	20
+
 struct blkg_iostat {
 	u64				bytes[BLKG_IOSTAT_NR];
 	u64				ios[BLKG_IOSTAT_NR];
+	u64				lat[BLKG_IOSTAT_DISCARD][BLKG_LAT_BUCKETS];
 };
 
 struct blkg_iostat_set {
@@ -600,6 +608,9 @@ static inline void blkcg_clear_delay(struct blkcg_gq *blkg)
 }
 
 void blk_cgroup_bio_start(struct bio *bio);
+void blk_cgroup_rq_start(struct request *rq);
+void blk_cgroup_rq_merged(struct request *rq);
+void blk_cgroup_rq_done(struct request *rq, u64 now);
 void blkcg_add_delay(struct blkcg_gq *blkg, u64 now, u64 delta);
 void blkcg_schedule_throttle(struct request_queue *q, bool use_memdelay);
 void blkcg_maybe_throttle_current(void);
@@ -654,6 +665,9 @@ static inline void blkg_put(struct blkcg_gq *blkg) { }
 static inline bool blkcg_punt_bio_submit(struct bio *bio) { return false; }
 static inline void blkcg_bio_issue_init(struct bio *bio) { }
 static inline void blk_cgroup_bio_start(struct bio *bio) { }
+static inline void blk_cgroup_rq_start(struct request *rq) { }
+static inline void blk_cgroup_rq_merged(struct request *rq) { }
+static inline void blk_cgroup_rq_done(struct request *rq, u64 now) { }
 
 #define blk_queue_for_each_rl(rl, q)	\
 	for ((rl) = &(q)->root_rl; (rl); (rl) = NULL)
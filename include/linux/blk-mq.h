@@ -502,6 +502,51 @@ void blk_mq_kick_requeue_list(struct request_queue *q);
 void blk_mq_delay_kick_requeue_list(struct request_queue *q, unsigned long msecs);
 void blk_mq_complete_request(struct request *rq);
 bool blk_mq_complete_request_remote(struct request *rq);
+
+/**
+ * struct io_comp_batch - requests completed by a driver, to be ended together
+ * @req_list: the requests, linked through rq_next
+ * @need_ts: whether any of the requests needs a completion time stamp
+ * @complete: driver callback that ends the batch, by finishing its part of
+ *	each request and then calling blk_mq_end_request_batch()
+ *
+ * A driver that completes more than one request at a time, e.g. when it
+ * processes a completion queue, collects them with blk_mq_add_to_batch(),
+ * and calls ->complete once it is done.
+ */
+struct io_comp_batch {
+	struct request *req_list;
+	bool need_ts;
+	void (*complete)(struct io_comp_batch *);
+};
+
+#define DEFINE_IO_COMP_BATCH(name)	struct io_comp_batch name = { }
+
+#define rq_list_for_each(listptr, pos)			\
+	for (pos = *(listptr); pos; pos = pos->rq_next)
+
+/*
+ * Only the successful completions of requests that go straight back to the
+ * tag set can be batched: no I/O scheduler and no ->end_io.
+ */
+static inline bool blk_mq_add_to_batch(struct request *req,
+				       struct io_comp_batch *iob, int ioerror,
+				       void (*complete)(struct io_comp_batch *))
+{
+	if (!iob || ioerror || req->end_io || req->q->elevator)
+		return false;
+
+	if (!iob->complete)
+		iob->complete = complete;
+	else if (iob->complete != complete)
+		return false;
+	iob->need_ts |= !!(req->rq_flags & (RQF_IO_STAT | RQF_STATS));
+	req->rq_next = iob->req_list;
+	iob->req_list = req;
+	return true;
+}
+
+void blk_mq_end_request_batch(struct io_comp_batch *iob);
 bool blk_mq_queue_stopped(struct request_queue *q);
 void blk_mq_stop_hw_queue(struct blk_mq_hw_ctx *hctx);
 void blk_mq_start_hw_queue(struct blk_mq_hw_ctx *hctx);
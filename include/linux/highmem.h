@@ -8,6 +8,7 @@
 #include <linux/mm.h>
 #include <linux/uaccess.h>
 #include <linux/hardirq.h>
+#include <linux/zeroed_pool.h>
 
 #include <asm/cacheflush.h>
 
@@ -183,6 +184,11 @@ static inline struct page *
 alloc_zeroed_user_highpage_movable(struct vm_area_struct *vma,
 					unsigned long vaddr)
 {
+	struct page *page = zeroed_pool_alloc(vma, vaddr);
+
+	if (page)
+		return page;
+
 	return __alloc_zeroed_user_highpage(__GFP_MOVABLE, vma, vaddr);
 }
 
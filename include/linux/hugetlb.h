@@ -492,6 +492,12 @@ struct hstate {
 	unsigned int nr_huge_pages_node[MAX_NUMNODES];
 	unsigned int free_huge_pages_node[MAX_NUMNODES];
 	unsigned int surplus_huge_pages_node[MAX_NUMNODES];
+	/* zero the free pages in the background */
+	bool prezero;
+#ifdef CONFIG_HUGETLB_PAGE_FREE_VMEMMAP
+	/* vmemmap pages freed for each huge page of the pool */
+	unsigned int nr_free_vmemmap_pages;
+#endif
 #ifdef CONFIG_CGROUP_HUGETLB
 	/* cgroup control files */
 	struct cftype cgroup_files_dfl[7];
@@ -513,6 +519,8 @@ struct page *alloc_huge_page_vma(struct hstate *h, struct vm_area_struct *vma,
 				unsigned long address);
 int huge_add_to_page_cache(struct page *page, struct address_space *mapping,
 			pgoff_t idx);
+void clear_huge_page_unless_zeroed(struct hstate *h, struct page *page,
+				   unsigned long addr);
 
 /* arch callback */
 int __init __alloc_bootmem_huge_page(struct hstate *h);
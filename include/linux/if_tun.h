@@ -8,6 +8,7 @@
 
 #include <uapi/linux/if_tun.h>
 #include <uapi/linux/virtio_net.h>
+#include <linux/uio.h>
 
 #define TUN_XDP_FLAG 0x1UL
 
@@ -19,6 +20,17 @@ struct tun_msg_ctl {
 	void *ptr;
 };
 
+/*
+ * recvmsg() receives a batch of packets consumed from the ptr_ring when
+ * msg_control points to a tun_msg_ctl of type TUN_MSG_PTR, and msg_controllen
+ * is set to its size. ptr then points to an array of num tun_msg_rx.
+ */
+struct tun_msg_rx {
+	void *ptr;		/* skb or XDP frame consumed from the ring */
+	struct iov_iter iter;	/* where the packet is copied to */
+	int len;		/* set to the packet length, or -errno */
+};
+
 struct tun_xdp_hdr {
 	int buflen;
 	struct virtio_net_hdr gso;
@@ -39,9 +39,11 @@
 #define DMA_PTE_WRITE		BIT_ULL(1)
 #define DMA_PTE_LARGE_PAGE	BIT_ULL(7)
 #define DMA_PTE_SNP		BIT_ULL(11)
+#define DMA_SL_PTE_DIRTY_BIT	9
 
 #define DMA_FL_PTE_PRESENT	BIT_ULL(0)
 #define DMA_FL_PTE_US		BIT_ULL(2)
+#define DMA_FL_PTE_DIRTY_BIT	6
 #define DMA_FL_PTE_XD		BIT_ULL(63)
 
 #define ADDR_WIDTH_5LEVEL	(57)
@@ -171,6 +173,7 @@
 #define ecap_smpwc(e)		(((e) >> 48) & 0x1)
 #define ecap_flts(e)		(((e) >> 47) & 0x1)
 #define ecap_slts(e)		(((e) >> 46) & 0x1)
+#define ecap_slads(e)		(((e) >> 45) & 0x1)
 #define ecap_vcs(e)		(((e) >> 44) & 0x1)
 #define ecap_smts(e)		(((e) >> 43) & 0x1)
 #define ecap_dit(e)		((e >> 41) & 0x1)
@@ -522,6 +525,13 @@ struct context_entry {
  */
 #define DOMAIN_FLAG_NESTING_MODE		BIT(2)
 
+/*
+ * The dirty bits of the page table are tracked for DOMAIN_ATTR_DIRTY_TRACKING.
+ * First level page tables always have them updated, second level page tables
+ * only if enabled in the PASID entries of the domain's devices.
+ */
+#define DOMAIN_FLAG_DIRTY_TRACKING		BIT(3)
+
 struct dmar_domain {
 	int	nid;			/* node id */
 
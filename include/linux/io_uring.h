@@ -22,6 +22,32 @@ struct io_identity {
 	refcount_t			count;
 };
 
+enum io_uring_cmd_flags {
+	/* ->uring_cmd() must not block */
+	IO_URING_F_NONBLOCK		= (1 << 0),
+	/* the ring or the task is going away, complete the command now */
+	IO_URING_F_CANCEL		= (1 << 1),
+	/* ->task_work_cb() doesn't run in the context of the submitter */
+	IO_URING_F_TASK_DEAD		= (1 << 2),
+};
+
+/*
+ * Passed to file_operations->uring_cmd() for IORING_OP_URING_CMD. Must have
+ * the file pointer first, like all the per-opcode data of struct io_kiocb.
+ */
+struct io_uring_cmd {
+	struct file	*file;
+	void (*task_work_cb)(struct io_uring_cmd *ioucmd,
+			     unsigned int issue_flags);
+	u64		addr;
+	u32		len;
+	u32		cmd_op;
+	/* copy of sqe->cmd */
+	u8		cmd[16];
+	/* for free use by the file, while the command is in flight */
+	u8		pdu[16];
+};
+
 struct io_uring_task {
 	/* submission side */
 	struct xarray		xa;
@@ -39,6 +65,10 @@ struct sock *io_uring_get_socket(struct file *file);
 void __io_uring_task_cancel(void);
 void __io_uring_files_cancel(struct files_struct *files);
 void __io_uring_free(struct task_struct *tsk);
+void io_uring_cmd_done(struct io_uring_cmd *ioucmd, ssize_t ret);
+void io_uring_cmd_complete_in_task(struct io_uring_cmd *ioucmd,
+		void (*task_work_cb)(struct io_uring_cmd *, unsigned int));
+void io_uring_cmd_mark_cancelable(struct io_uring_cmd *ioucmd);
 
 static inline void io_uring_task_cancel(void)
 {
@@ -69,6 +99,16 @@ static inline void io_uring_files_cancel(struct files_struct *files)
 static inline void io_uring_free(struct task_struct *tsk)
 {
 }
+static inline void io_uring_cmd_done(struct io_uring_cmd *ioucmd, ssize_t ret)
+{
+}
+static inline void io_uring_cmd_complete_in_task(struct io_uring_cmd *ioucmd,
+		void (*task_work_cb)(struct io_uring_cmd *, unsigned int))
+{
+}
+static inline void io_uring_cmd_mark_cancelable(struct io_uring_cmd *ioucmd)
+{
+}
 #endif
 
 #endif
@@ -32,6 +32,7 @@
 #include <linux/kvm_para.h>
 
 #include <linux/kvm_types.h>
+#include <linux/kvm_dirty_ring.h>
 
 #include <asm/kvm_host.h>
 
@@ -86,6 +87,7 @@
 #define KVM_PFN_ERR_FAULT	(KVM_PFN_ERR_MASK)
 #define KVM_PFN_ERR_HWPOISON	(KVM_PFN_ERR_MASK + 1)
 #define KVM_PFN_ERR_RO_FAULT	(KVM_PFN_ERR_MASK + 2)
+#define KVM_PFN_ERR_USERFAULT	(KVM_PFN_ERR_MASK + 3)
 
 /*
  * error pfns indicate that the gfn is in slot but faild to
@@ -163,14 +165,24 @@ extern struct list_head vm_list;
 struct kvm_io_range {
 	gpa_t addr;
 	int len;
+	bool has_datamatch;
+	u64 datamatch;
 	struct kvm_io_device *dev;
 };
 
 #define NR_IOBUS_DEVS 1000
 
+/*
+ * @hash is an open-addressed table of indices into @range, keyed on the
+ * exact address, length and datamatch of each device.  It lives in the same
+ * allocation as the bus, right after @range, and is rebuilt every time the
+ * bus is copied on registration or unregistration.
+ */
 struct kvm_io_bus {
 	int dev_count;
 	int ioeventfd_count;
+	unsigned int hash_bits;
+	int *hash;
 	struct kvm_io_range range[];
 };
 
@@ -190,6 +202,9 @@ int kvm_io_bus_read(struct kvm_vcpu *vcpu, enum kvm_bus bus_idx, gpa_t addr,
 		    int len, void *val);
 int kvm_io_bus_register_dev(struct kvm *kvm, enum kvm_bus bus_idx, gpa_t addr,
 			    int len, struct kvm_io_device *dev);
+int kvm_io_bus_register_dev_datamatch(struct kvm *kvm, enum kvm_bus bus_idx,
+				      gpa_t addr, int len, u64 datamatch,
+				      struct kvm_io_device *dev);
 void kvm_io_bus_unregister_dev(struct kvm *kvm, enum kvm_bus bus_idx,
 			       struct kvm_io_device *dev);
 struct kvm_io_device *kvm_io_bus_get_dev(struct kvm *kvm, enum kvm_bus bus_idx,
@@ -223,6 +238,13 @@ enum {
 	READING_SHADOW_PAGE_TABLES,
 };
 
+/* The values of kvm_vcpu->block_state, see kvm_vcpu_block(). */
+enum {
+	KVM_VCPU_NOT_BLOCKED,
+	KVM_VCPU_BLOCKED,
+	KVM_VCPU_WAKING,
+};
+
 #define KVM_UNMAPPED_PAGE	((void *) 0x500 + POISON_POINTER_DELTA)
 
 struct kvm_host_map {
@@ -259,6 +281,17 @@ struct kvm_mmio_fragment {
 	unsigned len;
 };
 
+/*
+ * Histogram of the time spent in kvm_vcpu_block(), in power-of-two buckets
+ * of microseconds, used to pick the halt-polling window.
+ */
+#define KVM_HALT_POLL_HIST_BUCKETS	16
+
+struct kvm_halt_poll_hist {
+	u32 count[KVM_HALT_POLL_HIST_BUCKETS];
+	u32 total;
+};
+
 struct kvm_vcpu {
 	struct kvm *kvm;
 #ifdef CONFIG_PREEMPT_NOTIFIERS
@@ -279,12 +312,16 @@ struct kvm_vcpu {
 	struct kvm_run *run;
 
 	struct rcuwait wait;
+	int block_state;
 	struct pid __rcu *pid;
 	int sigset_active;
 	sigset_t sigset;
 	struct kvm_vcpu_stat stat;
 	unsigned int halt_poll_ns;
+	struct kvm_halt_poll_hist halt_poll_hist;
 	bool valid_wakeup;
+	/* vCPU holding the lock this vCPU spins on, as told by the guest. */
+	struct kvm_vcpu *lock_holder_hint;
 
 #ifdef CONFIG_HAS_IOMEM
 	int mmio_needed;
@@ -318,7 +355,14 @@ struct kvm_vcpu {
 #endif
 	bool preempted;
 	bool ready;
+	/* Index of the memslot this vCPU last looked up a gfn in. */
+	int last_used_slot;
 	struct kvm_vcpu_arch arch;
+	struct kvm_dirty_ring dirty_ring;
+#ifdef CONFIG_KVM_MMIO
+	/* Only written by this vCPU, see KVM_CAP_COALESCED_MMIO_VCPU_RING */
+	struct kvm_coalesced_mmio_ring *coalesced_mmio_ring;
+#endif
 };
 
 static inline int kvm_vcpu_exiting_guest_mode(struct kvm_vcpu *vcpu)
@@ -338,15 +382,21 @@ static inline int kvm_vcpu_exiting_guest_mode(struct kvm_vcpu *vcpu)
  */
 #define KVM_MEM_MAX_NR_PAGES ((1UL << 31) - 1)
 
+/* The maximum number of entries of a KVM_DISCARD_RANGES batch. */
+#define KVM_MAX_DISCARD_RANGES 4096
+
 struct kvm_memory_slot {
 	gfn_t base_gfn;
 	unsigned long npages;
 	unsigned long *dirty_bitmap;
 	struct kvm_arch_memory_slot arch;
 	unsigned long userspace_addr;
+	u64 __user *userfault_bitmap;
 	u32 flags;
 	short id;
 	u16 as_id;
+	/* The node of the slot in kvm_memslots->hva_tree. */
+	struct interval_tree_node hva_node;
 };
 
 static inline unsigned long kvm_dirty_bitmap_bytes(struct kvm_memory_slot *memslot)
@@ -440,14 +490,31 @@ struct kvm_memslots {
 	short id_to_index[KVM_MEM_SLOTS_NUM];
 	atomic_t lru_slot;
 	int used_slots;
+	/*
+	 * The HVA ranges of memslots[], rebuilt whenever the memslots are
+	 * published, so that the MMU notifiers can skip the invalidations
+	 * outside the guest memory without walking all the memslots.
+	 */
+	struct rb_root_cached hva_tree;
 	struct kvm_memory_slot memslots[];
 };
 
 struct kvm {
+#ifdef KVM_HAVE_MMU_RWLOCK
+	rwlock_t mmu_lock;
+#else
 	spinlock_t mmu_lock;
+#endif /* KVM_HAVE_MMU_RWLOCK */
+
 	struct mutex slots_lock;
 	struct mm_struct *mm; /* userspace tied to this vm */
 	struct kvm_memslots __rcu *memslots[KVM_ADDRESS_SPACE_NUM];
+	/*
+	 * A retired copy of memslots, kept in sync with the active one, which
+	 * memslot updates reuse instead of duplicating the active memslots.
+	 * Protected by slots_lock.
+	 */
+	struct kvm_memslots *spare_memslots[KVM_ADDRESS_SPACE_NUM];
 	struct kvm_vcpu *vcpus[KVM_MAX_VCPUS];
 
 	/*
@@ -478,6 +545,10 @@ struct kvm {
 	struct kvm_coalesced_mmio_ring *coalesced_mmio_ring;
 	spinlock_t ring_lock;
 	struct list_head coalesced_zones;
+	bool coalesced_mmio_vcpu_rings;
+	bool coalesced_mmio_fence;
+	u32 coalesced_mmio_hwm;
+	struct eventfd_ctx *coalesced_mmio_eventfd;
 #endif
 
 	struct mutex irq_lock;
@@ -495,9 +566,22 @@ struct kvm {
 	struct mmu_notifier mmu_notifier;
 	unsigned long mmu_notifier_seq;
 	long mmu_notifier_count;
+	/*
+	 * The invalidations in progress, whether or not they hit a memslot.
+	 * The memslots are not replaced until it drops to zero, so that the
+	 * start and the end of an invalidation agree on the memslots it hit.
+	 */
+	spinlock_t mn_invalidate_lock;
+	unsigned long mn_active_invalidate_count;
+	struct rcuwait mn_memslots_update_rcuwait;
 #endif
 	long tlbs_dirty;
 	struct list_head devices;
+#ifdef CONFIG_HAVE_KVM_PFNCACHE
+	/* Protects gpc_list, the active gfn_to_pfn_caches of the VM. */
+	spinlock_t gpc_lock;
+	struct list_head gpc_list;
+#endif
 	u64 manual_dirty_log_protect;
 	struct dentry *debugfs_dentry;
 	struct kvm_stat_data **debugfs_stat_data;
@@ -505,6 +589,15 @@ struct kvm {
 	struct srcu_struct irq_srcu;
 	pid_t userspace_pid;
 	unsigned int max_halt_poll_ns;
+	u32 dirty_ring_size;
+#ifdef CONFIG_KVM_ASYNC_PF
+	/* Async page faults queued or running, see async_pf_per_vm. */
+	atomic_t async_pf_inflight;
+#endif
+#ifdef CONFIG_SCHED_CORE
+	/* Core scheduling cookie of the vCPU threads. */
+	unsigned long core_cookie;
+#endif
 };
 
 #define kvm_err(fmt, ...) \
@@ -538,6 +631,15 @@ static inline bool kvm_dirty_log_manual_protect_and_init_set(struct kvm *kvm)
 	return !!(kvm->manual_dirty_log_protect & KVM_DIRTY_LOG_INITIALLY_SET);
 }
 
+/*
+ * Dirty logging is enabled for a memslot by its flag, as the dirty bitmap is
+ * not allocated when the dirty pages are collected with the dirty rings.
+ */
+static inline bool kvm_slot_dirty_track_enabled(struct kvm_memory_slot *slot)
+{
+	return slot->flags & KVM_MEM_LOG_DIRTY_PAGES;
+}
+
 static inline struct kvm_io_bus *kvm_get_bus(struct kvm *kvm, enum kvm_bus idx)
 {
 	return srcu_dereference_check(kvm->buses[idx], &kvm->srcu,
@@ -729,7 +831,6 @@ void kvm_set_pfn_dirty(kvm_pfn_t pfn);
 void kvm_set_pfn_accessed(kvm_pfn_t pfn);
 void kvm_get_pfn(kvm_pfn_t pfn);
 
-void kvm_release_pfn(kvm_pfn_t pfn, bool dirty, struct gfn_to_pfn_cache *cache);
 int kvm_read_guest_page(struct kvm *kvm, gfn_t gfn, void *data, int offset,
 			int len);
 int kvm_read_guest(struct kvm *kvm, gpa_t gpa, void *data, unsigned long len);
@@ -750,6 +851,15 @@ int kvm_write_guest_offset_cached(struct kvm *kvm, struct gfn_to_hva_cache *ghc,
 int kvm_gfn_to_hva_cache_init(struct kvm *kvm, struct gfn_to_hva_cache *ghc,
 			      gpa_t gpa, unsigned long len);
 
+#ifdef CONFIG_HAVE_KVM_PFNCACHE
+void kvm_gpc_init(struct gfn_to_pfn_cache *gpc, struct kvm *kvm);
+int kvm_gpc_activate(struct gfn_to_pfn_cache *gpc, gpa_t gpa,
+		     unsigned long len);
+bool kvm_gpc_check(struct gfn_to_pfn_cache *gpc, unsigned long len);
+int kvm_gpc_refresh(struct gfn_to_pfn_cache *gpc, unsigned long len);
+void kvm_gpc_deactivate(struct gfn_to_pfn_cache *gpc);
+#endif
+
 #define __kvm_get_guest(kvm, gfn, offset, v)				\
 ({									\
 	unsigned long __addr = gfn_to_hva(kvm, gfn);			\
@@ -798,7 +908,8 @@ struct kvm_memory_slot *gfn_to_memslot(struct kvm *kvm, gfn_t gfn);
 bool kvm_is_visible_gfn(struct kvm *kvm, gfn_t gfn);
 bool kvm_vcpu_is_visible_gfn(struct kvm_vcpu *vcpu, gfn_t gfn);
 unsigned long kvm_host_page_size(struct kvm_vcpu *vcpu, gfn_t gfn);
-void mark_page_dirty_in_slot(struct kvm_memory_slot *memslot, gfn_t gfn);
+void mark_page_dirty_in_slot(struct kvm *kvm, struct kvm_memory_slot *memslot,
+			     gfn_t gfn);
 void mark_page_dirty(struct kvm *kvm, gfn_t gfn);
 
 struct kvm_memslots *kvm_vcpu_memslots(struct kvm_vcpu *vcpu);
@@ -806,12 +917,8 @@ struct kvm_memory_slot *kvm_vcpu_gfn_to_memslot(struct kvm_vcpu *vcpu, gfn_t gfn
 kvm_pfn_t kvm_vcpu_gfn_to_pfn_atomic(struct kvm_vcpu *vcpu, gfn_t gfn);
 kvm_pfn_t kvm_vcpu_gfn_to_pfn(struct kvm_vcpu *vcpu, gfn_t gfn);
 int kvm_vcpu_map(struct kvm_vcpu *vcpu, gpa_t gpa, struct kvm_host_map *map);
-int kvm_map_gfn(struct kvm_vcpu *vcpu, gfn_t gfn, struct kvm_host_map *map,
-		struct gfn_to_pfn_cache *cache, bool atomic);
 struct page *kvm_vcpu_gfn_to_page(struct kvm_vcpu *vcpu, gfn_t gfn);
 void kvm_vcpu_unmap(struct kvm_vcpu *vcpu, struct kvm_host_map *map, bool dirty);
-int kvm_unmap_gfn(struct kvm_vcpu *vcpu, struct kvm_host_map *map,
-		  struct gfn_to_pfn_cache *cache, bool dirty, bool atomic);
 unsigned long kvm_vcpu_gfn_to_hva(struct kvm_vcpu *vcpu, gfn_t gfn);
 unsigned long kvm_vcpu_gfn_to_hva_prot(struct kvm_vcpu *vcpu, gfn_t gfn, bool *writable);
 int kvm_vcpu_read_guest_page(struct kvm_vcpu *vcpu, gfn_t gfn, void *data, int offset,
@@ -848,8 +955,7 @@ void *kvm_mmu_memory_cache_alloc(struct kvm_mmu_memory_cache *mc);
 #endif
 
 bool kvm_make_vcpus_request_mask(struct kvm *kvm, unsigned int req,
-				 struct kvm_vcpu *except,
-				 unsigned long *vcpu_bitmap, cpumask_var_t tmp);
+				 unsigned long *vcpu_bitmap);
 bool kvm_make_all_cpus_request(struct kvm *kvm, unsigned int req);
 bool kvm_make_all_cpus_request_except(struct kvm *kvm, unsigned int req,
 				      struct kvm_vcpu *except);
@@ -858,6 +964,14 @@ bool kvm_make_cpus_request_mask(struct kvm *kvm, unsigned int req,
 
 long kvm_arch_dev_ioctl(struct file *filp,
 			unsigned int ioctl, unsigned long arg);
+#ifdef CONFIG_KVM_USERFAULT_BITMAP
+bool kvm_is_userfault_gfn(struct kvm_memory_slot *slot, gfn_t gfn);
+#endif
+#ifdef CONFIG_KVM_GENERIC_PRE_FAULT_MEMORY
+long kvm_arch_vcpu_pre_fault_memory(struct kvm_vcpu *vcpu,
+				    struct kvm_pre_fault_memory *range);
+#endif
+
 long kvm_arch_vcpu_ioctl(struct file *filp,
 			 unsigned int ioctl, unsigned long arg);
 vm_fault_t kvm_arch_vcpu_fault(struct kvm_vcpu *vcpu, struct vm_fault *vmf);
@@ -933,6 +1047,9 @@ int kvm_arch_vcpu_should_kick(struct kvm_vcpu *vcpu);
 bool kvm_arch_dy_runnable(struct kvm_vcpu *vcpu);
 int kvm_arch_post_init_vm(struct kvm *kvm);
 void kvm_arch_pre_destroy_vm(struct kvm *kvm);
+unsigned int kvm_arch_vcpu_nr_stats_hist(struct kvm_vcpu *vcpu, u16 *size);
+u64 *kvm_arch_vcpu_stats_hist(struct kvm_vcpu *vcpu, unsigned int i,
+			      struct kvm_stats_desc *desc);
 
 #ifndef __KVM_HAVE_ARCH_VM_ALLOC
 /*
@@ -1064,19 +1181,36 @@ bool kvm_arch_irqfd_allowed(struct kvm *kvm, struct kvm_irqfd *args);
  * IMPORTANT: Slots are sorted from highest GFN to lowest GFN!
  */
 static inline struct kvm_memory_slot *
-search_memslots(struct kvm_memslots *slots, gfn_t gfn)
+try_get_memslot(struct kvm_memslots *slots, int slot_index, gfn_t gfn)
+{
+	struct kvm_memory_slot *slot;
+
+	if (slot_index < 0 || slot_index >= slots->used_slots)
+		return NULL;
+
+	slot = &slots->memslots[slot_index];
+
+	if (gfn >= slot->base_gfn && gfn < slot->base_gfn + slot->npages)
+		return slot;
+
+	return NULL;
+}
+
+/*
+ * Binary search for the memslot containing @gfn, without looking at or
+ * updating the lru_slot cache of @slots.  Returns the index of the memslot in
+ * @slot_index.
+ */
+static inline struct kvm_memory_slot *
+__search_memslots(struct kvm_memslots *slots, gfn_t gfn, int *slot_index)
 {
 	int start = 0, end = slots->used_slots;
-	int slot = atomic_read(&slots->lru_slot);
 	struct kvm_memory_slot *memslots = slots->memslots;
+	int slot;
 
 	if (unlikely(!slots->used_slots))
 		return NULL;
 
-	if (gfn >= memslots[slot].base_gfn &&
-	    gfn < memslots[slot].base_gfn + memslots[slot].npages)
-		return &memslots[slot];
-
 	while (start < end) {
 		slot = start + (end - start) / 2;
 
@@ -1088,13 +1222,30 @@ search_memslots(struct kvm_memslots *slots, gfn_t gfn)
 
 	if (start < slots->used_slots && gfn >= memslots[start].base_gfn &&
 	    gfn < memslots[start].base_gfn + memslots[start].npages) {
-		atomic_set(&slots->lru_slot, start);
+		*slot_index = start;
 		return &memslots[start];
 	}
 
 	return NULL;
 }
 
+static inline struct kvm_memory_slot *
+search_memslots(struct kvm_memslots *slots, gfn_t gfn)
+{
+	struct kvm_memory_slot *slot;
+	int slot_index;
+
+	slot = try_get_memslot(slots, atomic_read(&slots->lru_slot), gfn);
+	if (slot)
+		return slot;
+
+	slot = __search_memslots(slots, gfn, &slot_index);
+	if (slot)
+		atomic_set(&slots->lru_slot, slot_index);
+
+	return slot;
+}
+
 static inline struct kvm_memory_slot *
 __gfn_to_memslot(struct kvm_memslots *slots, gfn_t gfn)
 {
@@ -1163,6 +1314,8 @@ struct kvm_stats_debugfs_item {
 	int offset;
 	enum kvm_stat_kind kind;
 	int mode;
+	u32 flags;		/* KVM_STATS_TYPE_* and KVM_STATS_UNIT_* */
+	s16 exponent;
 };
 
 #define KVM_DBGFS_GET_MODE(dbgfs_item)                                         \
@@ -1173,6 +1326,12 @@ struct kvm_stats_debugfs_item {
 #define VCPU_STAT(n, x, ...)							\
 	{ n, offsetof(struct kvm_vcpu, stat.x), KVM_STAT_VCPU, ## __VA_ARGS__ }
 
+/* For the binary stats, a stat is a cumulative count unless told otherwise. */
+#define KVM_STAT_INSTANT	.flags = KVM_STATS_TYPE_INSTANT
+#define KVM_STAT_PEAK		.flags = KVM_STATS_TYPE_PEAK
+#define KVM_STAT_BYTES		.flags = KVM_STATS_UNIT_BYTES
+#define KVM_STAT_NS		.flags = KVM_STATS_UNIT_SECONDS, .exponent = -9
+
 extern struct kvm_stats_debugfs_item debugfs_entries[];
 extern struct dentry *kvm_debugfs_dir;
 
@@ -1201,6 +1360,7 @@ static inline int mmu_notifier_retry(struct kvm *kvm, unsigned long mmu_seq)
 #ifdef CONFIG_HAVE_KVM_IRQ_ROUTING
 
 #define KVM_MAX_IRQ_ROUTES 4096 /* might need extension/rework in the future */
+#define KVM_MAX_MSI_BATCH 4096
 
 bool kvm_arch_can_set_irq_routing(struct kvm *kvm);
 int kvm_set_irq_routing(struct kvm *kvm,
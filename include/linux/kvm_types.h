@@ -18,6 +18,8 @@ struct kvm_memslots;
 
 enum kvm_mr_change;
 
+#include <linux/mutex.h>
+#include <linux/spinlock_types.h>
 #include <linux/types.h>
 
 #include <asm/kvm_types.h>
@@ -53,11 +55,25 @@ struct gfn_to_hva_cache {
 	struct kvm_memory_slot *memslot;
 };
 
+/*
+ * A kernel mapping of a guest page that KVM accesses often, e.g. steal time.
+ * No reference to the page is held; the MMU notifier clears @valid instead
+ * when the host mapping of @uhva changes.  Readers hold @lock for read and
+ * check the cache with kvm_gpc_check() before accessing @khva.
+ */
 struct gfn_to_pfn_cache {
 	u64 generation;
-	gfn_t gfn;
+	gpa_t gpa;
+	unsigned long uhva;
+	struct kvm_memory_slot *memslot;
+	struct kvm *kvm;
+	struct list_head list;
+	rwlock_t lock;
+	struct mutex refresh_lock;
+	void *khva;
 	kvm_pfn_t pfn;
-	bool dirty;
+	bool active;
+	bool valid;
 };
 
 #ifdef KVM_ARCH_NR_OBJS_PER_MEMORY_CACHE
@@ -337,9 +337,11 @@ struct mem_cgroup {
 
 /*
  * size of first charge trial. "32" comes from vmscan.c's magic value.
- * TODO: maybe necessary to use big numbers in big irons.
+ * The per-cpu stocks scale it up to MEMCG_CHARGE_BATCH_MAX for the CPUs
+ * that keep charging the same memcg.
  */
 #define MEMCG_CHARGE_BATCH 32U
+#define MEMCG_CHARGE_BATCH_MAX (MEMCG_CHARGE_BATCH << 4)
 
 extern struct mem_cgroup *root_mem_cgroup;
 
@@ -934,6 +936,8 @@ static inline void memcg_memory_event_mm(struct mm_struct *mm,
 void mem_cgroup_split_huge_fixup(struct page *head);
 #endif
 
+void split_page_memcg(struct page *head, unsigned int nr);
+
 #else /* CONFIG_MEMCG */
 
 #define MEM_CGROUP_ID_SHIFT	0
@@ -1264,6 +1268,10 @@ static inline void mem_cgroup_split_huge_fixup(struct page *head)
 {
 }
 
+static inline void split_page_memcg(struct page *head, unsigned int nr)
+{
+}
+
 static inline void count_memcg_events(struct mem_cgroup *memcg,
 				      enum vm_event_item idx,
 				      unsigned long count)
@@ -1872,6 +1872,17 @@ static inline bool get_user_page_fast_only(unsigned long addr,
 {
 	return get_user_pages_fast_only(addr, 1, gup_flags, pagep) == 1;
 }
+
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+bool get_user_page_speculative(unsigned long addr, unsigned int gup_flags,
+			       struct page **pagep);
+#else
+static inline bool get_user_page_speculative(unsigned long addr,
+			unsigned int gup_flags, struct page **pagep)
+{
+	return false;
+}
+#endif
 /*
  * per-process(per-mm_struct) statistics.
  */
@@ -3030,6 +3041,25 @@ void vmemmap_free(unsigned long start, unsigned long end,
 #endif
 void register_page_bootmem_memmap(unsigned long section_nr, struct page *map,
 				  unsigned long nr_pages);
+#ifdef CONFIG_HUGETLB_PAGE_FREE_VMEMMAP
+void vmemmap_remap_free(unsigned long start, unsigned long end,
+			unsigned long reuse);
+int vmemmap_remap_alloc(unsigned long start, unsigned long end,
+			unsigned long reuse, gfp_t gfp_mask);
+
+extern bool hugetlb_free_vmemmap_enabled;
+
+/* The vmemmap has to be mapped with base pages, to be remapped later. */
+static inline bool is_hugetlb_free_vmemmap_enabled(void)
+{
+	return hugetlb_free_vmemmap_enabled;
+}
+#else
+static inline bool is_hugetlb_free_vmemmap_enabled(void)
+{
+	return false;
+}
+#endif
 
 enum mf_flags {
 	MF_COUNT_INCREASED = 1 << 0,
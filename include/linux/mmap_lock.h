@@ -3,6 +3,30 @@
 
 #include <linux/mmdebug.h>
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+
+#define MMAP_LOCK_INITIALIZER(name) \
+	.mmap_lock = __RWSEM_INITIALIZER((name).mmap_lock), \
+	.mmap_seq = SEQCNT_ZERO((name).mmap_seq),
+
+static inline void mmap_init_lock(struct mm_struct *mm)
+{
+	init_rwsem(&mm->mmap_lock);
+	seqcount_init(&mm->mmap_seq);
+}
+
+static inline void mmap_seq_write_begin(struct mm_struct *mm)
+{
+	raw_write_seqcount_begin(&mm->mmap_seq);
+}
+
+static inline void mmap_seq_write_end(struct mm_struct *mm)
+{
+	raw_write_seqcount_end(&mm->mmap_seq);
+}
+
+#else
+
 #define MMAP_LOCK_INITIALIZER(name) \
 	.mmap_lock = __RWSEM_INITIALIZER((name).mmap_lock),
 
@@ -11,33 +35,50 @@ static inline void mmap_init_lock(struct mm_struct *mm)
 	init_rwsem(&mm->mmap_lock);
 }
 
+static inline void mmap_seq_write_begin(struct mm_struct *mm) {}
+static inline void mmap_seq_write_end(struct mm_struct *mm) {}
+
+#endif /* CONFIG_SPECULATIVE_PAGE_FAULT */
+
 static inline void mmap_write_lock(struct mm_struct *mm)
 {
 	down_write(&mm->mmap_lock);
+	mmap_seq_write_begin(mm);
 }
 
 static inline void mmap_write_lock_nested(struct mm_struct *mm, int subclass)
 {
 	down_write_nested(&mm->mmap_lock, subclass);
+	mmap_seq_write_begin(mm);
 }
 
 static inline int mmap_write_lock_killable(struct mm_struct *mm)
 {
-	return down_write_killable(&mm->mmap_lock);
+	int ret = down_write_killable(&mm->mmap_lock);
+
+	if (!ret)
+		mmap_seq_write_begin(mm);
+	return ret;
 }
 
 static inline bool mmap_write_trylock(struct mm_struct *mm)
 {
-	return down_write_trylock(&mm->mmap_lock) != 0;
+	if (!down_write_trylock(&mm->mmap_lock))
+		return false;
+
+	mmap_seq_write_begin(mm);
+	return true;
 }
 
 static inline void mmap_write_unlock(struct mm_struct *mm)
 {
+	mmap_seq_write_end(mm);
 	up_write(&mm->mmap_lock);
 }
 
 static inline void mmap_write_downgrade(struct mm_struct *mm)
 {
+	mmap_seq_write_end(mm);
 	downgrade_write(&mm->mmap_lock);
 }
 
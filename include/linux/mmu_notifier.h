@@ -42,6 +42,10 @@ struct mmu_interval_notifier;
  * @MMU_NOTIFY_MIGRATE: used during migrate_vma_collect() invalidate to signal
  * a device driver to possibly ignore the invalidation if the
  * migrate_pgmap_owner field matches the driver's device private pgmap owner.
+ *
+ * @MMU_NOTIFY_PROTECTION_NUMA: the range is made PROT_NONE by automatic NUMA
+ * balancing in order to sample the accesses to it. The pages are not moved or
+ * freed, which is notified separately, should they be migrated.
  */
 enum mmu_notifier_event {
 	MMU_NOTIFY_UNMAP = 0,
@@ -51,6 +55,7 @@ enum mmu_notifier_event {
 	MMU_NOTIFY_SOFT_DIRTY,
 	MMU_NOTIFY_RELEASE,
 	MMU_NOTIFY_MIGRATE,
+	MMU_NOTIFY_PROTECTION_NUMA,
 };
 
 #define MMU_NOTIFIER_RANGE_BLOCKABLE (1 << 0)
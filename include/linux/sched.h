@@ -672,6 +672,13 @@ struct task_struct {
 	 */
 	int				recent_used_cpu;
 	int				wake_cpu;
+
+	/*
+	 * Tasks with the same non-NULL wake_group share their working set,
+	 * e.g. the vCPU threads of a VM. Wakeups keep them in one LLC.
+	 * Only an identity, never dereferenced.
+	 */
+	const void			*wake_group;
 #endif
 	int				on_rq;
 
@@ -688,6 +695,11 @@ struct task_struct {
 #endif
 	struct sched_dl_entity		dl;
 
+#ifdef CONFIG_SCHED_CORE
+	struct rb_node			core_node;
+	unsigned long			core_cookie;
+#endif
+
 #ifdef CONFIG_UCLAMP_TASK
 	/*
 	 * Clamp values requested for a scheduling entity.
@@ -1676,6 +1688,28 @@ extern int sched_setscheduler_nocheck(struct task_struct *, int, const struct sc
 extern void sched_set_fifo(struct task_struct *p);
 extern void sched_set_fifo_low(struct task_struct *p);
 extern void sched_set_normal(struct task_struct *p, int nice);
+
+#ifdef CONFIG_SCHED_CORE
+extern unsigned long sched_core_alloc_cookie(void);
+extern void sched_core_put_cookie(unsigned long cookie);
+extern void sched_core_set_cookie(struct task_struct *p, unsigned long cookie);
+extern void sched_core_fork(struct task_struct *p);
+extern void sched_core_free(struct task_struct *p);
+#else
+static inline unsigned long sched_core_alloc_cookie(void) { return 0; }
+static inline void sched_core_put_cookie(unsigned long cookie) { }
+static inline void sched_core_set_cookie(struct task_struct *p,
+					 unsigned long cookie) { }
+static inline void sched_core_fork(struct task_struct *p) { }
+static inline void sched_core_free(struct task_struct *p) { }
+#endif
+
+static inline void sched_set_wake_group(struct task_struct *p, const void *group)
+{
+#ifdef CONFIG_SMP
+	WRITE_ONCE(p->wake_group, group);
+#endif
+}
 extern int sched_setattr(struct task_struct *, const struct sched_attr *);
 extern int sched_setattr_nocheck(struct task_struct *, const struct sched_attr *);
 extern struct task_struct *idle_task(int cpu);
@@ -1837,6 +1871,7 @@ static inline int test_tsk_need_resched(struct task_struct *tsk)
  * explicit rescheduling in places that are safe. The return
  * value indicates whether a reschedule was done in fact.
  * cond_resched_lock() will drop the spinlock before scheduling,
+ * cond_resched_rwlock_{read,write}() do the same for a rwlock.
  */
 #ifndef CONFIG_PREEMPTION
 extern int _cond_resched(void);
@@ -1850,12 +1885,24 @@ static inline int _cond_resched(void) { return 0; }
 })
 
 extern int __cond_resched_lock(spinlock_t *lock);
+extern int __cond_resched_rwlock_read(rwlock_t *lock);
+extern int __cond_resched_rwlock_write(rwlock_t *lock);
 
 #define cond_resched_lock(lock) ({				\
 	___might_sleep(__FILE__, __LINE__, PREEMPT_LOCK_OFFSET);\
 	__cond_resched_lock(lock);				\
 })
 
+#define cond_resched_rwlock_read(lock) ({			\
+	___might_sleep(__FILE__, __LINE__, PREEMPT_LOCK_OFFSET);\
+	__cond_resched_rwlock_read(lock);			\
+})
+
+#define cond_resched_rwlock_write(lock) ({			\
+	___might_sleep(__FILE__, __LINE__, PREEMPT_LOCK_OFFSET);\
+	__cond_resched_rwlock_write(lock);			\
+})
+
 static inline void cond_resched_rcu(void)
 {
 #if defined(CONFIG_DEBUG_ATOMIC_SLEEP) || !defined(CONFIG_PREEMPT_RCU)
@@ -1879,6 +1926,23 @@ static inline int spin_needbreak(spinlock_t *lock)
 #endif
 }
 
+/*
+ * Check if a rwlock is contended.
+ * Returns non-zero if there is another task waiting on the rwlock.
+ * Returns zero if the lock is not contended or the system / underlying
+ * rwlock implementation does not support contention detection.
+ * Technically does not depend on CONFIG_PREEMPTION, but a general need
+ * for low latency.
+ */
+static inline int rwlock_needbreak(rwlock_t *lock)
+{
+#ifdef CONFIG_PREEMPTION
+	return rwlock_is_contended(lock);
+#else
+	return 0;
+#endif
+}
+
 static __always_inline bool need_resched(void)
 {
 	return unlikely(tif_need_resched());
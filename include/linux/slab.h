@@ -398,7 +398,15 @@ void kmem_cache_free(struct kmem_cache *, void *);
  * Note that interrupts must be enabled when calling these functions.
  */
 void kmem_cache_free_bulk(struct kmem_cache *, size_t, void **);
-int kmem_cache_alloc_bulk(struct kmem_cache *, gfp_t, size_t, void **);
+int kmem_cache_alloc_bulk_node(struct kmem_cache *, gfp_t, int, size_t,
+			       void **);
+
+static __always_inline int kmem_cache_alloc_bulk(struct kmem_cache *s,
+						 gfp_t flags, size_t size,
+						 void **p)
+{
+	return kmem_cache_alloc_bulk_node(s, flags, NUMA_NO_NODE, size, p);
+}
 
 /*
  * Caller must not use kfree_bulk() on memory not originally allocated
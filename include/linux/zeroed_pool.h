@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _LINUX_ZEROED_POOL_H
+#define _LINUX_ZEROED_POOL_H
+
+struct page;
+struct vm_area_struct;
+
+#ifdef CONFIG_ZEROED_PAGE_POOL
+struct page *zeroed_pool_alloc(struct vm_area_struct *vma, unsigned long vaddr);
+#else
+static inline struct page *zeroed_pool_alloc(struct vm_area_struct *vma,
+					     unsigned long vaddr)
+{
+	return NULL;
+}
+#endif
+
+#endif /* _LINUX_ZEROED_POOL_H */
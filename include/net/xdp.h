@@ -59,6 +59,10 @@ struct xdp_rxq_info {
 	u32 queue_index;
 	u32 reg_state;
 	struct xdp_mem_info mem;
+	/* NAPI instance receiving on the queue, set by the driver for busy
+	 * polling after registration
+	 */
+	unsigned int napi_id;
 } ____cacheline_aligned; /* perf critical, avoid false-sharing */
 
 struct xdp_txq_info {
@@ -195,6 +199,23 @@ void xdp_return_frame(struct xdp_frame *xdpf);
 void xdp_return_frame_rx_napi(struct xdp_frame *xdpf);
 void xdp_return_buff(struct xdp_buff *xdp);
 
+#define XDP_BULK_QUEUE_SIZE	16
+/* Frames being returned to the same page_pool, see xdp_return_frame_bulk() */
+struct xdp_frame_bulk {
+	int count;
+	void *xa;
+	void *q[XDP_BULK_QUEUE_SIZE];
+};
+
+static __always_inline void xdp_frame_bulk_init(struct xdp_frame_bulk *bq)
+{
+	/* bq->count is reset when bq->xa gets set */
+	bq->xa = NULL;
+}
+
+void xdp_return_frame_bulk(struct xdp_frame *xdpf, struct xdp_frame_bulk *bq);
+void xdp_flush_frame_bulk(struct xdp_frame_bulk *bq);
+
 /* When sending xdp_frame into the network stack, then there is no
  * return point callback, which is needed to release e.g. DMA-mapping
  * resources with page_pool.  Thus, have explicit function to release
@@ -175,6 +175,9 @@
  *
  *  7.32
  *  - add flags to fuse_attr, add FUSE_ATTR_SUBMOUNT, add FUSE_SUBMOUNTS
+ *
+ *  7.33
+ *  - add FUSE_IO_URING_CMD_REGISTER and FUSE_IO_URING_CMD_COMMIT_AND_FETCH
  */
 
 #ifndef _LINUX_FUSE_H
@@ -210,7 +213,7 @@
 #define FUSE_KERNEL_VERSION 7
 
 /** Minor version number of this interface */
-#define FUSE_KERNEL_MINOR_VERSION 32
+#define FUSE_KERNEL_MINOR_VERSION 33
 
 /** The node ID of the root inode */
 #define FUSE_ROOT_ID 1
@@ -885,6 +888,34 @@ struct fuse_notify_retrieve_in {
 /* Device ioctls: */
 #define FUSE_DEV_IOC_CLONE	_IOR(229, 0, uint32_t)
 
+/*
+ * io_uring commands, in sqe->cmd_op of IORING_OP_URING_CMD on /dev/fuse.
+ *
+ * FUSE_IO_URING_CMD_REGISTER: hand the buffer at sqe->addr, of sqe->len
+ * bytes, to queue @qid of struct fuse_uring_cmd_req.  The command completes
+ * when a request is copied to the buffer, which holds the same bytes that
+ * read(2) would return, with cqe->res being their number.  Queues are per
+ * CPU; requests made on CPUs whose queue has no buffers go to read(2).
+ *
+ * FUSE_IO_URING_CMD_COMMIT_AND_FETCH: the buffer holding the request
+ * @commit_id now has its reply, as written by write(2); hand the buffer
+ * back to the queue for the next request.
+ */
+enum fuse_uring_cmd {
+	FUSE_IO_URING_CMD_INVALID		= 0,
+	FUSE_IO_URING_CMD_REGISTER		= 1,
+	FUSE_IO_URING_CMD_COMMIT_AND_FETCH	= 2,
+};
+
+/* In sqe->cmd */
+struct fuse_uring_cmd_req {
+	/* The unique ID of the request being replied to */
+	uint64_t	commit_id;
+	uint16_t	qid;
+	uint16_t	padding;
+	uint32_t	flags;
+};
+
 struct fuse_lseek_in {
 	uint64_t	fh;
 	uint64_t	offset;
@@ -25,6 +25,12 @@
  * application.
  */
 #define XDP_USE_NEED_WAKEUP (1 << 3)
+/* If this option is set, a packet may span several descriptors in the Rx
+ * and Tx rings, for example when it does not fit in a single umem chunk.
+ * All but the last descriptor of such a packet have XDP_PKT_CONTD set in
+ * their options field. Only supported in copy mode.
+ */
+#define XDP_USE_SG	(1 << 4)
 
 /* Flags for xsk_umem_config flags */
 #define XDP_UMEM_UNALIGNED_CHUNK_FLAG (1 << 0)
@@ -106,6 +112,9 @@ struct xdp_desc {
 	__u32 options;
 };
 
+/* Flags for the options field of struct xdp_desc */
+#define XDP_PKT_CONTD (1 << 0) /* The packet continues in the next descriptor */
+
 /* UMEM descriptor is __u64 */
 
 #endif /* _LINUX_IF_XDP_H */
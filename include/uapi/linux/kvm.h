@@ -109,6 +109,14 @@ struct kvm_userspace_memory_region {
  */
 #define KVM_MEM_LOG_DIRTY_PAGES	(1UL << 0)
 #define KVM_MEM_READONLY	(1UL << 1)
+/*
+ * The memory of the slot is bound to host nodes by userspace, e.g. according
+ * to the guest NUMA topology, so the automatic NUMA balancing of the host does
+ * not need to sample the guest accesses: the PROT_NONE hinting updates of the
+ * host mappings keep the guest mappings. Available with
+ * KVM_CAP_MEMSLOT_NUMA_BOUND.
+ */
+#define KVM_MEM_NUMA_BOUND	(1UL << 2)
 
 /* for KVM_IRQ_LINE */
 struct kvm_irq_level {
@@ -250,6 +258,8 @@ struct kvm_hyperv_exit {
 #define KVM_EXIT_ARM_NISV         28
 #define KVM_EXIT_X86_RDMSR        29
 #define KVM_EXIT_X86_WRMSR        30
+#define KVM_EXIT_DIRTY_RING_FULL  31
+#define KVM_EXIT_MEMORY_FAULT     32
 
 /* For KVM_EXIT_INTERNAL_ERROR */
 /* Emulate instruction failed. */
@@ -426,6 +436,12 @@ struct kvm_run {
 			__u32 index; /* kernel -> user */
 			__u64 data; /* kernel <-> user */
 		} msr;
+		/* KVM_EXIT_MEMORY_FAULT */
+		struct {
+			__u64 flags;
+			__u64 gpa;
+			__u64 size;
+		} memory_fault;
 		/* Fix the size of the union. */
 		char padding[256];
 	};
@@ -479,6 +495,9 @@ struct kvm_coalesced_mmio_ring {
 	((PAGE_SIZE - sizeof(struct kvm_coalesced_mmio_ring)) / \
 	 sizeof(struct kvm_coalesced_mmio))
 
+/* for KVM_CAP_COALESCED_MMIO_VCPU_RING */
+#define KVM_COALESCED_MMIO_VCPU_RING_FENCE	(1 << 0)
+
 /* for KVM_TRANSLATE */
 struct kvm_translation {
 	/* in */
@@ -1053,7 +1072,19 @@ struct kvm_ppc_resize_hpt {
 #define KVM_CAP_X86_USER_SPACE_MSR 188
 #define KVM_CAP_X86_MSR_FILTER 189
 #define KVM_CAP_ENFORCE_PV_FEATURE_CPUID 190
+#define KVM_CAP_DIRTY_LOG_RING 192
+#define KVM_CAP_PRE_FAULT_MEMORY 193
+#define KVM_CAP_MSI_BATCH 194
+#define KVM_CAP_COALESCED_MMIO_VCPU_RING 195
+#define KVM_CAP_BINARY_STATS_FD 196
+#define KVM_CAP_USERFAULT_BITMAP 197
+#define KVM_CAP_VM_TSC_CONTROL 198
+#define KVM_CAP_MAX_HUGEPAGE_LEVEL 199
 #define KVM_CAP_SGX_ATTRIBUTE 200
+#define KVM_CAP_SET_USER_MEMORY_REGIONS 201
+#define KVM_CAP_MEMSLOT_NUMA_BOUND 202
+#define KVM_CAP_DISCARD_RANGES 203
+#define KVM_CAP_VCPU_STATE 204
 
 #ifdef KVM_CAP_IRQ_ROUTING
 
@@ -1558,6 +1589,195 @@ struct kvm_pv_cmd {
 /* Available with KVM_CAP_X86_MSR_FILTER */
 #define KVM_X86_SET_MSR_FILTER	_IOW(KVMIO,  0xc6, struct kvm_msr_filter)
 
+/* Available with KVM_CAP_DIRTY_LOG_RING */
+#define KVM_RESET_DIRTY_RINGS		_IO(KVMIO, 0xc7)
+
+/* Available with KVM_CAP_PRE_FAULT_MEMORY */
+struct kvm_pre_fault_memory {
+	__u64 gpa;
+	__u64 size;
+	__u64 flags;
+	__u64 padding[5];
+};
+
+#define KVM_PRE_FAULT_MEMORY	_IOWR(KVMIO, 0xd5, struct kvm_pre_fault_memory)
+
+/* Available with KVM_CAP_MSI_BATCH */
+struct kvm_msi_batch {
+	__u32 nr;
+	__u32 flags;
+	struct kvm_msi entries[0];
+};
+
+#define KVM_INJECT_MSI_BATCH	_IOW(KVMIO, 0xd6, struct kvm_msi_batch)
+
+/*
+ * Available with KVM_CAP_BINARY_STATS_FD
+ *
+ * The file returned by KVM_GET_STATS_FD starts with a header, followed by an
+ * id string of name_size bytes, num_desc descriptors and the data block.  The
+ * layout is fixed for the life of the file, only the data block changes.
+ */
+#define KVM_STATS_NAME_SIZE	48
+
+struct kvm_stats_header {
+	__u32 flags;
+	__u32 name_size;
+	__u32 num_desc;
+	__u32 id_offset;
+	__u32 desc_offset;
+	__u32 data_offset;
+};
+
+/* How the value behaves, in bits 0-3 of the descriptor flags */
+#define KVM_STATS_TYPE_SHIFT		0
+#define KVM_STATS_TYPE_MASK		(0xF << KVM_STATS_TYPE_SHIFT)
+#define KVM_STATS_TYPE_CUMULATIVE	(0x0 << KVM_STATS_TYPE_SHIFT)
+#define KVM_STATS_TYPE_INSTANT		(0x1 << KVM_STATS_TYPE_SHIFT)
+#define KVM_STATS_TYPE_PEAK		(0x2 << KVM_STATS_TYPE_SHIFT)
+#define KVM_STATS_TYPE_LOG_HIST		(0x3 << KVM_STATS_TYPE_SHIFT)
+
+/* The unit of value * 10^exponent, in bits 4-7 of the descriptor flags */
+#define KVM_STATS_UNIT_SHIFT		4
+#define KVM_STATS_UNIT_MASK		(0xF << KVM_STATS_UNIT_SHIFT)
+#define KVM_STATS_UNIT_NONE		(0x0 << KVM_STATS_UNIT_SHIFT)
+#define KVM_STATS_UNIT_BYTES		(0x1 << KVM_STATS_UNIT_SHIFT)
+#define KVM_STATS_UNIT_SECONDS		(0x2 << KVM_STATS_UNIT_SHIFT)
+#define KVM_STATS_UNIT_CYCLES		(0x3 << KVM_STATS_UNIT_SHIFT)
+
+/*
+ * Each descriptor is followed by a NUL-terminated name of name_size bytes.
+ *
+ * The size values of a KVM_STATS_TYPE_LOG_HIST stat are the buckets of a
+ * power-of-two histogram: bucket 0 counts the values below 1 << bucket_shift,
+ * bucket n the values in [1 << (bucket_shift + n - 1), 1 << (bucket_shift + n))
+ * and the last bucket all the values above.
+ */
+struct kvm_stats_desc {
+	__u32 flags;
+	__u16 size;	/* number of __u64 values */
+	__s16 exponent;	/* of 10 */
+	__u32 offset;	/* from the start of the data block */
+	__u32 bucket_shift;
+	char name[];
+};
+
+#define KVM_GET_STATS_FD	_IO(KVMIO, 0xd7)
+
+/*
+ * Available with KVM_CAP_USERFAULT_BITMAP
+ *
+ * bitmap points to a userspace bitmap of __u64 words with one bit per page
+ * of the memslot.  Guest faults on a page whose bit is clear are not resolved
+ * by KVM; KVM_RUN fails with EFAULT and exit_reason KVM_EXIT_MEMORY_FAULT
+ * instead.  Userspace sets the bit once the page contents are in place.  A
+ * bitmap of 0 disables the check.  Only faults taken by the guest are checked,
+ * accesses to guest memory by KVM itself go through the userspace mapping.
+ */
+struct kvm_userfault_bitmap {
+	__u32 slot;
+	__u32 flags;
+	__u64 bitmap;
+};
+
+#define KVM_SET_USERFAULT_BITMAP _IOW(KVMIO, 0xd8, struct kvm_userfault_bitmap)
+
+/*
+ * Available with KVM_CAP_SET_USER_MEMORY_REGIONS
+ *
+ * Applies nent KVM_SET_USER_MEMORY_REGION updates as one transaction, either
+ * all of them or none, so that a batch of updates costs at most two SRCU
+ * grace periods instead of up to two per update.  Each slot may appear at
+ * most once, and overlaps are checked against the layout after the update.
+ */
+struct kvm_userspace_memory_region_list {
+	__u32 nent;
+	__u32 flags;
+	struct kvm_userspace_memory_region entries[0];
+};
+
+#define KVM_SET_USER_MEMORY_REGIONS _IOW(KVMIO, 0xd9, \
+					 struct kvm_userspace_memory_region_list)
+
+/*
+ * Available with KVM_CAP_DISCARD_RANGES
+ *
+ * Discards nent page-aligned guest physical ranges, e.g. the free pages
+ * reported by the guest, as madvise(MADV_DONTNEED) or, with
+ * KVM_DISCARD_RANGES_REMOVE, madvise(MADV_REMOVE) of the memory backing
+ * them.  Each range must lie in a single writable memslot.  The guest
+ * mappings of the whole batch are zapped first with one TLB flush.  On
+ * failure, some of the ranges may already have been discarded.
+ */
+struct kvm_discard_range {
+	__u64 gpa;
+	__u64 size;
+};
+
+#define KVM_DISCARD_RANGES_REMOVE	(1 << 0)
+
+struct kvm_discard_ranges {
+	__u32 nent;
+	__u32 flags;
+	struct kvm_discard_range entries[0];
+};
+
+#define KVM_DISCARD_RANGES	_IOW(KVMIO, 0xda, struct kvm_discard_ranges)
+
+/*
+ * Available with KVM_CAP_VCPU_STATE, which returns the maximum size of the
+ * state of a vCPU.
+ *
+ * The state is a header followed by nr_sections sections.  Each section is a
+ * struct kvm_vcpu_state_section followed by the structure of the respective
+ * KVM_GET_* ioctl, of size bytes, padded to 8 bytes.  KVM_GET_VCPU_STATE sets
+ * size to the size of the whole state, or fails with E2BIG if it exceeds the
+ * size passed in.  KVM_SET_VCPU_STATE applies the sections in order, which for
+ * a state from KVM_GET_VCPU_STATE is the order the separate ioctls need, and
+ * stops at the first one that fails.  Both fail with EINVAL for a vCPU that
+ * is in guest mode or has CR4.VMXE set, as the nested state is not included.
+ *
+ * KVM_GET_VCPU_STATES and KVM_SET_VCPU_STATES do the same for the first
+ * nr_vcpus vCPUs of the VM, whose states start at addr and are stride bytes
+ * apart.
+ */
+#define KVM_VCPU_STATE_VERSION		1
+
+#define KVM_VCPU_STATE_REGS		1	/* struct kvm_regs */
+#define KVM_VCPU_STATE_XSAVE		2	/* struct kvm_xsave */
+#define KVM_VCPU_STATE_XCRS		3	/* struct kvm_xcrs */
+#define KVM_VCPU_STATE_SREGS		4	/* struct kvm_sregs */
+#define KVM_VCPU_STATE_MSRS		5	/* struct kvm_msrs */
+#define KVM_VCPU_STATE_MP_STATE		6	/* struct kvm_mp_state */
+#define KVM_VCPU_STATE_LAPIC		7	/* struct kvm_lapic_state */
+#define KVM_VCPU_STATE_EVENTS		8	/* struct kvm_vcpu_events */
+#define KVM_VCPU_STATE_DEBUGREGS	9	/* struct kvm_debugregs */
+
+struct kvm_vcpu_state_section {
+	__u32 id;
+	__u32 size;
+	__u8 data[0];
+};
+
+struct kvm_vcpu_state {
+	__u32 version;
+	__u32 flags;
+	__u32 size;
+	__u32 nr_sections;
+	__u8 data[0];
+};
+
+struct kvm_vcpu_states {
+	__u32 nr_vcpus;
+	__u32 stride;
+	__u64 addr;
+};
+
+#define KVM_GET_VCPU_STATE	_IOWR(KVMIO, 0xdb, struct kvm_vcpu_state)
+#define KVM_SET_VCPU_STATE	_IOW(KVMIO, 0xdc, struct kvm_vcpu_state)
+#define KVM_GET_VCPU_STATES	_IOW(KVMIO, 0xdd, struct kvm_vcpu_states)
+#define KVM_SET_VCPU_STATES	_IOW(KVMIO, 0xde, struct kvm_vcpu_states)
+
 /* Secure Encrypted Virtualization command */
 enum sev_cmd_id {
 	/* Guest initialization commands */
@@ -1711,4 +1931,52 @@ struct kvm_hyperv_eventfd {
 #define KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE    (1 << 0)
 #define KVM_DIRTY_LOG_INITIALLY_SET            (1 << 1)
 
+/*
+ * Arch needs to define the macro after implementing the dirty ring
+ * feature.  KVM_DIRTY_LOG_PAGE_OFFSET should be defined as the
+ * starting page offset of the dirty ring structures.
+ */
+#ifndef KVM_DIRTY_LOG_PAGE_OFFSET
+#define KVM_DIRTY_LOG_PAGE_OFFSET 0
+#endif
+
+/*
+ * KVM dirty GFN flags, defined as:
+ *
+ * |---------------+---------------+--------------|
+ * | bit 1 (reset) | bit 0 (dirty) | Status       |
+ * |---------------+---------------+--------------|
+ * |             0 |             0 | Invalid GFN  |
+ * |             0 |             1 | Dirty GFN    |
+ * |             1 |             1 | GFN to reset |
+ * |---------------+---------------+--------------|
+ *
+ * Lifecycle of a dirty GFN goes like:
+ *
+ *      dirtied         harvested        reset
+ * 00 -----------> 01 -------------> 1X -------+
+ *  ^                                          |
+ *  |                                          |
+ *  +------------------------------------------+
+ *
+ * The userspace program is only responsible for the 01->1X state
+ * conversion after harvesting an entry.  Also, it must not skip any
+ * dirty bits, so that dirty bits are always harvested in sequence.
+ */
+#define KVM_DIRTY_GFN_F_DIRTY           (1 << 0)
+#define KVM_DIRTY_GFN_F_RESET           (1 << 1)
+#define KVM_DIRTY_GFN_F_MASK            0x3
+
+/*
+ * KVM dirty rings should be mapped at KVM_DIRTY_LOG_PAGE_OFFSET of
+ * per-vcpu mmaped regions as an array of struct kvm_dirty_gfn.  The
+ * size of the gfn buffer is decided by the first argument when
+ * enabling KVM_CAP_DIRTY_LOG_RING.
+ */
+struct kvm_dirty_gfn {
+	__u32 flags;
+	__u32 slot;
+	__u64 offset;
+};
+
 #endif /* __LINUX_KVM_H */
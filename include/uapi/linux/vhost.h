@@ -46,6 +46,14 @@
 /* Specify an eventfd file descriptor to signal on log write. */
 #define VHOST_SET_LOG_FD _IOW(VHOST_VIRTIO, 0x07, int)
 
+/* Create a new worker thread for the device, optionally bound to a CPU. The
+ * device has one worker after VHOST_SET_OWNER, which runs all virtqueues until
+ * they are bound to another worker with VHOST_ATTACH_VRING_WORKER. */
+#define VHOST_NEW_WORKER _IOWR(VHOST_VIRTIO, 0x08, struct vhost_worker_state)
+/* Free a worker created with VHOST_NEW_WORKER. The worker must not be bound to
+ * any virtqueue. */
+#define VHOST_FREE_WORKER _IOW(VHOST_VIRTIO, 0x09, struct vhost_worker_state)
+
 /* Ring setup. */
 /* Set number of descriptors in ring. This parameter can not
  * be modified while ring is running (bound to a device). */
@@ -71,6 +79,13 @@
 #define VHOST_SET_VRING_ENDIAN _IOW(VHOST_VIRTIO, 0x13, struct vhost_vring_state)
 #define VHOST_GET_VRING_ENDIAN _IOW(VHOST_VIRTIO, 0x14, struct vhost_vring_state)
 
+/* Bind a virtqueue to a worker, which then runs its kick handler and polls. */
+#define VHOST_ATTACH_VRING_WORKER _IOW(VHOST_VIRTIO, 0x15,		\
+				       struct vhost_vring_worker)
+/* Get the id of the worker a virtqueue is bound to. */
+#define VHOST_GET_VRING_WORKER _IOWR(VHOST_VIRTIO, 0x16,		\
+				     struct vhost_vring_worker)
+
 /* The following ioctls use eventfd file descriptors to signal and poll
  * for events. */
 
@@ -27,6 +27,22 @@ struct vhost_vring_file {
 
 };
 
+struct vhost_worker_state {
+	/* For VHOST_NEW_WORKER the kernel returns the new worker id here. For
+	 * VHOST_FREE_WORKER, userspace passes the id of the worker to free.
+	 */
+	unsigned int worker_id;
+	/* CPU to run a new worker on, or -1 to run it anywhere. */
+	int cpu;
+};
+
+struct vhost_vring_worker {
+	/* vring index */
+	unsigned int index;
+	/* The id of the vhost_worker returned from VHOST_NEW_WORKER */
+	unsigned int worker_id;
+};
+
 struct vhost_vring_addr {
 	unsigned int index;
 	/* Option flags. */
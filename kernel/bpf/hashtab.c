@@ -1336,6 +1336,35 @@ static void htab_map_seq_show_elem(struct bpf_map *map, void *key,
 	rcu_read_unlock();
 }
 
+static void htab_batch_copy_elem(struct bpf_map *map, struct htab_elem *l,
+				 void *dst_key, void *dst_val,
+				 u64 elem_map_flags, bool is_percpu)
+{
+	u32 size = round_up(map->value_size, 8);
+	void *value;
+
+	memcpy(dst_key, l->key, map->key_size);
+
+	if (is_percpu) {
+		int off = 0, cpu;
+		void __percpu *pptr;
+
+		pptr = htab_elem_get_ptr(l, map->key_size);
+		for_each_possible_cpu(cpu) {
+			bpf_long_memcpy(dst_val + off, per_cpu_ptr(pptr, cpu),
+					size);
+			off += size;
+		}
+	} else {
+		value = l->key + round_up(map->key_size, 8);
+		if (elem_map_flags & BPF_F_LOCK)
+			copy_map_value_locked(map, dst_val, value, true);
+		else
+			copy_map_value(map, dst_val, value);
+		check_and_init_map_lock(map, dst_val);
+	}
+}
+
 static int
 __htab_map_lookup_and_delete_batch(struct bpf_map *map,
 				   const union bpf_attr *attr,
@@ -1344,8 +1373,8 @@ __htab_map_lookup_and_delete_batch(struct bpf_map *map,
 				   bool is_percpu)
 {
 	struct bpf_htab *htab = container_of(map, struct bpf_htab, map);
-	u32 bucket_cnt, total, key_size, value_size, roundup_key_size;
-	void *keys = NULL, *values = NULL, *value, *dst_key, *dst_val;
+	u32 bucket_cnt, total, key_size, value_size, copied;
+	void *keys = NULL, *values = NULL, *dst_key, *dst_val;
 	void __user *uvalues = u64_to_user_ptr(attr->batch.values);
 	void __user *ukeys = u64_to_user_ptr(attr->batch.keys);
 	void *ubatch = u64_to_user_ptr(attr->batch.in_batch);
@@ -1384,7 +1413,6 @@ __htab_map_lookup_and_delete_batch(struct bpf_map *map,
 		return -ENOENT;
 
 	key_size = htab->map.key_size;
-	roundup_key_size = round_up(htab->map.key_size, 8);
 	value_size = htab->map.value_size;
 	size = round_up(value_size, 8);
 	if (is_percpu)
@@ -1422,7 +1450,11 @@ __htab_map_lookup_and_delete_batch(struct bpf_map *map,
 	hlist_nulls_for_each_entry_rcu(l, n, head, hash_node)
 		bucket_cnt++;
 
-	if (bucket_cnt && !locked) {
+	/* Lookups walk the bucket under RCU only, as lookups of single
+	 * elements do, so that dumping a map does not contend with the
+	 * programs updating it.
+	 */
+	if (bucket_cnt && !locked && do_delete) {
 		locked = true;
 		goto again_nocopy;
 	}
@@ -1430,10 +1462,8 @@ __htab_map_lookup_and_delete_batch(struct bpf_map *map,
 	if (bucket_cnt > (max_count - total)) {
 		if (total == 0)
 			ret = -ENOSPC;
-		/* Note that since bucket_cnt > 0 here, it is implicit
-		 * that the locked was grabbed, so release it.
-		 */
-		htab_unlock_bucket(htab, b, flags);
+		if (locked)
+			htab_unlock_bucket(htab, b, flags);
 		rcu_read_unlock();
 		bpf_enable_instrumentation();
 		goto after_loop;
@@ -1441,10 +1471,8 @@ __htab_map_lookup_and_delete_batch(struct bpf_map *map,
 
 	if (bucket_cnt > bucket_size) {
 		bucket_size = bucket_cnt;
-		/* Note that since bucket_cnt > 0 here, it is implicit
-		 * that the locked was grabbed, so release it.
-		 */
-		htab_unlock_bucket(htab, b, flags);
+		if (locked)
+			htab_unlock_bucket(htab, b, flags);
 		rcu_read_unlock();
 		bpf_enable_instrumentation();
 		kvfree(keys);
@@ -1452,46 +1480,42 @@ __htab_map_lookup_and_delete_batch(struct bpf_map *map,
 		goto alloc;
 	}
 
-	/* Next block is only safe to run if you have grabbed the lock */
-	if (!locked)
+	if (!bucket_cnt)
 		goto next_batch;
 
-	hlist_nulls_for_each_entry_safe(l, n, head, hash_node) {
-		memcpy(dst_key, l->key, key_size);
+	if (!do_delete) {
+		/* The bucket may have changed since it was counted, copy
+		 * at most as many elements as there is room for.
+		 */
+		copied = 0;
+		hlist_nulls_for_each_entry_rcu(l, n, head, hash_node) {
+			if (copied == bucket_cnt)
+				break;
+			htab_batch_copy_elem(map, l, dst_key, dst_val,
+					     elem_map_flags, is_percpu);
+			dst_key += key_size;
+			dst_val += value_size;
+			copied++;
+		}
+		bucket_cnt = copied;
+		goto next_batch;
+	}
 
-		if (is_percpu) {
-			int off = 0, cpu;
-			void __percpu *pptr;
+	hlist_nulls_for_each_entry_safe(l, n, head, hash_node) {
+		htab_batch_copy_elem(map, l, dst_key, dst_val, elem_map_flags,
+				     is_percpu);
+		hlist_nulls_del_rcu(&l->hash_node);
 
-			pptr = htab_elem_get_ptr(l, map->key_size);
-			for_each_possible_cpu(cpu) {
-				bpf_long_memcpy(dst_val + off,
-						per_cpu_ptr(pptr, cpu), size);
-				off += size;
-			}
+		/* bpf_lru_push_free() will acquire lru_lock, which
+		 * may cause deadlock. See comments in function
+		 * prealloc_lru_pop(). Let us do bpf_lru_push_free()
+		 * after releasing the bucket lock.
+		 */
+		if (is_lru_map) {
+			l->batch_flink = node_to_free;
+			node_to_free = l;
 		} else {
-			value = l->key + roundup_key_size;
-			if (elem_map_flags & BPF_F_LOCK)
-				copy_map_value_locked(map, dst_val, value,
-						      true);
-			else
-				copy_map_value(map, dst_val, value);
-			check_and_init_map_lock(map, dst_val);
-		}
-		if (do_delete) {
-			hlist_nulls_del_rcu(&l->hash_node);
-
-			/* bpf_lru_push_free() will acquire lru_lock, which
-			 * may cause deadlock. See comments in function
-			 * prealloc_lru_pop(). Let us do bpf_lru_push_free()
-			 * after releasing the bucket lock.
-			 */
-			if (is_lru_map) {
-				l->batch_flink = node_to_free;
-				node_to_free = l;
-			} else {
-				free_htab_elem(htab, l);
-			}
+			free_htab_elem(htab, l);
 		}
 		dst_key += key_size;
 		dst_val += value_size;
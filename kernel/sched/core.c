@@ -1570,6 +1570,9 @@ static inline void enqueue_task(struct rq *rq, struct task_struct *p, int flags)
 
 	uclamp_rq_inc(rq, p);
 	p->sched_class->enqueue_task(rq, p, flags);
+
+	if (sched_core_enabled(rq))
+		sched_core_enqueue(rq, p);
 }
 
 static inline void dequeue_task(struct rq *rq, struct task_struct *p, int flags)
@@ -1582,10 +1585,323 @@ static inline void dequeue_task(struct rq *rq, struct task_struct *p, int flags)
 		psi_dequeue(p, flags & DEQUEUE_SLEEP);
 	}
 
+	if (sched_core_enabled(rq))
+		sched_core_dequeue(rq, p);
+
 	uclamp_rq_dec(rq, p);
 	p->sched_class->dequeue_task(rq, p, flags);
 }
 
+#ifdef CONFIG_SCHED_CORE
+/*
+ * Core scheduling: with a cookie in use, a CPU only runs a task whose cookie
+ * matches the one of the tasks its SMT siblings are running, where no cookie
+ * counts as a cookie of its own. When the task picked by the scheduling
+ * classes doesn't match, a matching task is looked up in the core_tree, and
+ * failing that the CPU is forced idle until its siblings change what they
+ * run. A sibling forced idle for longer than the sched latency gets the core
+ * handed over at the next tick of the CPUs keeping it out, one that waits for
+ * an RT or DL task gets it right away.
+ */
+DEFINE_STATIC_KEY_FALSE(__sched_core_enabled);
+
+static atomic_t sched_core_count;
+static DEFINE_MUTEX(sched_core_mutex);
+
+static void __sched_core_enable(void)
+{
+	int cpu;
+
+	static_branch_enable(&__sched_core_enabled);
+
+	/* Have every CPU publish what it runs under core_lock from now on. */
+	for_each_online_cpu(cpu)
+		resched_cpu(cpu);
+}
+
+static void __sched_core_disable(void)
+{
+	int cpu;
+
+	static_branch_disable(&__sched_core_enabled);
+
+	/* Nothing wakes up the CPUs that were forced idle otherwise. */
+	for_each_online_cpu(cpu) {
+		if (READ_ONCE(cpu_rq(cpu)->core_forceidle))
+			resched_cpu(cpu);
+	}
+}
+
+void sched_core_get(void)
+{
+	if (atomic_inc_not_zero(&sched_core_count))
+		return;
+
+	mutex_lock(&sched_core_mutex);
+	if (!atomic_read(&sched_core_count))
+		__sched_core_enable();
+
+	/* Order the enabling before the count seen by atomic_inc_not_zero(). */
+	smp_mb__before_atomic();
+	atomic_inc(&sched_core_count);
+	mutex_unlock(&sched_core_mutex);
+}
+
+static void __sched_core_put(struct work_struct *work)
+{
+	if (atomic_dec_and_mutex_lock(&sched_core_count, &sched_core_mutex)) {
+		__sched_core_disable();
+		mutex_unlock(&sched_core_mutex);
+	}
+}
+
+/* Cookies can be freed from atomic context, by the last put_task_struct(). */
+void sched_core_put(void)
+{
+	static DECLARE_WORK(_work, __sched_core_put);
+
+	if (!atomic_add_unless(&sched_core_count, -1, 1))
+		schedule_work(&_work);
+}
+
+static inline bool sched_core_less(struct task_struct *a,
+				   struct task_struct *b)
+{
+	if (a->core_cookie != b->core_cookie)
+		return a->core_cookie < b->core_cookie;
+
+	return a->prio < b->prio;
+}
+
+void sched_core_enqueue(struct rq *rq, struct task_struct *p)
+{
+	struct rb_node **link = &rq->core_tree.rb_node, *parent = NULL;
+
+	if (!p->core_cookie)
+		return;
+
+	while (*link) {
+		parent = *link;
+		if (sched_core_less(p, rb_entry(parent, struct task_struct,
+						core_node)))
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+
+	rb_link_node(&p->core_node, parent, link);
+	rb_insert_color(&p->core_node, &rq->core_tree);
+}
+
+void sched_core_dequeue(struct rq *rq, struct task_struct *p)
+{
+	if (!sched_core_enqueued(p))
+		return;
+
+	rb_erase(&p->core_node, &rq->core_tree);
+	RB_CLEAR_NODE(&p->core_node);
+}
+
+/*
+ * Find the highest priority task with @cookie that can be switched to right
+ * away. Only fair tasks are considered, as running a queued RT or DL task out
+ * of order would bypass their throttling.
+ */
+static struct task_struct *sched_core_find(struct rq *rq, unsigned long cookie)
+{
+	struct rb_node *node = rq->core_tree.rb_node;
+	struct task_struct *p, *first = NULL;
+
+	while (node) {
+		p = rb_entry(node, struct task_struct, core_node);
+		if (cookie <= p->core_cookie) {
+			if (cookie == p->core_cookie)
+				first = p;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+
+	for (p = first; p && p->core_cookie == cookie;
+	     p = rb_entry_safe(rb_next(&p->core_node), struct task_struct,
+			       core_node)) {
+		if (p->sched_class == &fair_sched_class &&
+		    !task_is_throttled_fair(p))
+			return p;
+	}
+
+	return NULL;
+}
+
+static inline bool sched_core_starving(struct rq *srq, struct rq *rq)
+{
+	unsigned long start = READ_ONCE(srq->core_forceidle_start);
+
+	if (!READ_ONCE(srq->core_forceidle))
+		return false;
+
+	/* RT and DL tasks can't be made to wait for the sched latency. */
+	if (!READ_ONCE(srq->core_wait_urgent) &&
+	    !time_after(jiffies, start +
+			max(1UL, nsecs_to_jiffies(sysctl_sched_latency))))
+		return false;
+
+	/* Of two starving siblings, the one that waited longer goes first. */
+	return !rq->core_forceidle || time_before(start,
+						  rq->core_forceidle_start);
+}
+
+static void sched_core_lock(const struct cpumask *smt_mask)
+{
+	int cpu, i = 0;
+
+	for_each_cpu(cpu, smt_mask)
+		raw_spin_lock_nested(&cpu_rq(cpu)->core_lock, i++);
+}
+
+static void sched_core_unlock(const struct cpumask *smt_mask)
+{
+	int cpu;
+
+	for_each_cpu(cpu, smt_mask)
+		raw_spin_unlock(&cpu_rq(cpu)->core_lock);
+}
+
+/* The sibling is idle, or about to be: no need for its rq->lock. */
+static void sched_core_kick(struct rq *srq)
+{
+	if (set_nr_and_not_polling(srq->idle))
+		smp_send_reschedule(cpu_of(srq));
+}
+
+/*
+ * A busy sibling can't be rescheduled under our rq->lock, so it is done by
+ * the sibling itself, from an interrupt.
+ */
+static void sched_core_resched_work(struct irq_work *work)
+{
+	resched_cpu(smp_processor_id());
+}
+
+static inline void sched_core_publish(struct rq *rq, struct task_struct *p,
+				      bool forceidle)
+{
+	WRITE_ONCE(rq->core_busy, !is_idle_task(p) &&
+				  p->sched_class != &stop_sched_class);
+	WRITE_ONCE(rq->core_cookie, p->core_cookie);
+	if (forceidle && !rq->core_forceidle)
+		WRITE_ONCE(rq->core_forceidle_start, jiffies);
+	WRITE_ONCE(rq->core_forceidle, forceidle);
+}
+
+static struct task_struct *sched_core_pick(struct rq *rq,
+					   struct task_struct *next)
+{
+	const struct cpumask *smt_mask = cpu_smt_mask(cpu_of(rq));
+	unsigned long cookie, old_cookie = rq->core_cookie;
+	bool busy = false, was_busy = rq->core_busy;
+	struct rq *srq, *starving = NULL;
+	struct task_struct *p = next;
+	bool forceidle = false;
+	int cpu;
+
+	sched_core_lock(smt_mask);
+
+	/* The stopper runs no matter what, and does not hold up the core. */
+	if (is_idle_task(next) || next->sched_class == &stop_sched_class)
+		goto publish;
+
+	cookie = next->core_cookie;
+	for_each_cpu(cpu, smt_mask) {
+		srq = cpu_rq(cpu);
+		if (srq == rq)
+			continue;
+
+		/* Busy siblings run the same cookie, see below. */
+		if (srq->core_busy) {
+			busy = true;
+			cookie = srq->core_cookie;
+		} else if (!starving && sched_core_starving(srq, rq)) {
+			starving = srq;
+		}
+	}
+
+	if (!busy && starving)
+		cookie = starving->core_wait_cookie;
+
+	if (cookie != next->core_cookie) {
+		p = cookie ? sched_core_find(rq, cookie) : NULL;
+
+		next->sched_class->put_prev_task(rq, next);
+		if (p) {
+			p->sched_class->set_next_task(rq, p, true);
+		} else {
+			p = pick_next_task_idle(rq);
+			rq->core_wait_cookie = next->core_cookie;
+			WRITE_ONCE(rq->core_wait_urgent,
+				   next->sched_class != &fair_sched_class);
+			forceidle = true;
+		}
+	}
+
+publish:
+	sched_core_publish(rq, p, forceidle);
+	sched_core_unlock(smt_mask);
+
+	/*
+	 * Siblings forced idle because of what we ran may be able to run now.
+	 * Reading their state without core_lock is fine, a sibling going
+	 * forced idle after this saw our new state already.
+	 */
+	if (was_busy && (!rq->core_busy || rq->core_cookie != old_cookie)) {
+		for_each_cpu(cpu, smt_mask) {
+			srq = cpu_rq(cpu);
+			if (srq != rq && READ_ONCE(srq->core_forceidle))
+				sched_core_kick(srq);
+		}
+	}
+
+	/* The siblings see us starving, and hand the core over right away. */
+	if (forceidle && rq->core_wait_urgent) {
+		for_each_cpu(cpu, smt_mask) {
+			srq = cpu_rq(cpu);
+			if (srq != rq && READ_ONCE(srq->core_busy))
+				irq_work_queue_on(&srq->core_resched_work, cpu);
+		}
+	}
+
+	return p;
+}
+
+static void sched_core_tick(struct rq *rq)
+{
+	int cpu;
+
+	if (!sched_core_enabled(rq) || !rq->core_busy)
+		return;
+
+	for_each_cpu(cpu, cpu_smt_mask(cpu_of(rq))) {
+		struct rq *srq = cpu_rq(cpu);
+
+		if (srq != rq && sched_core_starving(srq, rq)) {
+			resched_curr(rq);
+			return;
+		}
+	}
+}
+
+static void sched_core_init_rq(struct rq *rq)
+{
+	raw_spin_lock_init(&rq->core_lock);
+	rq->core_tree = RB_ROOT;
+	init_irq_work(&rq->core_resched_work, sched_core_resched_work);
+}
+#else
+static inline void sched_core_tick(struct rq *rq) { }
+static inline void sched_core_init_rq(struct rq *rq) { }
+#endif /* CONFIG_SCHED_CORE */
+
 void activate_task(struct rq *rq, struct task_struct *p, int flags)
 {
 	enqueue_task(rq, p, flags);
@@ -3547,6 +3863,11 @@ static void __sched_fork(unsigned long clone_flags, struct task_struct *p)
 #ifdef CONFIG_SMP
 	p->wake_entry.u_flags = CSD_TYPE_TTWU;
 	p->migration_pending = NULL;
+	p->wake_group = NULL;
+#endif
+#ifdef CONFIG_SCHED_CORE
+	RB_CLEAR_NODE(&p->core_node);
+	p->core_cookie = 0;
 #endif
 }
 
@@ -3750,6 +4071,7 @@ int sched_fork(unsigned long clone_flags, struct task_struct *p)
 void sched_post_fork(struct task_struct *p)
 {
 	uclamp_post_fork(p);
+	sched_core_fork(p);
 }
 
 unsigned long to_ratio(u64 period, u64 runtime)
@@ -4308,6 +4630,16 @@ bool single_task_running(void)
 }
 EXPORT_SYMBOL(single_task_running);
 
+/*
+ * Return the number of tasks runnable on the current CPU, including current.
+ * The same caution as for single_task_running() applies.
+ */
+unsigned int nr_running_this_cpu(void)
+{
+	return raw_rq()->nr_running;
+}
+EXPORT_SYMBOL_GPL(nr_running_this_cpu);
+
 unsigned long long nr_context_switches(void)
 {
 	int i;
@@ -4491,6 +4823,7 @@ void scheduler_tick(void)
 	curr->sched_class->task_tick(rq, curr, 0);
 	calc_global_load_tick(rq);
 	psi_task_tick(rq);
+	sched_core_tick(rq);
 
 	rq_unlock(rq, &rf);
 
@@ -4819,7 +5152,7 @@ static void put_prev_task_balance(struct rq *rq, struct task_struct *prev,
  * Pick up the highest-prio task:
  */
 static inline struct task_struct *
-pick_next_task(struct rq *rq, struct task_struct *prev, struct rq_flags *rf)
+__pick_next_task(struct rq *rq, struct task_struct *prev, struct rq_flags *rf)
 {
 	const struct sched_class *class;
 	struct task_struct *p;
@@ -4859,6 +5192,22 @@ pick_next_task(struct rq *rq, struct task_struct *prev, struct rq_flags *rf)
 	BUG();
 }
 
+static struct task_struct *
+pick_next_task(struct rq *rq, struct task_struct *prev, struct rq_flags *rf)
+{
+	struct task_struct *next = __pick_next_task(rq, prev, rf);
+
+#ifdef CONFIG_SCHED_CORE
+	if (sched_core_enabled(rq))
+		return sched_core_pick(rq, next);
+
+	/* Keep the state current, for when core scheduling gets enabled. */
+	sched_core_publish(rq, next, false);
+#endif
+
+	return next;
+}
+
 /*
  * __schedule() is the main scheduler function.
  *
@@ -6650,6 +6999,46 @@ int __cond_resched_lock(spinlock_t *lock)
 }
 EXPORT_SYMBOL(__cond_resched_lock);
 
+int __cond_resched_rwlock_read(rwlock_t *lock)
+{
+	int resched = should_resched(PREEMPT_LOCK_OFFSET);
+	int ret = 0;
+
+	lockdep_assert_held_read(lock);
+
+	if (rwlock_needbreak(lock) || resched) {
+		read_unlock(lock);
+		if (resched)
+			preempt_schedule_common();
+		else
+			cpu_relax();
+		ret = 1;
+		read_lock(lock);
+	}
+	return ret;
+}
+EXPORT_SYMBOL(__cond_resched_rwlock_read);
+
+int __cond_resched_rwlock_write(rwlock_t *lock)
+{
+	int resched = should_resched(PREEMPT_LOCK_OFFSET);
+	int ret = 0;
+
+	lockdep_assert_held_write(lock);
+
+	if (rwlock_needbreak(lock) || resched) {
+		write_unlock(lock);
+		if (resched)
+			preempt_schedule_common();
+		else
+			cpu_relax();
+		ret = 1;
+		write_lock(lock);
+	}
+	return ret;
+}
+EXPORT_SYMBOL(__cond_resched_rwlock_write);
+
 /**
  * yield - yield the current processor to other threads.
  *
@@ -7746,6 +8135,7 @@ void __init sched_init(void)
 #endif
 #endif /* CONFIG_SMP */
 		hrtick_rq_init(rq);
+		sched_core_init_rq(rq);
 		atomic_set(&rq->nr_iowait, 0);
 	}
 
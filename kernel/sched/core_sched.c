@@ -0,0 +1,115 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Core scheduling cookies
+ *
+ * A cookie is an opaque, refcounted tag. Tasks with the same cookie may share
+ * an SMT core, tasks with different cookies may not. Each task holds a
+ * reference to its cookie.
+ */
+
+#include "sched.h"
+
+struct sched_core_cookie {
+	refcount_t		refcnt;
+};
+
+unsigned long sched_core_alloc_cookie(void)
+{
+	struct sched_core_cookie *ck = kmalloc(sizeof(*ck), GFP_KERNEL);
+
+	if (!ck)
+		return 0;
+
+	refcount_set(&ck->refcnt, 1);
+	sched_core_get();
+
+	return (unsigned long)ck;
+}
+EXPORT_SYMBOL_GPL(sched_core_alloc_cookie);
+
+void sched_core_put_cookie(unsigned long cookie)
+{
+	struct sched_core_cookie *ck = (void *)cookie;
+
+	if (ck && refcount_dec_and_test(&ck->refcnt)) {
+		kfree(ck);
+		sched_core_put();
+	}
+}
+EXPORT_SYMBOL_GPL(sched_core_put_cookie);
+
+static unsigned long sched_core_get_cookie(unsigned long cookie)
+{
+	struct sched_core_cookie *ck = (void *)cookie;
+
+	if (ck)
+		refcount_inc(&ck->refcnt);
+
+	return cookie;
+}
+
+/*
+ * Swap the cookie of @p for @cookie, whose reference is passed on to @p, and
+ * return the old cookie, whose reference is passed on to the caller.
+ */
+static unsigned long sched_core_update_cookie(struct task_struct *p,
+					      unsigned long cookie)
+{
+	unsigned long old_cookie;
+	struct rq_flags rf;
+	struct rq *rq;
+
+	rq = task_rq_lock(p, &rf);
+
+	/* sched_core_get() enabled core scheduling before the cookie existed. */
+	SCHED_WARN_ON((p->core_cookie || cookie) && !sched_core_enabled(rq));
+
+	sched_core_dequeue(rq, p);
+
+	old_cookie = p->core_cookie;
+	p->core_cookie = cookie;
+
+	if (task_on_rq_queued(p))
+		sched_core_enqueue(rq, p);
+
+	/* Have the new cookie taken into account right away. */
+	if (task_running(rq, p))
+		resched_curr(rq);
+
+	task_rq_unlock(rq, p, &rf);
+
+	return old_cookie;
+}
+
+/**
+ * sched_core_set_cookie - tag a task with a core scheduling cookie
+ * @p: the task
+ * @cookie: a cookie from sched_core_alloc_cookie(), or 0 to untag @p
+ *
+ * @p takes a reference to @cookie, and drops the one to its old cookie.
+ */
+void sched_core_set_cookie(struct task_struct *p, unsigned long cookie)
+{
+	if (READ_ONCE(p->core_cookie) == cookie)
+		return;
+
+	cookie = sched_core_update_cookie(p, sched_core_get_cookie(cookie));
+	sched_core_put_cookie(cookie);
+}
+EXPORT_SYMBOL_GPL(sched_core_set_cookie);
+
+/* Called from sched_post_fork(), __sched_fork() cleared p->core_cookie. */
+void sched_core_fork(struct task_struct *p)
+{
+	unsigned long flags;
+
+	/* The cookie of current can't be put while we hold its pi_lock. */
+	raw_spin_lock_irqsave(&current->pi_lock, flags);
+	p->core_cookie = sched_core_get_cookie(current->core_cookie);
+	raw_spin_unlock_irqrestore(&current->pi_lock, flags);
+}
+
+void sched_core_free(struct task_struct *p)
+{
+	sched_core_put_cookie(p->core_cookie);
+}
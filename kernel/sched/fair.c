@@ -6701,6 +6701,47 @@ static int find_energy_efficient_cpu(struct task_struct *p, int prev_cpu)
 	return -1;
 }
 
+#ifdef CONFIG_SCHED_CORE
+bool task_is_throttled_fair(struct task_struct *p)
+{
+	return throttled_hierarchy(cfs_rq_of(&p->se));
+}
+#endif
+
+/*
+ * Wakeup placement for the tasks of a wake group, which share their working
+ * set. A wakeup from a sibling, like a vCPU sending an IPI to another vCPU of
+ * the same VM, goes to an idle CPU in the waker's LLC if there is one. Any
+ * other wakeup keeps the task in the LLC of prev_cpu, preferring prev_cpu
+ * itself, instead of following the waker around as wake_affine() would.
+ *
+ * Returns -1 when the regular wakeup path should be taken.
+ */
+static int select_wake_group_cpu(struct task_struct *p, int prev_cpu, int cpu)
+{
+	const void *group = READ_ONCE(p->wake_group);
+	int target = -1;
+
+	if (!sched_feat(WA_GROUP) || !group ||
+	    !cpumask_test_cpu(prev_cpu, p->cpus_ptr))
+		return -1;
+
+	rcu_read_lock();
+	if (READ_ONCE(current->wake_group) == group &&
+	    !cpus_share_cache(cpu, prev_cpu) &&
+	    cpumask_test_cpu(cpu, p->cpus_ptr)) {
+		target = select_idle_sibling(p, prev_cpu, cpu);
+		if (!available_idle_cpu(target) && !sched_idle_cpu(target))
+			target = -1;
+	}
+
+	if (target < 0)
+		target = select_idle_sibling(p, prev_cpu, prev_cpu);
+	rcu_read_unlock();
+
+	return target;
+}
+
 /*
  * select_task_rq_fair: Select target runqueue for the waking task in domains
  * that have the relevant SD flag set. In practice, this is SD_BALANCE_WAKE,
@@ -6734,6 +6775,11 @@ select_task_rq_fair(struct task_struct *p, int prev_cpu, int wake_flags)
 			new_cpu = prev_cpu;
 		}
 
+		new_cpu = select_wake_group_cpu(p, prev_cpu, cpu);
+		if (new_cpu >= 0)
+			return new_cpu;
+		new_cpu = prev_cpu;
+
 		want_affine = !wake_wide(p) && cpumask_test_cpu(cpu, p->cpus_ptr);
 	}
 
@@ -85,6 +85,12 @@ SCHED_FEAT(WA_IDLE, true)
 SCHED_FEAT(WA_WEIGHT, true)
 SCHED_FEAT(WA_BIAS, true)
 
+/*
+ * Keep the wakeups of tasks in a wake group in the LLC of the waking
+ * sibling, or else in the LLC of the previous CPU.
+ */
+SCHED_FEAT(WA_GROUP, true)
+
 /*
  * UtilEstimation. Use estimated CPU utilization.
  */
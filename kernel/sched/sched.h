@@ -1061,6 +1061,29 @@ struct rq {
 #endif
 	unsigned int		push_busy;
 	struct cpu_stop_work	push_work;
+
+#ifdef CONFIG_SCHED_CORE
+	/*
+	 * What this CPU runs, as seen by its SMT siblings. Written by the CPU
+	 * itself in __schedule(), with core_lock held when core scheduling
+	 * is enabled. core_lock nests inside rq->lock, and the core_locks of
+	 * a core are taken in CPU order.
+	 */
+	raw_spinlock_t		core_lock;
+	unsigned int		core_busy;
+	unsigned int		core_forceidle;
+	unsigned long		core_cookie;
+	/* Cookie of the task we went forced idle instead of, and since when */
+	unsigned long		core_wait_cookie;
+	unsigned long		core_forceidle_start;
+	/* That task was RT or DL, and gets the core without waiting */
+	unsigned int		core_wait_urgent;
+
+	/* Queued tasks with a cookie, by cookie and then priority */
+	struct rb_root		core_tree;
+	/* Reschedules this CPU for an RT or DL task waiting on a sibling */
+	struct irq_work		core_resched_work;
+#endif
 };
 
 #ifdef CONFIG_FAIR_GROUP_SCHED
@@ -1099,6 +1122,33 @@ static inline bool is_migration_disabled(struct task_struct *p)
 #endif
 }
 
+#ifdef CONFIG_SCHED_CORE
+DECLARE_STATIC_KEY_FALSE(__sched_core_enabled);
+
+static inline bool sched_core_enabled(struct rq *rq)
+{
+	return static_branch_unlikely(&__sched_core_enabled);
+}
+
+static inline bool sched_core_enqueued(struct task_struct *p)
+{
+	return !RB_EMPTY_NODE(&p->core_node);
+}
+
+extern void sched_core_enqueue(struct rq *rq, struct task_struct *p);
+extern void sched_core_dequeue(struct rq *rq, struct task_struct *p);
+
+extern void sched_core_get(void);
+extern void sched_core_put(void);
+
+extern bool task_is_throttled_fair(struct task_struct *p);
+#else
+static inline bool sched_core_enabled(struct rq *rq)
+{
+	return false;
+}
+#endif /* CONFIG_SCHED_CORE */
+
 #ifdef CONFIG_SCHED_SMT
 extern void __update_idle_core(struct rq *rq);
 
@@ -449,6 +449,59 @@ int __sbitmap_queue_get(struct sbitmap_queue *sbq)
 }
 EXPORT_SYMBOL_GPL(__sbitmap_queue_get);
 
+unsigned long __sbitmap_queue_get_batch(struct sbitmap_queue *sbq, int nr_tags,
+					unsigned int *offset)
+{
+	struct sbitmap *sb = &sbq->sb;
+	unsigned int hint, depth, index;
+	unsigned long get_mask, nr;
+	long val;
+	int i;
+
+	if (unlikely(sbq->round_robin))
+		return 0;
+
+	depth = READ_ONCE(sb->depth);
+	hint = this_cpu_read(*sbq->alloc_hint);
+	if (unlikely(hint >= depth))
+		hint = depth ? prandom_u32() % depth : 0;
+	index = SB_NR_TO_INDEX(sb, hint);
+
+	for (i = 0; i < sb->map_nr; i++) {
+		struct sbitmap_word *map = &sb->map[index];
+
+		sbitmap_deferred_clear(sb, index);
+
+		/*
+		 * Claim the run of bits following the first free one with a
+		 * single atomic, and keep those that weren't already set.
+		 */
+		nr = find_first_zero_bit(&map->word, map->depth);
+		if (nr + nr_tags <= map->depth) {
+			get_mask = ((1UL << nr_tags) - 1) << nr;
+			val = READ_ONCE(map->word);
+			while (!atomic_long_try_cmpxchg((atomic_long_t *)&map->word,
+							&val, val | get_mask))
+				;
+			get_mask = (get_mask & ~val) >> nr;
+			if (get_mask) {
+				*offset = nr + (index << sb->shift);
+				hint = *offset + nr_tags;
+				if (hint >= depth - 1)
+					hint = 0;
+				this_cpu_write(*sbq->alloc_hint, hint);
+				return get_mask;
+			}
+		}
+
+		if (++index >= sb->map_nr)
+			index = 0;
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(__sbitmap_queue_get_batch);
+
 int __sbitmap_queue_get_shallow(struct sbitmap_queue *sbq,
 				unsigned int shallow_depth)
 {
@@ -589,6 +642,45 @@ void sbitmap_queue_clear(struct sbitmap_queue *sbq, unsigned int nr,
 }
 EXPORT_SYMBOL_GPL(sbitmap_queue_clear);
 
+void sbitmap_queue_clear_batch(struct sbitmap_queue *sbq, int offset,
+			       int *tags, int nr_tags)
+{
+	struct sbitmap *sb = &sbq->sb;
+	unsigned long *addr = NULL;
+	unsigned long mask = 0;
+	int i, nr;
+
+	/* See sbitmap_queue_clear() for the barriers. */
+	smp_mb__before_atomic();
+	for (i = 0; i < nr_tags; i++) {
+		unsigned long *this_addr;
+
+		/*
+		 * Clear the bits of each word with one atomic. The tags of a
+		 * batch tend to be close, so that's often a single one.
+		 */
+		nr = tags[i] - offset;
+		this_addr = &sb->map[SB_NR_TO_INDEX(sb, nr)].word;
+		if (addr && addr != this_addr) {
+			atomic_long_andnot(mask, (atomic_long_t *)addr);
+			mask = 0;
+		}
+		addr = this_addr;
+		mask |= 1UL << SB_NR_TO_BIT(sb, nr);
+	}
+	if (mask)
+		atomic_long_andnot(mask, (atomic_long_t *)addr);
+	smp_mb__after_atomic();
+
+	for (i = 0; i < nr_tags; i++)
+		sbitmap_queue_wake_up(sbq);
+
+	nr = tags[nr_tags - 1] - offset;
+	if (likely(!sbq->round_robin && nr < sb->depth))
+		this_cpu_write(*sbq->alloc_hint, nr);
+}
+EXPORT_SYMBOL_GPL(sbitmap_queue_clear_batch);
+
 void sbitmap_queue_wake_all(struct sbitmap_queue *sbq)
 {
 	int i, wake_index;
@@ -401,6 +401,40 @@ static noinline void check_insert(struct xarray *xa)
 	XA_BUG_ON(xa, !xa_empty(xa));
 }
 
+static noinline void check_insert_bulk(struct xarray *xa)
+{
+	void *entries[300];
+	unsigned long i;
+
+	for (i = 0; i < ARRAY_SIZE(entries); i++)
+		entries[i] = xa_mk_index(i + 60);
+
+	XA_BUG_ON(xa, xa_insert_bulk(xa, 60, entries, ARRAY_SIZE(entries),
+				GFP_KERNEL) != 0);
+	for (i = 0; i < ARRAY_SIZE(entries); i++)
+		XA_BUG_ON(xa, xa_load(xa, i + 60) != xa_mk_index(i + 60));
+	XA_BUG_ON(xa, xa_load(xa, 59) != NULL);
+	XA_BUG_ON(xa, xa_load(xa, 360) != NULL);
+
+	/* Overlapping an existing entry stores nothing */
+	XA_BUG_ON(xa, xa_insert_bulk(xa, 0, entries, 61, GFP_KERNEL) != -EBUSY);
+	for (i = 0; i < 60; i++)
+		XA_BUG_ON(xa, xa_load(xa, i) != NULL);
+	XA_BUG_ON(xa, xa_insert_bulk(xa, ~0UL, entries, 2, GFP_KERNEL) !=
+			-EINVAL);
+
+	xa_destroy(xa);
+
+	/* NULL entries are reserved */
+	entries[1] = NULL;
+	XA_BUG_ON(xa, xa_insert_bulk(xa, 0, entries, 3, GFP_KERNEL) != 0);
+	XA_BUG_ON(xa, xa_load(xa, 1) != NULL);
+	XA_BUG_ON(xa, xa_insert(xa, 1, xa_mk_index(1), 0) != -EBUSY);
+	xa_destroy(xa);
+
+	XA_BUG_ON(xa, !xa_empty(xa));
+}
+
 static noinline void check_cmpxchg(struct xarray *xa)
 {
 	void *FIVE = xa_mk_value(5);
@@ -1776,6 +1810,7 @@ static int xarray_checks(void)
 	check_xa_shrink(&array);
 	check_xas_erase(&array);
 	check_insert(&array);
+	check_insert_bulk(&array);
 	check_cmpxchg(&array);
 	check_reserve(&array);
 	check_reserve(&xa0);
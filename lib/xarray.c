@@ -1657,6 +1657,77 @@ int __xa_insert(struct xarray *xa, unsigned long index, void *entry, gfp_t gfp)
 }
 EXPORT_SYMBOL(__xa_insert);
 
+/**
+ * xa_insert_bulk() - Store entries at consecutive indices if none is present.
+ * @xa: XArray.
+ * @index: Index of the first entry.
+ * @entries: Array of @nr new entries.
+ * @nr: Number of entries.
+ * @gfp: Memory allocation flags.
+ *
+ * Stores @entries[i] at @index + i, walking the tree once rather than
+ * once per entry.  Like xa_insert(), a NULL entry stores a reserved
+ * entry and the insertion fails if any of the indices is not empty.  On
+ * failure, none of the entries is left in the array, though lockless
+ * readers may have seen some of them in the meantime.
+ *
+ * Context: Any context.  Takes and releases the xa_lock.  May sleep if
+ * the @gfp flags permit.
+ * Return: 0 if the store succeeded.  -EBUSY if another entry was present.
+ * -ENOMEM if memory could not be allocated.  -EINVAL if the range wraps
+ * or one of the entries cannot be stored in an XArray.
+ */
+int xa_insert_bulk(struct xarray *xa, unsigned long index, void **entries,
+		unsigned long nr, gfp_t gfp)
+{
+	XA_STATE(xas, xa, index);
+	unsigned long i;
+	void *curr;
+	int err;
+
+	if (!nr)
+		return 0;
+	if (index + nr - 1 < index)
+		return -EINVAL;
+	for (i = 0; i < nr; i++)
+		if (WARN_ON_ONCE(xa_is_advanced(entries[i])))
+			return -EINVAL;
+
+	i = 0;
+	xas_lock(&xas);
+	do {
+		/* (Re)walk to index + i, then step from slot to slot. */
+		curr = xas_load(&xas);
+		for (;;) {
+			if (curr) {
+				xas_set_err(&xas, -EBUSY);
+				break;
+			}
+			xas_store(&xas, entries[i] ? entries[i] : XA_ZERO_ENTRY);
+			if (xas_error(&xas))
+				break;
+			if (xa_track_free(xa))
+				xas_clear_mark(&xas, XA_FREE_MARK);
+			if (++i == nr)
+				break;
+			curr = xas_next(&xas);
+		}
+	} while (__xas_nomem(&xas, gfp));
+
+	err = xas_error(&xas);
+	if (err) {
+		/* Erasing may free nodes, so walk from the top for each one. */
+		while (i--) {
+			xas_set(&xas, index + i);
+			xas_store(&xas, NULL);
+		}
+	}
+	xas_unlock(&xas);
+
+	return err;
+}
+EXPORT_SYMBOL(xa_insert_bulk);
+
 #ifdef CONFIG_XARRAY_MULTI
 static void xas_set_range(struct xa_state *xas, unsigned long first,
 		unsigned long last)
@@ -42,6 +42,7 @@
 #include <linux/userfaultfd_k.h>
 #include <linux/page_owner.h>
 #include "internal.h"
+#include "hugetlb_vmemmap.h"
 
 int hugetlb_max_hstate __read_mostly;
 unsigned int default_hstate_idx;
@@ -1022,14 +1023,141 @@ static bool vma_has_reserves(struct vm_area_struct *vma, long chg)
 	return false;
 }
 
+/*
+ * Internal hugetlb specific page flag, set on the free pages that were zeroed
+ * in the pool.  It only means something for a page that alloc_huge_page() just
+ * returned, and is cleared when the page is freed.
+ */
+static inline bool PageHugeZeroed(struct page *page)
+{
+	return PageOwnerPriv1(&page[1]);
+}
+
+static inline void SetPageHugeZeroed(struct page *page)
+{
+	SetPageOwnerPriv1(&page[1]);
+}
+
+static inline void ClearPageHugeZeroed(struct page *page)
+{
+	ClearPageOwnerPriv1(&page[1]);
+}
+
+static void hugetlb_prezero_workfn(struct work_struct *work);
+static DECLARE_WORK(hugetlb_prezero_work, hugetlb_prezero_workfn);
+
+/*
+ * The free page that the prezero worker is clearing, protected by hugetlb_lock.
+ * It stays counted as free, and __free_huge_page() puts it back in the pool.
+ */
+static struct page *hugetlb_prezero_page;
+static DECLARE_WAIT_QUEUE_HEAD(hugetlb_prezero_wait);
+
 static void enqueue_huge_page(struct hstate *h, struct page *page)
 {
 	int nid = page_to_nid(page);
-	list_move(&page->lru, &h->hugepage_freelists[nid]);
+
+	/*
+	 * The zeroed pages are handed out first, and the pages that are still
+	 * to be zeroed wait at the tail, where the prezero worker looks.
+	 */
+	if (h->prezero && !PageHugeZeroed(page)) {
+		list_move_tail(&page->lru, &h->hugepage_freelists[nid]);
+		queue_work(system_unbound_wq, &hugetlb_prezero_work);
+	} else {
+		list_move(&page->lru, &h->hugepage_freelists[nid]);
+	}
 	h->free_huge_pages++;
 	h->free_huge_pages_node[nid]++;
 }
 
+/*
+ * Take a free page that is not zeroed yet off the free lists, without dipping
+ * into the reserves.  The page is refcounted meanwhile, like a page in use,
+ * so that dissolve_free_huge_page() leaves it alone, but it stays counted as
+ * free so that reservations don't fail while it is being cleared.
+ */
+static struct page *isolate_unzeroed_huge_page(struct hstate *h)
+{
+	struct page *page;
+	int nid;
+
+	spin_lock(&hugetlb_lock);
+	if (!h->prezero || h->free_huge_pages <= h->resv_huge_pages)
+		goto out;
+
+	for_each_node_state(nid, N_MEMORY) {
+		list_for_each_entry_reverse(page, &h->hugepage_freelists[nid],
+					    lru) {
+			if (PageHugeZeroed(page) || PageHWPoison(page))
+				continue;
+
+			list_move(&page->lru, &h->hugepage_activelist);
+			set_page_refcounted(page);
+			hugetlb_prezero_page = page;
+			spin_unlock(&hugetlb_lock);
+			return page;
+		}
+	}
+out:
+	spin_unlock(&hugetlb_lock);
+	return NULL;
+}
+
+/*
+ * Called with hugetlb_lock held by an allocation that found no free page of @h
+ * on the free lists, and returns with hugetlb_lock held.  Returns true after
+ * waiting for the prezero worker to put back the page of @h that it was
+ * clearing, as that page is still counted as free.
+ */
+static bool hugetlb_prezero_wait_page(struct hstate *h)
+{
+	if (!hugetlb_prezero_page || page_hstate(hugetlb_prezero_page) != h)
+		return false;
+
+	spin_unlock(&hugetlb_lock);
+	wait_event(hugetlb_prezero_wait, !READ_ONCE(hugetlb_prezero_page));
+	spin_lock(&hugetlb_lock);
+
+	return true;
+}
+
+static void hugetlb_prezero_workfn(struct work_struct *work)
+{
+	struct page *page;
+	struct hstate *h;
+
+	for_each_hstate(h) {
+		while ((page = isolate_unzeroed_huge_page(h))) {
+			clear_huge_page(page, 0, pages_per_huge_page(h));
+
+			/*
+			 * Free the page like any other, so that surplus pages
+			 * are given back to the buddy allocator.
+			 */
+			put_page(page);
+			wake_up_all(&hugetlb_prezero_wait);
+
+			cond_resched();
+		}
+	}
+}
+
+/*
+ * Clear a page that alloc_huge_page() returned for @addr, unless it was zeroed
+ * in the pool already.
+ */
+void clear_huge_page_unless_zeroed(struct hstate *h, struct page *page,
+				   unsigned long addr)
+{
+	if (PageHugeZeroed(page)) {
+		ClearPageHugeZeroed(page);
+		return;
+	}
+
+	clear_huge_page(page, addr, pages_per_huge_page(h));
+}
+
 static struct page *dequeue_huge_page_node_exact(struct hstate *h, int nid)
 {
 	struct page *page;
@@ -1291,13 +1419,56 @@ static inline void destroy_compound_gigantic_page(struct page *page,
 						unsigned int order) { }
 #endif
 
-static void update_and_free_page(struct hstate *h, struct page *page)
+/*
+ * Put back a page taken off the pool, whose vmemmap could not be restored, as a
+ * free surplus page.  The surplus pages are freed again when no longer needed.
+ */
+static void putback_surplus_huge_page(struct hstate *h, struct page *page)
+{
+	int nid = page_to_nid(page);
+
+	INIT_LIST_HEAD(&page->lru);
+	enqueue_huge_page(h, page);
+	h->surplus_huge_pages++;
+	h->surplus_huge_pages_node[nid]++;
+}
+
+/*
+ * The tail struct pages are written to when the page is freed, so they need
+ * their own vmemmap back first.  That takes thousands of pages for a gigantic
+ * page, which are allocated with the hugetlb_lock dropped.
+ */
+static int restore_huge_page_vmemmap(struct hstate *h, struct page *page)
+{
+	int ret;
+
+	if (!hstate_is_gigantic(h))
+		return alloc_huge_page_vmemmap(h, page, GFP_ATOMIC);
+
+	spin_unlock(&hugetlb_lock);
+	ret = alloc_huge_page_vmemmap(h, page, GFP_KERNEL | __GFP_NORETRY);
+	spin_lock(&hugetlb_lock);
+
+	return ret;
+}
+
+/*
+ * Returns 0 when the page is freed, or -ENOMEM when it is put back as a free
+ * surplus page instead.
+ */
+static int update_and_free_page(struct hstate *h, struct page *page)
 {
 	int i;
 
 	if (hstate_is_gigantic(h) && !gigantic_page_runtime_supported())
-		return;
+		return 0;
+
+	if (restore_huge_page_vmemmap(h, page)) {
+		putback_surplus_huge_page(h, page);
+		return -ENOMEM;
+	}
 
+	ClearPageHugeZeroed(page);
 	h->nr_huge_pages--;
 	h->nr_huge_pages_node[page_to_nid(page)]--;
 	for (i = 0; i < pages_per_huge_page(h); i++) {
@@ -1322,6 +1493,8 @@ static void update_and_free_page(struct hstate *h, struct page *page)
 	} else {
 		__free_pages(page, huge_page_order(h));
 	}
+
+	return 0;
 }
 
 struct hstate *size_to_hstate(unsigned long size)
@@ -1392,11 +1565,12 @@ static void __free_huge_page(struct page *page)
 	int nid = page_to_nid(page);
 	struct hugepage_subpool *spool =
 		(struct hugepage_subpool *)page_private(page);
-	bool restore_reserve;
+	bool restore_reserve, zeroed;
 
 	VM_BUG_ON_PAGE(page_count(page), page);
 	VM_BUG_ON_PAGE(page_mapcount(page), page);
 
+	ClearPageHugeZeroed(page);
 	set_page_private(page, 0);
 	page->mapping = NULL;
 	restore_reserve = PagePrivate(page);
@@ -1430,6 +1604,14 @@ static void __free_huge_page(struct page *page)
 	if (restore_reserve)
 		h->resv_huge_pages++;
 
+	/* The prezero worker kept the page counted as free while clearing it. */
+	zeroed = page == hugetlb_prezero_page;
+	if (zeroed) {
+		hugetlb_prezero_page = NULL;
+		h->free_huge_pages--;
+		h->free_huge_pages_node[nid]--;
+	}
+
 	if (PageHugeTemporary(page)) {
 		list_del(&page->lru);
 		ClearPageHugeTemporary(page);
@@ -1442,6 +1624,8 @@ static void __free_huge_page(struct page *page)
 		h->surplus_huge_pages_node[nid]--;
 	} else {
 		arch_clear_hugepage_flags(page);
+		if (zeroed)
+			SetPageHugeZeroed(page);
 		enqueue_huge_page(h, page);
 	}
 	spin_unlock(&hugetlb_lock);
@@ -1497,6 +1681,7 @@ void free_huge_page(struct page *page)
 
 static void prep_new_huge_page(struct hstate *h, struct page *page, int nid)
 {
+	free_huge_page_vmemmap(h, page);
 	INIT_LIST_HEAD(&page->lru);
 	set_compound_page_dtor(page, HUGETLB_PAGE_DTOR);
 	set_hugetlb_cgroup(page, NULL);
@@ -1811,8 +1996,7 @@ static int free_pool_huge_page(struct hstate *h, nodemask_t *nodes_allowed,
 				h->surplus_huge_pages--;
 				h->surplus_huge_pages_node[node]--;
 			}
-			update_and_free_page(h, page);
-			ret = 1;
+			ret = !update_and_free_page(h, page);
 			break;
 		}
 	}
@@ -1850,6 +2034,15 @@ int dissolve_free_huge_page(struct page *page)
 		int nid = page_to_nid(head);
 		if (h->free_huge_pages - h->resv_huge_pages == 0)
 			goto out;
+		list_del(&head->lru);
+		h->free_huge_pages--;
+		h->free_huge_pages_node[nid]--;
+		/* Moving the HWPoison flag below writes to a tail page. */
+		if (restore_huge_page_vmemmap(h, head)) {
+			putback_surplus_huge_page(h, head);
+			rc = -ENOMEM;
+			goto out;
+		}
 		/*
 		 * Move PageHWPoison flag from head page to the raw error page,
 		 * which makes any subpages rather than the error page reusable.
@@ -1858,9 +2051,6 @@ int dissolve_free_huge_page(struct page *page)
 			SetPageHWPoison(page);
 			ClearPageHWPoison(head);
 		}
-		list_del(&head->lru);
-		h->free_huge_pages--;
-		h->free_huge_pages_node[nid]--;
 		h->max_huge_pages--;
 		update_and_free_page(h, head);
 		rc = 0;
@@ -2401,6 +2591,9 @@ struct page *alloc_huge_page(struct vm_area_struct *vma,
 	 * a reservation exists for the allocation.
 	 */
 	page = dequeue_huge_page_vma(h, vma, addr, avoid_reserve, gbl_chg);
+	if (!page && hugetlb_prezero_wait_page(h))
+		page = dequeue_huge_page_vma(h, vma, addr, avoid_reserve,
+					     gbl_chg);
 	if (!page) {
 		spin_unlock(&hugetlb_lock);
 		page = alloc_buddy_huge_page_with_mpol(h, vma, addr);
@@ -2626,9 +2819,9 @@ static void try_to_free_low(struct hstate *h, unsigned long count,
 			if (PageHighMem(page))
 				continue;
 			list_del(&page->lru);
-			update_and_free_page(h, page);
 			h->free_huge_pages--;
 			h->free_huge_pages_node[page_to_nid(page)]--;
+			update_and_free_page(h, page);
 		}
 	}
 }
@@ -2997,12 +3190,45 @@ static ssize_t surplus_hugepages_show(struct kobject *kobj,
 }
 HSTATE_ATTR_RO(surplus_hugepages);
 
+static ssize_t prezero_show(struct kobject *kobj,
+			    struct kobj_attribute *attr, char *buf)
+{
+	struct hstate *h = kobj_to_hstate(kobj, NULL);
+
+	return sprintf(buf, "%d\n", h->prezero);
+}
+
+static ssize_t prezero_store(struct kobject *kobj,
+			     struct kobj_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct hstate *h = kobj_to_hstate(kobj, NULL);
+	bool prezero;
+	int err;
+
+	err = kstrtobool(buf, &prezero);
+	if (err)
+		return err;
+
+	spin_lock(&hugetlb_lock);
+	h->prezero = prezero;
+	spin_unlock(&hugetlb_lock);
+
+	/* Zero the pages that are in the pool already. */
+	if (prezero)
+		queue_work(system_unbound_wq, &hugetlb_prezero_work);
+
+	return count;
+}
+HSTATE_ATTR(prezero);
+
 static struct attribute *hstate_attrs[] = {
 	&nr_hugepages_attr.attr,
 	&nr_overcommit_hugepages_attr.attr,
 	&free_hugepages_attr.attr,
 	&resv_hugepages_attr.attr,
 	&surplus_hugepages_attr.attr,
+	&prezero_attr.attr,
 #ifdef CONFIG_NUMA
 	&nr_hugepages_mempolicy_attr.attr,
 #endif
@@ -3286,6 +3512,7 @@ void __init hugetlb_add_hstate(unsigned int order)
 	h->next_nid_to_free = first_memory_node;
 	snprintf(h->name, HSTATE_NAME_LEN, "hugepages-%lukB",
 					huge_page_size(h)/1024);
+	hugetlb_vmemmap_init(h);
 
 	parsed_hstate = h;
 }
@@ -4404,7 +4631,7 @@ static vm_fault_t hugetlb_no_page(struct mm_struct *mm,
 			ret = vmf_error(PTR_ERR(page));
 			goto out;
 		}
-		clear_huge_page(page, address, pages_per_huge_page(h));
+		clear_huge_page_unless_zeroed(h, page, address);
 		__SetPageUptodate(page);
 		new_page = true;
 
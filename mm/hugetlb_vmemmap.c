@@ -0,0 +1,139 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Free the vmemmap pages of the HugeTLB pages in the pool
+ *
+ * The struct pages of a HugeTLB page take 8 vmemmap pages for a 2MB page and
+ * 4096 for a 1GB page, but hugetlb only uses the head page and the first few
+ * tail pages; all the following tail pages are identical.  So the vmemmap of
+ * the tail pages is remapped, read-only, to the second vmemmap page of the
+ * HugeTLB page, and the vmemmap pages that backed them are freed:
+ *
+ *	vmemmap of a 2MB page		    physical pages
+ *	+-----------+			    +-----------+
+ *	|     0     | -------------------> |     0     |  head, tails 1-63
+ *	+-----------+			    +-----------+
+ *	|     1     | -------------------> |     1     |  tails 64-127
+ *	+-----------+		    ^ ^ ^   +-----------+
+ *	|     2     | --------------+ | |
+ *	+-----------+		      | |
+ *	|    ...    | ----------------+ |
+ *	+-----------+			|
+ *	|     7     | ------------------+
+ *	+-----------+
+ *
+ * The vmemmap is restored before the HugeTLB page is freed to the buddy
+ * allocator, or before anything writes to the tail struct pages.
+ */
+#define pr_fmt(fmt)	"HugeTLB: " fmt
+
+#include <linux/log2.h>
+#include <linux/mm.h>
+
+#include "hugetlb_vmemmap.h"
+
+/* The vmemmap pages that each HugeTLB page keeps. */
+#define RESERVE_VMEMMAP_NR		2U
+#define RESERVE_VMEMMAP_SIZE		(RESERVE_VMEMMAP_NR << PAGE_SHIFT)
+
+bool hugetlb_free_vmemmap_enabled __read_mostly;
+
+static int __init early_hugetlb_free_vmemmap_param(char *buf)
+{
+	/* The tail struct pages must fill whole vmemmap pages. */
+	if (!is_power_of_2(sizeof(struct page))) {
+		pr_warn("cannot free vmemmap pages because the struct page size is not power of 2\n");
+		return 0;
+	}
+
+	if (!buf)
+		return -EINVAL;
+
+	if (!strcmp(buf, "on"))
+		hugetlb_free_vmemmap_enabled = true;
+	else if (strcmp(buf, "off"))
+		return -EINVAL;
+
+	return 0;
+}
+early_param("hugetlb_free_vmemmap", early_hugetlb_free_vmemmap_param);
+
+/* Like page_huge_active(), the flag lives in the first tail page. */
+static inline bool PageHugeVmemmapFreed(struct page *head)
+{
+	return PagePrivate2(&head[1]);
+}
+
+static inline void SetPageHugeVmemmapFreed(struct page *head)
+{
+	SetPagePrivate2(&head[1]);
+}
+
+static inline void ClearPageHugeVmemmapFreed(struct page *head)
+{
+	ClearPagePrivate2(&head[1]);
+}
+
+static inline unsigned long free_vmemmap_pages_size_per_hpage(struct hstate *h)
+{
+	return (unsigned long)h->nr_free_vmemmap_pages << PAGE_SHIFT;
+}
+
+/*
+ * Give the tail struct pages of @head their own vmemmap again.  Returns 0 on
+ * success, or -ENOMEM if the vmemmap pages can't be allocated, in which case
+ * the struct pages must still not be written to.
+ */
+int alloc_huge_page_vmemmap(struct hstate *h, struct page *head,
+			    gfp_t gfp_mask)
+{
+	unsigned long vmemmap_addr = (unsigned long)head;
+	unsigned long vmemmap_end, vmemmap_reuse;
+	int ret;
+
+	if (!PageHugeVmemmapFreed(head))
+		return 0;
+
+	vmemmap_addr += RESERVE_VMEMMAP_SIZE;
+	vmemmap_end = vmemmap_addr + free_vmemmap_pages_size_per_hpage(h);
+	vmemmap_reuse = vmemmap_addr - PAGE_SIZE;
+
+	ret = vmemmap_remap_alloc(vmemmap_addr, vmemmap_end, vmemmap_reuse,
+				  gfp_mask | __GFP_NOWARN | __GFP_THISNODE);
+	if (!ret)
+		ClearPageHugeVmemmapFreed(head);
+
+	return ret;
+}
+
+/* Called once @head is a compound page, and before it goes to the pool. */
+void free_huge_page_vmemmap(struct hstate *h, struct page *head)
+{
+	unsigned long vmemmap_addr = (unsigned long)head;
+	unsigned long vmemmap_end, vmemmap_reuse;
+
+	if (!h->nr_free_vmemmap_pages)
+		return;
+
+	vmemmap_addr += RESERVE_VMEMMAP_SIZE;
+	vmemmap_end = vmemmap_addr + free_vmemmap_pages_size_per_hpage(h);
+	vmemmap_reuse = vmemmap_addr - PAGE_SIZE;
+
+	vmemmap_remap_free(vmemmap_addr, vmemmap_end, vmemmap_reuse);
+	SetPageHugeVmemmapFreed(head);
+}
+
+void __init hugetlb_vmemmap_init(struct hstate *h)
+{
+	unsigned int nr_pages = pages_per_huge_page(h);
+	unsigned int vmemmap_pages;
+
+	if (!hugetlb_free_vmemmap_enabled)
+		return;
+
+	vmemmap_pages = (nr_pages * sizeof(struct page)) >> PAGE_SHIFT;
+	if (vmemmap_pages > RESERVE_VMEMMAP_NR)
+		h->nr_free_vmemmap_pages = vmemmap_pages - RESERVE_VMEMMAP_NR;
+
+	pr_info("can free %u vmemmap pages for %s\n",
+		h->nr_free_vmemmap_pages, h->name);
+}
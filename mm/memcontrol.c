@@ -2201,6 +2201,7 @@ EXPORT_SYMBOL(unlock_page_memcg);
 struct memcg_stock_pcp {
 	struct mem_cgroup *cached; /* this never be root cgroup */
 	unsigned int nr_pages;
+	unsigned int batch; /* charge batch for cached */
 
 #ifdef CONFIG_MEMCG_KMEM
 	struct obj_cgroup *cached_objcg;
@@ -2247,7 +2248,7 @@ static bool consume_stock(struct mem_cgroup *memcg, unsigned int nr_pages)
 	unsigned long flags;
 	bool ret = false;
 
-	if (nr_pages > MEMCG_CHARGE_BATCH)
+	if (nr_pages > MEMCG_CHARGE_BATCH_MAX)
 		return ret;
 
 	local_irq_save(flags);
@@ -2319,15 +2320,70 @@ static void refill_stock(struct mem_cgroup *memcg, unsigned int nr_pages)
 		drain_stock(stock);
 		css_get(&memcg->css);
 		stock->cached = memcg;
+		stock->batch = MEMCG_CHARGE_BATCH;
 	}
 	stock->nr_pages += nr_pages;
 
-	if (stock->nr_pages > MEMCG_CHARGE_BATCH)
+	if (stock->nr_pages > stock->batch)
 		drain_stock(stock);
 
 	local_irq_restore(flags);
 }
 
+/* Whether the stocks of all the CPUs could hold @nr_pages of @memcg. */
+static bool stock_batch_fits(struct mem_cgroup *memcg, unsigned long nr_pages)
+{
+	unsigned long usage = page_counter_read(&memcg->memory);
+
+	nr_pages *= num_online_cpus();
+
+	return mem_cgroup_margin(memcg) > nr_pages &&
+	       usage + nr_pages < READ_ONCE(memcg->memory.high);
+}
+
+/*
+ * Returns how many pages to charge for @memcg when the local stock can't
+ * serve a charge. The batch doubles each time the stock of @memcg runs dry,
+ * up to MEMCG_CHARGE_BATCH_MAX, as long as the stocks of all the CPUs at
+ * that size stay below the limits of @memcg. This cuts the page_counter
+ * walks of the hierarchy for the tasks that fault in a lot of memory.
+ */
+static unsigned int stock_charge_batch(struct mem_cgroup *memcg)
+{
+	unsigned int batch = MEMCG_CHARGE_BATCH;
+	struct memcg_stock_pcp *stock;
+	unsigned long flags;
+
+	local_irq_save(flags);
+
+	stock = this_cpu_ptr(&memcg_stock);
+	if (stock->cached == memcg) {
+		batch = stock->batch;
+		if (batch < MEMCG_CHARGE_BATCH_MAX &&
+		    stock_batch_fits(memcg, batch * 2))
+			batch = stock->batch = batch * 2;
+	}
+
+	local_irq_restore(flags);
+
+	return batch;
+}
+
+/* Go back to the default batch when charging a larger one failed. */
+static void stock_reset_batch(struct mem_cgroup *memcg)
+{
+	struct memcg_stock_pcp *stock;
+	unsigned long flags;
+
+	local_irq_save(flags);
+
+	stock = this_cpu_ptr(&memcg_stock);
+	if (stock->cached == memcg)
+		stock->batch = MEMCG_CHARGE_BATCH;
+
+	local_irq_restore(flags);
+}
+
 /*
  * Drains all per-CPU charge caches for given root_memcg resp. subtree
  * of the hierarchy under it.
@@ -2676,7 +2732,7 @@ void mem_cgroup_handle_over_high(void)
 static int try_charge(struct mem_cgroup *memcg, gfp_t gfp_mask,
 		      unsigned int nr_pages)
 {
-	unsigned int batch = max(MEMCG_CHARGE_BATCH, nr_pages);
+	unsigned int batch = 0;
 	int nr_retries = MAX_RECLAIM_RETRIES;
 	struct mem_cgroup *mem_over_limit;
 	struct page_counter *counter;
@@ -2692,6 +2748,9 @@ static int try_charge(struct mem_cgroup *memcg, gfp_t gfp_mask,
 	if (consume_stock(memcg, nr_pages))
 		return 0;
 
+	if (!batch)
+		batch = max(stock_charge_batch(memcg), nr_pages);
+
 	if (!do_memsw_account() ||
 	    page_counter_try_charge(&memcg->memsw, batch, &counter)) {
 		if (page_counter_try_charge(&memcg->memory, batch, &counter))
@@ -2705,6 +2764,8 @@ static int try_charge(struct mem_cgroup *memcg, gfp_t gfp_mask,
 	}
 
 	if (batch > nr_pages) {
+		if (batch > MEMCG_CHARGE_BATCH)
+			stock_reset_batch(memcg);
 		batch = nr_pages;
 		goto retry;
 	}
@@ -3287,6 +3348,28 @@ void mem_cgroup_split_huge_fixup(struct page *head)
 }
 #endif /* CONFIG_TRANSPARENT_HUGEPAGE */
 
+/*
+ * The charge of a higher order allocation is recorded in its head page only.
+ * Give each page of a split allocation its share of the charge and its own
+ * reference, so that the pages can be freed one at a time.
+ */
+void split_page_memcg(struct page *head, unsigned int nr)
+{
+	struct mem_cgroup *memcg = head->mem_cgroup;
+	bool kmemcg = PageKmemcg(head);
+	int i;
+
+	if (mem_cgroup_disabled() || !memcg)
+		return;
+
+	for (i = 1; i < nr; i++) {
+		head[i].mem_cgroup = memcg;
+		if (kmemcg)
+			__SetPageKmemcg(head + i);
+	}
+	css_get_many(&memcg->css, nr - 1);
+}
+
 #ifdef CONFIG_MEMCG_SWAP
 /**
  * mem_cgroup_move_swap_account - move swap charge and swap_cgroup's record.
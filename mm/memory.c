@@ -73,6 +73,7 @@
 #include <linux/perf_event.h>
 #include <linux/ptrace.h>
 #include <linux/vmalloc.h>
+#include <linux/padata.h>
 
 #include <trace/events/kmem.h>
 
@@ -3577,6 +3578,180 @@ static vm_fault_t do_anonymous_page(struct vm_fault *vmf)
 	return VM_FAULT_OOM;
 }
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+/*
+ * Look up the vma covering @addr without mmap_lock. A walk that races with
+ * an update of the vma tree may return a stale vma, or none, but not a
+ * freed one as vmas are freed after a grace period. The caller has to
+ * validate the result against mm->mmap_seq.
+ */
+static struct vm_area_struct *find_vma_speculative(struct mm_struct *mm,
+						   unsigned long addr)
+{
+	struct rb_node *rb_node = READ_ONCE(mm->mm_rb.rb_node);
+	struct vm_area_struct *vma = NULL;
+
+	while (rb_node) {
+		struct vm_area_struct *tmp;
+
+		tmp = rb_entry(rb_node, struct vm_area_struct, vm_rb);
+		if (READ_ONCE(tmp->vm_end) > addr) {
+			vma = tmp;
+			if (READ_ONCE(tmp->vm_start) <= addr)
+				break;
+			rb_node = READ_ONCE(rb_node->rb_left);
+		} else {
+			rb_node = READ_ONCE(rb_node->rb_right);
+		}
+	}
+
+	return vma;
+}
+
+/*
+ * Walk the page tables down to the pte level like GUP fast does. The caller
+ * has IRQs disabled, which keeps the page tables from being freed.
+ */
+static bool pmd_lookup_speculative(struct mm_struct *mm, unsigned long addr,
+				   pmd_t **pmdpp, pmd_t *pmdp)
+{
+	pgd_t *pgdp, pgd;
+	p4d_t *p4dp, p4d;
+	pud_t *pudp, pud;
+	pmd_t pmd;
+
+	pgdp = pgd_offset(mm, addr);
+	pgd = READ_ONCE(*pgdp);
+	if (!pgd_present(pgd))
+		return false;
+
+	p4dp = p4d_offset_lockless(pgdp, pgd, addr);
+	p4d = READ_ONCE(*p4dp);
+	if (!p4d_present(p4d))
+		return false;
+
+	pudp = pud_offset_lockless(p4dp, p4d, addr);
+	pud = READ_ONCE(*pudp);
+	if (!pud_present(pud) || pud_leaf(pud))
+		return false;
+
+	*pmdpp = pmd_offset_lockless(pudp, pud, addr);
+	pmd = READ_ONCE(**pmdpp);
+	if (!pmd_present(pmd) || pmd_trans_huge(pmd) || pmd_devmap(pmd))
+		return false;
+
+	*pmdp = pmd;
+	return true;
+}
+
+/**
+ * get_user_page_speculative() - fault in a page without taking mmap_lock
+ * @addr: user address of the current process
+ * @gup_flags: must be FOLL_WRITE
+ * @pagep: the page mapped at @addr, on success
+ *
+ * Handles the write faults on the unpopulated ptes of private anonymous
+ * mappings, like do_anonymous_page() does. The vma is looked up and copied
+ * locklessly, and the pte is only set if mm->mmap_seq shows that no
+ * mmap_lock writer ran in the meantime. Any other fault, including the ones
+ * that would allocate a page table or a THP, is left to the regular GUP.
+ *
+ * Return: true if *@pagep holds a reference to the page, like GUP.
+ */
+bool get_user_page_speculative(unsigned long addr, unsigned int gup_flags,
+			       struct page **pagep)
+{
+	struct mm_struct *mm = current->mm;
+	struct vm_area_struct *vmap, vma;
+	struct page *page;
+	pmd_t *pmdp, pmd;
+	pte_t *pte, entry;
+	spinlock_t *ptl;
+	unsigned int seq;
+	bool ret = false;
+
+	if (gup_flags != FOLL_WRITE)
+		return false;
+
+	seq = raw_read_seqcount(&mm->mmap_seq);
+	if (seq & 1)
+		return false;
+
+	rcu_read_lock();
+	vmap = find_vma_speculative(mm, addr);
+	if (vmap)
+		vma = *vmap;
+	rcu_read_unlock();
+
+	if (!vmap || read_seqcount_retry(&mm->mmap_seq, seq))
+		return false;
+
+	if (addr < vma.vm_start || !vma_is_anonymous(&vma) || !vma.anon_vma ||
+	    (vma.vm_flags & (VM_READ | VM_WRITE)) != (VM_READ | VM_WRITE) ||
+	    userfaultfd_missing(&vma) || vma_policy(&vma))
+		return false;
+
+	page = alloc_zeroed_user_highpage_movable(&vma, addr);
+	if (!page)
+		return false;
+
+	if (mem_cgroup_charge(page, mm, GFP_KERNEL))
+		goto out_put;
+	cgroup_throttle_swaprate(page, GFP_KERNEL);
+
+	/* See do_anonymous_page(). */
+	__SetPageUptodate(page);
+
+	entry = mk_pte(page, vma.vm_page_prot);
+	entry = pte_sw_mkyoung(entry);
+	entry = pte_mkwrite(pte_mkdirty(entry));
+
+	local_irq_disable();
+	if (!pmd_lookup_speculative(mm, addr, &pmdp, &pmd))
+		goto out_irq;
+
+	/*
+	 * Only try the lock, its holder may be waiting for a TLB shootdown
+	 * IPI to this CPU.
+	 */
+	ptl = pte_lockptr(mm, &pmd);
+	if (!spin_trylock(ptl))
+		goto out_irq;
+
+	/*
+	 * With the pte lock held, an mmap_lock writer that has not bumped
+	 * mmap_seq yet will have to wait for it before zapping this page table.
+	 */
+	pte = pte_offset_map(&pmd, addr);
+	if (!pte_none(*pte) || !pmd_same(pmd, READ_ONCE(*pmdp)) ||
+	    read_seqcount_retry(&mm->mmap_seq, seq) ||
+	    check_stable_address_space(mm))
+		goto out_unlock;
+
+	inc_mm_counter_fast(mm, MM_ANONPAGES);
+	page_add_new_anon_rmap(page, &vma, addr, false);
+	lru_cache_add_inactive_or_unevictable(page, &vma);
+	set_pte_at(mm, addr, pte, entry);
+	update_mmu_cache(&vma, addr, pte);
+
+	/* The allocation reference is the mapping's, take one for the caller. */
+	get_page(page);
+	*pagep = page;
+	ret = true;
+
+out_unlock:
+	pte_unmap(pte);
+	spin_unlock(ptl);
+out_irq:
+	local_irq_enable();
+	if (ret)
+		return true;
+out_put:
+	put_page(page);
+	return false;
+}
+#endif /* CONFIG_SPECULATIVE_PAGE_FAULT */
+
 /*
  * The mmap_lock must have been held on entry, and may have been
  * released depending on flags and vma->vm_ops->fault() return value.
@@ -5088,19 +5263,58 @@ static inline void process_huge_page(
 	}
 }
 
+struct clear_gigantic_page_arg {
+	struct page *page;
+	unsigned long addr;
+};
+
+static void clear_gigantic_page_chunk(unsigned long start, unsigned long end,
+				      void *arg)
+{
+	struct clear_gigantic_page_arg *cgp = arg;
+	struct page *p = nth_page(cgp->page, start);
+	unsigned long i;
+
+	for (i = start; i < end; i++, p = mem_map_next(p, cgp->page, i)) {
+		cond_resched();
+		clear_user_highpage(p, cgp->addr + i * PAGE_SIZE);
+	}
+}
+
+/* Each helper thread clears at least this many pages. */
+#define CLEAR_GIGANTIC_PAGE_MIN_CHUNK	(SZ_64M >> PAGE_SHIFT)
+
+/*
+ * Clearing a 1GB page takes the best part of a tenth of a second, so it is
+ * split among helper threads on the page's node, which has the bandwidth.
+ */
 static void clear_gigantic_page(struct page *page,
 				unsigned long addr,
 				unsigned int pages_per_huge_page)
 {
-	int i;
-	struct page *p = page;
+	struct clear_gigantic_page_arg arg = {
+		.page = page,
+		.addr = addr,
+	};
+#ifdef CONFIG_PADATA
+	int nid = page_to_nid(page);
+	struct padata_mt_job job = {
+		.thread_fn   = clear_gigantic_page_chunk,
+		.fn_arg      = &arg,
+		.start       = 0,
+		.size        = pages_per_huge_page,
+		.align       = 1,
+		.min_chunk   = CLEAR_GIGANTIC_PAGE_MIN_CHUNK,
+		.max_threads = max_t(int, cpumask_weight(cpumask_of_node(nid)), 1),
+		.nid         = nid,
+	};
 
 	might_sleep();
-	for (i = 0; i < pages_per_huge_page;
-	     i++, p = mem_map_next(p, page, i)) {
-		cond_resched();
-		clear_user_highpage(p, addr + i * PAGE_SIZE);
-	}
+	padata_do_multithreaded(&job);
+#else
+	might_sleep();
+	clear_gigantic_page_chunk(0, pages_per_huge_page, &arg);
+#endif
 }
 
 static void clear_subpage(unsigned long addr, int idx, void *arg)
@@ -242,6 +242,8 @@ static inline unsigned long change_pmd_range(struct vm_area_struct *vma,
 		/* invoke the mmu notifier if the pmd is populated */
 		if (!range.start) {
 			mmu_notifier_range_init(&range,
+				cp_flags & MM_CP_PROT_NUMA ?
+				MMU_NOTIFY_PROTECTION_NUMA :
 				MMU_NOTIFY_PROTECTION_VMA, 0,
 				vma, vma->vm_mm, addr, end);
 			mmu_notifier_invalidate_range_start(&range);
@@ -3500,8 +3500,8 @@ cache_alloc_debugcheck_after_bulk(struct kmem_cache *s, gfp_t flags,
 		p[i] = cache_alloc_debugcheck_after(s, flags, p[i], caller);
 }
 
-int kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t flags, size_t size,
-			  void **p)
+int kmem_cache_alloc_bulk_node(struct kmem_cache *s, gfp_t flags, int node,
+			       size_t size, void **p)
 {
 	size_t i;
 	struct obj_cgroup *objcg = NULL;
@@ -3512,9 +3512,18 @@ int kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t flags, size_t size,
 
 	cache_alloc_debugcheck_before(s, flags);
 
+	/*
+	 * Only a remote node needs to bypass the per cpu array cache. Check
+	 * for NUMA_NO_NODE before get_node(), which would index s->node[-1].
+	 */
+	if (!IS_ENABLED(CONFIG_NUMA) || node == NUMA_NO_NODE ||
+	    node == numa_mem_id() || !get_node(s, node))
+		node = NUMA_NO_NODE;
+
 	local_irq_disable();
 	for (i = 0; i < size; i++) {
-		void *objp = __do_cache_alloc(s, flags);
+		void *objp = node == NUMA_NO_NODE ? __do_cache_alloc(s, flags) :
+			     ____cache_alloc_node(s, flags, node);
 
 		if (unlikely(!objp))
 			goto error;
@@ -3539,7 +3548,7 @@ int kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t flags, size_t size,
 	__kmem_cache_free_bulk(s, i, p);
 	return 0;
 }
-EXPORT_SYMBOL(kmem_cache_alloc_bulk);
+EXPORT_SYMBOL(kmem_cache_alloc_bulk_node);
 
 #ifdef CONFIG_TRACING
 void *
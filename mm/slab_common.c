@@ -115,13 +115,13 @@ void __kmem_cache_free_bulk(struct kmem_cache *s, size_t nr, void **p)
 	}
 }
 
-int __kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t flags, size_t nr,
-								void **p)
+int __kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t flags, int node,
+			    size_t nr, void **p)
 {
 	size_t i;
 
 	for (i = 0; i < nr; i++) {
-		void *x = p[i] = kmem_cache_alloc(s, flags);
+		void *x = p[i] = kmem_cache_alloc_node(s, flags, node);
 		if (!x) {
 			__kmem_cache_free_bulk(s, i, p);
 			return 0;
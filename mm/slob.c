@@ -679,12 +679,12 @@ void kmem_cache_free_bulk(struct kmem_cache *s, size_t size, void **p)
 }
 EXPORT_SYMBOL(kmem_cache_free_bulk);
 
-int kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t flags, size_t size,
-								void **p)
+int kmem_cache_alloc_bulk_node(struct kmem_cache *s, gfp_t flags, int node,
+			       size_t size, void **p)
 {
-	return __kmem_cache_alloc_bulk(s, flags, size, p);
+	return __kmem_cache_alloc_bulk(s, flags, node, size, p);
 }
-EXPORT_SYMBOL(kmem_cache_alloc_bulk);
+EXPORT_SYMBOL(kmem_cache_alloc_bulk_node);
 
 int __kmem_cache_shutdown(struct kmem_cache *c)
 {
@@ -3270,9 +3270,15 @@ void kmem_cache_free_bulk(struct kmem_cache *s, size_t size, void **p)
 }
 EXPORT_SYMBOL(kmem_cache_free_bulk);
 
-/* Note that interrupts must be enabled when calling this function. */
-int kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t flags, size_t size,
-			  void **p)
+/*
+ * Note that interrupts must be enabled when calling this function.
+ *
+ * Objects are taken from the cpu freelist, and ___slab_alloc() moves the
+ * whole freelist of the next slab there when it runs out. A refill thus
+ * costs one slow path call per slab rather than one per object.
+ */
+int kmem_cache_alloc_bulk_node(struct kmem_cache *s, gfp_t flags, int node,
+			       size_t size, void **p)
 {
 	struct kmem_cache_cpu *c;
 	int i;
@@ -3293,7 +3299,7 @@ int kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t flags, size_t size,
 	for (i = 0; i < size; i++) {
 		void *object = c->freelist;
 
-		if (unlikely(!object)) {
+		if (unlikely(!object || !node_match(c->page, node))) {
 			/*
 			 * We may have removed an object from c->freelist using
 			 * the fastpath in the previous iteration; in that case,
@@ -3307,8 +3313,7 @@ int kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t flags, size_t size,
 			 * Invoking slow path likely have side-effect
 			 * of re-populating per CPU c->freelist
 			 */
-			p[i] = ___slab_alloc(s, flags, NUMA_NO_NODE,
-					    _RET_IP_, c);
+			p[i] = ___slab_alloc(s, flags, node, _RET_IP_, c);
 			if (unlikely(!p[i]))
 				goto error;
 
@@ -3341,7 +3346,7 @@ int kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t flags, size_t size,
 	__kmem_cache_free_bulk(s, i, p);
 	return 0;
 }
-EXPORT_SYMBOL(kmem_cache_alloc_bulk);
+EXPORT_SYMBOL(kmem_cache_alloc_bulk_node);
 
 
 /*
@@ -22,6 +22,7 @@
 #include <linux/mmzone.h>
 #include <linux/memblock.h>
 #include <linux/memremap.h>
+#include <linux/memory_hotplug.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
@@ -263,3 +264,206 @@ struct page * __meminit __populate_section_memmap(unsigned long pfn,
 
 	return pfn_to_page(pfn);
 }
+
+#ifdef CONFIG_HUGETLB_PAGE_FREE_VMEMMAP
+/*
+ * The vmemmap of a range of struct pages can be remapped to a single page,
+ * for the tail pages of a compound page that are all alike.  The page table
+ * walk finds the page at @reuse_addr first, the range to be remapped follows
+ * it directly, and the vmemmap has to be mapped with base pages.
+ */
+struct vmemmap_remap_walk {
+	void (*remap_pte)(pte_t *pte, unsigned long addr,
+			  struct vmemmap_remap_walk *walk);
+	struct page *reuse_page;
+	unsigned long reuse_addr;
+	struct list_head *vmemmap_pages;
+};
+
+static void vmemmap_pte_range(pmd_t *pmd, unsigned long addr,
+			      unsigned long end,
+			      struct vmemmap_remap_walk *walk)
+{
+	pte_t *pte = pte_offset_kernel(pmd, addr);
+
+	if (!walk->reuse_page) {
+		walk->reuse_page = pte_page(*pte);
+		/* The page at the reuse address itself stays as it is. */
+		addr += PAGE_SIZE;
+		pte++;
+	}
+
+	for (; addr != end; addr += PAGE_SIZE, pte++)
+		walk->remap_pte(pte, addr, walk);
+}
+
+static void vmemmap_pmd_range(pud_t *pud, unsigned long addr,
+			      unsigned long end,
+			      struct vmemmap_remap_walk *walk)
+{
+	pmd_t *pmd = pmd_offset(pud, addr);
+	unsigned long next;
+
+	do {
+		BUG_ON(pmd_leaf(*pmd));
+
+		next = pmd_addr_end(addr, end);
+		vmemmap_pte_range(pmd, addr, next, walk);
+	} while (pmd++, addr = next, addr != end);
+}
+
+static void vmemmap_pud_range(p4d_t *p4d, unsigned long addr,
+			      unsigned long end,
+			      struct vmemmap_remap_walk *walk)
+{
+	pud_t *pud = pud_offset(p4d, addr);
+	unsigned long next;
+
+	do {
+		next = pud_addr_end(addr, end);
+		vmemmap_pmd_range(pud, addr, next, walk);
+	} while (pud++, addr = next, addr != end);
+}
+
+static void vmemmap_p4d_range(pgd_t *pgd, unsigned long addr,
+			      unsigned long end,
+			      struct vmemmap_remap_walk *walk)
+{
+	p4d_t *p4d = p4d_offset(pgd, addr);
+	unsigned long next;
+
+	do {
+		next = p4d_addr_end(addr, end);
+		vmemmap_pud_range(p4d, addr, next, walk);
+	} while (p4d++, addr = next, addr != end);
+}
+
+static void vmemmap_remap_range(unsigned long start, unsigned long end,
+				struct vmemmap_remap_walk *walk)
+{
+	unsigned long addr = start;
+	unsigned long next;
+	pgd_t *pgd;
+
+	VM_BUG_ON(!IS_ALIGNED(start, PAGE_SIZE));
+	VM_BUG_ON(!IS_ALIGNED(end, PAGE_SIZE));
+
+	pgd = pgd_offset_k(addr);
+	do {
+		next = pgd_addr_end(addr, end);
+		vmemmap_p4d_range(pgd, addr, next, walk);
+	} while (pgd++, addr = next, addr != end);
+
+	/* Only the mappings after the reuse page changed. */
+	flush_tlb_kernel_range(start + PAGE_SIZE, end);
+}
+
+/*
+ * The vmemmap pages populated at boot come from memblock and are reserved,
+ * they go back to the buddy allocator through their bootmem info.
+ */
+static void free_vmemmap_page_list(struct list_head *list)
+{
+	struct page *page, *next;
+
+	list_for_each_entry_safe(page, next, list, lru) {
+		list_del(&page->lru);
+		if (PageReserved(page))
+			put_page_bootmem(page);
+		else
+			__free_page(page);
+	}
+}
+
+static void vmemmap_remap_pte(pte_t *pte, unsigned long addr,
+			      struct vmemmap_remap_walk *walk)
+{
+	struct page *page = pte_page(*pte);
+
+	/* Read-only, so that stray writes to the shared tail pages fault. */
+	list_add(&page->lru, walk->vmemmap_pages);
+	set_pte_at(&init_mm, addr, pte,
+		   mk_pte(walk->reuse_page, PAGE_KERNEL_RO));
+}
+
+/**
+ * vmemmap_remap_free - remap a vmemmap range to the page before it
+ * @start:	start of the vmemmap range to remap
+ * @end:	end of the vmemmap range to remap
+ * @reuse:	address of the page that the range is remapped to, which must
+ *		be @start - PAGE_SIZE
+ *
+ * The pages that backed [@start, @end) are freed.  The caller guarantees that
+ * the struct pages in the range are the same as those at @reuse, and that
+ * nothing writes to them until vmemmap_remap_alloc() is called.
+ */
+void vmemmap_remap_free(unsigned long start, unsigned long end,
+			unsigned long reuse)
+{
+	LIST_HEAD(vmemmap_pages);
+	struct vmemmap_remap_walk walk = {
+		.remap_pte	= vmemmap_remap_pte,
+		.reuse_addr	= reuse,
+		.vmemmap_pages	= &vmemmap_pages,
+	};
+
+	BUG_ON(start - reuse != PAGE_SIZE);
+
+	vmemmap_remap_range(reuse, end, &walk);
+	free_vmemmap_page_list(&vmemmap_pages);
+}
+
+static void vmemmap_restore_pte(pte_t *pte, unsigned long addr,
+				struct vmemmap_remap_walk *walk)
+{
+	struct page *page;
+
+	BUG_ON(pte_page(*pte) != walk->reuse_page);
+
+	page = list_first_entry(walk->vmemmap_pages, struct page, lru);
+	list_del(&page->lru);
+	copy_page(page_to_virt(page), (void *)walk->reuse_addr);
+
+	set_pte_at(&init_mm, addr, pte, mk_pte(page, PAGE_KERNEL));
+}
+
+/**
+ * vmemmap_remap_alloc - undo vmemmap_remap_free()
+ * @start:	start of the vmemmap range to restore
+ * @end:	end of the vmemmap range to restore
+ * @reuse:	address of the page that the range is mapped to
+ * @gfp_mask:	flags for the allocation of the new vmemmap pages
+ *
+ * Returns 0 on success, or -ENOMEM, in which case the range is untouched.
+ */
+int vmemmap_remap_alloc(unsigned long start, unsigned long end,
+			unsigned long reuse, gfp_t gfp_mask)
+{
+	unsigned long nr_pages = (end - start) >> PAGE_SHIFT;
+	int nid = page_to_nid((struct page *)start);
+	LIST_HEAD(vmemmap_pages);
+	struct vmemmap_remap_walk walk = {
+		.remap_pte	= vmemmap_restore_pte,
+		.reuse_addr	= reuse,
+		.vmemmap_pages	= &vmemmap_pages,
+	};
+	struct page *page, *next;
+
+	BUG_ON(start - reuse != PAGE_SIZE);
+
+	while (nr_pages--) {
+		page = alloc_pages_node(nid, gfp_mask, 0);
+		if (!page)
+			goto out_free;
+		list_add_tail(&page->lru, &vmemmap_pages);
+	}
+
+	vmemmap_remap_range(reuse, end, &walk);
+	return 0;
+
+out_free:
+	list_for_each_entry_safe(page, next, &vmemmap_pages, lru)
+		__free_page(page);
+	return -ENOMEM;
+}
+#endif /* CONFIG_HUGETLB_PAGE_FREE_VMEMMAP */
@@ -960,12 +960,23 @@ int get_cmdline(struct task_struct *task, char *buffer, int buflen)
 
 int __weak memcmp_pages(struct page *page1, struct page *page2)
 {
-	char *addr1, *addr2;
-	int ret;
+	unsigned long *addr1, *addr2;
+	unsigned int i;
+	int ret = 0;
 
 	addr1 = kmap_atomic(page1);
 	addr2 = kmap_atomic(page2);
-	ret = memcmp(addr1, addr2, PAGE_SIZE);
+	/*
+	 * The generic memcmp() goes one byte at a time.  Look for the first
+	 * differing word instead, and only compare that one byte by byte, to
+	 * return the same result as memcmp() over the whole page.
+	 */
+	for (i = 0; i < PAGE_SIZE / sizeof(*addr1); i++) {
+		if (addr1[i] != addr2[i]) {
+			ret = memcmp(&addr1[i], &addr2[i], sizeof(*addr1));
+			break;
+		}
+	}
 	kunmap_atomic(addr2);
 	kunmap_atomic(addr1);
 	return ret;
@@ -785,6 +785,10 @@ static int refresh_cpu_vm_stats(bool do_pagesets)
 #endif
 			}
 		}
+
+		/* This is a good place to decay pcp->high as well */
+		if (do_pagesets && decay_pcp_high(zone, this_cpu_ptr(&p->pcp)))
+			changes++;
 #ifdef CONFIG_NUMA
 		for (i = 0; i < NR_VM_NUMA_STAT_ITEMS; i++) {
 			int v;
@@ -0,0 +1,413 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Pool of pre-zeroed pages for anonymous faults
+ *
+ * The first touch of anonymous memory allocates a page and clears it, and
+ * for a freshly started process or VM the clearing dominates the fault.
+ * kzerod clears pages in the background, at idle priority, and keeps them
+ * in a per-node pool that anonymous faults take from.  The pool is refilled
+ * without reclaim, and drained by a shrinker under memory pressure.
+ */
+
+#define pr_fmt(fmt) "zeroed_pool: " fmt
+
+#include <linux/cpuset.h>
+#include <linux/freezer.h>
+#include <linux/highmem.h>
+#include <linux/kthread.h>
+#include <linux/memory.h>
+#include <linux/mempolicy.h>
+#include <linux/mm.h>
+#include <linux/nodemask.h>
+#include <linux/page-isolation.h>
+#include <linux/sched.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/zeroed_pool.h>
+#include <uapi/linux/sched/types.h>
+
+struct zeroed_pool {
+	spinlock_t lock;
+	struct list_head pages;
+	unsigned long nr_pages;
+};
+
+static struct zeroed_pool *zeroed_pools[MAX_NUMNODES];
+
+/* The number of zeroed pages to keep on each node, 0 disables the pool. */
+static unsigned long zeroed_pool_pages_per_node __read_mostly;
+
+static struct task_struct *kzerod_thread;
+static DECLARE_WAIT_QUEUE_HEAD(kzerod_wait);
+
+/*
+ * The pool pages can't be migrated, so they don't come from ZONE_MOVABLE or
+ * CMA, where they would stand in the way of memory offlining and of
+ * alloc_contig_range().
+ */
+#define ZEROED_POOL_GFP \
+	((GFP_HIGHUSER & ~__GFP_RECLAIM) | __GFP_THISNODE | __GFP_NOWARN)
+
+/* The pool of a node never holds more than half of the node's memory. */
+static unsigned long zeroed_pool_target(int nid)
+{
+	struct zone *zones = NODE_DATA(nid)->node_zones;
+	unsigned long managed = 0;
+	int i;
+
+	for (i = 0; i < MAX_NR_ZONES; i++)
+		managed += zone_managed_pages(&zones[i]);
+
+	return min(READ_ONCE(zeroed_pool_pages_per_node), managed / 2);
+}
+
+static bool zeroed_pool_needs_refill(int nid)
+{
+	return READ_ONCE(zeroed_pools[nid]->nr_pages) < zeroed_pool_target(nid);
+}
+
+/*
+ * Refill below half of the target, so that kzerod wakes up once per batch
+ * rather than on every fault.
+ */
+static bool zeroed_pool_below_low(int nid)
+{
+	return READ_ONCE(zeroed_pools[nid]->nr_pages) <
+	       zeroed_pool_target(nid) / 2;
+}
+
+/**
+ * zeroed_pool_alloc - take a zeroed page for an anonymous fault
+ * @vma: the VMA the page is to be mapped in
+ * @vaddr: the virtual address the page is to be mapped at
+ *
+ * Returns a zeroed page from the pool of the local node, or NULL if the pool
+ * is empty or can't honor the memory policy of @vma, in which case the
+ * caller allocates and clears the page itself.
+ */
+struct page *zeroed_pool_alloc(struct vm_area_struct *vma, unsigned long vaddr)
+{
+	struct zeroed_pool *pool;
+	struct page *page = NULL;
+	int nid = numa_node_id();
+
+	if (!READ_ONCE(zeroed_pool_pages_per_node))
+		return NULL;
+
+#ifdef CONFIG_NUMA
+	/* The local node is only right for the default policy. */
+	if (vma_policy(vma) || current->mempolicy)
+		return NULL;
+#endif
+	if (!cpuset_node_allowed(nid, GFP_HIGHUSER_MOVABLE))
+		return NULL;
+
+	pool = zeroed_pools[nid];
+	if (!pool)
+		return NULL;
+	if (!READ_ONCE(pool->nr_pages))
+		goto out;
+
+	spin_lock(&pool->lock);
+	page = list_first_entry_or_null(&pool->pages, struct page, lru);
+	if (page) {
+		list_del(&page->lru);
+		pool->nr_pages--;
+	}
+	spin_unlock(&pool->lock);
+
+	/*
+	 * kzerod cleared the page through its kernel mapping, not through one
+	 * of the same colour as @vaddr like clear_user_highpage() does, so
+	 * write it back for virtually indexed caches.
+	 */
+	if (page)
+		flush_dcache_page(page);
+
+out:
+	if (zeroed_pool_below_low(nid))
+		wake_up_interruptible(&kzerod_wait);
+
+	return page;
+}
+
+static void zeroed_pool_refill(int nid)
+{
+	struct zeroed_pool *pool = zeroed_pools[nid];
+	struct zone *zone;
+	struct page *page;
+	bool isolated;
+
+	while (zeroed_pool_needs_refill(nid) && !kthread_should_stop()) {
+		page = alloc_pages_node(nid, ZEROED_POOL_GFP, 0);
+		if (!page)
+			break;
+
+		/*
+		 * Only take pages the zone can spare, rather than taking them
+		 * down to the min watermark and having kswapd reclaim them.
+		 */
+		zone = page_zone(page);
+		if (!zone_watermark_ok(zone, 0, high_wmark_pages(zone),
+				       zone_idx(zone), 0)) {
+			__free_page(page);
+			break;
+		}
+
+		clear_highpage(page);
+
+		/*
+		 * The page may come from a pageblock that was isolated for
+		 * offlining since, check under the lock that the memory
+		 * notifier drains the pool with.
+		 */
+		spin_lock(&pool->lock);
+		isolated = is_migrate_isolate_page(page);
+		if (!isolated) {
+			list_add(&page->lru, &pool->pages);
+			pool->nr_pages++;
+		}
+		spin_unlock(&pool->lock);
+
+		if (isolated) {
+			__free_page(page);
+			break;
+		}
+
+		cond_resched();
+	}
+}
+
+static void zeroed_pool_free_pages(struct list_head *pages)
+{
+	struct page *page;
+
+	while ((page = list_first_entry_or_null(pages, struct page, lru))) {
+		list_del(&page->lru);
+		__free_page(page);
+	}
+}
+
+static unsigned long zeroed_pool_drain(int nid, unsigned long nr_to_free)
+{
+	struct zeroed_pool *pool = zeroed_pools[nid];
+	unsigned long freed = 0;
+	LIST_HEAD(pages);
+
+	spin_lock(&pool->lock);
+	while (freed < nr_to_free && !list_empty(&pool->pages)) {
+		list_move(pool->pages.next, &pages);
+		pool->nr_pages--;
+		freed++;
+	}
+	spin_unlock(&pool->lock);
+
+	zeroed_pool_free_pages(&pages);
+
+	return freed;
+}
+
+static bool kzerod_has_work(void)
+{
+	int nid;
+
+	if (kthread_should_stop())
+		return true;
+
+	for_each_node_state(nid, N_MEMORY)
+		if (zeroed_pool_below_low(nid))
+			return true;
+
+	return false;
+}
+
+static int kzerod(void *unused)
+{
+	struct sched_param param = { .sched_priority = 0 };
+	int nid;
+
+	/* Clearing pages is only worth it with otherwise idle CPU time. */
+	sched_setscheduler_nocheck(current, SCHED_IDLE, &param);
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		for_each_node_state(nid, N_MEMORY)
+			zeroed_pool_refill(nid);
+
+		wait_event_freezable(kzerod_wait, kzerod_has_work());
+	}
+
+	return 0;
+}
+
+static unsigned long zeroed_pool_shrink_count(struct shrinker *shrink,
+					      struct shrink_control *sc)
+{
+	return READ_ONCE(zeroed_pools[sc->nid]->nr_pages) ? : SHRINK_EMPTY;
+}
+
+static unsigned long zeroed_pool_shrink_scan(struct shrinker *shrink,
+					     struct shrink_control *sc)
+{
+	return zeroed_pool_drain(sc->nid, sc->nr_to_scan) ? : SHRINK_STOP;
+}
+
+static struct shrinker zeroed_pool_shrinker = {
+	.count_objects = zeroed_pool_shrink_count,
+	.scan_objects = zeroed_pool_shrink_scan,
+	.seeks = DEFAULT_SEEKS,
+	.flags = SHRINKER_NUMA_AWARE,
+};
+
+#ifdef CONFIG_MEMORY_HOTREMOVE
+/* Free the pool pages of @nid in [@start_pfn, @end_pfn). */
+static void zeroed_pool_drain_range(int nid, unsigned long start_pfn,
+				    unsigned long end_pfn)
+{
+	struct zeroed_pool *pool = zeroed_pools[nid];
+	struct page *page, *next;
+	unsigned long pfn;
+	LIST_HEAD(pages);
+
+	spin_lock(&pool->lock);
+	list_for_each_entry_safe(page, next, &pool->pages, lru) {
+		pfn = page_to_pfn(page);
+		if (pfn >= start_pfn && pfn < end_pfn) {
+			list_move(&page->lru, &pages);
+			pool->nr_pages--;
+		}
+	}
+	spin_unlock(&pool->lock);
+
+	zeroed_pool_free_pages(&pages);
+}
+
+/*
+ * The pool pages can't be migrated, give those of the memory block back before
+ * it is offlined.  Its pageblocks are isolated at this point, so the pool is
+ * not refilled from them.
+ */
+static int zeroed_pool_memory_callback(struct notifier_block *self,
+				       unsigned long action, void *arg)
+{
+	struct memory_notify *mn = arg;
+	int nid;
+
+	if (action != MEM_GOING_OFFLINE)
+		return NOTIFY_OK;
+
+	for_each_node_state(nid, N_MEMORY)
+		zeroed_pool_drain_range(nid, mn->start_pfn,
+					mn->start_pfn + mn->nr_pages);
+
+	return NOTIFY_OK;
+}
+#endif
+
+#ifdef CONFIG_SYSFS
+static ssize_t pages_per_node_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", zeroed_pool_pages_per_node);
+}
+
+static ssize_t pages_per_node_store(struct kobject *kobj,
+				    struct kobj_attribute *attr,
+				    const char *buf, size_t count)
+{
+	unsigned long nr_pages;
+	int nid, err;
+
+	err = kstrtoul(buf, 10, &nr_pages);
+	if (err || nr_pages > totalram_pages() / 2)
+		return -EINVAL;
+
+	WRITE_ONCE(zeroed_pool_pages_per_node, nr_pages);
+
+	for_each_node_state(nid, N_MEMORY) {
+		unsigned long target = zeroed_pool_target(nid);
+
+		if (zeroed_pools[nid]->nr_pages > target)
+			zeroed_pool_drain(nid, zeroed_pools[nid]->nr_pages -
+					  target);
+	}
+
+	wake_up_interruptible(&kzerod_wait);
+
+	return count;
+}
+static struct kobj_attribute pages_per_node_attr =
+	__ATTR(pages_per_node, 0644, pages_per_node_show, pages_per_node_store);
+
+static ssize_t nr_pages_show(struct kobject *kobj,
+			     struct kobj_attribute *attr, char *buf)
+{
+	unsigned long nr_pages = 0;
+	int nid;
+
+	for_each_node_state(nid, N_MEMORY)
+		nr_pages += READ_ONCE(zeroed_pools[nid]->nr_pages);
+
+	return sprintf(buf, "%lu\n", nr_pages);
+}
+static struct kobj_attribute nr_pages_attr = __ATTR_RO(nr_pages);
+
+static struct attribute *zeroed_pool_attrs[] = {
+	&pages_per_node_attr.attr,
+	&nr_pages_attr.attr,
+	NULL,
+};
+
+static const struct attribute_group zeroed_pool_attr_group = {
+	.attrs = zeroed_pool_attrs,
+	.name = "zeroed_pool",
+};
+#endif /* CONFIG_SYSFS */
+
+static int __init zeroed_pool_pages_setup(char *str)
+{
+	return kstrtoul(str, 0, &zeroed_pool_pages_per_node) == 0;
+}
+__setup("zeroed_pool_pages=", zeroed_pool_pages_setup);
+
+static int __init zeroed_pool_init(void)
+{
+	struct zeroed_pool *pool;
+	int nid, err;
+
+	for_each_node(nid) {
+		pool = kzalloc_node(sizeof(*pool), GFP_KERNEL, nid);
+		if (!pool)
+			return -ENOMEM;
+
+		spin_lock_init(&pool->lock);
+		INIT_LIST_HEAD(&pool->pages);
+		zeroed_pools[nid] = pool;
+	}
+
+	err = register_shrinker(&zeroed_pool_shrinker);
+	if (err)
+		return err;
+
+	kzerod_thread = kthread_run(kzerod, NULL, "kzerod");
+	if (IS_ERR(kzerod_thread)) {
+		pr_err("creating kthread failed\n");
+		unregister_shrinker(&zeroed_pool_shrinker);
+		return PTR_ERR(kzerod_thread);
+	}
+
+#ifdef CONFIG_MEMORY_HOTREMOVE
+	hotplug_memory_notifier(zeroed_pool_memory_callback, 100);
+#endif
+
+#ifdef CONFIG_SYSFS
+	err = sysfs_create_group(mm_kobj, &zeroed_pool_attr_group);
+	if (err)
+		pr_err("register sysfs failed\n");
+#endif
+
+	return 0;
+}
+subsys_initcall(zeroed_pool_init);
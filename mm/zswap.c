@@ -127,15 +127,22 @@ module_param_named(same_filled_pages_enabled, zswap_same_filled_pages_enabled,
 * data structures
 **********************************/
 
+/*
+ * A pool has one zpool for each possible NUMA node.  Pages are compressed
+ * into the zpool of the node that the compressing CPU is on, so that the
+ * compressed data is local to the CPUs that reclaim the node, and they do
+ * not contend with the other nodes on the zpool locks.
+ */
 struct zswap_pool {
-	struct zpool *zpool;
 	struct crypto_comp * __percpu *tfm;
 	struct kref kref;
 	struct list_head list;
 	struct work_struct release_work;
 	struct work_struct shrink_work;
+	int shrink_nid;
 	struct hlist_node node;
 	char tfm_name[CRYPTO_MAX_ALG_NAME];
+	struct zpool *zpools[];
 };
 
 /*
@@ -155,6 +162,7 @@ struct zswap_pool {
  * length - the length in bytes of the compressed page data.  Needed during
  *          decompression. For a same value filled page length is 0.
  * pool - the zswap_pool the entry's data is in
+ * zpool - the zpool of that zswap_pool the entry's data is in
  * handle - zpool allocation handle that stores the compressed page data
  * value - value of the same-value filled pages which have same content
  */
@@ -164,6 +172,7 @@ struct zswap_entry {
 	int refcount;
 	unsigned int length;
 	struct zswap_pool *pool;
+	struct zpool *zpool;
 	union {
 		unsigned long handle;
 		unsigned long value;
@@ -206,9 +215,13 @@ static bool zswap_has_pool;
 * helpers and fwd declarations
 **********************************/
 
+/* All the zpools of a pool have the same type */
+#define zswap_pool_type(p)					\
+	zpool_get_type((p)->zpools[first_node(node_possible_map)])
+
 #define zswap_pool_debug(msg, p)				\
 	pr_debug("%s pool %s/%s\n", msg, (p)->tfm_name,		\
-		 zpool_get_type((p)->zpool))
+		 zswap_pool_type(p))
 
 static int zswap_writeback_entry(struct zpool *pool, unsigned long handle);
 static int zswap_pool_get(struct zswap_pool *pool);
@@ -235,11 +248,13 @@ static void zswap_update_total_size(void)
 {
 	struct zswap_pool *pool;
 	u64 total = 0;
+	int nid;
 
 	rcu_read_lock();
 
 	list_for_each_entry_rcu(pool, &zswap_pools, list)
-		total += zpool_get_total_size(pool->zpool);
+		for_each_node(nid)
+			total += zpool_get_total_size(pool->zpools[nid]);
 
 	rcu_read_unlock();
 
@@ -342,7 +357,7 @@ static void zswap_free_entry(struct zswap_entry *entry)
 	if (!entry->length)
 		atomic_dec(&zswap_same_filled_pages);
 	else {
-		zpool_free(entry->pool->zpool, entry->handle);
+		zpool_free(entry->zpool, entry->handle);
 		zswap_pool_put(entry->pool);
 	}
 	zswap_entry_cache_free(entry);
@@ -507,7 +522,7 @@ static struct zswap_pool *zswap_pool_find_get(char *type, char *compressor)
 	list_for_each_entry_rcu(pool, &zswap_pools, list) {
 		if (strcmp(pool->tfm_name, compressor))
 			continue;
-		if (strcmp(zpool_get_type(pool->zpool), type))
+		if (strcmp(zswap_pool_type(pool), type))
 			continue;
 		/* if we can't get it, it's about to be destroyed */
 		if (!zswap_pool_get(pool))
@@ -522,8 +537,19 @@ static void shrink_worker(struct work_struct *w)
 {
 	struct zswap_pool *pool = container_of(w, typeof(*pool),
 						shrink_work);
+	int i, ret = -EINVAL;
 
-	if (zpool_shrink(pool->zpool, 1, NULL))
+	/*
+	 * Go through the nodes in turn, the limit is for the whole pool.  The
+	 * zpool of a node can be empty, move on to the next one until a page
+	 * was written back.
+	 */
+	for (i = 0; i < num_possible_nodes() && ret; i++) {
+		pool->shrink_nid = next_node_in(pool->shrink_nid,
+						node_possible_map);
+		ret = zpool_shrink(pool->zpools[pool->shrink_nid], 1, NULL);
+	}
+	if (ret)
 		zswap_reject_reclaim_fail++;
 	zswap_pool_put(pool);
 }
@@ -533,7 +559,7 @@ static struct zswap_pool *zswap_pool_create(char *type, char *compressor)
 	struct zswap_pool *pool;
 	char name[38]; /* 'zswap' + 32 char (max) num + \0 */
 	gfp_t gfp = __GFP_NORETRY | __GFP_NOWARN | __GFP_KSWAPD_RECLAIM;
-	int ret;
+	int ret, id, nid;
 
 	if (!zswap_has_pool) {
 		/* if either are unset, pool initialization failed, and we
@@ -546,19 +572,24 @@ static struct zswap_pool *zswap_pool_create(char *type, char *compressor)
 			return NULL;
 	}
 
-	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	pool = kzalloc(struct_size(pool, zpools, nr_node_ids), GFP_KERNEL);
 	if (!pool)
 		return NULL;
 
-	/* unique name for each pool specifically required by zsmalloc */
-	snprintf(name, 38, "zswap%x", atomic_inc_return(&zswap_pools_count));
+	id = atomic_inc_return(&zswap_pools_count);
+	for_each_node(nid) {
+		/* unique name for each pool specifically required by zsmalloc */
+		snprintf(name, 38, "zswap%x.%d", id, nid);
 
-	pool->zpool = zpool_create_pool(type, name, gfp, &zswap_zpool_ops);
-	if (!pool->zpool) {
-		pr_err("%s zpool not available\n", type);
-		goto error;
+		pool->zpools[nid] = zpool_create_pool(type, name, gfp,
+						      &zswap_zpool_ops);
+		if (!pool->zpools[nid]) {
+			pr_err("%s zpool not available\n", type);
+			goto error;
+		}
 	}
-	pr_debug("using %s zpool\n", zpool_get_type(pool->zpool));
+	pool->shrink_nid = first_node(node_possible_map);
+	pr_debug("using %s zpool\n", zswap_pool_type(pool));
 
 	strlcpy(pool->tfm_name, compressor, sizeof(pool->tfm_name));
 	pool->tfm = alloc_percpu(struct crypto_comp *);
@@ -586,8 +617,9 @@ static struct zswap_pool *zswap_pool_create(char *type, char *compressor)
 
 error:
 	free_percpu(pool->tfm);
-	if (pool->zpool)
-		zpool_destroy_pool(pool->zpool);
+	for_each_node(nid)
+		if (pool->zpools[nid])
+			zpool_destroy_pool(pool->zpools[nid]);
 	kfree(pool);
 	return NULL;
 }
@@ -636,11 +668,14 @@ static __init struct zswap_pool *__zswap_pool_create_fallback(void)
 
 static void zswap_pool_destroy(struct zswap_pool *pool)
 {
+	int nid;
+
 	zswap_pool_debug("destroying", pool);
 
 	cpuhp_state_remove_instance(CPUHP_MM_ZSWP_POOL_PREPARE, &pool->node);
 	free_percpu(pool->tfm);
-	zpool_destroy_pool(pool->zpool);
+	for_each_node(nid)
+		zpool_destroy_pool(pool->zpools[nid]);
 	kfree(pool);
 }
 
@@ -1075,6 +1110,7 @@ static int zswap_frontswap_store(unsigned type, pgoff_t offset,
 
 	/* compress */
 	dst = get_cpu_var(zswap_dstmem);
+	entry->zpool = entry->pool->zpools[numa_node_id()];
 	tfm = *get_cpu_ptr(entry->pool->tfm);
 	src = kmap_atomic(page);
 	ret = crypto_comp_compress(tfm, src, PAGE_SIZE, dst, &dlen);
@@ -1086,11 +1122,11 @@ static int zswap_frontswap_store(unsigned type, pgoff_t offset,
 	}
 
 	/* store */
-	hlen = zpool_evictable(entry->pool->zpool) ? sizeof(zhdr) : 0;
+	hlen = zpool_evictable(entry->zpool) ? sizeof(zhdr) : 0;
 	gfp = __GFP_NORETRY | __GFP_NOWARN | __GFP_KSWAPD_RECLAIM;
-	if (zpool_malloc_support_movable(entry->pool->zpool))
+	if (zpool_malloc_support_movable(entry->zpool))
 		gfp |= __GFP_HIGHMEM | __GFP_MOVABLE;
-	ret = zpool_malloc(entry->pool->zpool, hlen + dlen, gfp, &handle);
+	ret = zpool_malloc(entry->zpool, hlen + dlen, gfp, &handle);
 	if (ret == -ENOSPC) {
 		zswap_reject_compress_poor++;
 		goto put_dstmem;
@@ -1099,10 +1135,10 @@ static int zswap_frontswap_store(unsigned type, pgoff_t offset,
 		zswap_reject_alloc_fail++;
 		goto put_dstmem;
 	}
-	buf = zpool_map_handle(entry->pool->zpool, handle, ZPOOL_MM_RW);
+	buf = zpool_map_handle(entry->zpool, handle, ZPOOL_MM_RW);
 	memcpy(buf, &zhdr, hlen);
 	memcpy(buf + hlen, dst, dlen);
-	zpool_unmap_handle(entry->pool->zpool, handle);
+	zpool_unmap_handle(entry->zpool, handle);
 	put_cpu_var(zswap_dstmem);
 
 	/* populate entry */
@@ -1172,15 +1208,15 @@ static int zswap_frontswap_load(unsigned type, pgoff_t offset,
 
 	/* decompress */
 	dlen = PAGE_SIZE;
-	src = zpool_map_handle(entry->pool->zpool, entry->handle, ZPOOL_MM_RO);
-	if (zpool_evictable(entry->pool->zpool))
+	src = zpool_map_handle(entry->zpool, entry->handle, ZPOOL_MM_RO);
+	if (zpool_evictable(entry->zpool))
 		src += sizeof(struct zswap_header);
 	dst = kmap_atomic(page);
 	tfm = *get_cpu_ptr(entry->pool->tfm);
 	ret = crypto_comp_decompress(tfm, src, entry->length, dst, &dlen);
 	put_cpu_ptr(entry->pool->tfm);
 	kunmap_atomic(dst);
-	zpool_unmap_handle(entry->pool->zpool, entry->handle);
+	zpool_unmap_handle(entry->zpool, entry->handle);
 	BUG_ON(ret);
 
 freeentry:
@@ -1341,7 +1377,7 @@ static int __init init_zswap(void)
 	pool = __zswap_pool_create_fallback();
 	if (pool) {
 		pr_info("loaded using pool %s/%s\n", pool->tfm_name,
-			zpool_get_type(pool->zpool));
+			zswap_pool_type(pool));
 		list_add(&pool->list, &zswap_pools);
 		zswap_has_pool = true;
 	} else {
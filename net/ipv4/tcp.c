@@ -1756,6 +1756,18 @@ static int tcp_zerocopy_vm_insert_batch(struct vm_area_struct *vma,
 	int ret;
 
 	ret = vm_insert_pages(vma, *insert_addr, pages, &pages_remaining);
+	if (ret == -EBUSY &&
+	    (zc->flags & TCP_RECEIVE_ZEROCOPY_FLAG_TLB_CLEAN_HINT)) {
+		unsigned long done = pages_to_map - pages_remaining;
+		unsigned long addr = *insert_addr + PAGE_SIZE * done;
+
+		/* The range wasn't clean after all: zap the rest of the batch
+		 * and retry, so that the TLB is only flushed for it.
+		 */
+		zap_page_range(vma, addr, PAGE_SIZE * pages_remaining);
+		ret = vm_insert_pages(vma, addr, pages + done,
+				      &pages_remaining);
+	}
 	bytes_mapped = PAGE_SIZE * (pages_to_map - pages_remaining);
 	/* Even if vm_insert_pages fails, it may have partially succeeded in
 	 * mapping (some but not all of the pages).
@@ -1773,12 +1785,44 @@ static int tcp_zerocopy_vm_insert_batch(struct vm_area_struct *vma,
 	return ret;
 }
 
+/* Copy @len bytes at *@seq to the copy buffer, which the caller checked */
+static int tcp_zerocopy_copy_leftover(struct sock *sk,
+				      struct tcp_zerocopy_receive *zc,
+				      u32 *seq, u32 len)
+{
+	void __user *buf = u64_to_user_ptr(zc->copybuf_address);
+	struct msghdr msg = {};
+	struct sk_buff *skb;
+	struct iovec iov;
+	u32 offset, used;
+	int copied = 0;
+	int err;
+
+	err = import_single_range(READ, buf, len, &iov, &msg.msg_iter);
+	if (err)
+		return err;
+
+	while (len) {
+		skb = tcp_recv_skb(sk, *seq, &offset);
+		if (!skb)
+			break;
+		used = min_t(u32, len, skb->len - offset);
+		err = skb_copy_datagram_msg(skb, offset, &msg, used);
+		if (err)
+			return copied ? : err;
+		*seq += used;
+		copied += used;
+		len -= used;
+	}
+	return copied;
+}
+
 static int tcp_zerocopy_receive(struct sock *sk,
 				struct tcp_zerocopy_receive *zc)
 {
 	unsigned long address = (unsigned long)zc->address;
 	u32 length = 0, seq, offset, zap_len;
-	#define PAGE_BATCH_SIZE 8
+	#define PAGE_BATCH_SIZE 32
 	struct page *pages[PAGE_BATCH_SIZE];
 	const skb_frag_t *frags = NULL;
 	struct vm_area_struct *vma;
@@ -1786,12 +1830,20 @@ static int tcp_zerocopy_receive(struct sock *sk,
 	unsigned long pg_idx = 0;
 	unsigned long curr_addr;
 	struct tcp_sock *tp;
+	int copied = 0;
 	int inq;
 	int ret;
 
 	if (address & (PAGE_SIZE - 1) || address != zc->address)
 		return -EINVAL;
 
+	if (zc->flags & ~TCP_RECEIVE_ZEROCOPY_FLAG_TLB_CLEAN_HINT)
+		return -EINVAL;
+
+	if (zc->copybuf_len < 0 ||
+	    (unsigned long)zc->copybuf_address != zc->copybuf_address)
+		return -EINVAL;
+
 	if (sk->sk_state == TCP_LISTEN)
 		return -ENOTCONN;
 
@@ -1813,7 +1865,12 @@ static int tcp_zerocopy_receive(struct sock *sk,
 	zc->length = min_t(u32, zc->length, inq);
 	zap_len = zc->length & ~(PAGE_SIZE - 1);
 	if (zap_len) {
-		zap_page_range(vma, address, zap_len);
+		/* Either the application says the range is clean, and
+		 * tcp_zerocopy_vm_insert_batch() zaps whatever isn't, or
+		 * flush the TLB once for the whole range.
+		 */
+		if (!(zc->flags & TCP_RECEIVE_ZEROCOPY_FLAG_TLB_CLEAN_HINT))
+			zap_page_range(vma, address, zap_len);
 		zc->recv_skip_hint = 0;
 	} else {
 		zc->recv_skip_hint = zc->length;
@@ -1885,13 +1942,28 @@ static int tcp_zerocopy_receive(struct sock *sk,
 	}
 out:
 	mmap_read_unlock(current->mm);
-	if (length) {
+
+	/* Copy the unaligned data up to the next mappable page, if any, in
+	 * the same call.  This can't fault with mmap_lock held.
+	 */
+	if (!ret && zc->copybuf_len && zc->recv_skip_hint) {
+		copied = tcp_zerocopy_copy_leftover(sk, zc, &seq,
+						    min_t(u32, zc->copybuf_len,
+							  zc->recv_skip_hint));
+		zc->copybuf_len = copied;
+		if (copied > 0)
+			zc->recv_skip_hint -= copied;
+		else
+			copied = 0;
+	}
+
+	if (length || copied) {
 		WRITE_ONCE(tp->copied_seq, seq);
 		tcp_rcv_space_adjust(sk);
 
 		/* Clean up data we have read: This will do ACK frames. */
 		tcp_recv_skb(sk, seq, &offset);
-		tcp_cleanup_rbuf(sk, length);
+		tcp_cleanup_rbuf(sk, length + copied);
 		ret = 0;
 		if (length == zc->length)
 			zc->recv_skip_hint = 0;
@@ -3823,7 +3895,7 @@ static int do_tcp_getsockopt(struct sock *sk, int level,
 	}
 #ifdef CONFIG_MMU
 	case TCP_ZEROCOPY_RECEIVE: {
-		struct tcp_zerocopy_receive zc;
+		struct tcp_zerocopy_receive zc = {};
 		int err;
 
 		if (get_user(len, optlen))
@@ -3843,6 +3915,7 @@ static int do_tcp_getsockopt(struct sock *sk, int level,
 		if (len == sizeof(zc))
 			goto zerocopy_rcv_sk_err;
 		switch (len) {
+		case offsetofend(struct tcp_zerocopy_receive, copybuf_len):
 		case offsetofend(struct tcp_zerocopy_receive, err):
 			goto zerocopy_rcv_sk_err;
 		case offsetofend(struct tcp_zerocopy_receive, inq):
@@ -23,6 +23,7 @@
 #include <linux/netdevice.h>
 #include <linux/rculist.h>
 #include <net/xdp_sock_drv.h>
+#include <net/busy_poll.h>
 #include <net/xdp.h>
 
 #include "xsk_queue.h"
@@ -30,6 +31,8 @@
 #include "xsk.h"
 
 #define TX_BATCH_SIZE 16
+/* Upper bound for the number of descriptors of a packet, with XDP_USE_SG */
+#define XSK_MAX_SG_DESCS (MAX_SKB_FRAGS + 1)
 
 static DEFINE_PER_CPU(struct list_head, xskmap_flush_list);
 
@@ -148,14 +151,15 @@ static u64 xp_get_handle(struct xdp_buff_xsk *xskb)
 	return xskb->orig_addr + (offset << XSK_UNALIGNED_BUF_OFFSET_SHIFT);
 }
 
-static int __xsk_rcv_zc(struct xdp_sock *xs, struct xdp_buff *xdp, u32 len)
+static int __xsk_rcv_zc(struct xdp_sock *xs, struct xdp_buff *xdp, u32 len,
+			u32 options)
 {
 	struct xdp_buff_xsk *xskb = container_of(xdp, struct xdp_buff_xsk, xdp);
 	u64 addr;
 	int err;
 
 	addr = xp_get_handle(xskb);
-	err = xskq_prod_reserve_desc(xs->rx, addr, len);
+	err = xskq_prod_reserve_desc(xs->rx, addr, len, options);
 	if (err) {
 		xs->rx_queue_full++;
 		return err;
@@ -183,15 +187,72 @@ static void xsk_copy_xdp(struct xdp_buff *to, struct xdp_buff *from, u32 len)
 	memcpy(to_buf, from_buf, len + metalen);
 }
 
+/* Copies a frame that does not fit in a single buffer into as many buffers as
+ * needed. The metadata, if any, is in front of the first buffer, and all the
+ * descriptors but the last one have XDP_PKT_CONTD set.
+ */
+static int __xsk_rcv_sg(struct xdp_sock *xs, struct xdp_buff *xdp, u32 len,
+			u32 frame_size)
+{
+	u32 nr_bufs = DIV_ROUND_UP(len, frame_size), i, off, copy;
+	struct xdp_buff *bufs[XSK_MAX_SG_DESCS];
+
+	if (nr_bufs > XSK_MAX_SG_DESCS) {
+		xs->rx_dropped++;
+		return -ENOSPC;
+	}
+
+	/* The frame is delivered whole or not at all. */
+	if (!xskq_prod_has_room(xs->rx, nr_bufs)) {
+		xs->rx_queue_full++;
+		return -ENOSPC;
+	}
+
+	for (i = 0; i < nr_bufs; i++) {
+		bufs[i] = xsk_buff_alloc(xs->pool);
+		if (!bufs[i]) {
+			while (i--)
+				xsk_buff_free(bufs[i]);
+			xs->rx_dropped++;
+			return -ENOSPC;
+		}
+	}
+
+	xsk_copy_xdp(bufs[0], xdp, frame_size);
+	for (i = 1, off = frame_size; i < nr_bufs; i++, off += frame_size) {
+		copy = min(len - off, frame_size);
+		memcpy(bufs[i]->data, xdp->data + off, copy);
+	}
+
+	for (i = 0; i < nr_bufs; i++) {
+		copy = min(len - i * frame_size, frame_size);
+		/* Cannot fail, the room in the Rx ring was checked above. */
+		__xsk_rcv_zc(xs, bufs[i], copy,
+			     i < nr_bufs - 1 ? XDP_PKT_CONTD : 0);
+	}
+
+	return 0;
+}
+
 static int __xsk_rcv(struct xdp_sock *xs, struct xdp_buff *xdp, u32 len,
 		     bool explicit_free)
 {
+	u32 frame_size = xsk_pool_get_rx_frame_size(xs->pool);
 	struct xdp_buff *xsk_xdp;
 	int err;
 
-	if (len > xsk_pool_get_rx_frame_size(xs->pool)) {
-		xs->rx_dropped++;
-		return -ENOSPC;
+	if (len > frame_size) {
+		if (!xs->sg) {
+			xs->rx_dropped++;
+			return -ENOSPC;
+		}
+
+		err = __xsk_rcv_sg(xs, xdp, len, frame_size);
+		if (err)
+			return err;
+		if (explicit_free)
+			xdp_return_buff(xdp);
+		return 0;
 	}
 
 	xsk_xdp = xsk_buff_alloc(xs->pool);
@@ -201,7 +262,7 @@ static int __xsk_rcv(struct xdp_sock *xs, struct xdp_buff *xdp, u32 len,
 	}
 
 	xsk_copy_xdp(xsk_xdp, xdp, len);
-	err = __xsk_rcv_zc(xs, xsk_xdp, len);
+	err = __xsk_rcv_zc(xs, xsk_xdp, len, 0);
 	if (err) {
 		xsk_buff_free(xsk_xdp);
 		return err;
@@ -232,10 +293,11 @@ static int xsk_rcv(struct xdp_sock *xs, struct xdp_buff *xdp,
 	if (xs->dev != xdp->rxq->dev || xs->queue_id != xdp->rxq->queue_index)
 		return -EINVAL;
 
+	__sk_mark_napi_id_once(&xs->sk, xdp->rxq->napi_id);
 	len = xdp->data_end - xdp->data;
 
 	return xdp->rxq->mem.type == MEM_TYPE_XSK_BUFF_POOL ?
-		__xsk_rcv_zc(xs, xdp, len) :
+		__xsk_rcv_zc(xs, xdp, len, 0) :
 		__xsk_rcv(xs, xdp, len, explicit_free);
 }
 
@@ -362,12 +424,69 @@ static void xsk_destruct_skb(struct sk_buff *skb)
 	sock_wfree(skb);
 }
 
+/* Completion addresses of a packet spanning several descriptors */
+struct xsk_tx_addrs {
+	u32 nr;
+	u64 addrs[];
+};
+
+static void xsk_destruct_skb_sg(struct sk_buff *skb)
+{
+	struct xsk_tx_addrs *tx_addrs = skb_shinfo(skb)->destructor_arg;
+	struct xdp_sock *xs = xdp_sk(skb->sk);
+	unsigned long flags;
+	u32 i;
+
+	spin_lock_irqsave(&xs->tx_completion_lock, flags);
+	for (i = 0; i < tx_addrs->nr; i++)
+		xskq_prod_submit_addr(xs->pool->cq, tx_addrs->addrs[i]);
+	spin_unlock_irqrestore(&xs->tx_completion_lock, flags);
+
+	kfree(tx_addrs);
+	sock_wfree(skb);
+}
+
+/* Reads the descriptors following @descs[0] up to the end of its packet,
+ * without releasing them. Returns the number of descriptors of the packet,
+ * which is more than XSK_MAX_SG_DESCS if they did not all fit in @descs, 0
+ * if user space has not produced the end of the packet yet, or -EINVAL if
+ * one of them is invalid. In the last case the consumer is left on the
+ * invalid descriptor, and the whole packet has to be dropped.
+ */
+static int xsk_tx_gather(struct xdp_sock *xs, struct xdp_desc *descs,
+			 u32 *len)
+{
+	struct xdp_desc desc = descs[0];
+	int nr = 1;
+
+	*len = desc.len;
+	while (desc.options & XDP_PKT_CONTD) {
+		xskq_cons_release(xs->tx);
+		if (!xskq_cons_has_entries(xs->tx, 1))
+			return 0;
+		if (!xskq_cons_read_next_desc(xs->tx, &desc, xs->pool)) {
+			/* The invalid one itself is already counted. */
+			xs->tx->invalid_descs += nr;
+			return -EINVAL;
+		}
+
+		if (nr < XSK_MAX_SG_DESCS) {
+			descs[nr] = desc;
+			*len += desc.len;
+		}
+		nr++;
+	}
+
+	return nr;
+}
+
 static int xsk_generic_xmit(struct sock *sk)
 {
+	struct xdp_desc descs[XSK_MAX_SG_DESCS];
 	struct xdp_sock *xs = xdp_sk(sk);
+	struct xsk_tx_addrs *tx_addrs;
 	u32 max_batch = TX_BATCH_SIZE;
 	bool sent_frame = false;
-	struct xdp_desc desc;
 	struct sk_buff *skb;
 	int err = 0;
 
@@ -376,31 +495,64 @@ static int xsk_generic_xmit(struct sock *sk)
 	if (xs->queue_id >= xs->dev->real_num_tx_queues)
 		goto out;
 
-	while (xskq_cons_peek_desc(xs->tx, &desc, xs->pool)) {
+	while (xskq_cons_peek_desc(xs->tx, &descs[0], xs->pool)) {
+		u32 cons = xs->tx->cached_cons;
+		u32 i, len, off;
 		char *buffer;
-		u64 addr;
-		u32 len;
+		int nr;
 
 		if (max_batch-- == 0) {
 			err = -EAGAIN;
 			goto out;
 		}
 
-		len = desc.len;
+		nr = xsk_tx_gather(xs, descs, &len);
+		if (!nr) {
+			xs->tx->cached_cons = cons;
+			break;
+		}
+		if (nr < 0) {
+			/* Drop the packet up to the invalid descriptor. */
+			xskq_cons_release(xs->tx);
+			continue;
+		}
+		if (nr > XSK_MAX_SG_DESCS) {
+			/* Too many fragments, drop the packet. */
+			xs->tx->invalid_descs += nr;
+			xskq_cons_release(xs->tx);
+			continue;
+		}
+		xs->tx->cached_cons = cons;
+
+		tx_addrs = NULL;
+		if (nr > 1) {
+			tx_addrs = kmalloc(struct_size(tx_addrs, addrs, nr),
+					   GFP_KERNEL);
+			if (unlikely(!tx_addrs)) {
+				err = -ENOMEM;
+				goto out;
+			}
+		}
+
 		skb = sock_alloc_send_skb(sk, len, 1, &err);
-		if (unlikely(!skb))
+		if (unlikely(!skb)) {
+			kfree(tx_addrs);
 			goto out;
+		}
 
 		skb_put(skb, len);
-		addr = desc.addr;
-		buffer = xsk_buff_raw_get_data(xs->pool, addr);
-		err = skb_store_bits(skb, 0, buffer, len);
+		err = 0;
+		for (i = 0, off = 0; i < nr && !err; off += descs[i++].len) {
+			buffer = xsk_buff_raw_get_data(xs->pool, descs[i].addr);
+			err = skb_store_bits(skb, off, buffer, descs[i].len);
+		}
 		/* This is the backpressure mechanism for the Tx path.
 		 * Reserve space in the completion queue and only proceed
 		 * if there is space in it. This avoids having to implement
 		 * any buffering in the Tx path.
 		 */
-		if (unlikely(err) || xskq_prod_reserve(xs->pool->cq)) {
+		if (unlikely(err) || xskq_prod_reserve_n(xs->pool->cq, nr)) {
+			kfree(tx_addrs);
 			kfree_skb(skb);
 			goto out;
 		}
@@ -408,8 +560,17 @@ static int xsk_generic_xmit(struct sock *sk)
 		skb->dev = xs->dev;
 		skb->priority = sk->sk_priority;
 		skb->mark = sk->sk_mark;
-		skb_shinfo(skb)->destructor_arg = (void *)(long)desc.addr;
-		skb->destructor = xsk_destruct_skb;
+		if (tx_addrs) {
+			tx_addrs->nr = nr;
+			for (i = 0; i < nr; i++)
+				tx_addrs->addrs[i] = descs[i].addr;
+			skb_shinfo(skb)->destructor_arg = tx_addrs;
+			skb->destructor = xsk_destruct_skb_sg;
+		} else {
+			skb_shinfo(skb)->destructor_arg =
+				(void *)(long)descs[0].addr;
+			skb->destructor = xsk_destruct_skb;
+		}
 
 		/* Hinder dev_direct_xmit from freeing the packet and
 		 * therefore completing it in the destructor
@@ -419,13 +580,15 @@ static int xsk_generic_xmit(struct sock *sk)
 		if  (err == NETDEV_TX_BUSY) {
 			/* Tell user-space to retry the send */
 			skb->destructor = sock_wfree;
+			xskq_prod_cancel_n(xs->pool->cq, nr);
+			kfree(tx_addrs);
 			/* Free skb without triggering the perf drop trace */
 			consume_skb(skb);
 			err = -EAGAIN;
 			goto out;
 		}
 
-		xskq_cons_release(xs->tx);
+		xs->tx->cached_cons += nr;
 		/* Ignore NET_XMIT_CN as packet might have been sent */
 		if (err == NET_XMIT_DROP) {
 			/* SKB completed but not sent */
@@ -460,20 +623,72 @@ static int __xsk_sendmsg(struct sock *sk)
 	return xs->zc ? xsk_zc_xmit(xs) : xsk_generic_xmit(sk);
 }
 
+static bool xsk_no_wakeup(struct sock *sk)
+{
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	/* Prefer busy-polling, skip the wakeup. */
+	return READ_ONCE(sk->sk_prefer_busy_poll) && READ_ONCE(sk->sk_ll_usec) &&
+		READ_ONCE(sk->sk_napi_id) >= MIN_NAPI_ID;
+#else
+	return false;
+#endif
+}
+
 static int xsk_sendmsg(struct socket *sock, struct msghdr *m, size_t total_len)
 {
 	bool need_wait = !(m->msg_flags & MSG_DONTWAIT);
 	struct sock *sk = sock->sk;
 	struct xdp_sock *xs = xdp_sk(sk);
+	struct xsk_buff_pool *pool;
 
 	if (unlikely(!xsk_is_bound(xs)))
 		return -ENXIO;
 	if (unlikely(need_wait))
 		return -EOPNOTSUPP;
 
+	if (sk_can_busy_loop(sk))
+		sk_busy_loop(sk, 1); /* only support non-blocking sockets */
+
+	/* In zero-copy mode, the driver transmits from its NAPI context. There
+	 * is nothing left to do if the application drives that context, or if
+	 * the driver did not ask for a wakeup.
+	 */
+	pool = xs->pool;
+	if (xs->zc && (xsk_no_wakeup(sk) ||
+		       (pool->uses_need_wakeup &&
+			!(pool->cached_need_wakeup & XDP_WAKEUP_TX))))
+		return 0;
+
 	return __xsk_sendmsg(sk);
 }
 
+static int xsk_recvmsg(struct socket *sock, struct msghdr *m, size_t len,
+		       int flags)
+{
+	bool need_wait = !(flags & MSG_DONTWAIT);
+	struct sock *sk = sock->sk;
+	struct xdp_sock *xs = xdp_sk(sk);
+
+	if (unlikely(!xsk_is_bound(xs)))
+		return -ENXIO;
+	if (unlikely(!(xs->dev->flags & IFF_UP)))
+		return -ENETDOWN;
+	if (unlikely(!xs->rx))
+		return -ENOBUFS;
+	if (unlikely(need_wait))
+		return -EOPNOTSUPP;
+
+	if (sk_can_busy_loop(sk))
+		sk_busy_loop(sk, 1); /* only support non-blocking sockets */
+
+	if (xsk_no_wakeup(sk))
+		return 0;
+
+	if (xs->zc && (xs->pool->cached_need_wakeup & XDP_WAKEUP_RX))
+		return xsk_wakeup(xs, XDP_WAKEUP_RX);
+	return 0;
+}
+
 static __poll_t xsk_poll(struct file *file, struct socket *sock,
 			     struct poll_table_struct *wait)
 {
@@ -658,8 +873,11 @@ static int xsk_bind(struct socket *sock, struct sockaddr *addr, int addr_len)
 
 	flags = sxdp->sxdp_flags;
 	if (flags & ~(XDP_SHARED_UMEM | XDP_COPY | XDP_ZEROCOPY |
-		      XDP_USE_NEED_WAKEUP))
+		      XDP_USE_NEED_WAKEUP | XDP_USE_SG))
 		return -EINVAL;
+	/* Multi-buffer packets need driver support in zero-copy mode. */
+	if ((flags & XDP_USE_SG) && (flags & XDP_ZEROCOPY))
+		return -EOPNOTSUPP;
 
 	rtnl_lock();
 	mutex_lock(&xs->mutex);
@@ -711,6 +929,12 @@ static int xsk_bind(struct socket *sock, struct sockaddr *addr, int addr_len)
 			goto out_unlock;
 		}
 
+		if ((flags & XDP_USE_SG) && umem_xs->zc) {
+			err = -EOPNOTSUPP;
+			sockfd_put(sock);
+			goto out_unlock;
+		}
+
 		if (umem_xs->queue_id != qid || umem_xs->dev != dev) {
 			/* Share the umem with another socket on another qid
 			 * and/or device.
@@ -758,6 +982,9 @@ static int xsk_bind(struct socket *sock, struct sockaddr *addr, int addr_len)
 			goto out_unlock;
 		}
 
+		if (flags & XDP_USE_SG)
+			flags |= XDP_COPY;
+
 		err = xp_assign_dev(xs->pool, dev, qid, flags);
 		if (err) {
 			xp_destroy(xs->pool);
@@ -768,6 +995,9 @@ static int xsk_bind(struct socket *sock, struct sockaddr *addr, int addr_len)
 
 	xs->dev = dev;
 	xs->zc = xs->umem->zc;
+	xs->sg = !!(flags & XDP_USE_SG);
+	if (xs->tx)
+		xs->tx->sg = xs->sg;
 	xs->queue_id = qid;
 	xp_add_xsk(xs->pool, xs);
 
@@ -1134,7 +1364,7 @@ static const struct proto_ops xsk_proto_ops = {
 	.setsockopt	= xsk_setsockopt,
 	.getsockopt	= xsk_getsockopt,
 	.sendmsg	= xsk_sendmsg,
-	.recvmsg	= sock_no_recvmsg,
+	.recvmsg	= xsk_recvmsg,
 	.mmap		= xsk_mmap,
 	.sendpage	= sock_no_sendpage,
 };
@@ -43,6 +43,8 @@ struct xsk_queue {
 	struct xdp_ring *ring;
 	u64 invalid_descs;
 	u64 queue_empty_descs;
+	/* Descriptors may have XDP_PKT_CONTD set */
+	bool sg;
 };
 
 /* The structure of the shared state of the rings are the same as the
@@ -136,7 +138,7 @@ static inline bool xp_aligned_validate_desc(struct xsk_buff_pool *pool,
 	if (chunk >= pool->addrs_cnt)
 		return false;
 
-	if (desc->options)
+	if (desc->options & ~XDP_PKT_CONTD)
 		return false;
 	return true;
 }
@@ -156,7 +158,7 @@ static inline bool xp_unaligned_validate_desc(struct xsk_buff_pool *pool,
 	    xp_desc_crosses_non_contig_pg(pool, addr, desc->len))
 		return false;
 
-	if (desc->options)
+	if (desc->options & ~XDP_PKT_CONTD)
 		return false;
 	return true;
 }
@@ -172,7 +174,8 @@ static inline bool xskq_cons_is_valid_desc(struct xsk_queue *q,
 					   struct xdp_desc *d,
 					   struct xsk_buff_pool *pool)
 {
-	if (!xp_validate_desc(pool, d)) {
+	if (!xp_validate_desc(pool, d) ||
+	    ((d->options & XDP_PKT_CONTD) && !q->sg)) {
 		q->invalid_descs++;
 		return false;
 	}
@@ -197,6 +200,19 @@ static inline bool xskq_cons_read_desc(struct xsk_queue *q,
 	return false;
 }
 
+/* Like xskq_cons_read_desc(), but on an invalid descriptor, leaves the
+ * consumer pointing at it instead of skipping it. There must be an entry.
+ */
+static inline bool xskq_cons_read_next_desc(struct xsk_queue *q,
+					    struct xdp_desc *desc,
+					    struct xsk_buff_pool *pool)
+{
+	struct xdp_rxtx_ring *ring = (struct xdp_rxtx_ring *)q->ring;
+
+	*desc = ring->desc[q->cached_cons & q->ring_mask];
+	return xskq_cons_is_valid_desc(q, desc, pool);
+}
+
 /* Functions for consumers */
 
 static inline void __xskq_cons_release(struct xsk_queue *q)
@@ -280,6 +296,25 @@ static inline bool xskq_prod_is_full(struct xsk_queue *q)
 	return !free_entries;
 }
 
+static inline bool xskq_prod_has_room(struct xsk_queue *q, u32 cnt)
+{
+	u32 free_entries = q->nentries - (q->cached_prod - q->cached_cons);
+
+	if (free_entries >= cnt)
+		return true;
+
+	/* Refresh the local tail pointer */
+	q->cached_cons = READ_ONCE(q->ring->consumer);
+	free_entries = q->nentries - (q->cached_prod - q->cached_cons);
+
+	return free_entries >= cnt;
+}
+
+static inline void xskq_prod_cancel_n(struct xsk_queue *q, u32 cnt)
+{
+	q->cached_prod -= cnt;
+}
+
 static inline int xskq_prod_reserve(struct xsk_queue *q)
 {
 	if (xskq_prod_is_full(q))
@@ -290,6 +325,16 @@ static inline int xskq_prod_reserve(struct xsk_queue *q)
 	return 0;
 }
 
+static inline int xskq_prod_reserve_n(struct xsk_queue *q, u32 cnt)
+{
+	if (!xskq_prod_has_room(q, cnt))
+		return -ENOSPC;
+
+	/* A, matches D */
+	q->cached_prod += cnt;
+	return 0;
+}
+
 static inline int xskq_prod_reserve_addr(struct xsk_queue *q, u64 addr)
 {
 	struct xdp_umem_ring *ring = (struct xdp_umem_ring *)q->ring;
@@ -303,7 +348,7 @@ static inline int xskq_prod_reserve_addr(struct xsk_queue *q, u64 addr)
 }
 
 static inline int xskq_prod_reserve_desc(struct xsk_queue *q,
-					 u64 addr, u32 len)
+					 u64 addr, u32 len, u32 options)
 {
 	struct xdp_rxtx_ring *ring = (struct xdp_rxtx_ring *)q->ring;
 	u32 idx;
@@ -315,6 +360,7 @@ static inline int xskq_prod_reserve_desc(struct xsk_queue *q,
 	idx = q->cached_prod++ & q->ring_mask;
 	ring->desc[idx].addr = addr;
 	ring->desc[idx].len = len;
+	ring->desc[idx].options = options;
 
 	return 0;
 }
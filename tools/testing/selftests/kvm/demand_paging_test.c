@@ -41,6 +41,33 @@
 
 static char *guest_data_prototype;
 
+/* Present bitmap of the test memslot, if KVM_SET_USERFAULT_BITMAP is used */
+static uint64_t *userfault_bitmap;
+static useconds_t userfault_delay;
+
+static void handle_memory_fault_exit(struct kvm_vm *vm, struct kvm_run *run)
+{
+	uint64_t gpa = run->memory_fault.gpa;
+	uint64_t page;
+	void *hva;
+
+	TEST_ASSERT(gpa >= guest_test_phys_mem,
+		    "Memory fault exit outside of the test memslot: 0x%lx", gpa);
+
+	page = (gpa - guest_test_phys_mem) / perf_test_args.host_page_size;
+
+	if (userfault_delay)
+		usleep(userfault_delay);
+
+	hva = addr_gpa2hva(vm, gpa & ~(perf_test_args.host_page_size - 1));
+	memcpy(hva, guest_data_prototype, perf_test_args.host_page_size);
+	__atomic_fetch_or(&userfault_bitmap[page / 64], 1ull << (page % 64),
+			  __ATOMIC_RELEASE);
+
+	PER_PAGE_DEBUG("Paged in %ld bytes at 0x%lx from vCPU exit\n",
+		       perf_test_args.host_page_size, gpa);
+}
+
 static void *vcpu_worker(void *data)
 {
 	int ret;
@@ -50,6 +77,7 @@ static void *vcpu_worker(void *data)
 	struct kvm_run *run;
 	struct timespec start;
 	struct timespec ts_diff;
+	int64_t pages = 0;
 
 	vcpu_args_set(vm, vcpu_id, 1, vcpu_id);
 	run = vcpu_state(vm, vcpu_id);
@@ -57,7 +85,16 @@ static void *vcpu_worker(void *data)
 	clock_gettime(CLOCK_MONOTONIC, &start);
 
 	/* Let the guest access its memory */
-	ret = _vcpu_run(vm, vcpu_id);
+	for (;;) {
+		ret = _vcpu_run(vm, vcpu_id);
+		if (ret == -1 && errno == EFAULT && userfault_bitmap &&
+		    run->exit_reason == KVM_EXIT_MEMORY_FAULT) {
+			handle_memory_fault_exit(vm, run);
+			pages++;
+			continue;
+		}
+		break;
+	}
 	TEST_ASSERT(ret == 0, "vcpu_run failed: %d\n", ret);
 	if (get_ucall(vm, vcpu_id, NULL) != UCALL_SYNC) {
 		TEST_ASSERT(false,
@@ -68,6 +105,9 @@ static void *vcpu_worker(void *data)
 	ts_diff = timespec_diff_now(start);
 	PER_VCPU_DEBUG("vCPU %d execution time: %ld.%.9lds\n", vcpu_id,
 		       ts_diff.tv_sec, ts_diff.tv_nsec);
+	if (userfault_bitmap)
+		PER_VCPU_DEBUG("vCPU %d paged in %ld pages from memory fault exits\n",
+			       vcpu_id, pages);
 
 	return NULL;
 }
@@ -248,8 +288,24 @@ static int setup_demand_paging(struct kvm_vm *vm,
 	return 0;
 }
 
+static void setup_userfault_bitmap(struct kvm_vm *vm, useconds_t delay)
+{
+	struct kvm_userfault_bitmap ufb;
+	uint64_t pages;
+
+	pages = nr_vcpus * guest_percpu_mem_size / perf_test_args.host_page_size;
+	userfault_bitmap = calloc((pages + 63) / 64, sizeof(uint64_t));
+	TEST_ASSERT(userfault_bitmap, "Memory allocation failed");
+	userfault_delay = delay;
+
+	ufb.slot = TEST_MEM_SLOT_INDEX;
+	ufb.flags = 0;
+	ufb.bitmap = (uint64_t)userfault_bitmap;
+	vm_ioctl(vm, KVM_SET_USERFAULT_BITMAP, &ufb);
+}
+
 static void run_test(enum vm_guest_mode mode, bool use_uffd,
-		     useconds_t uffd_delay)
+		     bool use_bitmap, useconds_t uffd_delay)
 {
 	pthread_t *vcpu_threads;
 	pthread_t *uffd_handler_threads = NULL;
@@ -261,7 +317,8 @@ static void run_test(enum vm_guest_mode mode, bool use_uffd,
 	int vcpu_id;
 	int r;
 
-	vm = create_vm(mode, nr_vcpus, guest_percpu_mem_size);
+	vm = create_vm(mode, nr_vcpus, guest_percpu_mem_size,
+		       VM_MEM_SRC_ANONYMOUS);
 
 	perf_test_args.wr_fract = 1;
 
@@ -275,6 +332,9 @@ static void run_test(enum vm_guest_mode mode, bool use_uffd,
 
 	add_vcpus(vm, nr_vcpus, guest_percpu_mem_size);
 
+	if (use_bitmap)
+		setup_userfault_bitmap(vm, uffd_delay);
+
 	if (use_uffd) {
 		uffd_handler_threads =
 			malloc(nr_vcpus * sizeof(*uffd_handler_threads));
@@ -367,6 +427,8 @@ static void run_test(enum vm_guest_mode mode, bool use_uffd,
 		free(uffd_args);
 		free(pipefds);
 	}
+	free(userfault_bitmap);
+	userfault_bitmap = NULL;
 }
 
 struct guest_mode {
@@ -384,7 +446,7 @@ static void help(char *name)
 	int i;
 
 	puts("");
-	printf("usage: %s [-h] [-m mode] [-u] [-d uffd_delay_usec]\n"
+	printf("usage: %s [-h] [-m mode] [-u] [-f] [-d uffd_delay_usec]\n"
 	       "          [-b memory] [-v vcpus]\n", name);
 	printf(" -m: specify the guest mode ID to test\n"
 	       "     (default: test all supported modes)\n"
@@ -396,9 +458,13 @@ static void help(char *name)
 	}
 	printf(" -u: use User Fault FD to handle vCPU page\n"
 	       "     faults.\n");
+	printf(" -f: mark the test memory as missing in a userfault\n"
+	       "     bitmap and handle KVM_EXIT_MEMORY_FAULT exits\n"
+	       "     on the vCPU threads. Excludes -u.\n");
 	printf(" -d: add a delay in usec to the User Fault\n"
-	       "     FD handler to simulate demand paging\n"
-	       "     overheads. Ignored without -u.\n");
+	       "     FD handler or the memory fault exit handler\n"
+	       "     to simulate demand paging overheads.\n"
+	       "     Ignored without -u or -f.\n");
 	printf(" -b: specify the size of the memory region which should be\n"
 	       "     demand paged by each vCPU. e.g. 10M or 3G.\n"
 	       "     Default: 1G\n");
@@ -414,6 +480,7 @@ int main(int argc, char *argv[])
 	unsigned int mode;
 	int opt, i;
 	bool use_uffd = false;
+	bool use_bitmap = false;
 	useconds_t uffd_delay = 0;
 
 #ifdef __x86_64__
@@ -437,7 +504,7 @@ int main(int argc, char *argv[])
 	guest_mode_init(VM_MODE_P40V48_4K, true, true);
 #endif
 
-	while ((opt = getopt(argc, argv, "hm:ud:b:v:")) != -1) {
+	while ((opt = getopt(argc, argv, "hm:ufd:b:v:")) != -1) {
 		switch (opt) {
 		case 'm':
 			if (!mode_selected) {
@@ -453,6 +520,9 @@ int main(int argc, char *argv[])
 		case 'u':
 			use_uffd = true;
 			break;
+		case 'f':
+			use_bitmap = true;
+			break;
 		case 'd':
 			uffd_delay = strtoul(optarg, NULL, 0);
 			TEST_ASSERT(uffd_delay >= 0,
@@ -473,13 +543,21 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	TEST_ASSERT(!(use_uffd && use_bitmap),
+		    "-u and -f can't be used together");
+
+	if (use_bitmap && !kvm_check_cap(KVM_CAP_USERFAULT_BITMAP)) {
+		print_skip("KVM_CAP_USERFAULT_BITMAP not supported");
+		exit(KSFT_SKIP);
+	}
+
 	for (i = 0; i < NUM_VM_MODES; ++i) {
 		if (!guest_modes[i].enabled)
 			continue;
 		TEST_ASSERT(guest_modes[i].supported,
 			    "Guest mode ID %d (%s) not supported.",
 			    i, vm_guest_mode_string(i));
-		run_test(i, use_uffd, uffd_delay);
+		run_test(i, use_uffd, use_bitmap, uffd_delay);
 	}
 
 	return 0;
@@ -27,9 +27,12 @@
 #define TEST_HOST_LOOP_N		2UL
 
 /* Host variables */
+static u64 dirty_log_manual_caps;
 static bool host_quit;
 static uint64_t iteration;
 static uint64_t vcpu_last_completed_iteration[MAX_VCPUS];
+/* How long each vCPU took to dirty its memory in the last iteration */
+static int64_t vcpu_last_iteration_ns[MAX_VCPUS];
 
 static void *vcpu_worker(void *data)
 {
@@ -60,6 +63,7 @@ static void *vcpu_worker(void *data)
 			    exit_reason_str(run->exit_reason));
 
 		pr_debug("Got sync event from vCPU %d\n", vcpu_id);
+		vcpu_last_iteration_ns[vcpu_id] = timespec_to_ns(ts_diff);
 		vcpu_last_completed_iteration[vcpu_id] = current_iteration;
 		pr_debug("vCPU %d updated last completed iteration to %lu\n",
 			 vcpu_id, vcpu_last_completed_iteration[vcpu_id]);
@@ -88,13 +92,57 @@ static void *vcpu_worker(void *data)
 	return NULL;
 }
 
-#ifdef USE_CLEAR_DIRTY_LOG
-static u64 dirty_log_manual_caps;
-#endif
+struct test_params {
+	unsigned long iterations;
+	uint64_t phys_offset;
+	int wr_fract;
+	enum vm_mem_backing_src_type backing_src;
+	bool manual_protect;
+	/* Pages per KVM_CLEAR_DIRTY_LOG, 0 to clear the memslot at once */
+	uint64_t clear_chunk_pages;
+};
+
+/*
+ * Report how long the vCPUs took to dirty their memory in the last iteration,
+ * which is dominated by the write protection faults taken while logging.  Only
+ * one page in wr_fract is written, the others are only read.
+ */
+static void report_vcpu_dirty_time(uint64_t pages_per_vcpu)
+{
+	int64_t total_ns = 0, max_ns = 0, ns;
+	uint64_t pages_written;
+	int vcpu_id;
+
+	pages_written = DIV_ROUND_UP(pages_per_vcpu, perf_test_args.wr_fract);
+
+	for (vcpu_id = 0; vcpu_id < nr_vcpus; vcpu_id++) {
+		ns = vcpu_last_iteration_ns[vcpu_id];
+		total_ns += ns;
+		if (ns > max_ns)
+			max_ns = ns;
+	}
+
+	pr_info("Iteration %lu vCPU dirty time: avg %ldns, max %ldns (avg %ldns/page)\n",
+		iteration, total_ns / nr_vcpus, max_ns,
+		total_ns / nr_vcpus / (int64_t)pages_written);
+}
+
+static void clear_dirty_log(struct kvm_vm *vm, unsigned long *bmap,
+			    uint64_t host_num_pages, uint64_t chunk_pages)
+{
+	uint64_t first, nr;
+
+	for (first = 0; first < host_num_pages; first += chunk_pages) {
+		nr = min(chunk_pages, host_num_pages - first);
+		/* The bitmap passed in starts at first. */
+		kvm_vm_clear_dirty_log(vm, TEST_MEM_SLOT_INDEX,
+				       bmap + first / BITS_PER_LONG, first, nr);
+	}
+}
 
-static void run_test(enum vm_guest_mode mode, unsigned long iterations,
-		     uint64_t phys_offset, int wr_fract)
+static void run_test(enum vm_guest_mode mode, struct test_params *p)
 {
+	unsigned long iterations = p->iterations;
 	pthread_t *vcpu_threads;
 	struct kvm_vm *vm;
 	unsigned long *bmap;
@@ -106,25 +154,23 @@ static void run_test(enum vm_guest_mode mode, unsigned long iterations,
 	struct timespec get_dirty_log_total = (struct timespec){0};
 	struct timespec vcpu_dirty_total = (struct timespec){0};
 	struct timespec avg;
-#ifdef USE_CLEAR_DIRTY_LOG
 	struct kvm_enable_cap cap = {};
 	struct timespec clear_dirty_log_total = (struct timespec){0};
-#endif
 
-	vm = create_vm(mode, nr_vcpus, guest_percpu_mem_size);
+	vm = create_vm(mode, nr_vcpus, guest_percpu_mem_size, p->backing_src);
 
-	perf_test_args.wr_fract = wr_fract;
+	perf_test_args.wr_fract = p->wr_fract;
 
 	guest_num_pages = (nr_vcpus * guest_percpu_mem_size) >> vm_get_page_shift(vm);
 	guest_num_pages = vm_adjust_num_guest_pages(mode, guest_num_pages);
 	host_num_pages = vm_num_host_pages(mode, guest_num_pages);
 	bmap = bitmap_alloc(host_num_pages);
 
-#ifdef USE_CLEAR_DIRTY_LOG
-	cap.cap = KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2;
-	cap.args[0] = dirty_log_manual_caps;
-	vm_enable_cap(vm, &cap);
-#endif
+	if (p->manual_protect) {
+		cap.cap = KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2;
+		cap.args[0] = dirty_log_manual_caps;
+		vm_enable_cap(vm, &cap);
+	}
 
 	vcpu_threads = malloc(nr_vcpus * sizeof(*vcpu_threads));
 	TEST_ASSERT(vcpu_threads, "Memory allocation failed");
@@ -180,6 +226,7 @@ static void run_test(enum vm_guest_mode mode, unsigned long iterations,
 		vcpu_dirty_total = timespec_add(vcpu_dirty_total, ts_diff);
 		pr_info("Iteration %lu dirty memory time: %ld.%.9lds\n",
 			iteration, ts_diff.tv_sec, ts_diff.tv_nsec);
+		report_vcpu_dirty_time(perf_test_args.vcpu_args[0].pages);
 
 		clock_gettime(CLOCK_MONOTONIC, &start);
 		kvm_vm_get_dirty_log(vm, TEST_MEM_SLOT_INDEX, bmap);
@@ -190,17 +237,17 @@ static void run_test(enum vm_guest_mode mode, unsigned long iterations,
 		pr_info("Iteration %lu get dirty log time: %ld.%.9lds\n",
 			iteration, ts_diff.tv_sec, ts_diff.tv_nsec);
 
-#ifdef USE_CLEAR_DIRTY_LOG
-		clock_gettime(CLOCK_MONOTONIC, &start);
-		kvm_vm_clear_dirty_log(vm, TEST_MEM_SLOT_INDEX, bmap, 0,
-				       host_num_pages);
+		if (p->manual_protect) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			clear_dirty_log(vm, bmap, host_num_pages,
+					p->clear_chunk_pages ? : host_num_pages);
 
-		ts_diff = timespec_diff_now(start);
-		clear_dirty_log_total = timespec_add(clear_dirty_log_total,
-						     ts_diff);
-		pr_info("Iteration %lu clear dirty log time: %ld.%.9lds\n",
-			iteration, ts_diff.tv_sec, ts_diff.tv_nsec);
-#endif
+			ts_diff = timespec_diff_now(start);
+			clear_dirty_log_total = timespec_add(clear_dirty_log_total,
+							     ts_diff);
+			pr_info("Iteration %lu clear dirty log time: %ld.%.9lds\n",
+				iteration, ts_diff.tv_sec, ts_diff.tv_nsec);
+		}
 	}
 
 	/* Tell the vcpu thread to quit */
@@ -220,12 +267,12 @@ static void run_test(enum vm_guest_mode mode, unsigned long iterations,
 		iterations, get_dirty_log_total.tv_sec,
 		get_dirty_log_total.tv_nsec, avg.tv_sec, avg.tv_nsec);
 
-#ifdef USE_CLEAR_DIRTY_LOG
-	avg = timespec_div(clear_dirty_log_total, iterations);
-	pr_info("Clear dirty log over %lu iterations took %ld.%.9lds. (Avg %ld.%.9lds/iteration)\n",
-		iterations, clear_dirty_log_total.tv_sec,
-		clear_dirty_log_total.tv_nsec, avg.tv_sec, avg.tv_nsec);
-#endif
+	if (p->manual_protect) {
+		avg = timespec_div(clear_dirty_log_total, iterations);
+		pr_info("Clear dirty log over %lu iterations took %ld.%.9lds. (Avg %ld.%.9lds/iteration)\n",
+			iterations, clear_dirty_log_total.tv_sec,
+			clear_dirty_log_total.tv_nsec, avg.tv_sec, avg.tv_nsec);
+	}
 
 	free(bmap);
 	free(vcpu_threads);
@@ -249,7 +296,8 @@ static void help(char *name)
 
 	puts("");
 	printf("usage: %s [-h] [-i iterations] [-p offset] "
-	       "[-m mode] [-b vcpu bytes] [-v vcpus]\n", name);
+	       "[-m mode] [-b vcpu bytes] [-v vcpus] [-s backing src] "
+	       "[-g] [-c chunk pages]\n", name);
 	puts("");
 	printf(" -i: specify iteration counts (default: %"PRIu64")\n",
 	       TEST_HOST_LOOP_N);
@@ -271,29 +319,28 @@ static void help(char *name)
 	       "     1/<fraction of pages to write>.\n"
 	       "     (default: 1 i.e. all pages are written to.)\n");
 	printf(" -v: specify the number of vCPUs to run.\n");
+	printf(" -s: specify the type of memory that should be used to\n"
+	       "     back the guest data region. (default: anonymous)\n");
+	backing_src_help();
+	printf(" -g: enable KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2 and clear the\n"
+	       "     dirty log with KVM_CLEAR_DIRTY_LOG after getting it.\n");
+	printf(" -c: specify the number of pages cleared by each\n"
+	       "     KVM_CLEAR_DIRTY_LOG, a multiple of 64. Implies -g.\n"
+	       "     (default: the whole memslot at once)\n");
 	puts("");
 	exit(0);
 }
 
 int main(int argc, char *argv[])
 {
-	unsigned long iterations = TEST_HOST_LOOP_N;
+	struct test_params p = {
+		.iterations = TEST_HOST_LOOP_N,
+		.wr_fract = 1,
+		.backing_src = VM_MEM_SRC_ANONYMOUS,
+	};
 	bool mode_selected = false;
-	uint64_t phys_offset = 0;
 	unsigned int mode;
 	int opt, i;
-	int wr_fract = 1;
-
-#ifdef USE_CLEAR_DIRTY_LOG
-	dirty_log_manual_caps =
-		kvm_check_cap(KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2);
-	if (!dirty_log_manual_caps) {
-		print_skip("KVM_CLEAR_DIRTY_LOG not available");
-		exit(KSFT_SKIP);
-	}
-	dirty_log_manual_caps &= (KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE |
-				  KVM_DIRTY_LOG_INITIALLY_SET);
-#endif
 
 #ifdef __x86_64__
 	guest_mode_init(VM_MODE_PXXV48_4K, true, true);
@@ -317,13 +364,13 @@ int main(int argc, char *argv[])
 	guest_mode_init(VM_MODE_P40V48_4K, true, true);
 #endif
 
-	while ((opt = getopt(argc, argv, "hi:p:m:b:f:v:")) != -1) {
+	while ((opt = getopt(argc, argv, "hi:p:m:b:f:v:s:gc:")) != -1) {
 		switch (opt) {
 		case 'i':
-			iterations = strtol(optarg, NULL, 10);
+			p.iterations = strtol(optarg, NULL, 10);
 			break;
 		case 'p':
-			phys_offset = strtoull(optarg, NULL, 0);
+			p.phys_offset = strtoull(optarg, NULL, 0);
 			break;
 		case 'm':
 			if (!mode_selected) {
@@ -340,8 +387,8 @@ int main(int argc, char *argv[])
 			guest_percpu_mem_size = parse_size(optarg);
 			break;
 		case 'f':
-			wr_fract = atoi(optarg);
-			TEST_ASSERT(wr_fract >= 1,
+			p.wr_fract = atoi(optarg);
+			TEST_ASSERT(p.wr_fract >= 1,
 				    "Write fraction cannot be less than one");
 			break;
 		case 'v':
@@ -352,6 +399,19 @@ int main(int argc, char *argv[])
 				    "This test does not currently support\n"
 				    "more than %d vCPUs.", MAX_VCPUS);
 			break;
+		case 's':
+			p.backing_src = parse_backing_src_type(optarg);
+			break;
+		case 'g':
+			p.manual_protect = true;
+			break;
+		case 'c':
+			p.manual_protect = true;
+			p.clear_chunk_pages = strtoull(optarg, NULL, 0);
+			TEST_ASSERT(p.clear_chunk_pages &&
+				    p.clear_chunk_pages % 64 == 0,
+				    "The clear chunk size must be a positive multiple of 64 pages");
+			break;
 		case 'h':
 		default:
 			help(argv[0]);
@@ -359,9 +419,20 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	TEST_ASSERT(iterations >= 2, "The test should have at least two iterations");
+	TEST_ASSERT(p.iterations >= 2, "The test should have at least two iterations");
+
+	if (p.manual_protect) {
+		dirty_log_manual_caps =
+			kvm_check_cap(KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2);
+		if (!dirty_log_manual_caps) {
+			print_skip("KVM_CLEAR_DIRTY_LOG not available");
+			exit(KSFT_SKIP);
+		}
+		dirty_log_manual_caps &= (KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE |
+					  KVM_DIRTY_LOG_INITIALLY_SET);
+	}
 
-	pr_info("Test iterations: %"PRIu64"\n",	iterations);
+	pr_info("Test iterations: %"PRIu64"\n",	p.iterations);
 
 	for (i = 0; i < NUM_VM_MODES; ++i) {
 		if (!guest_modes[i].enabled)
@@ -369,7 +440,7 @@ int main(int argc, char *argv[])
 		TEST_ASSERT(guest_modes[i].supported,
 			    "Guest mode ID %d (%s) not supported.",
 			    i, vm_guest_mode_string(i));
-		run_test(i, iterations, phys_offset, wr_fract);
+		run_test(i, &p);
 	}
 
 	return 0;
@@ -91,7 +91,8 @@ static void guest_code(uint32_t vcpu_id)
 }
 
 static struct kvm_vm *create_vm(enum vm_guest_mode mode, int vcpus,
-				uint64_t vcpu_memory_bytes)
+				uint64_t vcpu_memory_bytes,
+				enum vm_mem_backing_src_type backing_src)
 {
 	struct kvm_vm *vm;
 	uint64_t pages = DEFAULT_GUEST_PHY_PAGES;
@@ -147,6 +148,9 @@ static struct kvm_vm *create_vm(enum vm_guest_mode mode, int vcpus,
 			      perf_test_args.guest_page_size;
 	guest_test_phys_mem &= ~(perf_test_args.host_page_size - 1);
 
+	/* Align to the backing page size, so that KVM can map huge pages. */
+	guest_test_phys_mem &= ~(backing_src_page_size(backing_src) - 1);
+
 #ifdef __s390x__
 	/* Align to 1M (segment size) */
 	guest_test_phys_mem &= ~((1 << 20) - 1);
@@ -155,8 +159,7 @@ static struct kvm_vm *create_vm(enum vm_guest_mode mode, int vcpus,
 	pr_info("guest physical test memory offset: 0x%lx\n", guest_test_phys_mem);
 
 	/* Add an extra memory slot for testing */
-	vm_userspace_mem_region_add(vm, VM_MEM_SRC_ANONYMOUS,
-				    guest_test_phys_mem,
+	vm_userspace_mem_region_add(vm, backing_src, guest_test_phys_mem,
 				    TEST_MEM_SLOT_INDEX,
 				    guest_num_pages, 0);
 
@@ -67,4 +67,7 @@ struct timespec timespec_sub(struct timespec ts1, struct timespec ts2);
 struct timespec timespec_diff_now(struct timespec start);
 struct timespec timespec_div(struct timespec ts, int divisor);
 
+int cmp_u64(const void *a, const void *b);
+uint64_t percentile(const uint64_t *sorted, uint64_t nr, unsigned int pm);
+
 #endif /* SELFTEST_KVM_TEST_UTIL_H */
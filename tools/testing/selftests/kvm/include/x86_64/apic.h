@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * tools/testing/selftests/kvm/include/x86_64/apic.h
+ * Helpers for guest code that uses the local APIC in x2APIC mode
+ */
+
+#ifndef SELFTEST_KVM_APIC_H
+#define SELFTEST_KVM_APIC_H
+
+#include <stdint.h>
+#include "processor.h"
+
+/* Number of interrupts acknowledged by x2apic_ipi_handler() */
+extern volatile uint64_t x2apic_nr_ipis;
+
+static inline void x2apic_write(unsigned int reg, uint64_t value)
+{
+	wrmsr(APIC_BASE_MSR + (reg >> 4), value);
+}
+
+void x2apic_enable(void);
+void x2apic_ipi_handler(struct ex_regs *regs);
+
+#endif /* SELFTEST_KVM_APIC_H */
@@ -18,6 +18,10 @@
 #include <linux/kernel.h>
 
 #define KVM_UTIL_PGS_PER_HUGEPG 512
+
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB		(30 << MAP_HUGE_SHIFT)
+#endif
 #define KVM_UTIL_MIN_PFN	2
 
 /* Aligns x up to the next multiple of size. Size must be a power of 2. */
@@ -29,6 +33,44 @@ static void *align(void *x, size_t size)
 	return (void *) (((size_t) x + mask) & ~mask);
 }
 
+const struct vm_mem_backing_src_alias backing_src_aliases[] = {
+	{"anonymous", VM_MEM_SRC_ANONYMOUS, 0},
+	{"anonymous_thp", VM_MEM_SRC_ANONYMOUS_THP, 0x200000},
+	{"anonymous_hugetlb", VM_MEM_SRC_ANONYMOUS_HUGETLB, 0x200000},
+	{"anonymous_hugetlb_1gb", VM_MEM_SRC_ANONYMOUS_HUGETLB_1GB, 0x40000000},
+	{"shmem", VM_MEM_SRC_SHMEM, 0},
+};
+
+void backing_src_help(void)
+{
+	int i;
+
+	printf("Available backing src types:\n");
+	for (i = 0; i < NUM_VM_MEM_SRC_TYPES; i++)
+		printf("\t%s\n", backing_src_aliases[i].name);
+}
+
+enum vm_mem_backing_src_type parse_backing_src_type(const char *type_name)
+{
+	int i;
+
+	for (i = 0; i < NUM_VM_MEM_SRC_TYPES; i++)
+		if (!strcmp(type_name, backing_src_aliases[i].name))
+			return backing_src_aliases[i].type;
+
+	backing_src_help();
+	TEST_FAIL("Unknown backing src type: %s", type_name);
+	return -1;
+}
+
+size_t backing_src_page_size(enum vm_mem_backing_src_type type)
+{
+	TEST_ASSERT(type < NUM_VM_MEM_SRC_TYPES,
+		    "Unknown backing src type: %d", type);
+
+	return backing_src_aliases[type].page_size ? : getpagesize();
+}
+
 /*
  * Capability
  *
@@ -608,6 +650,7 @@ void vm_userspace_mem_region_add(struct kvm_vm *vm,
 	struct userspace_mem_region *region;
 	size_t huge_page_size = KVM_UTIL_PGS_PER_HUGEPG * vm->page_size;
 	size_t alignment;
+	int mmap_flags;
 
 	TEST_ASSERT(vm_adjust_num_guest_pages(vm->mode, npages) == npages,
 		"Number of guest pages is not compatible with the host. "
@@ -623,6 +666,11 @@ void vm_userspace_mem_region_add(struct kvm_vm *vm,
 		"  guest_paddr: 0x%lx npages: 0x%lx\n"
 		"  vm->max_gfn: 0x%lx vm->page_size: 0x%x",
 		guest_paddr, npages, vm->max_gfn, vm->page_size);
+	TEST_ASSERT((npages * vm->page_size) %
+		    backing_src_page_size(src_type) == 0,
+		    "Region size not a multiple of the backing page size,\n"
+		    "  npages: 0x%lx backing page size: 0x%lx",
+		    npages, backing_src_page_size(src_type));
 
 	/*
 	 * Confirm a mem region with an overlapping address doesn't
@@ -674,11 +722,24 @@ void vm_userspace_mem_region_add(struct kvm_vm *vm,
 	if (alignment > 1)
 		region->mmap_size += alignment;
 
+	switch (src_type) {
+	case VM_MEM_SRC_ANONYMOUS_HUGETLB:
+		mmap_flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+		break;
+	case VM_MEM_SRC_ANONYMOUS_HUGETLB_1GB:
+		mmap_flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+			     MAP_HUGE_1GB;
+		break;
+	case VM_MEM_SRC_SHMEM:
+		mmap_flags = MAP_SHARED | MAP_ANONYMOUS;
+		break;
+	default:
+		mmap_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+		break;
+	}
+
 	region->mmap_start = mmap(NULL, region->mmap_size,
-				  PROT_READ | PROT_WRITE,
-				  MAP_PRIVATE | MAP_ANONYMOUS
-				  | (src_type == VM_MEM_SRC_ANONYMOUS_HUGETLB ? MAP_HUGETLB : 0),
-				  -1, 0);
+				  PROT_READ | PROT_WRITE, mmap_flags, -1, 0);
 	TEST_ASSERT(region->mmap_start != MAP_FAILED,
 		    "test_malloc failed, mmap_start: %p errno: %i",
 		    region->mmap_start, errno);
@@ -1654,6 +1715,7 @@ static struct exit_reason {
 	{KVM_EXIT_INTERNAL_ERROR, "INTERNAL_ERROR"},
 	{KVM_EXIT_OSI, "OSI"},
 	{KVM_EXIT_PAPR_HCALL, "PAPR_HCALL"},
+	{KVM_EXIT_MEMORY_FAULT, "MEMORY_FAULT"},
 #ifdef KVM_EXIT_MEMORY_NOT_PRESENT
 	{KVM_EXIT_MEMORY_NOT_PRESENT, "MEMORY_NOT_PRESENT"},
 #endif
@@ -109,3 +109,20 @@ void print_skip(const char *fmt, ...)
 	va_end(ap);
 	puts(", skipping test");
 }
+
+/* qsort() comparator for arrays of uint64_t. */
+int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Returns the value at @pm per mille of the @nr values in @sorted, e.g.
+ * 999 for the 99.9th percentile and 1000 for the maximum.
+ */
+uint64_t percentile(const uint64_t *sorted, uint64_t nr, unsigned int pm)
+{
+	return sorted[(nr - 1) * pm / 1000];
+}
@@ -0,0 +1,24 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * tools/testing/selftests/kvm/lib/x86_64/apic.c
+ * Helpers for guest code that uses the local APIC in x2APIC mode
+ */
+
+#include "apic.h"
+
+volatile uint64_t x2apic_nr_ipis;
+
+/* Switch the local APIC of the running vCPU to x2APIC mode and enable it. */
+void x2apic_enable(void)
+{
+	wrmsr(MSR_IA32_APICBASE,
+	      rdmsr(MSR_IA32_APICBASE) | X2APIC_ENABLE | XAPIC_ENABLE);
+	x2apic_write(APIC_SPIV, APIC_SPIV_APIC_ENABLED | 0xff);
+}
+
+/* To be installed with vm_handle_exception() for fixed interrupt vectors. */
+void x2apic_ipi_handler(struct ex_regs *regs)
+{
+	x2apic_nr_ipis++;
+	x2apic_write(APIC_EOI, 0);
+}
@@ -0,0 +1,331 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * KVM memslot lookup and modification performance test
+ *
+ * Creates a number of memslots that the vCPUs write to at random, while a
+ * separate thread keeps deleting and re-adding them. Reports the guest access
+ * rate and the latency of the memslot updates.
+ */
+
+#define _GNU_SOURCE /* for program_invocation_name */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/compiler.h>
+
+#include "kvm_util.h"
+#include "processor.h"
+#include "test_util.h"
+
+#define MAX_VCPUS			64
+
+/* The first memslot used by the test; slot 0 holds the code and page tables */
+#define TEST_SLOT_FIRST			1
+
+/* Default guest virtual address of the test memslots */
+#define DEFAULT_GUEST_TEST_MEM		0xc0000000
+
+#define DEFAULT_NR_SLOTS		64
+#define DEFAULT_SLOT_SIZE		0x200000
+#define DEFAULT_DURATION_S		5
+
+/* How many accesses a vCPU makes between two updates of its counter */
+#define ACCESSES_PER_UPDATE		256
+
+struct test_params {
+	uint64_t gva;
+	uint64_t nr_slots;
+	uint64_t slot_pages;
+	uint64_t page_size;
+};
+
+static struct test_params params;
+
+/* Read by the host through their HVA, so that the vCPUs never have to exit. */
+static struct {
+	uint64_t accesses;
+	uint8_t pad[56];
+} guest_counters[MAX_VCPUS];
+static bool guest_quit;
+
+/* Host variables */
+static bool host_quit;
+static struct kvm_vm *vm;
+static uint64_t guest_test_phys_mem;
+static uint64_t mmio_exits[MAX_VCPUS];
+
+static void guest_code(uint32_t vcpu_id)
+{
+	uint64_t seed = 0x9e3779b97f4a7c15ull * (vcpu_id + 1);
+	uint64_t slot, page, i;
+
+	while (!READ_ONCE(guest_quit)) {
+		for (i = 0; i < ACCESSES_PER_UPDATE; i++) {
+			/* xorshift64 */
+			seed ^= seed << 13;
+			seed ^= seed >> 7;
+			seed ^= seed << 17;
+
+			slot = seed % params.nr_slots;
+			page = (seed >> 32) % params.slot_pages;
+
+			*(volatile uint64_t *)(params.gva +
+					       (slot * params.slot_pages + page) *
+					       params.page_size) = seed;
+		}
+
+		WRITE_ONCE(guest_counters[vcpu_id].accesses,
+			   guest_counters[vcpu_id].accesses +
+			   ACCESSES_PER_UPDATE);
+	}
+
+	GUEST_DONE();
+}
+
+static void *vcpu_worker(void *data)
+{
+	int vcpu_id = (long)data;
+	struct kvm_run *run;
+	struct ucall uc;
+	int ret;
+
+	vcpu_args_set(vm, vcpu_id, 1, vcpu_id);
+	run = vcpu_state(vm, vcpu_id);
+
+	for (;;) {
+		ret = _vcpu_run(vm, vcpu_id);
+		TEST_ASSERT(ret == 0, "vcpu_run failed: %d\n", ret);
+
+		/*
+		 * Accesses to a memslot that is being re-added exit to
+		 * userspace as MMIO. Drop them and re-enter the guest.
+		 */
+		if (run->exit_reason == KVM_EXIT_MMIO) {
+			mmio_exits[vcpu_id]++;
+			if (!run->mmio.is_write)
+				memset(run->mmio.data, 0, sizeof(run->mmio.data));
+			continue;
+		}
+
+		/*
+		 * get_ucall() walks the memory regions, which the memslot
+		 * thread modifies, so the guest only exits for good after
+		 * that thread is gone.
+		 */
+		TEST_ASSERT(get_ucall(vm, vcpu_id, &uc) == UCALL_DONE,
+			    "Unexpected exit: exit_reason=%s\n",
+			    exit_reason_str(run->exit_reason));
+		break;
+	}
+
+	return NULL;
+}
+
+struct update_stats {
+	uint64_t nr;
+	int64_t total_ns;
+	int64_t max_ns;
+};
+
+static void update_stats_add(struct update_stats *stats, struct timespec start)
+{
+	int64_t ns = timespec_to_ns(timespec_diff_now(start));
+
+	stats->nr++;
+	stats->total_ns += ns;
+	if (ns > stats->max_ns)
+		stats->max_ns = ns;
+}
+
+static struct update_stats delete_stats, add_stats;
+
+static void *memslot_worker(void *data)
+{
+	uint64_t slot_size = params.slot_pages * params.page_size;
+	uint64_t seed = 1, slot;
+	struct timespec start;
+
+	while (!READ_ONCE(host_quit)) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		slot = (seed >> 33) % params.nr_slots;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		vm_mem_region_delete(vm, TEST_SLOT_FIRST + slot);
+		update_stats_add(&delete_stats, start);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		vm_userspace_mem_region_add(vm, VM_MEM_SRC_ANONYMOUS,
+					    guest_test_phys_mem +
+					    slot * slot_size,
+					    TEST_SLOT_FIRST + slot,
+					    params.slot_pages, 0);
+		update_stats_add(&add_stats, start);
+	}
+
+	return NULL;
+}
+
+static void report_update_stats(const char *name, struct update_stats *stats)
+{
+	if (!stats->nr)
+		return;
+
+	pr_info("Memslot %s: %lu updates, avg %ld ns, max %ld ns\n", name,
+		stats->nr, stats->total_ns / (int64_t)stats->nr, stats->max_ns);
+}
+
+static void run_test(int nr_vcpus, uint64_t nr_slots, uint64_t slot_size,
+		     int duration)
+{
+	pthread_t vcpu_threads[MAX_VCPUS], memslot_thread;
+	uint64_t guest_num_pages, accesses = 0, exits = 0;
+	struct timespec start, ts_diff;
+	typeof(guest_counters[0]) *counters;
+	bool *quit;
+	uint64_t i;
+	int max_slots;
+	long vcpu_id;
+
+	max_slots = kvm_check_cap(KVM_CAP_NR_MEMSLOTS);
+	TEST_ASSERT(TEST_SLOT_FIRST + nr_slots <= max_slots,
+		    "KVM supports only %d memslots", max_slots);
+
+	/* Make room for the page tables that map the test memslots. */
+	vm = vm_create_default(0, nr_slots * slot_size / getpagesize(),
+			       guest_code);
+
+	params.page_size = vm_get_page_size(vm);
+	TEST_ASSERT(slot_size % params.page_size == 0 &&
+		    slot_size % getpagesize() == 0,
+		    "Memslot size is not page size aligned");
+	params.slot_pages = slot_size / params.page_size;
+	params.nr_slots = nr_slots;
+	params.gva = DEFAULT_GUEST_TEST_MEM;
+
+	guest_num_pages = nr_slots * params.slot_pages;
+	TEST_ASSERT(guest_num_pages < vm_get_max_gfn(vm),
+		    "Requested more guest memory than address space allows");
+
+	/* Keep the memslots 2MB aligned, so that they can use huge pages. */
+	guest_test_phys_mem = (vm_get_max_gfn(vm) - guest_num_pages) *
+			      params.page_size;
+	guest_test_phys_mem &= ~(0x200000ull - 1);
+
+	for (i = 0; i < nr_slots; i++)
+		vm_userspace_mem_region_add(vm, VM_MEM_SRC_ANONYMOUS,
+					    guest_test_phys_mem + i * slot_size,
+					    TEST_SLOT_FIRST + i,
+					    params.slot_pages, 0);
+
+	virt_map(vm, params.gva, guest_test_phys_mem, guest_num_pages, 0);
+
+	for (vcpu_id = 1; vcpu_id < nr_vcpus; vcpu_id++) {
+		vm_vcpu_add_default(vm, vcpu_id, guest_code);
+#ifdef __x86_64__
+		vcpu_set_cpuid(vm, vcpu_id, kvm_get_supported_cpuid());
+#endif
+	}
+
+	ucall_init(vm, NULL);
+	sync_global_to_guest(vm, params);
+
+	counters = addr_gva2hva(vm, (vm_vaddr_t)guest_counters);
+	quit = addr_gva2hva(vm, (vm_vaddr_t)&guest_quit);
+
+	pr_info("Testing %d vCPUs, %lu memslots of 0x%lx bytes for %ds\n",
+		nr_vcpus, nr_slots, slot_size, duration);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (vcpu_id = 0; vcpu_id < nr_vcpus; vcpu_id++)
+		pthread_create(&vcpu_threads[vcpu_id], NULL, vcpu_worker,
+			       (void *)vcpu_id);
+	pthread_create(&memslot_thread, NULL, memslot_worker, NULL);
+
+	sleep(duration);
+
+	WRITE_ONCE(host_quit, true);
+	pthread_join(memslot_thread, NULL);
+
+	for (vcpu_id = 0; vcpu_id < nr_vcpus; vcpu_id++)
+		accesses += READ_ONCE(counters[vcpu_id].accesses);
+	ts_diff = timespec_diff_now(start);
+
+	WRITE_ONCE(*quit, true);
+	for (vcpu_id = 0; vcpu_id < nr_vcpus; vcpu_id++) {
+		pthread_join(vcpu_threads[vcpu_id], NULL);
+		exits += mmio_exits[vcpu_id];
+	}
+
+	pr_info("Guest accesses: %lu in %ld.%.9lds (%lu/s), %lu MMIO exits\n",
+		accesses, ts_diff.tv_sec, ts_diff.tv_nsec,
+		(uint64_t)(accesses * 1000000000.0 / timespec_to_ns(ts_diff)),
+		exits);
+	report_update_stats("delete", &delete_stats);
+	report_update_stats("add", &add_stats);
+
+	ucall_uninit(vm);
+	kvm_vm_free(vm);
+}
+
+static void help(char *name)
+{
+	puts("");
+	printf("usage: %s [-h] [-v vcpus] [-s slots] [-b slot bytes] "
+	       "[-d seconds]\n", name);
+	puts("");
+	printf(" -v: specify the number of vCPUs to run (default: 1)\n");
+	printf(" -s: specify the number of memslots (default: %d)\n",
+	       DEFAULT_NR_SLOTS);
+	printf(" -b: specify the size of each memslot, e.g. 2M\n"
+	       "     (default: 2M)\n");
+	printf(" -d: specify the duration of the test in seconds "
+	       "(default: %d)\n", DEFAULT_DURATION_S);
+	puts("");
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t nr_slots = DEFAULT_NR_SLOTS;
+	uint64_t slot_size = DEFAULT_SLOT_SIZE;
+	int duration = DEFAULT_DURATION_S;
+	int nr_vcpus = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "hv:s:b:d:")) != -1) {
+		switch (opt) {
+		case 'v':
+			nr_vcpus = atoi(optarg);
+			TEST_ASSERT(nr_vcpus > 0 && nr_vcpus <= MAX_VCPUS,
+				    "Number of vCPUs must be between 1 and %d",
+				    MAX_VCPUS);
+			break;
+		case 's':
+			nr_slots = strtoull(optarg, NULL, 0);
+			TEST_ASSERT(nr_slots > 0,
+				    "Must have a positive number of memslots");
+			break;
+		case 'b':
+			slot_size = parse_size(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			TEST_ASSERT(duration > 0,
+				    "Duration must be positive");
+			break;
+		case 'h':
+		default:
+			help(argv[0]);
+			break;
+		}
+	}
+
+	run_test(nr_vcpus, nr_slots, slot_size, duration);
+
+	return 0;
+}
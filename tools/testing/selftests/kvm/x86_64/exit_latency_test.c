@@ -0,0 +1,352 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * exit_latency_test
+ *
+ * Measures, in TSC cycles, the round trip of the guest operations that exit
+ * to KVM or to userspace. Where an exit can be avoided or handled on a
+ * faster path (MSRs that are not intercepted, APIC virtualization,
+ * ioeventfd), both variants are measured, so that the numbers can be
+ * compared across hosts and kernel versions.
+ */
+
+#define _GNU_SOURCE /* for program_invocation_short_name */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+
+#include "test_util.h"
+#include "kvm_util.h"
+#include "processor.h"
+#include "apic.h"
+
+#define VCPU_ID			0
+#define WAKE_VCPU_ID		1
+
+#define IPI_VECTOR		0xa0
+#define WAKE_VECTOR		0xa1
+
+/* Not backed by any memslot, so that the accesses exit */
+#define TEST_MMIO_GPA		0xc0000000ul
+#define TEST_MMIO_EVENTFD_GPA	0xc0001000ul
+
+#define TEST_PIO_PORT		0xe0
+#define TEST_PIO_EVENTFD_PORT	0xe4
+
+#define DEFAULT_ITERATIONS	10000
+
+static uint64_t nr_iterations = DEFAULT_ITERATIONS;
+
+static volatile uint64_t nr_wakeups;
+static volatile bool wake_ready;
+static volatile bool guest_quit;
+
+static void wake_handler(struct ex_regs *regs)
+{
+	nr_wakeups++;
+	x2apic_write(APIC_EOI, 0);
+}
+
+static void do_cpuid(void)
+{
+	uint32_t eax = 0, ebx, ecx = 0, edx;
+
+	asm volatile("cpuid"
+		     : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+}
+
+static void do_vmcall(void)
+{
+	/* Unknown hypercalls fail with -KVM_ENOSYS, without side effects. */
+	kvm_hypercall(~0ul, 0, 0, 0, 0);
+}
+
+static void do_rdmsr_passthrough(void)
+{
+	rdmsr(MSR_KERNEL_GS_BASE);
+}
+
+static void do_rdmsr(void)
+{
+	rdmsr(MSR_IA32_APICBASE);
+}
+
+static void do_wrmsr(void)
+{
+	/* Writing back the current value is a nop for KVM. */
+	wrmsr(MSR_IA32_APICBASE, rdmsr(MSR_IA32_APICBASE));
+}
+
+static void do_wrmsr_tpr(void)
+{
+	/* The TPR accesses don't exit, with x2APIC virtualization. */
+	x2apic_write(APIC_TASKPRI, 0);
+}
+
+static void do_pio(void)
+{
+	outl(TEST_PIO_PORT, 0);
+}
+
+static void do_pio_eventfd(void)
+{
+	outl(TEST_PIO_EVENTFD_PORT, 0);
+}
+
+static void do_mmio(void)
+{
+	*(volatile uint32_t *)TEST_MMIO_GPA = 0;
+}
+
+static void do_mmio_eventfd(void)
+{
+	*(volatile uint32_t *)TEST_MMIO_EVENTFD_GPA = 0;
+}
+
+static void wait_for_ipi(uint64_t nr)
+{
+	/* Open an interrupt window, the IPI is pending by now. */
+	while (x2apic_nr_ipis == nr)
+		asm volatile("sti; nop; cli");
+}
+
+static void do_self_ipi_icr(void)
+{
+	uint64_t nr = x2apic_nr_ipis;
+
+	x2apic_write(APIC_ICR, APIC_DEST_SELF | APIC_DM_FIXED | IPI_VECTOR);
+	wait_for_ipi(nr);
+}
+
+static void do_self_ipi(void)
+{
+	uint64_t nr = x2apic_nr_ipis;
+
+	x2apic_write(APIC_SELF_IPI, IPI_VECTOR);
+	wait_for_ipi(nr);
+}
+
+static void do_hlt(void)
+{
+	uint64_t nr = x2apic_nr_ipis;
+
+	/* HLT exits, and KVM resumes the guest to deliver the pending IPI. */
+	x2apic_write(APIC_SELF_IPI, IPI_VECTOR);
+	asm volatile("sti; hlt; cli");
+	wait_for_ipi(nr);
+}
+
+static void do_ipi_wake(void)
+{
+	uint64_t nr = nr_wakeups;
+
+	x2apic_write(APIC_ICR, ((uint64_t)WAKE_VCPU_ID << 32) |
+		     APIC_DEST_PHYSICAL | APIC_DM_FIXED | WAKE_VECTOR);
+	while (nr_wakeups == nr)
+		asm volatile("pause");
+}
+
+static const struct exit_test {
+	const char *name;
+	void (*fn)(void);
+} exit_tests[] = {
+	{ "cpuid",			do_cpuid },
+	{ "vmcall",			do_vmcall },
+	{ "rdmsr (pass-through)",	do_rdmsr_passthrough },
+	{ "rdmsr (intercepted)",	do_rdmsr },
+	{ "wrmsr (intercepted)",	do_wrmsr },
+	{ "wrmsr (x2APIC TPR)",		do_wrmsr_tpr },
+	{ "pio (userspace)",		do_pio },
+	{ "pio (ioeventfd)",		do_pio_eventfd },
+	{ "mmio (userspace)",		do_mmio },
+	{ "mmio (ioeventfd)",		do_mmio_eventfd },
+	{ "self IPI (ICR)",		do_self_ipi_icr },
+	{ "self IPI (SELF_IPI)",	do_self_ipi },
+	{ "hlt (pending IPI)",		do_hlt },
+	{ "IPI to halted vCPU",		do_ipi_wake },
+};
+
+#define NR_EXIT_TESTS	ARRAY_SIZE(exit_tests)
+
+static struct {
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+} results[NR_EXIT_TESTS];
+
+static void measure(int test)
+{
+	uint64_t start, cycles;
+	int i;
+
+	/* Warm up the caches and the exit paths. */
+	for (i = 0; i < 16; i++)
+		exit_tests[test].fn();
+
+	results[test].min = ~0ull;
+	for (i = 0; i < nr_iterations; i++) {
+		start = rdtsc();
+		exit_tests[test].fn();
+		cycles = rdtsc() - start;
+
+		results[test].total += cycles;
+		if (cycles < results[test].min)
+			results[test].min = cycles;
+		if (cycles > results[test].max)
+			results[test].max = cycles;
+	}
+}
+
+static void guest_main(void)
+{
+	int i;
+
+	x2apic_enable();
+
+	while (!wake_ready)
+		asm volatile("pause");
+
+	for (i = 0; i < NR_EXIT_TESTS; i++)
+		measure(i);
+
+	guest_quit = true;
+	x2apic_write(APIC_ICR, ((uint64_t)WAKE_VCPU_ID << 32) |
+		     APIC_DEST_PHYSICAL | APIC_DM_FIXED | WAKE_VECTOR);
+
+	GUEST_DONE();
+}
+
+static void guest_wake(void)
+{
+	x2apic_enable();
+	wake_ready = true;
+
+	while (!guest_quit)
+		asm volatile("sti; hlt; cli");
+
+	GUEST_DONE();
+}
+
+static void run_vcpu(struct kvm_vm *vm, uint32_t vcpuid)
+{
+	struct kvm_run *run = vcpu_state(vm, vcpuid);
+	struct ucall uc;
+
+	for (;;) {
+		vcpu_run(vm, vcpuid);
+
+		if (run->exit_reason == KVM_EXIT_IO &&
+		    run->io.port == TEST_PIO_PORT)
+			continue;
+		if (run->exit_reason == KVM_EXIT_MMIO &&
+		    run->mmio.phys_addr == TEST_MMIO_GPA)
+			continue;
+
+		assert_on_unhandled_exception(vm, vcpuid);
+
+		switch (get_ucall(vm, vcpuid, &uc)) {
+		case UCALL_DONE:
+			return;
+		case UCALL_ABORT:
+			TEST_FAIL("%s at %s:%ld", (const char *)uc.args[0],
+				  __FILE__, uc.args[1]);
+		default:
+			TEST_FAIL("Unexpected exit: %s",
+				  exit_reason_str(run->exit_reason));
+		}
+	}
+}
+
+static void *wake_vcpu_thread(void *data)
+{
+	run_vcpu(data, WAKE_VCPU_ID);
+
+	return NULL;
+}
+
+static void add_ioeventfd(struct kvm_vm *vm, uint64_t addr, uint32_t len,
+			  uint32_t flags)
+{
+	struct kvm_ioeventfd ioeventfd = {
+		.addr = addr,
+		.len = len,
+		.flags = flags,
+	};
+
+	ioeventfd.fd = eventfd(0, EFD_NONBLOCK);
+	TEST_ASSERT(ioeventfd.fd >= 0, "eventfd failed, errno: %d", errno);
+
+	vm_ioctl(vm, KVM_IOEVENTFD, &ioeventfd);
+}
+
+static void help(char *name)
+{
+	puts("");
+	printf("usage: %s [-h] [-i iterations]\n", name);
+	puts("");
+	printf(" -i: specify the number of iterations of each exit\n"
+	       "     (default: %d)\n", DEFAULT_ITERATIONS);
+	puts("");
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t wake_thread;
+	struct kvm_vm *vm;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "hi:")) != -1) {
+		switch (opt) {
+		case 'i':
+			nr_iterations = strtoull(optarg, NULL, 0);
+			TEST_ASSERT(nr_iterations > 0,
+				    "Must have a positive number of iterations");
+			break;
+		case 'h':
+		default:
+			help(argv[0]);
+			break;
+		}
+	}
+
+	vm = vm_create_default(VCPU_ID, 0, guest_main);
+	vm_vcpu_add_default(vm, WAKE_VCPU_ID, guest_wake);
+	vcpu_set_cpuid(vm, WAKE_VCPU_ID, kvm_get_supported_cpuid());
+
+	vm_init_descriptor_tables(vm);
+	vcpu_init_descriptor_tables(vm, VCPU_ID);
+	vcpu_init_descriptor_tables(vm, WAKE_VCPU_ID);
+	vm_handle_exception(vm, IPI_VECTOR, x2apic_ipi_handler);
+	vm_handle_exception(vm, WAKE_VECTOR, wake_handler);
+
+	virt_pg_map(vm, TEST_MMIO_GPA, TEST_MMIO_GPA, 0);
+	virt_pg_map(vm, TEST_MMIO_EVENTFD_GPA, TEST_MMIO_EVENTFD_GPA, 0);
+
+	add_ioeventfd(vm, TEST_PIO_EVENTFD_PORT, 4, KVM_IOEVENTFD_FLAG_PIO);
+	/* Zero-length ioeventfds skip the instruction decoding. */
+	add_ioeventfd(vm, TEST_MMIO_EVENTFD_GPA,
+		      kvm_check_cap(KVM_CAP_IOEVENTFD_ANY_LENGTH) ? 0 : 4, 0);
+
+	sync_global_to_guest(vm, nr_iterations);
+
+	pthread_create(&wake_thread, NULL, wake_vcpu_thread, vm);
+	run_vcpu(vm, VCPU_ID);
+	pthread_join(wake_thread, NULL);
+
+	sync_global_from_guest(vm, results);
+
+	pr_info("%-24s %12s %12s %12s\n", "Exit", "Avg cycles", "Min cycles",
+		"Max cycles");
+	for (i = 0; i < NR_EXIT_TESTS; i++)
+		pr_info("%-24s %12lu %12lu %12lu\n", exit_tests[i].name,
+			results[i].total / nr_iterations, results[i].min,
+			results[i].max);
+
+	kvm_vm_free(vm);
+
+	return 0;
+}
@@ -0,0 +1,410 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * ipi_latency_test
+ *
+ * Measures the latency of IPIs to halted vCPUs, from the send to the
+ * acknowledgment by the target, either between pairs of vCPUs or from vCPU 0
+ * to all the others. The IPIs are sent through the x2APIC ICR, the KVM PV
+ * send IPI hypercall or the Hyper-V fast send IPI hypercall. The vCPU
+ * threads can be packed on fewer host CPUs to measure the latency under
+ * overcommit, where posted interrupts and directed yield matter.
+ */
+
+#define _GNU_SOURCE /* for program_invocation_short_name */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/kvm_para.h>
+
+#include "test_util.h"
+#include "kvm_util.h"
+#include "processor.h"
+#include "apic.h"
+
+/* The Hyper-V fast hypercall takes a 64-bit mask of VP indexes. */
+#define MAX_VCPUS		64
+
+#define IPI_VECTOR		0xa0
+
+#define SAMPLES_SLOT		1
+#define SAMPLES_GPA		0xc0000000ul
+
+#define DEFAULT_NR_VCPUS	4
+#define DEFAULT_NR_SAMPLES	10000
+#define NR_WARMUP		16
+
+#define HV_X64_MSR_GUEST_OS_ID	0x40000000
+#define HVCALL_SEND_IPI		0x000b
+#define HV_HYPERCALL_FAST_BIT	(1ul << 16)
+
+enum ipi_mode {
+	IPI_MODE_X2APIC,
+	IPI_MODE_PV,
+	IPI_MODE_HYPERV,
+	NR_IPI_MODES,
+};
+
+static const char * const ipi_mode_names[NR_IPI_MODES] = {
+	[IPI_MODE_X2APIC] = "x2apic",
+	[IPI_MODE_PV] = "pv",
+	[IPI_MODE_HYPERV] = "hyperv",
+};
+
+static struct {
+	enum ipi_mode mode;
+	bool broadcast;
+	int nr_vcpus;
+	uint64_t nr_samples;
+} params;
+
+static struct {
+	uint64_t acks;
+	uint8_t pad[56];
+} receivers[MAX_VCPUS];
+
+static int nr_ready;
+static int nr_done;
+static volatile bool guest_quit;
+
+static uint64_t hyperv_hypercall(uint64_t control, uint64_t input,
+				 uint64_t output)
+{
+	register uint64_t r8 asm("r8") = output;
+	uint64_t status;
+
+	asm volatile("vmcall"
+		     : "=a"(status)
+		     : "c"(control), "d"(input), "r"(r8)
+		     : "memory");
+
+	return status;
+}
+
+static void send_ipi(uint64_t mask)
+{
+	int dest;
+
+	switch (params.mode) {
+	case IPI_MODE_X2APIC:
+		if (params.broadcast) {
+			x2apic_write(APIC_ICR, APIC_DEST_ALLBUT | APIC_DM_FIXED |
+				     IPI_VECTOR);
+			break;
+		}
+		dest = __builtin_ctzll(mask);
+		x2apic_write(APIC_ICR, ((uint64_t)dest << 32) |
+			     APIC_DEST_PHYSICAL | APIC_DM_FIXED | IPI_VECTOR);
+		break;
+	case IPI_MODE_PV:
+		kvm_hypercall(KVM_HC_SEND_IPI, mask, 0, 0,
+			      APIC_DM_FIXED | IPI_VECTOR);
+		break;
+	case IPI_MODE_HYPERV:
+		hyperv_hypercall(HVCALL_SEND_IPI | HV_HYPERCALL_FAST_BIT,
+				 IPI_VECTOR, mask);
+		break;
+	default:
+		GUEST_ASSERT(0);
+	}
+}
+
+static void guest_sender(uint32_t vcpu_id, uint64_t *samples)
+{
+	uint64_t mask, start, i;
+	int dest;
+
+	if (params.broadcast)
+		mask = (~0ull >> (64 - params.nr_vcpus)) & ~1ull;
+	else
+		mask = 1ull << (vcpu_id + 1);
+
+	for (i = 0; i < NR_WARMUP + params.nr_samples; i++) {
+		start = rdtsc();
+		send_ipi(mask);
+
+		for (dest = 0; dest < params.nr_vcpus; dest++) {
+			if (!(mask & (1ull << dest)))
+				continue;
+
+			while (READ_ONCE(receivers[dest].acks) <= i)
+				asm volatile("pause");
+		}
+
+		if (i >= NR_WARMUP)
+			samples[i - NR_WARMUP] = rdtsc() - start;
+	}
+}
+
+static void guest_receiver(uint32_t vcpu_id)
+{
+	/* Interrupts are enabled only in HLT, no wakeup can be missed. */
+	while (!guest_quit) {
+		asm volatile("sti; hlt; cli");
+		WRITE_ONCE(receivers[vcpu_id].acks,
+			   receivers[vcpu_id].acks + 1);
+	}
+}
+
+static bool is_sender(uint32_t vcpu_id)
+{
+	if (params.broadcast)
+		return vcpu_id == 0;
+
+	return !(vcpu_id & 1) && vcpu_id + 1 < params.nr_vcpus;
+}
+
+static int nr_senders(void)
+{
+	return params.broadcast ? 1 : params.nr_vcpus / 2;
+}
+
+static void guest_code(uint32_t vcpu_id)
+{
+	uint64_t *samples = (uint64_t *)SAMPLES_GPA;
+
+	x2apic_enable();
+
+	__atomic_add_fetch(&nr_ready, 1, __ATOMIC_SEQ_CST);
+
+	if (!is_sender(vcpu_id)) {
+		guest_receiver(vcpu_id);
+		GUEST_DONE();
+	}
+
+	while (READ_ONCE(nr_ready) < params.nr_vcpus)
+		asm volatile("pause");
+
+	guest_sender(vcpu_id, samples +
+		     (params.broadcast ? 0 : vcpu_id / 2) * params.nr_samples);
+
+	__atomic_add_fetch(&nr_done, 1, __ATOMIC_SEQ_CST);
+
+	if (vcpu_id == 0) {
+		while (READ_ONCE(nr_done) < nr_senders())
+			asm volatile("pause");
+
+		/* Wake up the receivers to let them exit. */
+		guest_quit = true;
+		x2apic_write(APIC_ICR, APIC_DEST_ALLBUT | APIC_DM_FIXED |
+			     IPI_VECTOR);
+	}
+
+	GUEST_DONE();
+}
+
+static struct kvm_vm *vm;
+
+static void *vcpu_thread(void *data)
+{
+	uint32_t vcpu_id = (long)data;
+	struct ucall uc;
+
+	vcpu_args_set(vm, vcpu_id, 1, vcpu_id);
+	vcpu_run(vm, vcpu_id);
+	assert_on_unhandled_exception(vm, vcpu_id);
+
+	switch (get_ucall(vm, vcpu_id, &uc)) {
+	case UCALL_DONE:
+		break;
+	case UCALL_ABORT:
+		TEST_FAIL("%s at %s:%ld", (const char *)uc.args[0],
+			  __FILE__, uc.args[1]);
+	default:
+		TEST_FAIL("Unexpected exit: %s",
+			  exit_reason_str(vcpu_state(vm, vcpu_id)->exit_reason));
+	}
+
+	return NULL;
+}
+
+static void report_percentiles(uint64_t *samples, uint64_t nr,
+			       uint64_t tsc_khz)
+{
+	static const unsigned int permille[] = { 500, 900, 990, 999, 1000 };
+	static const char * const names[] = { "p50", "p90", "p99", "p99.9",
+					      "max" };
+	uint64_t cycles;
+	int i;
+
+	qsort(samples, nr, sizeof(*samples), cmp_u64);
+
+	for (i = 0; i < ARRAY_SIZE(permille); i++) {
+		cycles = percentile(samples, nr, permille[i]);
+		pr_info("%-6s %10lu cycles %10lu ns\n", names[i], cycles,
+			cycles * 1000000 / tsc_khz);
+	}
+}
+
+static void check_mode_support(enum ipi_mode mode)
+{
+	struct kvm_cpuid_entry2 *entry;
+
+	switch (mode) {
+	case IPI_MODE_PV:
+		entry = kvm_get_supported_cpuid_entry(KVM_CPUID_FEATURES);
+		if (!(entry->eax & (1u << KVM_FEATURE_PV_SEND_IPI))) {
+			print_skip("PV send IPI not supported");
+			exit(KSFT_SKIP);
+		}
+		break;
+	case IPI_MODE_HYPERV:
+		if (!kvm_check_cap(KVM_CAP_HYPERV_SEND_IPI)) {
+			print_skip("Hyper-V send IPI not supported");
+			exit(KSFT_SKIP);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static void help(char *name)
+{
+	int i;
+
+	puts("");
+	printf("usage: %s [-h] [-v vcpus] [-m mode] [-b] [-n samples] "
+	       "[-p host cpus]\n", name);
+	puts("");
+	printf(" -v: specify the number of vCPUs (default: %d, max: %d)\n",
+	       DEFAULT_NR_VCPUS, MAX_VCPUS);
+	printf(" -m: specify how IPIs are sent (default: x2apic):");
+	for (i = 0; i < NR_IPI_MODES; i++)
+		printf(" %s", ipi_mode_names[i]);
+	puts("");
+	printf(" -b: broadcast from vCPU 0 to all the other vCPUs, instead of\n"
+	       "     sending IPIs between pairs of vCPUs\n");
+	printf(" -n: specify the number of IPIs sent by each sender\n"
+	       "     (default: %d)\n", DEFAULT_NR_SAMPLES);
+	printf(" -p: run the vCPUs on that many host CPUs, to overcommit\n"
+	       "     them (default: don't pin the vCPUs)\n");
+	puts("");
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t threads[MAX_VCPUS];
+	uint64_t samples_pages, nr, tsc_khz, *samples;
+	int host_cpus[MAX_VCPUS], nr_host_cpus = 0;
+	cpu_set_t allowed, cpuset;
+	int opt, i, cpu;
+	long vcpu_id;
+
+	params.nr_vcpus = DEFAULT_NR_VCPUS;
+	params.nr_samples = DEFAULT_NR_SAMPLES;
+
+	while ((opt = getopt(argc, argv, "hv:m:bn:p:")) != -1) {
+		switch (opt) {
+		case 'v':
+			params.nr_vcpus = atoi(optarg);
+			TEST_ASSERT(params.nr_vcpus >= 2 &&
+				    params.nr_vcpus <= MAX_VCPUS,
+				    "Number of vCPUs must be between 2 and %d",
+				    MAX_VCPUS);
+			break;
+		case 'm':
+			for (i = 0; i < NR_IPI_MODES; i++)
+				if (!strcmp(optarg, ipi_mode_names[i]))
+					break;
+			TEST_ASSERT(i < NR_IPI_MODES, "Unknown mode %s", optarg);
+			params.mode = i;
+			break;
+		case 'b':
+			params.broadcast = true;
+			break;
+		case 'n':
+			params.nr_samples = strtoull(optarg, NULL, 0);
+			TEST_ASSERT(params.nr_samples > 0,
+				    "Must have a positive number of samples");
+			break;
+		case 'p':
+			nr_host_cpus = atoi(optarg);
+			TEST_ASSERT(nr_host_cpus > 0 &&
+				    nr_host_cpus <= MAX_VCPUS,
+				    "Number of host CPUs must be between 1 and %d",
+				    MAX_VCPUS);
+			break;
+		case 'h':
+		default:
+			help(argv[0]);
+			break;
+		}
+	}
+
+	check_mode_support(params.mode);
+
+	samples_pages = vm_calc_num_guest_pages(VM_MODE_DEFAULT,
+						nr_senders() *
+						params.nr_samples *
+						sizeof(uint64_t));
+
+	/* Only the page tables of the samples memslot go in the default one. */
+	vm = vm_create_default(0, samples_pages, guest_code);
+	for (vcpu_id = 1; vcpu_id < params.nr_vcpus; vcpu_id++) {
+		vm_vcpu_add_default(vm, vcpu_id, guest_code);
+		vcpu_set_cpuid(vm, vcpu_id, kvm_get_supported_cpuid());
+	}
+
+	vm_init_descriptor_tables(vm);
+	for (vcpu_id = 0; vcpu_id < params.nr_vcpus; vcpu_id++)
+		vcpu_init_descriptor_tables(vm, vcpu_id);
+	vm_handle_exception(vm, IPI_VECTOR, x2apic_ipi_handler);
+
+	vm_userspace_mem_region_add(vm, VM_MEM_SRC_ANONYMOUS, SAMPLES_GPA,
+				    SAMPLES_SLOT, samples_pages, 0);
+	virt_map(vm, SAMPLES_GPA, SAMPLES_GPA, samples_pages, 0);
+
+	/* Enables the Hyper-V hypercalls, VP indexes match the vCPU IDs. */
+	if (params.mode == IPI_MODE_HYPERV)
+		vcpu_set_msr(vm, 0, HV_X64_MSR_GUEST_OS_ID, 1);
+
+	sync_global_to_guest(vm, params);
+
+	tsc_khz = _vcpu_ioctl(vm, 0, KVM_GET_TSC_KHZ, NULL);
+	TEST_ASSERT(tsc_khz > 0, "KVM_GET_TSC_KHZ failed");
+
+	if (nr_host_cpus) {
+		TEST_ASSERT(!sched_getaffinity(0, sizeof(allowed), &allowed),
+			    "sched_getaffinity failed, errno: %d", errno);
+		TEST_ASSERT(nr_host_cpus <= CPU_COUNT(&allowed),
+			    "Only %d host CPUs available", CPU_COUNT(&allowed));
+
+		for (cpu = 0, i = 0; i < nr_host_cpus; cpu++)
+			if (CPU_ISSET(cpu, &allowed))
+				host_cpus[i++] = cpu;
+	}
+
+	pr_info("%d vCPUs, %s IPIs, %s, %s\n", params.nr_vcpus,
+		ipi_mode_names[params.mode],
+		params.broadcast ? "broadcast" : "pairs",
+		nr_host_cpus ? "pinned" : "not pinned");
+
+	for (vcpu_id = 0; vcpu_id < params.nr_vcpus; vcpu_id++) {
+		pthread_create(&threads[vcpu_id], NULL, vcpu_thread,
+			       (void *)vcpu_id);
+		if (!nr_host_cpus)
+			continue;
+
+		CPU_ZERO(&cpuset);
+		CPU_SET(host_cpus[vcpu_id % nr_host_cpus], &cpuset);
+		pthread_setaffinity_np(threads[vcpu_id], sizeof(cpuset),
+				       &cpuset);
+	}
+
+	for (vcpu_id = 0; vcpu_id < params.nr_vcpus; vcpu_id++)
+		pthread_join(threads[vcpu_id], NULL);
+
+	nr = nr_senders() * params.nr_samples;
+	samples = addr_gva2hva(vm, SAMPLES_GPA);
+	pr_info("%lu IPIs\n", nr);
+	report_percentiles(samples, nr, tsc_khz);
+
+	kvm_vm_free(vm);
+
+	return 0;
+}
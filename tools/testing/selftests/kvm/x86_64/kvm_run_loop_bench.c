@@ -0,0 +1,234 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * kvm_run_loop_bench
+ *
+ * Measures, in TSC cycles, tight loops of the guest operations that exit to
+ * KVM (VMCALL, CPUID, HLT) and of the round trip through KVM_RUN to
+ * userspace, and reports the percentiles of the per-iteration cycles.  The
+ * guest code is the same on VMX and SVM, so the numbers of both backends
+ * can be compared, and so can the numbers of two kernels on the same host.
+ */
+
+#define _GNU_SOURCE /* for program_invocation_short_name */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include "test_util.h"
+#include "kvm_util.h"
+#include "processor.h"
+#include "apic.h"
+
+#define VCPU_ID			0
+
+#define PAGE_SIZE		4096
+
+#define IPI_VECTOR		0xa0
+
+/* The per-iteration cycles, in their own memslot. */
+#define SAMPLES_SLOT		1
+#define SAMPLES_GPA		0xc0000000ul
+
+#define TEST_PIO_PORT		0xe0
+
+#define NR_WARMUP		16
+#define DEFAULT_ITERATIONS	100000
+
+static uint64_t nr_iterations = DEFAULT_ITERATIONS;
+
+static uint64_t * const samples = (uint64_t *)SAMPLES_GPA;
+
+static void do_vmcall(void)
+{
+	/* Unknown hypercalls fail with -KVM_ENOSYS, without side effects. */
+	kvm_hypercall(~0ul, 0, 0, 0, 0);
+}
+
+static void do_cpuid(void)
+{
+	uint32_t eax = 0, ebx, ecx = 0, edx;
+
+	asm volatile("cpuid"
+		     : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+}
+
+static void do_hlt(void)
+{
+	uint64_t nr = x2apic_nr_ipis;
+
+	/* HLT exits, and KVM resumes the guest to deliver the pending IPI. */
+	x2apic_write(APIC_SELF_IPI, IPI_VECTOR);
+	asm volatile("sti; hlt; cli");
+	while (x2apic_nr_ipis == nr)
+		asm volatile("sti; nop; cli");
+}
+
+static const struct guest_test {
+	const char *name;
+	void (*fn)(void);
+} guest_tests[] = {
+	{ "vmcall",		do_vmcall },
+	{ "cpuid",		do_cpuid },
+	{ "hlt (pending IPI)",	do_hlt },
+};
+
+#define NR_GUEST_TESTS	ARRAY_SIZE(guest_tests)
+
+static void guest_main(void)
+{
+	uint64_t start;
+	int test, i;
+
+	x2apic_enable();
+
+	for (test = 0; test < NR_GUEST_TESTS; test++) {
+		/* Warm up the caches and the exit paths. */
+		for (i = 0; i < NR_WARMUP; i++)
+			guest_tests[test].fn();
+
+		for (i = 0; i < nr_iterations; i++) {
+			start = rdtsc();
+			guest_tests[test].fn();
+			samples[i] = rdtsc() - start;
+		}
+
+		GUEST_SYNC(test);
+	}
+
+	/* The KVM_RUN round trips are timed by userspace. */
+	for (i = 0; i < NR_WARMUP + nr_iterations; i++)
+		outl(TEST_PIO_PORT, 0);
+
+	GUEST_DONE();
+}
+
+static void report(const char *name, uint64_t *cycles)
+{
+	qsort(cycles, nr_iterations, sizeof(*cycles), cmp_u64);
+
+	pr_info("%-20s %8lu %8lu %8lu %8lu %8lu %8lu\n", name, cycles[0],
+		percentile(cycles, nr_iterations, 500),
+		percentile(cycles, nr_iterations, 900),
+		percentile(cycles, nr_iterations, 990),
+		percentile(cycles, nr_iterations, 999),
+		cycles[nr_iterations - 1]);
+}
+
+static void run_guest_tests(struct kvm_vm *vm, uint64_t *cycles)
+{
+	struct kvm_run *run = vcpu_state(vm, VCPU_ID);
+	struct ucall uc;
+	int test;
+
+	for (test = 0; test < NR_GUEST_TESTS; test++) {
+		vcpu_run(vm, VCPU_ID);
+		assert_on_unhandled_exception(vm, VCPU_ID);
+
+		switch (get_ucall(vm, VCPU_ID, &uc)) {
+		case UCALL_SYNC:
+			TEST_ASSERT(uc.args[1] == test,
+				    "Unexpected stage %ld", uc.args[1]);
+			report(guest_tests[test].name, cycles);
+			break;
+		case UCALL_ABORT:
+			TEST_FAIL("%s at %s:%ld", (const char *)uc.args[0],
+				  __FILE__, uc.args[1]);
+		default:
+			TEST_FAIL("Unexpected exit: %s",
+				  exit_reason_str(run->exit_reason));
+		}
+	}
+}
+
+static void run_round_trips(struct kvm_vm *vm, uint64_t *cycles)
+{
+	struct kvm_run *run = vcpu_state(vm, VCPU_ID);
+	uint64_t start, delta;
+	struct ucall uc;
+	int i;
+
+	for (i = 0; i < NR_WARMUP + nr_iterations; i++) {
+		start = rdtsc();
+		vcpu_run(vm, VCPU_ID);
+		delta = rdtsc() - start;
+
+		TEST_ASSERT(run->exit_reason == KVM_EXIT_IO &&
+			    run->io.port == TEST_PIO_PORT,
+			    "Unexpected exit: %s",
+			    exit_reason_str(run->exit_reason));
+
+		if (i >= NR_WARMUP)
+			cycles[i - NR_WARMUP] = delta;
+	}
+
+	report("KVM_RUN round trip", cycles);
+
+	vcpu_run(vm, VCPU_ID);
+	TEST_ASSERT(get_ucall(vm, VCPU_ID, &uc) == UCALL_DONE,
+		    "Unexpected exit: %s", exit_reason_str(run->exit_reason));
+}
+
+static void help(char *name)
+{
+	puts("");
+	printf("usage: %s [-h] [-i iterations]\n", name);
+	puts("");
+	printf(" -i: specify the number of iterations of each loop\n"
+	       "     (default: %d)\n", DEFAULT_ITERATIONS);
+	puts("");
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t npages, *cycles;
+	struct kvm_vm *vm;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "hi:")) != -1) {
+		switch (opt) {
+		case 'i':
+			nr_iterations = strtoull(optarg, NULL, 0);
+			TEST_ASSERT(nr_iterations > 0,
+				    "Must have a positive number of iterations");
+			break;
+		case 'h':
+		default:
+			help(argv[0]);
+			break;
+		}
+	}
+
+	npages = DIV_ROUND_UP(nr_iterations * sizeof(uint64_t), PAGE_SIZE);
+
+	/*
+	 * The samples get their own memslot, vm_create_default() only adds
+	 * the page tables needed to map npages more to the default memslot.
+	 */
+	vm = vm_create_default(VCPU_ID, npages, guest_main);
+
+	vm_init_descriptor_tables(vm);
+	vcpu_init_descriptor_tables(vm, VCPU_ID);
+	vm_handle_exception(vm, IPI_VECTOR, x2apic_ipi_handler);
+
+	vm_userspace_mem_region_add(vm, VM_MEM_SRC_ANONYMOUS, SAMPLES_GPA,
+				    SAMPLES_SLOT, npages, 0);
+	virt_map(vm, SAMPLES_GPA, SAMPLES_GPA, npages, 0);
+	cycles = addr_gpa2hva(vm, SAMPLES_GPA);
+
+	sync_global_to_guest(vm, nr_iterations);
+
+	pr_info("Backend: %s, %lu iterations\n",
+		is_intel_cpu() ? "VMX" : "SVM", nr_iterations);
+	pr_info("%-20s %8s %8s %8s %8s %8s %8s\n", "Loop (TSC cycles)", "min",
+		"p50", "p90", "p99", "p99.9", "max");
+
+	run_guest_tests(vm, cycles);
+	run_round_trips(vm, cycles);
+
+	kvm_vm_free(vm);
+
+	return 0;
+}
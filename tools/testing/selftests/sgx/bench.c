@@ -0,0 +1,248 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  Copyright(c) 2021 Intel Corporation. */
+
+/*
+ * EPC oversubscription benchmark. Builds enclaves totaling a multiple of the
+ * physical EPC, and reports the EINIT rate, the throughput of the reclaimer
+ * through /sys/kernel/mm/sgx/reclaim, and the latency of the faults on the
+ * evicted pages, one "key=value" pair per line.
+ *
+ * Usage: sgx_bench [oversubscription factor, 2 by default]
+ */
+
+#include <cpuid.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include "defines.h"
+#include "main.h"
+#include "../kselftest.h"
+
+/* Enclaves per physical EPC. */
+#define ENCLS_PER_EPC		4
+/* Upper bound for the number of fault latency samples. */
+#define MAX_SAMPLES		(1UL << 20)
+
+static const char *reclaim_path = "/sys/kernel/mm/sgx/reclaim";
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t sgx_epc_size(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	uint64_t size = 0;
+	int i;
+
+	if (__get_cpuid_max(0, NULL) < SGX_CPUID)
+		return 0;
+
+	for (i = SGX_CPUID_EPC; ; i++) {
+		__cpuid_count(SGX_CPUID, i, eax, ebx, ecx, edx);
+		if ((eax & SGX_CPUID_EPC_MASK) != SGX_CPUID_EPC_SECTION)
+			break;
+
+		size += (ecx & 0xfffff000) + ((uint64_t)(edx & 0xfffff) << 32);
+	}
+
+	return size;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report_percentiles(const char *name, uint64_t *samples,
+			       unsigned long nr)
+{
+	static const unsigned int permille[] = { 500, 900, 990, 999 };
+	static const char * const suffix[] = { "p50", "p90", "p99", "p999" };
+	unsigned int i;
+
+	if (!nr)
+		return;
+
+	qsort(samples, nr, sizeof(*samples), cmp_u64);
+
+	for (i = 0; i < sizeof(permille) / sizeof(permille[0]); i++)
+		printf("%s_%s_ns=%lu\n", name, suffix[i],
+		       samples[(nr - 1) * permille[i] / 1000]);
+	printf("%s_max_ns=%lu\n", name, samples[nr - 1]);
+}
+
+static bool encl_map(struct encl *encl)
+{
+	unsigned int i;
+	void *addr;
+
+	for (i = 0; i < encl->nr_segments; i++) {
+		struct encl_segment *seg = &encl->segment_tbl[i];
+
+		addr = mmap((void *)encl->encl_base + seg->offset, seg->size,
+			    seg->prot, MAP_SHARED | MAP_FIXED, encl->fd, 0);
+		if (addr == MAP_FAILED) {
+			fprintf(stderr, "mmap() failed, errno=%d.\n", errno);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Returns the time it took the kernel to reclaim @nr_pages, or 0 on failure. */
+static uint64_t reclaim(unsigned long nr_pages)
+{
+	char buf[32];
+	uint64_t start;
+	int fd, len;
+	ssize_t ret;
+
+	fd = open(reclaim_path, O_WRONLY);
+	if (fd < 0)
+		return 0;
+
+	len = snprintf(buf, sizeof(buf), "%lu", nr_pages);
+	start = now_ns();
+	ret = write(fd, buf, len);
+	close(fd);
+
+	return ret == len ? now_ns() - start : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t epc_size, encl_size, heap_size, start, end, t;
+	uint64_t *einit_ns, *fault_ns, build_ns = 0, einit_total = 0;
+	unsigned long nr_encls, nr_pages, nr_samples, stride, page, i;
+	struct encl tmpl, *encls;
+	unsigned int factor = 2;
+	volatile char *p;
+
+	if (argc > 1)
+		factor = strtoul(argv[1], NULL, 0);
+	if (factor < 1 || factor > 8)
+		ksft_exit_fail_msg("invalid oversubscription factor %u\n",
+				   factor);
+
+	epc_size = sgx_epc_size();
+	if (!epc_size)
+		ksft_exit_skip("no EPC\n");
+
+	/* Enclave sizes are powers of two, so the heap fills one to the top. */
+	for (encl_size = PAGE_SIZE; encl_size * 2 <= epc_size / ENCLS_PER_EPC; )
+		encl_size <<= 1;
+
+	if (!encl_load("test_encl.elf", &tmpl, 0)) {
+		encl_delete(&tmpl);
+		ksft_exit_skip("cannot load enclaves\n");
+	}
+	if (tmpl.src_size >= encl_size / 2)
+		ksft_exit_skip("EPC too small\n");
+	heap_size = encl_size - tmpl.src_size;
+	encl_delete(&tmpl);
+
+	/* All the enclaves have the same measurement, sign it only once. */
+	if (!encl_load("test_encl.elf", &tmpl, heap_size) ||
+	    !encl_measure(&tmpl))
+		ksft_exit_fail_msg("cannot measure the enclave\n");
+
+	nr_encls = (factor * epc_size + encl_size - 1) / encl_size;
+	nr_pages = nr_encls * (heap_size / PAGE_SIZE);
+
+	encls = calloc(nr_encls, sizeof(*encls));
+	einit_ns = calloc(nr_encls, sizeof(*einit_ns));
+	nr_samples = nr_pages < MAX_SAMPLES ? nr_pages : MAX_SAMPLES;
+	fault_ns = calloc(nr_samples, sizeof(*fault_ns));
+	if (!encls || !einit_ns || !fault_ns)
+		ksft_exit_fail_msg("out of memory\n");
+
+	printf("epc_bytes=%lu\n", epc_size);
+	printf("factor=%u\n", factor);
+	printf("enclaves=%lu\n", nr_encls);
+	printf("enclave_bytes=%lu\n", encl_size);
+
+	for (i = 0; i < nr_encls; i++) {
+		if (!encl_load("test_encl.elf", &encls[i], heap_size))
+			ksft_exit_fail_msg("cannot load enclave %lu\n", i);
+		memcpy(&encls[i].sigstruct, &tmpl.sigstruct,
+		       sizeof(tmpl.sigstruct));
+
+		start = now_ns();
+		if (!encl_create(&encls[i]))
+			ksft_exit_fail_msg("cannot create enclave %lu\n", i);
+		end = now_ns();
+		if (!encl_init(&encls[i]))
+			ksft_exit_fail_msg("cannot initialize enclave %lu\n", i);
+		t = now_ns();
+
+		build_ns += end - start;
+		einit_ns[i] = t - end;
+		einit_total += t - end;
+
+		if (!encl_map(&encls[i]))
+			ksft_exit_fail_msg("cannot map enclave %lu\n", i);
+	}
+
+	printf("build_pages_per_sec=%lu\n",
+	       build_ns ? nr_pages * 1000000000UL / build_ns : 0);
+	printf("einit_per_sec=%lu\n",
+	       einit_total ? nr_encls * 1000000000UL / einit_total : 0);
+	report_percentiles("einit", einit_ns, nr_encls);
+
+	/* Reclaim half of the EPC, which has to be full by now. */
+	t = reclaim(epc_size / PAGE_SIZE / 2);
+	if (t)
+		printf("reclaim_pages_per_sec=%lu\n",
+		       epc_size / PAGE_SIZE / 2 * 1000000000UL / t);
+	else
+		printf("reclaim_pages_per_sec=unavailable\n");
+
+	/*
+	 * Fault in the heaps, evicted for the most part. The faults load the
+	 * pages with ELDU, and reclaim others when the EPC is full. Reading
+	 * enclave memory from outside the enclave does not return its contents,
+	 * but it faults in the page all the same.
+	 */
+	stride = nr_pages / nr_samples;
+	for (i = 0, page = 0; i < nr_samples; i++, page += stride) {
+		struct encl *encl = &encls[page / (heap_size / PAGE_SIZE)];
+		struct encl_segment *heap =
+			&encl->segment_tbl[encl->nr_segments - 1];
+
+		p = (void *)encl->encl_base + heap->offset +
+		    (page % (heap_size / PAGE_SIZE)) * PAGE_SIZE;
+
+		start = now_ns();
+		(void)*p;
+		fault_ns[i] = now_ns() - start;
+	}
+
+	printf("fault_samples=%lu\n", nr_samples);
+	report_percentiles("fault", fault_ns, nr_samples);
+
+	for (i = 0; i < nr_encls; i++)
+		encl_delete(&encls[i]);
+	encl_delete(&tmpl);
+	free(fault_ns);
+	free(einit_ns);
+	free(encls);
+
+	exit(KSFT_PASS);
+}
@@ -27,6 +27,9 @@ void encl_delete(struct encl *encl)
 	if (encl->bin)
 		munmap(encl->bin, encl->bin_size);
 
+	if (encl->heap)
+		munmap(encl->heap, encl->heap_size);
+
 	if (encl->fd)
 		close(encl->fd);
 
@@ -103,28 +106,39 @@ static bool encl_ioc_add_pages(struct encl *encl, struct encl_segment *seg)
 {
 	struct sgx_enclave_add_pages ioc;
 	struct sgx_secinfo secinfo;
+	size_t done = 0;
 	int rc;
 
 	memset(&secinfo, 0, sizeof(secinfo));
 	secinfo.flags = seg->flags;
 
-	ioc.src = (uint64_t)encl->src + seg->offset;
-	ioc.offset = seg->offset;
-	ioc.length = seg->size;
-	ioc.secinfo = (unsigned long)&secinfo;
-	ioc.flags = SGX_PAGE_MEASURE;
+	/* A pending signal can cut a large segment short, add the rest. */
+	while (done < seg->size) {
+		ioc.src = (uint64_t)seg->src + done;
+		ioc.offset = seg->offset + done;
+		ioc.length = seg->size - done;
+		ioc.secinfo = (unsigned long)&secinfo;
+		ioc.flags = seg->measure ? SGX_PAGE_MEASURE : 0;
+		ioc.count = 0;
+
+		rc = ioctl(encl->fd, SGX_IOC_ENCLAVE_ADD_PAGES, &ioc);
+		if (rc < 0 && errno != EINTR) {
+			fprintf(stderr, "SGX_IOC_ENCLAVE_ADD_PAGES failed: errno=%d.\n",
+				errno);
+			return false;
+		}
 
-	rc = ioctl(encl->fd, SGX_IOC_ENCLAVE_ADD_PAGES, &ioc);
-	if (rc < 0) {
-		fprintf(stderr, "SGX_IOC_ENCLAVE_ADD_PAGES failed: errno=%d.\n",
-			errno);
-		return false;
+		done += ioc.count;
 	}
 
 	return true;
 }
 
-bool encl_load(const char *path, struct encl *encl)
+/*
+ * Load the enclave image at @path. A non-zero @heap_size appends a segment of
+ * zeroed, read-write pages of that size, which are not measured with EEXTEND.
+ */
+bool encl_load(const char *path, struct encl *encl, size_t heap_size)
 {
 	Elf64_Phdr *phdr_tbl;
 	off_t src_offset;
@@ -155,6 +169,9 @@ bool encl_load(const char *path, struct encl *encl)
 			encl->nr_segments++;
 	}
 
+	if (heap_size)
+		encl->nr_segments++;
+
 	encl->segment_tbl = calloc(encl->nr_segments,
 				   sizeof(struct encl_segment));
 	if (!encl->segment_tbl)
@@ -198,6 +215,7 @@ bool encl_load(const char *path, struct encl *encl)
 
 		seg->offset = (phdr->p_offset & PAGE_MASK) - src_offset;
 		seg->size = (phdr->p_filesz + PAGE_SIZE - 1) & PAGE_MASK;
+		seg->measure = true;
 
 		printf("0x%016lx 0x%016lx 0x%02x\n", seg->offset, seg->size,
 		       seg->prot);
@@ -205,9 +223,37 @@ bool encl_load(const char *path, struct encl *encl)
 		j++;
 	}
 
+	encl->src = encl->bin + src_offset;
+
+	for (i = 0; i < j; i++)
+		encl->segment_tbl[i].src = encl->src +
+					   encl->segment_tbl[i].offset;
+
+	if (heap_size) {
+		struct encl_segment *seg = &encl->segment_tbl[j];
+
+		heap_size = (heap_size + PAGE_SIZE - 1) & PAGE_MASK;
+		encl->heap = mmap(NULL, heap_size, PROT_READ,
+				  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (encl->heap == MAP_FAILED) {
+			encl->heap = NULL;
+			perror("mmap()");
+			goto err;
+		}
+		encl->heap_size = heap_size;
+
+		seg->src = encl->heap;
+		seg->offset = encl->segment_tbl[j - 1].offset +
+			      encl->segment_tbl[j - 1].size;
+		seg->size = heap_size;
+		seg->prot = PROT_READ | PROT_WRITE;
+		seg->flags = (SGX_PAGE_TYPE_REG << 8) | seg->prot;
+		seg->measure = false;
+		j++;
+	}
+
 	assert(j == encl->nr_segments);
 
-	encl->src = encl->bin + src_offset;
 	encl->src_size = encl->segment_tbl[j - 1].offset +
 			 encl->segment_tbl[j - 1].size;
 
@@ -242,10 +288,9 @@ static bool encl_map_area(struct encl *encl)
 	return true;
 }
 
-bool encl_build(struct encl *encl)
+/* Create the enclave and add its pages. */
+bool encl_create(struct encl *encl)
 {
-	struct sgx_enclave_init ioc;
-	int ret;
 	int i;
 
 	if (!encl_map_area(encl))
@@ -265,6 +310,14 @@ bool encl_build(struct encl *encl)
 			return false;
 	}
 
+	return true;
+}
+
+bool encl_init(struct encl *encl)
+{
+	struct sgx_enclave_init ioc;
+	int ret;
+
 	ioc.sigstruct = (uint64_t)&encl->sigstruct;
 	ret = ioctl(encl->fd, SGX_IOC_ENCLAVE_INIT, &ioc);
 	if (ret) {
@@ -275,3 +328,8 @@ bool encl_build(struct encl *encl)
 
 	return true;
 }
+
+bool encl_build(struct encl *encl)
+{
+	return encl_create(encl) && encl_init(encl);
+}
@@ -175,7 +175,7 @@ int main(int argc, char *argv[], char *envp[])
 
 	memset(&run, 0, sizeof(run));
 
-	if (!encl_load("test_encl.elf", &encl)) {
+	if (!encl_load("test_encl.elf", &encl, 0)) {
 		encl_delete(&encl);
 		ksft_exit_skip("cannot load enclaves\n");
 	}
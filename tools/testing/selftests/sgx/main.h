@@ -7,10 +7,12 @@
 #define MAIN_H
 
 struct encl_segment {
+	void *src;
 	off_t offset;
 	size_t size;
 	unsigned int prot;
 	unsigned int flags;
+	bool measure;
 };
 
 struct encl {
@@ -19,6 +21,8 @@ struct encl {
 	off_t bin_size;
 	void *src;
 	size_t src_size;
+	void *heap;
+	size_t heap_size;
 	size_t encl_size;
 	off_t encl_base;
 	unsigned int nr_segments;
@@ -28,8 +32,10 @@ struct encl {
 };
 
 void encl_delete(struct encl *ctx);
-bool encl_load(const char *path, struct encl *encl);
+bool encl_load(const char *path, struct encl *encl, size_t heap_size);
 bool encl_measure(struct encl *encl);
+bool encl_create(struct encl *encl);
+bool encl_init(struct encl *encl);
 bool encl_build(struct encl *encl);
 
 int sgx_call_vdso(void *rdi, void *rsi, long rdx, u32 function, void *r8, void *r9,
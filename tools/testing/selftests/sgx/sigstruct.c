@@ -305,7 +305,11 @@ static bool mrenclave_segment(EVP_MD_CTX *ctx, struct encl *encl,
 		if (!mrenclave_eadd(ctx, offset, seg->flags))
 			return false;
 
-		if (!mrenclave_eextend(ctx, offset, encl->src + offset))
+		if (!seg->measure)
+			continue;
+
+		if (!mrenclave_eextend(ctx, offset,
+				       seg->src + (offset - seg->offset)))
 			return false;
 	}
 
@@ -18,6 +18,15 @@
 #include <trace/events/kvm.h>
 
 static struct kmem_cache *async_pf_cache;
+static struct workqueue_struct *async_pf_wq;
+
+/*
+ * Maximum number of async page faults a VM can have in flight.  Further
+ * faults are handled synchronously, so that a VM that is being swapped out
+ * can't flood the workqueue with GUP requests.
+ */
+static unsigned int async_pf_per_vm = 256;
+module_param(async_pf_per_vm, uint, 0644);
 
 int kvm_async_pf_init(void)
 {
@@ -26,11 +35,20 @@ int kvm_async_pf_init(void)
 	if (!async_pf_cache)
 		return -ENOMEM;
 
+	async_pf_wq = alloc_workqueue("kvm-async-pf", WQ_UNBOUND, 0);
+	if (!async_pf_wq) {
+		kmem_cache_destroy(async_pf_cache);
+		async_pf_cache = NULL;
+		return -ENOMEM;
+	}
+
 	return 0;
 }
 
 void kvm_async_pf_deinit(void)
 {
+	destroy_workqueue(async_pf_wq);
+	async_pf_wq = NULL;
 	kmem_cache_destroy(async_pf_cache);
 	async_pf_cache = NULL;
 }
@@ -88,6 +106,7 @@ static void async_pf_execute(struct work_struct *work)
 	rcuwait_wake_up(&vcpu->wait);
 
 	mmput(mm);
+	atomic_dec(&vcpu->kvm->async_pf_inflight);
 	kvm_put_kvm(vcpu->kvm);
 }
 
@@ -115,6 +134,7 @@ void kvm_clear_async_pf_completion_queue(struct kvm_vcpu *vcpu)
 #else
 		if (cancel_work_sync(&work->work)) {
 			mmput(work->mm);
+			atomic_dec(&vcpu->kvm->async_pf_inflight);
 			kvm_put_kvm(vcpu->kvm); /* == work->vcpu->kvm */
 			kmem_cache_free(async_pf_cache, work);
 		}
@@ -172,13 +192,17 @@ bool kvm_setup_async_pf(struct kvm_vcpu *vcpu, gpa_t cr2_or_gpa,
 	if (unlikely(kvm_is_error_hva(hva)))
 		return false;
 
+	if (atomic_inc_return(&vcpu->kvm->async_pf_inflight) >
+	    READ_ONCE(async_pf_per_vm))
+		goto out_dec;
+
 	/*
 	 * do alloc nowait since if we are going to sleep anyway we
 	 * may as well sleep faulting in page
 	 */
 	work = kmem_cache_zalloc(async_pf_cache, GFP_NOWAIT | __GFP_NOWARN);
 	if (!work)
-		return false;
+		goto out_dec;
 
 	work->wakeup_all = false;
 	work->vcpu = vcpu;
@@ -195,9 +219,13 @@ bool kvm_setup_async_pf(struct kvm_vcpu *vcpu, gpa_t cr2_or_gpa,
 	vcpu->async_pf.queued++;
 	work->notpresent_injected = kvm_arch_async_page_not_present(vcpu, work);
 
-	schedule_work(&work->work);
+	queue_work(async_pf_wq, &work->work);
 
 	return true;
+
+out_dec:
+	atomic_dec(&vcpu->kvm->async_pf_inflight);
+	return false;
 }
 
 int kvm_async_pf_wakeup_all(struct kvm_vcpu *vcpu)
@@ -14,6 +14,7 @@
 #include <linux/kvm_host.h>
 #include <linux/slab.h>
 #include <linux/kvm.h>
+#include <linux/eventfd.h>
 
 #include "coalesced_mmio.h"
 
@@ -40,9 +41,8 @@ static int coalesced_mmio_in_range(struct kvm_coalesced_mmio_dev *dev,
 	return 1;
 }
 
-static int coalesced_mmio_has_room(struct kvm_coalesced_mmio_dev *dev, u32 last)
+static int coalesced_mmio_has_room(struct kvm_coalesced_mmio_ring *ring, u32 last)
 {
-	struct kvm_coalesced_mmio_ring *ring;
 	unsigned avail;
 
 	/* Are we able to batch it ? */
@@ -51,8 +51,7 @@ static int coalesced_mmio_has_room(struct kvm_coalesced_mmio_dev *dev, u32 last)
 	 * check if we don't meet the first used entry
 	 * there is always one unused entry in the buffer
 	 */
-	ring = dev->kvm->coalesced_mmio_ring;
-	avail = (ring->first - last - 1) % KVM_COALESCED_MMIO_MAX;
+	avail = (READ_ONCE(ring->first) - last - 1) % KVM_COALESCED_MMIO_MAX;
 	if (avail == 0) {
 		/* full */
 		return 0;
@@ -61,35 +60,62 @@ static int coalesced_mmio_has_room(struct kvm_coalesced_mmio_dev *dev, u32 last)
 	return 1;
 }
 
+/* Returns the new number of entries in the ring, or 0 if it is full. */
+static u32 coalesced_mmio_append(struct kvm_coalesced_mmio_dev *dev,
+				 struct kvm_coalesced_mmio_ring *ring,
+				 gpa_t addr, int len, const void *val)
+{
+	__u32 insert;
+
+	insert = READ_ONCE(ring->last);
+	if (!coalesced_mmio_has_room(ring, insert) ||
+	    insert >= KVM_COALESCED_MMIO_MAX)
+		return 0;
+
+	/* copy data in first free entry of the ring */
+
+	ring->coalesced_mmio[insert].phys_addr = addr;
+	ring->coalesced_mmio[insert].len = len;
+	memcpy(ring->coalesced_mmio[insert].data, val, len);
+	ring->coalesced_mmio[insert].pio = dev->zone.pio;
+	smp_wmb();
+	WRITE_ONCE(ring->last, (insert + 1) % KVM_COALESCED_MMIO_MAX);
+
+	return (insert + 1 - READ_ONCE(ring->first)) % KVM_COALESCED_MMIO_MAX;
+}
+
 static int coalesced_mmio_write(struct kvm_vcpu *vcpu,
 				struct kvm_io_device *this, gpa_t addr,
 				int len, const void *val)
 {
 	struct kvm_coalesced_mmio_dev *dev = to_mmio(this);
-	struct kvm_coalesced_mmio_ring *ring = dev->kvm->coalesced_mmio_ring;
-	__u32 insert;
+	struct kvm *kvm = dev->kvm;
+	u32 used;
 
 	if (!coalesced_mmio_in_range(dev, addr, len))
 		return -EOPNOTSUPP;
 
-	spin_lock(&dev->kvm->ring_lock);
+	/*
+	 * A per-vCPU ring has a single producer, the vCPU itself, which is
+	 * serialized by vcpu->mutex, so no lock is needed to append to it.
+	 */
+	if (vcpu->coalesced_mmio_ring) {
+		used = coalesced_mmio_append(dev, vcpu->coalesced_mmio_ring,
+					     addr, len, val);
+	} else {
+		spin_lock(&kvm->ring_lock);
+		used = coalesced_mmio_append(dev, kvm->coalesced_mmio_ring,
+					     addr, len, val);
+		spin_unlock(&kvm->ring_lock);
+	}
 
-	insert = READ_ONCE(ring->last);
-	if (!coalesced_mmio_has_room(dev, insert) ||
-	    insert >= KVM_COALESCED_MMIO_MAX) {
-		spin_unlock(&dev->kvm->ring_lock);
+	if (!used)
 		return -EOPNOTSUPP;
-	}
 
-	/* copy data in first free entry of the ring */
+	/* Rings fill one entry at a time, so this fires once per crossing. */
+	if (kvm->coalesced_mmio_eventfd && used == kvm->coalesced_mmio_hwm)
+		eventfd_signal(kvm->coalesced_mmio_eventfd, 1);
 
-	ring->coalesced_mmio[insert].phys_addr = addr;
-	ring->coalesced_mmio[insert].len = len;
-	memcpy(ring->coalesced_mmio[insert].data, val, len);
-	ring->coalesced_mmio[insert].pio = dev->zone.pio;
-	smp_wmb();
-	ring->last = (insert + 1) % KVM_COALESCED_MMIO_MAX;
-	spin_unlock(&dev->kvm->ring_lock);
 	return 0;
 }
 
@@ -132,6 +158,95 @@ void kvm_coalesced_mmio_free(struct kvm *kvm)
 {
 	if (kvm->coalesced_mmio_ring)
 		free_page((unsigned long)kvm->coalesced_mmio_ring);
+	if (kvm->coalesced_mmio_eventfd)
+		eventfd_ctx_put(kvm->coalesced_mmio_eventfd);
+}
+
+int kvm_coalesced_mmio_vcpu_init(struct kvm_vcpu *vcpu)
+{
+	struct page *page;
+
+	if (!vcpu->kvm->coalesced_mmio_vcpu_rings)
+		return 0;
+
+	page = alloc_page(GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+	if (!page)
+		return -ENOMEM;
+
+	vcpu->coalesced_mmio_ring = page_address(page);
+	return 0;
+}
+
+void kvm_coalesced_mmio_vcpu_free(struct kvm_vcpu *vcpu)
+{
+	if (vcpu->coalesced_mmio_ring)
+		free_page((unsigned long)vcpu->coalesced_mmio_ring);
+	vcpu->coalesced_mmio_ring = NULL;
+}
+
+/*
+ * With KVM_COALESCED_MMIO_VCPU_RING_FENCE, an ioeventfd must not signal
+ * userspace ahead of the coalesced writes that the vCPU made before it.
+ * While the ring is not empty, the ioeventfd write exits to userspace
+ * instead, and userspace drains the ring before handling the exit.
+ */
+bool kvm_coalesced_mmio_vcpu_ring_fence(struct kvm_vcpu *vcpu)
+{
+	struct kvm_coalesced_mmio_ring *ring = vcpu->coalesced_mmio_ring;
+
+	if (!ring || !vcpu->kvm->coalesced_mmio_fence)
+		return false;
+
+	return READ_ONCE(ring->first) != ring->last;
+}
+
+/*
+ * Give each vCPU its own coalesced MMIO ring, mapped at
+ * KVM_COALESCED_MMIO_PAGE_OFFSET of the vCPU fd in place of the VM-wide
+ * ring.  The entries of a ring are in the order of the vCPU's writes, but
+ * there is no ordering between the rings of different vCPUs.  If @fd is an
+ * eventfd, it is signaled whenever a ring fills up to @hwm entries.
+ * KVM_COALESCED_MMIO_VCPU_RING_FENCE in @flags orders the ioeventfds after
+ * the coalesced writes.
+ */
+int kvm_vm_ioctl_enable_coalesced_mmio_vcpu_ring(struct kvm *kvm, u64 fd,
+						 u64 hwm, u32 flags)
+{
+	struct eventfd_ctx *eventfd = NULL;
+	int r;
+
+	if (hwm >= KVM_COALESCED_MMIO_MAX)
+		return -EINVAL;
+
+	if (hwm) {
+		if (fd != (int)fd)
+			return -EINVAL;
+
+		eventfd = eventfd_ctx_fdget(fd);
+		if (IS_ERR(eventfd))
+			return PTR_ERR(eventfd);
+	}
+
+	mutex_lock(&kvm->lock);
+
+	/* The rings are allocated at vCPU creation. */
+	if (kvm->created_vcpus || kvm->coalesced_mmio_vcpu_rings) {
+		r = -EINVAL;
+	} else {
+		kvm->coalesced_mmio_vcpu_rings = true;
+		kvm->coalesced_mmio_fence =
+			!!(flags & KVM_COALESCED_MMIO_VCPU_RING_FENCE);
+		kvm->coalesced_mmio_hwm = hwm;
+		kvm->coalesced_mmio_eventfd = eventfd;
+		eventfd = NULL;
+		r = 0;
+	}
+
+	mutex_unlock(&kvm->lock);
+
+	if (eventfd)
+		eventfd_ctx_put(eventfd);
+	return r;
 }
 
 int kvm_vm_ioctl_register_coalesced_mmio(struct kvm *kvm,
@@ -24,6 +24,11 @@ struct kvm_coalesced_mmio_dev {
 
 int kvm_coalesced_mmio_init(struct kvm *kvm);
 void kvm_coalesced_mmio_free(struct kvm *kvm);
+int kvm_coalesced_mmio_vcpu_init(struct kvm_vcpu *vcpu);
+void kvm_coalesced_mmio_vcpu_free(struct kvm_vcpu *vcpu);
+bool kvm_coalesced_mmio_vcpu_ring_fence(struct kvm_vcpu *vcpu);
+int kvm_vm_ioctl_enable_coalesced_mmio_vcpu_ring(struct kvm *kvm, u64 fd,
+						 u64 hwm, u32 flags);
 int kvm_vm_ioctl_register_coalesced_mmio(struct kvm *kvm,
 					struct kvm_coalesced_mmio_zone *zone);
 int kvm_vm_ioctl_unregister_coalesced_mmio(struct kvm *kvm,
@@ -33,6 +38,12 @@ int kvm_vm_ioctl_unregister_coalesced_mmio(struct kvm *kvm,
 
 static inline int kvm_coalesced_mmio_init(struct kvm *kvm) { return 0; }
 static inline void kvm_coalesced_mmio_free(struct kvm *kvm) { }
+static inline int kvm_coalesced_mmio_vcpu_init(struct kvm_vcpu *vcpu) { return 0; }
+static inline void kvm_coalesced_mmio_vcpu_free(struct kvm_vcpu *vcpu) { }
+static inline bool kvm_coalesced_mmio_vcpu_ring_fence(struct kvm_vcpu *vcpu)
+{
+	return false;
+}
 
 #endif
 
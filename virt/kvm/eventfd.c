@@ -28,6 +28,8 @@
 
 #include <kvm/iodev.h>
 
+#include "coalesced_mmio.h"
+
 #ifdef CONFIG_HAVE_KVM_IRQFD
 
 static struct workqueue_struct *irqfd_cleanup_wq;
@@ -201,8 +203,10 @@ irqfd_wakeup(wait_queue_entry_t *wait, unsigned mode, int sync, void *key)
 		/* An event has been signaled, inject an interrupt */
 		if (kvm_arch_set_irq_inatomic(&irq, kvm,
 					      KVM_USERSPACE_IRQ_SOURCE_ID, 1,
-					      false) == -EWOULDBLOCK)
+					      false) == -EWOULDBLOCK) {
+			++kvm->stat.irqfd_inject_deferred;
 			schedule_work(&irqfd->inject);
+		}
 		srcu_read_unlock(&kvm->irq_srcu, idx);
 	}
 
@@ -734,6 +738,10 @@ ioeventfd_write(struct kvm_vcpu *vcpu, struct kvm_io_device *this, gpa_t addr,
 	if (!ioeventfd_in_range(p, addr, len, val))
 		return -EOPNOTSUPP;
 
+	/* Exit to userspace, which drains the ring before the eventfd. */
+	if (vcpu && kvm_coalesced_mmio_vcpu_ring_fence(vcpu))
+		return -EOPNOTSUPP;
+
 	eventfd_signal(p->eventfd, 1);
 	return 0;
 }
@@ -823,8 +831,13 @@ static int kvm_assign_ioeventfd_idx(struct kvm *kvm,
 
 	kvm_iodevice_init(&p->dev, &ioeventfd_ops);
 
-	ret = kvm_io_bus_register_dev(kvm, bus_idx, p->addr, p->length,
-				      &p->dev);
+	if (p->wildcard)
+		ret = kvm_io_bus_register_dev(kvm, bus_idx, p->addr, p->length,
+					      &p->dev);
+	else
+		ret = kvm_io_bus_register_dev_datamatch(kvm, bus_idx, p->addr,
+							p->length, p->datamatch,
+							&p->dev);
 	if (ret < 0)
 		goto unlock_fail;
 
@@ -48,9 +48,11 @@
 #include <linux/slab.h>
 #include <linux/sort.h>
 #include <linux/bsearch.h>
+#include <linux/hash.h>
 #include <linux/io.h>
 #include <linux/lockdep.h>
 #include <linux/kthread.h>
+#include <linux/seq_file.h>
 
 #include <asm/processor.h>
 #include <asm/ioctl.h>
@@ -59,6 +61,8 @@
 #include "coalesced_mmio.h"
 #include "async_pf.h"
 #include "vfio.h"
+#include "mmu_lock.h"
+#include "kvm_mm.h"
 
 #define CREATE_TRACE_POINTS
 #include <trace/events/kvm.h>
@@ -89,6 +93,24 @@ unsigned int halt_poll_ns_shrink;
 module_param(halt_poll_ns_shrink, uint, 0644);
 EXPORT_SYMBOL_GPL(halt_poll_ns_shrink);
 
+/*
+ * Pick per-vcpu halt_poll_ns from a histogram of its block times, rather than
+ * growing and shrinking it.
+ */
+static bool halt_poll_adaptive;
+module_param(halt_poll_adaptive, bool, 0644);
+
+#ifdef CONFIG_SCHED_CORE
+/*
+ * Tag the vCPU threads of each VM with a core scheduling cookie, so that SMT
+ * siblings only ever run vCPUs of the same VM together.  Off by default, as
+ * it costs the host throughput whenever the siblings have nothing to run of
+ * the same VM.
+ */
+static bool core_sched;
+module_param(core_sched, bool, 0444);
+#endif
+
 /*
  * Ordering of locks:
  *
@@ -244,9 +266,6 @@ static void ack_flush(void *_completed)
 
 static inline bool kvm_kick_many_cpus(const struct cpumask *cpus, bool wait)
 {
-	if (unlikely(!cpus))
-		cpus = cpu_online_mask;
-
 	if (cpumask_empty(cpus))
 		return false;
 
@@ -254,33 +273,58 @@ static inline bool kvm_kick_many_cpus(const struct cpumask *cpus, bool wait)
 	return true;
 }
 
+static void kvm_make_vcpu_request(struct kvm_vcpu *vcpu, unsigned int req,
+				  struct cpumask *tmp, int current_cpu)
+{
+	int cpu;
+
+	kvm_make_request(req, vcpu);
+
+	if (!(req & KVM_REQUEST_NO_WAKEUP) && kvm_vcpu_wake_up(vcpu))
+		return;
+
+	/*
+	 * The vCPU can migrate after kvm_request_needs_ipi(), and the IPI then
+	 * goes to the previous pCPU. That's fine, its purpose is to get the
+	 * vCPU out of guest mode, which migrating does as well.
+	 */
+	if (kvm_request_needs_ipi(vcpu, req)) {
+		cpu = READ_ONCE(vcpu->cpu);
+		if (cpu != -1 && cpu != current_cpu)
+			__cpumask_set_cpu(cpu, tmp);
+	}
+}
+
+/*
+ * The IPIs to all the pCPUs that run a targeted vCPU are sent at once, with
+ * a cpumask preallocated for each pCPU, so that the requests don't have to
+ * allocate one with GFP_ATOMIC, and don't fall back to IPI'ing every online
+ * pCPU when that allocation fails.
+ */
+static DEFINE_PER_CPU(cpumask_var_t, cpu_kick_mask);
+
 bool kvm_make_vcpus_request_mask(struct kvm *kvm, unsigned int req,
-				 struct kvm_vcpu *except,
-				 unsigned long *vcpu_bitmap, cpumask_var_t tmp)
+				 unsigned long *vcpu_bitmap)
 {
-	int i, cpu, me;
 	struct kvm_vcpu *vcpu;
+	struct cpumask *cpus;
+	int i, me;
 	bool called;
 
 	me = get_cpu();
 
-	kvm_for_each_vcpu(i, vcpu, kvm) {
-		if ((vcpu_bitmap && !test_bit(i, vcpu_bitmap)) ||
-		    vcpu == except)
-			continue;
-
-		kvm_make_request(req, vcpu);
-		cpu = vcpu->cpu;
+	cpus = this_cpu_cpumask_var_ptr(cpu_kick_mask);
+	cpumask_clear(cpus);
 
-		if (!(req & KVM_REQUEST_NO_WAKEUP) && kvm_vcpu_wake_up(vcpu))
+	/* Only visit the targeted vCPUs, not all of those in the VM. */
+	for_each_set_bit(i, vcpu_bitmap, KVM_MAX_VCPUS) {
+		vcpu = kvm_get_vcpu(kvm, i);
+		if (!vcpu)
 			continue;
-
-		if (tmp != NULL && cpu != -1 && cpu != me &&
-		    kvm_request_needs_ipi(vcpu, req))
-			__cpumask_set_cpu(cpu, tmp);
+		kvm_make_vcpu_request(vcpu, req, cpus, me);
 	}
 
-	called = kvm_kick_many_cpus(tmp, !!(req & KVM_REQUEST_WAIT));
+	called = kvm_kick_many_cpus(cpus, !!(req & KVM_REQUEST_WAIT));
 	put_cpu();
 
 	return called;
@@ -289,14 +333,25 @@ bool kvm_make_vcpus_request_mask(struct kvm *kvm, unsigned int req,
 bool kvm_make_all_cpus_request_except(struct kvm *kvm, unsigned int req,
 				      struct kvm_vcpu *except)
 {
-	cpumask_var_t cpus;
+	struct kvm_vcpu *vcpu;
+	struct cpumask *cpus;
+	int i, me;
 	bool called;
 
-	zalloc_cpumask_var(&cpus, GFP_ATOMIC);
+	me = get_cpu();
+
+	cpus = this_cpu_cpumask_var_ptr(cpu_kick_mask);
+	cpumask_clear(cpus);
+
+	kvm_for_each_vcpu(i, vcpu, kvm) {
+		if (vcpu == except)
+			continue;
+		kvm_make_vcpu_request(vcpu, req, cpus, me);
+	}
 
-	called = kvm_make_vcpus_request_mask(kvm, req, except, NULL, cpus);
+	called = kvm_kick_many_cpus(cpus, !!(req & KVM_REQUEST_WAIT));
+	put_cpu();
 
-	free_cpumask_var(cpus);
 	return called;
 }
 
@@ -356,6 +411,18 @@ int kvm_mmu_topup_memory_cache(struct kvm_mmu_memory_cache *mc, int min)
 
 	if (mc->nobjs >= min)
 		return 0;
+
+	/*
+	 * Refill slab backed caches with a single bulk allocation. It's all or
+	 * nothing, fall back to allocating one object at a time on failure so
+	 * that a partial refill can still satisfy @min.
+	 */
+	if (mc->kmem_cache)
+		mc->nobjs += kmem_cache_alloc_bulk(mc->kmem_cache,
+						   GFP_KERNEL_ACCOUNT | mc->gfp_zero,
+						   ARRAY_SIZE(mc->objects) - mc->nobjs,
+						   &mc->objects[mc->nobjs]);
+
 	while (mc->nobjs < ARRAY_SIZE(mc->objects)) {
 		obj = mmu_memory_cache_alloc_obj(mc, GFP_KERNEL_ACCOUNT);
 		if (!obj)
@@ -404,6 +471,7 @@ static void kvm_vcpu_init(struct kvm_vcpu *vcpu, struct kvm *kvm, unsigned id)
 	kvm_async_pf_vcpu_init(vcpu);
 
 	vcpu->pre_pcpu = -1;
+	vcpu->last_used_slot = 0;
 	INIT_LIST_HEAD(&vcpu->blocked_vcpu_list);
 
 	kvm_vcpu_set_in_spin_loop(vcpu, false);
@@ -415,6 +483,8 @@ static void kvm_vcpu_init(struct kvm_vcpu *vcpu, struct kvm *kvm, unsigned id)
 
 void kvm_vcpu_destroy(struct kvm_vcpu *vcpu)
 {
+	kvm_coalesced_mmio_vcpu_free(vcpu);
+	kvm_dirty_ring_free(&vcpu->dirty_ring);
 	kvm_arch_vcpu_destroy(vcpu);
 
 	/*
@@ -456,30 +526,110 @@ static void kvm_mmu_notifier_change_pte(struct mmu_notifier *mn,
 	int idx;
 
 	idx = srcu_read_lock(&kvm->srcu);
-	spin_lock(&kvm->mmu_lock);
+	KVM_MMU_LOCK(kvm);
 	kvm->mmu_notifier_seq++;
 
 	if (kvm_set_spte_hva(kvm, address, pte))
 		kvm_flush_remote_tlbs(kvm);
 
-	spin_unlock(&kvm->mmu_lock);
+	KVM_MMU_UNLOCK(kvm);
 	srcu_read_unlock(&kvm->srcu, idx);
 }
 
+#define kvm_for_each_memslot_in_hva_range(node, slots, start, last)	\
+	for (node = interval_tree_iter_first(&(slots)->hva_tree, start, last); \
+	     node;							\
+	     node = interval_tree_iter_next(node, start, last))
+
+/*
+ * Check whether @range overlaps any memslot. Must be called with kvm->srcu
+ * held.
+ */
+static bool kvm_mmu_notifier_hits_memslot(struct kvm *kvm,
+					  const struct mmu_notifier_range *range)
+{
+	int i;
+
+	for (i = 0; i < KVM_ADDRESS_SPACE_NUM; i++) {
+		if (interval_tree_iter_first(&__kvm_memslots(kvm, i)->hva_tree,
+					     range->start, range->end - 1))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Check whether @range is a NUMA hinting update, which only covers memslots
+ * flagged with KVM_MEM_NUMA_BOUND. Such an update leaves the pages in place,
+ * and a later migration invalidates them again, so the sptes can be kept.
+ * Must be called with kvm->srcu held.
+ */
+static bool kvm_mmu_notifier_numa_bound(struct kvm *kvm,
+					const struct mmu_notifier_range *range)
+{
+	struct kvm_memory_slot *memslot;
+	struct interval_tree_node *node;
+	struct kvm_memslots *slots;
+	int i;
+
+	if (range->event != MMU_NOTIFY_PROTECTION_NUMA)
+		return false;
+
+	for (i = 0; i < KVM_ADDRESS_SPACE_NUM; i++) {
+		slots = __kvm_memslots(kvm, i);
+		kvm_for_each_memslot_in_hva_range(node, slots, range->start,
+						  range->end - 1) {
+			memslot = container_of(node, struct kvm_memory_slot,
+					       hva_node);
+			if (!(memslot->flags & KVM_MEM_NUMA_BOUND))
+				return false;
+		}
+	}
+
+	return true;
+}
+
 static int kvm_mmu_notifier_invalidate_range_start(struct mmu_notifier *mn,
 					const struct mmu_notifier_range *range)
 {
 	struct kvm *kvm = mmu_notifier_to_kvm(mn);
 	int need_tlb_flush = 0, idx;
+	bool keep;
+
+	spin_lock(&kvm->mn_invalidate_lock);
+	kvm->mn_active_invalidate_count++;
+	spin_unlock(&kvm->mn_invalidate_lock);
 
 	idx = srcu_read_lock(&kvm->srcu);
-	spin_lock(&kvm->mmu_lock);
+
+	/*
+	 * Nothing to do for the VMM's own memory: no spte or cache maps it, and
+	 * the vCPU faults on guest memory need not retry.
+	 */
+	if (!kvm_mmu_notifier_hits_memslot(kvm, range)) {
+		srcu_read_unlock(&kvm->srcu, idx);
+		return 0;
+	}
+
+	keep = kvm_mmu_notifier_numa_bound(kvm, range);
+
+	KVM_MMU_LOCK(kvm);
 	/*
 	 * The count increase must become visible at unlock time as no
 	 * spte can be established without taking the mmu_lock and
 	 * count is also read inside the mmu_lock critical section.
+	 * It is raised even when the sptes are kept, so that it stays
+	 * balanced with kvm_mmu_notifier_invalidate_range_end() should
+	 * the memslots change in the meantime.
 	 */
 	kvm->mmu_notifier_count++;
+	if (keep) {
+		KVM_MMU_UNLOCK(kvm);
+		srcu_read_unlock(&kvm->srcu, idx);
+		return 0;
+	}
+
 	need_tlb_flush = kvm_unmap_hva_range(kvm, range->start, range->end,
 					     range->flags);
 	need_tlb_flush |= kvm->tlbs_dirty;
@@ -487,18 +637,22 @@ static int kvm_mmu_notifier_invalidate_range_start(struct mmu_notifier *mn,
 	if (need_tlb_flush)
 		kvm_flush_remote_tlbs(kvm);
 
-	spin_unlock(&kvm->mmu_lock);
+	KVM_MMU_UNLOCK(kvm);
+
+	/*
+	 * Caches are invalidated after mmu_notifier_count is raised, so that a
+	 * concurrent refresh either sees the elevated count or is invalidated.
+	 */
+	gfn_to_pfn_cache_invalidate_start(kvm, range->start, range->end);
+
 	srcu_read_unlock(&kvm->srcu, idx);
 
 	return 0;
 }
 
-static void kvm_mmu_notifier_invalidate_range_end(struct mmu_notifier *mn,
-					const struct mmu_notifier_range *range)
+static void __kvm_mmu_notifier_invalidate_range_end(struct kvm *kvm)
 {
-	struct kvm *kvm = mmu_notifier_to_kvm(mn);
-
-	spin_lock(&kvm->mmu_lock);
+	KVM_MMU_LOCK(kvm);
 	/*
 	 * This sequence increase will notify the kvm page fault that
 	 * the page that is going to be mapped in the spte could have
@@ -512,11 +666,51 @@ static void kvm_mmu_notifier_invalidate_range_end(struct mmu_notifier *mn,
 	 * in conjunction with the smp_rmb in mmu_notifier_retry().
 	 */
 	kvm->mmu_notifier_count--;
-	spin_unlock(&kvm->mmu_lock);
+	KVM_MMU_UNLOCK(kvm);
 
 	BUG_ON(kvm->mmu_notifier_count < 0);
 }
 
+static void kvm_mmu_notifier_invalidate_range_end(struct mmu_notifier *mn,
+					const struct mmu_notifier_range *range)
+{
+	struct kvm *kvm = mmu_notifier_to_kvm(mn);
+	bool hit, wake;
+	int idx;
+
+	/* Same memslots as in the start, see mn_active_invalidate_count. */
+	idx = srcu_read_lock(&kvm->srcu);
+	hit = kvm_mmu_notifier_hits_memslot(kvm, range);
+	srcu_read_unlock(&kvm->srcu, idx);
+
+	if (hit)
+		__kvm_mmu_notifier_invalidate_range_end(kvm);
+
+	spin_lock(&kvm->mn_invalidate_lock);
+	wake = !--kvm->mn_active_invalidate_count;
+	spin_unlock(&kvm->mn_invalidate_lock);
+
+	if (wake)
+		rcuwait_wake_up(&kvm->mn_memslots_update_rcuwait);
+}
+
+/*
+ * Aging only needs mmu_lock to protect the arch page tables. Architectures
+ * that selected KVM_MMU_LOCKLESS_AGING take it themselves, in the mode and for
+ * the parts of the walk that need it.
+ */
+static inline void kvm_mmu_age_lock(struct kvm *kvm)
+{
+	if (!IS_ENABLED(CONFIG_KVM_MMU_LOCKLESS_AGING))
+		KVM_MMU_LOCK(kvm);
+}
+
+static inline void kvm_mmu_age_unlock(struct kvm *kvm)
+{
+	if (!IS_ENABLED(CONFIG_KVM_MMU_LOCKLESS_AGING))
+		KVM_MMU_UNLOCK(kvm);
+}
+
 static int kvm_mmu_notifier_clear_flush_young(struct mmu_notifier *mn,
 					      struct mm_struct *mm,
 					      unsigned long start,
@@ -526,13 +720,13 @@ static int kvm_mmu_notifier_clear_flush_young(struct mmu_notifier *mn,
 	int young, idx;
 
 	idx = srcu_read_lock(&kvm->srcu);
-	spin_lock(&kvm->mmu_lock);
+	kvm_mmu_age_lock(kvm);
 
 	young = kvm_age_hva(kvm, start, end);
 	if (young)
 		kvm_flush_remote_tlbs(kvm);
 
-	spin_unlock(&kvm->mmu_lock);
+	kvm_mmu_age_unlock(kvm);
 	srcu_read_unlock(&kvm->srcu, idx);
 
 	return young;
@@ -547,7 +741,7 @@ static int kvm_mmu_notifier_clear_young(struct mmu_notifier *mn,
 	int young, idx;
 
 	idx = srcu_read_lock(&kvm->srcu);
-	spin_lock(&kvm->mmu_lock);
+	kvm_mmu_age_lock(kvm);
 	/*
 	 * Even though we do not flush TLB, this will still adversely
 	 * affect performance on pre-Haswell Intel EPT, where there is
@@ -562,7 +756,7 @@ static int kvm_mmu_notifier_clear_young(struct mmu_notifier *mn,
 	 * more sophisticated heuristic later.
 	 */
 	young = kvm_age_hva(kvm, start, end);
-	spin_unlock(&kvm->mmu_lock);
+	kvm_mmu_age_unlock(kvm);
 	srcu_read_unlock(&kvm->srcu, idx);
 
 	return young;
@@ -576,9 +770,9 @@ static int kvm_mmu_notifier_test_young(struct mmu_notifier *mn,
 	int young, idx;
 
 	idx = srcu_read_lock(&kvm->srcu);
-	spin_lock(&kvm->mmu_lock);
+	kvm_mmu_age_lock(kvm);
 	young = kvm_test_age_hva(kvm, address);
-	spin_unlock(&kvm->mmu_lock);
+	kvm_mmu_age_unlock(kvm);
 	srcu_read_unlock(&kvm->srcu, idx);
 
 	return young;
@@ -608,10 +802,55 @@ static const struct mmu_notifier_ops kvm_mmu_notifier_ops = {
 
 static int kvm_init_mmu_notifier(struct kvm *kvm)
 {
+	spin_lock_init(&kvm->mn_invalidate_lock);
+	rcuwait_init(&kvm->mn_memslots_update_rcuwait);
+
 	kvm->mmu_notifier.ops = &kvm_mmu_notifier_ops;
 	return mmu_notifier_register(&kvm->mmu_notifier, current->mm);
 }
 
+/*
+ * Replace the memslots of @as_id once no invalidation is in progress, and with
+ * mn_invalidate_lock held so that none can start meanwhile.
+ */
+static void kvm_assign_memslots(struct kvm *kvm, int as_id,
+				struct kvm_memslots *slots)
+{
+	spin_lock(&kvm->mn_invalidate_lock);
+	prepare_to_rcuwait(&kvm->mn_memslots_update_rcuwait);
+	while (kvm->mn_active_invalidate_count) {
+		set_current_state(TASK_UNINTERRUPTIBLE);
+		spin_unlock(&kvm->mn_invalidate_lock);
+		schedule();
+		spin_lock(&kvm->mn_invalidate_lock);
+	}
+	finish_rcuwait(&kvm->mn_memslots_update_rcuwait);
+
+	rcu_assign_pointer(kvm->memslots[as_id], slots);
+	spin_unlock(&kvm->mn_invalidate_lock);
+}
+
+/*
+ * The copies of memslots[] share the tree nodes of the slots they were copied
+ * from, rebuild the tree from scratch.
+ */
+static void kvm_build_hva_tree(struct kvm_memslots *slots)
+{
+	struct kvm_memory_slot *memslot;
+
+	slots->hva_tree = RB_ROOT_CACHED;
+
+	kvm_for_each_memslot(memslot, slots) {
+		if (!memslot->npages)
+			continue;
+
+		memslot->hva_node.start = memslot->userspace_addr;
+		memslot->hva_node.last = memslot->userspace_addr +
+					 (memslot->npages << PAGE_SHIFT) - 1;
+		interval_tree_insert(&memslot->hva_node, &slots->hva_tree);
+	}
+}
+
 #else  /* !(CONFIG_MMU_NOTIFIER && KVM_ARCH_WANT_MMU_NOTIFIER) */
 
 static int kvm_init_mmu_notifier(struct kvm *kvm)
@@ -619,6 +858,16 @@ static int kvm_init_mmu_notifier(struct kvm *kvm)
 	return 0;
 }
 
+static void kvm_build_hva_tree(struct kvm_memslots *slots)
+{
+}
+
+static void kvm_assign_memslots(struct kvm *kvm, int as_id,
+				struct kvm_memslots *slots)
+{
+	rcu_assign_pointer(kvm->memslots[as_id], slots);
+}
+
 #endif /* CONFIG_MMU_NOTIFIER && KVM_ARCH_WANT_MMU_NOTIFIER */
 
 static struct kvm_memslots *kvm_alloc_memslots(void)
@@ -743,7 +992,7 @@ static struct kvm *kvm_create_vm(unsigned long type)
 	if (!kvm)
 		return ERR_PTR(-ENOMEM);
 
-	spin_lock_init(&kvm->mmu_lock);
+	KVM_MMU_LOCK_INIT(kvm);
 	mmgrab(current->mm);
 	kvm->mm = current->mm;
 	kvm_eventfd_init(kvm);
@@ -751,6 +1000,10 @@ static struct kvm *kvm_create_vm(unsigned long type)
 	mutex_init(&kvm->irq_lock);
 	mutex_init(&kvm->slots_lock);
 	INIT_LIST_HEAD(&kvm->devices);
+#ifdef CONFIG_HAVE_KVM_PFNCACHE
+	spin_lock_init(&kvm->gpc_lock);
+	INIT_LIST_HEAD(&kvm->gpc_list);
+#endif
 
 	BUILD_BUG_ON(KVM_MEM_SLOTS_NUM > SHRT_MAX);
 
@@ -779,6 +1032,14 @@ static struct kvm *kvm_create_vm(unsigned long type)
 
 	kvm->max_halt_poll_ns = halt_poll_ns;
 
+#ifdef CONFIG_SCHED_CORE
+	if (core_sched) {
+		kvm->core_cookie = sched_core_alloc_cookie();
+		if (!kvm->core_cookie)
+			goto out_err_no_arch_destroy_vm;
+	}
+#endif
+
 	r = kvm_arch_init_vm(kvm, type);
 	if (r)
 		goto out_err_no_arch_destroy_vm;
@@ -818,6 +1079,9 @@ static struct kvm *kvm_create_vm(unsigned long type)
 	kvm_arch_destroy_vm(kvm);
 out_err_no_arch_destroy_vm:
 	WARN_ON_ONCE(!refcount_dec_and_test(&kvm->users_count));
+#ifdef CONFIG_SCHED_CORE
+	sched_core_put_cookie(kvm->core_cookie);
+#endif
 	for (i = 0; i < KVM_NR_BUSES; i++)
 		kfree(kvm_get_bus(kvm, i));
 	for (i = 0; i < KVM_ADDRESS_SPACE_NUM; i++)
@@ -875,10 +1139,17 @@ static void kvm_destroy_vm(struct kvm *kvm)
 #endif
 	kvm_arch_destroy_vm(kvm);
 	kvm_destroy_devices(kvm);
-	for (i = 0; i < KVM_ADDRESS_SPACE_NUM; i++)
+	for (i = 0; i < KVM_ADDRESS_SPACE_NUM; i++) {
 		kvm_free_memslots(kvm, __kvm_memslots(kvm, i));
+		/* The spare shares the dirty bitmaps etc. with the active. */
+		kvfree(kvm->spare_memslots[i]);
+	}
 	cleanup_srcu_struct(&kvm->irq_srcu);
 	cleanup_srcu_struct(&kvm->srcu);
+#ifdef CONFIG_SCHED_CORE
+	/* The vCPU threads keep their own reference. */
+	sched_core_put_cookie(kvm->core_cookie);
+#endif
 	kvm_arch_free_vm(kvm);
 	preempt_notifier_dec();
 	hardware_disable_all();
@@ -1100,7 +1371,7 @@ static void update_memslots(struct kvm_memslots *slots,
 
 static int check_memory_region_flags(const struct kvm_userspace_memory_region *mem)
 {
-	u32 valid_flags = KVM_MEM_LOG_DIRTY_PAGES;
+	u32 valid_flags = KVM_MEM_LOG_DIRTY_PAGES | KVM_MEM_NUMA_BOUND;
 
 #ifdef __KVM_HAVE_READONLY_MEM
 	valid_flags |= KVM_MEM_READONLY;
@@ -1112,8 +1383,8 @@ static int check_memory_region_flags(const struct kvm_userspace_memory_region *m
 	return 0;
 }
 
-static struct kvm_memslots *install_new_memslots(struct kvm *kvm,
-		int as_id, struct kvm_memslots *slots)
+static struct kvm_memslots *kvm_publish_memslots(struct kvm *kvm, int as_id,
+						 struct kvm_memslots *slots)
 {
 	struct kvm_memslots *old_memslots = __kvm_memslots(kvm, as_id);
 	u64 gen = old_memslots->generation;
@@ -1121,8 +1392,16 @@ static struct kvm_memslots *install_new_memslots(struct kvm *kvm,
 	WARN_ON(gen & KVM_MEMSLOT_GEN_UPDATE_IN_PROGRESS);
 	slots->generation = gen | KVM_MEMSLOT_GEN_UPDATE_IN_PROGRESS;
 
-	rcu_assign_pointer(kvm->memslots[as_id], slots);
-	synchronize_srcu_expedited(&kvm->srcu);
+	kvm_build_hva_tree(slots);
+	kvm_assign_memslots(kvm, as_id, slots);
+	return old_memslots;
+}
+
+/* Called once the readers of the memslots replaced by @slots are gone. */
+static void kvm_finish_memslots_update(struct kvm *kvm,
+				       struct kvm_memslots *slots)
+{
+	u64 gen;
 
 	/*
 	 * Increment the new memslot generation a second time, dropping the
@@ -1144,28 +1423,53 @@ static struct kvm_memslots *install_new_memslots(struct kvm *kvm,
 	kvm_arch_memslots_updated(kvm, gen);
 
 	slots->generation = gen;
+}
+
+static struct kvm_memslots *install_new_memslots(struct kvm *kvm,
+		int as_id, struct kvm_memslots *slots)
+{
+	struct kvm_memslots *old_memslots = kvm_publish_memslots(kvm, as_id,
+								 slots);
+
+	synchronize_srcu_expedited(&kvm->srcu);
+	kvm_finish_memslots_update(kvm, slots);
 
 	return old_memslots;
 }
 
 /*
- * Note, at a minimum, the current number of used slots must be allocated, even
- * when deleting a memslot, as we need a complete duplicate of the memslots for
- * use when invalidating a memslot prior to deleting/moving the memslot.
+ * Install the non-NULL entries of @slots, with a single grace period for all
+ * the address spaces, and return the memslots they replace in @old.
  */
-static struct kvm_memslots *kvm_dup_memslots(struct kvm_memslots *old,
-					     enum kvm_mr_change change)
+static void install_new_memslots_all(struct kvm *kvm,
+				     struct kvm_memslots **slots,
+				     struct kvm_memslots **old)
+{
+	int as_id;
+
+	for (as_id = 0; as_id < KVM_ADDRESS_SPACE_NUM; as_id++) {
+		if (slots[as_id])
+			old[as_id] = kvm_publish_memslots(kvm, as_id,
+							  slots[as_id]);
+	}
+
+	synchronize_srcu_expedited(&kvm->srcu);
+
+	for (as_id = 0; as_id < KVM_ADDRESS_SPACE_NUM; as_id++) {
+		if (slots[as_id])
+			kvm_finish_memslots_update(kvm, slots[as_id]);
+	}
+}
+
+static struct kvm_memslots *__kvm_dup_memslots(struct kvm_memslots *old,
+					       int nr_new)
 {
 	struct kvm_memslots *slots;
 	size_t old_size, new_size;
 
 	old_size = sizeof(struct kvm_memslots) +
 		   (sizeof(struct kvm_memory_slot) * old->used_slots);
-
-	if (change == KVM_MR_CREATE)
-		new_size = old_size + sizeof(struct kvm_memory_slot);
-	else
-		new_size = old_size;
+	new_size = old_size + sizeof(struct kvm_memory_slot) * nr_new;
 
 	slots = kvzalloc(new_size, GFP_KERNEL_ACCOUNT);
 	if (likely(slots))
@@ -1174,6 +1478,57 @@ static struct kvm_memslots *kvm_dup_memslots(struct kvm_memslots *old,
 	return slots;
 }
 
+/*
+ * Note, at a minimum, the current number of used slots must be allocated, even
+ * when deleting a memslot, as we need a complete duplicate of the memslots for
+ * use when invalidating a memslot prior to deleting/moving the memslot.
+ */
+static struct kvm_memslots *kvm_dup_memslots(struct kvm_memslots *old,
+					     enum kvm_mr_change change)
+{
+	return __kvm_dup_memslots(old, change == KVM_MR_CREATE ? 1 : 0);
+}
+
+/*
+ * Get a copy of the active memslots to update.  Reuse the spare copy retired
+ * by the previous update if possible, which saves allocating and copying the
+ * whole array.  The spare can't be used for creating a memslot, as it might not
+ * have room for one more memslot.
+ */
+static struct kvm_memslots *kvm_get_inactive_memslots(struct kvm *kvm,
+						      int as_id,
+						      enum kvm_mr_change change)
+{
+	struct kvm_memslots *slots = kvm->spare_memslots[as_id];
+
+	kvm->spare_memslots[as_id] = NULL;
+
+	if (slots && change != KVM_MR_CREATE)
+		return slots;
+
+	kvfree(slots);
+	return kvm_dup_memslots(__kvm_memslots(kvm, as_id), change);
+}
+
+/*
+ * Bring the memslots retired by an update in sync with the active memslots, by
+ * applying the same change to them, and keep them for the next update.  The
+ * memslots retired by creating a memslot have no room for the new memslot.
+ */
+static void kvm_retire_memslots(struct kvm *kvm, int as_id,
+				struct kvm_memslots *slots,
+				struct kvm_memory_slot *new,
+				enum kvm_mr_change change)
+{
+	if (change == KVM_MR_CREATE) {
+		kvfree(slots);
+		return;
+	}
+
+	update_memslots(slots, new, change);
+	kvm->spare_memslots[as_id] = slots;
+}
+
 static int kvm_set_memslot(struct kvm *kvm,
 			   const struct kvm_userspace_memory_region *mem,
 			   struct kvm_memory_slot *old,
@@ -1184,7 +1539,7 @@ static int kvm_set_memslot(struct kvm *kvm,
 	struct kvm_memslots *slots;
 	int r;
 
-	slots = kvm_dup_memslots(__kvm_memslots(kvm, as_id), change);
+	slots = kvm_get_inactive_memslots(kvm, as_id, change);
 	if (!slots)
 		return -ENOMEM;
 
@@ -1223,7 +1578,7 @@ static int kvm_set_memslot(struct kvm *kvm,
 
 	kvm_arch_commit_memory_region(kvm, mem, old, new, change);
 
-	kvfree(slots);
+	kvm_retire_memslots(kvm, as_id, slots, new, change);
 	return 0;
 
 out_slots:
@@ -1233,46 +1588,24 @@ static int kvm_set_memslot(struct kvm *kvm,
 	return r;
 }
 
-static int kvm_delete_memslot(struct kvm *kvm,
-			      const struct kvm_userspace_memory_region *mem,
-			      struct kvm_memory_slot *old, int as_id)
-{
-	struct kvm_memory_slot new;
-	int r;
-
-	if (!old->npages)
-		return -EINVAL;
-
-	memset(&new, 0, sizeof(new));
-	new.id = old->id;
-	/*
-	 * This is only for debugging purpose; it should never be referenced
-	 * for a removed memslot.
-	 */
-	new.as_id = as_id;
-
-	r = kvm_set_memslot(kvm, mem, old, &new, as_id, KVM_MR_DELETE);
-	if (r)
-		return r;
-
-	kvm_free_memslot(kvm, old);
-	return 0;
-}
+/* A change to the memslots, as described by a kvm_userspace_memory_region. */
+struct kvm_memslot_change {
+	const struct kvm_userspace_memory_region *mem;
+	struct kvm_memory_slot old, new;
+	enum kvm_mr_change change;
+	int as_id;
+};
 
 /*
- * Allocate some memory and give it an address in the guest physical address
- * space.
- *
- * Discontiguous memory is allowed, mostly for framebuffers.
- *
- * Must be called holding kvm->slots_lock for write.
+ * Validate @mem and fill in @chg from it.  Returns 1 if there is something to
+ * change, 0 if @mem matches the current memslot and an error code otherwise.
  */
-int __kvm_set_memory_region(struct kvm *kvm,
-			    const struct kvm_userspace_memory_region *mem)
+static int kvm_check_memslot_change(struct kvm *kvm,
+				    const struct kvm_userspace_memory_region *mem,
+				    struct kvm_memslot_change *chg)
 {
-	struct kvm_memory_slot old, new;
+	struct kvm_memory_slot *old = &chg->old, *new = &chg->new;
 	struct kvm_memory_slot *tmp;
-	enum kvm_mr_change change;
 	int as_id, id;
 	int r;
 
@@ -1298,6 +1631,9 @@ int __kvm_set_memory_region(struct kvm *kvm,
 	if (mem->guest_phys_addr + mem->memory_size < mem->guest_phys_addr)
 		return -EINVAL;
 
+	chg->mem = mem;
+	chg->as_id = as_id;
+
 	/*
 	 * Make a full copy of the old memslot, the pointer will become stale
 	 * when the memslots are re-sorted by update_memslots(), and the old
@@ -1306,82 +1642,147 @@ int __kvm_set_memory_region(struct kvm *kvm,
 	 */
 	tmp = id_to_memslot(__kvm_memslots(kvm, as_id), id);
 	if (tmp) {
-		old = *tmp;
+		*old = *tmp;
 		tmp = NULL;
 	} else {
-		memset(&old, 0, sizeof(old));
-		old.id = id;
+		memset(old, 0, sizeof(*old));
+		old->id = id;
 	}
 
-	if (!mem->memory_size)
-		return kvm_delete_memslot(kvm, mem, &old, as_id);
+	if (!mem->memory_size) {
+		if (!old->npages)
+			return -EINVAL;
+
+		memset(new, 0, sizeof(*new));
+		new->id = id;
+		/*
+		 * This is only for debugging purpose; it should never be
+		 * referenced for a removed memslot.
+		 */
+		new->as_id = as_id;
+		chg->change = KVM_MR_DELETE;
+		return 1;
+	}
 
-	new.as_id = as_id;
-	new.id = id;
-	new.base_gfn = mem->guest_phys_addr >> PAGE_SHIFT;
-	new.npages = mem->memory_size >> PAGE_SHIFT;
-	new.flags = mem->flags;
-	new.userspace_addr = mem->userspace_addr;
+	new->as_id = as_id;
+	new->id = id;
+	new->base_gfn = mem->guest_phys_addr >> PAGE_SHIFT;
+	new->npages = mem->memory_size >> PAGE_SHIFT;
+	new->flags = mem->flags;
+	new->userspace_addr = mem->userspace_addr;
 
-	if (new.npages > KVM_MEM_MAX_NR_PAGES)
+	if (new->npages > KVM_MEM_MAX_NR_PAGES)
 		return -EINVAL;
 
-	if (!old.npages) {
-		change = KVM_MR_CREATE;
-		new.dirty_bitmap = NULL;
-		memset(&new.arch, 0, sizeof(new.arch));
+	if (!old->npages) {
+		chg->change = KVM_MR_CREATE;
+		new->dirty_bitmap = NULL;
+		new->userfault_bitmap = NULL;
+		memset(&new->arch, 0, sizeof(new->arch));
 	} else { /* Modify an existing slot. */
-		if ((new.userspace_addr != old.userspace_addr) ||
-		    (new.npages != old.npages) ||
-		    ((new.flags ^ old.flags) & KVM_MEM_READONLY))
+		if ((new->userspace_addr != old->userspace_addr) ||
+		    (new->npages != old->npages) ||
+		    ((new->flags ^ old->flags) & KVM_MEM_READONLY))
 			return -EINVAL;
 
-		if (new.base_gfn != old.base_gfn)
-			change = KVM_MR_MOVE;
-		else if (new.flags != old.flags)
-			change = KVM_MR_FLAGS_ONLY;
+		if (new->base_gfn != old->base_gfn)
+			chg->change = KVM_MR_MOVE;
+		else if (new->flags != old->flags)
+			chg->change = KVM_MR_FLAGS_ONLY;
 		else /* Nothing to change. */
 			return 0;
 
-		/* Copy dirty_bitmap and arch from the current memslot. */
-		new.dirty_bitmap = old.dirty_bitmap;
-		memcpy(&new.arch, &old.arch, sizeof(new.arch));
+		/* Copy the bitmaps and arch from the current memslot. */
+		new->dirty_bitmap = old->dirty_bitmap;
+		new->userfault_bitmap = old->userfault_bitmap;
+		memcpy(&new->arch, &old->arch, sizeof(new->arch));
 	}
 
-	if ((change == KVM_MR_CREATE) || (change == KVM_MR_MOVE)) {
-		/* Check for overlaps */
-		kvm_for_each_memslot(tmp, __kvm_memslots(kvm, as_id)) {
-			if (tmp->id == id)
-				continue;
-			if (!((new.base_gfn + new.npages <= tmp->base_gfn) ||
-			      (new.base_gfn >= tmp->base_gfn + tmp->npages)))
-				return -EEXIST;
-		}
-	}
+	return 1;
+}
+
+static bool kvm_memslots_overlap(const struct kvm_memory_slot *a,
+				 const struct kvm_memory_slot *b)
+{
+	return a->base_gfn < b->base_gfn + b->npages &&
+	       b->base_gfn < a->base_gfn + a->npages;
+}
+
+/* Allocate/free page dirty bitmap as needed */
+static int kvm_prepare_dirty_bitmap(struct kvm *kvm,
+				    struct kvm_memory_slot *new)
+{
+	int r;
 
-	/* Allocate/free page dirty bitmap as needed */
-	if (!(new.flags & KVM_MEM_LOG_DIRTY_PAGES))
-		new.dirty_bitmap = NULL;
-	else if (!new.dirty_bitmap) {
-		r = kvm_alloc_dirty_bitmap(&new);
+	if (!(new->flags & KVM_MEM_LOG_DIRTY_PAGES)) {
+		new->dirty_bitmap = NULL;
+	} else if (!new->dirty_bitmap && !kvm->dirty_ring_size) {
+		r = kvm_alloc_dirty_bitmap(new);
 		if (r)
 			return r;
 
 		if (kvm_dirty_log_manual_protect_and_init_set(kvm))
-			bitmap_set(new.dirty_bitmap, 0, new.npages);
+			bitmap_set(new->dirty_bitmap, 0, new->npages);
 	}
 
-	r = kvm_set_memslot(kvm, mem, &old, &new, as_id, change);
-	if (r)
-		goto out_bitmap;
-
-	if (old.dirty_bitmap && !new.dirty_bitmap)
-		kvm_destroy_dirty_bitmap(&old);
+	return 0;
+}
+
+/*
+ * Allocate some memory and give it an address in the guest physical address
+ * space.
+ *
+ * Discontiguous memory is allowed, mostly for framebuffers.
+ *
+ * Must be called holding kvm->slots_lock for write.
+ */
+int __kvm_set_memory_region(struct kvm *kvm,
+			    const struct kvm_userspace_memory_region *mem)
+{
+	struct kvm_memslot_change chg;
+	struct kvm_memory_slot *tmp;
+	int r;
+
+	r = kvm_check_memslot_change(kvm, mem, &chg);
+	if (r <= 0)
+		return r;
+
+	if (chg.change == KVM_MR_DELETE) {
+		r = kvm_set_memslot(kvm, mem, &chg.old, &chg.new, chg.as_id,
+				    KVM_MR_DELETE);
+		if (r)
+			return r;
+
+		kvm_free_memslot(kvm, &chg.old);
+		return 0;
+	}
+
+	if ((chg.change == KVM_MR_CREATE) || (chg.change == KVM_MR_MOVE)) {
+		/* Check for overlaps */
+		kvm_for_each_memslot(tmp, __kvm_memslots(kvm, chg.as_id)) {
+			if (tmp->id == chg.new.id)
+				continue;
+			if (kvm_memslots_overlap(tmp, &chg.new))
+				return -EEXIST;
+		}
+	}
+
+	r = kvm_prepare_dirty_bitmap(kvm, &chg.new);
+	if (r)
+		return r;
+
+	r = kvm_set_memslot(kvm, mem, &chg.old, &chg.new, chg.as_id,
+			    chg.change);
+	if (r)
+		goto out_bitmap;
+
+	if (chg.old.dirty_bitmap && !chg.new.dirty_bitmap)
+		kvm_destroy_dirty_bitmap(&chg.old);
 	return 0;
 
 out_bitmap:
-	if (new.dirty_bitmap && !old.dirty_bitmap)
-		kvm_destroy_dirty_bitmap(&new);
+	if (chg.new.dirty_bitmap && !chg.old.dirty_bitmap)
+		kvm_destroy_dirty_bitmap(&chg.new);
 	return r;
 }
 EXPORT_SYMBOL_GPL(__kvm_set_memory_region);
@@ -1407,6 +1808,407 @@ static int kvm_vm_ioctl_set_memory_region(struct kvm *kvm,
 	return kvm_set_memory_region(kvm, mem);
 }
 
+/*
+ * Apply the changes in @chgs, in order, like kvm_set_memslot() does for one
+ * change, but with the grace periods shared by all of them: one after marking
+ * the deleted and moved memslots invalid, if there are any, and one after
+ * installing the updated memslots.
+ */
+static int kvm_set_memslots(struct kvm *kvm, struct kvm_memslot_change *chgs,
+			    int nr)
+{
+	struct kvm_memslots *invalid[KVM_ADDRESS_SPACE_NUM] = {};
+	struct kvm_memslots *slots[KVM_ADDRESS_SPACE_NUM] = {};
+	struct kvm_memslots *pre[KVM_ADDRESS_SPACE_NUM] = {};
+	struct kvm_memslots *old[KVM_ADDRESS_SPACE_NUM] = {};
+	int nr_create[KVM_ADDRESS_SPACE_NUM] = {};
+	bool need_invalid = false;
+	struct kvm_memslot_change *chg;
+	struct kvm_memory_slot *slot;
+	int as_id, i, r = -ENOMEM;
+
+	for (chg = chgs; chg < chgs + nr; chg++) {
+		if (chg->change == KVM_MR_CREATE)
+			nr_create[chg->as_id]++;
+	}
+
+	/* Allocate everything upfront, before anything is installed. */
+	for (chg = chgs; chg < chgs + nr; chg++) {
+		as_id = chg->as_id;
+		if ((chg->change == KVM_MR_DELETE ||
+		     chg->change == KVM_MR_MOVE) && !invalid[as_id]) {
+			invalid[as_id] = kvm_get_inactive_memslots(kvm, as_id,
+								   KVM_MR_DELETE);
+			if (!invalid[as_id])
+				goto out_free;
+			need_invalid = true;
+		}
+	}
+
+	for (chg = chgs; chg < chgs + nr; chg++) {
+		as_id = chg->as_id;
+		/*
+		 * Without memslots to create, the memslots retired by
+		 * invalidating get updated, like in kvm_set_memslot().
+		 */
+		if (slots[as_id] || (invalid[as_id] && !nr_create[as_id]))
+			continue;
+
+		if (nr_create[as_id]) {
+			/* Goes stale, see kvm_get_inactive_memslots(). */
+			kvfree(kvm->spare_memslots[as_id]);
+			kvm->spare_memslots[as_id] = NULL;
+			slots[as_id] = __kvm_dup_memslots(__kvm_memslots(kvm, as_id),
+							  nr_create[as_id]);
+		} else {
+			slots[as_id] = kvm_get_inactive_memslots(kvm, as_id,
+								 KVM_MR_FLAGS_ONLY);
+		}
+		if (!slots[as_id])
+			goto out_free;
+	}
+
+	if (need_invalid) {
+		for (chg = chgs; chg < chgs + nr; chg++) {
+			if (chg->change != KVM_MR_DELETE &&
+			    chg->change != KVM_MR_MOVE)
+				continue;
+
+			slot = id_to_memslot(invalid[chg->as_id], chg->old.id);
+			slot->flags |= KVM_MEMSLOT_INVALID;
+		}
+
+		install_new_memslots_all(kvm, invalid, pre);
+
+		for (as_id = 0; as_id < KVM_ADDRESS_SPACE_NUM; as_id++) {
+			if (invalid[as_id] && !slots[as_id])
+				slots[as_id] = pre[as_id];
+		}
+
+		/* See kvm_set_memslot(). */
+		for (chg = chgs; chg < chgs + nr; chg++) {
+			if (chg->change == KVM_MR_DELETE ||
+			    chg->change == KVM_MR_MOVE)
+				kvm_arch_flush_shadow_memslot(kvm,
+					id_to_memslot(invalid[chg->as_id],
+						      chg->old.id));
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		chg = &chgs[i];
+		r = kvm_arch_prepare_memory_region(kvm, &chg->new, chg->mem,
+						   chg->change);
+		if (r)
+			goto out_unprepare;
+	}
+
+	for (chg = chgs; chg < chgs + nr; chg++)
+		update_memslots(slots[chg->as_id], &chg->new, chg->change);
+
+	install_new_memslots_all(kvm, slots, old);
+
+	for (chg = chgs; chg < chgs + nr; chg++)
+		kvm_arch_commit_memory_region(kvm, chg->mem, &chg->old,
+					      &chg->new, chg->change);
+
+	for (as_id = 0; as_id < KVM_ADDRESS_SPACE_NUM; as_id++) {
+		if (!slots[as_id])
+			continue;
+
+		/*
+		 * The retired memslots have no room for the new memslots, and
+		 * the ones retired by invalidating were only kept in case of
+		 * failure.
+		 */
+		if (nr_create[as_id]) {
+			kvfree(pre[as_id]);
+			kvfree(old[as_id]);
+			continue;
+		}
+
+		for (chg = chgs; chg < chgs + nr; chg++) {
+			if (chg->as_id == as_id)
+				update_memslots(old[as_id], &chg->new,
+						chg->change);
+		}
+		kvm->spare_memslots[as_id] = old[as_id];
+	}
+
+	return 0;
+
+out_unprepare:
+	/*
+	 * If the arch allocated metadata for a moved memslot, it differs from
+	 * the one of the old memslot, which is left alone.
+	 */
+	while (i--) {
+		chg = &chgs[i];
+		if ((chg->change == KVM_MR_CREATE ||
+		     chg->change == KVM_MR_MOVE) &&
+		    memcmp(&chg->new.arch, &chg->old.arch,
+			   sizeof(chg->new.arch)))
+			kvm_arch_free_memslot(kvm, &chg->new);
+	}
+
+	if (need_invalid) {
+		for (as_id = 0; as_id < KVM_ADDRESS_SPACE_NUM; as_id++) {
+			if (slots[as_id] == pre[as_id])
+				slots[as_id] = NULL;
+		}
+
+		/* Reinstall the memslots as they were, retiring the invalid ones. */
+		install_new_memslots_all(kvm, pre, invalid);
+	}
+out_free:
+	for (as_id = 0; as_id < KVM_ADDRESS_SPACE_NUM; as_id++) {
+		kvfree(invalid[as_id]);
+		kvfree(slots[as_id]);
+	}
+	return r;
+}
+
+/*
+ * Apply all of @mems, an array of @nr memslot updates, with a single pass of
+ * kvm_set_memslots().  Each memslot may appear only once, and overlaps are
+ * checked against the final layout, so memslots may trade places.
+ */
+static int kvm_set_memory_regions(struct kvm *kvm,
+				  const struct kvm_userspace_memory_region *mems,
+				  int nr)
+{
+	DECLARE_BITMAP(seen, KVM_ADDRESS_SPACE_NUM * KVM_MEM_SLOTS_NUM);
+	DECLARE_BITMAP(changed, KVM_ADDRESS_SPACE_NUM * KVM_MEM_SLOTS_NUM);
+	struct kvm_memslot_change *chgs, *chg, *tmp;
+	struct kvm_memory_slot *slot;
+	int i, nr_chgs = 0, r;
+
+	chgs = kvcalloc(nr, sizeof(*chgs), GFP_KERNEL_ACCOUNT);
+	if (!chgs)
+		return -ENOMEM;
+
+	bitmap_zero(seen, KVM_ADDRESS_SPACE_NUM * KVM_MEM_SLOTS_NUM);
+	bitmap_zero(changed, KVM_ADDRESS_SPACE_NUM * KVM_MEM_SLOTS_NUM);
+
+	for (i = 0; i < nr; i++) {
+		int bit;
+
+		chg = &chgs[nr_chgs];
+		r = kvm_check_memslot_change(kvm, &mems[i], chg);
+		if (r < 0)
+			goto out;
+
+		bit = chg->as_id * KVM_MEM_SLOTS_NUM + chg->old.id;
+		if (__test_and_set_bit(bit, seen)) {
+			r = -EINVAL;
+			goto out;
+		}
+
+		if (r) {
+			__set_bit(bit, changed);
+			nr_chgs++;
+		}
+	}
+
+	r = 0;
+	if (!nr_chgs)
+		goto out;
+
+	/*
+	 * The memslots being changed are checked against their new selves,
+	 * by the second loop.
+	 */
+	r = -EEXIST;
+	for (chg = chgs; chg < chgs + nr_chgs; chg++) {
+		if (chg->change != KVM_MR_CREATE && chg->change != KVM_MR_MOVE)
+			continue;
+
+		kvm_for_each_memslot(slot, __kvm_memslots(kvm, chg->as_id)) {
+			if (!test_bit(chg->as_id * KVM_MEM_SLOTS_NUM + slot->id,
+				      changed) &&
+			    kvm_memslots_overlap(slot, &chg->new))
+				goto out;
+		}
+
+		for (tmp = chgs; tmp < chgs + nr_chgs; tmp++) {
+			if (tmp != chg && tmp->as_id == chg->as_id &&
+			    tmp->change != KVM_MR_DELETE &&
+			    kvm_memslots_overlap(&tmp->new, &chg->new))
+				goto out;
+		}
+	}
+
+	for (i = 0; i < nr_chgs; i++) {
+		r = kvm_prepare_dirty_bitmap(kvm, &chgs[i].new);
+		if (r)
+			goto out_bitmap;
+	}
+
+	r = kvm_set_memslots(kvm, chgs, nr_chgs);
+	if (r)
+		goto out_bitmap;
+
+	for (chg = chgs; chg < chgs + nr_chgs; chg++) {
+		if (chg->change == KVM_MR_DELETE)
+			kvm_free_memslot(kvm, &chg->old);
+		else if (chg->old.dirty_bitmap && !chg->new.dirty_bitmap)
+			kvm_destroy_dirty_bitmap(&chg->old);
+	}
+	goto out;
+
+out_bitmap:
+	while (i--) {
+		chg = &chgs[i];
+		if (chg->new.dirty_bitmap && !chg->old.dirty_bitmap)
+			kvm_destroy_dirty_bitmap(&chg->new);
+	}
+out:
+	kvfree(chgs);
+	return r;
+}
+
+static int kvm_vm_ioctl_set_memory_regions(struct kvm *kvm,
+		struct kvm_userspace_memory_region_list __user *argp)
+{
+	struct kvm_userspace_memory_region_list list;
+	struct kvm_userspace_memory_region *mems;
+	u32 i;
+	int r;
+
+	if (copy_from_user(&list, argp, sizeof(list)))
+		return -EFAULT;
+
+	if (list.flags || !list.nent ||
+	    list.nent > KVM_ADDRESS_SPACE_NUM * KVM_USER_MEM_SLOTS)
+		return -EINVAL;
+
+	mems = vmemdup_user(argp->entries, array_size(sizeof(*mems), list.nent));
+	if (IS_ERR(mems))
+		return PTR_ERR(mems);
+
+	r = -EINVAL;
+	for (i = 0; i < list.nent; i++) {
+		if ((u16)mems[i].slot >= KVM_USER_MEM_SLOTS)
+			goto out;
+	}
+
+	mutex_lock(&kvm->slots_lock);
+	r = kvm_set_memory_regions(kvm, mems, list.nent);
+	mutex_unlock(&kvm->slots_lock);
+out:
+	kvfree(mems);
+	return r;
+}
+
+#if defined(CONFIG_MMU_NOTIFIER) && defined(KVM_ARCH_WANT_MMU_NOTIFIER)
+static int kvm_discard_range_cmp(const void *a, const void *b)
+{
+	const struct kvm_discard_range *ra = a, *rb = b;
+
+	if (ra->gpa < rb->gpa)
+		return -1;
+
+	return ra->gpa > rb->gpa;
+}
+
+/*
+ * Turn the guest ranges of @r, sorted by gpa, into the host virtual ranges
+ * backing them, in place and merging the adjacent ones, and zap the sptes of
+ * all of them with a single TLB flush.  The MMU notifiers of the madvise()
+ * calls that follow then find nothing left to zap and flush.
+ *
+ * Return: the number of host ranges, or -EINVAL
+ */
+static int kvm_discard_ranges_to_hva(struct kvm *kvm,
+				     struct kvm_discard_range *r, u32 nent)
+{
+	struct kvm_memory_slot *slot;
+	bool flush = false;
+	unsigned long hva;
+	int idx, n = 0;
+	u64 npages;
+	gfn_t gfn;
+	u32 i;
+
+	idx = srcu_read_lock(&kvm->srcu);
+
+	for (i = 0; i < nent; i++) {
+		if (!PAGE_ALIGNED(r[i].gpa) || !PAGE_ALIGNED(r[i].size) ||
+		    !r[i].size || r[i].gpa + r[i].size < r[i].gpa)
+			goto out_einval;
+
+		gfn = gpa_to_gfn(r[i].gpa);
+		npages = r[i].size >> PAGE_SHIFT;
+
+		slot = gfn_to_memslot(kvm, gfn);
+		if (!slot || slot->flags & (KVM_MEMSLOT_INVALID | KVM_MEM_READONLY) ||
+		    npages > slot->base_gfn + slot->npages - gfn)
+			goto out_einval;
+
+		hva = __gfn_to_hva_memslot(slot, gfn);
+		if (n && r[n - 1].gpa + r[n - 1].size == hva) {
+			r[n - 1].size += r[i].size;
+		} else {
+			r[n].gpa = hva;
+			r[n].size = r[i].size;
+			n++;
+		}
+	}
+
+	KVM_MMU_LOCK(kvm);
+	for (i = 0; i < n; i++)
+		flush |= kvm_unmap_hva_range(kvm, r[i].gpa, r[i].gpa + r[i].size,
+					     MMU_NOTIFIER_RANGE_BLOCKABLE);
+	if (flush)
+		kvm_flush_remote_tlbs(kvm);
+	KVM_MMU_UNLOCK(kvm);
+
+	srcu_read_unlock(&kvm->srcu, idx);
+	return n;
+
+out_einval:
+	srcu_read_unlock(&kvm->srcu, idx);
+	return -EINVAL;
+}
+
+static int kvm_vm_ioctl_discard_ranges(struct kvm *kvm,
+				       struct kvm_discard_ranges __user *argp)
+{
+	struct kvm_discard_ranges list;
+	struct kvm_discard_range *r;
+	int advice, n, i, ret;
+
+	if (copy_from_user(&list, argp, sizeof(list)))
+		return -EFAULT;
+
+	if (list.flags & ~KVM_DISCARD_RANGES_REMOVE || !list.nent ||
+	    list.nent > KVM_MAX_DISCARD_RANGES)
+		return -EINVAL;
+
+	r = vmemdup_user(argp->entries, array_size(sizeof(*r), list.nent));
+	if (IS_ERR(r))
+		return PTR_ERR(r);
+
+	sort(r, list.nent, sizeof(*r), kvm_discard_range_cmp, NULL);
+
+	n = kvm_discard_ranges_to_hva(kvm, r, list.nent);
+	if (n < 0) {
+		ret = n;
+		goto out;
+	}
+
+	advice = list.flags & KVM_DISCARD_RANGES_REMOVE ? MADV_REMOVE :
+							  MADV_DONTNEED;
+	for (i = 0, ret = 0; i < n && !ret; i++) {
+		ret = do_madvise(current->mm, r[i].gpa, r[i].size, advice);
+		cond_resched();
+	}
+out:
+	kvfree(r);
+	return ret;
+}
+#endif
+
 #ifndef CONFIG_KVM_GENERIC_DIRTYLOG_READ_PROTECT
 /**
  * kvm_get_dirty_log - get a snapshot of dirty pages
@@ -1423,6 +2225,10 @@ int kvm_get_dirty_log(struct kvm *kvm, struct kvm_dirty_log *log,
 	unsigned long n;
 	unsigned long any = 0;
 
+	/* Dirty ring tracking is exclusive to dirty log tracking */
+	if (kvm->dirty_ring_size)
+		return -ENXIO;
+
 	*memslot = NULL;
 	*is_dirty = 0;
 
@@ -1484,6 +2290,10 @@ static int kvm_get_dirty_log_protect(struct kvm *kvm, struct kvm_dirty_log *log)
 	unsigned long *dirty_bitmap_buffer;
 	bool flush;
 
+	/* Dirty ring tracking is exclusive to dirty log tracking */
+	if (kvm->dirty_ring_size)
+		return -ENXIO;
+
 	as_id = log->slot >> 16;
 	id = (u16)log->slot;
 	if (as_id >= KVM_ADDRESS_SPACE_NUM || id >= KVM_USER_MEM_SLOTS)
@@ -1514,7 +2324,7 @@ static int kvm_get_dirty_log_protect(struct kvm *kvm, struct kvm_dirty_log *log)
 		dirty_bitmap_buffer = kvm_second_dirty_bitmap(memslot);
 		memset(dirty_bitmap_buffer, 0, n);
 
-		spin_lock(&kvm->mmu_lock);
+		KVM_MMU_LOCK(kvm);
 		for (i = 0; i < n / sizeof(long); i++) {
 			unsigned long mask;
 			gfn_t offset;
@@ -1530,7 +2340,7 @@ static int kvm_get_dirty_log_protect(struct kvm *kvm, struct kvm_dirty_log *log)
 			kvm_arch_mmu_enable_log_dirty_pt_masked(kvm, memslot,
 								offset, mask);
 		}
-		spin_unlock(&kvm->mmu_lock);
+		KVM_MMU_UNLOCK(kvm);
 	}
 
 	if (flush)
@@ -1592,6 +2402,10 @@ static int kvm_clear_dirty_log_protect(struct kvm *kvm,
 	unsigned long *dirty_bitmap_buffer;
 	bool flush;
 
+	/* Dirty ring tracking is exclusive to dirty log tracking */
+	if (kvm->dirty_ring_size)
+		return -ENXIO;
+
 	as_id = log->slot >> 16;
 	id = (u16)log->slot;
 	if (as_id >= KVM_ADDRESS_SPACE_NUM || id >= KVM_USER_MEM_SLOTS)
@@ -1621,7 +2435,7 @@ static int kvm_clear_dirty_log_protect(struct kvm *kvm,
 	if (copy_from_user(dirty_bitmap_buffer, log->dirty_bitmap, n))
 		return -EFAULT;
 
-	spin_lock(&kvm->mmu_lock);
+	KVM_MMU_LOCK(kvm);
 	for (offset = log->first_page, i = offset / BITS_PER_LONG,
 		 n = DIV_ROUND_UP(log->num_pages, BITS_PER_LONG); n--;
 	     i++, offset += BITS_PER_LONG) {
@@ -1643,8 +2457,16 @@ static int kvm_clear_dirty_log_protect(struct kvm *kvm,
 			kvm_arch_mmu_enable_log_dirty_pt_masked(kvm, memslot,
 								offset, mask);
 		}
+
+		/*
+		 * Clearing a multi-terabyte slot in one go would keep faulting
+		 * vCPUs off mmu_lock for the whole walk.  Dropping the lock in
+		 * between words is safe: the bitmap is updated atomically and
+		 * the TLB flush below covers all SPTEs changed so far.
+		 */
+		KVM_MMU_COND_RESCHED(kvm);
 	}
-	spin_unlock(&kvm->mmu_lock);
+	KVM_MMU_UNLOCK(kvm);
 
 	if (flush)
 		kvm_arch_flush_remote_tlbs_memslot(kvm, memslot);
@@ -1666,6 +2488,69 @@ static int kvm_vm_ioctl_clear_dirty_log(struct kvm *kvm,
 }
 #endif /* CONFIG_KVM_GENERIC_DIRTYLOG_READ_PROTECT */
 
+#ifdef CONFIG_KVM_USERFAULT_BITMAP
+static int kvm_vm_ioctl_set_userfault_bitmap(struct kvm *kvm,
+					     struct kvm_userfault_bitmap *ufb)
+{
+	struct kvm_memory_slot *memslot;
+	u64 __user *bitmap;
+	int as_id, id, r;
+
+	if (ufb->flags)
+		return -EINVAL;
+
+	as_id = ufb->slot >> 16;
+	id = (u16)ufb->slot;
+	if (as_id >= KVM_ADDRESS_SPACE_NUM || id >= KVM_USER_MEM_SLOTS)
+		return -EINVAL;
+
+	bitmap = u64_to_user_ptr(ufb->bitmap);
+	if (!IS_ALIGNED((unsigned long)bitmap, sizeof(u64)))
+		return -EINVAL;
+
+	mutex_lock(&kvm->slots_lock);
+
+	r = -ENOENT;
+	memslot = id_to_memslot(__kvm_memslots(kvm, as_id), id);
+	if (!memslot)
+		goto out;
+
+	/*
+	 * Updating the live memslot is fine, memslot changes are serialized by
+	 * slots_lock and carry the pointer over.  Pages already mapped by the
+	 * guest would bypass the new bitmap, so zap them.
+	 */
+	WRITE_ONCE(memslot->userfault_bitmap, bitmap);
+	if (bitmap)
+		kvm_arch_flush_shadow_memslot(kvm, memslot);
+	r = 0;
+out:
+	mutex_unlock(&kvm->slots_lock);
+	return r;
+}
+
+/*
+ * Return true if @gfn is not yet present according to the userfault bitmap of
+ * @slot.  A bitmap that can't be read is reported as missing as well, so that
+ * userspace gets to see the problem.
+ */
+bool kvm_is_userfault_gfn(struct kvm_memory_slot *slot, gfn_t gfn)
+{
+	u64 __user *bitmap = READ_ONCE(slot->userfault_bitmap);
+	unsigned long rel_gfn = gfn - slot->base_gfn;
+	u64 word;
+
+	if (!bitmap)
+		return false;
+
+	if (get_user(word, bitmap + rel_gfn / 64))
+		return true;
+
+	return !(word & BIT_ULL(rel_gfn % 64));
+}
+EXPORT_SYMBOL_GPL(kvm_is_userfault_gfn);
+#endif /* CONFIG_KVM_USERFAULT_BITMAP */
+
 struct kvm_memory_slot *gfn_to_memslot(struct kvm *kvm, gfn_t gfn)
 {
 	return __gfn_to_memslot(kvm_memslots(kvm), gfn);
@@ -1674,7 +2559,25 @@ EXPORT_SYMBOL_GPL(gfn_to_memslot);
 
 struct kvm_memory_slot *kvm_vcpu_gfn_to_memslot(struct kvm_vcpu *vcpu, gfn_t gfn)
 {
-	return __gfn_to_memslot(kvm_vcpu_memslots(vcpu), gfn);
+	struct kvm_memslots *slots = kvm_vcpu_memslots(vcpu);
+	struct kvm_memory_slot *slot;
+	int slot_index;
+
+	slot = try_get_memslot(slots, vcpu->last_used_slot, gfn);
+	if (slot)
+		return slot;
+
+	/*
+	 * Fall back to searching all memslots, bypassing the VM-wide lru_slot
+	 * so that vCPUs working in different memslots don't thrash it, nor
+	 * bounce its cacheline.  A stale index, e.g. after a memslot update,
+	 * is harmless as try_get_memslot() checks the range of the slot.
+	 */
+	slot = __search_memslots(slots, gfn, &slot_index);
+	if (slot)
+		vcpu->last_used_slot = slot_index;
+
+	return slot;
 }
 EXPORT_SYMBOL_GPL(kvm_vcpu_gfn_to_memslot);
 
@@ -1946,8 +2849,8 @@ static int hva_to_pfn_remapped(struct vm_area_struct *vma,
  * 2): @write_fault = false && @writable, @writable will tell the caller
  *     whether the mapping is writable.
  */
-static kvm_pfn_t hva_to_pfn(unsigned long addr, bool atomic, bool *async,
-			bool write_fault, bool *writable)
+kvm_pfn_t hva_to_pfn(unsigned long addr, bool atomic, bool *async,
+		     bool write_fault, bool *writable)
 {
 	struct vm_area_struct *vma;
 	kvm_pfn_t pfn = 0;
@@ -1962,6 +2865,21 @@ static kvm_pfn_t hva_to_pfn(unsigned long addr, bool atomic, bool *async,
 	if (atomic)
 		return KVM_PFN_ERR_FAULT;
 
+	/*
+	 * Populate anonymous memory without mmap_lock, so that the vCPUs
+	 * don't have to wait for the VMM's mmap() and munmap() calls.
+	 */
+	if (write_fault) {
+		struct page *page;
+
+		might_sleep();
+		if (get_user_page_speculative(addr, FOLL_WRITE, &page)) {
+			if (writable)
+				*writable = true;
+			return page_to_pfn(page);
+		}
+	}
+
 	npages = hva_to_pfn_slow(addr, async, write_fault, writable, &pfn);
 	if (npages == 1)
 		return pfn;
@@ -2101,72 +3019,36 @@ struct page *gfn_to_page(struct kvm *kvm, gfn_t gfn)
 }
 EXPORT_SYMBOL_GPL(gfn_to_page);
 
-void kvm_release_pfn(kvm_pfn_t pfn, bool dirty, struct gfn_to_pfn_cache *cache)
+static void kvm_release_pfn(kvm_pfn_t pfn, bool dirty)
 {
 	if (pfn == 0)
 		return;
 
-	if (cache)
-		cache->pfn = cache->gfn = 0;
-
 	if (dirty)
 		kvm_release_pfn_dirty(pfn);
 	else
 		kvm_release_pfn_clean(pfn);
 }
 
-static void kvm_cache_gfn_to_pfn(struct kvm_memory_slot *slot, gfn_t gfn,
-				 struct gfn_to_pfn_cache *cache, u64 gen)
-{
-	kvm_release_pfn(cache->pfn, cache->dirty, cache);
-
-	cache->pfn = gfn_to_pfn_memslot(slot, gfn);
-	cache->gfn = gfn;
-	cache->dirty = false;
-	cache->generation = gen;
-}
-
-static int __kvm_map_gfn(struct kvm_memslots *slots, gfn_t gfn,
-			 struct kvm_host_map *map,
-			 struct gfn_to_pfn_cache *cache,
-			 bool atomic)
+int kvm_vcpu_map(struct kvm_vcpu *vcpu, gfn_t gfn, struct kvm_host_map *map)
 {
 	kvm_pfn_t pfn;
 	void *hva = NULL;
 	struct page *page = KVM_UNMAPPED_PAGE;
-	struct kvm_memory_slot *slot = __gfn_to_memslot(slots, gfn);
-	u64 gen = slots->generation;
 
 	if (!map)
 		return -EINVAL;
 
-	if (cache) {
-		if (!cache->pfn || cache->gfn != gfn ||
-			cache->generation != gen) {
-			if (atomic)
-				return -EAGAIN;
-			kvm_cache_gfn_to_pfn(slot, gfn, cache, gen);
-		}
-		pfn = cache->pfn;
-	} else {
-		if (atomic)
-			return -EAGAIN;
-		pfn = gfn_to_pfn_memslot(slot, gfn);
-	}
+	pfn = kvm_vcpu_gfn_to_pfn(vcpu, gfn);
 	if (is_error_noslot_pfn(pfn))
 		return -EINVAL;
 
 	if (pfn_valid(pfn)) {
 		page = pfn_to_page(pfn);
-		if (atomic)
-			hva = kmap_atomic(page);
-		else
-			hva = kmap(page);
+		hva = kmap(page);
 #ifdef CONFIG_HAS_IOMEM
-	} else if (!atomic) {
-		hva = memremap(pfn_to_hpa(pfn), PAGE_SIZE, MEMREMAP_WB);
 	} else {
-		return -EINVAL;
+		hva = memremap(pfn_to_hpa(pfn), PAGE_SIZE, MEMREMAP_WB);
 #endif
 	}
 
@@ -2180,26 +3062,9 @@ static int __kvm_map_gfn(struct kvm_memslots *slots, gfn_t gfn,
 
 	return 0;
 }
-
-int kvm_map_gfn(struct kvm_vcpu *vcpu, gfn_t gfn, struct kvm_host_map *map,
-		struct gfn_to_pfn_cache *cache, bool atomic)
-{
-	return __kvm_map_gfn(kvm_memslots(vcpu->kvm), gfn, map,
-			cache, atomic);
-}
-EXPORT_SYMBOL_GPL(kvm_map_gfn);
-
-int kvm_vcpu_map(struct kvm_vcpu *vcpu, gfn_t gfn, struct kvm_host_map *map)
-{
-	return __kvm_map_gfn(kvm_vcpu_memslots(vcpu), gfn, map,
-		NULL, false);
-}
 EXPORT_SYMBOL_GPL(kvm_vcpu_map);
 
-static void __kvm_unmap_gfn(struct kvm_memory_slot *memslot,
-			struct kvm_host_map *map,
-			struct gfn_to_pfn_cache *cache,
-			bool dirty, bool atomic)
+void kvm_vcpu_unmap(struct kvm_vcpu *vcpu, struct kvm_host_map *map, bool dirty)
 {
 	if (!map)
 		return;
@@ -2207,45 +3072,21 @@ static void __kvm_unmap_gfn(struct kvm_memory_slot *memslot,
 	if (!map->hva)
 		return;
 
-	if (map->page != KVM_UNMAPPED_PAGE) {
-		if (atomic)
-			kunmap_atomic(map->hva);
-		else
-			kunmap(map->page);
-	}
+	if (map->page != KVM_UNMAPPED_PAGE)
+		kunmap(map->page);
 #ifdef CONFIG_HAS_IOMEM
-	else if (!atomic)
-		memunmap(map->hva);
 	else
-		WARN_ONCE(1, "Unexpected unmapping in atomic context");
+		memunmap(map->hva);
 #endif
 
 	if (dirty)
-		mark_page_dirty_in_slot(memslot, map->gfn);
+		kvm_vcpu_mark_page_dirty(vcpu, map->gfn);
 
-	if (cache)
-		cache->dirty |= dirty;
-	else
-		kvm_release_pfn(map->pfn, dirty, NULL);
+	kvm_release_pfn(map->pfn, dirty);
 
 	map->hva = NULL;
 	map->page = NULL;
 }
-
-int kvm_unmap_gfn(struct kvm_vcpu *vcpu, struct kvm_host_map *map, 
-		  struct gfn_to_pfn_cache *cache, bool dirty, bool atomic)
-{
-	__kvm_unmap_gfn(gfn_to_memslot(vcpu->kvm, map->gfn), map,
-			cache, dirty, atomic);
-	return 0;
-}
-EXPORT_SYMBOL_GPL(kvm_unmap_gfn);
-
-void kvm_vcpu_unmap(struct kvm_vcpu *vcpu, struct kvm_host_map *map, bool dirty)
-{
-	__kvm_unmap_gfn(kvm_vcpu_gfn_to_memslot(vcpu, map->gfn), map, NULL,
-			dirty, false);
-}
 EXPORT_SYMBOL_GPL(kvm_vcpu_unmap);
 
 struct page *kvm_vcpu_gfn_to_page(struct kvm_vcpu *vcpu, gfn_t gfn)
@@ -2350,43 +3191,55 @@ int kvm_vcpu_read_guest_page(struct kvm_vcpu *vcpu, gfn_t gfn, void *data,
 }
 EXPORT_SYMBOL_GPL(kvm_vcpu_read_guest_page);
 
-int kvm_read_guest(struct kvm *kvm, gpa_t gpa, void *data, unsigned long len)
+/*
+ * The userspace mapping of a memslot is contiguous, so copy all of the range
+ * that a memslot covers with a single user copy and only look up another
+ * memslot when the range crosses into it.  @slot is the memslot of @gpa.
+ */
+static int __kvm_read_guest(struct kvm_memslots *slots,
+			    struct kvm_memory_slot *slot, gpa_t gpa,
+			    void *data, unsigned long len)
 {
 	gfn_t gfn = gpa >> PAGE_SHIFT;
-	int seg;
 	int offset = offset_in_page(gpa);
-	int ret;
+	unsigned long addr, seg;
+	gfn_t nr_pages;
+
+	while (len) {
+		addr = __gfn_to_hva_many(slot, gfn, &nr_pages, false);
+		if (kvm_is_error_hva(addr))
+			return -EFAULT;
+
+		seg = min_t(u64, len, (nr_pages << PAGE_SHIFT) - offset);
+		if (__copy_from_user(data, (void __user *)addr + offset, seg))
+			return -EFAULT;
 
-	while ((seg = next_segment(len, offset)) != 0) {
-		ret = kvm_read_guest_page(kvm, gfn, data, offset, seg);
-		if (ret < 0)
-			return ret;
-		offset = 0;
 		len -= seg;
 		data += seg;
-		++gfn;
+		gfn += nr_pages;
+		offset = 0;
+		if (len)
+			slot = __gfn_to_memslot(slots, gfn);
 	}
 	return 0;
 }
+
+int kvm_read_guest(struct kvm *kvm, gpa_t gpa, void *data, unsigned long len)
+{
+	gfn_t gfn = gpa >> PAGE_SHIFT;
+
+	return __kvm_read_guest(kvm_memslots(kvm), gfn_to_memslot(kvm, gfn),
+				gpa, data, len);
+}
 EXPORT_SYMBOL_GPL(kvm_read_guest);
 
 int kvm_vcpu_read_guest(struct kvm_vcpu *vcpu, gpa_t gpa, void *data, unsigned long len)
 {
 	gfn_t gfn = gpa >> PAGE_SHIFT;
-	int seg;
-	int offset = offset_in_page(gpa);
-	int ret;
 
-	while ((seg = next_segment(len, offset)) != 0) {
-		ret = kvm_vcpu_read_guest_page(vcpu, gfn, data, offset, seg);
-		if (ret < 0)
-			return ret;
-		offset = 0;
-		len -= seg;
-		data += seg;
-		++gfn;
-	}
-	return 0;
+	return __kvm_read_guest(kvm_vcpu_memslots(vcpu),
+				kvm_vcpu_gfn_to_memslot(vcpu, gfn),
+				gpa, data, len);
 }
 EXPORT_SYMBOL_GPL(kvm_vcpu_read_guest);
 
@@ -2418,7 +3271,8 @@ int kvm_vcpu_read_guest_atomic(struct kvm_vcpu *vcpu, gpa_t gpa,
 }
 EXPORT_SYMBOL_GPL(kvm_vcpu_read_guest_atomic);
 
-static int __kvm_write_guest_page(struct kvm_memory_slot *memslot, gfn_t gfn,
+static int __kvm_write_guest_page(struct kvm *kvm,
+				  struct kvm_memory_slot *memslot, gfn_t gfn,
 			          const void *data, int offset, int len)
 {
 	int r;
@@ -2430,7 +3284,7 @@ static int __kvm_write_guest_page(struct kvm_memory_slot *memslot, gfn_t gfn,
 	r = __copy_to_user((void __user *)addr + offset, data, len);
 	if (r)
 		return -EFAULT;
-	mark_page_dirty_in_slot(memslot, gfn);
+	mark_page_dirty_in_slot(kvm, memslot, gfn);
 	return 0;
 }
 
@@ -2439,7 +3293,7 @@ int kvm_write_guest_page(struct kvm *kvm, gfn_t gfn,
 {
 	struct kvm_memory_slot *slot = gfn_to_memslot(kvm, gfn);
 
-	return __kvm_write_guest_page(slot, gfn, data, offset, len);
+	return __kvm_write_guest_page(kvm, slot, gfn, data, offset, len);
 }
 EXPORT_SYMBOL_GPL(kvm_write_guest_page);
 
@@ -2448,49 +3302,66 @@ int kvm_vcpu_write_guest_page(struct kvm_vcpu *vcpu, gfn_t gfn,
 {
 	struct kvm_memory_slot *slot = kvm_vcpu_gfn_to_memslot(vcpu, gfn);
 
-	return __kvm_write_guest_page(slot, gfn, data, offset, len);
+	return __kvm_write_guest_page(vcpu->kvm, slot, gfn, data, offset, len);
 }
 EXPORT_SYMBOL_GPL(kvm_vcpu_write_guest_page);
 
-int kvm_write_guest(struct kvm *kvm, gpa_t gpa, const void *data,
-		    unsigned long len)
+/* Like __kvm_read_guest(), one user copy per memslot covered by the range. */
+static int __kvm_write_guest(struct kvm *kvm, struct kvm_memslots *slots,
+			     struct kvm_memory_slot *slot, gpa_t gpa,
+			     const void *data, unsigned long len)
 {
 	gfn_t gfn = gpa >> PAGE_SHIFT;
-	int seg;
 	int offset = offset_in_page(gpa);
-	int ret;
+	unsigned long addr, seg;
+	gfn_t nr_pages, i;
+	int r;
+
+	while (len) {
+		addr = __gfn_to_hva_many(slot, gfn, &nr_pages, true);
+		if (kvm_is_error_hva(addr))
+			return -EFAULT;
+
+		seg = min_t(u64, len, (nr_pages << PAGE_SHIFT) - offset);
+		r = __copy_to_user((void __user *)addr + offset, data, seg);
+
+		/*
+		 * A failed copy may still have written part of the range, and
+		 * marking a page that wasn't written is harmless.
+		 */
+		for (i = 0; i < DIV_ROUND_UP(offset + seg, PAGE_SIZE); i++)
+			mark_page_dirty_in_slot(kvm, slot, gfn + i);
+		if (r)
+			return -EFAULT;
 
-	while ((seg = next_segment(len, offset)) != 0) {
-		ret = kvm_write_guest_page(kvm, gfn, data, offset, seg);
-		if (ret < 0)
-			return ret;
-		offset = 0;
 		len -= seg;
 		data += seg;
-		++gfn;
+		gfn += nr_pages;
+		offset = 0;
+		if (len)
+			slot = __gfn_to_memslot(slots, gfn);
 	}
 	return 0;
 }
+
+int kvm_write_guest(struct kvm *kvm, gpa_t gpa, const void *data,
+		    unsigned long len)
+{
+	gfn_t gfn = gpa >> PAGE_SHIFT;
+
+	return __kvm_write_guest(kvm, kvm_memslots(kvm),
+				 gfn_to_memslot(kvm, gfn), gpa, data, len);
+}
 EXPORT_SYMBOL_GPL(kvm_write_guest);
 
 int kvm_vcpu_write_guest(struct kvm_vcpu *vcpu, gpa_t gpa, const void *data,
 		         unsigned long len)
 {
 	gfn_t gfn = gpa >> PAGE_SHIFT;
-	int seg;
-	int offset = offset_in_page(gpa);
-	int ret;
 
-	while ((seg = next_segment(len, offset)) != 0) {
-		ret = kvm_vcpu_write_guest_page(vcpu, gfn, data, offset, seg);
-		if (ret < 0)
-			return ret;
-		offset = 0;
-		len -= seg;
-		data += seg;
-		++gfn;
-	}
-	return 0;
+	return __kvm_write_guest(vcpu->kvm, kvm_vcpu_memslots(vcpu),
+				 kvm_vcpu_gfn_to_memslot(vcpu, gfn),
+				 gpa, data, len);
 }
 EXPORT_SYMBOL_GPL(kvm_vcpu_write_guest);
 
@@ -2567,7 +3438,7 @@ int kvm_write_guest_offset_cached(struct kvm *kvm, struct gfn_to_hva_cache *ghc,
 	r = __copy_to_user((void __user *)ghc->hva + offset, data, len);
 	if (r)
 		return -EFAULT;
-	mark_page_dirty_in_slot(ghc->memslot, gpa >> PAGE_SHIFT);
+	mark_page_dirty_in_slot(kvm, ghc->memslot, gpa >> PAGE_SHIFT);
 
 	return 0;
 }
@@ -2643,12 +3514,26 @@ int kvm_clear_guest(struct kvm *kvm, gpa_t gpa, unsigned long len)
 }
 EXPORT_SYMBOL_GPL(kvm_clear_guest);
 
-void mark_page_dirty_in_slot(struct kvm_memory_slot *memslot, gfn_t gfn)
+void mark_page_dirty_in_slot(struct kvm *kvm, struct kvm_memory_slot *memslot,
+			     gfn_t gfn)
 {
-	if (memslot && memslot->dirty_bitmap) {
+	struct kvm_vcpu *vcpu;
+
+	if (memslot && kvm_slot_dirty_track_enabled(memslot)) {
 		unsigned long rel_gfn = gfn - memslot->base_gfn;
+		u32 slot = (memslot->as_id << 16) | memslot->id;
 
-		set_bit_le(rel_gfn, memslot->dirty_bitmap);
+		if (!kvm->dirty_ring_size) {
+			set_bit_le(rel_gfn, memslot->dirty_bitmap);
+			return;
+		}
+
+		/* Only a running vCPU can have its ring written. */
+		vcpu = kvm_get_running_vcpu();
+		if (WARN_ON_ONCE(!vcpu || vcpu->kvm != kvm))
+			return;
+
+		kvm_dirty_ring_push(&vcpu->dirty_ring, slot, rel_gfn);
 	}
 }
 EXPORT_SYMBOL_GPL(mark_page_dirty_in_slot);
@@ -2658,7 +3543,7 @@ void mark_page_dirty(struct kvm *kvm, gfn_t gfn)
 	struct kvm_memory_slot *memslot;
 
 	memslot = gfn_to_memslot(kvm, gfn);
-	mark_page_dirty_in_slot(memslot, gfn);
+	mark_page_dirty_in_slot(kvm, memslot, gfn);
 }
 EXPORT_SYMBOL_GPL(mark_page_dirty);
 
@@ -2667,7 +3552,7 @@ void kvm_vcpu_mark_page_dirty(struct kvm_vcpu *vcpu, gfn_t gfn)
 	struct kvm_memory_slot *memslot;
 
 	memslot = kvm_vcpu_gfn_to_memslot(vcpu, gfn);
-	mark_page_dirty_in_slot(memslot, gfn);
+	mark_page_dirty_in_slot(vcpu->kvm, memslot, gfn);
 }
 EXPORT_SYMBOL_GPL(kvm_vcpu_mark_page_dirty);
 
@@ -2760,6 +3645,82 @@ update_halt_poll_stats(struct kvm_vcpu *vcpu, u64 poll_ns, bool waited)
 		vcpu->stat.halt_poll_success_ns += poll_ns;
 }
 
+/*
+ * Bucket i of the halt-polling histogram holds the block times below
+ * 2^(i + 11) ns, i.e. roughly 2^(i + 1) us, that didn't fit in bucket i - 1.
+ * The last bucket holds all longer block times, and the wakeups that polling
+ * couldn't have caught.
+ */
+#define HALT_POLL_HIST_MAX_SAMPLES	1024
+
+static u64 halt_poll_hist_edge_ns(int i)
+{
+	return 1ull << (i + 11);
+}
+
+static void halt_poll_hist_record(struct kvm_vcpu *vcpu, u64 block_ns,
+				  bool valid)
+{
+	struct kvm_halt_poll_hist *hist = &vcpu->halt_poll_hist;
+	u64 us = block_ns >> 10;
+	int i;
+
+	if (!valid)
+		i = KVM_HALT_POLL_HIST_BUCKETS - 1;
+	else if (!us)
+		i = 0;
+	else
+		i = min_t(int, ilog2(us), KVM_HALT_POLL_HIST_BUCKETS - 1);
+
+	hist->count[i]++;
+
+	/* Halve the counts every now and then, so that old samples fade. */
+	if (++hist->total >= HALT_POLL_HIST_MAX_SAMPLES) {
+		hist->total = 0;
+		for (i = 0; i < KVM_HALT_POLL_HIST_BUCKETS; i++) {
+			hist->count[i] >>= 1;
+			hist->total += hist->count[i];
+		}
+	}
+}
+
+/*
+ * Return the polling window that catches the most wakeups per nanosecond of
+ * polling. Polling up to the upper edge of bucket k catches the wakeups in
+ * buckets 0..k, at the cost of their block time, and wastes the whole window
+ * on every other halt. Ties go to the shorter window, and no wakeup caught
+ * means no polling.
+ */
+static unsigned int halt_poll_hist_window(struct kvm_vcpu *vcpu)
+{
+	struct kvm_halt_poll_hist *hist = &vcpu->halt_poll_hist;
+	u64 max_ns = vcpu->kvm->max_halt_poll_ns;
+	u64 hits = 0, hit_ns = 0, cost;
+	u64 best_hits = 0, best_cost = 1;
+	unsigned int window = 0;
+	int i;
+
+	for (i = 0; i < KVM_HALT_POLL_HIST_BUCKETS - 1; i++) {
+		u64 edge = halt_poll_hist_edge_ns(i);
+
+		if (edge > max_ns)
+			break;
+
+		hits += hist->count[i];
+		/* Assume that the wakeups are spread evenly in the bucket. */
+		hit_ns += (u64)hist->count[i] * (3 * edge / 4);
+		cost = hit_ns + (hist->total - hits) * edge;
+
+		if (hits * best_cost > best_hits * cost) {
+			best_hits = hits;
+			best_cost = cost;
+			window = edge;
+		}
+	}
+
+	return window;
+}
+
 /*
  * The vCPU has executed a HLT instruction with in-kernel mode enabled.
  */
@@ -2793,6 +3754,13 @@ void kvm_vcpu_block(struct kvm_vcpu *vcpu)
 
 	prepare_to_rcuwait(&vcpu->wait);
 	for (;;) {
+		/*
+		 * Re-arm the wakeup before checking for events, so that the
+		 * wakers coalesced into the previous wakeup, see
+		 * kvm_vcpu_wake_up(), are seen by the check. Pairs with the
+		 * cmpxchg() in kvm_vcpu_wake_up().
+		 */
+		WRITE_ONCE(vcpu->block_state, KVM_VCPU_BLOCKED);
 		set_current_state(TASK_INTERRUPTIBLE);
 
 		if (kvm_vcpu_check_block(vcpu) < 0)
@@ -2802,6 +3770,8 @@ void kvm_vcpu_block(struct kvm_vcpu *vcpu)
 		schedule();
 	}
 	finish_rcuwait(&vcpu->wait);
+	/* Have the wakers kick the vCPU again from now on. */
+	smp_store_mb(vcpu->block_state, KVM_VCPU_NOT_BLOCKED);
 	cur = ktime_get();
 out:
 	kvm_arch_vcpu_unblocking(vcpu);
@@ -2811,7 +3781,11 @@ void kvm_vcpu_block(struct kvm_vcpu *vcpu)
 		vcpu, ktime_to_ns(ktime_sub(poll_end, start)), waited);
 
 	if (!kvm_arch_no_poll(vcpu)) {
-		if (!vcpu_valid_wakeup(vcpu)) {
+		halt_poll_hist_record(vcpu, block_ns, vcpu_valid_wakeup(vcpu));
+
+		if (READ_ONCE(halt_poll_adaptive)) {
+			vcpu->halt_poll_ns = halt_poll_hist_window(vcpu);
+		} else if (!vcpu_valid_wakeup(vcpu)) {
 			shrink_halt_poll_ns(vcpu);
 		} else if (vcpu->kvm->max_halt_poll_ns) {
 			if (block_ns <= vcpu->halt_poll_ns)
@@ -2838,6 +3812,18 @@ bool kvm_vcpu_wake_up(struct kvm_vcpu *vcpu)
 {
 	struct rcuwait *waitp;
 
+	/*
+	 * A vCPU blocked in kvm_vcpu_block(), which has already been woken up
+	 * but has not checked for events yet, will see the event of this waker
+	 * too. Don't wake it up or kick it again, e.g. when an irqfd, a timer
+	 * and a posted interrupt fire in a row.
+	 */
+	if (cmpxchg(&vcpu->block_state, KVM_VCPU_BLOCKED,
+		    KVM_VCPU_WAKING) == KVM_VCPU_WAKING) {
+		++vcpu->stat.halt_wakeup_coalesced;
+		return true;
+	}
+
 	waitp = kvm_arch_vcpu_get_wait(vcpu);
 	if (rcuwait_wake_up(waitp)) {
 		WRITE_ONCE(vcpu->ready, true);
@@ -2963,6 +3949,16 @@ void kvm_vcpu_on_spin(struct kvm_vcpu *me, bool yield_to_kernel_mode)
 	int i;
 
 	kvm_vcpu_set_in_spin_loop(me, true);
+
+	/*
+	 * If the guest told us which vCPU holds the lock, boost it directly
+	 * instead of guessing, provided that it's waiting for a physical CPU.
+	 */
+	vcpu = READ_ONCE(me->lock_holder_hint);
+	if (vcpu && vcpu != me && READ_ONCE(vcpu->ready) &&
+	    kvm_vcpu_yield_to(vcpu) > 0)
+		yielded = 1;
+
 	/*
 	 * We boost the priority of a VCPU that is runnable but not
 	 * currently running, because it got preempted by something
@@ -3008,6 +4004,17 @@ void kvm_vcpu_on_spin(struct kvm_vcpu *me, bool yield_to_kernel_mode)
 }
 EXPORT_SYMBOL_GPL(kvm_vcpu_on_spin);
 
+static bool kvm_page_in_dirty_ring(struct kvm *kvm, unsigned long pgoff)
+{
+#if KVM_DIRTY_LOG_PAGE_OFFSET > 0
+	return (pgoff >= KVM_DIRTY_LOG_PAGE_OFFSET) &&
+	    (pgoff < KVM_DIRTY_LOG_PAGE_OFFSET +
+	     kvm->dirty_ring_size / PAGE_SIZE);
+#else
+	return false;
+#endif
+}
+
 static vm_fault_t kvm_vcpu_fault(struct vm_fault *vmf)
 {
 	struct kvm_vcpu *vcpu = vmf->vma->vm_file->private_data;
@@ -3021,8 +4028,13 @@ static vm_fault_t kvm_vcpu_fault(struct vm_fault *vmf)
 #endif
 #ifdef CONFIG_KVM_MMIO
 	else if (vmf->pgoff == KVM_COALESCED_MMIO_PAGE_OFFSET)
-		page = virt_to_page(vcpu->kvm->coalesced_mmio_ring);
+		page = virt_to_page(vcpu->coalesced_mmio_ring ?:
+				    vcpu->kvm->coalesced_mmio_ring);
 #endif
+	else if (kvm_page_in_dirty_ring(vcpu->kvm, vmf->pgoff))
+		page = kvm_dirty_ring_get_page(
+		    &vcpu->dirty_ring,
+		    vmf->pgoff - KVM_DIRTY_LOG_PAGE_OFFSET);
 	else
 		return kvm_arch_vcpu_fault(vcpu, vmf);
 	get_page(page);
@@ -3036,6 +4048,15 @@ static const struct vm_operations_struct kvm_vcpu_vm_ops = {
 
 static int kvm_vcpu_mmap(struct file *file, struct vm_area_struct *vma)
 {
+	struct kvm_vcpu *vcpu = file->private_data;
+	unsigned long pages = (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+
+	/* The dirty ring can only be shared with userspace, never executed. */
+	if ((kvm_page_in_dirty_ring(vcpu->kvm, vma->vm_pgoff) ||
+	     kvm_page_in_dirty_ring(vcpu->kvm, vma->vm_pgoff + pages - 1)) &&
+	    ((vma->vm_flags & VM_EXEC) || !(vma->vm_flags & VM_SHARED)))
+		return -EINVAL;
+
 	vma->vm_ops = &kvm_vcpu_vm_ops;
 	return 0;
 }
@@ -3067,9 +4088,24 @@ static int create_vcpu_fd(struct kvm_vcpu *vcpu)
 	return anon_inode_getfd(name, &kvm_vcpu_fops, vcpu, O_RDWR | O_CLOEXEC);
 }
 
+static int vcpu_halt_poll_hist_show(struct seq_file *m, void *v)
+{
+	struct kvm_vcpu *vcpu = m->private;
+	struct kvm_halt_poll_hist *hist = &vcpu->halt_poll_hist;
+	int i;
+
+	for (i = 0; i < KVM_HALT_POLL_HIST_BUCKETS - 1; i++)
+		seq_printf(m, "<%llu %u\n", halt_poll_hist_edge_ns(i),
+			   READ_ONCE(hist->count[i]));
+	seq_printf(m, "inf %u\n", READ_ONCE(hist->count[i]));
+	seq_printf(m, "halt_poll_ns %u\n", READ_ONCE(vcpu->halt_poll_ns));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(vcpu_halt_poll_hist);
+
 static void kvm_create_vcpu_debugfs(struct kvm_vcpu *vcpu)
 {
-#ifdef __KVM_HAVE_ARCH_VCPU_DEBUGFS
 	struct dentry *debugfs_dentry;
 	char dir_name[ITOA_MAX_LEN * 2];
 
@@ -3080,6 +4116,10 @@ static void kvm_create_vcpu_debugfs(struct kvm_vcpu *vcpu)
 	debugfs_dentry = debugfs_create_dir(dir_name,
 					    vcpu->kvm->debugfs_dentry);
 
+	debugfs_create_file("halt_poll_hist", 0444, debugfs_dentry, vcpu,
+			    &vcpu_halt_poll_hist_fops);
+
+#ifdef __KVM_HAVE_ARCH_VCPU_DEBUGFS
 	kvm_arch_create_vcpu_debugfs(vcpu, debugfs_dentry);
 #endif
 }
@@ -3093,96 +4133,367 @@ static int kvm_vm_ioctl_create_vcpu(struct kvm *kvm, u32 id)
 	struct kvm_vcpu *vcpu;
 	struct page *page;
 
-	if (id >= KVM_MAX_VCPU_ID)
-		return -EINVAL;
+	if (id >= KVM_MAX_VCPU_ID)
+		return -EINVAL;
+
+	mutex_lock(&kvm->lock);
+	if (kvm->created_vcpus == KVM_MAX_VCPUS) {
+		mutex_unlock(&kvm->lock);
+		return -EINVAL;
+	}
+
+	kvm->created_vcpus++;
+	mutex_unlock(&kvm->lock);
+
+	/*
+	 * kvm->lock is only held to reserve a slot above and to publish the
+	 * vCPU below.  Everything in between can run concurrently for several
+	 * vCPUs of the same VM, so arch code must not assume creation is
+	 * serialized.
+	 */
+	r = kvm_arch_vcpu_precreate(kvm, id);
+	if (r)
+		goto vcpu_decrement;
+
+	vcpu = kmem_cache_zalloc(kvm_vcpu_cache, GFP_KERNEL);
+	if (!vcpu) {
+		r = -ENOMEM;
+		goto vcpu_decrement;
+	}
+
+	BUILD_BUG_ON(sizeof(struct kvm_run) > PAGE_SIZE);
+	page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	if (!page) {
+		r = -ENOMEM;
+		goto vcpu_free;
+	}
+	vcpu->run = page_address(page);
+
+	kvm_vcpu_init(vcpu, kvm, id);
+
+	r = kvm_arch_vcpu_create(vcpu);
+	if (r)
+		goto vcpu_free_run_page;
+
+	if (kvm->dirty_ring_size) {
+		r = kvm_dirty_ring_alloc(&vcpu->dirty_ring,
+					 id, kvm->dirty_ring_size);
+		if (r)
+			goto arch_vcpu_destroy;
+	}
+
+	r = kvm_coalesced_mmio_vcpu_init(vcpu);
+	if (r)
+		goto dirty_ring_free;
+
+	mutex_lock(&kvm->lock);
+	if (kvm_get_vcpu_by_id(kvm, id)) {
+		r = -EEXIST;
+		goto unlock_vcpu_destroy;
+	}
+
+	vcpu->vcpu_idx = atomic_read(&kvm->online_vcpus);
+	BUG_ON(kvm->vcpus[vcpu->vcpu_idx]);
+
+	/* Now it's all set up, let userspace reach it */
+	kvm_get_kvm(kvm);
+	r = create_vcpu_fd(vcpu);
+	if (r < 0) {
+		kvm_put_kvm_no_destroy(kvm);
+		goto unlock_vcpu_destroy;
+	}
+
+	kvm->vcpus[vcpu->vcpu_idx] = vcpu;
+
+	/*
+	 * Pairs with smp_rmb() in kvm_get_vcpu.  Write kvm->vcpus
+	 * before kvm->online_vcpu's incremented value.
+	 */
+	smp_wmb();
+	atomic_inc(&kvm->online_vcpus);
+
+	mutex_unlock(&kvm->lock);
+	kvm_arch_vcpu_postcreate(vcpu);
+	kvm_create_vcpu_debugfs(vcpu);
+	return r;
+
+unlock_vcpu_destroy:
+	mutex_unlock(&kvm->lock);
+	kvm_coalesced_mmio_vcpu_free(vcpu);
+dirty_ring_free:
+	kvm_dirty_ring_free(&vcpu->dirty_ring);
+arch_vcpu_destroy:
+	kvm_arch_vcpu_destroy(vcpu);
+vcpu_free_run_page:
+	free_page((unsigned long)vcpu->run);
+vcpu_free:
+	kmem_cache_free(kvm_vcpu_cache, vcpu);
+vcpu_decrement:
+	mutex_lock(&kvm->lock);
+	kvm->created_vcpus--;
+	mutex_unlock(&kvm->lock);
+	return r;
+}
+
+static int kvm_vcpu_ioctl_set_sigmask(struct kvm_vcpu *vcpu, sigset_t *sigset)
+{
+	if (sigset) {
+		sigdelsetmask(sigset, sigmask(SIGKILL)|sigmask(SIGSTOP));
+		vcpu->sigset_active = 1;
+		vcpu->sigset = *sigset;
+	} else
+		vcpu->sigset_active = 0;
+	return 0;
+}
+
+#ifdef CONFIG_KVM_GENERIC_PRE_FAULT_MEMORY
+static int kvm_vcpu_pre_fault_memory(struct kvm_vcpu *vcpu,
+				     struct kvm_pre_fault_memory *range)
+{
+	int idx;
+	long r;
+	u64 full_size;
+
+	if (range->flags)
+		return -EINVAL;
+
+	if (!PAGE_ALIGNED(range->gpa) ||
+	    !PAGE_ALIGNED(range->size) ||
+	    range->gpa + range->size <= range->gpa)
+		return -EINVAL;
+
+	vcpu_load(vcpu);
+	idx = srcu_read_lock(&vcpu->kvm->srcu);
+
+	full_size = range->size;
+	do {
+		if (signal_pending(current)) {
+			r = -EINTR;
+			break;
+		}
+
+		r = kvm_arch_vcpu_pre_fault_memory(vcpu, range);
+		if (WARN_ON_ONCE(r == 0 || r == -EIO))
+			break;
+
+		if (r < 0)
+			break;
+
+		range->size -= r;
+		range->gpa += r;
+		cond_resched();
+	} while (range->size);
+
+	srcu_read_unlock(&vcpu->kvm->srcu, idx);
+	vcpu_put(vcpu);
+
+	/* Return success if at least one page was mapped successfully.  */
+	return full_size == range->size ? r : 0;
+}
+#endif
+
+struct kvm_stats_file {
+	struct kvm *kvm;
+	struct kvm_vcpu *vcpu;
+	size_t data_offset;
+	size_t size;
+	void *buf;		/* header, id and descriptors */
+	u32 num_values;
+	const void *values[];	/* each u64 of the data block */
+};
+
+static u64 kvm_stats_value(struct kvm_stats_file *stats, u32 i)
+{
+	if (stats->vcpu)
+		return READ_ONCE(*(const u64 *)stats->values[i]);
+
+	return READ_ONCE(*(const ulong *)stats->values[i]);
+}
+
+/*
+ * The number of histograms of @vcpu that are only in its binary stats, and
+ * the number of buckets of each of them.
+ */
+unsigned int __weak kvm_arch_vcpu_nr_stats_hist(struct kvm_vcpu *vcpu,
+						u16 *size)
+{
+	return 0;
+}
+
+/*
+ * Fill in the flags, exponent, bucket shift and name of the @i-th histogram
+ * of @vcpu and return its buckets.
+ */
+u64 * __weak kvm_arch_vcpu_stats_hist(struct kvm_vcpu *vcpu, unsigned int i,
+				      struct kvm_stats_desc *desc)
+{
+	return NULL;
+}
+
+static ssize_t kvm_stats_read(struct file *file, char __user *user_buffer,
+			      size_t size, loff_t *offset)
+{
+	struct kvm_stats_file *stats = file->private_data;
+	size_t copied = 0, len, skip;
+	loff_t pos = *offset;
+	u64 val;
+	u32 i;
+
+	if (pos < 0)
+		return -EINVAL;
+	if (pos >= stats->size)
+		return 0;
+
+	size = min_t(size_t, size, stats->size - pos);
+
+	if (pos < stats->data_offset) {
+		len = min_t(size_t, size, stats->data_offset - pos);
+		if (copy_to_user(user_buffer, stats->buf + pos, len))
+			return -EFAULT;
+		copied += len;
+		pos += len;
+	}
+
+	/* The values are read at the time of the read, one at a time. */
+	while (copied < size) {
+		i = (pos - stats->data_offset) / sizeof(u64);
+		skip = (pos - stats->data_offset) % sizeof(u64);
+		len = min_t(size_t, sizeof(u64) - skip, size - copied);
+
+		val = kvm_stats_value(stats, i);
+		if (copy_to_user(user_buffer + copied, (void *)&val + skip, len))
+			return -EFAULT;
+		copied += len;
+		pos += len;
+	}
+
+	*offset = pos;
+	return copied;
+}
+
+static int kvm_stats_release(struct inode *inode, struct file *file)
+{
+	struct kvm_stats_file *stats = file->private_data;
+
+	kvm_put_kvm(stats->kvm);
+	kvfree(stats->buf);
+	kfree(stats);
+	return 0;
+}
+
+static const struct file_operations kvm_stats_fops = {
+	.read		= kvm_stats_read,
+	.release	= kvm_stats_release,
+	.llseek		= noop_llseek,
+};
+
+/*
+ * Describe the stats in debugfs_entries that belong to @vcpu, or to @kvm if
+ * @vcpu is NULL, and the histograms of @vcpu, so that they can be read with a
+ * single pread().
+ */
+static int kvm_stats_fd_create(struct kvm *kvm, struct kvm_vcpu *vcpu)
+{
+	enum kvm_stat_kind kind = vcpu ? KVM_STAT_VCPU : KVM_STAT_VM;
+	size_t desc_size = sizeof(struct kvm_stats_desc) + KVM_STATS_NAME_SIZE;
+	struct kvm_stats_debugfs_item *p;
+	struct kvm_stats_header *header;
+	struct kvm_stats_file *stats;
+	struct kvm_stats_desc *desc;
+	u32 num_desc = 0, num_values, i = 0, j, k, v = 0;
+	unsigned int nr_hist = 0;
+	u16 hist_size = 0;
+	struct file *file;
+	u64 *hist;
+	int fd;
+
+	for (p = debugfs_entries; p->name; p++)
+		num_desc += p->kind == kind;
 
-	mutex_lock(&kvm->lock);
-	if (kvm->created_vcpus == KVM_MAX_VCPUS) {
-		mutex_unlock(&kvm->lock);
-		return -EINVAL;
-	}
+	if (vcpu)
+		nr_hist = kvm_arch_vcpu_nr_stats_hist(vcpu, &hist_size);
 
-	kvm->created_vcpus++;
-	mutex_unlock(&kvm->lock);
+	num_values = num_desc + nr_hist * hist_size;
+	num_desc += nr_hist;
 
-	r = kvm_arch_vcpu_precreate(kvm, id);
-	if (r)
-		goto vcpu_decrement;
+	stats = kzalloc(struct_size(stats, values, num_values),
+			GFP_KERNEL_ACCOUNT);
+	if (!stats)
+		return -ENOMEM;
 
-	vcpu = kmem_cache_zalloc(kvm_vcpu_cache, GFP_KERNEL);
-	if (!vcpu) {
-		r = -ENOMEM;
-		goto vcpu_decrement;
-	}
+	stats->kvm = kvm;
+	stats->vcpu = vcpu;
+	stats->num_values = num_values;
+	stats->data_offset = sizeof(*header) + KVM_STATS_NAME_SIZE +
+			     num_desc * desc_size;
+	stats->size = stats->data_offset + num_values * sizeof(u64);
 
-	BUILD_BUG_ON(sizeof(struct kvm_run) > PAGE_SIZE);
-	page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-	if (!page) {
-		r = -ENOMEM;
-		goto vcpu_free;
+	stats->buf = kvzalloc(stats->data_offset, GFP_KERNEL_ACCOUNT);
+	if (!stats->buf) {
+		kfree(stats);
+		return -ENOMEM;
 	}
-	vcpu->run = page_address(page);
 
-	kvm_vcpu_init(vcpu, kvm, id);
+	header = stats->buf;
+	header->name_size = KVM_STATS_NAME_SIZE;
+	header->num_desc = num_desc;
+	header->id_offset = sizeof(*header);
+	header->desc_offset = header->id_offset + KVM_STATS_NAME_SIZE;
+	header->data_offset = stats->data_offset;
 
-	r = kvm_arch_vcpu_create(vcpu);
-	if (r)
-		goto vcpu_free_run_page;
+	if (vcpu)
+		snprintf(stats->buf + header->id_offset, KVM_STATS_NAME_SIZE,
+			 "kvm-%d/vcpu-%d", task_pid_nr(current), vcpu->vcpu_id);
+	else
+		snprintf(stats->buf + header->id_offset, KVM_STATS_NAME_SIZE,
+			 "kvm-%d", task_pid_nr(current));
 
-	mutex_lock(&kvm->lock);
-	if (kvm_get_vcpu_by_id(kvm, id)) {
-		r = -EEXIST;
-		goto unlock_vcpu_destroy;
-	}
+	for (p = debugfs_entries; p->name; p++) {
+		if (p->kind != kind)
+			continue;
 
-	vcpu->vcpu_idx = atomic_read(&kvm->online_vcpus);
-	BUG_ON(kvm->vcpus[vcpu->vcpu_idx]);
+		desc = stats->buf + header->desc_offset + i++ * desc_size;
+		desc->flags = p->flags;
+		desc->size = 1;
+		desc->exponent = p->exponent;
+		desc->offset = v * sizeof(u64);
+		strscpy(desc->name, p->name, KVM_STATS_NAME_SIZE);
+		stats->values[v++] = (vcpu ? (void *)vcpu : (void *)kvm) +
+				     p->offset;
+	}
 
-	/* Now it's all set up, let userspace reach it */
-	kvm_get_kvm(kvm);
-	r = create_vcpu_fd(vcpu);
-	if (r < 0) {
-		kvm_put_kvm_no_destroy(kvm);
-		goto unlock_vcpu_destroy;
+	for (j = 0; j < nr_hist; j++) {
+		desc = stats->buf + header->desc_offset + i++ * desc_size;
+		hist = kvm_arch_vcpu_stats_hist(vcpu, j, desc);
+		desc->size = hist_size;
+		desc->offset = v * sizeof(u64);
+		for (k = 0; k < hist_size; k++)
+			stats->values[v++] = &hist[k];
 	}
 
-	kvm->vcpus[vcpu->vcpu_idx] = vcpu;
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0)
+		goto out_free;
 
-	/*
-	 * Pairs with smp_rmb() in kvm_get_vcpu.  Write kvm->vcpus
-	 * before kvm->online_vcpu's incremented value.
-	 */
-	smp_wmb();
-	atomic_inc(&kvm->online_vcpus);
+	file = anon_inode_getfile(vcpu ? "kvm-vcpu-stats" : "kvm-vm-stats",
+				  &kvm_stats_fops, stats, O_RDONLY);
+	if (IS_ERR(file)) {
+		put_unused_fd(fd);
+		fd = PTR_ERR(file);
+		goto out_free;
+	}
 
-	mutex_unlock(&kvm->lock);
-	kvm_arch_vcpu_postcreate(vcpu);
-	kvm_create_vcpu_debugfs(vcpu);
-	return r;
+	/* The stats are meant to be read with pread(), at fixed offsets. */
+	file->f_mode |= FMODE_PREAD;
 
-unlock_vcpu_destroy:
-	mutex_unlock(&kvm->lock);
-	kvm_arch_vcpu_destroy(vcpu);
-vcpu_free_run_page:
-	free_page((unsigned long)vcpu->run);
-vcpu_free:
-	kmem_cache_free(kvm_vcpu_cache, vcpu);
-vcpu_decrement:
-	mutex_lock(&kvm->lock);
-	kvm->created_vcpus--;
-	mutex_unlock(&kvm->lock);
-	return r;
-}
+	kvm_get_kvm(kvm);
+	fd_install(fd, file);
+	return fd;
 
-static int kvm_vcpu_ioctl_set_sigmask(struct kvm_vcpu *vcpu, sigset_t *sigset)
-{
-	if (sigset) {
-		sigdelsetmask(sigset, sigmask(SIGKILL)|sigmask(SIGSTOP));
-		vcpu->sigset_active = 1;
-		vcpu->sigset = *sigset;
-	} else
-		vcpu->sigset_active = 0;
-	return 0;
+out_free:
+	kvfree(stats->buf);
+	kfree(stats);
+	return fd;
 }
 
 static long kvm_vcpu_ioctl(struct file *filp,
@@ -3227,6 +4538,13 @@ static long kvm_vcpu_ioctl(struct file *filp,
 
 			newpid = get_task_pid(current, PIDTYPE_PID);
 			rcu_assign_pointer(vcpu->pid, newpid);
+			/* Keep the vCPUs of the VM close on wakeup, see WA_GROUP. */
+			sched_set_wake_group(current, vcpu->kvm);
+#ifdef CONFIG_SCHED_CORE
+			if (vcpu->kvm->core_cookie)
+				sched_core_set_cookie(current,
+						      vcpu->kvm->core_cookie);
+#endif
 			if (oldpid)
 				synchronize_rcu();
 			put_pid(oldpid);
@@ -3382,6 +4700,23 @@ static long kvm_vcpu_ioctl(struct file *filp,
 		r = kvm_arch_vcpu_ioctl_set_fpu(vcpu, fpu);
 		break;
 	}
+#ifdef CONFIG_KVM_GENERIC_PRE_FAULT_MEMORY
+	case KVM_PRE_FAULT_MEMORY: {
+		struct kvm_pre_fault_memory range;
+
+		r = -EFAULT;
+		if (copy_from_user(&range, argp, sizeof(range)))
+			break;
+		r = kvm_vcpu_pre_fault_memory(vcpu, &range);
+		/* Pass back leftover range. */
+		if (copy_to_user(argp, &range, sizeof(range)))
+			r = -EFAULT;
+		break;
+	}
+#endif
+	case KVM_GET_STATS_FD:
+		r = kvm_stats_fd_create(vcpu->kvm, vcpu);
+		break;
 	default:
 		r = kvm_arch_vcpu_ioctl(filp, ioctl, arg);
 	}
@@ -3613,12 +4948,20 @@ static long kvm_vm_ioctl_check_extension_generic(struct kvm *kvm, long arg)
 	case KVM_CAP_CHECK_EXTENSION_VM:
 	case KVM_CAP_ENABLE_CAP_VM:
 	case KVM_CAP_HALT_POLL:
+	case KVM_CAP_BINARY_STATS_FD:
+	case KVM_CAP_MEMSLOT_NUMA_BOUND:
 		return 1;
+#ifdef CONFIG_KVM_USERFAULT_BITMAP
+	case KVM_CAP_USERFAULT_BITMAP:
+		return 1;
+#endif
 #ifdef CONFIG_KVM_MMIO
 	case KVM_CAP_COALESCED_MMIO:
 		return KVM_COALESCED_MMIO_PAGE_OFFSET;
 	case KVM_CAP_COALESCED_PIO:
 		return 1;
+	case KVM_CAP_COALESCED_MMIO_VCPU_RING:
+		return KVM_COALESCED_MMIO_MAX;
 #endif
 #ifdef CONFIG_KVM_GENERIC_DIRTYLOG_READ_PROTECT
 	case KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2:
@@ -3628,12 +4971,28 @@ static long kvm_vm_ioctl_check_extension_generic(struct kvm *kvm, long arg)
 	case KVM_CAP_IRQ_ROUTING:
 		return KVM_MAX_IRQ_ROUTES;
 #endif
+#ifdef CONFIG_HAVE_KVM_MSI
+	case KVM_CAP_MSI_BATCH:
+		return KVM_MAX_MSI_BATCH;
+#endif
 #if KVM_ADDRESS_SPACE_NUM > 1
 	case KVM_CAP_MULTI_ADDRESS_SPACE:
 		return KVM_ADDRESS_SPACE_NUM;
 #endif
 	case KVM_CAP_NR_MEMSLOTS:
 		return KVM_USER_MEM_SLOTS;
+	case KVM_CAP_SET_USER_MEMORY_REGIONS:
+		return KVM_ADDRESS_SPACE_NUM * KVM_USER_MEM_SLOTS;
+#if defined(CONFIG_MMU_NOTIFIER) && defined(KVM_ARCH_WANT_MMU_NOTIFIER)
+	case KVM_CAP_DISCARD_RANGES:
+		return KVM_MAX_DISCARD_RANGES;
+#endif
+	case KVM_CAP_DIRTY_LOG_RING:
+#if KVM_DIRTY_LOG_PAGE_OFFSET > 0
+		return KVM_DIRTY_RING_MAX_ENTRIES * sizeof(struct kvm_dirty_gfn);
+#else
+		return 0;
+#endif
 	default:
 		break;
 	}
@@ -3646,6 +5005,66 @@ int __attribute__((weak)) kvm_vm_ioctl_enable_cap(struct kvm *kvm,
 	return -EINVAL;
 }
 
+static int kvm_vm_ioctl_enable_dirty_log_ring(struct kvm *kvm, u32 size)
+{
+	int r;
+
+	if (!KVM_DIRTY_LOG_PAGE_OFFSET)
+		return -EINVAL;
+
+	/* the size should be power of 2 */
+	if (!size || (size & (size - 1)))
+		return -EINVAL;
+
+	/* Should be bigger to keep the reserved entries, or a page */
+	if (size < kvm_dirty_ring_get_rsvd_entries() *
+	    sizeof(struct kvm_dirty_gfn) || size < PAGE_SIZE)
+		return -EINVAL;
+
+	if (size > KVM_DIRTY_RING_MAX_ENTRIES *
+	    sizeof(struct kvm_dirty_gfn))
+		return -E2BIG;
+
+	/* We only allow it to set once */
+	if (kvm->dirty_ring_size)
+		return -EINVAL;
+
+	mutex_lock(&kvm->lock);
+
+	if (kvm->created_vcpus) {
+		/* We don't allow to change this value after vcpu created */
+		r = -EINVAL;
+	} else {
+		kvm->dirty_ring_size = size;
+		r = 0;
+	}
+
+	mutex_unlock(&kvm->lock);
+	return r;
+}
+
+static int kvm_vm_ioctl_reset_dirty_pages(struct kvm *kvm)
+{
+	int i;
+	struct kvm_vcpu *vcpu;
+	int cleared = 0;
+
+	if (!kvm->dirty_ring_size)
+		return -EINVAL;
+
+	mutex_lock(&kvm->slots_lock);
+
+	kvm_for_each_vcpu(i, vcpu, kvm)
+		cleared += kvm_dirty_ring_reset(vcpu->kvm, &vcpu->dirty_ring);
+
+	mutex_unlock(&kvm->slots_lock);
+
+	if (cleared)
+		kvm_flush_remote_tlbs(kvm);
+
+	return cleared;
+}
+
 static int kvm_vm_ioctl_enable_cap_generic(struct kvm *kvm,
 					   struct kvm_enable_cap *cap)
 {
@@ -3670,11 +5089,53 @@ static int kvm_vm_ioctl_enable_cap_generic(struct kvm *kvm,
 		kvm->max_halt_poll_ns = cap->args[0];
 		return 0;
 	}
+	case KVM_CAP_DIRTY_LOG_RING:
+		return kvm_vm_ioctl_enable_dirty_log_ring(kvm, cap->args[0]);
+#ifdef CONFIG_KVM_MMIO
+	case KVM_CAP_COALESCED_MMIO_VCPU_RING:
+		if (cap->flags & ~KVM_COALESCED_MMIO_VCPU_RING_FENCE)
+			return -EINVAL;
+		return kvm_vm_ioctl_enable_coalesced_mmio_vcpu_ring(kvm,
+								    cap->args[0],
+								    cap->args[1],
+								    cap->flags);
+#endif
 	default:
 		return kvm_vm_ioctl_enable_cap(kvm, cap);
 	}
 }
 
+#ifdef CONFIG_HAVE_KVM_MSI
+/*
+ * Inject a batch of MSIs with a single ioctl. Repeated interrupts to the same
+ * vCPU don't cost more than one kick, as the vCPU is only kicked while it's
+ * in guest mode and posted interrupts only notify once per pending vector set.
+ * Return the number of MSIs processed, which is less than batch->nr if an
+ * entry was invalid.
+ */
+static int kvm_vm_ioctl_inject_msi_batch(struct kvm *kvm,
+					 struct kvm_msi_batch *batch,
+					 struct kvm_msi __user *entries)
+{
+	struct kvm_msi msi;
+	int i, r;
+
+	if (batch->flags || batch->nr > KVM_MAX_MSI_BATCH)
+		return -EINVAL;
+
+	for (i = 0; i < batch->nr; i++) {
+		if (copy_from_user(&msi, &entries[i], sizeof(msi)))
+			return i ? i : -EFAULT;
+
+		r = kvm_send_userspace_msi(kvm, &msi);
+		if (r == -EINVAL)
+			return i ? i : r;
+	}
+
+	return i;
+}
+#endif
+
 static long kvm_vm_ioctl(struct file *filp,
 			   unsigned int ioctl, unsigned long arg)
 {
@@ -3708,6 +5169,14 @@ static long kvm_vm_ioctl(struct file *filp,
 		r = kvm_vm_ioctl_set_memory_region(kvm, &kvm_userspace_mem);
 		break;
 	}
+	case KVM_SET_USER_MEMORY_REGIONS:
+		r = kvm_vm_ioctl_set_memory_regions(kvm, argp);
+		break;
+#if defined(CONFIG_MMU_NOTIFIER) && defined(KVM_ARCH_WANT_MMU_NOTIFIER)
+	case KVM_DISCARD_RANGES:
+		r = kvm_vm_ioctl_discard_ranges(kvm, argp);
+		break;
+#endif
 	case KVM_GET_DIRTY_LOG: {
 		struct kvm_dirty_log log;
 
@@ -3728,6 +5197,17 @@ static long kvm_vm_ioctl(struct file *filp,
 		break;
 	}
 #endif
+#ifdef CONFIG_KVM_USERFAULT_BITMAP
+	case KVM_SET_USERFAULT_BITMAP: {
+		struct kvm_userfault_bitmap ufb;
+
+		r = -EFAULT;
+		if (copy_from_user(&ufb, argp, sizeof(ufb)))
+			goto out;
+		r = kvm_vm_ioctl_set_userfault_bitmap(kvm, &ufb);
+		break;
+	}
+#endif
 #ifdef CONFIG_KVM_MMIO
 	case KVM_REGISTER_COALESCED_MMIO: {
 		struct kvm_coalesced_mmio_zone zone;
@@ -3776,6 +5256,16 @@ static long kvm_vm_ioctl(struct file *filp,
 		r = kvm_send_userspace_msi(kvm, &msi);
 		break;
 	}
+	case KVM_INJECT_MSI_BATCH: {
+		struct kvm_msi_batch __user *ubatch = argp;
+		struct kvm_msi_batch batch;
+
+		r = -EFAULT;
+		if (copy_from_user(&batch, ubatch, sizeof(batch)))
+			goto out;
+		r = kvm_vm_ioctl_inject_msi_batch(kvm, &batch, ubatch->entries);
+		break;
+	}
 #endif
 #ifdef __KVM_HAVE_IRQ_LINE
 	case KVM_IRQ_LINE_STATUS:
@@ -3854,6 +5344,12 @@ static long kvm_vm_ioctl(struct file *filp,
 	case KVM_CHECK_EXTENSION:
 		r = kvm_vm_ioctl_check_extension_generic(kvm, arg);
 		break;
+	case KVM_RESET_DIRTY_RINGS:
+		r = kvm_vm_ioctl_reset_dirty_pages(kvm);
+		break;
+	case KVM_GET_STATS_FD:
+		r = kvm_stats_fd_create(kvm, NULL);
+		break;
 	default:
 		r = kvm_arch_vm_ioctl(filp, ioctl, arg);
 	}
@@ -4154,6 +5650,139 @@ static int kvm_io_bus_sort_cmp(const void *p1, const void *p2)
 	return kvm_io_bus_cmp(p1, p2);
 }
 
+static unsigned int kvm_io_bus_nr_buckets(int dev_count)
+{
+	return dev_count ? roundup_pow_of_two(2 * dev_count) : 0;
+}
+
+static struct kvm_io_bus *kvm_io_bus_alloc(int dev_count)
+{
+	struct kvm_io_bus *bus;
+
+	return kmalloc(struct_size(bus, range, dev_count) +
+		       kvm_io_bus_nr_buckets(dev_count) * sizeof(*bus->hash),
+		       GFP_KERNEL_ACCOUNT);
+}
+
+static u32 kvm_io_bus_hash_key(gpa_t addr, int len, bool has_datamatch,
+			       u64 datamatch, unsigned int bits)
+{
+	u64 key = hash_64(addr ^ ((u64)len << 32), 64);
+
+	if (has_datamatch)
+		key = hash_64(key ^ datamatch, 64);
+
+	return key >> (64 - bits);
+}
+
+/*
+ * Index every device by its exact address, length and datamatch.  Lookups
+ * probe linearly until they reach an empty bucket; there are always at least
+ * twice as many buckets as devices.
+ */
+static void kvm_io_bus_hash_build(struct kvm_io_bus *bus)
+{
+	unsigned int nr_buckets = kvm_io_bus_nr_buckets(bus->dev_count);
+	struct kvm_io_range *range;
+	u32 mask = nr_buckets - 1;
+	u32 b;
+	int i;
+
+	if (!nr_buckets) {
+		bus->hash = NULL;
+		bus->hash_bits = 0;
+		return;
+	}
+
+	bus->hash = (int *)&bus->range[bus->dev_count];
+	bus->hash_bits = ilog2(nr_buckets);
+	memset(bus->hash, -1, nr_buckets * sizeof(*bus->hash));
+
+	for (i = 0; i < bus->dev_count; i++) {
+		range = &bus->range[i];
+		b = kvm_io_bus_hash_key(range->addr, range->len,
+					range->has_datamatch, range->datamatch,
+					bus->hash_bits);
+		while (bus->hash[b] >= 0)
+			b = (b + 1) & mask;
+		bus->hash[b] = i;
+	}
+}
+
+/*
+ * Try the devices whose range and datamatch are exactly those of the write,
+ * e.g. the ioeventfd of a virtqueue doorbell.  Returns the index of the device
+ * that accepted the write, or -EOPNOTSUPP if none did, in which case the
+ * caller falls back to the sorted search; devices that reject a write have
+ * no side effects, so trying them twice is harmless.
+ */
+static int kvm_io_bus_hash_write(struct kvm_vcpu *vcpu, struct kvm_io_bus *bus,
+				 gpa_t addr, int len, bool has_datamatch,
+				 u64 datamatch, const void *val)
+{
+	u32 mask = (1U << bus->hash_bits) - 1;
+	struct kvm_io_range *range;
+	u32 b;
+	int idx;
+
+	b = kvm_io_bus_hash_key(addr, len, has_datamatch, datamatch,
+				bus->hash_bits);
+	for ( ; (idx = bus->hash[b]) >= 0; b = (b + 1) & mask) {
+		range = &bus->range[idx];
+		if (range->addr != addr || range->len != len ||
+		    range->has_datamatch != has_datamatch ||
+		    (has_datamatch && range->datamatch != datamatch))
+			continue;
+
+		if (!kvm_iodevice_write(vcpu, range->dev, addr, len, val))
+			return idx;
+	}
+
+	return -EOPNOTSUPP;
+}
+
+static int kvm_io_bus_hash_dispatch(struct kvm_vcpu *vcpu,
+				    struct kvm_io_bus *bus,
+				    struct kvm_io_range *range, const void *val)
+{
+	u64 data;
+	int idx;
+
+	if (!bus->hash)
+		return -EOPNOTSUPP;
+
+	switch (range->len) {
+	case 1:
+		data = *(u8 *)val;
+		break;
+	case 2:
+		data = *(u16 *)val;
+		break;
+	case 4:
+		data = *(u32 *)val;
+		break;
+	case 8:
+		data = *(u64 *)val;
+		break;
+	default:
+		goto no_datamatch;
+	}
+
+	idx = kvm_io_bus_hash_write(vcpu, bus, range->addr, range->len, true,
+				    data, val);
+	if (idx >= 0)
+		return idx;
+
+no_datamatch:
+	idx = kvm_io_bus_hash_write(vcpu, bus, range->addr, range->len, false,
+				    0, val);
+	if (idx >= 0 || !range->len)
+		return idx;
+
+	/* Zero-length devices match any write to their address. */
+	return kvm_io_bus_hash_write(vcpu, bus, range->addr, 0, false, 0, val);
+}
+
 static int kvm_io_bus_get_first_dev(struct kvm_io_bus *bus,
 			     gpa_t addr, int len)
 {
@@ -4183,6 +5812,10 @@ static int __kvm_io_bus_write(struct kvm_vcpu *vcpu, struct kvm_io_bus *bus,
 {
 	int idx;
 
+	idx = kvm_io_bus_hash_dispatch(vcpu, bus, range, val);
+	if (idx >= 0)
+		return idx;
+
 	idx = kvm_io_bus_get_first_dev(bus, range->addr, range->len);
 	if (idx < 0)
 		return -EOPNOTSUPP;
@@ -4289,9 +5922,9 @@ int kvm_io_bus_read(struct kvm_vcpu *vcpu, enum kvm_bus bus_idx, gpa_t addr,
 	return r < 0 ? r : 0;
 }
 
-/* Caller must hold slots_lock. */
-int kvm_io_bus_register_dev(struct kvm *kvm, enum kvm_bus bus_idx, gpa_t addr,
-			    int len, struct kvm_io_device *dev)
+static int __kvm_io_bus_register_dev(struct kvm *kvm, enum kvm_bus bus_idx,
+				     gpa_t addr, int len, bool has_datamatch,
+				     u64 datamatch, struct kvm_io_device *dev)
 {
 	int i;
 	struct kvm_io_bus *new_bus, *bus;
@@ -4305,14 +5938,15 @@ int kvm_io_bus_register_dev(struct kvm *kvm, enum kvm_bus bus_idx, gpa_t addr,
 	if (bus->dev_count - bus->ioeventfd_count > NR_IOBUS_DEVS - 1)
 		return -ENOSPC;
 
-	new_bus = kmalloc(struct_size(bus, range, bus->dev_count + 1),
-			  GFP_KERNEL_ACCOUNT);
+	new_bus = kvm_io_bus_alloc(bus->dev_count + 1);
 	if (!new_bus)
 		return -ENOMEM;
 
 	range = (struct kvm_io_range) {
 		.addr = addr,
 		.len = len,
+		.has_datamatch = has_datamatch,
+		.datamatch = datamatch,
 		.dev = dev,
 	};
 
@@ -4325,6 +5959,7 @@ int kvm_io_bus_register_dev(struct kvm *kvm, enum kvm_bus bus_idx, gpa_t addr,
 	new_bus->range[i] = range;
 	memcpy(new_bus->range + i + 1, bus->range + i,
 		(bus->dev_count - i) * sizeof(struct kvm_io_range));
+	kvm_io_bus_hash_build(new_bus);
 	rcu_assign_pointer(kvm->buses[bus_idx], new_bus);
 	synchronize_srcu_expedited(&kvm->srcu);
 	kfree(bus);
@@ -4332,6 +5967,26 @@ int kvm_io_bus_register_dev(struct kvm *kvm, enum kvm_bus bus_idx, gpa_t addr,
 	return 0;
 }
 
+/* Caller must hold slots_lock. */
+int kvm_io_bus_register_dev(struct kvm *kvm, enum kvm_bus bus_idx, gpa_t addr,
+			    int len, struct kvm_io_device *dev)
+{
+	return __kvm_io_bus_register_dev(kvm, bus_idx, addr, len, false, 0, dev);
+}
+
+/*
+ * Same as kvm_io_bus_register_dev(), for a device that only accepts writes
+ * of @datamatch.  Such writes are dispatched to the device in constant time.
+ * Caller must hold slots_lock.
+ */
+int kvm_io_bus_register_dev_datamatch(struct kvm *kvm, enum kvm_bus bus_idx,
+				      gpa_t addr, int len, u64 datamatch,
+				      struct kvm_io_device *dev)
+{
+	return __kvm_io_bus_register_dev(kvm, bus_idx, addr, len, true,
+					 datamatch, dev);
+}
+
 /* Caller must hold slots_lock. */
 void kvm_io_bus_unregister_dev(struct kvm *kvm, enum kvm_bus bus_idx,
 			       struct kvm_io_device *dev)
@@ -4351,13 +6006,13 @@ void kvm_io_bus_unregister_dev(struct kvm *kvm, enum kvm_bus bus_idx,
 	if (i == bus->dev_count)
 		return;
 
-	new_bus = kmalloc(struct_size(bus, range, bus->dev_count - 1),
-			  GFP_KERNEL_ACCOUNT);
+	new_bus = kvm_io_bus_alloc(bus->dev_count - 1);
 	if (new_bus) {
 		memcpy(new_bus, bus, struct_size(bus, range, i));
 		new_bus->dev_count--;
 		memcpy(new_bus->range + i, bus->range + i + 1,
 				flex_array_size(new_bus, range, new_bus->dev_count - i));
+		kvm_io_bus_hash_build(new_bus);
 	} else {
 		pr_err("kvm: failed to shrink bus, removing it completely\n");
 		for (j = 0; j < bus->dev_count; j++) {
@@ -4792,9 +6447,17 @@ int kvm_init(void *opaque, unsigned vcpu_size, unsigned vcpu_align,
 		goto out_free_0;
 	}
 
+	for_each_possible_cpu(cpu) {
+		if (!alloc_cpumask_var_node(&per_cpu(cpu_kick_mask, cpu),
+					    GFP_KERNEL, cpu_to_node(cpu))) {
+			r = -ENOMEM;
+			goto out_free_kick_mask;
+		}
+	}
+
 	r = kvm_arch_hardware_setup(opaque);
 	if (r < 0)
-		goto out_free_1;
+		goto out_free_kick_mask;
 
 	c.ret = &r;
 	c.opaque = opaque;
@@ -4859,7 +6522,9 @@ int kvm_init(void *opaque, unsigned vcpu_size, unsigned vcpu_align,
 	cpuhp_remove_state_nocalls(CPUHP_AP_KVM_STARTING);
 out_free_2:
 	kvm_arch_hardware_unsetup();
-out_free_1:
+out_free_kick_mask:
+	for_each_possible_cpu(cpu)
+		free_cpumask_var(per_cpu(cpu_kick_mask, cpu));
 	free_cpumask_var(cpus_hardware_enabled);
 out_free_0:
 	kvm_irqfd_exit();
@@ -4872,6 +6537,8 @@ EXPORT_SYMBOL_GPL(kvm_init);
 
 void kvm_exit(void)
 {
+	int cpu;
+
 	debugfs_remove_recursive(kvm_debugfs_dir);
 	misc_deregister(&kvm_dev);
 	kmem_cache_destroy(kvm_vcpu_cache);
@@ -4883,6 +6550,8 @@ void kvm_exit(void)
 	kvm_arch_hardware_unsetup();
 	kvm_arch_exit();
 	kvm_irqfd_exit();
+	for_each_possible_cpu(cpu)
+		free_cpumask_var(per_cpu(cpu_kick_mask, cpu));
 	free_cpumask_var(cpus_hardware_enabled);
 	kvm_vfio_ops_exit();
 }
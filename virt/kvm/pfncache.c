@@ -0,0 +1,343 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KVM gfn_to_pfn_cache implementation
+ *
+ * Kernel mappings of guest pages that KVM itself reads and writes on most
+ * exits, e.g. steal time.  The pages are not pinned: the mapping is looked up
+ * once and stays valid until the MMU notifier reports a change to the host
+ * mapping, or the memslots change.
+ */
+#include <linux/kvm_host.h>
+#include <linux/kvm.h>
+#include <linux/highmem.h>
+#include <linux/io.h>
+
+#include "kvm_mm.h"
+
+/*
+ * Called from the invalidate_range_start() MMU notifier, after
+ * mmu_notifier_count has been raised.
+ */
+void gfn_to_pfn_cache_invalidate_start(struct kvm *kvm, unsigned long start,
+				       unsigned long end)
+{
+	struct gfn_to_pfn_cache *gpc;
+
+	spin_lock(&kvm->gpc_lock);
+	list_for_each_entry(gpc, &kvm->gpc_list, list) {
+		write_lock_irq(&gpc->lock);
+		if (gpc->valid && !is_error_noslot_pfn(gpc->pfn) &&
+		    gpc->uhva >= start && gpc->uhva < end)
+			gpc->valid = false;
+		write_unlock_irq(&gpc->lock);
+	}
+	spin_unlock(&kvm->gpc_lock);
+}
+
+/**
+ * kvm_gpc_check() - Check whether a gfn_to_pfn_cache can be accessed
+ * @gpc:	the cache
+ * @len:	number of bytes that will be accessed at @gpc->khva
+ *
+ * The caller must hold @gpc->lock for read, and keep holding it while
+ * accessing @gpc->khva.  If the check fails, the lock must be dropped
+ * before calling kvm_gpc_refresh().
+ */
+bool kvm_gpc_check(struct gfn_to_pfn_cache *gpc, unsigned long len)
+{
+	struct kvm_memslots *slots = kvm_memslots(gpc->kvm);
+
+	if (!gpc->active || !gpc->valid)
+		return false;
+
+	if (offset_in_page(gpc->gpa) + len > PAGE_SIZE)
+		return false;
+
+	return gpc->generation == slots->generation &&
+	       !kvm_is_error_hva(gpc->uhva);
+}
+EXPORT_SYMBOL_GPL(kvm_gpc_check);
+
+static void *gpc_map(kvm_pfn_t pfn)
+{
+	if (pfn_valid(pfn))
+		return kmap(pfn_to_page(pfn));
+#ifdef CONFIG_HAS_IOMEM
+	return memremap(pfn_to_hpa(pfn), PAGE_SIZE, MEMREMAP_WB);
+#else
+	return NULL;
+#endif
+}
+
+static void gpc_unmap(kvm_pfn_t pfn, void *khva)
+{
+	if (is_error_noslot_pfn(pfn) || !khva)
+		return;
+
+	if (pfn_valid(pfn)) {
+		kunmap(pfn_to_page(pfn));
+		return;
+	}
+#ifdef CONFIG_HAS_IOMEM
+	memunmap(khva);
+#endif
+}
+
+static bool gpc_invalidate_retry(struct kvm *kvm, unsigned long mmu_seq)
+{
+	/*
+	 * gpc->lock is held instead of mmu_lock.  That is enough, because
+	 * invalidations take gpc->lock after raising mmu_notifier_count, and
+	 * clear gpc->valid if the count is missed here.
+	 */
+	if (kvm->mmu_notifier_count)
+		return true;
+
+	smp_rmb();
+	return kvm->mmu_notifier_seq != mmu_seq;
+}
+
+/*
+ * Look up and map the pfn behind gpc->uhva.  Called and returns with
+ * gpc->lock held for write, but drops it while faulting in the page.
+ */
+static int gpc_map_retry(struct gfn_to_pfn_cache *gpc)
+{
+	void *old_khva = gpc->khva - offset_in_page(gpc->khva);
+	kvm_pfn_t new_pfn = KVM_PFN_ERR_FAULT;
+	void *new_khva = NULL;
+	unsigned long mmu_seq;
+
+	lockdep_assert_held(&gpc->refresh_lock);
+	lockdep_assert_held_write(&gpc->lock);
+
+	/*
+	 * The gpa and uhva are already updated, make concurrent readers fail
+	 * kvm_gpc_check() until the new pfn is in place.
+	 */
+	gpc->valid = false;
+
+	do {
+		mmu_seq = gpc->kvm->mmu_notifier_seq;
+		smp_rmb();
+
+		write_unlock_irq(&gpc->lock);
+
+		/* An invalidation raced with the previous attempt. */
+		if (new_pfn != KVM_PFN_ERR_FAULT) {
+			if (new_khva != old_khva)
+				gpc_unmap(new_pfn, new_khva);
+			kvm_release_pfn_clean(new_pfn);
+			cond_resched();
+		}
+
+		new_pfn = hva_to_pfn(gpc->uhva, false, NULL, true, NULL);
+		if (is_error_noslot_pfn(new_pfn))
+			goto out_error;
+
+		if (new_pfn == gpc->pfn)
+			new_khva = old_khva;
+		else
+			new_khva = gpc_map(new_pfn);
+
+		if (!new_khva) {
+			kvm_release_pfn_clean(new_pfn);
+			goto out_error;
+		}
+
+		write_lock_irq(&gpc->lock);
+
+		/* Refreshes are serialized by refresh_lock. */
+		WARN_ON_ONCE(gpc->valid);
+	} while (gpc_invalidate_retry(gpc->kvm, mmu_seq));
+
+	gpc->valid = true;
+	gpc->pfn = new_pfn;
+	gpc->khva = new_khva + offset_in_page(gpc->gpa);
+
+	/*
+	 * From here on the MMU notifier keeps the mapping coherent, so don't
+	 * keep the page pinned; it can be migrated or swapped out like any
+	 * other page of the guest.
+	 */
+	kvm_release_pfn_clean(new_pfn);
+
+	return 0;
+
+out_error:
+	write_lock_irq(&gpc->lock);
+	return -EFAULT;
+}
+
+static int __kvm_gpc_refresh(struct gfn_to_pfn_cache *gpc, gpa_t gpa,
+			     unsigned long len)
+{
+	struct kvm_memslots *slots = kvm_memslots(gpc->kvm);
+	unsigned long page_offset = offset_in_page(gpa);
+	bool unmap_old = false;
+	unsigned long old_uhva;
+	kvm_pfn_t old_pfn;
+	void *old_khva;
+	int ret = 0;
+
+	if (page_offset + len > PAGE_SIZE)
+		return -EINVAL;
+
+	mutex_lock(&gpc->refresh_lock);
+	write_lock_irq(&gpc->lock);
+
+	if (!gpc->active) {
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+
+	old_pfn = gpc->pfn;
+	old_khva = gpc->khva - offset_in_page(gpc->khva);
+	old_uhva = gpc->uhva;
+
+	if (gpc->gpa != gpa || gpc->generation != slots->generation ||
+	    kvm_is_error_hva(gpc->uhva)) {
+		gfn_t gfn = gpa_to_gfn(gpa);
+
+		gpc->gpa = gpa;
+		gpc->generation = slots->generation;
+		gpc->memslot = __gfn_to_memslot(slots, gfn);
+		gpc->uhva = gfn_to_hva_memslot(gpc->memslot, gfn);
+		if (kvm_is_error_hva(gpc->uhva)) {
+			ret = -EFAULT;
+			goto out;
+		}
+	}
+
+	if (!gpc->valid || old_uhva != gpc->uhva) {
+		ret = gpc_map_retry(gpc);
+	} else {
+		/* Same page, only the offset may have changed. */
+		gpc->khva = old_khva + page_offset;
+		goto out_unlock;
+	}
+
+out:
+	if (ret) {
+		gpc->valid = false;
+		gpc->pfn = KVM_PFN_ERR_FAULT;
+		gpc->khva = NULL;
+	}
+
+	unmap_old = old_pfn != gpc->pfn;
+
+out_unlock:
+	write_unlock_irq(&gpc->lock);
+	mutex_unlock(&gpc->refresh_lock);
+
+	if (unmap_old)
+		gpc_unmap(old_pfn, old_khva);
+
+	return ret;
+}
+
+/**
+ * kvm_gpc_refresh() - Revalidate a gfn_to_pfn_cache after a failed check
+ * @gpc:	the cache
+ * @len:	number of bytes that will be accessed at @gpc->khva
+ *
+ * May sleep, must be called without @gpc->lock held.
+ *
+ * Return: 0 on success, -EFAULT if the gpa is not backed by a memslot or the
+ *	   page can't be faulted in, -EINVAL if the cache is not active
+ */
+int kvm_gpc_refresh(struct gfn_to_pfn_cache *gpc, unsigned long len)
+{
+	return __kvm_gpc_refresh(gpc, gpc->gpa, len);
+}
+EXPORT_SYMBOL_GPL(kvm_gpc_refresh);
+
+/**
+ * kvm_gpc_init() - Initialize a gfn_to_pfn_cache
+ * @gpc:	the cache
+ * @kvm:	the VM whose memory is mapped by @gpc
+ */
+void kvm_gpc_init(struct gfn_to_pfn_cache *gpc, struct kvm *kvm)
+{
+	rwlock_init(&gpc->lock);
+	mutex_init(&gpc->refresh_lock);
+
+	gpc->kvm = kvm;
+	gpc->pfn = KVM_PFN_ERR_FAULT;
+	gpc->uhva = KVM_HVA_ERR_BAD;
+}
+EXPORT_SYMBOL_GPL(kvm_gpc_init);
+
+/**
+ * kvm_gpc_activate() - Map a guest physical address through a cache
+ * @gpc:	the cache, initialized with kvm_gpc_init()
+ * @gpa:	the guest physical address to map
+ * @len:	number of bytes that will be accessed at @gpc->khva
+ *
+ * Add @gpc to the caches invalidated by the MMU notifier and map @gpa.  The
+ * cache stays active, and can be refreshed, until kvm_gpc_deactivate().
+ *
+ * Return: see kvm_gpc_refresh()
+ */
+int kvm_gpc_activate(struct gfn_to_pfn_cache *gpc, gpa_t gpa,
+		     unsigned long len)
+{
+	struct kvm *kvm = gpc->kvm;
+
+	if (!gpc->active) {
+		if (WARN_ON_ONCE(gpc->valid))
+			return -EINVAL;
+
+		spin_lock(&kvm->gpc_lock);
+		list_add(&gpc->list, &kvm->gpc_list);
+		spin_unlock(&kvm->gpc_lock);
+
+		/*
+		 * Only activate the cache once it can be found by the MMU
+		 * notifier, nothing may be mapped before that.
+		 */
+		write_lock_irq(&gpc->lock);
+		gpc->active = true;
+		write_unlock_irq(&gpc->lock);
+	}
+
+	return __kvm_gpc_refresh(gpc, gpa, len);
+}
+EXPORT_SYMBOL_GPL(kvm_gpc_activate);
+
+/**
+ * kvm_gpc_deactivate() - Unmap a gfn_to_pfn_cache
+ * @gpc:	the cache
+ *
+ * Unmap the page and remove @gpc from the caches invalidated by the MMU
+ * notifier.  Safe to call on a cache that is not active.
+ */
+void kvm_gpc_deactivate(struct gfn_to_pfn_cache *gpc)
+{
+	struct kvm *kvm = gpc->kvm;
+	kvm_pfn_t old_pfn;
+	void *old_khva;
+
+	mutex_lock(&gpc->refresh_lock);
+
+	if (gpc->active) {
+		write_lock_irq(&gpc->lock);
+		gpc->active = false;
+		gpc->valid = false;
+
+		old_khva = gpc->khva - offset_in_page(gpc->khva);
+		gpc->khva = NULL;
+		old_pfn = gpc->pfn;
+		gpc->pfn = KVM_PFN_ERR_FAULT;
+		write_unlock_irq(&gpc->lock);
+
+		spin_lock(&kvm->gpc_lock);
+		list_del(&gpc->list);
+		spin_unlock(&kvm->gpc_lock);
+
+		gpc_unmap(old_pfn, old_khva);
+	}
+
+	mutex_unlock(&gpc->refresh_lock);
+}
+EXPORT_SYMBOL_GPL(kvm_gpc_deactivate);